@@ -11,6 +11,31 @@
 #include "config_sys.h"
 #include "board.h"
 
+// Peripheral mask bits, which are also the handles of the reference-counted peripherals
+#define PERIPHERAL_RNG      0x00000001
+#define PERIPHERAL_RTC      0x00000002
+#define PERIPHERAL_SUBGHZ   0x00000004
+#define PERIPHERAL_ADC      0x00000008
+#define PERIPHERAL_ADCDMA   0x00000010
+#define PERIPHERAL_LPUART1  0x00000020
+#define PERIPHERAL_USART1   0x00000040
+#define PERIPHERAL_USART2   0x00000080
+#define PERIPHERAL_CRYP     0x00000100
+#define PERIPHERAL_I2C2     0x00000200
+#define PERIPHERAL_SPI1     0x00000400
+#define PERIPHERAL_SPI1DMA  0x00000800
+#define PERIPHERAL_TIM17    0x00001000
+void MY_PeripheralAcquire(uint32_t peripheral);
+
+// Hot-path code that executes from SRAM1, copied there at startup along with initialized
+// data, so that its timing depends neither on flash wait states nor on flash operations
+#if defined(__ICCARM__)
+#define RAMFUNC __ramfunc
+#else
+#define RAMFUNC __attribute__((__section__(".RamFunc"), __noinline__))
+#endif
+void MY_PeripheralRelease(uint32_t peripheral);
+
 void MX_GPIO_Init(void);
 void MX_GPIO_DeInit(void);
 void MX_DMA_Init(void);
@@ -18,8 +43,14 @@ void MX_ADC_Init(void);
 void MX_ADC_DeInit(void);
 bool MX_ADC_Values(uint16_t *wordValues, double *voltageValues, double *vref);
 double MX_ADC_A0_Voltage(void);
+bool MX_ADC_A0_Sample(void (*cb)(uint16_t millivolts));
+uint16_t MX_ADC_A0_Millivolts(void);
+void MX_ADC_SampledTask(void);
+bool MX_ADC_Stream_Start(uint32_t channel, uint16_t *buffer, uint32_t halfSamples, uint32_t sampleHz, void (*cb)(uint16_t *samples, uint32_t count));
+uint32_t MX_ADC_Stream_Stop(void);
 void MX_USART1_UART_Init(void);
 void MX_USART1_UART_Transmit(uint8_t *buf, uint32_t len, uint32_t timeoutMs);
+bool MX_USART1_UART_Receive(uint8_t *buf, uint32_t len, uint32_t timeoutMs);
 void MX_USART1_UART_DeInit(void);
 void MX_USART2_UART_Init(void);
 void MX_USART2_UART_Suspend(void);
@@ -30,19 +61,49 @@ void MX_LPUART1_UART_Init(void);
 void MX_LPUART1_UART_Suspend(void);
 void MX_LPUART1_UART_Resume(void);
 void MX_LPUART1_UART_Transmit(uint8_t *buf, uint32_t len, uint32_t timeoutMs);
+bool MX_LPUART1_UART_TransmitAsync(uint8_t *buf, uint32_t len);
 void MX_LPUART1_UART_DeInit(void);
 void MX_I2C2_Init(void);
 void MX_I2C2_DeInit(void);
+void MY_I2C2_Acquire(void);
+void MY_I2C2_Release(void);
+void MY_I2C2_Reset(void);
+void MY_I2C2_CompletedTask(void);
 void MY_ActivePeripherals(char *buf, uint32_t buflen);
 bool MY_I2C2_Ping(uint16_t i2cAddress, uint32_t timeoutMs, uint32_t attempts);
 bool MY_I2C2_ReadRegister(uint16_t i2cAddress, uint8_t Reg, void *data, uint16_t maxdatalen, uint32_t timeoutMs);
 bool MY_I2C2_WriteRegister(uint16_t i2cAddress, uint8_t Reg, void *data, uint16_t datalen, uint32_t timeoutMs);
 bool MY_I2C2_Transmit(uint16_t i2cAddress, void *data, uint16_t datalen, uint32_t timeoutMs);
 bool MY_I2C2_Receive(uint16_t i2cAddress, void *data, uint16_t maxdatalen, uint32_t timeoutMs);
+
+// An I2C2 transaction, queued by MY_I2C2_Submit() in storage owned by the caller and
+// performed by DMA in turn with every other transaction on the bus
+#define I2C2_OP_READ_REGISTER   0
+#define I2C2_OP_WRITE_REGISTER  1
+#define I2C2_OP_TRANSMIT        2
+#define I2C2_OP_RECEIVE         3
+#define I2C2_PENDING            0
+#define I2C2_ACTIVE             1
+#define I2C2_SUCCEEDED          2
+#define I2C2_FAILED             3
+typedef struct i2c2Transaction_s {
+    struct i2c2Transaction_s *next;
+    uint16_t address;
+    uint8_t op;
+    uint8_t reg;
+    uint8_t *data;
+    uint16_t len;
+    volatile uint8_t status;
+    void (*done)(struct i2c2Transaction_s *t);  // Called from a task, or NULL if polled
+    void *context;
+} i2c2Transaction;
+void MY_I2C2_Submit(i2c2Transaction *t);
 void MX_SPI1_Init(void);
 void MX_SPI1_DeInit(void);
 void MX_SUBGHZ_Init(void);
 void MX_SUBGHZ_DeInit(void);
+HAL_StatusTypeDef MX_SUBGHZ_WriteBuffer(SUBGHZ_HandleTypeDef *hsubghz, uint8_t offset, uint8_t *buffer, uint16_t size);
+HAL_StatusTypeDef MX_SUBGHZ_ReadBuffer(SUBGHZ_HandleTypeDef *hsubghz, uint8_t offset, uint8_t *buffer, uint16_t size);
 void MX_RNG_Init(void);
 void MX_RNG_DeInit(void);
 void MX_AES_Init(void);
@@ -54,6 +115,8 @@ void MX_DBG_Suspend(void);
 void MX_DBG_Resume(void);
 void MX_DBG_RxCallback(void (*cb)(uint8_t *rxChar, uint16_t size, uint8_t error));
 void MX_DBG(const char *msg, size_t len, uint32_t timeout);
+bool MX_DBG_Async(const char *msg, size_t len);
+bool MX_DBG_Drain(uint32_t timeoutMs);
 void MX_DBG_Disable(void);
 void MX_DBG_Enable(void);
 bool MX_DBG_Enabled(void);
@@ -62,19 +125,34 @@ bool MX_DBG_Available(void);
 void MX_DBG_TxCpltCallback(void (*cb)(void *));
 uint8_t MX_DBG_Receive(bool *underrun, bool *overrun);
 void MX_TIM17_DelayUs(uint32_t us);
+void MX_ClockBoost(void);
+void MX_ClockRelax(void);
 #define HAL_DelayUs(us) MX_TIM17_DelayUs(us)
 
 uint32_t MX_Image_Size(void);
 #define MX_Image_Pages() (((MX_Image_Size()%FLASH_PAGE_SIZE)==0)?(MX_Image_Size()/FLASH_PAGE_SIZE):((MX_Image_Size()/FLASH_PAGE_SIZE)+1))
 uint32_t MX_Heap_Size(uint8_t **base);
+void MX_Heap_Usage(uint32_t *highWater, uint32_t *freeBytes, uint32_t *largest);
+void MX_Stack_Paint(void);
+uint32_t MX_Stack_HighWater(uint32_t *size);
 
 void MX_Breakpoint(void);
 void MX_AppMain(void);
 void MX_UTIL_Init(void);
 void MX_AppISR(uint16_t GPIO_Pin);
 uint32_t MX_RNG_Get(void);
+uint32_t MY_Random(void);
+void MY_RandomRefill(void);
+bool MY_RandomRefillDue(void);
 bool MX_AES_CTR_Encrypt(uint8_t *key, uint8_t *plaintext, uint16_t len, uint8_t *ciphertext);
 bool MX_AES_CTR_Decrypt(uint8_t *key, uint8_t *ciphertext, uint16_t len, uint8_t *plaintext);
+bool MX_AES_CTR_Start(uint8_t *key, uint8_t *input, uint16_t len, uint8_t *output);
+bool MX_AES_CTR_StartInPlace(uint8_t *key, uint8_t *buf, uint16_t len, uint16_t bufSize);
+bool MX_AES_CTR_Wait(void);
+void MX_AES_CTR_SessionEnd(void);
+#define AES_CCM_NONCE_BYTES 13
+bool MX_AES_CCM_Encrypt(uint8_t *key, uint8_t *nonce, uint8_t *aad, uint16_t aadLen, uint8_t *plaintext, uint16_t len, uint8_t *ciphertext, uint8_t *tag, uint16_t tagLen);
+bool MX_AES_CCM_Decrypt(uint8_t *key, uint8_t *nonce, uint8_t *aad, uint16_t aadLen, uint8_t *ciphertext, uint16_t len, uint8_t *plaintext, uint8_t *tag, uint16_t tagLen);
 
 void Error_Handler(void);
 
@@ -83,3 +161,5 @@ extern SUBGHZ_HandleTypeDef hsubghz;
 extern UART_HandleTypeDef huart2;
 extern UART_HandleTypeDef hlpuart1;
 extern DMA_HandleTypeDef hdma_usart2_tx;
+extern DMA_HandleTypeDef hdma_aes_in;
+extern DMA_HandleTypeDef hdma_aes_out;
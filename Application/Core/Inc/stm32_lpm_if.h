@@ -5,11 +5,27 @@
 // Low Power Manager interface configuration
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include "stm32_lpm.h"
 
+// Residency, which is the RTC ticks spent in each mode, and what woke the processor
+#define PWR_MODE_RUN        0
+#define PWR_MODE_SLEEP      1
+#define PWR_MODE_STOP2      2
+#define PWR_MODE_OFF        3
+#define PWR_MODES           4
+#define PWR_WAKE_RTC        0
+#define PWR_WAKE_EXTI       1
+#define PWR_WAKE_RADIO      2
+#define PWR_WAKE_UART       3
+#define PWR_WAKE_OTHER      4
+#define PWR_WAKES           5
+
 void PWR_EnterOffMode(void);
 void PWR_ExitOffMode(void);
 void PWR_EnterStopMode(void);
 void PWR_ExitStopMode(void);
 void PWR_EnterSleepMode(void);
 void PWR_ExitSleepMode(void);
+void PWR_Residency(uint32_t *ticks, uint32_t *wakes, bool reset);
@@ -65,6 +65,12 @@
   */
 #define UTIL_SEQ_MEMSET8( dest, value, size )   UTIL_MEM_set_8( dest, value, size )
 
+/**
+  * Number of sequencer priorities, one for each stage of the application
+  */
+#include "utilities_def.h"
+#define UTIL_SEQ_CONF_PRIO_NBR                  CFG_SEQ_Prio_NBR
+
 /**
   * macro used to initialize the critical section
   */
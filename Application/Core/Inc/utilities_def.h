@@ -13,6 +13,8 @@ typedef enum {
     CFG_LPM_APPLI_Id,
     CFG_LPM_UART_TX_Id,
     CFG_LPM_TCXO_WA_Id,
+    CFG_LPM_IDLE_Id,
+    CFG_LPM_ADC_Id,
 
 } CFG_LPM_Id_t;
 
@@ -22,14 +24,33 @@ typedef enum {
 // Each Id shall be in the range 0..31
 typedef enum {
     CFG_SEQ_Prio_0,
+    CFG_SEQ_Prio_1,
+    CFG_SEQ_Prio_2,
+    CFG_SEQ_Prio_3,
 
     CFG_SEQ_Prio_NBR,
 } CFG_SEQ_Prio_Id_t;
 
+// Stages of the application, from the highest priority to the lowest.  The sequencer
+// always runs the highest pending task next, so a radio frame waits at most for the
+// task that was running when it arrived.
+#define CFG_SEQ_Prio_Radio          CFG_SEQ_Prio_0  // Received frames and the state machine that answers them
+#define CFG_SEQ_Prio_Event          CFG_SEQ_Prio_1  // Timer and button events, and trace output
+#define CFG_SEQ_Prio_Notecard       CFG_SEQ_Prio_2  // Notecard requests and housekeeping
+#define CFG_SEQ_Prio_Console        CFG_SEQ_Prio_3  // Console input
+
 // This is the list of task id required by the application
 // Each Id shall be in the range 0..31
 typedef enum {
     CFG_SEQ_Task_Sparrow_Process,
+    CFG_SEQ_Task_Sparrow_Event,
+    CFG_SEQ_Task_Notecard_Process,
+    CFG_SEQ_Task_Log_Drain,
+    CFG_SEQ_Task_ADC_Sampled,
+    CFG_SEQ_Task_I2C2_Completed,
+    CFG_SEQ_Task_Radio_Received,
+    CFG_SEQ_Task_Console,
+    CFG_SEQ_Task_Housekeeping,
 
     CFG_SEQ_Task_NBR
 } CFG_SEQ_Task_Id_t;
@@ -69,6 +69,12 @@
 #define RADIO_INIT                              MX_SUBGHZ_Init
 #define RADIO_DEINIT                            MX_SUBGHZ_DeInit
 
+// Radio buffer transfers, by DMA rather than byte-by-byte
+#if SUBGHZ_DMA
+#define HAL_SUBGHZ_WriteBuffer                  MX_SUBGHZ_WriteBuffer
+#define HAL_SUBGHZ_ReadBuffer                   MX_SUBGHZ_ReadBuffer
+#endif
+
 // Delay interface to radio Middleware
 #define RADIO_DELAY_MS                          HAL_Delay
 
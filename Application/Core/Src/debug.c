@@ -81,6 +81,30 @@ void MX_DBG(const char *message, size_t length, uint32_t timeout)
 
 }
 
+// Begin output of trace to the console, returning false if it must instead be sent with
+// MX_DBG().  If true, the message is in use until the transmit complete callback.
+bool MX_DBG_Async(const char *message, size_t length)
+{
+#if DEBUGGER_ON_LPUART1 && DEBUGGER_LPUART1_STOP2
+    return MX_LPUART1_UART_TransmitAsync((uint8_t *)message, length);
+#else
+    return false;
+#endif
+}
+
+// Wait for up to the timeout for the trace that has been queued to be sent, returning true if
+// it has been, which is needed only before something that would cut it off such as a restart
+bool MX_DBG_Drain(uint32_t timeoutMs)
+{
+    for (uint32_t i=0; i<timeoutMs; i++) {
+        if (UTIL_ADV_TRACE_IsBufferEmpty()) {
+            return true;
+        }
+        HAL_Delay(1);
+    }
+    return UTIL_ADV_TRACE_IsBufferEmpty();
+}
+
 // Prepare for going into stop2 mode
 void MX_DBG_Suspend()
 {
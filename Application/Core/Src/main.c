@@ -2,10 +2,19 @@
 // Use of this source code is governed by licenses granted by the
 // copyright holder including that found in the LICENSE file.
 
+#include <stdlib.h>
+#if !defined( __ICCARM__ )
+#include <malloc.h>
+#endif
 #include "main.h"
 #include "stm32wlxx_hal_cryp.h"
 #include "stm32wlxx_hal_rng.h"
 #include "stm32wlxx_ll_lpuart.h"
+#include "stm32_seq.h"
+#include "stm32_lpm.h"
+#include "stm32_timer.h"
+#include "stm32_mem.h"
+#include "utilities_def.h"
 
 // HAL data
 RNG_HandleTypeDef hrng;
@@ -21,14 +30,26 @@ DMA_HandleTypeDef hdma_usart1_tx;
 DMA_HandleTypeDef hdma_usart2_rx;
 DMA_HandleTypeDef hdma_usart2_tx;
 CRYP_HandleTypeDef hcryp;
+DMA_HandleTypeDef hdma_aes_in;
+DMA_HandleTypeDef hdma_aes_out;
 I2C_HandleTypeDef hi2c2;
 DMA_HandleTypeDef hdma_i2c2_rx;
 DMA_HandleTypeDef hdma_i2c2_tx;
 SPI_HandleTypeDef hspi1;
 DMA_HandleTypeDef hdma_spi1_rx;
 DMA_HandleTypeDef hdma_spi1_tx;
+DMA_HandleTypeDef hdma_subghzspi_rx;
+DMA_HandleTypeDef hdma_subghzspi_tx;
 TIM_HandleTypeDef htim17;
-uint32_t i2c2IOCompletions = 0;
+TIM_HandleTypeDef htim2;
+
+// I2C2 bus manager.  The bus is powered by the peripheral manager while it has users, and
+// its transactions are queued so that each is started by DMA from the completion of the
+// one before.
+static i2c2Transaction *i2c2Queue = NULL;
+static i2c2Transaction *i2c2QueueTail = NULL;
+static i2c2Transaction *i2c2Completed = NULL;
+static i2c2Transaction *i2c2CompletedTail = NULL;
 
 // ADC buffer
 #if defined ( __ICCARM__ ) /* IAR Compiler */
@@ -39,24 +60,64 @@ __align(8)
 __attribute__ ((aligned (8)))
 #endif
 uint16_t adcValues[ADC_TOTAL] = {0};
-bool adcDMACompleted = false;
+volatile bool adcDMACompleted = false;
+
+// ADC calibration factor, measured once and restored whenever the ADC is re-enabled
+static bool adcCalibrated = false;
+static uint32_t adcCalibrationFactor = 0;
+
+// Asynchronous battery sampling
+static volatile bool adcSampling = false;
+static bool adcSampleLedWasEnabled = false;
+static void (*adcSampleCallback)(uint16_t millivolts) = NULL;
+static uint16_t adcA0Millivolts = 0;
+static UTIL_TIMER_Object_t adcSettleTimer;
+static bool adcSettleTimerCreated = false;
+
+// Streaming of a single channel into a circular DMA buffer, paced by ADC_STREAM_TIM, whose
+// halves are handed in turn to the callback from the sequencer while the DMA fills the other.
+// The flags are the halves that have filled and not yet been handed over, and a half that
+// fills again before it has been is counted as an overrun.
+static volatile bool adcStreaming = false;
+static uint16_t *adcStreamBuffer = NULL;
+static uint32_t adcStreamHalfSamples = 0;
+static void (*adcStreamCallback)(uint16_t *samples, uint32_t count) = NULL;
+static volatile uint32_t adcStreamHalvesFilled = 0;
+static volatile uint32_t adcStreamOverruns = 0;
 
 // Peripheral mask, so we can easily tell what is enabled and what is not
-#define PERIPHERAL_RNG      0x00000001
-#define PERIPHERAL_RTC      0x00000002
-#define PERIPHERAL_SUBGHZ   0x00000004
-#define PERIPHERAL_ADC      0x00000008
-#define PERIPHERAL_ADCDMA   0x00000010
-#define PERIPHERAL_LPUART1  0x00000020
-#define PERIPHERAL_USART1   0x00000040
-#define PERIPHERAL_USART2   0x00000080
-#define PERIPHERAL_CRYP     0x00000100
-#define PERIPHERAL_I2C2     0x00000200
-#define PERIPHERAL_SPI1     0x00000400
-#define PERIPHERAL_SPI1DMA  0x00000800
-#define PERIPHERAL_TIM17    0x00001000
 uint32_t peripherals = 0;
 
+// Reference-counted peripherals, each initialized for its first user and deinitialized once
+// it has been idle for PERIPHERAL_IDLE_MS.  Whether one is actually initialized is always
+// taken from the peripheral mask, so a direct deinit (as after an error) is simply undone
+// by the next acquire.
+typedef struct {
+    uint32_t peripheral;
+    void (*init)(void);
+    void (*deinit)(void);
+    uint16_t users;
+    uint32_t idleSinceMs;
+} managedPeripheral;
+static managedPeripheral managedPeripherals[] = {
+    {PERIPHERAL_RNG, MX_RNG_Init, MX_RNG_DeInit, 0, 0},
+    {PERIPHERAL_CRYP, MX_AES_Init, MX_AES_DeInit, 0, 0},
+    {PERIPHERAL_I2C2, MX_I2C2_Init, MX_I2C2_DeInit, 0, 0},
+};
+#define MANAGED_PERIPHERALS (sizeof(managedPeripherals)/sizeof(managedPeripherals[0]))
+static UTIL_TIMER_Object_t peripheralIdleTimer;
+static bool peripheralIdleTimerCreated = false;
+
+// Entropy pool
+static uint32_t rngPool[RNG_POOL_WORDS];
+static uint32_t rngPoolCount = 0;
+
+// Clock governor, counting the callers that currently need full speed
+#define MSI_FAST_MHZ        48                              // RCC_MSIRANGE_11
+#define MSI_SLOW_MHZ        16                              // RCC_MSIRANGE_8
+static uint32_t clockMHz = MSI_FAST_MHZ;
+static uint32_t clockBoosts = 0;
+
 // RTC
 #define BASEYEAR 2000   // Must end in 00 because of the chip's leap year computations
 
@@ -66,11 +127,37 @@ __ALIGN_BEGIN static uint32_t keyAES[8] __ALIGN_END = {
 };
 __ALIGN_BEGIN static uint32_t AESIV_CTR[4] __ALIGN_END = {0xF0F1F2F3, 0xF4F5F6F7, 0xF8F9FAFB, 0xFCFDFEFF};
 
+// AES session.  The session holds a reference to the peripheral from the first
+// encrypt/decrypt until MX_AES_CTR_SessionEnd(), and because the HAL is told to reload the key and IV on every
+// operation, switching peers only requires changing keyAES.  The DMA engine only moves
+// whole 16-byte blocks, so messages are staged through block-padded buffers; because
+// this is CTR mode the keystream for the padding is simply discarded.  A message encrypted
+// in place within a buffer that has room for its whole blocks needs no staging at all.
+#define AES_DMA_MAX_BYTES   256
+__ALIGN_BEGIN static uint32_t aesDMAIn[AES_DMA_MAX_BYTES/sizeof(uint32_t)] __ALIGN_END;
+__ALIGN_BEGIN static uint32_t aesDMAOut[AES_DMA_MAX_BYTES/sizeof(uint32_t)] __ALIGN_END;
+static bool aesSessionActive = false;
+static volatile bool aesDMACompleted = false;
+static volatile bool aesDMAFailed = false;
+static uint8_t *aesDMAOutput = NULL;
+static uint16_t aesDMAOutputLen = 0;
+static bool aesDMADirect = false;
+
+// AES CCM, which is performed synchronously through the same staging buffers.  The peripheral
+// leaves the formatting of the B0 block and of the header to software, so that is done here
+// as NIST SP 800-38C requires, with a 13-byte nonce and thus a 2-byte payload length.
+#define AES_CCM_MAX_AAD_BYTES   30
+__ALIGN_BEGIN static uint32_t aesCCMB0[4] __ALIGN_END;
+__ALIGN_BEGIN static uint32_t aesCCMHeader[(AES_CCM_MAX_AAD_BYTES+2)/sizeof(uint32_t)] __ALIGN_END;
+__ALIGN_BEGIN static uint32_t aesCCMTag[4] __ALIGN_END;
+
 // Linker-related symbols
 #if defined( __ICCARM__ )   // IAR
 extern void *ROM_CONTENT$$Limit;
 extern void *HEAP$$Base;
 extern void *HEAP$$Limit;
+extern void *CSTACK$$Base;
+extern void *CSTACK$$Limit;
 #else                       // STM32CubeIDE (gcc)
 extern void *_highest_used_rom;
 extern void *_end;
@@ -99,12 +186,35 @@ static uint8_t vector_t[VECTOR_TABLE_SIZE_BYTES];
 void SystemClock_Config(void);
 static void MX_TIM17_Init(void);
 double calibrateVoltage(double v);
+static void i2c2Start(void);
+static void i2c2Retire(bool success);
+static void i2c2Complete(bool success);
+static bool i2c2Transact(uint8_t op, uint16_t i2cAddress, uint8_t reg, void *data, uint16_t len, uint32_t timeoutMs);
+static bool adcStartConversion(void);
+static void adcFinishConversion(void);
+static void adcEnable(void);
+static void adcStreamHalfFilled(uint32_t half);
+static void adcSettleEvent(void *context);
+static void clockSet(bool fast);
+static HAL_StatusTypeDef subghzBufferTransfer(SUBGHZ_HandleTypeDef *hsubghz, uint8_t opcode, uint8_t offset, uint8_t *buffer, uint16_t size, bool read);
+
+// SUBGHZ HAL internals, which are exported but not declared in its header
+HAL_StatusTypeDef SUBGHZSPI_Transmit(SUBGHZ_HandleTypeDef *hsubghz, uint8_t Data);
+HAL_StatusTypeDef SUBGHZSPI_Receive(SUBGHZ_HandleTypeDef *hsubghz, uint8_t *pData);
+HAL_StatusTypeDef SUBGHZ_WaitOnBusy(SUBGHZ_HandleTypeDef *hsubghz);
+HAL_StatusTypeDef SUBGHZ_CheckDeviceReady(SUBGHZ_HandleTypeDef *hsubghz);
+static managedPeripheral *peripheralFind(uint32_t peripheral);
+static void peripheralIdleEvent(void *context);
+static void peripheralName(char *buf, uint32_t buflen, uint32_t peripheral, const char *name);
 size_t strlcat(char *dst, const char *src, size_t siz);
 
 // Main entry point
 int main(void)
 {
 
+    // Paint the stack before anything has used it deeply
+    MX_Stack_Paint();
+
     // Copy the vectors
     memcpy(vector_t, (uint8_t *) FLASH_BASE, sizeof(vector_t));
     SCB->VTOR = (uint32_t) vector_t;
@@ -151,8 +261,12 @@ void SystemClock_Config(void)
     RCC_OscInitStruct.LSEState = RCC_LSE_ON;
     RCC_OscInitStruct.MSIState = RCC_MSI_ON;
     RCC_OscInitStruct.MSICalibrationValue = RCC_MSICALIBRATION_DEFAULT;
-#define MSI_FREQUENCY_MHZ   48                              // 48Mhz
     RCC_OscInitStruct.MSIClockRange = RCC_MSIRANGE_11;      // 48Mhz
+#if CLOCK_GOVERNOR
+    RCC_OscInitStruct.OscillatorType |= RCC_OSCILLATORTYPE_HSI;
+    RCC_OscInitStruct.HSIState = RCC_HSI_ON;
+    RCC_OscInitStruct.HSICalibrationValue = RCC_HSICALIBRATION_DEFAULT;
+#endif
     RCC_OscInitStruct.LSIDiv = RCC_LSI_DIV1;
     RCC_OscInitStruct.LSIState = RCC_LSI_ON;
     RCC_OscInitStruct.PLL.PLLState = RCC_PLL_NONE;
@@ -176,6 +290,55 @@ void SystemClock_Config(void)
     // Ensure that MSI is wake-up system clock
     __HAL_RCC_WAKEUPSTOP_CLK_CONFIG(RCC_STOP_WAKEUPCLOCK_MSI);
 
+    // Drop to the low-power clock until something asks for full speed
+#if CLOCK_GOVERNOR
+    clockSet(false);
+#endif
+
+}
+
+// Switch the MSI range that is the system clock.  Scale 2 is limited to 16Mhz, so the
+// range is lowered before the voltage and the voltage is raised before the range.  Flash
+// latency stays at the 2 wait states that both configurations require.
+static void clockSet(bool fast)
+{
+    if (fast) {
+        HAL_PWREx_ControlVoltageScaling(PWR_REGULATOR_VOLTAGE_SCALE1);
+        __HAL_RCC_MSI_RANGE_CONFIG(RCC_MSIRANGE_11);
+        clockMHz = MSI_FAST_MHZ;
+    } else {
+        __HAL_RCC_MSI_RANGE_CONFIG(RCC_MSIRANGE_8);
+        clockMHz = MSI_SLOW_MHZ;
+        HAL_PWREx_ControlVoltageScaling(PWR_REGULATOR_VOLTAGE_SCALE2);
+    }
+    SystemCoreClock = clockMHz * 1000000;
+}
+
+// Run at full speed until the matching MX_ClockRelax().  These nest, and may be called
+// from ISRs.
+void MX_ClockBoost(void)
+{
+#if CLOCK_GOVERNOR
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (clockBoosts++ == 0) {
+        clockSet(true);
+    }
+    __set_PRIMASK(primask);
+#endif
+}
+
+// Release a boost, returning to the low-power clock when no boosts remain
+void MX_ClockRelax(void)
+{
+#if CLOCK_GOVERNOR
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (clockBoosts > 0 && --clockBoosts == 0) {
+        clockSet(false);
+    }
+    __set_PRIMASK(primask);
+#endif
 }
 
 // Initialize for GPIO
@@ -247,7 +410,7 @@ void MX_ADC_Init(void)
     hadc.Init.LowPowerAutoPowerOff = DISABLE;
     hadc.Init.ContinuousConvMode = DISABLE;
     hadc.Init.NbrOfConversion = ADC_TOTAL;
-    hadc.Init.DiscontinuousConvMode = ENABLE;
+    hadc.Init.DiscontinuousConvMode = DISABLE;
     hadc.Init.ExternalTrigConv = ADC_SOFTWARE_START;
     hadc.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_NONE;
     hadc.Init.DMAContinuousRequests = DISABLE;
@@ -311,36 +474,75 @@ void MX_ADC_DeInit(void)
     HAL_ADC_DeInit(&hadc);
 }
 
-// Return ADC_COUNT words of values assuming that they're all voltages
-bool MX_ADC_Values(uint16_t *wordValues, double *voltageValues, double *vref)
+// Init the ADC, enable it with its calibration factor, and start a single DMA conversion of
+// the whole sequence.  Calibration is only performed the first time because the factor can
+// simply be restored after the deinit that follows each conversion.
+static bool adcStartConversion(void)
 {
 
-    // Init ADC
+    // Init and enable the ADC
     MX_ADC_Init();
+    adcEnable();
 
-    // Calibrate
-    HAL_ADCEx_Calibration_Start(&hadc);
-
-    // Start DMA
+    // Start DMA, which converts the entire sequence from a single software trigger
     adcDMACompleted = false;
     memset(adcValues, 0xff, sizeof(adcValues));
-    HAL_ADC_Start_DMA(&hadc, (uint32_t *) adcValues, ADC_TOTAL);
-
-    // Perform ADC Conversion, aborting if there is a conversion error
-    // because we will lose track of the sequencer position
-    for (int i=0; i<250 && !adcDMACompleted; i++) {
-        HAL_ADC_Start(&hadc);
-        HAL_Delay(10);
+    if (HAL_ADC_Start_DMA(&hadc, (uint32_t *) adcValues, ADC_TOTAL) != HAL_OK) {
+        MX_ADC_DeInit();
+        return false;
     }
+    return true;
 
-    // Stop ADC
-    HAL_ADC_Stop(&hadc);
+}
+
+// Calibrate the ADC the first time, and otherwise enable it and restore the calibration
+static void adcEnable(void)
+{
+    if (!adcCalibrated) {
+        if (HAL_ADCEx_Calibration_Start(&hadc) == HAL_OK) {
+            adcCalibrationFactor = HAL_ADCEx_Calibration_GetValue(&hadc);
+            adcCalibrated = true;
+        }
+    } else {
+        LL_ADC_ClearFlag_ADRDY(hadc.Instance);
+        LL_ADC_Enable(hadc.Instance);
+        uint32_t beganMs = HAL_GetTick();
+        while (LL_ADC_IsActiveFlag_ADRDY(hadc.Instance) == 0) {
+            if (HAL_GetTick() - beganMs > ADC_TIMEOUT_MS) {
+                break;
+            }
+        }
+        HAL_ADCEx_Calibration_SetValue(&hadc, adcCalibrationFactor);
+    }
+}
 
-    // Deinit ADC
+// Stop and deinit the ADC after a conversion
+static void adcFinishConversion(void)
+{
+    HAL_ADC_Stop_DMA(&hadc);
     MX_ADC_DeInit();
+}
+
+// Return ADC_COUNT words of values assuming that they're all voltages
+bool MX_ADC_Values(uint16_t *wordValues, double *voltageValues, double *vref)
+{
+
+    // The ADC is in use by an asynchronous sample or a stream
+    if (adcSampling || adcStreaming) {
+        return false;
+    }
+
+    // Perform the conversion, which takes far less than a millisecond
+    if (!adcStartConversion()) {
+        return false;
+    }
+    uint32_t beganMs = HAL_GetTick();
+    while (!adcDMACompleted && (HAL_GetTick() - beganMs) <= ADC_TIMEOUT_MS) ;
+    adcFinishConversion();
 
     // Exit if error
     if (!adcDMACompleted) {
+        return false;
     }
 
     // Calculate vrefint voltage, knowing that vrefint is the first
@@ -369,12 +571,112 @@ bool MX_ADC_Values(uint16_t *wordValues, double *voltageValues, double *vref)
 // Conversion complete callback in non blocking mode
 void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef *hadc)
 {
+    if (adcStreaming) {
+        adcStreamHalfFilled(1);
+        return;
+    }
     adcDMACompleted = true;
+    if (adcSampling) {
+        UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_ADC_Sampled), CFG_SEQ_Prio_Radio);
+    }
 }
 
 // Conversion DMA half-transfer callback in non blocking mode
 void HAL_ADC_ConvHalfCpltCallback(ADC_HandleTypeDef *hadc)
 {
+    if (adcStreaming) {
+        adcStreamHalfFilled(0);
+    }
+}
+
+// Note that a half of the stream's buffer has filled, and have the sequencer hand it over
+static void adcStreamHalfFilled(uint32_t half)
+{
+    if ((adcStreamHalvesFilled & (1 << half)) != 0) {
+        adcStreamOverruns++;
+    }
+    adcStreamHalvesFilled |= (1 << half);
+    UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_ADC_Sampled), CFG_SEQ_Prio_Radio);
+}
+
+// Begin streaming a channel at the given rate into a buffer of twice halfSamples, calling back
+// from the sequencer with each half as it fills until MX_ADC_Stream_Stop(), which the callback
+// may itself call.  The clock is held at full speed and STOP2 is held off while streaming, so
+// that the pace is steady.  Returns false if the ADC is in use.
+bool MX_ADC_Stream_Start(uint32_t channel, uint16_t *buffer, uint32_t halfSamples, uint32_t sampleHz, void (*cb)(uint16_t *samples, uint32_t count))
+{
+    if (adcSampling || adcStreaming || halfSamples == 0 || sampleHz == 0) {
+        return false;
+    }
+    MX_ClockBoost();
+    UTIL_LPM_SetStopMode((1 << CFG_LPM_ADC_Id), UTIL_LPM_DISABLE);
+
+    // A single channel, converted on each update of the pacing timer
+    MX_ADC_Init();
+    hadc.Init.ScanConvMode = ADC_SCAN_DISABLE;
+    hadc.Init.NbrOfConversion = 1;
+    hadc.Init.ExternalTrigConv = ADC_STREAM_TRIGGER;
+    hadc.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_RISING;
+    hadc.Init.DMAContinuousRequests = ENABLE;
+    ADC_ChannelConfTypeDef sConfig = {0};
+    sConfig.Channel = channel;
+    sConfig.Rank = ADC_REGULAR_RANK_1;
+    sConfig.SamplingTime = ADC_SAMPLINGTIME_COMMON_2;
+    if (HAL_ADC_Init(&hadc) != HAL_OK || HAL_ADC_ConfigChannel(&hadc, &sConfig) != HAL_OK) {
+        MX_ADC_DeInit();
+        UTIL_LPM_SetStopMode((1 << CFG_LPM_ADC_Id), UTIL_LPM_ENABLE);
+        MX_ClockRelax();
+        return false;
+    }
+    adcEnable();
+
+    // The pacing timer counts microseconds
+    htim2.Instance = ADC_STREAM_TIM;
+    htim2.Init.Prescaler = (SystemCoreClock / 1000000) - 1;
+    htim2.Init.CounterMode = TIM_COUNTERMODE_UP;
+    htim2.Init.Period = (1000000 / sampleHz) - 1;
+    htim2.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+    htim2.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+    TIM_MasterConfigTypeDef master = {0};
+    master.MasterOutputTrigger = TIM_TRGO_UPDATE;
+    master.MasterSlaveMode = TIM_MASTERSLAVEMODE_DISABLE;
+    if (HAL_TIM_Base_Init(&htim2) != HAL_OK || HAL_TIMEx_MasterConfigSynchronization(&htim2, &master) != HAL_OK) {
+        MX_ADC_DeInit();
+        UTIL_LPM_SetStopMode((1 << CFG_LPM_ADC_Id), UTIL_LPM_ENABLE);
+        MX_ClockRelax();
+        return false;
+    }
+
+    // Start converting into the circular buffer, and then start the pace
+    adcStreamBuffer = buffer;
+    adcStreamHalfSamples = halfSamples;
+    adcStreamCallback = cb;
+    adcStreamHalvesFilled = 0;
+    adcStreamOverruns = 0;
+    adcStreaming = true;
+    if (HAL_ADC_Start_DMA(&hadc, (uint32_t *) buffer, halfSamples * 2) != HAL_OK) {
+        MX_ADC_Stream_Stop();
+        return false;
+    }
+    HAL_TIM_Base_Start(&htim2);
+    return true;
+}
+
+// Stop streaming, returning the number of halves that were overrun
+uint32_t MX_ADC_Stream_Stop(void)
+{
+    if (!adcStreaming) {
+        return 0;
+    }
+    HAL_TIM_Base_Stop(&htim2);
+    HAL_TIM_Base_DeInit(&htim2);
+    HAL_ADC_Stop_DMA(&hadc);
+    MX_ADC_DeInit();
+    adcStreaming = false;
+    adcStreamHalvesFilled = 0;
+    UTIL_LPM_SetStopMode((1 << CFG_LPM_ADC_Id), UTIL_LPM_ENABLE);
+    MX_ClockRelax();
+    return adcStreamOverruns;
 }
 
 // ADC error callback in non blocking mode
@@ -418,8 +720,12 @@ double MX_ADC_A0_Voltage()
     // Measure the voltage
     double voltage = 0.0;
     double voltageValues[ADC_COUNT];
+    if (!ledWasEnabled) {
+        HAL_Delay(BATMON_SETTLE_MS);
+    }
     if (MX_ADC_Values(NULL, voltageValues, NULL)) {
         voltage = calibrateVoltage(voltageValues[0]);
+        adcA0Millivolts = (uint16_t) (voltage * 1000.0);
     }
 
     if (!ledWasEnabled) {
@@ -432,6 +738,84 @@ double MX_ADC_A0_Voltage()
 #endif
 }
 
+// Begin an asynchronous sample of the A0 voltage, calling back with the result in
+// millivolts, or 0 if it failed.  The BAT MON settles on a timer during which we may sleep,
+// and STOP2 is only held off during the conversion itself.  Returns false if a sample is
+// already in progress or if there is no battery monitor.
+bool MX_ADC_A0_Sample(void (*cb)(uint16_t millivolts))
+{
+#if defined(USE_SPARROW) && defined(USE_LED_TX)
+    if (adcSampling || adcStreaming) {
+        return false;
+    }
+    if (!adcSettleTimerCreated) {
+        UTIL_TIMER_Create(&adcSettleTimer, 0xFFFFFFFFU, UTIL_TIMER_ONESHOT, adcSettleEvent, NULL);
+        adcSettleTimerCreated = true;
+    }
+    adcSampling = true;
+    adcSampleCallback = cb;
+    adcSampleLedWasEnabled = (LED_TX_ON == HAL_GPIO_ReadPin(LED_TX_GPIO_Port, LED_TX_Pin));
+    HAL_GPIO_WritePin(LED_TX_GPIO_Port, LED_TX_Pin, LED_TX_ON);
+    UTIL_TIMER_SetPeriod(&adcSettleTimer, BATMON_SETTLE_MS);
+    UTIL_TIMER_Start(&adcSettleTimer);
+    return true;
+#else
+    return false;
+#endif
+}
+
+// The BAT MON has settled, so start the conversion
+static void adcSettleEvent(void *context)
+{
+    UTIL_LPM_SetStopMode((1 << CFG_LPM_ADC_Id), UTIL_LPM_DISABLE);
+    if (!adcStartConversion()) {
+        adcDMACompleted = false;
+        UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_ADC_Sampled), CFG_SEQ_Prio_Radio);
+    }
+}
+
+// Sequencer task that completes an asynchronous sample, or hands over the halves of a stream
+// that have filled, outside of the DMA interrupt
+void MX_ADC_SampledTask(void)
+{
+    while (adcStreaming && adcStreamHalvesFilled != 0) {
+        uint32_t half = ((adcStreamHalvesFilled & 1) != 0) ? 0 : 1;
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        adcStreamHalvesFilled &= ~(1 << half);
+        __set_PRIMASK(primask);
+        if (adcStreamCallback != NULL) {
+            adcStreamCallback(&adcStreamBuffer[half * adcStreamHalfSamples], adcStreamHalfSamples);
+        }
+    }
+#if defined(USE_SPARROW) && defined(USE_LED_TX)
+    if (!adcSampling) {
+        return;
+    }
+    uint16_t millivolts = 0;
+    if (adcDMACompleted) {
+        adcFinishConversion();
+        double v = __LL_ADC_CALC_DATA_TO_VOLTAGE(VDDA_APPLI, adcValues[A0_ADC_RankIndex], LL_ADC_RESOLUTION_12B);
+        millivolts = (uint16_t) (calibrateVoltage(((double) v) / 1000) * 1000.0);
+        adcA0Millivolts = millivolts;
+    }
+    if (!adcSampleLedWasEnabled) {
+        HAL_GPIO_WritePin(LED_TX_GPIO_Port, LED_TX_Pin, LED_TX_OFF);
+    }
+    UTIL_LPM_SetStopMode((1 << CFG_LPM_ADC_Id), UTIL_LPM_ENABLE);
+    adcSampling = false;
+    if (adcSampleCallback != NULL) {
+        adcSampleCallback(millivolts);
+    }
+#endif
+}
+
+// The most recently sampled A0 voltage in millivolts, or 0 if none has been taken
+uint16_t MX_ADC_A0_Millivolts(void)
+{
+    return adcA0Millivolts;
+}
+
 // Init I2C2
 void MX_I2C2_Init(void)
 {
@@ -444,7 +828,23 @@ void MX_I2C2_Init(void)
 
     // Configure I2C
     hi2c2.Instance = I2C2;
+#if CLOCK_GOVERNOR
+#if NOTECARD_I2C_KHZ >= 1000
+    hi2c2.Init.Timing = 0x00200204;     // 1MHz from HSI16
+#elif NOTECARD_I2C_KHZ >= 400
+    hi2c2.Init.Timing = 0x10320309;     // 400kHz from HSI16
+#else
+    hi2c2.Init.Timing = 0x10A02817;     // 100kHz, the tuning below re-derived for HSI16
+#endif
+#else
+#if NOTECARD_I2C_KHZ >= 1000
+    hi2c2.Init.Timing = 0x50100103;     // 1MHz from PCLK1
+#elif NOTECARD_I2C_KHZ >= 400
+    hi2c2.Init.Timing = 0x50330309;     // 400kHz from PCLK1
+#else
     hi2c2.Init.Timing = 0x30F03B23;     // Tuned to 100kHz
+#endif
+#endif
     hi2c2.Init.OwnAddress1 = 0;
     hi2c2.Init.AddressingMode = I2C_ADDRESSINGMODE_7BIT;
     hi2c2.Init.DualAddressMode = I2C_DUALADDRESS_DISABLE;
@@ -466,6 +866,11 @@ void MX_I2C2_Init(void)
         Error_Handler();
     }
 
+    // Fast-mode Plus needs the stronger drive on SCL and SDA
+#if NOTECARD_I2C_KHZ >= 1000
+    HAL_I2CEx_EnableFastModePlus(I2C_FASTMODEPLUS_I2C2);
+#endif
+
     // Enabled
     peripherals |= PERIPHERAL_I2C2;
 
@@ -480,118 +885,244 @@ void MX_I2C2_DeInit(void)
     HAL_I2C_DeInit(&hi2c2);
 }
 
-// I2C1 DMA completion events
+// Take a reference to the bus, powering it up for the first user
+void MY_I2C2_Acquire(void)
+{
+    MY_PeripheralAcquire(PERIPHERAL_I2C2);
+}
+
+// Drop a reference to the bus, which is powered down once it has been idle for a while
+void MY_I2C2_Release(void)
+{
+    MY_PeripheralRelease(PERIPHERAL_I2C2);
+}
+
+// Reinitialize the bus after an error, failing the transaction that was in progress
+void MY_I2C2_Reset(void)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    bool wasActive = (i2c2Queue != NULL && i2c2Queue->status == I2C2_ACTIVE);
+    MX_I2C2_DeInit();
+    MX_I2C2_Init();
+    if (wasActive) {
+        i2c2Complete(false);
+    }
+    __set_PRIMASK(primask);
+}
+
+// Queue a transaction, starting it now if the bus is idle.  The bus must be held with
+// MY_I2C2_Acquire() until the transaction has completed.
+void MY_I2C2_Submit(i2c2Transaction *t)
+{
+    t->next = NULL;
+    t->status = I2C2_PENDING;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (i2c2QueueTail == NULL) {
+        i2c2Queue = t;
+    } else {
+        i2c2QueueTail->next = t;
+    }
+    i2c2QueueTail = t;
+    if (i2c2Queue == t) {
+        i2c2Start();
+    }
+    __set_PRIMASK(primask);
+}
+
+// Start the transaction at the head of the queue, failing any that can't be started.
+// Called with interrupts masked or from the completion of the previous transaction.
+static void i2c2Start(void)
+{
+    while (i2c2Queue != NULL) {
+        i2c2Transaction *t = i2c2Queue;
+        uint16_t address = ((uint16_t) t->address) << 1;
+        HAL_StatusTypeDef status = HAL_ERROR;
+        switch (t->op) {
+        case I2C2_OP_READ_REGISTER:
+            status = HAL_I2C_Mem_Read_DMA(&hi2c2, address, (uint16_t) t->reg, I2C_MEMADD_SIZE_8BIT, t->data, t->len);
+            break;
+        case I2C2_OP_WRITE_REGISTER:
+            status = HAL_I2C_Mem_Write_DMA(&hi2c2, address, (uint16_t) t->reg, I2C_MEMADD_SIZE_8BIT, t->data, t->len);
+            break;
+        case I2C2_OP_TRANSMIT:
+            status = HAL_I2C_Master_Transmit_DMA(&hi2c2, address, t->data, t->len);
+            break;
+        case I2C2_OP_RECEIVE:
+            status = HAL_I2C_Master_Receive_DMA(&hi2c2, address, t->data, t->len);
+            break;
+        }
+        if (status == HAL_OK) {
+            t->status = I2C2_ACTIVE;
+            return;
+        }
+        i2c2Retire(false);
+    }
+}
+
+// Retire the transaction at the head of the queue, handing it to the completion task if
+// it has a callback
+static void i2c2Retire(bool success)
+{
+    i2c2Transaction *t = i2c2Queue;
+    if (t == NULL) {
+        return;
+    }
+    i2c2Queue = t->next;
+    if (i2c2Queue == NULL) {
+        i2c2QueueTail = NULL;
+    }
+    t->next = NULL;
+    t->status = success ? I2C2_SUCCEEDED : I2C2_FAILED;
+    if (t->done != NULL) {
+        if (i2c2CompletedTail == NULL) {
+            i2c2Completed = t;
+        } else {
+            i2c2CompletedTail->next = t;
+        }
+        i2c2CompletedTail = t;
+        UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_I2C2_Completed), CFG_SEQ_Prio_Radio);
+    }
+}
+
+// Retire the transaction at the head of the queue and start the next
+static void i2c2Complete(bool success)
+{
+    i2c2Retire(success);
+    i2c2Start();
+}
+
+// Sequencer task that delivers completed transactions to their callbacks
+void MY_I2C2_CompletedTask(void)
+{
+    while (true) {
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        i2c2Transaction *t = i2c2Completed;
+        if (t != NULL) {
+            i2c2Completed = t->next;
+            if (i2c2Completed == NULL) {
+                i2c2CompletedTail = NULL;
+            }
+        }
+        __set_PRIMASK(primask);
+        if (t == NULL) {
+            break;
+        }
+        t->done(t);
+    }
+}
+
+// I2C2 DMA completion events
 void HAL_I2C_MasterRxCpltCallback(I2C_HandleTypeDef *hi2c)
 {
     if (hi2c == &hi2c2) {
-        i2c2IOCompletions++;
+        i2c2Complete(true);
     }
 }
 void HAL_I2C_MasterTxCpltCallback(I2C_HandleTypeDef *hi2c)
 {
     if (hi2c == &hi2c2) {
-        i2c2IOCompletions++;
+        i2c2Complete(true);
     }
 }
 void HAL_I2C_MemRxCpltCallback(I2C_HandleTypeDef *hi2c)
 {
     if (hi2c == &hi2c2) {
-        i2c2IOCompletions++;
+        i2c2Complete(true);
     }
 }
 void HAL_I2C_MemTxCpltCallback(I2C_HandleTypeDef *hi2c)
 {
     if (hi2c == &hi2c2) {
-        i2c2IOCompletions++;
+        i2c2Complete(true);
     }
 }
 
-bool MY_I2C2_Ping(uint16_t i2cAddress, uint32_t timeoutMs, uint32_t attempts) {
-    return (HAL_OK == HAL_I2C_IsDeviceReady(&hi2c2, (uint16_t)(i2cAddress << 1), attempts, timeoutMs));
+// I2C2 errors, such as a NACK, end a DMA transfer without a completion event
+void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c)
+{
+    if (hi2c == &hi2c2) {
+        i2c2Complete(false);
+    }
 }
 
-// Receive from a register, and return true for success or false for failure
-bool MY_I2C2_ReadRegister(uint16_t i2cAddress, uint8_t Reg, void *data, uint16_t maxdatalen, uint32_t timeoutMs)
+// Perform a transaction through the queue and wait for it, returning false if it failed or
+// timed out.  A transaction that times out is withdrawn, resetting the bus if it had begun.
+static bool i2c2Transact(uint8_t op, uint16_t i2cAddress, uint8_t reg, void *data, uint16_t len, uint32_t timeoutMs)
 {
-    uint32_t ioCount = i2c2IOCompletions;
-    uint32_t status = HAL_I2C_Mem_Read_DMA(&hi2c2, ((uint16_t)i2cAddress) << 1, (uint16_t)Reg, I2C_MEMADD_SIZE_8BIT, data, maxdatalen);
-    if (status != HAL_OK) {
-        return false;
-    }
+    i2c2Transaction t = {0};
+    t.op = op;
+    t.address = i2cAddress;
+    t.reg = reg;
+    t.data = (uint8_t *) data;
+    t.len = len;
+    MY_I2C2_Submit(&t);
     uint32_t waitedMs = 0;
     uint32_t waitGranularityMs = 1;
-    bool success = true;
-    while (success && ioCount == i2c2IOCompletions) {
+    while (t.status == I2C2_PENDING || t.status == I2C2_ACTIVE) {
         HAL_Delay(waitGranularityMs);
         waitedMs += waitGranularityMs;
         if (timeoutMs != 0 && waitedMs > timeoutMs) {
-            success = false;
+            uint32_t primask = __get_PRIMASK();
+            __disable_irq();
+            if (t.status == I2C2_ACTIVE) {
+                MY_I2C2_Reset();
+            } else if (t.status == I2C2_PENDING) {
+                i2c2Transaction **p = &i2c2Queue;
+                i2c2Transaction *prev = NULL;
+                while (*p != &t) {
+                    prev = *p;
+                    p = &(*p)->next;
+                }
+                *p = t.next;
+                if (i2c2QueueTail == &t) {
+                    i2c2QueueTail = prev;
+                }
+                t.status = I2C2_FAILED;
+            }
+            __set_PRIMASK(primask);
+            return false;
         }
     }
-    return success;
+    return (t.status == I2C2_SUCCEEDED);
 }
 
-// Write a register, and return true for success or false for failure
-bool MY_I2C2_WriteRegister(uint16_t i2cAddress, uint8_t Reg, void *data, uint16_t datalen, uint32_t timeoutMs)
+// Probe for a device, which is done by polling once the queue is idle
+bool MY_I2C2_Ping(uint16_t i2cAddress, uint32_t timeoutMs, uint32_t attempts)
 {
-    uint32_t ioCount = i2c2IOCompletions;
-    uint32_t status = HAL_I2C_Mem_Write_DMA(&hi2c2, ((uint16_t)i2cAddress) << 1, (uint16_t)Reg, I2C_MEMADD_SIZE_8BIT, data, datalen);
-    if (status != HAL_OK) {
-        return false;
-    }
-    uint32_t waitedMs = 0;
-    uint32_t waitGranularityMs = 1;
-    bool success = true;
-    while (success && ioCount == i2c2IOCompletions) {
-        HAL_Delay(waitGranularityMs);
-        waitedMs += waitGranularityMs;
-        if (timeoutMs != 0 && waitedMs > timeoutMs) {
-            success = false;
+    for (uint32_t waitedMs = 0; i2c2Queue != NULL; waitedMs++) {
+        if (waitedMs > timeoutMs) {
+            return false;
         }
+        HAL_Delay(1);
     }
-    return success;
+    return (HAL_OK == HAL_I2C_IsDeviceReady(&hi2c2, (uint16_t)(i2cAddress << 1), attempts, timeoutMs));
+}
+
+// Receive from a register, and return true for success or false for failure
+bool MY_I2C2_ReadRegister(uint16_t i2cAddress, uint8_t Reg, void *data, uint16_t maxdatalen, uint32_t timeoutMs)
+{
+    return i2c2Transact(I2C2_OP_READ_REGISTER, i2cAddress, Reg, data, maxdatalen, timeoutMs);
+}
+
+// Write a register, and return true for success or false for failure
+bool MY_I2C2_WriteRegister(uint16_t i2cAddress, uint8_t Reg, void *data, uint16_t datalen, uint32_t timeoutMs)
+{
+    return i2c2Transact(I2C2_OP_WRITE_REGISTER, i2cAddress, Reg, data, datalen, timeoutMs);
 }
 
 // Transmit, and return true for success or false for failure
 bool MY_I2C2_Transmit(uint16_t i2cAddress, void *data, uint16_t datalen, uint32_t timeoutMs)
 {
-    uint32_t ioCount = i2c2IOCompletions;
-    uint32_t status = HAL_I2C_Master_Transmit_DMA(&hi2c2, ((uint16_t)i2cAddress) << 1, data, datalen);
-    if (status != HAL_OK) {
-        return false;
-    }
-    uint32_t waitedMs = 0;
-    uint32_t waitGranularityMs = 1;
-    bool success = true;
-    while (success && ioCount == i2c2IOCompletions) {
-        HAL_Delay(waitGranularityMs);
-        waitedMs += waitGranularityMs;
-        if (timeoutMs != 0 && waitedMs > timeoutMs) {
-            success = false;
-        }
-    }
-    return success;
+    return i2c2Transact(I2C2_OP_TRANSMIT, i2cAddress, 0, data, datalen, timeoutMs);
 }
 
 // Receive, and return true for success or false for failure
 bool MY_I2C2_Receive(uint16_t i2cAddress, void *data, uint16_t maxdatalen, uint32_t timeoutMs)
 {
-    uint32_t ioCount = i2c2IOCompletions;
-    uint32_t status = HAL_I2C_Master_Receive_DMA(&hi2c2, ((uint16_t)i2cAddress) << 1, data, maxdatalen);
-    if (status != HAL_OK) {
-        return false;
-    }
-    uint32_t waitedMs = 0;
-    uint32_t waitGranularityMs = 1;
-    bool success = true;
-    while (success && ioCount == i2c2IOCompletions) {
-        HAL_Delay(waitGranularityMs);
-        waitedMs += waitGranularityMs;
-        if (timeoutMs != 0 && waitedMs > timeoutMs) {
-            success = false;
-        }
-    }
-    return success;
+    return i2c2Transact(I2C2_OP_RECEIVE, i2cAddress, 0, data, maxdatalen, timeoutMs);
 }
 
 // SPI1 Initialization
@@ -655,42 +1186,354 @@ void MX_SUBGHZ_DeInit(void)
     HAL_SUBGHZ_DeInit(&hsubghz);
 }
 
-// Encrypt using AES as configured
-bool MX_AES_CTR_Encrypt(uint8_t *key, uint8_t *plaintext, uint16_t len, uint8_t *ciphertext)
+// Transfer a payload to or from the radio's buffer.  This is the HAL's WriteBuffer and
+// ReadBuffer, except that the payload is moved by DMA.  Nothing is gained by letting it
+// complete in the background, because the radio driver waits on each command, so both
+// channels are started and then polled.  When reading, the bytes clocked out are taken
+// from the zeroed buffer just ahead of where the bytes clocked in are stored; when
+// writing, what is clocked in is discarded along with the overrun that it causes.
+static HAL_StatusTypeDef subghzBufferTransfer(SUBGHZ_HandleTypeDef *hsubghz, uint8_t opcode, uint8_t offset, uint8_t *buffer, uint16_t size, bool read)
+{
+
+    if (hsubghz->State != HAL_SUBGHZ_STATE_READY) {
+        return HAL_BUSY;
+    }
+    __HAL_LOCK(hsubghz);
+    bool dma = (size >= SUBGHZ_DMA_MIN_BYTES);
+    if (dma) {
+        MX_ClockBoost();
+    }
+    (void) SUBGHZ_CheckDeviceReady(hsubghz);
+    LL_PWR_SelectSUBGHZSPI_NSS();
+    (void) SUBGHZSPI_Transmit(hsubghz, opcode);
+    (void) SUBGHZSPI_Transmit(hsubghz, offset);
+    if (read) {
+        (void) SUBGHZSPI_Transmit(hsubghz, 0x00U);
+    }
+
+    if (!dma) {
+        for (uint16_t i=0; i<size; i++) {
+            if (read) {
+                (void) SUBGHZSPI_Receive(hsubghz, &buffer[i]);
+            } else {
+                (void) SUBGHZSPI_Transmit(hsubghz, buffer[i]);
+            }
+        }
+    } else {
+        if (read) {
+            UTIL_MEM_set_8(buffer, 0, size);
+            HAL_DMA_Start(&hdma_subghzspi_rx, (uint32_t) &SUBGHZSPI->DR, (uint32_t) buffer, size);
+            SET_BIT(SUBGHZSPI->CR2, SPI_CR2_RXDMAEN);
+        }
+        HAL_DMA_Start(&hdma_subghzspi_tx, (uint32_t) buffer, (uint32_t) &SUBGHZSPI->DR, size);
+        SET_BIT(SUBGHZSPI->CR2, SPI_CR2_TXDMAEN);
+
+        // Wait for the last byte to be received, or to leave the FIFO and the shifter
+        DMA_Channel_TypeDef *last = read ? hdma_subghzspi_rx.Instance : hdma_subghzspi_tx.Instance;
+        uint32_t count = (uint32_t) size * 1000;
+        while (last->CNDTR != 0 && --count != 0) ;
+        while ((SUBGHZSPI->SR & (SPI_SR_FTLVL|SPI_SR_BSY)) != 0 && count != 0 && --count != 0) ;
+        if (count == 0) {
+            hsubghz->ErrorCode = HAL_SUBGHZ_ERROR_TIMEOUT;
+        }
+        CLEAR_BIT(SUBGHZSPI->CR2, SPI_CR2_TXDMAEN|SPI_CR2_RXDMAEN);
+        HAL_DMA_Abort(&hdma_subghzspi_tx);
+        if (read) {
+            HAL_DMA_Abort(&hdma_subghzspi_rx);
+        }
+        while ((SUBGHZSPI->SR & SPI_SR_FRLVL) != 0) {
+            (void) *((__IO uint8_t *) &SUBGHZSPI->DR);
+        }
+        (void) SUBGHZSPI->SR;
+    }
+
+    LL_PWR_UnselectSUBGHZSPI_NSS();
+    (void) SUBGHZ_WaitOnBusy(hsubghz);
+    if (dma) {
+        MX_ClockRelax();
+    }
+    HAL_StatusTypeDef status = (hsubghz->ErrorCode == HAL_SUBGHZ_ERROR_NONE) ? HAL_OK : HAL_ERROR;
+    hsubghz->State = HAL_SUBGHZ_STATE_READY;
+    __HAL_UNLOCK(hsubghz);
+    return status;
+
+}
+
+// Write a payload into the radio's buffer
+HAL_StatusTypeDef MX_SUBGHZ_WriteBuffer(SUBGHZ_HandleTypeDef *hsubghz, uint8_t offset, uint8_t *buffer, uint16_t size)
+{
+    return subghzBufferTransfer(hsubghz, SUBGHZ_RADIO_WRITE_BUFFER, offset, buffer, size, false);
+}
+
+// Read a payload from the radio's buffer
+HAL_StatusTypeDef MX_SUBGHZ_ReadBuffer(SUBGHZ_HandleTypeDef *hsubghz, uint8_t offset, uint8_t *buffer, uint16_t size)
 {
-    if ((((uint32_t) plaintext) & 0x03) != 0) {
+    return subghzBufferTransfer(hsubghz, SUBGHZ_RADIO_READ_BUFFER, offset, buffer, size, true);
+}
+
+// Begin an AES CTR operation using DMA, which completes in the background.  In CTR mode the
+// encrypt and decrypt operations are identical, so this is used for both.
+bool RAMFUNC MX_AES_CTR_Start(uint8_t *key, uint8_t *input, uint16_t len, uint8_t *output)
+{
+
+    // Validate parameters
+    if ((((uint32_t) input) & 0x03) != 0) {
         return false;
     }
-    if ((((uint32_t) ciphertext) & 0x03) != 0) {
+    if ((((uint32_t) output) & 0x03) != 0) {
         return false;
     }
+    uint16_t paddedLen = (len + 15) & ~15;
+    if (paddedLen > AES_DMA_MAX_BYTES) {
+        return false;
+    }
+
+    // Bring up the session if it isn't already active, and switch to this peer's key
+    if (!aesSessionActive) {
+        MY_PeripheralAcquire(PERIPHERAL_CRYP);
+        aesSessionActive = true;
+    }
     memcpy(keyAES, key, sizeof(keyAES));
-    MX_AES_Init();
-    bool success = HAL_CRYP_Encrypt_IT(&hcryp, (uint32_t *)plaintext, len, (uint32_t *)ciphertext) == HAL_OK;
-    if (success) {
-        while (HAL_CRYP_GetState(&hcryp) != HAL_CRYP_STATE_READY) ;
+
+    // Stage the input and begin the transfer, at full speed until MX_AES_CTR_Wait()
+    MX_ClockBoost();
+    memcpy(aesDMAIn, input, len);
+    memset(&((uint8_t *)aesDMAIn)[len], 0, paddedLen-len);
+    aesDMAOutput = output;
+    aesDMAOutputLen = len;
+    aesDMADirect = false;
+    aesDMAFailed = false;
+    aesDMACompleted = false;
+    if (HAL_CRYP_Encrypt_DMA(&hcryp, aesDMAIn, paddedLen, aesDMAOut) != HAL_OK) {
+        aesDMAOutput = NULL;
+        MX_ClockRelax();
+        return false;
     }
-    MX_AES_DeInit();
+
+    return true;
+
+}
+
+// Begin an AES CTR operation on a buffer in place using DMA, which completes in the background.
+// When the buffer has room for the whole blocks that the peripheral writes, the DMA engine
+// reads and writes it directly, each block being read before its keystream is applied, and
+// otherwise the message is staged just as by MX_AES_CTR_Start.
+bool RAMFUNC MX_AES_CTR_StartInPlace(uint8_t *key, uint8_t *buf, uint16_t len, uint16_t bufSize)
+{
+
+    // Stage the message if the buffer won't do for DMA
+    uint16_t paddedLen = (len + 15) & ~15;
+    if ((((uint32_t) buf) & 0x03) != 0 || paddedLen > bufSize) {
+        return MX_AES_CTR_Start(key, buf, len, buf);
+    }
+
+    // Bring up the session if it isn't already active, and switch to this peer's key
+    if (!aesSessionActive) {
+        MY_PeripheralAcquire(PERIPHERAL_CRYP);
+        aesSessionActive = true;
+    }
+    memcpy(keyAES, key, sizeof(keyAES));
+
+    // Begin the transfer, at full speed until MX_AES_CTR_Wait()
+    MX_ClockBoost();
+    aesDMAOutput = buf;
+    aesDMAOutputLen = len;
+    aesDMADirect = true;
+    aesDMAFailed = false;
+    aesDMACompleted = false;
+    if (HAL_CRYP_Encrypt_DMA(&hcryp, (uint32_t *) buf, paddedLen, (uint32_t *) buf) != HAL_OK) {
+        aesDMAOutput = NULL;
+        aesDMADirect = false;
+        MX_ClockRelax();
+        return false;
+    }
+
+    return true;
+
+}
+
+// Wait for the AES operation begun by MX_AES_CTR_Start to complete
+bool RAMFUNC MX_AES_CTR_Wait()
+{
+
+    // Exit if nothing is in progress
+    if (aesDMAOutput == NULL) {
+        return false;
+    }
+
+    // Wait for the DMA output channel to complete.  This normally takes only microseconds,
+    // but don't hang forever if the peripheral never completes.
+    uint32_t beganMs = HAL_GetTick();
+    while (!aesDMACompleted && !aesDMAFailed) {
+        if (HAL_GetTick() - beganMs > 100) {
+            aesDMAFailed = true;
+            break;
+        }
+    }
+
+    // Deliver the output, and discard the staged copies
+    bool success = !aesDMAFailed;
+    if (success && !aesDMADirect) {
+        memcpy(aesDMAOutput, aesDMAOut, aesDMAOutputLen);
+    } else if (!success) {
+        MX_AES_CTR_SessionEnd();
+        MX_AES_DeInit();
+    }
+    if (!aesDMADirect) {
+        memset(aesDMAIn, 0, sizeof(aesDMAIn));
+        memset(aesDMAOut, 0, sizeof(aesDMAOut));
+    }
+    aesDMAOutput = NULL;
+    aesDMADirect = false;
+    MX_ClockRelax();
     return success;
+
+}
+
+// End the AES session, erasing the key and releasing the peripheral, which stays powered
+// briefly in case another session follows
+void MX_AES_CTR_SessionEnd()
+{
+    if (aesSessionActive) {
+        aesSessionActive = false;
+        MY_PeripheralRelease(PERIPHERAL_CRYP);
+    }
+    memset(keyAES, 0, sizeof(keyAES));
+}
+
+// AES DMA output completion callback
+void RAMFUNC HAL_CRYP_OutCpltCallback(CRYP_HandleTypeDef *hcryp)
+{
+    aesDMACompleted = true;
+}
+
+// AES DMA error callback
+void HAL_CRYP_ErrorCallback(CRYP_HandleTypeDef *hcryp)
+{
+    aesDMAFailed = true;
+}
+
+// Encrypt using AES as configured
+bool MX_AES_CTR_Encrypt(uint8_t *key, uint8_t *plaintext, uint16_t len, uint8_t *ciphertext)
+{
+    if (!MX_AES_CTR_Start(key, plaintext, len, ciphertext)) {
+        return false;
+    }
+    return MX_AES_CTR_Wait();
 }
 
 // Decrypt using AES as configured
 bool MX_AES_CTR_Decrypt(uint8_t *key, uint8_t *ciphertext, uint16_t len, uint8_t *plaintext)
 {
-    if ((((uint32_t) plaintext) & 0x03) != 0) {
+    if (!MX_AES_CTR_Start(key, ciphertext, len, plaintext)) {
+        return false;
+    }
+    return MX_AES_CTR_Wait();
+}
+
+// Perform an AES CCM operation, computing the full tag over the associated data and the
+// plaintext, and leaving the peripheral configured for CTR mode again afterward
+static bool RAMFUNC MX_AES_CCM(bool encrypt, uint8_t *key, uint8_t *nonce, uint8_t *aad, uint16_t aadLen, uint8_t *input, uint16_t len, uint8_t *output, uint8_t *tag, uint16_t tagLen)
+{
+
+    // Validate parameters, and don't disturb a CTR operation that is in progress
+    uint16_t paddedLen = (len + 15) & ~15;
+    if (aesDMAOutput != NULL || paddedLen > AES_DMA_MAX_BYTES || aadLen > AES_CCM_MAX_AAD_BYTES) {
         return false;
     }
-    if ((((uint32_t) ciphertext) & 0x03) != 0) {
+    if (tagLen < 4 || tagLen > 16 || (tagLen & 1) != 0) {
         return false;
     }
+
+    // Bring up the session if it isn't already active, and switch to this peer's key
+    MX_ClockBoost();
+    if (!aesSessionActive) {
+        MY_PeripheralAcquire(PERIPHERAL_CRYP);
+        aesSessionActive = true;
+    }
     memcpy(keyAES, key, sizeof(keyAES));
-    MX_AES_Init();
-    bool success = HAL_CRYP_Decrypt_IT(&hcryp, (uint32_t *)ciphertext, len, (uint32_t *)plaintext) == HAL_OK;
+
+    // Format B0, which the peripheral loads most-significant byte first, and the header,
+    // which is the length of the associated data followed by it, padded to whole blocks
+    uint8_t b0[16];
+    b0[0] = (aadLen ? 0x40 : 0) | (((tagLen-2)/2) << 3) | (15-AES_CCM_NONCE_BYTES-1);
+    memcpy(&b0[1], nonce, AES_CCM_NONCE_BYTES);
+    b0[14] = (uint8_t) (len >> 8);
+    b0[15] = (uint8_t) len;
+    for (int i=0; i<4; i++) {
+        aesCCMB0[i] = (b0[i*4] << 24) | (b0[i*4+1] << 16) | (b0[i*4+2] << 8) | b0[i*4+3];
+    }
+    uint8_t *header = (uint8_t *) aesCCMHeader;
+    memset(aesCCMHeader, 0, sizeof(aesCCMHeader));
+    header[0] = (uint8_t) (aadLen >> 8);
+    header[1] = (uint8_t) aadLen;
+    memcpy(&header[2], aad, aadLen);
+    uint16_t headerLen = aadLen ? ((aadLen + 2 + 15) & ~15) : 0;
+
+    // Switch the peripheral to CCM
+    CRYP_ConfigTypeDef config;
+    bool success = (HAL_CRYP_GetConfig(&hcryp, &config) == HAL_OK);
+    config.Algorithm = CRYP_AES_CCM;
+    config.B0 = aesCCMB0;
+    config.Header = aesCCMHeader;
+    config.HeaderSize = headerLen / sizeof(uint32_t);
+    success = success && (HAL_CRYP_SetConfig(&hcryp, &config) == HAL_OK);
+
+    // Process the payload, and then compute the tag
+    memcpy(aesDMAIn, input, len);
+    memset(&((uint8_t *)aesDMAIn)[len], 0, paddedLen-len);
+    if (success && encrypt) {
+        success = (HAL_CRYP_Encrypt(&hcryp, aesDMAIn, len, aesDMAOut, 100) == HAL_OK);
+    } else if (success) {
+        success = (HAL_CRYP_Decrypt(&hcryp, aesDMAIn, len, aesDMAOut, 100) == HAL_OK);
+    }
+    success = success && (HAL_CRYPEx_AESCCM_GenerateAuthTAG(&hcryp, aesCCMTag, 100) == HAL_OK);
     if (success) {
-        while (HAL_CRYP_GetState(&hcryp) != HAL_CRYP_STATE_READY) ;
-    }
-    MX_AES_DeInit();
+        memcpy(output, aesDMAOut, len);
+        memcpy(tag, aesCCMTag, tagLen);
+    }
+
+    // Return to CTR mode, starting over with a fresh session if that fails
+    config.Algorithm = CRYP_AES_CTR;
+    config.pInitVect = AESIV_CTR;
+    config.B0 = NULL;
+    config.Header = NULL;
+    config.HeaderSize = 0;
+    if (!success || HAL_CRYP_SetConfig(&hcryp, &config) != HAL_OK) {
+        MX_AES_CTR_SessionEnd();
+        MX_AES_DeInit();
+    }
+    memset(aesDMAIn, 0, sizeof(aesDMAIn));
+    memset(aesDMAOut, 0, sizeof(aesDMAOut));
+    memset(aesCCMHeader, 0, sizeof(aesCCMHeader));
+    memset(aesCCMTag, 0, sizeof(aesCCMTag));
+    MX_ClockRelax();
     return success;
+
+}
+
+// Encrypt and authenticate using AES CCM, producing a tag truncated to tagLen bytes
+bool MX_AES_CCM_Encrypt(uint8_t *key, uint8_t *nonce, uint8_t *aad, uint16_t aadLen, uint8_t *plaintext, uint16_t len, uint8_t *ciphertext, uint8_t *tag, uint16_t tagLen)
+{
+    return MX_AES_CCM(true, key, nonce, aad, aadLen, plaintext, len, ciphertext, tag, tagLen);
+}
+
+// Decrypt using AES CCM, failing and yielding no plaintext unless the truncated tag matches
+bool MX_AES_CCM_Decrypt(uint8_t *key, uint8_t *nonce, uint8_t *aad, uint16_t aadLen, uint8_t *ciphertext, uint16_t len, uint8_t *plaintext, uint8_t *tag, uint16_t tagLen)
+{
+    uint8_t computed[16];
+    if (tagLen > sizeof(computed) || !MX_AES_CCM(false, key, nonce, aad, aadLen, ciphertext, len, plaintext, computed, tagLen)) {
+        return false;
+    }
+    uint8_t diff = 0;
+    for (int i=0; i<tagLen; i++) {
+        diff |= computed[i] ^ tag[i];
+    }
+    if (diff != 0) {
+        memset(plaintext, 0, len);
+        return false;
+    }
+    return true;
 }
 
 // Init AES
@@ -708,11 +1551,13 @@ void MX_AES_Init()
     if (HAL_CRYP_Init(&hcryp) != HAL_OK) {
         Error_Handler();
     }
+    peripherals |= PERIPHERAL_CRYP;
 }
 
 // DeInit AES
 void MX_AES_DeInit(void)
 {
+    peripherals &= ~PERIPHERAL_CRYP;
     HAL_CRYP_DeInit(&hcryp);
 }
 
@@ -724,6 +1569,7 @@ void MX_RNG_Init(void)
     if (HAL_RNG_Init(&hrng) != HAL_OK) {
         Error_Handler();
     }
+    peripherals |= PERIPHERAL_RNG;
 }
 
 // Get a random number
@@ -740,9 +1586,131 @@ uint32_t MX_RNG_Get()
 // DeInit RNG
 void MX_RNG_DeInit(void)
 {
+    peripherals &= ~PERIPHERAL_RNG;
     HAL_RNG_DeInit(&hrng);
 }
 
+// Fill the entropy pool from the RNG in a single burst
+void MY_RandomRefill(void)
+{
+    if (rngPoolCount >= RNG_POOL_WORDS) {
+        return;
+    }
+    MY_PeripheralAcquire(PERIPHERAL_RNG);
+    while (true) {
+        uint32_t random = MX_RNG_Get();
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        bool full = (rngPoolCount >= RNG_POOL_WORDS);
+        if (!full) {
+            rngPool[rngPoolCount++] = random;
+        }
+        __set_PRIMASK(primask);
+        if (full) {
+            break;
+        }
+    }
+    MY_PeripheralRelease(PERIPHERAL_RNG);
+}
+
+// True if the pool has run low enough that it should be topped up in idle time
+bool MY_RandomRefillDue(void)
+{
+    return (rngPoolCount < RNG_POOL_WORDS/2);
+}
+
+// Get a random number from the pool, refilling it first if it is empty.  Each word is
+// erased as it is drawn so that it is never handed out twice.
+uint32_t MY_Random(void)
+{
+    while (true) {
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        if (rngPoolCount > 0) {
+            rngPoolCount--;
+            uint32_t random = rngPool[rngPoolCount];
+            rngPool[rngPoolCount] = 0;
+            __set_PRIMASK(primask);
+            return random;
+        }
+        __set_PRIMASK(primask);
+        MY_RandomRefill();
+    }
+}
+
+// Find a reference-counted peripheral
+static managedPeripheral *peripheralFind(uint32_t peripheral)
+{
+    for (uint32_t i=0; i<MANAGED_PERIPHERALS; i++) {
+        if (managedPeripherals[i].peripheral == peripheral) {
+            return &managedPeripherals[i];
+        }
+    }
+    return NULL;
+}
+
+// Take a reference to a peripheral, initializing it unless it is still up from a recent user
+void MY_PeripheralAcquire(uint32_t peripheral)
+{
+    managedPeripheral *p = peripheralFind(peripheral);
+    if (p == NULL) {
+        return;
+    }
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    p->users++;
+    if ((peripherals & peripheral) == 0) {
+        p->init();
+    }
+    __set_PRIMASK(primask);
+}
+
+// Drop a reference to a peripheral, scheduling it to be deinitialized if it stays idle
+void MY_PeripheralRelease(uint32_t peripheral)
+{
+    managedPeripheral *p = peripheralFind(peripheral);
+    if (p == NULL || p->users == 0) {
+        return;
+    }
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (--p->users == 0) {
+        p->idleSinceMs = HAL_GetTick();
+        if (!peripheralIdleTimerCreated) {
+            UTIL_TIMER_Create(&peripheralIdleTimer, 0xFFFFFFFFU, UTIL_TIMER_ONESHOT, peripheralIdleEvent, NULL);
+            peripheralIdleTimerCreated = true;
+        }
+        if (!UTIL_TIMER_IsRunning(&peripheralIdleTimer)) {
+            UTIL_TIMER_SetPeriod(&peripheralIdleTimer, PERIPHERAL_IDLE_MS);
+            UTIL_TIMER_Start(&peripheralIdleTimer);
+        }
+    }
+    __set_PRIMASK(primask);
+}
+
+// Deinitialize the peripherals that have been idle long enough, and wait for the rest
+static void peripheralIdleEvent(void *context)
+{
+    uint32_t nowMs = HAL_GetTick();
+    uint32_t nextMs = 0;
+    for (uint32_t i=0; i<MANAGED_PERIPHERALS; i++) {
+        managedPeripheral *p = &managedPeripherals[i];
+        if (p->users != 0 || (peripherals & p->peripheral) == 0) {
+            continue;
+        }
+        uint32_t idleMs = nowMs - p->idleSinceMs;
+        if (idleMs >= PERIPHERAL_IDLE_MS) {
+            p->deinit();
+        } else if (nextMs == 0 || PERIPHERAL_IDLE_MS - idleMs < nextMs) {
+            nextMs = PERIPHERAL_IDLE_MS - idleMs;
+        }
+    }
+    if (nextMs != 0) {
+        UTIL_TIMER_SetPeriod(&peripheralIdleTimer, nextMs);
+        UTIL_TIMER_Start(&peripheralIdleTimer);
+    }
+}
+
 // Microsecond timer
 void MX_TIM17_Init(void)
 {
@@ -766,7 +1734,7 @@ void MX_TIM17_DelayUs(uint32_t us)
 {
     __HAL_TIM_SET_COUNTER (&htim17, 0);
     __HAL_TIM_ENABLE (&htim17);
-    uint32_t ticks = MSI_FREQUENCY_MHZ * us;
+    uint32_t ticks = clockMHz * us;
     uint32_t base = 0;
     uint32_t prev = 0;
     while (true) {
@@ -880,6 +1848,28 @@ void MX_USART1_UART_Transmit(uint8_t *buf, uint32_t len, uint32_t timeoutMs)
 
 }
 
+// Receive from USART1, returning false if the buffer wasn't filled in time
+bool MX_USART1_UART_Receive(uint8_t *buf, uint32_t len, uint32_t timeoutMs)
+{
+
+    // Receive
+    if (HAL_UART_Receive_DMA(&huart1, buf, len) != HAL_OK) {
+        return false;
+    }
+
+    // Wait, so that the caller won't use the buffer until the HAL is done with it
+    for (uint32_t i=0; i<timeoutMs; i++) {
+        HAL_UART_StateTypeDef state = HAL_UART_GetState(&huart1);
+        if ((state & HAL_UART_STATE_BUSY_RX) != HAL_UART_STATE_BUSY_RX) {
+            return true;
+        }
+        HAL_Delay(1);
+    }
+    HAL_UART_AbortReceive(&huart1);
+    return false;
+
+}
+
 // USART1 Deinitialization
 void MX_USART1_UART_DeInit(void)
 {
@@ -1044,9 +2034,16 @@ void MX_LPUART1_UART_Init(void)
     if (HAL_UARTEx_SetRxFifoThreshold(&hlpuart1, UART_RXFIFO_THRESHOLD_1_8) != HAL_OK) {
         Error_Handler();
     }
+#if DEBUGGER_LPUART1_STOP2
+    // The FIFO's threshold interrupt, unlike the one for each byte, wakes us from STOP2
+    if (HAL_UARTEx_EnableFifoMode(&hlpuart1) != HAL_OK) {
+        Error_Handler();
+    }
+#else
     if (HAL_UARTEx_DisableFifoMode(&hlpuart1) != HAL_OK) {
         Error_Handler();
     }
+#endif
 
     peripherals |= PERIPHERAL_LPUART1;
 
@@ -1101,6 +2098,13 @@ void MX_LPUART1_UART_Transmit(uint8_t *buf, uint32_t len, uint32_t timeoutMs)
 
 }
 
+// Begin transmitting to LPUART1 without waiting, the buffer being left in use until the
+// transmit complete callback
+bool MX_LPUART1_UART_TransmitAsync(uint8_t *buf, uint32_t len)
+{
+    return (HAL_UART_Transmit_IT(&hlpuart1, buf, len) == HAL_OK);
+}
+
 // LPUART1 De-Initialization Function
 void MX_LPUART1_UART_DeInit(void)
 {
@@ -1136,48 +2140,125 @@ uint32_t MX_Heap_Size(uint8_t **base)
     return heapSize;
 }
 
-// Get the currently active peripherals
-void MY_ActivePeripherals(char *buf, uint32_t buflen)
+// Pattern with which the stack is painted at boot, so that how deep it has ever grown can be seen
+#define STACK_PAINT         0xA5A5A5A5U
+#define STACK_PAINT_MARGIN  32          // Left unpainted below the painter's own frame
+
+// Get the limits of the stack reserved by the linker, which grows down from its top
+static void stackLimits(uint32_t **bottom, uint32_t **top)
 {
-    *buf = '\0';
-    if ((peripherals & PERIPHERAL_RNG) != 0) {
-        strlcat(buf, "RNG ", buflen);
-    }
-    if ((peripherals & PERIPHERAL_RTC) != 0) {
-        strlcat(buf, "RTC ", buflen);
-    }
-    if ((peripherals & PERIPHERAL_SUBGHZ) != 0) {
-        strlcat(buf, "SUBGHZ ", buflen);
-    }
-    if ((peripherals & PERIPHERAL_ADC) != 0) {
-        strlcat(buf, "ADC ", buflen);
-    }
-    if ((peripherals & PERIPHERAL_ADCDMA) != 0) {
-        strlcat(buf, "ADCDMA ", buflen);
-    }
-    if ((peripherals & PERIPHERAL_LPUART1) != 0) {
-        strlcat(buf, "LPUART1 ", buflen);
+#if defined( __ICCARM__ )   // IAR
+    *bottom = (uint32_t *) &CSTACK$$Base;
+    *top = (uint32_t *) &CSTACK$$Limit;
+#else
+    *bottom = (uint32_t *) ((uint32_t)&_estack - (uint32_t)&_Min_Stack_Size);
+    *top = (uint32_t *) &_estack;
+#endif
+}
+
+// Paint the part of the stack not yet in use, which must be done before anything runs deep
+void MX_Stack_Paint()
+{
+    uint32_t *bottom, *top;
+    stackLimits(&bottom, &top);
+    volatile uint32_t *p = bottom;
+    volatile uint32_t *end = (uint32_t *) ((__get_MSP() - STACK_PAINT_MARGIN) & ~3U);
+    if (end > top) {
+        end = top;
     }
-    if ((peripherals & PERIPHERAL_USART1) != 0) {
-        strlcat(buf, "USART1 ", buflen);
+    while (p < end) {
+        *p++ = STACK_PAINT;
     }
-    if ((peripherals & PERIPHERAL_USART2) != 0) {
-        strlcat(buf, "USART2 ", buflen);
+}
+
+// Get the deepest that the stack has grown since boot, and the size reserved for it.  Use
+// of all of it means that the stack may have grown past it into the heap.
+uint32_t MX_Stack_HighWater(uint32_t *size)
+{
+    uint32_t *bottom, *top;
+    stackLimits(&bottom, &top);
+    uint32_t *p = bottom;
+    while (p < top && *p == STACK_PAINT) {
+        p++;
     }
-    if ((peripherals & PERIPHERAL_CRYP) != 0) {
-        strlcat(buf, "CRYP ", buflen);
+    if (size != NULL) {
+        *size = (uint32_t) ((uint8_t *) top - (uint8_t *) bottom);
     }
-    if ((peripherals & PERIPHERAL_I2C2) != 0) {
-        strlcat(buf, "I2C2 ", buflen);
+    return (uint32_t) ((uint8_t *) top - (uint8_t *) p);
+}
+
+// Find the largest block above 'ok' bytes and at most 'limit' bytes that malloc can provide,
+// or 'ok' if there is none
+static uint32_t heapProbe(uint32_t ok, uint32_t limit)
+{
+    while (ok < limit) {
+        uint32_t size = ok + ((limit - ok + 1) / 2);
+        void *p = malloc(size);
+        if (p == NULL) {
+            limit = size - 1;
+        } else {
+            free(p);
+            ok = size;
+        }
     }
-    if ((peripherals & PERIPHERAL_SPI1) != 0) {
-        strlcat(buf, "SPI1 ", buflen);
+    return ok;
+}
+
+// Get the most of the heap that malloc has ever claimed, the bytes free within that, and the
+// largest block that could be allocated now.  With newlib, the heap grows by sbrk and never
+// shrinks, so only blocks too large to be claimed from the unclaimed remainder are probed, so
+// that the probe itself can't raise the high-water mark.
+void MX_Heap_Usage(uint32_t *highWater, uint32_t *freeBytes, uint32_t *largest)
+{
+    uint32_t heapSize = MX_Heap_Size(NULL);
+#if defined( __ICCARM__ )   // IAR
+    *highWater = 0;
+    *freeBytes = 0;
+    *largest = heapProbe(0, heapSize);
+#else
+    struct mallinfo mi = mallinfo();
+    uint32_t claimed = (uint32_t) mi.arena;
+    uint32_t unclaimed = (heapSize > claimed) ? (heapSize - claimed) : 0;
+    uint32_t tail = (unclaimed > 16) ? (unclaimed - 16) : 0;
+    *highWater = claimed;
+    *freeBytes = (uint32_t) mi.fordblks;
+    *largest = heapProbe(unclaimed, (uint32_t) mi.fordblks);
+    if (*largest <= unclaimed) {
+        *largest = tail;
     }
-    if ((peripherals & PERIPHERAL_SPI1DMA) != 0) {
-        strlcat(buf, "SPI1DMA ", buflen);
+#endif
+}
+
+// Append the name of a peripheral if it is active, marking a reference-counted peripheral
+// that has no users and is only awaiting its idle deinit
+static void peripheralName(char *buf, uint32_t buflen, uint32_t peripheral, const char *name)
+{
+    if ((peripherals & peripheral) == 0) {
+        return;
     }
-    if ((peripherals & PERIPHERAL_TIM17) != 0) {
-        strlcat(buf, "TIM17 ", buflen);
+    strlcat(buf, name, buflen);
+    managedPeripheral *p = peripheralFind(peripheral);
+    if (p != NULL && p->users == 0) {
+        strlcat(buf, "(idle)", buflen);
     }
+    strlcat(buf, " ", buflen);
+}
 
+// Get the currently active peripherals
+void MY_ActivePeripherals(char *buf, uint32_t buflen)
+{
+    *buf = '\0';
+    peripheralName(buf, buflen, PERIPHERAL_RNG, "RNG");
+    peripheralName(buf, buflen, PERIPHERAL_RTC, "RTC");
+    peripheralName(buf, buflen, PERIPHERAL_SUBGHZ, "SUBGHZ");
+    peripheralName(buf, buflen, PERIPHERAL_ADC, "ADC");
+    peripheralName(buf, buflen, PERIPHERAL_ADCDMA, "ADCDMA");
+    peripheralName(buf, buflen, PERIPHERAL_LPUART1, "LPUART1");
+    peripheralName(buf, buflen, PERIPHERAL_USART1, "USART1");
+    peripheralName(buf, buflen, PERIPHERAL_USART2, "USART2");
+    peripheralName(buf, buflen, PERIPHERAL_CRYP, "CRYP");
+    peripheralName(buf, buflen, PERIPHERAL_I2C2, "I2C2");
+    peripheralName(buf, buflen, PERIPHERAL_SPI1, "SPI1");
+    peripheralName(buf, buflen, PERIPHERAL_SPI1DMA, "SPI1DMA");
+    peripheralName(buf, buflen, PERIPHERAL_TIM17, "TIM17");
 }
@@ -5,6 +5,20 @@
 #include "main.h"
 #include "stm32_lpm.h"
 #include "stm32_lpm_if.h"
+#include "timer_if.h"
+
+// Residency since the last reset, charged at each change of mode using the RTC, whose
+// sub-second ticks keep counting through STOP2
+static uint32_t residencyTicks[PWR_MODES] = {0};
+static uint32_t residencyWakes[PWR_WAKES] = {0};
+static uint32_t residencyModeBeganTicks = 0;
+
+// Forwards
+void PWR_Charge(int mode);
+void PWR_CountWake(void);
+#if TIMELINE_ON
+void timelineLowPower(uint8_t mode);
+#endif
 
 // Power driver callbacks handler
 const struct UTIL_LPM_Driver_s UTIL_PowerDriver = {
@@ -18,12 +32,59 @@ const struct UTIL_LPM_Driver_s UTIL_PowerDriver = {
     PWR_ExitOffMode,
 };
 
+// Charge the time since the last change of mode to the mode that is ending
+void PWR_Charge(int mode)
+{
+    uint32_t nowTicks = TIMER_IF_GetTimerValue();
+    residencyTicks[mode] += nowTicks - residencyModeBeganTicks;
+    residencyModeBeganTicks = nowTicks;
+}
+
+// Count what woke the processor, which is called before interrupts are unmasked so that
+// the interrupt that did it is still pending
+void PWR_CountWake(void)
+{
+    int source = PWR_WAKE_OTHER;
+    if (NVIC_GetPendingIRQ(SUBGHZ_Radio_IRQn)) {
+        source = PWR_WAKE_RADIO;
+    } else if (NVIC_GetPendingIRQ(USART1_IRQn) || NVIC_GetPendingIRQ(USART2_IRQn) || NVIC_GetPendingIRQ(LPUART1_IRQn)) {
+        source = PWR_WAKE_UART;
+    } else if (NVIC_GetPendingIRQ(EXTI0_IRQn) || NVIC_GetPendingIRQ(EXTI1_IRQn) || NVIC_GetPendingIRQ(EXTI2_IRQn)
+               || NVIC_GetPendingIRQ(EXTI3_IRQn) || NVIC_GetPendingIRQ(EXTI4_IRQn)
+               || NVIC_GetPendingIRQ(EXTI9_5_IRQn) || NVIC_GetPendingIRQ(EXTI15_10_IRQn)) {
+        source = PWR_WAKE_EXTI;
+    } else if (NVIC_GetPendingIRQ(RTC_Alarm_IRQn) || NVIC_GetPendingIRQ(RTC_WKUP_IRQn)
+               || NVIC_GetPendingIRQ(TAMP_STAMP_LSECSS_SSRU_IRQn)) {
+        source = PWR_WAKE_RTC;
+    }
+    residencyWakes[source]++;
+}
+
+// Get the ticks spent in each mode and the wakes by source, charging the time that the
+// caller has been running, and optionally reset them after they have been taken
+void PWR_Residency(uint32_t *ticks, uint32_t *wakes, bool reset)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    PWR_Charge(PWR_MODE_RUN);
+    memcpy(ticks, residencyTicks, sizeof(residencyTicks));
+    memcpy(wakes, residencyWakes, sizeof(residencyWakes));
+    if (reset) {
+        memset(residencyTicks, 0, sizeof(residencyTicks));
+        memset(residencyWakes, 0, sizeof(residencyWakes));
+    }
+    __set_PRIMASK(primask);
+}
+
 void PWR_EnterOffMode(void)
 {
+    PWR_Charge(PWR_MODE_RUN);
 }
 
 void PWR_ExitOffMode(void)
 {
+    PWR_Charge(PWR_MODE_OFF);
+    PWR_CountWake();
 }
 
 void PWR_EnterStopMode(void)
@@ -38,6 +99,10 @@ void PWR_EnterStopMode(void)
     // Clear Status Flag before entering STOP/STANDBY Mode
     LL_PWR_ClearFlag_C1STOP_C1STB();
 
+    PWR_Charge(PWR_MODE_RUN);
+#if TIMELINE_ON
+    timelineLowPower(2);
+#endif
     HAL_PWREx_EnterSTOP2Mode(PWR_STOPENTRY_WFI);
 
 }
@@ -47,6 +112,11 @@ void PWR_ExitStopMode(void)
 
     // Resume sysTick : work around for degugger problem in dual core
     HAL_ResumeTick();
+    PWR_Charge(PWR_MODE_STOP2);
+    PWR_CountWake();
+#if TIMELINE_ON
+    timelineLowPower(0);
+#endif
 
     // Not retained peripherals:
     //    ADC interface
@@ -63,6 +133,10 @@ void PWR_EnterSleepMode(void)
 
     // Suspend sysTick
     HAL_SuspendTick();
+    PWR_Charge(PWR_MODE_RUN);
+#if TIMELINE_ON
+    timelineLowPower(1);
+#endif
     HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI);
 
 }
@@ -72,6 +146,11 @@ void PWR_ExitSleepMode(void)
 
     // Suspend sysTick
     HAL_ResumeTick();
+    PWR_Charge(PWR_MODE_SLEEP);
+    PWR_CountWake();
+#if TIMELINE_ON
+    timelineLowPower(0);
+#endif
 
 }
 
@@ -9,6 +9,8 @@ extern DMA_HandleTypeDef hdma_i2c2_rx;
 extern DMA_HandleTypeDef hdma_i2c2_tx;
 extern DMA_HandleTypeDef hdma_spi1_rx;
 extern DMA_HandleTypeDef hdma_spi1_tx;
+extern DMA_HandleTypeDef hdma_subghzspi_rx;
+extern DMA_HandleTypeDef hdma_subghzspi_tx;
 extern DMA_HandleTypeDef hdma_usart1_rx;
 extern DMA_HandleTypeDef hdma_usart1_tx;
 extern DMA_HandleTypeDef hdma_usart2_rx;
@@ -19,20 +21,26 @@ void HAL_MspInit(void)
 {
 }
 
-// TIM17 Init
+// TIM17 and ADC stream pacing timer Init
 void HAL_TIM_Base_MspInit(TIM_HandleTypeDef* htim_base)
 {
     if (htim_base->Instance==TIM17) {
         __HAL_RCC_TIM17_CLK_ENABLE();
     }
+    if (htim_base->Instance==ADC_STREAM_TIM) {
+        __HAL_RCC_TIM2_CLK_ENABLE();
+    }
 }
 
-// TIM17 DeInit
+// TIM17 and ADC stream pacing timer DeInit
 void HAL_TIM_Base_MspDeInit(TIM_HandleTypeDef* htim_base)
 {
     if (htim_base->Instance==TIM17) {
         __HAL_RCC_TIM17_CLK_DISABLE();
     }
+    if (htim_base->Instance==ADC_STREAM_TIM) {
+        __HAL_RCC_TIM2_CLK_DISABLE();
+    }
 
 }
 
@@ -142,7 +150,11 @@ void HAL_I2C_MspInit(I2C_HandleTypeDef* hi2c)
 
         // Initializes the peripherals clocks
         PeriphClkInitStruct.PeriphClockSelection = RCC_PERIPHCLK_I2C2;
+#if CLOCK_GOVERNOR
+        PeriphClkInitStruct.I2c2ClockSelection = RCC_I2C2CLKSOURCE_HSI;
+#else
         PeriphClkInitStruct.I2c2ClockSelection = RCC_I2C2CLKSOURCE_PCLK1;
+#endif
         if (HAL_RCCEx_PeriphCLKConfig(&PeriphClkInitStruct) != HAL_OK) {
             Error_Handler();
         }
@@ -330,9 +342,43 @@ void HAL_CRYP_MspInit(CRYP_HandleTypeDef* hcryp)
         // Peripheral clock enable
         __HAL_RCC_AES_CLK_ENABLE();
 
+        // AES IN DMA
+        hdma_aes_in.Instance = AES_IN_DMA_Channel;
+        hdma_aes_in.Init.Request = DMA_REQUEST_AES_IN;
+        hdma_aes_in.Init.Direction = DMA_MEMORY_TO_PERIPH;
+        hdma_aes_in.Init.PeriphInc = DMA_PINC_DISABLE;
+        hdma_aes_in.Init.MemInc = DMA_MINC_ENABLE;
+        hdma_aes_in.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+        hdma_aes_in.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+        hdma_aes_in.Init.Mode = DMA_NORMAL;
+        hdma_aes_in.Init.Priority = DMA_PRIORITY_HIGH;
+        if (HAL_DMA_Init(&hdma_aes_in) != HAL_OK) {
+            Error_Handler();
+        }
+        __HAL_LINKDMA(hcryp,hdmain,hdma_aes_in);
+
+        // AES OUT DMA
+        hdma_aes_out.Instance = AES_OUT_DMA_Channel;
+        hdma_aes_out.Init.Request = DMA_REQUEST_AES_OUT;
+        hdma_aes_out.Init.Direction = DMA_PERIPH_TO_MEMORY;
+        hdma_aes_out.Init.PeriphInc = DMA_PINC_DISABLE;
+        hdma_aes_out.Init.MemInc = DMA_MINC_ENABLE;
+        hdma_aes_out.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+        hdma_aes_out.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+        hdma_aes_out.Init.Mode = DMA_NORMAL;
+        hdma_aes_out.Init.Priority = DMA_PRIORITY_HIGH;
+        if (HAL_DMA_Init(&hdma_aes_out) != HAL_OK) {
+            Error_Handler();
+        }
+        __HAL_LINKDMA(hcryp,hdmaout,hdma_aes_out);
+
         // AES interrupt Init
         HAL_NVIC_SetPriority(AES_IRQn, 0, 0);
         HAL_NVIC_EnableIRQ(AES_IRQn);
+        HAL_NVIC_SetPriority(AES_IN_DMA_IRQn, 2, 0);
+        HAL_NVIC_EnableIRQ(AES_IN_DMA_IRQn);
+        HAL_NVIC_SetPriority(AES_OUT_DMA_IRQn, 2, 0);
+        HAL_NVIC_EnableIRQ(AES_OUT_DMA_IRQn);
     }
 
 }
@@ -347,8 +393,14 @@ void HAL_CRYP_MspDeInit(CRYP_HandleTypeDef* hcryp)
         // Peripheral clock disable
         __HAL_RCC_AES_CLK_DISABLE();
 
+        // DMA
+        HAL_DMA_DeInit(hcryp->hdmain);
+        HAL_DMA_DeInit(hcryp->hdmaout);
+
         // AES interrupt DeInit
         HAL_NVIC_DisableIRQ(AES_IRQn);
+        HAL_NVIC_DisableIRQ(AES_IN_DMA_IRQn);
+        HAL_NVIC_DisableIRQ(AES_OUT_DMA_IRQn);
 
     }
 
@@ -449,6 +501,34 @@ void HAL_SUBGHZ_MspInit(SUBGHZ_HandleTypeDef* subghzHandle)
     // SUBGHZ clock enable
     __HAL_RCC_SUBGHZSPI_CLK_ENABLE();
 
+    // SUBGHZSPI RX DMA
+    hdma_subghzspi_rx.Instance = SUBGHZSPI_RX_DMA_Channel;
+    hdma_subghzspi_rx.Init.Request = DMA_REQUEST_SUBGHZSPI_RX;
+    hdma_subghzspi_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_subghzspi_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_subghzspi_rx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_subghzspi_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_subghzspi_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_subghzspi_rx.Init.Mode = DMA_NORMAL;
+    hdma_subghzspi_rx.Init.Priority = DMA_PRIORITY_VERY_HIGH;
+    if (HAL_DMA_Init(&hdma_subghzspi_rx) != HAL_OK) {
+        Error_Handler();
+    }
+
+    // SUBGHZSPI TX DMA
+    hdma_subghzspi_tx.Instance = SUBGHZSPI_TX_DMA_Channel;
+    hdma_subghzspi_tx.Init.Request = DMA_REQUEST_SUBGHZSPI_TX;
+    hdma_subghzspi_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    hdma_subghzspi_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_subghzspi_tx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_subghzspi_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_subghzspi_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_subghzspi_tx.Init.Mode = DMA_NORMAL;
+    hdma_subghzspi_tx.Init.Priority = DMA_PRIORITY_VERY_HIGH;
+    if (HAL_DMA_Init(&hdma_subghzspi_tx) != HAL_OK) {
+        Error_Handler();
+    }
+
     // SUBGHZ interrupt Init
     HAL_NVIC_SetPriority(SUBGHZ_Radio_IRQn, 0, 0);
     HAL_NVIC_EnableIRQ(SUBGHZ_Radio_IRQn);
@@ -462,6 +542,10 @@ void HAL_SUBGHZ_MspDeInit(SUBGHZ_HandleTypeDef* subghzHandle)
     // Peripheral clock disable
     __HAL_RCC_SUBGHZSPI_CLK_DISABLE();
 
+    // SUBGHZSPI DMA DeInit
+    HAL_DMA_DeInit(&hdma_subghzspi_rx);
+    HAL_DMA_DeInit(&hdma_subghzspi_tx);
+
     // SUBGHZ interrupt Deinit
     HAL_NVIC_DisableIRQ(SUBGHZ_Radio_IRQn);
 
@@ -478,7 +562,11 @@ void HAL_UART_MspInit(UART_HandleTypeDef* uartHandle)
 
         // Initializes the peripherals clocks
         PeriphClkInitStruct.PeriphClockSelection = RCC_PERIPHCLK_USART1;
+#if CLOCK_GOVERNOR
+        PeriphClkInitStruct.Usart1ClockSelection = RCC_USART1CLKSOURCE_HSI;
+#else
         PeriphClkInitStruct.Usart1ClockSelection = RCC_USART1CLKSOURCE_SYSCLK;
+#endif
         if (HAL_RCCEx_PeriphCLKConfig(&PeriphClkInitStruct) != HAL_OK) {
             Error_Handler();
         }
@@ -541,7 +629,11 @@ void HAL_UART_MspInit(UART_HandleTypeDef* uartHandle)
 
         // Initializes the peripherals clocks
         PeriphClkInitStruct.PeriphClockSelection = RCC_PERIPHCLK_USART2;
+#if CLOCK_GOVERNOR
+        PeriphClkInitStruct.Usart2ClockSelection = RCC_USART2CLKSOURCE_HSI;
+#else
         PeriphClkInitStruct.Usart2ClockSelection = RCC_USART2CLKSOURCE_SYSCLK;
+#endif
         if (HAL_RCCEx_PeriphCLKConfig(&PeriphClkInitStruct) != HAL_OK) {
             Error_Handler();
         }
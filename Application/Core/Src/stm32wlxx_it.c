@@ -26,6 +26,8 @@ extern UART_HandleTypeDef huart1;
 extern UART_HandleTypeDef huart2;
 extern RTC_HandleTypeDef hrtc;
 extern CRYP_HandleTypeDef hcryp;
+extern DMA_HandleTypeDef hdma_aes_in;
+extern DMA_HandleTypeDef hdma_aes_out;
 extern RNG_HandleTypeDef hrng;
 
 // Forwards
@@ -148,6 +150,14 @@ void USART2_TX_DMA_IRQHandler(void)
 {
     HAL_DMA_IRQHandler(&hdma_usart2_tx);
 }
+void AES_IN_DMA_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_aes_in);
+}
+void AES_OUT_DMA_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_aes_out);
+}
 
 // ADC Interrupt
 void ADC_IRQHandler(void)
@@ -4,6 +4,8 @@
 
 #include "main.h"
 #include "timer_if.h"
+#include "stm32_lpm.h"
+#include "utilities_def.h"
 #include "stm32wlxx_ll_rtc.h"
 
 extern RTC_HandleTypeDef hrtc;
@@ -69,8 +71,15 @@ static bool RTC_Initialized = false;
 // RtcTimerContext
 static uint32_t RtcTimerContext = 0;
 
+// Timer on which a delay sleeps
+static UTIL_TIMER_Object_t delayTimer;
+static bool delayTimerCreated = false;
+static volatile bool delayElapsed = false;
+
 // Forwards
 static inline uint32_t GetTimerTicks(void);
+static bool delayCanSleep(void);
+static void delayTimerEvent(void *context);
 static void TIMER_IF_BkUp_Write_MSBticks(uint32_t MSBticks);
 static uint32_t TIMER_IF_BkUp_Read_MSBticks(void);
 
@@ -207,9 +216,53 @@ uint32_t TIMER_IF_Convert_Tick2ms(uint32_t tick)
     return ((uint32_t)((((uint64_t)(tick)) * 1000) >> RTC_N_PREDIV_S));
 }
 
-// Delay
+// Whether the caller of a delay can sleep through it, which requires the timer server and
+// interrupts, and that we not be in an interrupt handler
+static bool delayCanSleep()
+{
+    return (RTC_Initialized && __get_PRIMASK() == 0 && __get_IPSR() == 0);
+}
+
+// The delay timer has expired
+static void delayTimerEvent(void *context)
+{
+    delayElapsed = true;
+}
+
+// Delay, sleeping on an RTC alarm if the delay is long enough to be worth it and the caller
+// can sleep, or else spinning.  SysTick is suspended while asleep, so the HAL tick is
+// advanced by the time slept for the sake of those timing loops that use HAL_GetTick().
 void TIMER_IF_DelayMs(uint32_t delay)
 {
+    if (delay >= LOW_POWER_DELAY_MIN_MS && delayCanSleep()) {
+        if (!delayTimerCreated) {
+            UTIL_TIMER_Create(&delayTimer, 0xFFFFFFFFU, UTIL_TIMER_ONESHOT, delayTimerEvent, NULL);
+            delayTimerCreated = true;
+        }
+        uint32_t beganTick = HAL_GetTick();
+        int64_t beganMs = TIMER_IF_GetTimeMs();
+        delayElapsed = false;
+        UTIL_TIMER_SetPeriod(&delayTimer, delay);
+        UTIL_TIMER_Start(&delayTimer);
+
+        // Test for expiry with interrupts masked so that the alarm can't slip in between the
+        // test and the WFI, and unmask them after each wakeup so the handler can run
+        __disable_irq();
+        while (!delayElapsed) {
+            bool shortWait = (UTIL_TIMER_GetFirstRemainingTime() < LOW_POWER_STOP_MIN_MS);
+            UTIL_LPM_SetStopMode((1 << CFG_LPM_IDLE_Id), shortWait ? UTIL_LPM_DISABLE : UTIL_LPM_ENABLE);
+            UTIL_LPM_EnterLowPower();
+            __enable_irq();
+            __disable_irq();
+        }
+        uint32_t sleptMs = (uint32_t) (TIMER_IF_GetTimeMs() - beganMs);
+        if (HAL_GetTick() - beganTick < sleptMs) {
+            uwTick = beganTick + sleptMs;
+        }
+        __enable_irq();
+        return;
+    }
+
     uint32_t delayTicks = TIMER_IF_Convert_ms2Tick(delay);
     uint32_t timeout = GetTimerTicks();
     while (((GetTimerTicks() - timeout)) < delayTicks) {
@@ -68,10 +68,13 @@ void vcom_Trace(uint8_t *p_data, uint16_t size)
     MX_DBG((const char *)p_data, (size_t)size, 100);
 }
 
-// Trace with DMA
+// Trace with DMA, or on an LPUART that drains through STOP2 with interrupts, without waiting
+// because the trace buffer isn't reused until the transmit complete callback
 UTIL_ADV_TRACE_Status_t vcom_Trace_DMA(uint8_t *p_data, uint16_t size)
 {
-    MX_DBG((const char *)p_data, (size_t)size, 100);
+    if (!MX_DBG_Async((const char *)p_data, (size_t)size)) {
+        MX_DBG((const char *)p_data, (size_t)size, 100);
+    }
     return UTIL_ADV_TRACE_OK;
 }
 
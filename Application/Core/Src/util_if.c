@@ -9,6 +9,13 @@
 #include "stm32_adv_trace.h"
 #include "utilities_def.h"
 
+// Forwards
+void radioReceivedTask(void);
+#if LOG_DEFERRED
+void logDeferredTask(void);
+void logDeferredResume(void);
+#endif
+
 // Initializes ST's utility packages
 void MX_UTIL_Init(void)
 {
@@ -19,6 +26,15 @@ void MX_UTIL_Init(void)
     // Initialize the trace terminal
     UTIL_ADV_TRACE_Init();
     UTIL_ADV_TRACE_SetVerboseLevel(VERBOSE_LEVEL);
+#if LOG_DEFERRED
+    UTIL_SEQ_RegTask((1 << CFG_SEQ_Task_Log_Drain), UTIL_SEQ_RFU, logDeferredTask);
+#endif
+    UTIL_SEQ_RegTask((1 << CFG_SEQ_Task_ADC_Sampled), UTIL_SEQ_RFU, MX_ADC_SampledTask);
+    UTIL_SEQ_RegTask((1 << CFG_SEQ_Task_I2C2_Completed), UTIL_SEQ_RFU, MY_I2C2_CompletedTask);
+    UTIL_SEQ_RegTask((1 << CFG_SEQ_Task_Radio_Received), UTIL_SEQ_RFU, radioReceivedTask);
+#if DEBUGGER_ON
+    UTIL_SEQ_RegTask((1 << CFG_SEQ_Task_Console), UTIL_SEQ_RFU, traceInput);
+#endif
 
     // Init low power manager
     UTIL_LPM_Init();
@@ -34,8 +50,38 @@ void MX_UTIL_Init(void)
 
 }
 
-// Redefines __weak function in stm32_seq.c such to enter low power
+// Redefines __weak function in stm32_seq.c such to enter low power.  Standby is never used
+// because RAM must be retained, so the choice is between STOP2 and, when the next timer is
+// due too soon for STOP2 to pay off, sleep.  Idle time is first used to top up the
+// entropy pool, after which the sequencer will come back around to idle again.
 void UTIL_SEQ_Idle(void)
 {
+    if (MY_RandomRefillDue()) {
+        MY_RandomRefill();
+        return;
+    }
+    bool shortWait = (UTIL_TIMER_GetFirstRemainingTime() < LOW_POWER_STOP_MIN_MS);
+    UTIL_LPM_SetStopMode((1 << CFG_LPM_IDLE_Id), shortWait ? UTIL_LPM_DISABLE : UTIL_LPM_ENABLE);
     UTIL_LPM_EnterLowPower();
 }
+
+// Redefines __weak function in stm32_adv_trace.c so that STOP2, which would halt the
+// UART's DMA, isn't entered while trace output is being transmitted, unless it's on an
+// LPUART that keeps draining through STOP2
+void UTIL_ADV_TRACE_PreSendHook(void)
+{
+#if !(DEBUGGER_ON_LPUART1 && DEBUGGER_LPUART1_STOP2)
+    UTIL_LPM_SetStopMode((1 << CFG_LPM_UART_TX_Id), UTIL_LPM_DISABLE);
+#endif
+}
+
+// Redefines __weak function in stm32_adv_trace.c, allowing STOP2 once trace output is sent
+void UTIL_ADV_TRACE_PostSendHook(void)
+{
+#if !(DEBUGGER_ON_LPUART1 && DEBUGGER_LPUART1_STOP2)
+    UTIL_LPM_SetStopMode((1 << CFG_LPM_UART_TX_Id), UTIL_LPM_ENABLE);
+#endif
+#if LOG_DEFERRED
+    logDeferredResume();
+#endif
+}
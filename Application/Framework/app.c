@@ -16,7 +16,6 @@ States_t CurrentStateCore = LOWPOWER;
 bool ListenPhaseBeforeTalk = false;
 bool ButtonEventOccurred = false;
 bool TimerEventOccurred = false;
-bool TraceEventOccurred = false;
 
 // Running sequence of request IDs issued to the gateway
 uint32_t LastRequestID = 0;
@@ -26,7 +25,7 @@ uint8_t wildcardAddress[ADDRESS_LEN] = {0};
 uint8_t invalidAddress[ADDRESS_LEN] = {0};
 uint8_t ourAddress[ADDRESS_LEN];
 char ourAddressText[ADDRESS_LEN*3];
-uint8_t lastReceivedSensorAddress[ADDRESS_LEN] = {0};
+int lastReceivedPeerHandle = -1;
 uint8_t gatewayAddress[ADDRESS_LEN] = {0};
 uint8_t beaconKey[AES_KEY_BYTES];
 uint8_t invalidKey[AES_KEY_BYTES] = {0};
@@ -36,9 +35,11 @@ char sensorName[SENSOR_NAME_MAX] = {0};
 uint16_t batteryMillivolts = 0;
 
 // Time Windowing
-uint16_t twLBTRetries = 10;
+uint16_t twLBTRetries = TW_LBT_RETRIES;
 uint16_t twLBTRetriesRemaining;
 uint32_t twLastActiveSensors = 0;
+uint32_t twLastSlotUnits = 0;
+uint32_t twAirtimePeriodBegan = 0;
 uint32_t TWModulusSecs = 0;
 uint16_t TWModulusOffsetSecs = 0;
 uint16_t TWSlotBeginsSecs = 0;
@@ -48,27 +49,126 @@ uint16_t TWListenBeforeTalkMs = 0;
 uint32_t twSlotBeginsTime;
 uint32_t twSlotExpiresTime;
 bool twForceIgnore = false;
+uint8_t twSlotChannel = 0;
+bool gatewayListenHopping = false;
 bool twSlotExpiresTimeWasValid;
+uint8_t TWUrgentPeriodSecs = 0;
+uint8_t TWUrgentSecs = 0;
+uint16_t twNowSubsecondMs = 0;
 static UTIL_TIMER_Object_t twSleepTimer;
 
+// Offset from the local millisecond timer to Unix epoch milliseconds, or 0 if not yet known,
+// as of the local time at which it was last synchronized, and the rate at which the local
+// timer has been learned to drift from the gateway's in parts per billion
+int64_t timeSyncOffsetMs = 0;
+int64_t timeSyncLocalMs = 0;
+int32_t timeSyncDriftPpb = 0;
+bool timeSyncDriftLearned = false;
+
+// Gateway's clock, kept by the RTC and set from the Notecard's time now and then
+bool timeClockSynced = false;
+uint32_t timeClockSyncedTime = 0;
+
+// Sensor state retained across resets in the RTC backup registers that follow those used by timer_if.c
+#define SNAPSHOT_MAGIC          0x534E0002
+#define SNAPSHOT_FIRST_REGISTER RTC_BKP_DR3
+enum {
+    SNAPSHOT_MAGIC_WORD,
+    SNAPSHOT_CHECK_WORD,
+    SNAPSHOT_GATEWAY_WORD,
+    SNAPSHOT_REQUEST_ID_WORD,
+    SNAPSHOT_MODULUS_WORD,
+    SNAPSHOT_OFFSET_LBT_WORD,
+    SNAPSHOT_SLOT_WORD,
+    SNAPSHOT_CHANNEL_WORD,
+    SNAPSHOT_BROADCAST_WORD,
+    SNAPSHOT_ATP_WORD,
+    SNAPSHOT_WORDS = SNAPSHOT_ATP_WORD + ATP_SNAPSHOT_WORDS
+};
+
+// Sensor's schedule for receiving the gateway's response
+static UTIL_TIMER_Object_t rxSleepTimer;
+uint32_t sensorResponseDelayMs = 0;
+int64_t sensorResponseAckMs = 0;
+int64_t sensorHoldOffUntilMs = 0;              // The gateway asked that no request be sent before then
+uint32_t twNotBeforeTime = 0;                   // A busy gateway asked that our retry wait until then
+int64_t sensorResponseExpectedMs = 0;
+uint32_t sensorResponseJitterMs = 0;
+bool sensorResponseWindowPending = false;
+bool sensorResponseWindowShort = false;
+bool sensorResponseWindowMissed = false;
+
+// Sensor's estimate of the round trip to its gateway, for its ACK timeout
+uint32_t sensorSrttMs = 0;
+uint32_t sensorRttvarMs = 0;
+uint8_t sensorRtoBackoff = 0;
+int64_t sensorAckWaitBeganMs = 0;
+bool sensorAckAwaited = false;
+bool sensorRttSampling = false;
+bool sensorRttResent = false;
+uint32_t sensorRetryBackoffMs = 0;
+
+// Sensor's measure of how long its exchanges take, for chaining requests within its slot
+int64_t sensorExchangeBeganMs = 0;
+uint32_t sensorExchangeMs = 0;
+bool sensorExchangeChainable = false;
+
+// Sensor's last check-in in response to a wakeup from the gateway
+bool sensorCheckedIn = false;
+int64_t sensorCheckInMs = 0;
+
+// Sensor's copy of the gateway's broadcast key, and the time of the last broadcast accepted
+uint8_t sensorBroadcastKey[AES_KEY_BYTES] = {0};
+bool sensorHasBroadcastKey = false;
+uint32_t sensorLastBroadcastTime = 0;
+
+// Sensor's copy of the fields of the gateway's last full ACK, against which it accepts deltas
+gatewayAckBody sensorAckConfig;
+uint16_t sensorAckConfigVersion = 0;
+
+// Whether the gateway has shown, by sending us the extended ACK, that it's on firmware that
+// acknowledges windows of chunks
+bool sensorGatewayExtended = false;
+
 // Sent message state
 uint32_t sensorSendRetriesRemaining;
 uint32_t messageToSendRequestID;
 uint8_t messageToSendFlags;
+bool messageToSendDelta = false;
 uint8_t messageToSendRSSI;
 uint8_t messageToSendSNR;
 uint8_t *messageToSendData;
 uint32_t messageToSendDataLen;
 bool messageToSendDataDealloc;
 uint32_t messageToSendAcknowledgedLen;
+uint32_t messageToSendOffset;
+uint32_t messageToSendSackMap;
+uint32_t messageToSendBurstChunks;
+bool messageToSendBurstContinues;
 int64_t sentMessageMs;
 uint16_t sentMessageCarrierLen;
 wireMessageCarrier sentMessageCarrier;
-wireMessage sentMessage;
+
+// What's still needed of the message last sent once it has been encrypted in place within
+// the carrier
+typedef struct {
+    uint8_t Flags;
+    uint8_t Len;
+    uint32_t Offset;
+    uint32_t TotalLen;
+    uint32_t RequestID;
+} sentMessageHeader;
+sentMessageHeader sentMessage;
+uint8_t *sentFrame = (uint8_t *) &sentMessageCarrier;
+static uint8_t sentShortFrame[sizeof(wireMessageCarrier)];
+static uint8_t sentShortMessage[sizeof(wireMessage)];
+bool sentCompactAckExpected = false;
+bool sentGroupAck = false;
 
 // Received message state
 wireMessageCarrier wireReceivedCarrier;
 wireMessage wireReceived;
+int wireReceivedPeerHandle = -1;
 uint32_t wireReceivedLen;
 uint32_t wireReceiveTimeoutMs;
 
@@ -86,23 +186,194 @@ typedef struct {
     uint16_t sensorMv;
     uint16_t twSlotBeginsSecs;
     uint16_t twSlotEndsSecs;
+    uint8_t twSlotChannel;
+    uint16_t ackedConfigVersion;    // ConfigVersion of our last full ACK, while the sensor accepts deltas
     uint32_t lastReceivedTime;
     uint8_t sensorAddress[ADDRESS_LEN];
     uint32_t currentRequestID;
     uint32_t lastProcessedRequestID;
     uint32_t lastProcessedRequestIDForAck;
+    uint32_t recentRequestIDs[GATEWAY_RECENT_REQUESTS];  // Completed requests, most recent first
     uint32_t requestsProcessed;
     uint32_t requestsLost;
     uint8_t *data;
     uint32_t dataTotalLen;
     uint32_t dataAcknowledgedLen;
+    uint32_t dataReceivedMap;
+    uint8_t dataChunkLen;           // Chunk size in which dataReceivedMap is expressed
+    bool windowAckPending;
+    int64_t windowAckPendingMs;     // When the chunk awaiting our window ACK arrived
+    uint16_t lruPrev;
+    uint16_t lruNext;
+    int peerHandle;
+    bool dbDirty;                   // Stats have changed since sensors.db was last updated
+    uint32_t responseLatencyMs;     // Smoothed time from final ACK to response, for the sensor's RX window
+    uint32_t airtimeMs;             // Airtime used by exchanges with the sensor this period
+    uint32_t airtimeAvgMs;          // Smoothed airtime used per period
+    bool airtimeTracked;            // The sensor was cached for all of this period
+    bool airtimeMeasured;           // airtimeAvgMs reflects at least one full period
+    bool wakePending;               // The sensor should be woken to check in
+    atpModel downlinkLoss;          // Path loss to the sensor, for choosing our transmit power
+    atpLink uplinkLink;             // How often the sensor's frames arrive garbled, for choosing the coding rate
+    bool relayed;                   // The sensor's last frame reached us through its relay
+    bool ours;                      // The entry is for the gateway itself rather than a sensor
+    atpModel downlinkNoise;         // Noise floor at the sensor
+    int64_t requestBeganMs;         // When the first chunk of the current request arrived
+    int64_t rateAheadMs;            // How far the sensor's requests are ahead of its allowance, as a time
+    bool responseInAck;             // Our final ACK, now being sent, carries the response
+    bool responsePending;           // The response is ready to follow our final ACK
+    statsLatency latency;           // From the creation of its requests until the Notecard took them
+    uint32_t expectedTime;          // When the sensor's next activation is due, as it advertised, or 0
+    uint32_t expectedPeriodSecs;    // The shortest activation period of its periodic apps
+    bool late;                      // It missed the slot after it was due, and hasn't been heard since
+    bool busy;                      // Its current request was turned away for want of memory
+    bool extendedAck;               // Its last frame was marked as taking the extended ACK
 } requestState;
 requestState requestCache[MAX_CACHED_SENSORS] = {0};
-uint8_t cachedSensors = 0;
+uint16_t cachedSensors = 0;
+
+// Responses recently sent to sensors, kept so that a retried request can be answered again
+typedef struct {
+    uint8_t sensorAddress[ADDRESS_LEN];
+    uint32_t requestID;
+    uint8_t *data;
+    uint32_t dataLen;
+    uint32_t lastUsed;
+} cachedResponse;
+cachedResponse responseCache[GATEWAY_RESPONSE_CACHE] = {0};
+uint32_t responseCacheUses = 0;
+
+// Index of the request cache, keyed on sensor address.  Entries in requestCache[] never
+// move once allocated; the hash table and the LRU list refer to them by index+1 so that
+// zero always means "none".
+uint16_t requestCacheHash[REQUEST_CACHE_HASH_SLOTS] = {0};
+_Static_assert((REQUEST_CACHE_HASH_SLOTS & (REQUEST_CACHE_HASH_SLOTS-1)) == 0
+               && REQUEST_CACHE_HASH_SLOTS >= 2*MAX_CACHED_SENSORS,
+               "REQUEST_CACHE_HASH_SLOTS must be a power of two at least twice MAX_CACHED_SENSORS");
+uint16_t requestCacheLRUHead = 0;
+uint16_t requestCacheLRUTail = 0;
+
+// The request cache entry of each paired sensor, by peer handle as index+1, so that a frame
+// whose sender has been identified finds its entry without comparing addresses.  Peer handles
+// are stable, and there may be more of them than cached sensors, but never MAX_PEER_HANDLES.
+uint16_t requestCacheByPeer[MAX_PEER_HANDLES] = {0};
+
+// Compact copy of the request cache that is kept in flash, so that the gateway comes back from a
+// reboot or DFU with the same slot plan and duplicate detection.  The header is followed by a
+// record for each cached sensor, least recently used first.  The last two requests that a
+// sensor completed are also its lastProcessedRequestID and lastProcessedRequestIDForAck.
+#define GATEWAY_SNAPSHOT_VERSION    1
+typedef struct {
+    uint16_t version;
+    uint16_t recordLen;
+    uint16_t records;
+    uint16_t modulusOffsetSecs;
+    uint32_t modulusSecs;
+    uint32_t dutyStretchPercent;
+    uint32_t airtimePeriodBegan;
+    uint32_t lastActiveSensors;
+    uint32_t lastSlotUnits;
+    uint32_t lastNeighborUnits;
+    uint32_t lastPrecedingUnits;
+    uint32_t lastHadNeighbors;
+} gatewaySnapshotHeader;
+#define GATEWAY_SNAPSHOT_MEASURED   0x01
+#define GATEWAY_SNAPSHOT_DB_DIRTY   0x02
+typedef struct {
+    uint8_t sensorAddress[ADDRESS_LEN];
+    uint32_t lastReceivedTime;
+    uint32_t recentRequestIDs[GATEWAY_RECENT_REQUESTS];
+    uint32_t requestsProcessed;
+    uint32_t requestsLost;
+    uint32_t airtimeAvgMs;
+    uint16_t twSlotBeginsSecs;
+    uint16_t twSlotEndsSecs;
+    uint8_t twSlotChannel;
+    uint8_t flags;                  // GATEWAY_SNAPSHOT_*
+    int8_t gatewayRSSI;
+    int8_t gatewaySNR;
+} gatewaySnapshotRecord;
+_Static_assert((sizeof(gatewaySnapshotHeader) % sizeof(uint64_t)) == 0, "snapshot header must be whole doublewords");
+_Static_assert((sizeof(gatewaySnapshotRecord) % sizeof(uint64_t)) == 0, "snapshot record must be whole doublewords");
+bool gatewaySnapshotDirty = false;
+int64_t gatewaySnapshotMs = 0;
 
 // Sensor database update info
 bool forceSensorRefresh = false;
 
+// Sensor requests waiting to be performed against the Notecard in the background.  Those
+// that overflow the queue are kept in the outbound store in flash, each prefixed by the
+// sensor's address and request ID, and brought into the queue in turn as it drains.
+typedef struct {
+    uint8_t sensorAddress[ADDRESS_LEN];
+    uint32_t requestID;
+    uint8_t *data;
+    uint32_t dataLen;
+    uint32_t offset;                // Where the next request to perform within a batch begins
+    bool stored;                    // It's in the outbound store until it has been performed
+    int64_t queuedMs;
+    int64_t originMs;               // When the sensor created it, or 0 if not known
+} notecardQueueEntry;
+notecardQueueEntry notecardQueue[GATEWAY_NOTECARD_QUEUE_MAX];
+uint32_t notecardQueued = 0;
+uint32_t notecardStoreLoaded = 0;   // Requests in the outbound store that are also in the queue
+#define NOTECARD_STORE_PREFIX       (ADDRESS_LEN+sizeof(uint32_t))
+static UTIL_TIMER_Object_t notecardWaitTimer;
+bool notecardWaitPending = false;
+uint32_t notecardRetryMs = 0;
+int64_t notecardDeferredMs = 0;     // When the task began holding off for an exchange, or 0
+int64_t gatewayExchangeUntilMs = 0; // When the frame that we're waiting for from a sensor is due
+
+// Spreading factor that the gateway's most recent ACK told the sensor to use
+uint8_t gatewayAckedSpreadingFactor = 0;
+uint8_t gatewayAckedCodingRate = 0;
+
+// Spreading factor that the gateway left when it last switched, until the sensor is heard at
+// the new one, because a sensor that missed the ACK resends at the old one
+bool gatewaySwitchUnconfirmed = false;
+uint8_t gatewaySwitchFromSpreadingFactor = 0;
+uint8_t gatewaySwitchFromCodingRate = 0;
+
+// Response that the final ACK being prepared may carry
+bool gatewayAckResponseReady = false;
+uint8_t *gatewayAckResponse = NULL;
+uint32_t gatewayAckResponseLen = 0;
+
+// Other gateways heard announcing themselves on our channel
+typedef struct {
+    uint8_t address[ADDRESS_LEN];
+    uint32_t modulusSecs;
+    uint16_t modulusOffsetSecs;
+    uint16_t slotUnits;
+    uint32_t lastHeardTime;
+} gatewayNeighbor;
+gatewayNeighbor gatewayNeighbors[GATEWAY_NEIGHBORS_MAX] = {0};
+uint32_t gatewayNextAnnounceTime = 0;
+uint8_t gatewayBroadcastKey[AES_KEY_BYTES] = {0};
+bool gatewayBroadcastPending = true;
+uint32_t gatewayNextBroadcastTime = 0;
+bool twLastHadNeighbors = false;
+uint32_t twLastNeighborUnits = 0;
+uint32_t twLastPrecedingUnits = 0;
+uint32_t twDutyStretchPercent = 100;
+
+// Receive trouble heard by the gateway, counted by slot position within the modulus over the
+// airtime period and then folded into a running average per period, along with the slots
+// that are being left empty because the trouble in them has become chronic
+#define TW_HEAT_SLOTS 32
+uint16_t twHeatEvents[TW_HEAT_SLOTS] = {0};
+uint16_t twHeatAvg[TW_HEAT_SLOTS] = {0};
+uint32_t twAvoidMask = 0;
+uint32_t twAvoidedSlots = 0;
+
+// A beacon whose ACK is being held back in favor of less-loaded gateways, for which
+// the sensor extends the time that it waits for the beacon's ACK
+bool pairDeferring = false;
+bool pairDeferYielded = false;
+int64_t pairDeferUntilMs;
+uint8_t pairDeferAddress[ADDRESS_LEN];
+uint8_t pairDeferKey[AES_KEY_BYTES];
+
 // Sensor's response state when communicating with gateway
 typedef struct {
     bool sendingRequest;
@@ -116,67 +387,204 @@ typedef struct {
 } responseState;
 responseState response = {0};
 
+// Sensor's outbound request queue.  Requests go out in the order in which they were queued,
+// except that urgent requests go ahead of all others, and that a request needing a response
+// goes out at once when nothing is queued, so it may overtake notes stored in flash after an
+// earlier failure, which go out as the store drains.  An app that queued a request without
+// asking for a response is told of it only if it is lost, rather than delivered or stored.
+typedef struct {
+    uint8_t *reqData;
+    uint32_t reqDataLen;
+    bool responseRequested;
+    int appID;
+    uint8_t priority;
+    int64_t queuedMs;
+} queuedRequest;
+queuedRequest sensorQueue[SENSOR_QUEUE_MAX_REQUESTS];
+uint16_t sensorQueued = 0;
+bool sensorRequestInFlight = false;
+int sensorRequestAppID = -1;           // App on whose behalf the request in flight was sent
+bool sensorRequestUrgent = false;      // The request in flight is sent in the gateway's urgent windows
+uint32_t sensorRequestAppRequestID = 0;
+bool sensorRequestStorable = false;    // The request in flight is to be stored if the gateway can't be reached
+uint32_t sensorRequestStored = 0;      // Notes of the outbound store that the request in flight delivers
+int sensorRequestQueuedApps[SENSOR_QUEUE_MAX_REQUESTS];   // Apps that queued each entry of the request in flight
+uint16_t sensorRequestQueuedAppCount = 0;
+int64_t sensorRequestCreatedMs = 0;    // When the request about to be sent was created, or 0 if not known
+bool sensorGatewayReachable = true;    // The most recent exchange with the gateway succeeded
+
 // Forwards
 void gatewayWaitForSensorMessage(void);
 void gatewayWaitForAnySensorMessage(void);
+void gatewayWaitForSensorChunk(void);
+void gatewaySendAck(requestState *request, bool beacon);
+void gatewaySendAckFrame(requestState *request, bool beacon, uint8_t *ack);
+void gatewaySendCompactAck(requestState *request, uint16_t peerID);
+bool gatewaySendGroupAck(void);
+uint16_t gatewayAckConfigVersion(gatewayAckBody *body);
+void gatewayRespondInAck(requestState *request);
+requestState *gatewayWindowAckDue(void);
+void gatewayChargeRequest(requestState *request);
+uint32_t gatewayRequestBytesHeld(void);
+uint16_t gatewayRetryAfterSecs(requestState *request);
+void gatewayPairSensor(requestState *request, uint8_t *key);
+uint32_t gatewayPairDeferMs(void);
+void gatewayPairDeferContinue(bool expired);
+bool gatewayAnnounceDue(void);
+void gatewayAnnounce(void);
+requestState *gatewayWakeDue(void);
+void gatewayWake(requestState *request);
+void gatewayBroadcastKeyInit(void);
+bool gatewayBroadcastDue(void);
+void gatewayBroadcast(void);
+bool gatewayNeighborHeard(void);
+bool gatewayNeighborLoad(uint32_t *neighborUnits, uint32_t *precedingUnits);
+requestState *requestCacheLookup(uint8_t *address, bool *created);
+requestState *requestCacheLookupPeer(int handle, uint8_t *address, bool *created);
+void requestCacheSetPeer(requestState *request, int handle);
+requestState *requestCacheMRU(void);
+uint32_t requestCacheHashSlot(uint8_t *address);
+void requestCacheHashInsert(uint16_t entry);
+void requestCacheHashRemove(uint16_t entry);
+void requestCacheLRUUnlink(uint16_t entry);
+void requestCacheLRUPushHead(uint16_t entry);
 void sensorWaitForGatewayMessage(void);
 void sensorWaitForGatewayResponse(void);
 void sensorSendToGateway(bool responseRequested, uint8_t *message, uint32_t length, bool dealloc);
+void sensorTransmitToGateway(bool responseRequested, uint8_t *message, uint32_t length, bool dealloc);
+void sensorAgeStamp(uint8_t *message);
+int sensorRequestApp(uint32_t requestID);
+void sensorQueueRemove(uint16_t count);
 bool sensorResendToGateway(void);
 void sendToPeer(bool useTW, uint8_t flags, int8_t rssi, int8_t snr, uint8_t *toAddress, uint32_t requestID,
                 uint8_t *message, uint32_t length, bool dealloc);
 void sendMessageToPeer(bool useTW, uint8_t *toAddress);
+bool windowNextChunk(uint32_t offset, uint32_t *nextOffset);
+bool sendWindowContinue(uint8_t *toAddress);
 bool sendTimeout(void);
+uint32_t sensorAckTimeoutMs(void);
+void sensorRttSample(void);
 void freeMessageToSendBuffer(void);
 void restartReceive(uint32_t timeoutMs);
 bool validateReceivedMessage(void);
 void processSensorRequest(requestState *request, bool respond);
+void gatewayPerformRequest(requestState *request, bool respond, int64_t beganMs);
+bool gatewayNotecardEnqueue(uint8_t *sensorAddress, uint32_t requestID, uint8_t *data, uint32_t dataLen, int64_t originMs);
+void gatewaySensorLatency(uint8_t *sensorAddress, int64_t originMs);
+requestState *requestCacheFind(uint8_t *address);
+uint32_t gatewayRequestAge(uint8_t *data, uint32_t *len);
+void gatewayCalendarLearn(requestState *request, uint8_t *data, uint32_t *len);
+void gatewayCalendarHeard(requestState *request);
+void gatewayCalendarUpdate(void);
+bool gatewayCalendarSkips(requestState *request, uint32_t slotEndsTime);
+bool gatewayCalendarDueSoon(requestState *request);
+bool gatewayNotecardStore(uint8_t *sensorAddress, uint32_t requestID, uint8_t *data, uint32_t dataLen);
+void gatewayNotecardLoad(void);
+bool gatewayNotecardIdle(void);
+uint32_t gatewayNotecardDeferMs(void);
+void gatewayNotecardWaitEvent(void *context);
+void gatewayNotecardWait(uint32_t ms);
+bool gatewayNotecardRequestAt(notecardQueueEntry *entry, uint32_t offset, uint8_t **reqData, uint32_t *reqDataLen, uint32_t *nextOffset);
+uint32_t gatewayNotecardGather(char **lines, uint32_t *lineLen, uint32_t *endEntry, uint32_t *endOffset);
+void gatewayNotecardDequeueDone(void);
+void sensorRequestProcessed(requestState *request);
+bool sensorRequestRecentlyProcessed(requestState *request);
+void responseCacheStore(requestState *request);
+bool responseCacheTake(requestState *request, uint8_t **data, uint32_t *dataLen);
+void responseCacheRelease(requestState *request, uint32_t requestID);
 bool lbtListenBeforeTalk(void);
 void lbtTalk(void);
 void twRefresh(void);
+uint32_t twSlotUnits(requestState *request);
+void twHeatFold(void);
+uint32_t twSlotPlace(uint32_t logicalSecs);
+uint8_t twSensorTransmitChannel(void);
+uint8_t twGatewayListenChannel(uint32_t *listenMs);
+bool twUrgentWindow(uint32_t periodSecs, uint32_t windowSecs, uint32_t *edgeSecs);
+uint32_t appNextUrgentWindowDueMs(void);
 void twOpenEvent(void *context);
-uint32_t twMinimumModulusSecs(void);
+void rxWindowEvent(void *context);
+void sensorOpenResponseWindow(void);
+void sensorResponseArrived(void);
+uint32_t sensorResponseGuardMs(void);
+void sensorSniff(void);
+void sensorSniffReceived(bool received);
+void sensorCheckIn(void);
+void sensorBroadcastKeyLearned(uint8_t *key);
+bool sensorAckBroadcastKey(uint8_t **key);
+bool sensorAckReceivedChunks(uint32_t ackedLen, uint32_t sackBitmap);
+bool sensorAckIsDelta(void);
+bool sensorAckExtended(void);
+void sensorAckName(char *name, uint32_t nameLen);
+gatewayAckBody *sensorAckExpand(bool *configKnown);
+uint32_t sensorAckResponse(uint8_t **rsp);
+void sensorResponseCarried(uint8_t *rsp, uint32_t rspLen);
+void sensorProcessResponse(void);
+void sensorExchangeCompleted(void);
+void sensorStoreRequest(void);
+void sensorQueuedRequestLost(uint16_t entry);
+bool sensorStoreDrainDue(void);
+bool sensorStoreDrain(void);
+bool sensorSlotChainable(void);
+void sensorBroadcastReceived(void);
+void sensorGatewayBootTime(uint32_t bootTime);
+void sensorGatewayResync(void);
+void sensorGatewayTime(uint32_t time, uint16_t timeMs, int16_t zoneOffsetMins, uint8_t *zoneName);
+uint32_t gatewayTransmitTime(uint32_t delayMs, uint16_t *timeMs);
+void sensorLearnDrift(int64_t offsetMs, int64_t localMs);
+uint32_t sensorLocalMs(uint32_t ms);
+void sensorGatewaySchedule(uint32_t modulusSecs, uint16_t modulusOffsetSecs, uint16_t slotBeginsSecs,
+                           uint16_t slotEndsSecs, uint16_t lbtMs, uint8_t channel);
+void appSwitchSpreadingFactor(uint8_t sf, uint8_t cr);
 void sensorCoreIdle(void);
+void sensorSnapshotSave(void);
+void sensorSnapshotRestore(void);
 void sensorGatewayRequestFailure(bool wasTX, const char *why);
+void sensorGatewayBusy(uint16_t retryAfterSecs);
+void sensorGatewayGiveUp(bool store);
 void showReceivedTime(char *msg, uint32_t beginSecs, uint32_t endSecs);
+void gatewayLogPacket(uint8_t outcome, uint32_t latencyMs);
 
 // Set the current application state, potentially from an ISR
 void appSetCoreState(States_t newState)
 {
 
-#ifdef TRACE_STATE
-    APP_PRINTF("SET %d\r\n", newState);
-#endif
+    TRACE_PRINTF(TRACE_APP, VLEVEL_H, "SET %d\r\n", newState);
 
-    // Set the application-level state for the next time we're scheduled
+    // Set the application-level state for the next time we're scheduled, and have the
+    // gateway's housekeeping yield to whatever the radio has for us
     CurrentStateCore = newState;
+    TIMELINE(TIMELINE_CORE, 0, newState);
+    if (appIsGateway && newState != LOWPOWER) {
+        gatewayHousekeepingDefer();
+    }
 
     // Wake up the scheduler
     if (newState != LOWPOWER) {
-        UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Sparrow_Process), CFG_SEQ_Prio_0);
+        UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Sparrow_Process), CFG_SEQ_Prio_Radio);
     }
 
 }
 
-// Wake up the main task for timer processing
+// Wake up the console task, which runs below everything else so that typing never holds
+// off the radio
 void appTraceWakeup()
 {
-    TraceEventOccurred = true;
-    UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Sparrow_Process), CFG_SEQ_Prio_0);
+    UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Console), CFG_SEQ_Prio_Console);
 }
 
-// Wake up the main task for timer processing
+// Wake up the event task for timer processing
 void appTimerWakeup()
 {
     TimerEventOccurred = true;
-    UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Sparrow_Process), CFG_SEQ_Prio_0);
+    UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Sparrow_Event), CFG_SEQ_Prio_Event);
 }
 
-// Wake up the main task for button processing
+// Wake up the event task for button processing
 void appButtonWakeup()
 {
     ButtonEventOccurred = true;
-    UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Sparrow_Process), CFG_SEQ_Prio_0);
+    UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Sparrow_Event), CFG_SEQ_Prio_Event);
 }
 
 // Free the send buffer
@@ -186,12 +594,14 @@ void freeMessageToSendBuffer(void)
     // Free the previously-allocated buffer
     if (messageToSendDataDealloc) {
         memset(messageToSendData, '?', messageToSendDataLen);
-        free(messageToSendData);
+        poolFree(messageToSendData);
     }
     messageToSendData = NULL;
     messageToSendDataLen = 0;
     messageToSendDataDealloc = false;
     messageToSendAcknowledgedLen = 0;
+    messageToSendOffset = 0;
+    messageToSendSackMap = 0;
 
 }
 
@@ -223,44 +633,87 @@ void sendToPeer(bool useTW, uint8_t flags, int8_t rssi, int8_t snr, uint8_t *toA
 void sendMessageToPeer(bool useTW, uint8_t *toAddress)
 {
 
-    // Format the header for the next chunk
+    // Unless we're continuing a window that's already in flight, begin a new
+    // window at the first chunk that hasn't yet been acknowledged by the peer.
+    if (!messageToSendBurstContinues) {
+        messageToSendOffset = messageToSendAcknowledgedLen;
+        messageToSendBurstChunks = 0;
+    }
+    messageToSendBurstContinues = false;
+    messageToSendBurstChunks++;
+
+    // Format the header for the next chunk directly within the carrier, where it is encrypted
+    // in place
+    wireMessage *msg = &sentMessageCarrier.Message;
     sentMessageCarrier.Version = MESSAGE_VERSION;
-    sentMessageCarrier.Algorithm = ((messageToSendFlags & MESSAGE_FLAG_BEACON) != 0) ? MESSAGE_ALG_CLEAR : MESSAGE_ALG_CTR;
-    sentMessage.Signature = MESSAGE_SIGNATURE;
-    sentMessage.Millivolts = batteryMillivolts;
-    sentMessage.TXP = atpPowerLevel();
-    sentMessage.LTP = atpLowestPowerLevel();
-    sentMessage.RSSI = messageToSendRSSI;
-    sentMessage.SNR = messageToSendSNR;
-    sentMessage.Flags = messageToSendFlags;
-    sentMessage.RequestID = messageToSendRequestID;
-    uint32_t left = messageToSendDataLen - messageToSendAcknowledgedLen;
-    if (messageToSendAcknowledgedLen > messageToSendDataLen) {
+    sentMessageCarrier.Algorithm = ((messageToSendFlags & (MESSAGE_FLAG_BEACON|MESSAGE_FLAG_GATEWAY)) != 0) ? MESSAGE_ALG_CLEAR : MESSAGE_ALG_CTR;
+    msg->Signature = MESSAGE_SIGNATURE;
+    msg->Millivolts = batteryMillivolts;
+    msg->TXP = atpPowerLevel();
+    msg->LTP = atpLowestPowerLevel();
+    msg->RSSI = messageToSendRSSI;
+    msg->SNR = messageToSendSNR;
+    msg->Flags = messageToSendFlags;
+    if (!appIsGateway && !sensorHasBroadcastKey && RADIO_SNIFF_PERIOD_MS != 0 && (messageToSendFlags & MESSAGE_FLAG_BEACON) == 0) {
+        msg->Flags |= MESSAGE_FLAG_KEY;
+    }
+    if (!appIsGateway) {
+        msg->Flags |= MESSAGE_FLAG_EXTENDED;
+    }
+    msg->RequestID = messageToSendRequestID;
+    uint32_t left = messageToSendDataLen - messageToSendOffset;
+    if (messageToSendOffset > messageToSendDataLen) {
         left = 0;
     }
-    sentMessage.Offset = messageToSendAcknowledgedLen;
-    sentMessage.Len = (left <= MESSAGE_MAX_BODY) ? (uint16_t) left : MESSAGE_MAX_BODY;
-    sentMessage.TotalLen = messageToSendDataLen;
+    msg->Offset = messageToSendOffset;
+    uint32_t chunkLen = radioChunkLen(0);
+    msg->Len = (left <= chunkLen) ? (uint16_t) left : chunkLen;
+    msg->TotalLen = messageToSendDataLen;
     memcpy(sentMessageCarrier.Sender, ourAddress, sizeof(sentMessageCarrier.Sender));
     memcpy(sentMessageCarrier.Receiver, toAddress, sizeof(sentMessageCarrier.Receiver));
-    if (sentMessage.Len) {
-        memcpy(sentMessage.Body, &messageToSendData[messageToSendAcknowledgedLen], sentMessage.Len);
+    if (msg->Len) {
+        memcpy(msg->Body, &messageToSendData[messageToSendOffset], msg->Len);
+    }
+
+    // A far sensor reaches its gateway through its relay, which readdresses what we send
+    uint8_t *relay = appIsGateway ? NULL : relayVia();
+    bool relaying = (relay != NULL && sentMessageCarrier.Algorithm == MESSAGE_ALG_CTR
+                     && memcmp(toAddress, gatewayAddress, ADDRESS_LEN) == 0);
+    if (relaying) {
+        memcpy(sentMessageCarrier.Receiver, relay, sizeof(sentMessageCarrier.Receiver));
+    }
+
+    // If the window permits another chunk to follow this one, tell the peer not to ACK it
+    uint32_t nextOffset;
+    if (windowNextChunk(msg->Offset + msg->Len, &nextOffset)) {
+        msg->Flags |= MESSAGE_FLAG_WINDOW;
     }
+    sentMessage.Flags = msg->Flags;
+    sentMessage.Len = msg->Len;
+    sentMessage.Offset = msg->Offset;
+    sentMessage.TotalLen = msg->TotalLen;
+    sentMessage.RequestID = msg->RequestID;
 
-    const char *m1 = "sending (";
+    const char *m1 = "sending";
     DEBUG_VARIABLE(m1);
     if ((messageToSendFlags & MESSAGE_FLAG_ACK)) {
         m1 = "sending ACK";
     } else if ((messageToSendFlags & MESSAGE_FLAG_BEACON)) {
         m1 = "sending BEACON";
+    } else if ((messageToSendFlags & MESSAGE_FLAG_GATEWAY)) {
+        m1 = "sending ANNOUNCEMENT";
+    } else if ((messageToSendFlags & MESSAGE_FLAG_WAKEUP)) {
+        m1 = "sending WAKEUP";
+    } else if ((messageToSendFlags & MESSAGE_FLAG_BROADCAST)) {
+        m1 = "sending BROADCAST";
     }
-    APP_PRINTF("%s %s (%d/%d) at txp:%d\r\n", tracePeer(), m1, sentMessage.Len, messageToSendDataLen, atpPowerLevel());
+    TRACE_EVENT(TRACE_RADIO, VLEVEL_L, m1, {"len", sentMessage.Len}, {"total", messageToSendDataLen}, {"txp", atpPowerLevel()});
 
     // Compute message length of actual message
-    uint16_t wireMessageLen = sizeof(sentMessage);
-    wireMessageLen -= sizeof(sentMessage.Padding);
-    wireMessageLen -= sizeof(sentMessage.Body);
-    wireMessageLen += sentMessage.Len;
+    uint16_t wireMessageLen = sizeof(wireMessage);
+    wireMessageLen -= sizeof(msg->Padding);
+    wireMessageLen -= sizeof(msg->Body);
+    wireMessageLen += msg->Len;
     uint16_t padRequired = (wireMessageLen % AES_PAD_BYTES) == 0 ? 0 : AES_PAD_BYTES - (wireMessageLen % AES_PAD_BYTES);
     sentMessageCarrier.MessageLen = wireMessageLen + padRequired;
     sentMessageCarrierLen = sizeof(sentMessageCarrier);
@@ -268,20 +721,39 @@ void sendMessageToPeer(bool useTW, uint8_t *toAddress)
     sentMessageCarrierLen += sentMessageCarrier.MessageLen;
     // Pad the body with data to fill out to AES block size
     for (int i=0; i<padRequired; i++) {
-        sentMessage.Body[sentMessage.Len+i] = i;
+        msg->Body[msg->Len+i] = i;
     }
 
-    // See if encryption is necessary
-    if (sentMessageCarrier.Algorithm == MESSAGE_ALG_CLEAR) {
-
-        sentMessageCarrier.Message = sentMessage;
+    // Between a sensor and its gateway, once the sensor has an ID, use the short header unless
+    // the frame goes through a relay, which must see the addresses
+    uint8_t *plain = (uint8_t *) msg;
+    uint16_t plainLen = sentMessageCarrier.MessageLen;
+    uint16_t peerID;
+    bool shortHeader = false;
+    sentFrame = (uint8_t *) &sentMessageCarrier;
+    if (sentMessageCarrier.Algorithm == MESSAGE_ALG_CTR && (messageToSendFlags & MESSAGE_FLAG_BROADCAST) == 0
+            && !relaying && wireShortPeer(toAddress, &peerID)) {
+        plain = sentShortMessage;
+        bool delta = appIsGateway ? messageToSendDelta : (RADIO_DELTA_ACK && sensorAckConfigVersion != 0);
+        plainLen = wireShortFormat(toAddress, peerID, msg, delta, (wireShortCarrier *) sentShortFrame, plain);
+        sentFrame = sentShortFrame;
+        sentMessageCarrierLen = sizeof(wireShortCarrier) + MESSAGE_CCM_COUNTER_BYTES + plainLen + MESSAGE_CCM_TAG_BYTES;
+        shortHeader = true;
+    }
+    sentCompactAckExpected = !appIsGateway
+                             && wireCompactAckFor(shortHeader, sentMessage.Flags, sentMessage.Offset, sentMessage.Len, sentMessage.TotalLen);
+    sentGroupAck = false;
 
-    } else {
+    // See if encryption is necessary, a cleartext message already being in place
+    bool encrypting = false;
+    if (sentMessageCarrier.Algorithm != MESSAGE_ALG_CLEAR) {
 
-        // Always use the sensor's key when encrypting
+        // Always use the sensor's key when encrypting, except for broadcasts to all sensors
         uint8_t key[AES_KEY_BYTES];
         uint8_t *sensorAddress = appIsGateway ? sentMessageCarrier.Receiver : sentMessageCarrier.Sender;
-        if (!flashConfigFindPeerByAddress(sensorAddress, NULL, key, NULL)) {
+        if ((messageToSendFlags & MESSAGE_FLAG_BROADCAST) != 0) {
+            memcpy(key, gatewayBroadcastKey, sizeof(key));
+        } else if (!flashConfigFindPeerByAddress(sensorAddress, NULL, key, NULL)) {
             APP_PRINTF("can't find the sensor's key\r\n");
             memcpy(key, invalidKey, sizeof(key));
         }
@@ -299,12 +771,18 @@ void sendMessageToPeer(bool useTW, uint8_t *toAddress)
         APP_PRINTF("\r\n");
 #endif
 
-        // Encrypt the data
-        bool success = MX_AES_CTR_Encrypt(key, (uint8_t *)&sentMessage, sentMessageCarrier.MessageLen, (uint8_t *)&sentMessageCarrier.Message);
-        memcpy(key, invalidKey, sizeof(key));
-        if (!success) {
-            APP_PRINTF("encryption error\r\n");
+        // Seal a short-header frame, or else begin encrypting the data, which completes in the background
+        if (shortHeader) {
+            if (!wireShortSeal(key, (wireShortCarrier *) sentShortFrame, plain, plainLen)) {
+                APP_PRINTF("encryption error\r\n");
+            }
+        } else {
+            encrypting = MX_AES_CTR_StartInPlace(key, plain, plainLen, sizeof(wireMessage));
+            if (!encrypting) {
+                APP_PRINTF("encryption error\r\n");
+            }
         }
+        memcpy(key, invalidKey, sizeof(key));
 
     }
 
@@ -315,9 +793,13 @@ void sendMessageToPeer(bool useTW, uint8_t *toAddress)
         // receive mode quickly enough, and our reply got there too soon.
         // This gives some breathing room.  Note that we don't need
         // to do this if we're using LBT because the LBT delay is sufficient.
+        // The encryption proceeds during this delay.
         if (RADIO_TURNAROUND_ALLOWANCE_MS != 0) {
             HAL_Delay(RADIO_TURNAROUND_ALLOWANCE_MS);
         }
+        if (encrypting && !MX_AES_CTR_Wait()) {
+            APP_PRINTF("encryption error\r\n");
+        }
 
         // Send the packet now
         lbtTalk();
@@ -325,21 +807,56 @@ void sendMessageToPeer(bool useTW, uint8_t *toAddress)
         return;
     }
 
-    // Compute the next slot
+    // Complete the encryption before the message is needed
+    if (encrypting && !MX_AES_CTR_Wait()) {
+        APP_PRINTF("encryption error\r\n");
+    }
+
+    // If the exchange just completed left room in our slot for another, send this one now
+    if (sensorSlotChainable()) {
+        APP_PRINTF("%s chaining request within slot (%ds left, exchange %dms)\r\n",
+                   tracePeer(), twSlotExpiresTime - appTime(), sensorExchangeMs);
+        ledIndicateTransmitInProgress(false);
+        appSetCoreState(TW_OPEN);
+        return;
+    }
+
+    // An urgent request goes out at a random moment early in the gateway's next urgent window
+    uint32_t urgentMs = sensorRequestUrgent ? appNextUrgentWindowDueMs() : 0xFFFFFFFFU;
+    if (urgentMs != 0xFFFFFFFFU) {
+        APP_PRINTF("%s waiting %dms to transmit urgently\r\n", tracePeer(), urgentMs);
+        ledIndicateTransmitInProgress(false);
+        ledIndicateTransmitWindowWait();
+        UTIL_TIMER_Stop(&twSleepTimer);
+        UTIL_TIMER_SetPeriod(&twSleepTimer, urgentMs+1);
+        UTIL_TIMER_Start(&twSleepTimer);
+        appSetCoreState(LOWPOWER);
+        return;
+    }
+
+    // Compute the next slot, and how far into the second we computed it
     uint32_t sleepSecs = appNextTransmitWindowDueSecs();
+    uint32_t sleepMs = (sleepSecs == 0) ? 0 : sensorLocalMs((sleepSecs*1000) - twNowSubsecondMs);
     APP_PRINTF("%s waiting %ds to transmit (slot %ds-%ds in %ds window)\r\n",
                tracePeer(), sleepSecs, TWSlotBeginsSecs, TWSlotEndsSecs, TWModulusSecs);
 
+    // Spread a retry over the first half of the slot
+    uint32_t backoffMs = 0;
+    if (sensorRetryBackoffMs != 0) {
+        uint32_t roomMs = (twSlotExpiresTime > twSlotBeginsTime) ? (twSlotExpiresTime - twSlotBeginsTime) * 500 : 0;
+        uint32_t rangeMs = (sensorRetryBackoffMs < roomMs) ? sensorRetryBackoffMs : roomMs;
+        if (rangeMs != 0) {
+            backoffMs = MY_Random() % rangeMs;
+            APP_PRINTF("%s retry backing off %dms within slot\r\n", tracePeer(), backoffMs);
+        }
+        sensorRetryBackoffMs = 0;
+    }
+
     // Schedule the timer for the next open transmit window
     ledIndicateTransmitInProgress(false);
-    ledIndicateReceiveInProgress(true);
-    HAL_Delay(100);
-    ledIndicateReceiveInProgress(false);
-    ledIndicateTransmitInProgress(true);
-    HAL_Delay(100);
-    ledIndicateTransmitInProgress(false);
-    UTIL_TIMER_Create(&twSleepTimer, 0xFFFFFFFFU, UTIL_TIMER_ONESHOT, twOpenEvent, NULL);
-    UTIL_TIMER_SetPeriod(&twSleepTimer, (sleepSecs*1000)+1);
+    ledIndicateTransmitWindowWait();
+    UTIL_TIMER_Stop(&twSleepTimer);
+    UTIL_TIMER_SetPeriod(&twSleepTimer, sleepMs+1+backoffMs);
     UTIL_TIMER_Start(&twSleepTimer);
 
     // Wait
@@ -347,6 +864,84 @@ void sendMessageToPeer(bool useTW, uint8_t *toAddress)
 
 }
 
+// Find the next chunk at or beyond offset that may be sent within the current window,
+// skipping any chunks that the peer has already selectively acknowledged.  Windowing
+// is only used for request data sent by the sensor, never for ACKs or beacons.
+bool windowNextChunk(uint32_t offset, uint32_t *nextOffset)
+{
+
+    // Exit if this isn't a windowed transfer or if the window is full.  A relay can't hear the
+    // next chunk while it's repeating this one, so what goes through it is sent stop-and-wait,
+    // as is what goes to a gateway that hasn't shown that it acknowledges windows.
+    if (appIsGateway || (messageToSendFlags & (MESSAGE_FLAG_ACK|MESSAGE_FLAG_BEACON)) != 0 || relayVia() != NULL
+            || !sensorGatewayExtended) {
+        return false;
+    }
+    if (messageToSendBurstChunks >= MESSAGE_WINDOW_CHUNKS) {
+        return false;
+    }
+
+    // Skip chunks that the peer told us it has already received
+    uint32_t chunkLen = radioChunkLen(0);
+    for (; offset < messageToSendDataLen; offset += chunkLen) {
+        uint32_t chunk = (offset - messageToSendAcknowledgedLen) / chunkLen;
+        if (chunk == 0) {
+            *nextOffset = offset;
+            return true;
+        }
+        if (chunk > (sizeof(messageToSendSackMap)*8)) {
+            return false;
+        }
+        if ((messageToSendSackMap & (1UL << (chunk-1))) == 0) {
+            *nextOffset = offset;
+            return true;
+        }
+    }
+
+    return false;
+
+}
+
+// If the chunk just transmitted said that more of the window follows, send the next one now
+bool sendWindowContinue(uint8_t *toAddress)
+{
+
+    if ((sentMessage.Flags & MESSAGE_FLAG_WINDOW) == 0) {
+        return false;
+    }
+
+    uint32_t nextOffset;
+    if (!windowNextChunk(sentMessage.Offset + sentMessage.Len, &nextOffset)) {
+        return false;
+    }
+
+    messageToSendOffset = nextOffset;
+    messageToSendBurstContinues = true;
+    sendMessageToPeer(false, toAddress);
+    return true;
+
+}
+
+// The sync word for a frame or a receive.  Cleartext frames, and everything while pairing or
+// unpaired, use the common word; otherwise the network's word is derived from the gateway's
+// address, with each nibble in 1..7 and avoiding the common private and public words.
+uint8_t appRadioSyncWord(bool cleartext)
+{
+    if (!RADIO_NETWORK_SYNC_WORD || cleartext || ledIsPairInProgress()) {
+        return RADIO_COMMON_SYNC_WORD;
+    }
+    uint8_t *address = appIsGateway ? ourAddress : gatewayAddress;
+    if (memcmp(address, invalidAddress, ADDRESS_LEN) == 0) {
+        return RADIO_COMMON_SYNC_WORD;
+    }
+    uint32_t hash = utilHashAddress(address) % 49;
+    uint8_t syncWord = (uint8_t) ((((hash / 7) + 1) << 4) | ((hash % 7) + 1));
+    if (syncWord == RADIO_COMMON_SYNC_WORD || syncWord == 0x34) {
+        syncWord = 0x77;
+    }
+    return syncWord;
+}
+
 // Get stats relating to last wire message received, both from our perspective and the remote perspective
 void appReceivedMessageStats(int8_t *gtxdb, int8_t *grssi, int8_t *grsnr, int8_t *stxdb, int8_t *srssi, int8_t *srsnr)
 {
@@ -358,6 +953,13 @@ void appReceivedMessageStats(int8_t *gtxdb, int8_t *grssi, int8_t *grsnr, int8_t
     *grsnr = wireReceiveSNR;
 }
 
+// Get the battery voltage and lowest transmit power reported by the sensor in the message received
+void appReceivedMessageSensor(uint16_t *millivolts, int8_t *ltp)
+{
+    *millivolts = wireReceived.Millivolts;
+    *ltp = wireReceived.LTP;
+}
+
 // Send a beacon for sensor pairing
 void appSendBeaconToGateway()
 {
@@ -365,15 +967,15 @@ void appSendBeaconToGateway()
     // Set sensor response state
     response.sendingRequest = true;
     response.receivingResponse = false;
+    sensorRequestInFlight = true;
+    sensorRequestAppID = -1;
 
     // The request ID is the decryption algorithm to be used, and the body is the key
     uint32_t requestID = MESSAGE_ALG_CTR;
     uint32_t length = AES_KEY_BYTES;
-    MX_RNG_Init();
     for (size_t i=0; i<length; i++) {
-        beaconKey[i] = MX_RNG_Get();
+        beaconKey[i] = MY_Random();
     }
-    MX_RNG_DeInit();
 
     // Assign the next request ID, which is used to determine packet loss
     traceSetID("BE", wildcardAddress, requestID);
@@ -390,6 +992,23 @@ void twOpenEvent(void *context)
     appSetCoreState(TW_OPEN);
 }
 
+// Switch to the spreading factor agreed for the remainder of an exchange
+void appSwitchSpreadingFactor(uint8_t sf, uint8_t cr)
+{
+    uint8_t prevSF = radioSpreadingFactor();
+    uint8_t prevCR = radioCodingRate();
+    radioSetSpreadingFactor(sf);
+    radioSetCodingRate(cr);
+    if (radioSpreadingFactor() == prevSF && radioCodingRate() == prevCR) {
+        return;
+    }
+    if (radioSpreadingFactor() == RADIO_SF_FSK) {
+        APP_PRINTF("%s switched to FSK\r\n", tracePeer());
+    } else {
+        APP_PRINTF("%s switched to SF%d CR4/%d\r\n", tracePeer(), radioSpreadingFactor(), 4+radioCodingRate());
+    }
+}
+
 // Compute the minimum modulus allowed
 uint32_t twMinimumModulusSecs()
 {
@@ -397,7 +1016,14 @@ uint32_t twMinimumModulusSecs()
     if (TW_LBT_PERIOD_MS != 0) {
         minmod = ((TW_LBT_PERIOD_MS*2)/1000)+1;
     }
-    minmod += RADIO_TIME_WINDOW_SECS;
+#if USE_MODEM_LORA
+    uint8_t sf = LORA_SPREADING_FACTOR;
+#else
+    uint8_t sf = 0;
+#endif
+    uint32_t exchangeMs = radioMessageTimeOnAirMs(sf) + radioAckTimeOnAirMs(sf)
+                          + (RADIO_TURNAROUND_ALLOWANCE_MS*2) + RADIO_TIME_WINDOW_MARGIN_MS;
+    minmod += ((exchangeMs * RADIO_TIME_WINDOW_EXCHANGES) + 999) / 1000;
     return minmod;
 }
 
@@ -405,7 +1031,7 @@ uint32_t twMinimumModulusSecs()
 uint32_t appTransmitWindowWaitMaxSecs()
 {
     // Modulus hasn't been received yet, use a very liberal timeout
-    if (!NoteTimeValidST()) {
+    if (!appTimeValid()) {
         return 600;
     }
     // Use modulus
@@ -415,23 +1041,121 @@ uint32_t appTransmitWindowWaitMaxSecs()
     return TWModulusSecs * 3;
 }
 
-// Compute the next transmit window and its expiration
+// Compute when a slot next begins and expires, given the window's modulus and its offset.
+// Without an offset, all modules everywhere would be aligned to Unix epoch time 0, so the
+// windows of a given gateway's sensors are aligned to a random value of its own.  Within
+// the first TW_SLOT_LATE_SECS of the slot in the current window, the slot is taken to begin now.
+uint32_t twSlotStartTime(uint32_t now, uint32_t offsetSecs, uint32_t modulusSecs, uint32_t beginsSecs, uint32_t endsSecs, uint32_t *expiresTime)
+{
+    uint32_t windowRelativeNowTime = now - offsetSecs;
+    uint32_t windowBeginTime = (windowRelativeNowTime / modulusSecs) * modulusSecs;
+    if (windowRelativeNowTime >= windowBeginTime + (beginsSecs + TW_SLOT_LATE_SECS)) {
+        windowBeginTime += modulusSecs;
+    }
+    *expiresTime = now + ((windowBeginTime + endsSecs) - windowRelativeNowTime);
+    return now + ((windowBeginTime + beginsSecs) - windowRelativeNowTime);
+}
+
+// Get the Unix epoch time in milliseconds, or 0 if it isn't known.  The gateway's is kept by
+// the RTC once set from the Notecard, while the sensor's is the gateway's as of its last ACK
+// or broadcast, corrected for drift since.  Until then, it is whatever the Notecard says.
+int64_t appTimeMs()
+{
+    if (appIsGateway) {
+        if (timeClockSynced) {
+            SysTime_t t = SysTimeGet();
+            return ((int64_t) t.Seconds * 1000) + t.SubSeconds;
+        }
+    } else if (timeSyncOffsetMs != 0) {
+        int64_t nowMs = TIMER_IF_GetTimeMs();
+        int64_t driftMs = ((nowMs - timeSyncLocalMs) * timeSyncDriftPpb) / 1000000000;
+        return nowMs + timeSyncOffsetMs + driftMs;
+    }
+    return NoteTimeValidST() ? (int64_t) NoteTimeST() * 1000 : 0;
+}
+
+// Get the Unix epoch time in seconds.  This is what the framework uses in place of NoteTimeST(),
+// so that the gateway never waits for the Notecard to tell it the time while serving a sensor.
+uint32_t appTime()
+{
+    if (appIsGateway ? timeClockSynced : (timeSyncOffsetMs != 0)) {
+        return (uint32_t) (appTimeMs() / 1000);
+    }
+    return NoteTimeST();
+}
+
+// See whether the time is known
+bool appTimeValid()
+{
+    if (appIsGateway ? timeClockSynced : (timeSyncOffsetMs != 0)) {
+        return true;
+    }
+    return NoteTimeValidST();
+}
+
+// See whether the gateway's clock is due to be set from the Notecard's time
+bool appTimeSyncDue()
+{
+    return appIsGateway && (!timeClockSynced || appTime() >= timeClockSyncedTime + TIME_SYNC_NOTECARD_SECS);
+}
+
+// Set the gateway's clock from the Notecard's time, adjusting it only if it has drifted beyond
+// what the Notecard's time, which is to the second, can tell
+void appTimeSync()
+{
+    if (!NoteTimeValidST()) {
+        return;
+    }
+    uint32_t noteTime = NoteTimeST();
+    int64_t errorMs = timeClockSynced ? appTimeMs() - ((int64_t) noteTime * 1000) : 0;
+    if (!timeClockSynced || errorMs < -TIME_SYNC_TOLERANCE_MS || errorMs > TIME_SYNC_TOLERANCE_MS) {
+        SysTime_t t = { .Seconds = noteTime, .SubSeconds = 0 };
+        SysTimeSet(t);
+        if (timeClockSynced) {
+            APP_PRINTF("clock: set from Notecard (was off by %dms)\r\n", (int32_t) errorMs);
+        }
+    }
+    timeClockSynced = true;
+    timeClockSyncedTime = noteTime;
+}
+
+// Get when the sensor's slot next begins at or after a given time, as the next transmit window
+// would be computed then, or 0 if the gateway hasn't yet assigned one.  Unlike computing the
+// transmit window itself, this has no effect on it.
+uint32_t appTransmitWindowBeginsAt(uint32_t time)
+{
+    if (appIsGateway || !appTimeValid() || TWModulusSecs == 0) {
+        return 0;
+    }
+    uint32_t modulusSecs = TWModulusSecs;
+    if (modulusSecs < twMinimumModulusSecs()) {
+        modulusSecs = twMinimumModulusSecs();
+    }
+    uint32_t beginsSecs = (TWSlotBeginsSecs >= modulusSecs) ? 0 : TWSlotBeginsSecs;
+    uint32_t endsSecs = (TWSlotEndsSecs >= modulusSecs || TWSlotEndsSecs <= beginsSecs) ? modulusSecs : TWSlotEndsSecs;
+    uint32_t expiresTime;
+    uint32_t beginsTime = twSlotStartTime(time, TWModulusOffsetSecs, modulusSecs, beginsSecs, endsSecs, &expiresTime);
+    return (beginsTime < time) ? time : beginsTime;
+}
+
+// Compute the next transmit window and its expiration, noting how far into the current second
+// the computation was made so that the caller can wake at the very start of the slot
 uint32_t appNextTransmitWindowDueSecs()
 {
-    uint32_t now = NoteTimeST();
+    int64_t nowMs = appTimeMs();
+    uint32_t now = (nowMs == 0) ? appTime() : (uint32_t) (nowMs / 1000);
+    twNowSubsecondMs = (nowMs == 0) ? 0 : (uint16_t) (nowMs % 1000);
 
     // Make sure the modulus and other params are within range
-    if (!NoteTimeValidST() && !MX_DBG_Active() && twSlotBeginsTime == 0) {
+    if (!appTimeValid() && !MX_DBG_Active() && twSlotBeginsTime == 0) {
 
         // If the time is not valid, it means that we don't have a slot assigned yet.
         // When all devices awaken after a power failure, they'll all appear in slot 0
         // and collide.  This algorithm potentially steps into successive slots, but
         // it helps the startup case immensely.
-        MX_RNG_Init();
         TWModulusSecs = twMinimumModulusSecs();
-        twSlotBeginsTime = now + (MX_RNG_Get() % 180);
-        twSlotExpiresTime = twSlotBeginsTime + 120;
-        MX_RNG_DeInit();
+        twSlotBeginsTime = now + (MY_Random() % TW_STARTUP_SPREAD_SECS);
+        twSlotExpiresTime = twSlotBeginsTime + TW_STARTUP_WINDOW_SECS;
         APP_PRINTF("%s (using random time window until assigned by gateway)\r\n", tracePeer());
 
     } else {
@@ -450,7 +1174,7 @@ uint32_t appNextTransmitWindowDueSecs()
     }
 
     // Compute number of seconds until the next period
-    if (!NoteTimeValidST()) {
+    if (!appTimeValid()) {
 
         TWSlotBeginsSecs = 0;
         TWSlotEndsSecs = TWModulusSecs;
@@ -460,22 +1184,7 @@ uint32_t appNextTransmitWindowDueSecs()
 
     } else {
 
-#ifdef TW_TRACE
-        APP_PRINTF("%s modulus:%d slotBegin:%d slotEnd:%d\r\n", tracePeer(), TWModulusSecs, TWSlotBeginsSecs, TWSlotEndsSecs);
-#endif
-
-        // Without an offset, all modules everywhere would be aligned to Unix epoch time 0.
-        // This changes the calculations such that all modules for a given gateway are aligned
-        // to a random value associated with that gateway.
-        uint32_t windowRelativeNowTime = now - TWModulusOffsetSecs;
-
-        // Compute the number of seconds until the prev and next slot, modulus those secs
-        uint32_t thisWindowBeginTime = (windowRelativeNowTime / TWModulusSecs) * TWModulusSecs;
-        uint32_t nextWindowBeginTime = ((windowRelativeNowTime / TWModulusSecs) + 1) * TWModulusSecs;
-#ifdef TW_TRACE
-        APP_PRINTF("%s relative winNow:%d winThis:%d winNext:%d\r\n",
-                   tracePeer(), windowRelativeNowTime, thisWindowBeginTime, nextWindowBeginTime);
-#endif
+        TRACE_PRINTF(TRACE_TW, VLEVEL_H, "%s modulus:%d slotBegin:%d slotEnd:%d\r\n", tracePeer(), TWModulusSecs, TWSlotBeginsSecs, TWSlotEndsSecs);
 
         // Adjust the slot begin based upon whether or not we've been encountering errors by
         // scheduling within the slot.  If there are multiple sensors that are misaligned because of
@@ -487,22 +1196,12 @@ uint32_t appNextTransmitWindowDueSecs()
             slotBeginsSecs += (TWSlotEndsSecs - TWSlotBeginsSecs) / 2;
         }
 
-        // If we're within the first 3 seconds of the current slot, the time is NOW
-        if (windowRelativeNowTime < thisWindowBeginTime + (slotBeginsSecs + 3)) {
-            twSlotBeginsTime = now + ((thisWindowBeginTime + slotBeginsSecs) - windowRelativeNowTime);
-            twSlotExpiresTime = now + ((thisWindowBeginTime + TWSlotEndsSecs) - windowRelativeNowTime);
-#ifdef TW_TRACE
-            APP_PRINTF("%s absolute now:%d THIS slotBegin:%d slotEnd:%d\r\n",
-                       tracePeer(), now, twSlotBeginsTime, twSlotExpiresTime);
-#endif
-        } else {
-            twSlotBeginsTime = now + ((nextWindowBeginTime + slotBeginsSecs) - windowRelativeNowTime);
-            twSlotExpiresTime = now + ((nextWindowBeginTime + TWSlotEndsSecs) - windowRelativeNowTime);
-#ifdef TW_TRACE
-            APP_PRINTF("%s absolute now:%d next slotBegin:%d slotEnd:%d\r\n",
-                       tracePeer(), now, twSlotBeginsTime, twSlotExpiresTime);
-#endif
-        }
+        // A retry that a busy gateway asked to wait goes in the first slot after that
+        uint32_t fromTime = (twNotBeforeTime > now) ? twNotBeforeTime : now;
+        twNotBeforeTime = 0;
+        twSlotBeginsTime = twSlotStartTime(fromTime, TWModulusOffsetSecs, TWModulusSecs, slotBeginsSecs, TWSlotEndsSecs, &twSlotExpiresTime);
+        TRACE_PRINTF(TRACE_TW, VLEVEL_H, "%s absolute now:%d slotBegin:%d slotEnd:%d\r\n",
+                     tracePeer(), now, twSlotBeginsTime, twSlotExpiresTime);
 
         if (twSlotBeginsTime < now) {
             twSlotBeginsTime = now;
@@ -527,12 +1226,21 @@ uint32_t appNextTransmitWindowDueSecs()
 bool lbtListenBeforeTalk()
 {
 
+    // If CAD just saw activity, follow up with a full listen without spending a retry,
+    // which will either receive what's being sent or time out when the channel clears.
+    bool cadActivity = radioCadActivityDetected;
+    radioCadActivityDetected = false;
+
     // If retries are exhausted, give up and let caller deal with it
-    if (twLBTRetriesRemaining == 0 || TWListenBeforeTalkMs == 0) {
+    if (TWListenBeforeTalkMs == 0 || (twLBTRetriesRemaining == 0 && !cadActivity)) {
         ListenPhaseBeforeTalk = false;
         return false;
     }
-    twLBTRetriesRemaining--;
+    if (!cadActivity) {
+        twLBTRetriesRemaining--;
+    }
+    statsCount(STATS_LBT_BUSY);
+    twHeatCount(0);
 
     // Listen before talk
     memset(&wireReceivedCarrier, 0, sizeof(wireReceivedCarrier));
@@ -541,6 +1249,15 @@ bool lbtListenBeforeTalk()
     ledIndicateTransmitInProgress(true);
     radioSetChannel();
     ListenPhaseBeforeTalk = true;
+
+    // Sampling the channel with CAD takes a few symbols rather than a full listen period,
+    // so only do the full listen when CAD indicates that someone may be talking.
+#if TW_LBT_USE_CAD
+    if (!cadActivity && radioCad()) {
+        appSetCoreState(LOWPOWER);
+        return true;
+    }
+#endif
     if (TWListenBeforeTalkMs < TW_LBT_PERIOD_MS) {
         TWListenBeforeTalkMs = TW_LBT_PERIOD_MS;
     }
@@ -557,14 +1274,28 @@ void lbtTalk()
 #if TRANSMIT_SIZE_TEST
     APP_PRINTF("%s send(%d)\r\n", tracePeer(), sentMessageCarrierLen);
 #endif
+
+    // Don't transmit beyond the band's duty cycle, which is handled just as a failure to
+    // transmit, and have a sensor hold back its queue until the airtime is available
+    uint32_t dutyMs = dutyWaitMs(radioChannelFrequency(radioChannelIndex()), radioTxTimeOnAirMs(sentMessageCarrierLen));
+    if (dutyMs != 0) {
+        APP_PRINTF("%s *** duty cycle exhausted for %dms ***\r\n", tracePeer(), dutyMs);
+        int64_t untilMs = TIMER_IF_GetTimeMs() + dutyMs;
+        if (!appIsGateway && untilMs > sensorHoldOffUntilMs) {
+            sensorHoldOffUntilMs = untilMs;
+        }
+        appSetCoreState(TX_TIMEOUT);
+        return;
+    }
+
     ledIndicateTransmitInProgress(true);
-    if (!appIsGateway) {
+    if (!appIsGateway && (sentMessage.Flags & MESSAGE_FLAG_WINDOW) == 0) {
         atpGatewayMessageSent();
     }
     radioSetChannel();
     HAL_Delay(radioWakeupRequiredMs());
     sentMessageMs = TIMER_IF_GetTimeMs();
-    radioTx((uint8_t *)&sentMessageCarrier, sentMessageCarrierLen);
+    radioTx(sentFrame, sentMessageCarrierLen);
     appSetCoreState(LOWPOWER);
 }
 
@@ -581,31 +1312,303 @@ void sensorSendReqToGateway(J *req, bool responseRequested)
     // Show the request ID
     APP_PRINTF("%s %s\r\n", tracePeer(), JGetString(req, "req"));
 
-    // Convert it to JSON and send it
-    uint8_t *reqJSON = (uint8_t *) JConvertToJSONString(req);
-    uint32_t reqJSONLen = strlen((char *)reqJSON);
+    // Remember any template being registered, so that notes added to its notefile
+    // can be sent in compact form
+    compactLearnTemplate(NULL, req);
+
+    // Convert it to its compact form if possible, else to JSON
+    uint8_t *reqData = NULL;
+    uint32_t reqDataLen = 0;
+    if (!compactEncodeRequest(req, &reqData, &reqDataLen)) {
+        reqData = (uint8_t *) JConvertToJSONString(req);
+        if (reqData != NULL) {
+            reqDataLen = strlen((char *)reqData);
+        }
+    }
 
-    // Delete the request now that it's converted
+    // Delete the request now that it's converted, and send it
     JDelete(req);
+    sensorSendDataToGateway(reqData, reqDataLen, responseRequested);
 
-    // Send it to the gateway
-    if (reqJSON == NULL) {
-        sensorSendToGateway(false, NULL, 0, false);
-    } else {
-        sensorSendToGateway(responseRequested, reqJSON, reqJSONLen, true);
+}
+
+// Send a request to the gateway that has already been encoded, taking ownership of its data
+void sensorSendDataToGateway(uint8_t *reqData, uint32_t reqDataLen, bool responseRequested)
+{
+    int appID = schedCurrentApp();
+    uint8_t priority = schedAppPriority(appID);
+
+    // Send it to the gateway, failing it immediately if we can't do so without
+    // disrupting a request that is already in progress
+    if (reqData == NULL) {
+        if (sensorRequestInFlight) {
+            schedSendingRequest(appID, false);
+            schedRequestResponseTimeout(appID);
+        } else {
+            sensorSendToGateway(false, NULL, 0, false);
+        }
+        return;
+    }
+
+    // Send it now if it's urgent, or if it needs a response and nothing else is waiting to go out
+    if (priority == SCHED_PRIORITY_URGENT && !sensorRequestInFlight) {
+        sensorSendToGateway(responseRequested, reqData, reqDataLen, true);
+        return;
+    }
+    if (responseRequested && !sensorRequestInFlight && sensorQueued == 0 && sensorHoldOffSecs() == 0) {
+        sensorSendToGateway(responseRequested, reqData, reqDataLen, true);
+        return;
+    }
+
+    // Make room in the queue if we can
+    if (sensorQueued >= SENSOR_QUEUE_MAX_REQUESTS) {
+        sensorQueueFlush();
+    }
+    if (sensorQueued >= SENSOR_QUEUE_MAX_REQUESTS) {
+        APP_PRINTF("%s *** request queue full: request discarded ***\r\n", tracePeer());
+        memset(reqData, '?', reqDataLen);
+        poolFree(reqData);
+        schedSendingRequest(appID, responseRequested);
+        schedRequestResponseTimeout(appID);
+        return;
+    }
+
+    // Hold it in the queue so that it may share a transmit window with others, placing an
+    // urgent request ahead of all but those that are also urgent
+    uint16_t entry = sensorQueued;
+    if (priority == SCHED_PRIORITY_URGENT) {
+        entry = 0;
+        while (entry < sensorQueued && sensorQueue[entry].priority == SCHED_PRIORITY_URGENT) {
+            entry++;
+        }
+        memmove(&sensorQueue[entry+1], &sensorQueue[entry], (sensorQueued-entry) * sizeof(queuedRequest));
+    }
+    schedSendingRequest(appID, responseRequested);
+    schedRequestQueued(appID);
+    sensorQueue[entry].reqData = reqData;
+    sensorQueue[entry].reqDataLen = reqDataLen;
+    sensorQueue[entry].responseRequested = responseRequested;
+    sensorQueue[entry].appID = appID;
+    sensorQueue[entry].priority = priority;
+    sensorQueue[entry].queuedMs = TIMER_IF_GetTimeMs();
+    sensorQueued++;
+    APP_PRINTF("%s request queued (%d pending)\r\n", tracePeer(), sensorQueued);
+
+}
+
+// Get the time for which the gateway has asked us to hold back queued requests, or 0 if none
+uint32_t sensorHoldOffSecs()
+{
+    int64_t now = TIMER_IF_GetTimeMs();
+    if (sensorHoldOffUntilMs <= now) {
+        return 0;
+    }
+    return (uint32_t) ((sensorHoldOffUntilMs - now + 999) / 1000);
+}
+
+// Get how long low-priority requests may yet be held back so that others may join them, which
+// is 0 unless everything queued is such a request and the queue still has room
+uint32_t sensorQueueDeferSecs()
+{
+    if (sensorQueued == 0 || sensorQueued >= SENSOR_QUEUE_MAX_REQUESTS) {
+        return 0;
+    }
+    int64_t oldestMs = sensorQueue[0].queuedMs;
+    for (int i=0; i<sensorQueued; i++) {
+        if (sensorQueue[i].priority != SCHED_PRIORITY_LOW || sensorQueue[i].responseRequested) {
+            return 0;
+        }
+        if (sensorQueue[i].queuedMs < oldestMs) {
+            oldestMs = sensorQueue[i].queuedMs;
+        }
+    }
+    int64_t dueMs = oldestMs + ((int64_t) SENSOR_LOW_PRIORITY_DEFER_SECS * 1000);
+    int64_t now = TIMER_IF_GetTimeMs();
+    if (dueMs <= now) {
+        return 0;
+    }
+    return (uint32_t) ((dueMs - now + 999) / 1000);
+}
+
+// Remove entries from the head of the sensor's request queue without freeing them
+void sensorQueueRemove(uint16_t count)
+{
+    sensorQueued -= count;
+    memmove(&sensorQueue[0], &sensorQueue[count], sensorQueued * sizeof(queuedRequest));
+    memset(&sensorQueue[sensorQueued], 0, count * sizeof(queuedRequest));
+}
+
+// Transmit what is pending in the sensor's request queue, if the radio is free.  A request
+// requiring a response is sent by itself, while consecutive requests that don't require a
+// response are coalesced into a single batch, in which each is preceded by its 16-bit
+// length, and which the gateway will process in order.
+void sensorQueueFlush()
+{
+
+    // Exit if there's nothing to do or if we can't do it now
+    bool drain = sensorStoreDrainDue();
+    if ((sensorQueued == 0 && !drain) || sensorRequestInFlight || ledIsPairInProgress() || ledIsPairMandatory()) {
+        return;
+    }
+
+    // Leave requests queued, where they will be coalesced, while the gateway has asked us to hold
+    // off unless one is urgent, or while low-priority requests are waiting for others to join them
+    if (sensorHoldOffSecs() != 0 && sensorQueue[0].priority != SCHED_PRIORITY_URGENT) {
+        return;
+    }
+
+    // Notes stored while the gateway was unreachable go ahead of anything queued since, unless
+    // it's urgent
+    if (drain && (sensorQueued == 0 || sensorQueue[0].priority != SCHED_PRIORITY_URGENT)) {
+        if (sensorStoreDrain() || sensorQueued == 0) {
+            return;
+        }
+    }
+    if (sensorQueueDeferSecs() != 0) {
+        return;
+    }
+
+    // Requests sent on behalf of the one at the head of the queue share its priority
+    sensorRequestUrgent = (sensorQueue[0].priority == SCHED_PRIORITY_URGENT);
+
+    // Send a request requiring a response on behalf of the app that is waiting for it
+    if (sensorQueue[0].responseRequested) {
+        uint8_t *reqData = sensorQueue[0].reqData;
+        uint32_t reqDataLen = sensorQueue[0].reqDataLen;
+        int appID = sensorQueue[0].appID;
+        sensorRequestCreatedMs = sensorQueue[0].queuedMs;
+        sensorQueueRemove(1);
+        schedRequestDequeued(appID);
+        sensorRequestAppID = appID;
+        sensorRequestStorable = false;
+        sensorTransmitToGateway(true, reqData, reqDataLen, true);
+        return;
+    }
+
+    // Determine how many requests can be coalesced into this batch
+    uint16_t count = 0;
+    uint32_t batchLen = 1;
+    while (count < sensorQueued && !sensorQueue[count].responseRequested) {
+        uint32_t entryLen = sizeof(uint16_t) + sensorQueue[count].reqDataLen;
+        if (count > 0 && batchLen + entryLen > SENSOR_QUEUE_MAX_BATCH_BYTES) {
+            break;
+        }
+        batchLen += entryLen;
+        count++;
+    }
+
+    // A single request is sent as-is
+    if (count == 1) {
+        uint8_t *reqData = sensorQueue[0].reqData;
+        uint32_t reqDataLen = sensorQueue[0].reqDataLen;
+        sensorRequestCreatedMs = sensorQueue[0].queuedMs;
+        sensorRequestQueuedApps[0] = sensorQueue[0].appID;
+        sensorRequestQueuedAppCount = 1;
+        sensorQueueRemove(1);
+        sensorRequestAppID = -1;
+        sensorRequestStorable = true;
+        sensorTransmitToGateway(false, reqData, reqDataLen, true);
+        return;
+    }
+
+    // Build the batch, leaving the requests queued if we can't allocate it
+    uint8_t *batch = (uint8_t *) poolAlloc(batchLen);
+    if (batch == NULL) {
+        APP_PRINTF("%s *** can't allocate request batch ***\r\n", tracePeer());
+        return;
+    }
+    uint32_t batchOffset = 0;
+    batch[batchOffset++] = COMPACT_BATCH;
+    sensorRequestCreatedMs = sensorQueue[0].queuedMs;
+    for (int i=0; i<count; i++) {
+        if (sensorQueue[i].queuedMs < sensorRequestCreatedMs) {
+            sensorRequestCreatedMs = sensorQueue[i].queuedMs;
+        }
+        batch[batchOffset++] = (uint8_t) (sensorQueue[i].reqDataLen >> 0);
+        batch[batchOffset++] = (uint8_t) (sensorQueue[i].reqDataLen >> 8);
+        memcpy(&batch[batchOffset], sensorQueue[i].reqData, sensorQueue[i].reqDataLen);
+        batchOffset += sensorQueue[i].reqDataLen;
+        memset(sensorQueue[i].reqData, '?', sensorQueue[i].reqDataLen);
+        poolFree(sensorQueue[i].reqData);
+        sensorRequestQueuedApps[i] = sensorQueue[i].appID;
     }
+    sensorRequestQueuedAppCount = count;
+    sensorQueueRemove(count);
+
+    // Send it
+    APP_PRINTF("%s sending batch of %d requests\r\n", tracePeer(), count);
+    sensorRequestAppID = -1;
+    sensorRequestStorable = true;
+    sensorTransmitToGateway(false, batch, batchOffset, true);
 
 }
 
-// Send a message to the gateway
+// Send a message to the gateway on behalf of the current app
 void sensorSendToGateway(bool responseRequested, uint8_t *message, uint32_t length, bool dealloc)
 {
 
-    // Update local voltage (which may be time-consuming so we do it before I/O)
+    // Notify the sensor scheduler that we are sending a request
+    int appID = schedCurrentApp();
+    schedSendingRequest(appID, responseRequested);
+
+    // Send it
+    sensorRequestAppID = appID;
+    sensorRequestCreatedMs = TIMER_IF_GetTimeMs();
+    sensorRequestUrgent = (schedAppPriority(appID) == SCHED_PRIORITY_URGENT);
+    sensorRequestStorable = !responseRequested;
+    sensorTransmitToGateway(responseRequested, message, length, dealloc);
+
+}
+
+// Transmit a message to the gateway
+void sensorTransmitToGateway(bool responseRequested, uint8_t *message, uint32_t length, bool dealloc)
+{
+
+    // Use the voltage sampled after the previous exchange, measuring it now only
+    // if there isn't one yet
 #ifdef USE_SPARROW
-    batteryMillivolts = (uint16_t) (MX_ADC_A0_Voltage() * 1000.0);
+    batteryMillivolts = MX_ADC_A0_Millivolts();
+    if (batteryMillivolts == 0) {
+        batteryMillivolts = (uint16_t) (MX_ADC_A0_Voltage() * 1000.0);
+    }
 #endif
 
+    // Prefix the request with its age and then with our schedule, taking ownership of a copy
+    // if we can't reuse it
+    bool aged = (SENSOR_REQUEST_AGE && sensorRequestCreatedMs != 0 && message != NULL);
+    uint8_t schedule[COMPACT_SCHEDULE_MAX];
+    uint32_t scheduleLen = 0;
+    uint32_t periodSecs, dueSecs;
+    if (SENSOR_ADVERTISE_SCHEDULE && message != NULL && schedNextDue(&periodSecs, &dueSecs)) {
+        scheduleLen = compactEncodeSchedule(schedule, periodSecs, dueSecs);
+    }
+    uint32_t prefixLen = (aged ? COMPACT_AGED_PREFIX : 0) + scheduleLen;
+    if (prefixLen != 0) {
+        uint8_t *prefixed = (uint8_t *) poolAlloc(prefixLen + length);
+        if (prefixed != NULL) {
+            if (aged) {
+                prefixed[0] = COMPACT_AGED;
+            }
+            memcpy(&prefixed[prefixLen - scheduleLen], schedule, scheduleLen);
+            memcpy(&prefixed[prefixLen], message, length);
+            if (dealloc) {
+                memset(message, '?', length);
+                poolFree(message);
+            }
+            message = prefixed;
+            length += prefixLen;
+            dealloc = true;
+            if (aged) {
+                sensorAgeStamp(message);
+            }
+        } else {
+            aged = false;
+        }
+    }
+    if (!aged) {
+        sensorRequestCreatedMs = 0;
+    }
+
     // Initialize retries
     sensorSendRetriesRemaining = GATEWAY_REQUEST_FAILURE_RETRIES;
 
@@ -613,13 +1616,13 @@ void sensorSendToGateway(bool responseRequested, uint8_t *message, uint32_t leng
     response.sendingRequest = true;
     response.receivingResponse = false;
     response.responseRequired = responseRequested;
-
-    // Notify the sensor scheduler that we are sending a request
-    schedSendingRequest(responseRequested);
+    sensorRequestInFlight = true;
 
     // Assign the next request ID, which is used to determine packet loss
     uint32_t requestID = ++LastRequestID;
     traceSetID("to", gatewayAddress, requestID);
+    sensorRequestAppRequestID = requestID;
+    sensorSnapshotSave();
 
     // Send it
     APP_PRINTF("%s sensor sending request (%d)\r\n", tracePeer(), length);
@@ -629,7 +1632,32 @@ void sensorSendToGateway(bool responseRequested, uint8_t *message, uint32_t leng
 
 }
 
-// Re-send a message to the gateway
+// Stamp an aged request with how long ago it was created, as of now
+void sensorAgeStamp(uint8_t *message)
+{
+    int64_t ageMs = TIMER_IF_GetTimeMs() - sensorRequestCreatedMs;
+    uint32_t age = (ageMs < 0) ? 0 : (ageMs > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t) ageMs;
+    for (uint32_t i=0; i<sizeof(age); i++) {
+        message[1+i] = (uint8_t) (age >> (i*8));
+    }
+}
+
+// Get the app that made a request, so that its response goes to the right app
+int sensorRequestApp(uint32_t requestID)
+{
+    if (requestID != sensorRequestAppRequestID) {
+        return -1;
+    }
+    return sensorRequestAppID;
+}
+
+// Get the app on whose behalf the radio is being used, or -1 if it is the framework's own
+int sensorRadioApp()
+{
+    return sensorRequestAppID;
+}
+
+// Re-send a message to the gateway
 bool sensorResendToGateway()
 {
 
@@ -646,7 +1674,7 @@ bool sensorResendToGateway()
     response.receivingResponse = false;
 
     // Notify the sensor scheduler that we are sending a request
-    schedSendingRequest(responseRequested);
+    schedSendingRequest(sensorRequestAppID, responseRequested);
 
     // Assign the next request ID, which is used to determine packet loss
     traceSetID("to", gatewayAddress, LastRequestID);
@@ -658,12 +1686,19 @@ bool sensorResendToGateway()
     messageToSendData = NULL;
     messageToSendDataLen = 0;
     messageToSendDataDealloc = false;
+    if (sensorRequestCreatedMs != 0 && sendData != NULL && sendDataLen >= COMPACT_AGED_PREFIX && sendData[0] == COMPACT_AGED) {
+        sensorAgeStamp(sendData);
+    }
 
     // Before giving up, don't use the transmit window.  This is to prevent a case in
     // which this sensor's tw is invalidly synchronized with a different sensor's tw and
     // thus they repeatedly talk over one another.
     TWSlotBeginsTweak = (sensorSendRetriesRemaining <= (GATEWAY_REQUEST_FAILURE_RETRIES/2));
 
+    // Retry at a random moment within the slot, drawn from a range that doubles with each retry
+    uint32_t retry = GATEWAY_REQUEST_FAILURE_RETRIES - sensorSendRetriesRemaining;
+    sensorRetryBackoffMs = SENSOR_RETRY_BACKOFF_MS << ((retry > 8 ? 8 : retry) - 1);
+
     // Send it
     APP_PRINTF("%s sensor re-sending request (retries remaining: %d)\r\n", tracePeer(), sensorSendRetriesRemaining);
     sendToPeer(true, messageToSendFlags,
@@ -678,54 +1713,180 @@ bool sensorResendToGateway()
 // See if there's a timeout on send
 bool sendTimeout()
 {
-    if ((TIMER_IF_GetTimeMs() - sentMessageMs) > 10000) {
+    if ((TIMER_IF_GetTimeMs() - sentMessageMs) > radioTimeOnAirMs(sentMessageCarrierLen) + sensorAckTimeoutMs()) {
         return true;
     }
     return false;
 }
 
-// Process a request from a gateway
-void processSensorRequest(requestState *request, bool respond)
+// Get how long to wait for the gateway's ACK of what we've just sent, based upon the round
+// trip measured on the link and backed off for each ACK that has since failed to arrive
+uint32_t sensorAckTimeoutMs()
 {
+    uint32_t maxMs = radioReplyTimeoutMs(SOLICITED_COMMS_RX_MARGIN_MS) + relayHopMs();
+    if (sensorSrttMs == 0) {
+        return maxMs;
+    }
+    uint32_t varMs = sensorRttvarMs*4;
+    if (varMs < SENSOR_RTT_MIN_MARGIN_MS) {
+        varMs = SENSOR_RTT_MIN_MARGIN_MS;
+    }
+    uint32_t timeoutMs = radioMessageTimeOnAirMs(0) + sensorSrttMs + varMs;
+    uint32_t minMs = radioWakeupRequiredMs() + RADIO_TURNAROUND_ALLOWANCE_MS + radioMessageTimeOnAirMs(0) + SENSOR_RTT_MIN_MARGIN_MS + relayHopMs();
+    if (timeoutMs < minMs) {
+        timeoutMs = minMs;
+    }
+    timeoutMs <<= sensorRtoBackoff;
+    return (timeoutMs > maxMs) ? maxMs : timeoutMs;
+}
 
-    // Free the existing buffer and initialize for sending the message back
-    uint8_t *reqJSON = request->data;
-    uint32_t reqJSONLen = request->dataTotalLen;
-    request->data = NULL;
-    request->dataTotalLen = 0;
-    request->dataAcknowledgedLen = 0;
-
-    // Process the request if we haven't successfully processed it before and if no response is required
-    if (!respond && request->lastProcessedRequestID != 0 && request->currentRequestID == request->lastProcessedRequestID) {
-        APP_PRINTF("%s *** ignoring duplicate request ***\r\n", tracePeer());
-        memset(reqJSON, '?', reqJSONLen);
-        free(reqJSON);
+// Measure the wait for an ACK that has just arrived, unless what it acknowledges was resent
+// so that we can't tell which transmission it answers.  The excess of the wait over the ACK's
+// own time on air is what's smoothed, so that the estimate holds across spreading factors.
+void sensorRttSample()
+{
+    sensorAckAwaited = false;
+    if (!sensorRttSampling) {
+        return;
+    }
+    sensorRttSampling = false;
+    int64_t waitedMs = radioReceivedMs() - sensorAckWaitBeganMs;
+    int64_t airMs = radioTimeOnAirMs(wireReceivedLen);
+    if (waitedMs <= 0) {
+        return;
+    }
+    uint32_t excessMs = (waitedMs > airMs) ? (uint32_t) (waitedMs - airMs) : 0;
+    if (sensorSrttMs == 0) {
+        sensorRttvarMs = excessMs / 2;
+        sensorSrttMs = excessMs;
     } else {
-        uint8_t *rspData;
-        uint32_t rspDataLen;
-        bool success = gatewayProcessSensorRequest(request->sensorAddress, reqJSON, reqJSONLen, &rspData, &rspDataLen);
-        memset(reqJSON, '?', reqJSONLen);
-        free(reqJSON);
-        if (success) {
+        uint32_t errorMs = (excessMs > sensorSrttMs) ? excessMs - sensorSrttMs : sensorSrttMs - excessMs;
+        sensorRttvarMs = ((sensorRttvarMs*3) + errorMs) / 4;
+        sensorSrttMs = ((sensorSrttMs*7) + excessMs) / 8;
+    }
+    if (sensorSrttMs == 0) {
+        sensorSrttMs = 1;
+    }
+    sensorRtoBackoff = 0;
+    TRACE_PRINTF(TRACE_RADIO, VLEVEL_M, "%s rtt: %dms srtt:%dms rttvar:%dms timeout:%dms\r\n", tracePeer(),
+                 (uint32_t) waitedMs, sensorSrttMs, sensorRttvarMs, sensorAckTimeoutMs());
+}
 
-            // Bump request statistics
-            request->requestsProcessed++;
-            if (request->lastProcessedRequestID != 0 && request->currentRequestID > request->lastProcessedRequestID) {
-                request->requestsLost += (request->currentRequestID - request->lastProcessedRequestID) - 1;
-            }
+// Note that a request from a sensor has been successfully processed
+void sensorRequestProcessed(requestState *request)
+{
+    request->requestsProcessed++;
+    if (request->lastProcessedRequestID != 0 && request->currentRequestID > request->lastProcessedRequestID) {
+        request->requestsLost += (request->currentRequestID - request->lastProcessedRequestID) - 1;
+    }
+    request->lastProcessedRequestIDForAck = request->lastProcessedRequestID;
+    request->lastProcessedRequestID = request->currentRequestID;
+    memmove(&request->recentRequestIDs[1], &request->recentRequestIDs[0],
+            sizeof(request->recentRequestIDs) - sizeof(request->recentRequestIDs[0]));
+    request->recentRequestIDs[0] = request->currentRequestID;
+    gatewaySnapshotDirty = true;
+}
 
-            // Set things up for response processing
-            request->lastProcessedRequestIDForAck = request->lastProcessedRequestID;
-            request->lastProcessedRequestID = request->currentRequestID;
-            request->data = rspData;
-            request->dataTotalLen = rspDataLen;
+// See if the sensor's current request is one that we've recently completed
+bool sensorRequestRecentlyProcessed(requestState *request)
+{
+    if (request->currentRequestID == 0) {
+        return false;
+    }
+    for (int i=0; i<GATEWAY_RECENT_REQUESTS; i++) {
+        if (request->recentRequestIDs[i] == request->currentRequestID) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Take ownership of the response that has just been sent to a sensor, keeping it in the
+// cache in place of the least recently used entry
+void responseCacheStore(requestState *request)
+{
+    if (request->data == NULL) {
+        return;
+    }
+    if (request->dataTotalLen > GATEWAY_RESPONSE_CACHE_MAX_BYTES) {
+        memset(request->data, '?', request->dataTotalLen);
+        poolFree(request->data);
+        request->data = NULL;
+        return;
+    }
+    cachedResponse *slot = &responseCache[0];
+    for (int i=0; i<GATEWAY_RESPONSE_CACHE; i++) {
+        cachedResponse *c = &responseCache[i];
+        if (c->data == NULL || c->lastUsed < slot->lastUsed) {
+            slot = c;
+        }
+        if (c->data == NULL) {
+            break;
+        }
+    }
+    if (slot->data != NULL) {
+        memset(slot->data, '?', slot->dataLen);
+        poolFree(slot->data);
+    }
+    memcpy(slot->sensorAddress, request->sensorAddress, sizeof(slot->sensorAddress));
+    slot->requestID = request->currentRequestID;
+    slot->data = request->data;
+    slot->dataLen = request->dataTotalLen;
+    slot->lastUsed = ++responseCacheUses;
+    request->data = NULL;
+}
+
+// Remove the cached response to the sensor's current request, returning it to the caller
+bool responseCacheTake(requestState *request, uint8_t **data, uint32_t *dataLen)
+{
+    for (int i=0; i<GATEWAY_RESPONSE_CACHE; i++) {
+        cachedResponse *c = &responseCache[i];
+        if (c->data != NULL && c->requestID == request->currentRequestID
+                && memcmp(c->sensorAddress, request->sensorAddress, sizeof(c->sensorAddress)) == 0) {
+            *data = c->data;
+            *dataLen = c->dataLen;
+            c->data = NULL;
+            c->dataLen = 0;
+            return true;
+        }
+    }
+    return false;
+}
 
+// Release the cached responses to the sensor's requests other than the one specified, which it
+// has implicitly acknowledged by moving on to another
+void responseCacheRelease(requestState *request, uint32_t requestID)
+{
+    for (int i=0; i<GATEWAY_RESPONSE_CACHE; i++) {
+        cachedResponse *c = &responseCache[i];
+        if (c->data != NULL && c->requestID != requestID
+                && memcmp(c->sensorAddress, request->sensorAddress, sizeof(c->sensorAddress)) == 0) {
+            memset(c->data, '?', c->dataLen);
+            poolFree(c->data);
+            c->data = NULL;
+            c->dataLen = 0;
         }
     }
+}
+
+// Process a request from a gateway
+void processSensorRequest(requestState *request, bool respond)
+{
+    int64_t beganMs = TIMER_IF_GetTimeMs();
+    gatewayPerformRequest(request, respond, beganMs);
 
     // Transmit the response to the sensor if one was requested
     if (respond) {
 
+        // Track how long the sensor waits between our final ACK and the response, including
+        // the delay before we transmit, so that the next final ACK can tell it when to listen
+        uint32_t latencyMs = (uint32_t) (TIMER_IF_GetTimeMs() - beganMs) + RADIO_TURNAROUND_ALLOWANCE_MS + radioWakeupRequiredMs();
+        if (request->responseLatencyMs == 0) {
+            request->responseLatencyMs = latencyMs;
+        } else {
+            request->responseLatencyMs = ((request->responseLatencyMs*3) + latencyMs) / 4;
+        }
+
         // Send response.  Note that we will retain responsibility for deallocation
         request->receivingRequest = false;
         request->sendingResponse = true;
@@ -740,176 +1901,1405 @@ void processSensorRequest(requestState *request, bool respond)
         request->sendingResponse = false;
         if (request->data != NULL) {
             memset(request->data, '?', request->dataTotalLen);
-            free(request->data);
+            poolFree(request->data);
             request->data = NULL;
         }
         gatewayWaitForAnySensorMessage();
 
-        // Do housekeeping by borrowing time from the sensor's window
-        gatewayHousekeeping(forceSensorRefresh, cachedSensors);
-        forceSensorRefresh = false;
+        // Do housekeeping by borrowing time from the sensor's window, unless the
+        // background task will be doing it after it has drained its queue.
+        if (gatewayNotecardIdle()) {
+            gatewayHousekeeping(forceSensorRefresh, cachedSensors);
+            forceSensorRefresh = false;
+        }
 
     }
 
 }
 
-// Wait for a message from a specific sensor
-void gatewayWaitForSensorMessage()
+// Perform a sensor's request, leaving the response to it, if one is required, in its buffer
+void gatewayPerformRequest(requestState *request, bool respond, int64_t beganMs)
 {
-    memset(&wireReceivedCarrier, 0, sizeof(wireReceivedCarrier));
-    memset(&wireReceived, 0, sizeof(wireReceived));
-    ledIndicateReceiveInProgress(true);
-    radioSetChannel();
-    wireReceiveTimeoutMs = SOLICITED_COMMS_RX_TIMEOUT_VALUE;
-    ListenPhaseBeforeTalk = false;
-    radioRx(wireReceiveTimeoutMs);
-    APP_PRINTF("%s waiting for message from a specific sensor\r\n", tracePeer());
-    appSetCoreState(LOWPOWER);
+
+    // Free the existing buffer and initialize for sending the message back
+    uint8_t *reqJSON = request->data;
+    uint32_t reqJSONLen = request->dataTotalLen;
+    request->data = NULL;
+    request->dataTotalLen = 0;
+    request->dataAcknowledgedLen = 0;
+
+    // A request that we didn't hold, because it was too large or we were out of memory, is
+    // answered with an error if the sensor is waiting for a response
+    if (reqJSON == NULL) {
+        pktlogRecord(request->sensorAddress, request->currentRequestID, reqJSONLen, request->gatewayRSSI,
+                     request->gatewaySNR, request->sensorTXP, PKTLOG_IGNORED, (uint32_t) (beganMs - request->requestBeganMs));
+        if (respond) {
+            static const char rspErr[] = "{\"err\":\"request is too large for the gateway\"}";
+            request->data = (uint8_t *) poolAlloc(sizeof(rspErr));
+            if (request->data != NULL) {
+                memcpy(request->data, rspErr, sizeof(rspErr));
+                request->dataTotalLen = sizeof(rspErr)-1;
+            }
+        }
+        return;
+    }
+
+    // Work out when the sensor created the request, if it told us how long ago that was
+    int64_t originMs = 0;
+    if (reqJSON != NULL && reqJSONLen >= COMPACT_AGED_PREFIX && reqJSON[0] == COMPACT_AGED) {
+        originMs = request->requestBeganMs - gatewayRequestAge(reqJSON, &reqJSONLen);
+    }
+    gatewayCalendarLearn(request, reqJSON, &reqJSONLen);
+
+    // Process the request if we haven't successfully processed it before and if no response is required,
+    // and if a response is required to one we have processed, answer from the cache if we can
+    uint8_t *cachedData;
+    uint32_t cachedDataLen;
+    if (!respond && sensorRequestRecentlyProcessed(request)) {
+        APP_PRINTF("%s *** ignoring duplicate request ***\r\n", tracePeer());
+        pktlogRecord(request->sensorAddress, request->currentRequestID, reqJSONLen, request->gatewayRSSI,
+                     request->gatewaySNR, request->sensorTXP, PKTLOG_IGNORED, (uint32_t) (beganMs - request->requestBeganMs));
+        memset(reqJSON, '?', reqJSONLen);
+        poolFree(reqJSON);
+    } else if (!respond && statsLoadTest(request->sensorAddress, reqJSON, reqJSONLen, (uint32_t) (beganMs - request->requestBeganMs))) {
+
+        // Load-test traffic measures what the radio achieves, so it goes no further than us
+        sensorRequestProcessed(request);
+        pktlogRecord(request->sensorAddress, request->currentRequestID, reqJSONLen, request->gatewayRSSI,
+                     request->gatewaySNR, request->sensorTXP, PKTLOG_COMPLETED, (uint32_t) (beganMs - request->requestBeganMs));
+        memset(reqJSON, '?', reqJSONLen);
+        poolFree(reqJSON);
+
+    } else if (!respond && gatewayNotecardEnqueue(request->sensorAddress, request->currentRequestID, reqJSON, reqJSONLen, originMs)) {
+
+        // The sensor has already been ACK'ed and isn't waiting for anything further, so
+        // the request was handed to the background task and we get back to receiving.  It
+        // is considered processed now, so that a duplicate that arrives meanwhile is ignored.
+        sensorRequestProcessed(request);
+        pktlogRecord(request->sensorAddress, request->currentRequestID, reqJSONLen, request->gatewayRSSI,
+                     request->gatewaySNR, request->sensorTXP, PKTLOG_COMPLETED, (uint32_t) (beganMs - request->requestBeganMs));
+
+    } else if (respond && sensorRequestRecentlyProcessed(request) && responseCacheTake(request, &cachedData, &cachedDataLen)) {
+        APP_PRINTF("%s *** answering retried request from cache ***\r\n", tracePeer());
+        memset(reqJSON, '?', reqJSONLen);
+        poolFree(reqJSON);
+        request->data = cachedData;
+        request->dataTotalLen = cachedDataLen;
+
+    } else {
+        uint8_t *rspData;
+        uint32_t rspDataLen;
+        MX_ClockBoost();
+        bool success = gatewayProcessSensorRequest(request->sensorAddress, reqJSON, reqJSONLen, &rspData, &rspDataLen);
+        MX_ClockRelax();
+        memset(reqJSON, '?', reqJSONLen);
+        poolFree(reqJSON);
+        if (success) {
+
+            // Bump request statistics, and set things up for response processing
+            sensorRequestProcessed(request);
+            pktlogRecord(request->sensorAddress, request->currentRequestID, reqJSONLen, request->gatewayRSSI,
+                         request->gatewaySNR, request->sensorTXP, PKTLOG_COMPLETED,
+                         (uint32_t) (TIMER_IF_GetTimeMs() - request->requestBeganMs));
+            request->data = rspData;
+            request->dataTotalLen = rspDataLen;
+            gatewaySensorLatency(request->sensorAddress, originMs);
+
+        }
+    }
+
 }
 
-// Wait for a message from any sensor
-void gatewayWaitForAnySensorMessage()
+// Take the age prefix off a request, in place, returning how many ms before its first chunk
+// was sent the sensor created it
+uint32_t gatewayRequestAge(uint8_t *data, uint32_t *len)
 {
-    memset(&wireReceivedCarrier, 0, sizeof(wireReceivedCarrier));
-    memset(&wireReceived, 0, sizeof(wireReceived));
-    ledIndicateReceiveInProgress(true);
-    radioSetChannel();
-    wireReceiveTimeoutMs = UNSOLICITED_RX_TIMEOUT_VALUE;
-    ListenPhaseBeforeTalk = false;
-    radioRx(wireReceiveTimeoutMs);
-    showReceivedTime("rx", 0, 0);
-    APP_PRINTF("\r\n");
-    appSetCoreState(LOWPOWER);
+    uint32_t age = 0;
+    for (uint32_t i=0; i<sizeof(age); i++) {
+        age |= ((uint32_t) data[1+i]) << (i*8);
+    }
+    *len -= COMPACT_AGED_PREFIX;
+    memmove(data, &data[COMPACT_AGED_PREFIX], *len);
+    return age;
 }
 
-// Begin a receive on gateway
-void sensorWaitForGatewayMessage()
+// Note how long it took from a sensor creating a request until the Notecard accepted it
+void gatewaySensorLatency(uint8_t *sensorAddress, int64_t originMs)
 {
-    memset(&wireReceivedCarrier, 0, sizeof(wireReceivedCarrier));
-    memset(&wireReceived, 0, sizeof(wireReceived));
-    ledIndicateReceiveInProgress(true);
-    radioSetChannel();
-    wireReceiveTimeoutMs = SOLICITED_COMMS_RX_TIMEOUT_VALUE;
-    ListenPhaseBeforeTalk = false;
-    radioRx(wireReceiveTimeoutMs);
-    APP_PRINTF("%s waiting for message from gateway\r\n", tracePeer());
-    appSetCoreState(LOWPOWER);
+    if (originMs == 0) {
+        return;
+    }
+    requestState *request = requestCacheFind(sensorAddress);
+    if (request != NULL) {
+        int64_t ms = TIMER_IF_GetTimeMs() - originMs;
+        statsLatencyAdd(&request->latency, (ms < 0) ? 0 : (ms > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t) ms);
+        request->dbDirty = true;
+    }
 }
 
-// Begin a receive on gateway, waiting for a response which may take a while
-void sensorWaitForGatewayResponse()
+// Hand a request that needs no response to the background task, queueing it in RAM while
+// there's room and nothing stored is waiting ahead of it, and otherwise in flash, so that
+// each sensor's requests reach the Notecard in the order in which they were received.
+// Returns false, leaving the request with the caller, if it can be queued in neither.
+bool gatewayNotecardEnqueue(uint8_t *sensorAddress, uint32_t requestID, uint8_t *data, uint32_t dataLen, int64_t originMs)
 {
-    memset(&wireReceivedCarrier, 0, sizeof(wireReceivedCarrier));
-    memset(&wireReceived, 0, sizeof(wireReceived));
-    ledIndicateReceiveInProgress(true);
-    radioSetChannel();
-    wireReceiveTimeoutMs = SOLICITED_PROCESSING_RX_TIMEOUT_VALUE;
-    ListenPhaseBeforeTalk = false;
-    radioRx(wireReceiveTimeoutMs);
-    APP_PRINTF("%s waiting for response from gateway\r\n", tracePeer());
-    appSetCoreState(LOWPOWER);
+    bool storedAhead = GATEWAY_STORE_AND_FORWARD && flashStorePending() > notecardStoreLoaded;
+    if (!storedAhead && notecardQueued < GATEWAY_NOTECARD_QUEUE_MAX) {
+        notecardQueueEntry *entry = &notecardQueue[notecardQueued++];
+        memcpy(entry->sensorAddress, sensorAddress, sizeof(entry->sensorAddress));
+        entry->requestID = requestID;
+        entry->data = data;
+        entry->dataLen = dataLen;
+        entry->offset = (dataLen > 0 && data[0] == COMPACT_BATCH) ? 1 : 0;
+        entry->stored = false;
+        entry->queuedMs = TIMER_IF_GetTimeMs();
+        entry->originMs = originMs;
+    } else if (GATEWAY_STORE_AND_FORWARD && gatewayNotecardStore(sensorAddress, requestID, data, dataLen)) {
+        memset(data, '?', dataLen);
+        poolFree(data);
+    } else {
+        return false;
+    }
+
+    // Wake the background task, unless it's waiting for others to join the oldest or to retry
+    // a Notecard that's unavailable
+    if (!notecardWaitPending) {
+        UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Notecard_Process), CFG_SEQ_Prio_Notecard);
+    }
+    return true;
 }
 
-// Restart the receive with the specified timeout
-void restartReceive(uint32_t timeoutMs)
+// Append a request to the outbound store, prefixed by the sensor's address and request ID
+bool gatewayNotecardStore(uint8_t *sensorAddress, uint32_t requestID, uint8_t *data, uint32_t dataLen)
 {
-    memset(&wireReceivedCarrier, 0, sizeof(wireReceivedCarrier));
-    memset(&wireReceived, 0, sizeof(wireReceived));
-    ledIndicateReceiveInProgress(true);
-    radioSetChannel();
-    ListenPhaseBeforeTalk = false;
-    radioRx(timeoutMs);
-    showReceivedTime("restarting rx", 0, 0);
-    APP_PRINTF("\r\n");
-    appSetCoreState(LOWPOWER);
-    return;
+    uint8_t *record = (uint8_t *) poolAlloc(NOTECARD_STORE_PREFIX + dataLen);
+    if (record == NULL) {
+        return false;
+    }
+    memcpy(record, sensorAddress, ADDRESS_LEN);
+    memcpy(&record[ADDRESS_LEN], &requestID, sizeof(requestID));
+    memcpy(&record[NOTECARD_STORE_PREFIX], data, dataLen);
+    bool success = flashStoreAppend(record, NOTECARD_STORE_PREFIX + dataLen);
+    memset(record, '?', NOTECARD_STORE_PREFIX + dataLen);
+    poolFree(record);
+    if (success) {
+        TRACE_PRINTF(TRACE_GATEWAY, VLEVEL_L, "%s request stored until the notecard can take it (%d stored)\r\n", tracePeer(), flashStorePending());
+    }
+    return success;
 }
 
-// Initialize sensor
-void appSensorInit()
+// Bring the oldest stored requests not yet in the queue into it while there's room.  Each
+// stays in flash until it has been performed, so that it survives a reset meanwhile.
+void gatewayNotecardLoad()
 {
-    // Initialize the scheduler
-    schedInit();
+    uint8_t *record;
+    uint32_t recordLen;
+    while (GATEWAY_STORE_AND_FORWARD && notecardQueued < GATEWAY_NOTECARD_QUEUE_MAX
+            && flashStoreRecord(notecardStoreLoaded, &record, &recordLen)) {
+
+        // Copy it into RAM, followed by the writable byte that in-place parsing requires
+        uint32_t dataLen = (recordLen > NOTECARD_STORE_PREFIX) ? recordLen - NOTECARD_STORE_PREFIX : 0;
+        uint8_t *data = (uint8_t *) poolAlloc(dataLen+1);
+        if (data == NULL) {
+            return;
+        }
+        memcpy(data, &record[NOTECARD_STORE_PREFIX], dataLen);
+        data[dataLen] = '\0';
+        notecardQueueEntry *entry = &notecardQueue[notecardQueued++];
+        memset(entry->sensorAddress, 0, sizeof(entry->sensorAddress));
+        entry->requestID = 0;
+        if (recordLen >= NOTECARD_STORE_PREFIX) {
+            memcpy(entry->sensorAddress, record, ADDRESS_LEN);
+            memcpy(&entry->requestID, &record[ADDRESS_LEN], sizeof(entry->requestID));
+        }
+        entry->data = data;
+        entry->dataLen = dataLen;
+        entry->offset = (dataLen > 0 && data[0] == COMPACT_BATCH) ? 1 : 0;
+        entry->stored = true;
+        entry->queuedMs = 0;
+        entry->originMs = 0;
+        notecardStoreLoaded++;
+
+    }
 }
 
-// Set sensor task in a low power core state
-void sensorCoreIdle()
+// See if nothing is waiting to be performed against the Notecard in the background
+bool gatewayNotecardIdle()
 {
-    appSetCoreState(LOWPOWER);
+    return notecardQueued == 0 && (!GATEWAY_STORE_AND_FORWARD || flashStorePending() == 0);
 }
 
-// Application state machine for Sensor
-void appSensorProcess()
+// Get how long the background task should hold off beginning a Notecard transaction, which is
+// until the exchange under way with a sensor is over and the frames received have been handled
+uint32_t gatewayNotecardDeferMs()
 {
+    int64_t nowMs = TIMER_IF_GetTimeMs();
+    if (radioRxQueued() == 0 && nowMs >= gatewayExchangeUntilMs) {
+        notecardDeferredMs = 0;
+        return 0;
+    }
+    if (notecardDeferredMs == 0) {
+        notecardDeferredMs = nowMs;
+    }
+    if (nowMs - notecardDeferredMs >= GATEWAY_NOTECARD_DEFER_MAX_MS) {
+        notecardDeferredMs = 0;
+        return 0;
+    }
+    return GATEWAY_NOTECARD_DEFER_MS;
+}
 
-#ifdef TRACE_STATE
-    APP_PRINTF("ENTER %d\r\n", CurrentStateCore);
-#endif
+// Hold the background task for a while, during which what is queued doesn't wake it
+void gatewayNotecardWait(uint32_t ms)
+{
+    notecardWaitPending = true;
+    UTIL_TIMER_Stop(&notecardWaitTimer);
+    UTIL_TIMER_SetPeriod(&notecardWaitTimer, ms);
+    UTIL_TIMER_Start(&notecardWaitTimer);
+}
 
-    // Default for the identity of the subject of tracing
-    traceSetID("", NULL, 0);
+// Resume the background task once its wait is over
+void gatewayNotecardWaitEvent(void *context)
+{
+    notecardWaitPending = false;
+    UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Notecard_Process), CFG_SEQ_Prio_Notecard);
+}
 
-    // Process sub-states that may have caused wakeup
-    if (ButtonEventOccurred) {
-        ButtonEventOccurred = false;
-        appProcessButton();
-        if (!appIsGateway && ledIsPairInProgress()) {
-            ledSet();
-            sensorPoll();
-        }
+// Find the request that begins at an offset within a queued entry, which is the whole entry
+// unless it's a batch, returning false if there isn't one because the batch is malformed
+bool gatewayNotecardRequestAt(notecardQueueEntry *entry, uint32_t offset, uint8_t **reqData, uint32_t *reqDataLen, uint32_t *nextOffset)
+{
+    *nextOffset = entry->dataLen;
+    if (offset == 0) {
+        *reqData = entry->data;
+        *reqDataLen = entry->dataLen;
+        return entry->dataLen > 0;
     }
-    if (TimerEventOccurred) {
-        TimerEventOccurred = false;
-        sensorPoll();
+    if (offset + sizeof(uint16_t) > entry->dataLen) {
+        return false;
     }
-    if (TraceEventOccurred) {
-        TraceEventOccurred = false;
-        traceInput();
+    uint32_t len = entry->data[offset] | (entry->data[offset+1] << 8);
+    uint32_t next = offset + sizeof(uint16_t) + len;
+    if (len == 0 || next > entry->dataLen || entry->data[offset+sizeof(uint16_t)] == COMPACT_BATCH) {
+        return false;
     }
+    *reqData = &entry->data[offset+sizeof(uint16_t)];
+    *reqDataLen = len;
+    *nextOffset = next;
+    return true;
+}
 
-    // Exit if not yet paired
-    if (!ledIsPairInProgress() && memcmp(gatewayAddress, invalidAddress, sizeof(gatewayAddress)) == 0) {
-        APP_PRINTF("%s not currently paired with a gateway\r\n", tracePeer());
-        ledReset();
-        for (int i=0; i<5; i++) {
-            ledWalk();
-            HAL_Delay(50);
+// Gather the compact note.adds at the head of the queue, in order and across sensors, each
+// formatted as a line so that they may be performed together.  Returns how many were
+// gathered, noting for each the entry and the offset within it at which it ends.
+uint32_t gatewayNotecardGather(char **lines, uint32_t *lineLen, uint32_t *endEntry, uint32_t *endOffset)
+{
+    uint32_t count = 0;
+    for (uint32_t i=0; i<notecardQueued; i++) {
+        notecardQueueEntry *entry = &notecardQueue[i];
+        uint32_t offset = entry->offset;
+        while (offset < entry->dataLen) {
+            uint8_t *reqData;
+            uint32_t reqDataLen;
+            uint32_t nextOffset;
+            if (count >= GATEWAY_NOTECARD_COALESCE_MAX
+                    || !gatewayNotecardRequestAt(entry, offset, &reqData, &reqDataLen, &nextOffset)) {
+                return count;
+            }
+            traceSetID("fm", entry->sensorAddress, entry->requestID);
+            lines[count] = gatewayFormatCompactNote(entry->sensorAddress, reqData, reqDataLen, &lineLen[count]);
+            if (lines[count] == NULL) {
+                return count;
+            }
+            endEntry[count] = i;
+            endOffset[count] = nextOffset;
+            count++;
+            offset = nextOffset;
         }
-        ledReset();
-        sensorCoreIdle();
-#ifdef TRACE_STATE
-        APP_PRINTF("EXIT %d\r\n", CurrentStateCore);
-#endif
-        return;
     }
+    return count;
+}
 
-    // Dispatch based upon state
-    switch (CurrentStateCore) {
-
-    case TW_OPEN:
-        if (NoteTimeST() >= twSlotExpiresTime) {
-            APP_PRINTF("%s *** transmit window expired ***\r\n", tracePeer());
-            schedRequestResponseTimeout();
-            sensorCoreIdle();
-            break;
-        }
-        twLBTRetriesRemaining = twLBTRetries;
-        if (!lbtListenBeforeTalk()) {
-            lbtTalk();
-            break;
+// Dequeue the entries at the head of the queue that are done, releasing them from flash
+void gatewayNotecardDequeueDone()
+{
+    while (notecardQueued > 0 && notecardQueue[0].offset >= notecardQueue[0].dataLen) {
+        notecardQueueEntry *entry = &notecardQueue[0];
+        gatewaySensorLatency(entry->sensorAddress, entry->originMs);
+        memset(entry->data, '?', entry->dataLen);
+        poolFree(entry->data);
+        if (entry->stored) {
+            flashStoreRelease(1);
+            notecardStoreLoaded--;
         }
-        break;
+        notecardQueued--;
+        memmove(&notecardQueue[0], &notecardQueue[1], notecardQueued * sizeof(notecardQueue[0]));
+    }
+}
 
-    case RX: {
+// Background task that performs queued sensor requests against the Notecard, one per
+// invocation so that radio events are serviced between them, except that compact note.adds
+// are performed together.  The requests within a batch are performed one per invocation
+// too, so that if the Notecard is busy or unreachable, those already performed aren't
+// performed again when the rest are retried.
+void appGatewayNotecardProcess()
+{
 
-        // If we've successfully received something while we're in an LBT 'listening'
+    // Take the oldest request, bringing in any that are stored
+    gatewayNotecardLoad();
+    if (notecardQueued == 0) {
+        return;
+    }
+    notecardQueueEntry *entry = &notecardQueue[0];
+
+    // Let the exchange under way with a sensor finish first
+    uint32_t deferMs = gatewayNotecardDeferMs();
+    if (deferMs != 0) {
+        gatewayNotecardWait(deferMs);
+        return;
+    }
+
+    // Give others a chance to join the oldest if it's a compact note.add, while there's room
+    uint8_t *headData;
+    uint32_t headDataLen;
+    uint32_t headNextOffset;
+    if (GATEWAY_NOTECARD_COALESCE_MAX > 1 && notecardQueued < GATEWAY_NOTECARD_QUEUE_MAX
+            && gatewayNotecardRequestAt(entry, entry->offset, &headData, &headDataLen, &headNextOffset)
+            && headData[0] == COMPACT_NOTE_ADD) {
+        int64_t waitedMs = TIMER_IF_GetTimeMs() - entry->queuedMs;
+        if (waitedMs < GATEWAY_NOTECARD_COALESCE_MS) {
+            gatewayNotecardWait((uint32_t) (GATEWAY_NOTECARD_COALESCE_MS - waitedMs));
+            return;
+        }
+    }
+
+    // Perform the compact note.adds at the head of the queue together if there are any, and
+    // otherwise the next request, discarding responses because the sensors didn't ask for them
+    char *lines[GATEWAY_NOTECARD_COALESCE_MAX];
+    uint32_t lineLen[GATEWAY_NOTECARD_COALESCE_MAX];
+    uint32_t endEntry[GATEWAY_NOTECARD_COALESCE_MAX];
+    uint32_t endOffset[GATEWAY_NOTECARD_COALESCE_MAX];
+    uint32_t count = gatewayNotecardGather(lines, lineLen, endEntry, endOffset);
+    bool success = true;
+    if (count > 0) {
+        MX_ClockBoost();
+        success = gatewayPerformCompactNoteLines(lines, lineLen, count);
+        MX_ClockRelax();
+        for (uint32_t i=0; i<count; i++) {
+            memset(lines[i], '?', lineLen[i]);
+            poolFree(lines[i]);
+        }
+    } else {
+        uint8_t *reqData;
+        uint32_t reqDataLen;
+        uint32_t nextOffset;
+        traceSetID("fm", entry->sensorAddress, entry->requestID);
+        if (!gatewayNotecardRequestAt(entry, entry->offset, &reqData, &reqDataLen, &nextOffset)) {
+            APP_PRINTF("%s batch is malformed\r\n", tracePeer());
+        } else {
+            uint8_t *rspData;
+            uint32_t rspDataLen;
+            MX_ClockBoost();
+            success = gatewayProcessSensorRequest(entry->sensorAddress, reqData, reqDataLen, &rspData, &rspDataLen);
+            MX_ClockRelax();
+            if (success) {
+                memset(rspData, '?', rspDataLen);
+                poolFree(rspData);
+            }
+        }
+        count = 1;
+        endEntry[0] = 0;
+        endOffset[0] = nextOffset;
+    }
+
+    // If the Notecard is busy or unreachable, keep our place and try again later
+    if (!success) {
+        notecardRetryMs = (notecardRetryMs == 0) ? GATEWAY_NOTECARD_RETRY_MIN_MS : notecardRetryMs*2;
+        if (notecardRetryMs > GATEWAY_NOTECARD_RETRY_MAX_MS) {
+            notecardRetryMs = GATEWAY_NOTECARD_RETRY_MAX_MS;
+        }
+        APP_PRINTF("%s *** notecard unavailable: retrying in %dms (%d queued, %d stored) ***\r\n",
+                   tracePeer(), notecardRetryMs, notecardQueued, flashStorePending());
+        gatewayNotecardWait(notecardRetryMs);
+        return;
+    }
+    notecardRetryMs = 0;
+
+    // Move past what was performed, dequeueing the entries that are done
+    for (uint32_t i=0; i<endEntry[count-1]; i++) {
+        notecardQueue[i].offset = notecardQueue[i].dataLen;
+    }
+    notecardQueue[endEntry[count-1]].offset = endOffset[count-1];
+    gatewayNotecardDequeueDone();
+
+    // Continue with the next, or do the housekeeping that was deferred while we were busy
+    if (!gatewayNotecardIdle()) {
+        UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Notecard_Process), CFG_SEQ_Prio_Notecard);
+    } else {
+        gatewayHousekeeping(forceSensorRefresh, cachedSensors);
+        forceSensorRefresh = false;
+    }
+
+}
+
+// Background task that resumes the gateway's housekeeping in the next gap between windows,
+// unless it will be done anyway once the queue of Notecard requests has drained
+void appGatewayHousekeepingProcess()
+{
+    if (gatewayNotecardIdle()) {
+        gatewayHousekeeping(forceSensorRefresh, cachedSensors);
+        forceSensorRefresh = false;
+    }
+}
+
+// Compute how long remains before one of our sensors is next expected to transmit, which is
+// none while we're within the window of a sensor that we haven't yet heard from in it.  In
+// that case the time until that window ends is also returned.  Windows of the sensors of
+// neighboring gateways with which we share a modulus are gaps for us, as are those of our
+// sensors that have told us that they won't be due until a later one.
+uint32_t gatewaySlotGapSecs(uint32_t *waitSecs)
+{
+    if (waitSecs != NULL) {
+        *waitSecs = 0;
+    }
+    if (!appTimeValid() || TWModulusSecs == 0) {
+        return 0xFFFFFFFFU;
+    }
+    uint32_t now = appTime();
+    uint32_t windowRelativeNowTime = now - TWModulusOffsetSecs;
+    uint32_t thisWindowBeginTime = (windowRelativeNowTime / TWModulusSecs) * TWModulusSecs;
+    uint32_t windowOffsetSecs = windowRelativeNowTime - thisWindowBeginTime;
+    uint32_t gapSecs = TWModulusSecs;
+    for (int i=0; i<cachedSensors; i++) {
+        requestState *r = &requestCache[i];
+        if (r->twSlotEndsSecs == 0) {
+            continue;
+        }
+        if (windowOffsetSecs >= r->twSlotBeginsSecs && windowOffsetSecs < r->twSlotEndsSecs) {
+            uint32_t slotBeganTime = thisWindowBeginTime + TWModulusOffsetSecs + r->twSlotBeginsSecs;
+            if (gatewayCalendarSkips(r, now + (r->twSlotEndsSecs - windowOffsetSecs))) {
+                continue;
+            }
+            if (r->lastReceivedTime < slotBeganTime) {
+                if (waitSecs != NULL && r->twSlotEndsSecs - windowOffsetSecs > *waitSecs) {
+                    *waitSecs = r->twSlotEndsSecs - windowOffsetSecs;
+                }
+                gapSecs = 0;
+            }
+            continue;
+        }
+        uint32_t untilSecs = (r->twSlotBeginsSecs > windowOffsetSecs)
+                             ? r->twSlotBeginsSecs - windowOffsetSecs
+                             : (TWModulusSecs - windowOffsetSecs) + r->twSlotBeginsSecs;
+        if (gatewayCalendarSkips(r, now + untilSecs + (r->twSlotEndsSecs - r->twSlotBeginsSecs))) {
+            continue;
+        }
+        if (untilSecs < gapSecs) {
+            gapSecs = untilSecs;
+        }
+    }
+    return gapSecs;
+}
+
+// Take the schedule prefix off a request, in place, noting in the calendar when the sensor
+// that sent it is next due.  What it advertised was as of when it sent the first chunk.
+void gatewayCalendarLearn(requestState *request, uint8_t *data, uint32_t *len)
+{
+    uint32_t periodSecs, dueSecs;
+    uint32_t prefixLen = compactDecodeSchedule(data, *len, &periodSecs, &dueSecs);
+    if (prefixLen == 0) {
+        return;
+    }
+    *len -= prefixLen;
+    memmove(data, &data[prefixLen], *len);
+    if (!appTimeValid()) {
+        return;
+    }
+    int64_t agoMs = TIMER_IF_GetTimeMs() - request->requestBeganMs;
+    uint32_t sentTime = appTime() - ((agoMs > 0) ? (uint32_t) (agoMs / 1000) : 0);
+    request->expectedTime = sentTime + dueSecs;
+    request->expectedPeriodSecs = periodSecs;
+}
+
+// Note that a frame has arrived from a sensor, which if it was due means that its activation has
+// come and the next is a period later, until the request tells us more precisely
+void gatewayCalendarHeard(requestState *request)
+{
+    uint32_t now = appTime();
+    if (request->expectedTime == 0 || request->expectedTime > now) {
+        return;
+    }
+    if (request->late) {
+        request->late = false;
+        APP_PRINTF("%s calendar: late sensor heard %ds after it was due\r\n", tracePeer(), now - request->expectedTime);
+    }
+    if (request->expectedPeriodSecs == 0) {
+        request->expectedTime = 0;
+        return;
+    }
+    request->expectedTime += (((now - request->expectedTime) / request->expectedPeriodSecs) + 1) * request->expectedPeriodSecs;
+}
+
+// Flag the sensors that have missed the slot that followed when they were due
+void gatewayCalendarUpdate()
+{
+    if (!appTimeValid() || TWModulusSecs == 0) {
+        return;
+    }
+    uint32_t now = appTime();
+    for (int i=0; i<cachedSensors; i++) {
+        requestState *r = &requestCache[i];
+        if (r->expectedTime == 0 || r->late || now < r->expectedTime + TWModulusSecs + GATEWAY_CALENDAR_LATE_SECS) {
+            continue;
+        }
+        r->late = true;
+        char address[40];
+        utilAddressToText(r->sensorAddress, address, sizeof(address));
+        APP_PRINTF("calendar: *** %s is late, having been due %ds ago ***\r\n", address, now - r->expectedTime);
+    }
+}
+
+// See whether a sensor's slot that ends then can be left free, because the sensor has told us
+// that it won't be due until after it.  A late sensor may come in any slot.
+bool gatewayCalendarSkips(requestState *request, uint32_t slotEndsTime)
+{
+    return (request->expectedTime != 0 && !request->late && request->expectedTime >= slotEndsTime);
+}
+
+// See whether a sensor is due shortly, so that its entry in the request cache is kept for it
+bool gatewayCalendarDueSoon(requestState *request)
+{
+    uint32_t now = appTime();
+    return (request->expectedTime != 0 && !request->late
+            && request->expectedTime <= now + GATEWAY_CALENDAR_PREWARM_SECS
+            && request->expectedTime + TWModulusSecs >= now);
+}
+
+// Display when each sensor that advertised its schedule is next due
+void appGatewayCalendarShow()
+{
+    uint32_t now = appTime();
+    bool shown = false;
+    for (int i=0; i<cachedSensors; i++) {
+        requestState *r = &requestCache[i];
+        if (r->expectedTime == 0) {
+            continue;
+        }
+        shown = true;
+        char address[40];
+        utilAddressToText(r->sensorAddress, address, sizeof(address));
+        const char *name = NULL;
+        flashConfigFindPeerName(r->sensorAddress, &name, NULL);
+        int32_t dueSecs = (int32_t) (r->expectedTime - now);
+        APP_PRINTF("calendar: %s %s due in %ds, every %ds, slot %d-%d%s\r\n", address, (name == NULL) ? "" : name,
+                   dueSecs, r->expectedPeriodSecs, r->twSlotBeginsSecs, r->twSlotEndsSecs, r->late ? " LATE" : "");
+    }
+    if (!shown) {
+        APP_PRINTF("calendar: no sensor has advertised its schedule\r\n");
+    }
+}
+
+// Wait for a message from a specific sensor
+void gatewayWaitForSensorMessage()
+{
+    memset(&wireReceivedCarrier, 0, sizeof(wireReceivedCarrier));
+    memset(&wireReceived, 0, sizeof(wireReceived));
+    ledIndicateReceiveInProgress(true);
+    radioSetChannel();
+    wireReceiveTimeoutMs = radioReplyTimeoutMs(SOLICITED_COMMS_RX_MARGIN_MS);
+    gatewayListenHopping = false;
+    ListenPhaseBeforeTalk = false;
+    radioRx(wireReceiveTimeoutMs);
+    gatewayExchangeUntilMs = TIMER_IF_GetTimeMs() + wireReceiveTimeoutMs;
+    APP_PRINTF("%s waiting for message from a specific sensor\r\n", tracePeer());
+    appSetCoreState(LOWPOWER);
+}
+
+// Wait for a message from any sensor
+void gatewayWaitForAnySensorMessage()
+{
+    gatewayExchangeUntilMs = 0;
+    gatewaySwitchUnconfirmed = false;
+    MX_AES_CTR_SessionEnd();
+    radioSetSpreadingFactor(0);
+    radioSetCodingRate(0);
+    radioSetChannelIndex(0);
+    radioSetWakeupPreamble(false);
+    atpMaximizePowerLevel();
+    gatewayCalendarUpdate();
+    if (gatewayAnnounceDue()) {
+        gatewayAnnounce();
+        return;
+    }
+    requestState *wake = gatewayWakeDue();
+    if (wake != NULL) {
+        gatewayWake(wake);
+        return;
+    }
+    if (gatewayBroadcastDue()) {
+        gatewayBroadcast();
+        return;
+    }
+    uint32_t errorAgoMs;
+    uint32_t errors = radioRxErrorsTake(&errorAgoMs);
+    while (errors-- > 0) {
+        twHeatCount(errorAgoMs / 1000);
+    }
+    memset(&wireReceivedCarrier, 0, sizeof(wireReceivedCarrier));
+    memset(&wireReceived, 0, sizeof(wireReceived));
+    ledIndicateReceiveInProgress(true);
+    radioSetChannelIndex(twGatewayListenChannel(&wireReceiveTimeoutMs));
+    radioSetChannel();
+    gatewayListenHopping = (wireReceiveTimeoutMs != UNSOLICITED_RX_TIMEOUT_VALUE);
+    ListenPhaseBeforeTalk = false;
+    radioRx(wireReceiveTimeoutMs);
+    showReceivedTime("rx", 0, 0);
+    APP_PRINTF("\r\n");
+    appSetCoreState(LOWPOWER);
+}
+
+// Begin a receive on gateway
+void sensorWaitForGatewayMessage()
+{
+    memset(&wireReceivedCarrier, 0, sizeof(wireReceivedCarrier));
+    memset(&wireReceived, 0, sizeof(wireReceived));
+    ledIndicateReceiveInProgress(true);
+    radioSetChannel();
+
+    // Wait for an ACK for as long as the round trip measured on the link says is needed, and
+    // learn from it if the frame that it acknowledges went out only once
+    sensorAckAwaited = (sentMessage.Flags & MESSAGE_FLAG_ACK) == 0;
+    wireReceiveTimeoutMs = sensorAckAwaited ? sensorAckTimeoutMs() : radioReplyTimeoutMs(SOLICITED_COMMS_RX_MARGIN_MS);
+    if ((sentMessage.Flags & MESSAGE_FLAG_BEACON) != 0) {
+        wireReceiveTimeoutMs = radioReplyTimeoutMs(SOLICITED_COMMS_RX_MARGIN_MS) + GATEWAY_PAIR_DEFER_MAX_MS;
+        sensorAckAwaited = false;
+    }
+    if (GATEWAY_RESPONSE_IN_ACK && (sentMessage.Flags & (MESSAGE_FLAG_RESPONSE|MESSAGE_FLAG_ACK)) == MESSAGE_FLAG_RESPONSE
+            && sentMessage.Offset+sentMessage.Len >= sentMessage.TotalLen) {
+        // The gateway performs the request before its final ACK, which may carry the response
+        wireReceiveTimeoutMs = radioReplyTimeoutMs(SOLICITED_PROCESSING_RX_MARGIN_MS);
+        sensorAckAwaited = false;
+    }
+    sensorRttSampling = sensorAckAwaited && !sensorRttResent;
+    sensorRttResent = false;
+    sensorAckWaitBeganMs = TIMER_IF_GetTimeMs();
+    ListenPhaseBeforeTalk = false;
+    if (sensorAckAwaited && sentCompactAckExpected) {
+        radioImplicitHeaderNext(sizeof(wireCompactAck));
+    }
+    radioRx(wireReceiveTimeoutMs);
+    APP_PRINTF("%s waiting for message from gateway\r\n", tracePeer());
+    appSetCoreState(LOWPOWER);
+}
+
+// Begin a receive on gateway, waiting for a response which may take a while.  If the gateway
+// told us when to expect it, sleep until just before then.
+void sensorWaitForGatewayResponse()
+{
+    sensorResponseExpectedMs = 0;
+    if (sensorResponseDelayMs != 0) {
+        sensorResponseExpectedMs = sensorResponseAckMs + sensorResponseDelayMs;
+        int64_t sleepMs = sensorResponseExpectedMs - sensorResponseGuardMs() - radioWakeupRequiredMs() - TIMER_IF_GetTimeMs();
+        if (!sensorResponseWindowMissed && sleepMs >= SENSOR_RESPONSE_SLEEP_MIN_MS) {
+            APP_PRINTF("%s sleeping %dms until response is due\r\n", tracePeer(), (uint32_t) sleepMs);
+            sensorResponseWindowPending = true;
+            UTIL_TIMER_Stop(&rxSleepTimer);
+            UTIL_TIMER_SetPeriod(&rxSleepTimer, (uint32_t) sleepMs);
+            UTIL_TIMER_Start(&rxSleepTimer);
+            appSetCoreState(LOWPOWER);
+            return;
+        }
+    }
+    sensorResponseWindowShort = false;
+    memset(&wireReceivedCarrier, 0, sizeof(wireReceivedCarrier));
+    memset(&wireReceived, 0, sizeof(wireReceived));
+    ledIndicateReceiveInProgress(true);
+    radioSetChannel();
+    wireReceiveTimeoutMs = radioReplyTimeoutMs(SOLICITED_PROCESSING_RX_MARGIN_MS);
+    ListenPhaseBeforeTalk = false;
+    radioRx(wireReceiveTimeoutMs);
+    APP_PRINTF("%s waiting for response from gateway\r\n", tracePeer());
+    appSetCoreState(LOWPOWER);
+}
+
+// Listen for the response only within the guard around when it's due
+void sensorOpenResponseWindow()
+{
+    sensorResponseWindowPending = false;
+    sensorResponseWindowShort = true;
+    memset(&wireReceivedCarrier, 0, sizeof(wireReceivedCarrier));
+    memset(&wireReceived, 0, sizeof(wireReceived));
+    ledIndicateReceiveInProgress(true);
+    radioSetChannel();
+    wireReceiveTimeoutMs = radioWakeupRequiredMs() + (sensorResponseGuardMs()*2) + radioMessageTimeOnAirMs(0);
+    ListenPhaseBeforeTalk = false;
+    radioRx(wireReceiveTimeoutMs);
+    APP_PRINTF("%s listening %dms for response from gateway\r\n", tracePeer(), wireReceiveTimeoutMs);
+    appSetCoreState(LOWPOWER);
+}
+
+// Compute the guard on either side of when the response is due
+uint32_t sensorResponseGuardMs()
+{
+    uint32_t guardMs = sensorResponseJitterMs * 2;
+    return (guardMs < SENSOR_RESPONSE_GUARD_MIN_MS) ? SENSOR_RESPONSE_GUARD_MIN_MS : guardMs;
+}
+
+// Measure how far from the expected time the response actually began, so that the
+// guard tracks the jitter in the gateway's processing.
+void sensorResponseArrived()
+{
+    sensorResponseWindowShort = false;
+    sensorResponseWindowMissed = false;
+    if (sensorResponseExpectedMs == 0) {
+        return;
+    }
+    int64_t beganMs = radioReceivedMs() - radioTimeOnAirMs(wireReceivedLen);
+    int64_t errorMs = beganMs - sensorResponseExpectedMs;
+    if (errorMs < 0) {
+        errorMs = -errorMs;
+    }
+    sensorResponseJitterMs = ((sensorResponseJitterMs*3) + (uint32_t) errorMs) / 4;
+    sensorResponseExpectedMs = 0;
+}
+
+// Process the timed event for opening the response window
+void rxWindowEvent(void *context)
+{
+    appSetCoreState(RX_WINDOW_OPEN);
+}
+
+// Wait for the next chunk of a window that a specific sensor is sending back-to-back
+void gatewayWaitForSensorChunk()
+{
+    memset(&wireReceivedCarrier, 0, sizeof(wireReceivedCarrier));
+    memset(&wireReceived, 0, sizeof(wireReceived));
+    ledIndicateReceiveInProgress(true);
+    radioSetChannel();
+    wireReceiveTimeoutMs = radioReplyTimeoutMs(WINDOW_CHUNK_RX_MARGIN_MS);
+    gatewayListenHopping = false;
+    ListenPhaseBeforeTalk = false;
+    radioRx(wireReceiveTimeoutMs);
+    gatewayExchangeUntilMs = TIMER_IF_GetTimeMs() + wireReceiveTimeoutMs;
+    APP_PRINTF("%s waiting for next chunk of window from sensor\r\n", tracePeer());
+    appSetCoreState(LOWPOWER);
+}
+
+// Restart the receive with the specified timeout
+void restartReceive(uint32_t timeoutMs)
+{
+    memset(&wireReceivedCarrier, 0, sizeof(wireReceivedCarrier));
+    memset(&wireReceived, 0, sizeof(wireReceived));
+    ledIndicateReceiveInProgress(true);
+    radioSetChannel();
+    ListenPhaseBeforeTalk = false;
+    if (!appIsGateway) {
+        radioImplicitHeaderNext(radioImplicitHeaderLen());
+    }
+    radioRx(timeoutMs);
+    showReceivedTime("restarting rx", 0, 0);
+    APP_PRINTF("\r\n");
+    appSetCoreState(LOWPOWER);
+    return;
+}
+
+// Initialize sensor
+void appSensorInit()
+{
+
+    // Create the timers used to sleep until the transmit window and the response are due
+    UTIL_TIMER_Create(&twSleepTimer, 0xFFFFFFFFU, UTIL_TIMER_ONESHOT, twOpenEvent, NULL);
+    UTIL_TIMER_Create(&rxSleepTimer, 0xFFFFFFFFU, UTIL_TIMER_ONESHOT, rxWindowEvent, NULL);
+    // Initialize the scheduler, including the apps that take firmware updates and settings from
+    // the gateway
+    schedInit();
+    dfuLoraSensorInit();
+    settingsSensorInit();
+
+    // Load the gateway's broadcast key, which is stored with the gateway's address
+    if (flashConfigFindPeerByType(PEER_TYPE_GATEWAY, NULL, sensorBroadcastKey, NULL)) {
+        sensorHasBroadcastKey = (memcmp(sensorBroadcastKey, invalidKey, sizeof(invalidKey)) != 0);
+    }
+
+    // Pick up where we left off if we were reset while paired with this gateway
+    sensorSnapshotRestore();
+}
+
+// Compute the check word over the snapshot's contents
+static uint32_t sensorSnapshotCheck(uint32_t *words)
+{
+    uint32_t check = SNAPSHOT_MAGIC;
+    for (int i=SNAPSHOT_GATEWAY_WORD; i<SNAPSHOT_WORDS; i++) {
+        check = ((check << 5) | (check >> 27)) ^ words[i];
+    }
+    return check;
+}
+
+// Save link state to the backup registers, which survive reset and every low power mode
+void sensorSnapshotSave()
+{
+    uint32_t words[SNAPSHOT_WORDS];
+    words[SNAPSHOT_MAGIC_WORD] = SNAPSHOT_MAGIC;
+    words[SNAPSHOT_GATEWAY_WORD] = utilHashAddress(gatewayAddress);
+    words[SNAPSHOT_REQUEST_ID_WORD] = LastRequestID;
+    words[SNAPSHOT_MODULUS_WORD] = TWModulusSecs;
+    words[SNAPSHOT_OFFSET_LBT_WORD] = TWModulusOffsetSecs | ((uint32_t)TWListenBeforeTalkMs << 16);
+    words[SNAPSHOT_SLOT_WORD] = TWSlotBeginsSecs | ((uint32_t)TWSlotEndsSecs << 16);
+    words[SNAPSHOT_CHANNEL_WORD] = twSlotChannel;
+    words[SNAPSHOT_BROADCAST_WORD] = sensorLastBroadcastTime;
+    atpSnapshot(&words[SNAPSHOT_ATP_WORD]);
+    words[SNAPSHOT_CHECK_WORD] = sensorSnapshotCheck(words);
+    for (int i=0; i<SNAPSHOT_WORDS; i++) {
+        HAL_RTCEx_BKUPWrite(&hrtc, SNAPSHOT_FIRST_REGISTER+i, words[i]);
+    }
+}
+
+// Restore link state saved before a reset, if it was saved while paired with the same gateway.
+// The gateway's boot time is deliberately not retained, because a change in it is what
+// triggers the reset, and the scheduler's state is in gateway time that we don't yet know.
+void sensorSnapshotRestore()
+{
+    uint32_t words[SNAPSHOT_WORDS];
+    for (int i=0; i<SNAPSHOT_WORDS; i++) {
+        words[i] = HAL_RTCEx_BKUPRead(&hrtc, SNAPSHOT_FIRST_REGISTER+i);
+    }
+    if (words[SNAPSHOT_MAGIC_WORD] != SNAPSHOT_MAGIC
+            || words[SNAPSHOT_CHECK_WORD] != sensorSnapshotCheck(words)
+            || words[SNAPSHOT_GATEWAY_WORD] != utilHashAddress(gatewayAddress)) {
+        return;
+    }
+    LastRequestID = words[SNAPSHOT_REQUEST_ID_WORD];
+    TWModulusSecs = words[SNAPSHOT_MODULUS_WORD];
+    TWModulusOffsetSecs = (uint16_t) words[SNAPSHOT_OFFSET_LBT_WORD];
+    TWListenBeforeTalkMs = (uint16_t) (words[SNAPSHOT_OFFSET_LBT_WORD] >> 16);
+    TWSlotBeginsSecs = (uint16_t) words[SNAPSHOT_SLOT_WORD];
+    TWSlotEndsSecs = (uint16_t) (words[SNAPSHOT_SLOT_WORD] >> 16);
+    twSlotChannel = (uint8_t) words[SNAPSHOT_CHANNEL_WORD];
+    sensorLastBroadcastTime = words[SNAPSHOT_BROADCAST_WORD];
+    atpRestore(&words[SNAPSHOT_ATP_WORD]);
+    APP_PRINTF("%s resuming after reset at request %d\r\n", tracePeer(), LastRequestID);
+}
+
+// Set sensor task in a low power core state
+void sensorCoreIdle()
+{
+    MX_AES_CTR_SessionEnd();
+    radioSetSpreadingFactor(0);
+    radioSetCodingRate(0);
+    radioSetChannelIndex(0);
+    sensorResponseWindowShort = false;
+    sensorSnapshotSave();
+    if (sensorResponseWindowPending) {
+        sensorResponseWindowPending = false;
+        UTIL_TIMER_Stop(&rxSleepTimer);
+    }
+
+    // Now that the exchange is over, get anything that was queued behind it moving
+    sensorRequestInFlight = false;
+    sensorRequestUrgent = false;
+    sensorRequestStored = 0;
+    if (sensorQueued > 0 || sensorStoreDrainDue()) {
+        sensorTimerWakeFromISR();
+    }
+
+    // Refresh the battery voltage for the next exchange while we would otherwise be idle
+#ifdef USE_SPARROW
+    MX_ADC_A0_Sample(NULL);
+#endif
+
+    sensorSniff();
+    appSetCoreState(LOWPOWER);
+}
+
+// Listen for a wakeup from the gateway until our next exchange, if enabled
+void sensorSniff()
+{
+    if (ledIsPairInProgress() || ledIsPairMandatory()) {
+        return;
+    }
+    if (radioRelayListen()) {
+        return;
+    }
+    radioSniff();
+}
+
+// Process what was received while sniffing, checking in if the gateway woke us, unless it's
+// a frame that we relay for a far sensor
+void sensorSniffReceived(bool received)
+{
+    if (received && !sensorRequestInFlight && relayFrameReceived()) {
+        appSetCoreState(LOWPOWER);
+        return;
+    }
+    if (received && validateReceivedMessage()
+            && memcmp(wireReceivedCarrier.Sender, gatewayAddress, sizeof(gatewayAddress)) == 0) {
+        if ((wireReceived.Flags & MESSAGE_FLAG_BROADCAST) != 0) {
+            sensorBroadcastReceived();
+        } else if ((wireReceived.Flags & (MESSAGE_FLAG_WAKEUP|MESSAGE_FLAG_ACK)) == MESSAGE_FLAG_WAKEUP) {
+            sensorCheckIn();
+        }
+    }
+    if (!sensorRequestInFlight) {
+        MX_AES_CTR_SessionEnd();
+    }
+    sensorSniff();
+    appSetCoreState(LOWPOWER);
+}
+
+// Send the gateway a request that it performs itself, so that its ACK brings us up to date
+void sensorCheckIn()
+{
+    int64_t now = TIMER_IF_GetTimeMs();
+    if (sensorCheckedIn && now - sensorCheckInMs < SENSOR_WAKEUP_MIN_SECS*1000) {
+        return;
+    }
+    if (sensorRequestInFlight || sensorQueued > 0) {
+        return;
+    }
+    J *req = NoteNewRequest(SENSOR_CHECKIN_REQUEST);
+    if (req == NULL) {
+        return;
+    }
+    uint8_t *reqData = (uint8_t *) JConvertToJSONString(req);
+    JDelete(req);
+    if (reqData == NULL) {
+        return;
+    }
+    sensorCheckedIn = true;
+    sensorCheckInMs = now;
+    APP_PRINTF("%s woken by gateway: checking in\r\n", tracePeer());
+    sensorRequestAppID = -1;
+    sensorRequestStorable = false;
+    sensorRequestCreatedMs = now;
+    sensorTransmitToGateway(false, reqData, strlen((char *)reqData), true);
+}
+
+// Note which chunks of the window the gateway says that it has actually received, returning
+// false if the ACK just received isn't of the request that we're sending
+bool sensorAckReceivedChunks(uint32_t ackedLen, uint32_t sackBitmap)
+{
+    if (wireReceived.RequestID != messageToSendRequestID
+            || ackedLen < messageToSendAcknowledgedLen || ackedLen > messageToSendDataLen) {
+        return false;
+    }
+    if (sackBitmap != 0 || ackedLen < sentMessage.Offset+sentMessage.Len) {
+        APP_PRINTF("%s selective ack (%d/%d) map:%08x\r\n", tracePeer(),
+                   ackedLen, messageToSendDataLen, sackBitmap);
+    }
+    messageToSendAcknowledgedLen = ackedLen;
+    messageToSendSackMap = sackBitmap;
+    return true;
+}
+
+// See whether the ACK just received is a delta against the gateway's last full ACK
+bool sensorAckIsDelta()
+{
+    return (wireReceivedFields & MESSAGE_FIELD_DELTA) != 0;
+}
+
+// See whether the ACK just received is the extended ACK rather than the legacy one.  Compact
+// and delta ACKs are only ever sent in place of the extended ACK.
+bool sensorAckExtended()
+{
+    if (wireReceivedCompact || sensorAckIsDelta()) {
+        return true;
+    }
+    return wireReceived.Len > offsetof(gatewayAckBody, Format)
+           && wireReceived.Body[offsetof(gatewayAckBody, Format)] == GATEWAY_ACK_EXTENDED;
+}
+
+// Take our name from an ACK, given the bytes from the name to the end of the ACK
+void sensorAckName(char *name, uint32_t nameLen)
+{
+    if (nameLen > sizeof(sensorName)) {
+        nameLen = sizeof(sensorName);
+    }
+    if (nameLen == 0) {
+        sensorName[0] = '\0';
+        return;
+    }
+    memcpy(sensorName, name, nameLen);
+    sensorName[nameLen-1] = '\0';
+    for (size_t i=0; i<nameLen-1 && sensorName[i] != '\0'; i++) {
+        if (sensorName[i] < ' ') {
+            sensorName[i] = '?';
+        }
+    }
+}
+
+// Get the full body of the ACK just received.  A full ACK's fixed fields are kept for the
+// deltas that follow it, and a delta is expanded from them if it is against the version that
+// we hold.  If it isn't, configKnown is returned false, and we stop accepting deltas so that
+// the gateway sends our next ACK in full.
+gatewayAckBody *sensorAckExpand(bool *configKnown)
+{
+    if (!sensorAckIsDelta()) {
+        gatewayAckBody *body = (gatewayAckBody *)wireReceived.Body;
+        memcpy(&sensorAckConfig, body, sizeof(gatewayAckBody)-SENSOR_NAME_MAX);
+        sensorAckConfigVersion = body->ConfigVersion;
+        *configKnown = true;
+        return body;
+    }
+    static gatewayAckBody body;
+    gatewayAckDeltaBody *delta = (gatewayAckDeltaBody *)wireReceived.Body;
+    memcpy(&body, &sensorAckConfig, sizeof(gatewayAckBody)-SENSOR_NAME_MAX);
+    body.Name[0] = '\0';
+    body.AckedLen = delta->AckedLen;
+    body.SackBitmap = delta->SackBitmap;
+    body.Time = delta->Time;
+    body.TimeMs = delta->TimeMs;
+    body.SpreadingFactor = delta->SpreadingFactor;
+    body.CodingRate = delta->CodingRate;
+    body.ResponseDelayMs = delta->ResponseDelayMs;
+    body.RetryAfterSecs = delta->RetryAfterSecs;
+    body.ResponseLen = delta->ResponseLen;
+    *configKnown = (sensorAckConfigVersion != 0 && delta->ConfigVersion == sensorAckConfigVersion);
+    if (!*configKnown) {
+        APP_PRINTF("%s gateway's config has changed: asking for a full ACK\r\n", tracePeer());
+        sensorAckConfigVersion = 0;
+    }
+    return &body;
+}
+
+// Find the gateway's broadcast key at the end of the ACK just received, if it's there
+bool sensorAckBroadcastKey(uint8_t **key)
+{
+    if (!sensorAckExtended()) {
+        return false;
+    }
+    if (sensorAckIsDelta()) {
+        gatewayAckDeltaBody *delta = (gatewayAckDeltaBody *)wireReceived.Body;
+        if (wireReceived.Len < sizeof(gatewayAckDeltaBody) + AES_KEY_BYTES + delta->ResponseLen) {
+            return false;
+        }
+        *key = &wireReceived.Body[sizeof(gatewayAckDeltaBody)];
+        return true;
+    }
+    uint32_t fixedLen = sizeof(gatewayAckBody) - SENSOR_NAME_MAX;
+    if (wireReceived.Len < fixedLen) {
+        return false;
+    }
+    gatewayAckBody *body = (gatewayAckBody *)wireReceived.Body;
+    uint32_t nameRoom = wireReceived.Len - fixedLen;
+    if (body->ResponseLen < nameRoom) {
+        nameRoom -= body->ResponseLen;
+    }
+    uint32_t nameLen = 0;
+    while (nameLen < nameRoom && nameLen < SENSOR_NAME_MAX && body->Name[nameLen] != '\0') {
+        nameLen++;
+    }
+    if (nameLen >= SENSOR_NAME_MAX || nameRoom < nameLen + 1 + AES_KEY_BYTES) {
+        return false;
+    }
+    *key = &wireReceived.Body[fixedLen + nameLen + 1];
+    return true;
+}
+
+// Find the response that the gateway carried at the end of its ACK, returning its length,
+// or 0 if there is none
+uint32_t sensorAckResponse(uint8_t **rsp)
+{
+    if (!sensorAckExtended()) {
+        return 0;
+    }
+    if (sensorAckIsDelta()) {
+        gatewayAckDeltaBody *delta = (gatewayAckDeltaBody *)wireReceived.Body;
+        if (wireReceived.Len < sizeof(gatewayAckDeltaBody) || delta->ResponseLen == 0
+                || delta->ResponseLen > wireReceived.Len - sizeof(gatewayAckDeltaBody)) {
+            return 0;
+        }
+        *rsp = &wireReceived.Body[wireReceived.Len - delta->ResponseLen];
+        return delta->ResponseLen;
+    }
+    uint32_t fixedLen = sizeof(gatewayAckBody) - SENSOR_NAME_MAX;
+    if (wireReceived.Len < fixedLen) {
+        return 0;
+    }
+    gatewayAckBody *body = (gatewayAckBody *)wireReceived.Body;
+    if (body->ResponseLen == 0 || body->ResponseLen >= wireReceived.Len - fixedLen) {
+        return 0;
+    }
+    *rsp = &wireReceived.Body[wireReceived.Len - body->ResponseLen];
+    return body->ResponseLen;
+}
+
+// Take and process the response that the gateway carried in its final ACK
+void sensorResponseCarried(uint8_t *rsp, uint32_t rspLen)
+{
+    if (response.data != NULL) {
+        memset(response.data, '?', response.dataTotalLen);
+        poolFree(response.data);
+        response.data = NULL;
+    }
+    response.requestID = wireReceived.RequestID;
+    response.data = (uint8_t *) poolAlloc(rspLen+1);
+    response.dataTotalLen = rspLen;
+    response.dataAcknowledgedLen = rspLen;
+
+    // We can no longer retry this request because we're about to free the message buffer
+    sensorSendRetriesRemaining = 0;
+    freeMessageToSendBuffer();
+    if (response.data == NULL) {
+        APP_PRINTF("%s *** can't allocate carried response *** (%d)\r\n", tracePeer(), rspLen);
+        schedRequestResponseTimeout(sensorRequestAppID);
+        return;
+    }
+    memcpy(response.data, rsp, rspLen);
+    sensorProcessResponse();
+}
+
+// Save the gateway's broadcast key with the gateway's address
+void sensorBroadcastKeyLearned(uint8_t *key)
+{
+    if (sensorHasBroadcastKey && memcmp(sensorBroadcastKey, key, sizeof(sensorBroadcastKey)) == 0) {
+        return;
+    }
+    memcpy(sensorBroadcastKey, key, sizeof(sensorBroadcastKey));
+    sensorHasBroadcastKey = true;
+    flashConfigUpdatePeer(PEER_TYPE_GATEWAY, gatewayAddress, sensorBroadcastKey);
+    APP_PRINTF("%s received gateway's broadcast key\r\n", tracePeer());
+}
+
+// Adopt what the gateway broadcast to all of its sensors
+void sensorBroadcastReceived()
+{
+    gatewayBroadcastBody *body = (gatewayBroadcastBody *)wireReceived.Body;
+    uint32_t fixedLen = sizeof(gatewayBroadcastBody) - sizeof(body->Slots);
+    if (wireReceived.Len < fixedLen) {
+        return;
+    }
+
+    // Ignore anything that isn't newer than what we last accepted, so that replays are harmless
+    if (body->Time <= sensorLastBroadcastTime) {
+        APP_PRINTF("%s ignoring stale broadcast\r\n", tracePeer());
+        return;
+    }
+    sensorLastBroadcastTime = body->Time;
+    APP_PRINTF("%s received broadcast from gateway\r\n", tracePeer());
+    sensorGatewayBootTime(body->BootTime);
+
+    // Find our own slot, keeping the one we have if we aren't listed
+    uint16_t slotBeginsSecs = TWSlotBeginsSecs;
+    uint16_t slotEndsSecs = TWSlotEndsSecs;
+    uint8_t channel = twSlotChannel;
+    uint32_t ourHash = utilHashAddress(ourAddress);
+    uint32_t slots = (wireReceived.Len - fixedLen) / sizeof(gatewayBroadcastSlot);
+    for (uint32_t i=0; i<slots && i<GATEWAY_BROADCAST_SLOTS; i++) {
+        if (body->Slots[i].AddressHash == ourHash) {
+            slotBeginsSecs = body->Slots[i].TWSlotBeginsSecs;
+            slotEndsSecs = body->Slots[i].TWSlotEndsSecs;
+            channel = body->Slots[i].Channel;
+            break;
+        }
+    }
+
+    sensorGatewayTime(body->Time, body->TimeMs, body->ZoneOffsetMins, body->ZoneName);
+    sensorGatewaySchedule(body->TWModulusSecs, body->TWModulusOffsetSecs, slotBeginsSecs, slotEndsSecs,
+                          body->TWListenBeforeTalkMs, channel);
+    dfuLoraSensorAck(body->ImageCRC, body->ImageLen);
+}
+
+// If the gateway's boot time has changed, then either resynchronize with it or restart, just as
+// a way of resetting the world remotely
+void sensorGatewayBootTime(uint32_t bootTime)
+{
+    if (bootTime != 0) {
+        if (bootTime != gatewayBootTime) {
+            flashTemplatesGatewayBooted(bootTime);
+        }
+        if (gatewayBootTime != 0 && bootTime != gatewayBootTime) {
+            if (!SENSOR_RESYNC_WHEN_GATEWAY_REBOOTS) {
+                NVIC_SystemReset();
+            }
+            sensorGatewayResync();
+        }
+        gatewayBootTime = bootTime;
+    }
+}
+
+// Forget what the gateway lost when it rebooted.  It listens on the home channel until sensors
+// are heard again, and ACKs that went missing while it was down say nothing about the link.
+// Our slot is kept until the gateway assigns one, because those it assigned before don't
+// overlap, and it sends its first ACK to us in full because it holds no version that we do.
+void sensorGatewayResync()
+{
+    APP_PRINTF("%s gateway has rebooted: resynchronizing\r\n", tracePeer());
+    twSlotChannel = 0;
+    sensorRtoBackoff = 0;
+}
+
+// Set the local date/time from the gateway's, unless it's still booting and doesn't know it.
+// The gateway stamped the frame with when it began, which is when we finished receiving it
+// less its time on air.
+void sensorGatewayTime(uint32_t time, uint16_t timeMs, int16_t zoneOffsetMins, uint8_t *zoneName)
+{
+    if (time == 0) {
+        return;
+    }
+    int64_t beganMs = radioReceivedMs() - radioTimeOnAirMs(wireReceivedLen);
+    int64_t offsetMs = ((int64_t) time * 1000) + timeMs - beganMs;
+    if (timeSyncOffsetMs != 0) {
+        int64_t predictedMs = beganMs + timeSyncOffsetMs + (((beganMs - timeSyncLocalMs) * timeSyncDriftPpb) / 1000000000);
+        TRACE_PRINTF(TRACE_TW, VLEVEL_H, "%s clock corrected by %dms\r\n", tracePeer(), (int32_t) ((beganMs + offsetMs) - predictedMs));
+        sensorLearnDrift(offsetMs, beganMs);
+    }
+    timeSyncOffsetMs = offsetMs;
+    timeSyncLocalMs = beganMs;
+    char zone[4];
+    zone[0] = zoneName[0];
+    zone[1] = zoneName[1];
+    zone[2] = zoneName[2];
+    zone[3] = '\0';
+    NoteTimeSet((JTIME) (appTimeMs() / 1000), zoneOffsetMins, zone, NULL, NULL);
+}
+
+// Learn how fast our clock drifts from the gateway's by how much the offset between them has
+// changed since the last synchronization, provided that enough time has passed for the error
+// in a single synchronization to be negligible.  A sensor that sleeps for hours can then
+// keep to its slot with no more synchronization than its own exchanges.
+void sensorLearnDrift(int64_t offsetMs, int64_t localMs)
+{
+    int64_t elapsedMs = localMs - timeSyncLocalMs;
+    if (elapsedMs < (int64_t) TIME_SYNC_DRIFT_MIN_SECS * 1000) {
+        return;
+    }
+    int64_t ppb = ((offsetMs - timeSyncOffsetMs) * 1000000000) / elapsedMs;
+    if (ppb > (int64_t) TIME_SYNC_DRIFT_MAX_PPM * 1000 || ppb < -(int64_t) TIME_SYNC_DRIFT_MAX_PPM * 1000) {
+        TRACE_PRINTF(TRACE_TW, VLEVEL_H, "%s ignoring implausible drift of %dppb\r\n", tracePeer(), (int32_t) ppb);
+        return;
+    }
+    if (!timeSyncDriftLearned) {
+        timeSyncDriftPpb = (int32_t) ppb;
+        timeSyncDriftLearned = true;
+    } else {
+        timeSyncDriftPpb = (int32_t) (((int64_t) timeSyncDriftPpb * 3 + ppb) / 4);
+    }
+    TRACE_PRINTF(TRACE_TW, VLEVEL_M, "%s clock drift %dppb (measured %dppb over %ds)\r\n",
+                 tracePeer(), timeSyncDriftPpb, (int32_t) ppb, (uint32_t) (elapsedMs / 1000));
+}
+
+// Convert a period of the gateway's time into one of our own timer, correcting for drift
+uint32_t sensorLocalMs(uint32_t ms)
+{
+    return (uint32_t) (((int64_t) ms * 1000000000) / (1000000000 + timeSyncDriftPpb));
+}
+
+// Set the time window parameters assigned by the gateway
+void sensorGatewaySchedule(uint32_t modulusSecs, uint16_t modulusOffsetSecs, uint16_t slotBeginsSecs,
+                           uint16_t slotEndsSecs, uint16_t lbtMs, uint8_t channel)
+{
+
+    // Trace
+    if (TWModulusSecs != modulusSecs) {
+        APP_PRINTF("%s TWModulusSecs: from %d to %d\r\n", tracePeer(), TWModulusSecs, modulusSecs);
+    }
+    if (TWModulusOffsetSecs != modulusOffsetSecs) {
+        APP_PRINTF("%s TWModulusOffsetSecs: from %d to %d\r\n", tracePeer(), TWModulusOffsetSecs, modulusOffsetSecs);
+    }
+    if (TWSlotBeginsSecs != slotBeginsSecs) {
+        APP_PRINTF("%s TWSlotBeginsSecs: from %d to %d\r\n", tracePeer(), TWSlotBeginsSecs, slotBeginsSecs);
+    }
+    if (TWSlotEndsSecs != slotEndsSecs) {
+        APP_PRINTF("%s TWSlotEndsSecs: from %d to %d\r\n", tracePeer(), TWSlotEndsSecs, slotEndsSecs);
+    }
+    if (twSlotChannel != channel) {
+        APP_PRINTF("%s slot channel: from %d to %d\r\n", tracePeer(), twSlotChannel, channel);
+    }
+
+    // Set the time window parameters
+    TWModulusSecs = modulusSecs;
+    TWModulusOffsetSecs = modulusOffsetSecs;
+    TWSlotBeginsSecs = slotBeginsSecs;
+    TWSlotEndsSecs = slotEndsSecs;
+    TWListenBeforeTalkMs = lbtMs;
+    twSlotChannel = channel;
+
+}
+
+// Event task for Sensor, in which polling may take a while reading sensors, so it runs
+// below received frames and then lets the state machine settle whatever it changed
+void appSensorEvents()
+{
+    LATENCY_HOP(LATENCY_HOP_TASK);
+    traceSetID("", NULL, 0);
+    if (ButtonEventOccurred) {
+        ButtonEventOccurred = false;
+        appProcessButton();
+        if (ledIsPairInProgress()) {
+            ledSet();
+            sensorPoll();
+        }
+    }
+    if (TimerEventOccurred) {
+        TimerEventOccurred = false;
+        sensorPoll();
+    }
+    UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Sparrow_Process), CFG_SEQ_Prio_Radio);
+}
+
+// Application state machine for Sensor
+void appSensorProcess()
+{
+
+    TRACE_PRINTF(TRACE_APP, VLEVEL_H, "ENTER %d\r\n", CurrentStateCore);
+
+    // Default for the identity of the subject of tracing
+    traceSetID("", NULL, 0);
+
+    // Exit if not yet paired
+    if (!ledIsPairInProgress() && memcmp(gatewayAddress, invalidAddress, sizeof(gatewayAddress)) == 0) {
+        APP_PRINTF("%s not currently paired with a gateway\r\n", tracePeer());
+        ledIndicateNotPaired();
+        sensorCoreIdle();
+        TRACE_PRINTF(TRACE_APP, VLEVEL_H, "EXIT %d\r\n", CurrentStateCore);
+        return;
+    }
+
+    // Dispatch based upon state
+    switch (CurrentStateCore) {
+
+    case TW_OPEN:
+        relayCancel();
+        sensorExchangeChainable = false;
+        sensorExchangeBeganMs = TIMER_IF_GetTimeMs();
+        if (!sensorRequestUrgent && appTime() >= twSlotExpiresTime) {
+            APP_PRINTF("%s *** transmit window expired ***\r\n", tracePeer());
+            schedRequestResponseTimeout(sensorRequestAppID);
+            sensorCoreIdle();
+            break;
+        }
+        twLBTRetriesRemaining = twLBTRetries;
+        radioSetChannelIndex(twSensorTransmitChannel());
+        if (radioChannelIndex() != 0) {
+            TRACE_EVENT(TRACE_RADIO, VLEVEL_L, "transmitting", {"channel", radioChannelIndex()});
+        }
+        if (!lbtListenBeforeTalk()) {
+            lbtTalk();
+            break;
+        }
+        break;
+
+    case RX_WINDOW_OPEN:
+        if (sensorResponseWindowPending) {
+            sensorOpenResponseWindow();
+        }
+        break;
+
+    case RX: {
+
+        // Something heard while sniffing between exchanges
+        if (radioIsSniffing()) {
+            sensorSniffReceived(true);
+            break;
+        }
+
+        // If we've successfully received something while we're in an LBT 'listening'
         // phase, it means that we need to try again until there is nobody speaking.
         if (ListenPhaseBeforeTalk) {
             if (lbtListenBeforeTalk()) {
                 break;
             }
             APP_PRINTF("%s *** busy and transmit retries expired ***\r\n", tracePeer());
-            schedRequestResponseTimeout();
+            schedRequestResponseTimeout(sensorRequestAppID);
             sensorCoreIdle();
             break;
         }
@@ -917,6 +3307,7 @@ void appSensorProcess()
         // Decrypt and validate the received message, ignoring it if invalid
         if (!validateReceivedMessage()) {
             if (sendTimeout()) {
+                sensorRttResent = true;
                 sendMessageToPeer(false, gatewayAddress);
             } else {
                 restartReceive(wireReceiveTimeoutMs);
@@ -925,10 +3316,20 @@ void appSensorProcess()
         }
         traceSetID("fm", wireReceivedCarrier.Sender, wireReceived.RequestID);
 
+        // A broadcast from the gateway doesn't interrupt what we're waiting for
+        if ((wireReceived.Flags & MESSAGE_FLAG_BROADCAST) != 0) {
+            sensorBroadcastReceived();
+            restartReceive(wireReceiveTimeoutMs);
+            break;
+        }
+
         // If this is a beacon ACK, set the gateway address and turn off beacon mode
         if (ledIsPairInProgress()) {
             if ((wireReceived.Flags & (MESSAGE_FLAG_BEACON|MESSAGE_FLAG_ACK)) == (MESSAGE_FLAG_BEACON|MESSAGE_FLAG_ACK)) {
                 memcpy(gatewayAddress, wireReceivedCarrier.Sender, sizeof(gatewayAddress));
+                wirePeerID = 0;
+                sensorAckConfigVersion = 0;
+                sensorGatewayExtended = sensorAckExtended();
                 flashConfigUpdatePeer(PEER_TYPE_SENSOR|PEER_TYPE_SELF, ourAddress, beaconKey);
 #ifdef SHOW_KEYS
                 APP_PRINTF("STORE OURS: ");
@@ -941,7 +3342,10 @@ void appSensorProcess()
                 }
                 APP_PRINTF("\r\n");
 #endif
+                // The cleartext beacon ACK carries no broadcast key, which we ask for in our
+                // first request
                 flashConfigUpdatePeer(PEER_TYPE_GATEWAY, gatewayAddress, invalidKey);
+                sensorHasBroadcastKey = false;
                 memcpy(beaconKey, invalidKey, sizeof(beaconKey));
                 APP_PRINTF("%s received beacon pairing ACK: paired\r\n", tracePeer());
                 ledIndicatePairInProgress(false);
@@ -951,6 +3355,7 @@ void appSensorProcess()
 #ifdef KEEP_ALIVE_WHEN_PAIRED
                 sensorCoreIdle();
 #else
+                ledIndicateWait();
                 NVIC_SystemReset();
 #endif
                 break;
@@ -961,6 +3366,7 @@ void appSensorProcess()
         if (memcmp(gatewayAddress, wireReceivedCarrier.Sender, sizeof(gatewayAddress)) != 0) {
             APP_PRINTF("%s message received by sensor from wrong gateway\r\n", tracePeer());
             if (sendTimeout()) {
+                sensorRttResent = true;
                 sendMessageToPeer(false, gatewayAddress);
             } else {
                 restartReceive(wireReceiveTimeoutMs);
@@ -970,63 +3376,101 @@ void appSensorProcess()
 
         // We're sending a request to the gateway and we get an ack on a chunk
         if ((wireReceived.Flags & MESSAGE_FLAG_ACK) != 0) {
-            APP_PRINTF("%s ack received\r\n", tracePeer());
+            TRACE_EVENT(TRACE_RADIO, VLEVEL_L, "ack received", {"len", wireReceived.Len});
+            if (wireReceived.RequestID == messageToSendRequestID) {
+                sensorRttSample();
+            }
 
             // Extract and set the sensor time
-            if (wireReceived.Len >= sizeof(gatewayAckBody)-SENSOR_NAME_MAX) {
-                gatewayAckBody *body = (gatewayAckBody *)wireReceived.Body;
-
-                // Extract sensor name
-                uint32_t sensorNameLen = wireReceived.Len - (sizeof(gatewayAckBody)-SENSOR_NAME_MAX);
-                if (sensorNameLen == 0) {
-                    sensorName[0] = '\0';
-                } else {
-                    memcpy(sensorName, body->Name, sizeof(sensorName));
-                    sensorName[sensorNameLen-1] = '\0';
-                    for (size_t i=0; i<sensorNameLen-1; i++) {
-                        if (sensorName[i] < ' ') {
-                            sensorName[i] = '?';
-                        }
+            bool sackReceived = false;
+            bool busy = false;
+            uint16_t busyRetryAfterSecs = 0;
+            uint8_t *carried = NULL;
+            uint32_t carriedLen = 0;
+            sensorResponseDelayMs = 0;
+            if (wireReceivedCompact) {
+
+                // A compact ACK tells us only which chunks of the window the gateway has received
+                wireCompactAckBody *body = (wireCompactAckBody *)wireReceived.Body;
+                sackReceived = sensorAckReceivedChunks(body->AckedLen, body->SackBitmap);
+
+            } else if (!sensorAckExtended()) {
+
+                // A gateway on older firmware acknowledges just the chunk, and sends only its
+                // schedule, time and our name, so we stay at the defaults for everything else
+                sensorGatewayExtended = false;
+                if (wireReceived.Len >= offsetof(gatewayAckLegacyBody, Name)) {
+                    gatewayAckLegacyBody *body = (gatewayAckLegacyBody *)wireReceived.Body;
+                    sensorAckName(body->Name, wireReceived.Len - offsetof(gatewayAckLegacyBody, Name));
+                    sensorGatewayTime(body->Time, 0, body->ZoneOffsetMins, body->ZoneName);
+                    sensorGatewayBootTime(body->BootTime);
+                    sensorGatewaySchedule(body->TWModulusSecs, body->TWModulusOffsetSecs, body->TWSlotBeginsSecs,
+                                          body->TWSlotEndsSecs, body->TWListenBeforeTalkMs, 0);
+                    if (wireReceived.RSSI != 0 || wireReceived.SNR != 0) {
+                        atpGatewayMessageReceived(wireReceived.RSSI, wireReceived.SNR, wireReceiveRSSI, wireReceiveSNR);
                     }
                 }
 
-                // If the gateway's boot time has changed, then restart just as a
-                // way of resetting the world remotely.
-                if (body->BootTime != 0) {
-                    if (gatewayBootTime != 0 && body->BootTime != gatewayBootTime) {
-                        NVIC_SystemReset();
-                    }
-                    gatewayBootTime = body->BootTime;
+            } else if (wireReceived.Len >= (sensorAckIsDelta() ? sizeof(gatewayAckDeltaBody) : sizeof(gatewayAckBody)-SENSOR_NAME_MAX)) {
+                bool configKnown;
+                gatewayAckBody *body = sensorAckExpand(&configKnown);
+                sensorGatewayExtended = true;
+
+                // Note our ID for short-header frames and our relay, and when the gateway expects to respond
+                if (configKnown) {
+                    wirePeerID = body->PeerID;
+                    relaySetVia(body->RelayAddress);
+                }
+                sensorResponseDelayMs = body->ResponseDelayMs;
+                sensorResponseAckMs = TIMER_IF_GetTimeMs();
+
+                // Hold back our next request for as long as the gateway asks
+                sensorHoldOffUntilMs = 0;
+                if (body->RetryAfterSecs != 0) {
+                    sensorHoldOffUntilMs = sensorResponseAckMs + ((int64_t) body->RetryAfterSecs * 1000);
+                    APP_PRINTF("%s gateway asks that we hold off for %ds\r\n", tracePeer(), body->RetryAfterSecs);
                 }
 
-                // Extract the gateway's date/time and set it locally
-                char zone[4];
-                zone[0] = body->ZoneName[0];
-                zone[1] = body->ZoneName[1];
-                zone[2] = body->ZoneName[2];
-                zone[3] = '\0';
-                NoteTimeSet(body->Time, body->ZoneOffsetMins, zone, NULL, NULL);
-
-                // Trace
-                if (TWModulusSecs != body->TWModulusSecs) {
-                    APP_PRINTF("%s TWModulusSecs: from %d to %d\r\n", tracePeer(), TWModulusSecs, body->TWModulusSecs);
+                // Note which chunks of the window the gateway has actually received, unless it
+                // had no room for the request at all
+                if (body->AckedLen == GATEWAY_ACK_BUSY && wireReceived.RequestID == messageToSendRequestID) {
+                    busy = true;
+                    busyRetryAfterSecs = body->RetryAfterSecs;
+                } else if (sensorAckReceivedChunks(body->AckedLen, body->SackBitmap)) {
+                    sackReceived = true;
+                    carriedLen = sensorAckResponse(&carried);
                 }
-                if (TWModulusOffsetSecs != body->TWModulusOffsetSecs) {
-                    APP_PRINTF("%s TWModulusOffsetSecs: from %d to %d\r\n", tracePeer(), TWModulusOffsetSecs, body->TWModulusOffsetSecs);
+
+                // Extract sensor name, which may be followed by the gateway's broadcast key.  A
+                // delta ACK carries no name, so we keep the one we have.
+                if (!sensorAckIsDelta()) {
+                    sensorAckName(body->Name, wireReceived.Len - (sizeof(gatewayAckBody)-SENSOR_NAME_MAX));
                 }
-                if (TWSlotBeginsSecs != body->TWSlotBeginsSecs) {
-                    APP_PRINTF("%s TWSlotBeginsSecs: from %d to %d\r\n", tracePeer(), TWSlotBeginsSecs, body->TWSlotBeginsSecs);
+                uint8_t *broadcastKey;
+                if (sensorAckBroadcastKey(&broadcastKey)) {
+                    sensorBroadcastKeyLearned(broadcastKey);
                 }
-                if (TWSlotEndsSecs != body->TWSlotEndsSecs) {
-                    APP_PRINTF("%s TWSlotEndsSecs: from %d to %d\r\n", tracePeer(), TWSlotEndsSecs, body->TWSlotEndsSecs);
+
+                // Adopt the gateway's boot time, date/time, and time window parameters, unless
+                // this is a delta against fields that we no longer hold
+                sensorGatewayTime(body->Time, body->TimeMs, body->ZoneOffsetMins, body->ZoneName);
+                if (configKnown) {
+                    sensorGatewayBootTime(body->BootTime);
+                    sensorGatewaySchedule(body->TWModulusSecs, body->TWModulusOffsetSecs, body->TWSlotBeginsSecs,
+                                          body->TWSlotEndsSecs, body->TWListenBeforeTalkMs, body->Channel);
+                    TWUrgentPeriodSecs = body->TWUrgentPeriodSecs;
+                    TWUrgentSecs = body->TWUrgentSecs;
                 }
 
-                // Set the time window parameters
-                TWModulusSecs = body->TWModulusSecs;
-                TWModulusOffsetSecs = body->TWModulusOffsetSecs;
-                TWSlotBeginsSecs = body->TWSlotBeginsSecs;
-                TWSlotEndsSecs = body->TWSlotEndsSecs;
-                TWListenBeforeTalkMs = body->TWListenBeforeTalkMs;
+                // Use whatever spreading factor the gateway chose for the remainder of the exchange
+                appSwitchSpreadingFactor(body->SpreadingFactor, body->CodingRate);
+
+                // See if the gateway is offering a firmware update, or has settings for us that
+                // we don't hold
+                if (configKnown) {
+                    dfuLoraSensorAck(body->ImageCRC, body->ImageLen);
+                    settingsSensorAck(body->SettingsVersion);
+                }
 
                 // Adapt the transmit power parameters based what gateway sees
                 if (wireReceived.RSSI != 0 || wireReceived.SNR != 0) {
@@ -1036,21 +3480,38 @@ void appSensorProcess()
 
             }
 
-            // Send the next chunk of the request
-            messageToSendAcknowledgedLen += sentMessage.Len;
+            // Begin the request again later if the gateway couldn't take it
+            if (busy) {
+                sensorGatewayBusy(busyRetryAfterSecs);
+                break;
+            }
+
+            // Send the next window of the request, which begins with the first chunk
+            // that the gateway hasn't yet received.
+            if (!sackReceived) {
+                messageToSendAcknowledgedLen += sentMessage.Len;
+            }
             if (messageToSendAcknowledgedLen < messageToSendDataLen) {
                 sendMessageToPeer(false, gatewayAddress);
                 break;
             }
 
-            // If a response is coming, wait for that response from the gateway
-            schedRequestCompleted();
+            // If a response is coming, wait for that response from the gateway, unless it came
+            // in this ACK, in which case our next request is what acknowledges it
+            schedRequestCompleted(sensorRequestAppID);
+            sensorRequestQueuedAppCount = 0;
             response.sendingRequest = false;
             response.receivingResponse = false;
-            if (response.responseRequired) {
+            if (response.responseRequired && carriedLen != 0) {
+                APP_PRINTF("%s received final ACK carrying response (%d)\r\n", tracePeer(), carriedLen);
+                sensorResponseCarried(carried, carriedLen);
+                sensorExchangeCompleted();
+                sensorCoreIdle();
+            } else if (response.responseRequired) {
                 sensorWaitForGatewayResponse();
             } else {
                 APP_PRINTF("%s received final ACK: request completed\r\n", tracePeer());
+                sensorExchangeCompleted();
                 sensorCoreIdle();
             }
             break;
@@ -1063,13 +3524,20 @@ void appSensorProcess()
         if (wireReceived.Offset == 0 || wireReceived.RequestID != response.requestID) {
             if (response.data != NULL) {
                 memset(response.data, '?', response.dataTotalLen);
-                free(response.data);
+                poolFree(response.data);
                 response.data = NULL;
             }
             APP_PRINTF("%s now receiving response from gateway\r\n", tracePeer());
+            sensorResponseArrived();
             response.receivingResponse = true;
             response.sendingRequest = false;
-            response.data = (uint8_t *) malloc(wireReceived.TotalLen+1);
+            response.data = NULL;
+            if (wireReceived.TotalLen <= SENSOR_RESPONSE_MAX_BYTES) {
+                response.data = (uint8_t *) poolAlloc(wireReceived.TotalLen+1);
+            }
+            if (response.data == NULL) {
+                APP_PRINTF("%s *** response of %d bytes can't be held ***\r\n", tracePeer(), wireReceived.TotalLen);
+            }
             response.dataTotalLen = wireReceived.TotalLen;
             response.dataAcknowledgedLen = 0;
             response.requestID = wireReceived.RequestID;
@@ -1086,13 +3554,13 @@ void appSensorProcess()
             if (wireReceived.Offset != response.dataAcknowledgedLen) {
                 APP_PRINTF("%s *** message has wrong offset *** (%d/%d)\r\n",
                            tracePeer(), wireReceived.Offset, response.dataAcknowledgedLen);
-                schedRequestResponseTimeout();
+                schedRequestResponseTimeout(sensorRequestAppID);
                 sensorCoreIdle();
                 break;
             }
             if (wireReceived.Offset+wireReceived.Len > response.dataTotalLen) {
                 APP_PRINTF("%s *** message has wrong length ***\r\n", tracePeer());
-                schedRequestResponseTimeout();
+                schedRequestResponseTimeout(sensorRequestAppID);
                 sensorCoreIdle();
                 break;
             }
@@ -1118,30 +3586,25 @@ void appSensorProcess()
 
     case TX: {
 
-        // Process the gateway response when it's completely received
+        // A frame that we've relayed for a far sensor, after which we listen again
+        if (relayTransmitDone()) {
+            sensorSniff();
+            appSetCoreState(LOWPOWER);
+            break;
+        }
+
+        // If we're in the middle of a window, send its next chunk without waiting for an ACK
         traceSetID("to", sentMessageCarrier.Receiver, sentMessage.RequestID);
+        if (sendWindowContinue(gatewayAddress)) {
+            break;
+        }
+
+        // Process the gateway response when it's completely received
         if (response.receivingResponse && response.dataAcknowledgedLen == response.dataTotalLen) {
             response.sendingRequest = false;
             response.receivingResponse = false;
-
-            // Convert it to a null-terminated string and parse it.  Note that we had explicitly
-            // allocated this buffer 1 byte larger than we had needed explicitly for this purpose.
-            response.data[response.dataTotalLen] = '\0';
-            J *rsp = JConvertFromJSONString((const char *)response.data);
-            if (rsp == NULL) {
-                APP_PRINTF("%s *** sensor response isn't valid JSON *** (%d)\r\n", tracePeer(), response.dataTotalLen);
-            } else {
-                schedResponseCompleted(rsp);
-                JDelete(rsp);
-                if (twSlotExpiresTimeWasValid && NoteTimeValidST()) {
-                    uint32_t now = NoteTimeST();
-                    if (now > twSlotExpiresTime) {
-                        APP_PRINTF("%s *** sensor used too much time (%d)\r\n", tracePeer(), now-twSlotExpiresTime);
-                    } else {
-                        APP_PRINTF("%s sensor completed with time to spare (%d)\r\n", tracePeer(), twSlotExpiresTime-now);
-                    }
-                }
-            }
+            sensorProcessResponse();
+            sensorExchangeCompleted();
 
             // Go idle
             sensorCoreIdle();
@@ -1161,18 +3624,49 @@ void appSensorProcess()
 
     case RX_TIMEOUT:
 
+        // Nothing heard while listening between exchanges
+        if (radioIsSniffing()) {
+            sensorSniffReceived(false);
+            break;
+        }
+
         // If in LBT mode, this means the channel is clear and we can now transmit freely
         if (ListenPhaseBeforeTalk) {
             lbtTalk();
             break;
         }
 
-        // We expected either an ACK or response data and failed to receive it
+        // If we missed the response in the short window, widen the guard and fall back to
+        // listening for the gateway's retry throughout the full window.
+        if (sensorResponseWindowShort && !response.receivingResponse) {
+            APP_PRINTF("%s *** missed response window ***\r\n", tracePeer());
+            sensorResponseWindowMissed = true;
+            sensorResponseJitterMs = ((sensorResponseJitterMs*3) + sensorResponseGuardMs()*2) / 4;
+            sensorResponseDelayMs = 0;
+            sensorWaitForGatewayResponse();
+            break;
+        }
+
+        // We expected either an ACK or response data and failed to receive it, and if it was an
+        // ACK, wait longer for the next
+        if (sensorAckAwaited) {
+            sensorAckAwaited = false;
+            sensorRttSampling = false;
+            if (sensorRtoBackoff < SENSOR_RTT_BACKOFF_MAX) {
+                sensorRtoBackoff++;
+            }
+        }
         sensorGatewayRequestFailure(false, "*** no gateway response ***");
         break;
 
     case RX_ERROR:
 
+        // Something garbled heard while sniffing
+        if (radioIsSniffing()) {
+            sensorSniffReceived(false);
+            break;
+        }
+
         // If in LBT mode, this means the channel is busy and we couldn't successfully receive,
         // so we should either retry the listen or give up.
         if (ListenPhaseBeforeTalk) {
@@ -1188,6 +3682,12 @@ void appSensorProcess()
         break;
 
     case TX_TIMEOUT:
+        if (relayTransmitDone()) {
+            APP_PRINTF("relay: *** can't transmit relayed frame ***\r\n");
+            sensorSniff();
+            appSetCoreState(LOWPOWER);
+            break;
+        }
         sensorGatewayRequestFailure(true, "*** can't transmit to gateway ***");
         break;
 
@@ -1196,10 +3696,208 @@ void appSensorProcess()
         break;
     }
 
-#ifdef TRACE_STATE
-    APP_PRINTF("EXIT %d\r\n", CurrentStateCore);
-#endif
+    TRACE_PRINTF(TRACE_APP, VLEVEL_H, "EXIT %d\r\n", CurrentStateCore);
+
+}
+
+// Deliver a completely received response to the app that made the request
+void sensorProcessResponse()
+{
+
+    // Expand it if the gateway squeezed it, which yields a buffer with room for a terminator
+    uint8_t *expanded;
+    uint32_t expandedLen;
+    if (response.data != NULL && response.dataTotalLen > 0 && response.data[0] == SQUEEZE_RESPONSE) {
+        if (squeezeExpand(response.data, response.dataTotalLen, &expanded, &expandedLen)) {
+            memset(response.data, '?', response.dataTotalLen);
+            poolFree(response.data);
+            response.data = expanded;
+            response.dataTotalLen = expandedLen;
+        } else {
+            APP_PRINTF("%s *** can't expand squeezed response ***\r\n", tracePeer());
+        }
+    }
 
+    // A response that we couldn't hold still completes the request, with an error
+    if (response.data == NULL) {
+        char rspErr[] = "{\"err\":\"response is too large for the sensor\"}";
+        schedResponseCompletedJSON(sensorRequestApp(response.requestID), rspErr, strlen(rspErr));
+        return;
+    }
+
+    // Convert it to a null-terminated string and hand it to the app.  Note that we had explicitly
+    // allocated this buffer 1 byte larger than we had needed explicitly for this purpose.
+    response.data[response.dataTotalLen] = '\0';
+    if (!schedResponseCompletedJSON(sensorRequestApp(response.requestID), (char *) response.data, response.dataTotalLen)) {
+        APP_PRINTF("%s *** sensor response isn't valid JSON *** (%d)\r\n", tracePeer(), response.dataTotalLen);
+    } else if (twSlotExpiresTimeWasValid && appTimeValid()) {
+        uint32_t now = appTime();
+        if (now > twSlotExpiresTime) {
+            APP_PRINTF("%s *** sensor used too much time (%d)\r\n", tracePeer(), now-twSlotExpiresTime);
+        } else {
+            APP_PRINTF("%s sensor completed with time to spare (%d)\r\n", tracePeer(), twSlotExpiresTime-now);
+        }
+    }
+
+}
+
+// Note that an exchange within our slot has completed, measuring how long it took from the
+// slot's opening.  The measure rises at once to a longer exchange but decays slowly, so that
+// chaining stays conservative.
+void sensorExchangeCompleted()
+{
+    uint32_t tookMs = (uint32_t) (TIMER_IF_GetTimeMs() - sensorExchangeBeganMs);
+    if (tookMs > sensorExchangeMs) {
+        sensorExchangeMs = tookMs;
+    } else {
+        sensorExchangeMs = ((sensorExchangeMs*3) + tookMs) / 4;
+    }
+    sensorExchangeChainable = SENSOR_SLOT_CHAINING && !sensorRequestUrgent;
+
+    // The gateway is evidently reachable, and the notes delivered from the store are released
+    sensorGatewayReachable = true;
+    if (sensorRequestStored != 0) {
+        flashStoreRelease(sensorRequestStored);
+        APP_PRINTF("%s delivered %d stored notes (%d remain)\r\n", tracePeer(), sensorRequestStored, flashStorePending());
+        sensorRequestStored = 0;
+    }
+}
+
+// See if notes stored while the gateway was unreachable should now be drained, which is so
+// once an exchange has shown that it can be reached again
+bool sensorStoreDrainDue()
+{
+    return SENSOR_STORE_AND_FORWARD && sensorGatewayReachable && flashStorePending() != 0;
+}
+
+// Send as many of the oldest stored notes as fit in a batch, leaving them in the store until
+// the gateway has acknowledged it, returning false if it couldn't be sent
+bool sensorStoreDrain()
+{
+    uint8_t *data;
+    uint32_t len;
+    uint32_t count = 0;
+    uint32_t batchLen = 1;
+    while (flashStoreRecord(count, &data, &len)) {
+        uint32_t entryLen = sizeof(uint16_t) + len;
+        if (count > 0 && batchLen + entryLen > SENSOR_QUEUE_MAX_BATCH_BYTES) {
+            break;
+        }
+        batchLen += entryLen;
+        count++;
+    }
+    if (count == 0) {
+        return false;
+    }
+
+    // A single note is sent as-is, and either way it's sent from RAM because the store may
+    // be written while the request is in flight
+    if (count == 1) {
+        flashStoreRecord(0, &data, &len);
+        batchLen = len;
+    }
+    uint8_t *batch = (uint8_t *) poolAlloc(batchLen);
+    if (batch == NULL) {
+        APP_PRINTF("%s *** can't allocate stored note batch ***\r\n", tracePeer());
+        return false;
+    }
+    uint32_t batchOffset = 0;
+    if (count == 1) {
+        memcpy(batch, data, len);
+        batchOffset = len;
+    } else {
+        batch[batchOffset++] = COMPACT_BATCH;
+        for (uint32_t i=0; i<count; i++) {
+            flashStoreRecord(i, &data, &len);
+            batch[batchOffset++] = (uint8_t) (len >> 0);
+            batch[batchOffset++] = (uint8_t) (len >> 8);
+            memcpy(&batch[batchOffset], data, len);
+            batchOffset += len;
+        }
+    }
+
+    // Send it
+    APP_PRINTF("%s sending %d of %d stored notes\r\n", tracePeer(), count, flashStorePending());
+    sensorRequestAppID = -1;
+    sensorRequestUrgent = false;
+    sensorRequestStorable = false;
+    sensorRequestStored = count;
+    sensorRequestCreatedMs = 0;
+    sensorTransmitToGateway(false, batch, batchOffset, true);
+    return true;
+}
+
+// Keep the request that the gateway couldn't be reached to deliver in the outbound store,
+// splitting a batch into the notes it coalesced so that they may be batched anew as they fit
+void sensorStoreRequest()
+{
+    uint8_t *data = messageToSendData;
+    uint32_t len = messageToSendDataLen;
+    if (data != NULL && len >= COMPACT_AGED_PREFIX && data[0] == COMPACT_AGED) {
+        data += COMPACT_AGED_PREFIX;
+        len -= COMPACT_AGED_PREFIX;
+    }
+    uint32_t scheduleLen = compactDecodeSchedule(data, len, NULL, NULL);
+    if (scheduleLen != 0) {
+        data += scheduleLen;
+        len -= scheduleLen;
+    }
+    if (data == NULL || len == 0) {
+        return;
+    }
+    uint32_t stored = 0;
+    uint32_t lost = 0;
+    if (data[0] == COMPACT_BATCH) {
+        uint32_t offset = 1;
+        uint16_t entry = 0;
+        while (offset + sizeof(uint16_t) <= len) {
+            uint32_t entryLen = data[offset] | (data[offset+1] << 8);
+            offset += sizeof(uint16_t);
+            if (offset + entryLen > len) {
+                break;
+            }
+            if (flashStoreAppend(&data[offset], entryLen)) {
+                stored++;
+            } else {
+                lost++;
+                sensorQueuedRequestLost(entry);
+            }
+            offset += entryLen;
+            entry++;
+        }
+    } else if (flashStoreAppend(data, len)) {
+        stored++;
+    } else {
+        lost++;
+        sensorQueuedRequestLost(0);
+    }
+    if (lost != 0) {
+        APP_PRINTF("%s *** outbound store can't hold %d notes ***\r\n", tracePeer(), lost);
+    }
+    APP_PRINTF("%s stored %d notes until the gateway can be reached (%d pending)\r\n", tracePeer(), stored, flashStorePending());
+}
+
+// Tell the app that queued an entry of the request in flight that the entry is lost
+void sensorQueuedRequestLost(uint16_t entry)
+{
+    if (entry < sensorRequestQueuedAppCount) {
+        schedRequestLost(sensorRequestQueuedApps[entry]);
+    }
+}
+
+// See if a request may be sent now within the slot of the exchange that just completed,
+// which is so if another exchange would end before the slot does
+bool sensorSlotChainable()
+{
+    if (!sensorExchangeChainable || !appTimeValid()) {
+        return false;
+    }
+    uint32_t now = appTime();
+    if (now < twSlotBeginsTime || now + ((sensorExchangeMs + 999) / 1000) >= twSlotExpiresTime) {
+        sensorExchangeChainable = false;
+        return false;
+    }
+    return true;
 }
 
 // Handle the case of known failure of transmit or receive to a gateway having failed
@@ -1220,10 +3918,60 @@ void sensorGatewayRequestFailure(bool wasTX, const char *why)
     // failures at the "boundary" that might happen as often as every other message.
     atpGatewayMessageLost();
 
-    // If we can retry, do so during the next transmit window
+    // Fall back to full headers until the gateway confirms our ID, in case it no longer knows it
+    wirePeerID = 0;
+
+    // Try the other way of reaching the gateway, if we have a relay, in case this way failed
+    relayLinkFailed();
+
+    // A retry waits for a window of its own
+    sensorExchangeChainable = false;
+
+    // Any retry begins a new exchange, which the gateway expects at the default spreading factor
+    radioSetSpreadingFactor(0);
+    radioSetCodingRate(0);
+
+    // If we can retry, do so during the next transmit window, except that once the gateway has
+    // been found unreachable, a request that may be stored joins those stored before it
+    bool store = SENSOR_STORE_AND_FORWARD && sensorRequestStorable;
+    bool joinStored = store && !sensorGatewayReachable && flashStorePending() != 0;
+    if (!joinStored && sensorResendToGateway()) {
+        return;
+    }
+    sensorGatewayReachable = false;
+    sensorGatewayGiveUp(store);
+
+}
+
+// The gateway had no room for our request, so begin it again in the first slot after it
+// asked us to hold off.  It was heard, so this isn't counted as a loss.
+void sensorGatewayBusy(uint16_t retryAfterSecs)
+{
+    APP_PRINTF("%s gateway is busy, so retrying after %ds\r\n", tracePeer(), retryAfterSecs);
+    sensorExchangeChainable = false;
+    twNotBeforeTime = appTime() + retryAfterSecs;
     if (sensorResendToGateway()) {
         return;
     }
+    twNotBeforeTime = 0;
+    sensorGatewayGiveUp(SENSOR_STORE_AND_FORWARD && sensorRequestStorable);
+}
+
+// Give up on the request being sent to the gateway, storing it if asked
+void sensorGatewayGiveUp(bool store)
+{
+
+    // Keep what couldn't be delivered, while stored notes that failed to drain remain stored,
+    // and tell the apps that queued what is lost
+    if (store) {
+        sensorStoreRequest();
+    } else {
+        for (uint16_t entry=0; entry<sensorRequestQueuedAppCount; entry++) {
+            sensorQueuedRequestLost(entry);
+        }
+    }
+    sensorRequestQueuedAppCount = 0;
+    sensorRequestStored = 0;
 
     // Free the message buffer
     freeMessageToSendBuffer();
@@ -1231,7 +3979,7 @@ void sensorGatewayRequestFailure(bool wasTX, const char *why)
     // Abort with a lost message indication
     memset(&wireReceivedCarrier, 0, sizeof(wireReceivedCarrier));
     memset(&wireReceived, 0, sizeof(wireReceived));
-    schedRequestResponseTimeout();
+    schedRequestResponseTimeout(sensorRequestAppID);
     sensorCoreIdle();
 
 }
@@ -1239,36 +3987,44 @@ void sensorGatewayRequestFailure(bool wasTX, const char *why)
 // Initialize gateway state machine
 void appGatewayInit()
 {
-    gatewayHousekeeping(false, cachedSensors);
+    UTIL_TIMER_Create(&notecardWaitTimer, 0xFFFFFFFFU, UTIL_TIMER_ONESHOT, gatewayNotecardWaitEvent, NULL);
+    gatewayBroadcastKeyInit();
+    appGatewaySnapshotRestore();
     gatewayWaitForAnySensorMessage();
+    gatewayHousekeeping(false, cachedSensors);
+
+    // Resume performing whatever was stored for the Notecard before we were reset
+    if (!gatewayNotecardIdle()) {
+        UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Notecard_Process), CFG_SEQ_Prio_Notecard);
+    }
+}
+
+// Event task for Gateway, which yields to received frames and then lets the state machine
+// settle whatever the event changed
+void appGatewayEvents()
+{
+    traceSetID("", ourAddress, 0);
+    if (ButtonEventOccurred) {
+        ButtonEventOccurred = false;
+        appProcessButton();
+    }
+    UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Sparrow_Process), CFG_SEQ_Prio_Radio);
 }
 
 // Application state machine for Gateway
 void appGatewayProcess()
 {
 
-#ifdef TRACE_STATE
-    APP_PRINTF("ENTER %d\r\n", CurrentStateCore);
-#endif
+    TRACE_PRINTF(TRACE_APP, VLEVEL_H, "ENTER %d\r\n", CurrentStateCore);
 
     // Set identity of the 'subject' of our work to 'unknown'
     traceSetID("", ourAddress, 0);
 
-    // Process sub-states that may have caused wakeup
-    if (ButtonEventOccurred) {
-        ButtonEventOccurred = false;
-        appProcessButton();
-    }
-    if (TraceEventOccurred) {
-        TraceEventOccurred = false;
-        traceInput();
-        gatewayHousekeeping(forceSensorRefresh, cachedSensors);
-    }
-
     // Dispatch based upon state
     switch (CurrentStateCore) {
 
     case TW_OPEN:
+    case RX_WINDOW_OPEN:
         APP_PRINTF("%s *** INVALID STATE FOR GATEWAY ***\r\n", tracePeer());
         gatewayWaitForAnySensorMessage();
         break;
@@ -1286,48 +4042,73 @@ void appGatewayProcess()
             break;
         }
 
-        // Decrypt and validate the received message, ignoring it if invalid
-        if (!validateReceivedMessage()) {
+        // Decrypt and validate the received message, ignoring it if invalid.  While a
+        // beacon ACK is being held back we're only listening for other gateways.  If we were
+        // listening on the current slot's channel, pick up again from wherever we are now.
+        bool valid = validateReceivedMessage();
+        if (pairDeferring) {
+            gatewayPairDeferContinue(false);
+            break;
+        }
+        if (!valid) {
+            twHeatCount(0);
+            if (gatewayListenHopping) {
+                gatewayWaitForAnySensorMessage();
+                break;
+            }
             restartReceive(wireReceiveTimeoutMs);
             break;
         }
         traceSetID("fm", wireReceivedCarrier.Sender, wireReceived.RequestID);
 
+        // Whatever we switched to has been heard
+        gatewaySwitchUnconfirmed = false;
+
         // If this request is from a different sensor than last time, clear stats
-        if (memcmp(lastReceivedSensorAddress, wireReceivedCarrier.Sender, sizeof(wireReceivedCarrier.Sender)) != 0) {
-            memcpy(lastReceivedSensorAddress, wireReceivedCarrier.Sender, sizeof(lastReceivedSensorAddress));
+        if (wireReceivedPeerHandle < 0 || wireReceivedPeerHandle != lastReceivedPeerHandle) {
+            lastReceivedPeerHandle = wireReceivedPeerHandle;
             radioSetTxPowerUnknown();
         }
 
-        // Find the sensor that is sending to us, and bubble it down to the 0th entry of the cache
-        requestState foundRequest;
-        int found = -1;
-        for (int i=0; i<cachedSensors; i++) {
-            if (memcmp(requestCache[i].sensorAddress, wireReceivedCarrier.Sender, sizeof(wireReceivedCarrier.Sender)) == 0) {
-                foundRequest = requestCache[i];
-                found = i;
-                break;
-            }
-        }
-        if (found == -1) {
-            if (cachedSensors < MAX_CACHED_SENSORS) {
-                cachedSensors++;
-            }
-            memset(&foundRequest, 0, sizeof(requestState));
-            memcpy(foundRequest.sensorAddress, wireReceivedCarrier.Sender, sizeof(wireReceivedCarrier.Sender));
+        // Find the sensor that is sending to us, making it the most recently used in the cache
+        bool created;
+        requestState *request = requestCacheLookupPeer(wireReceivedPeerHandle, wireReceivedCarrier.Sender, &created);
+        if (created) {
             APP_PRINTF("%s *** new sensor being cached ***\r\n", tracePeer());
-            found = cachedSensors-1;
             forceSensorRefresh = true;
         }
-        for (int i=cachedSensors-1; i>0; --i) {
-            if (i <= found) {
-                requestCache[i] = requestCache[i-1];
-            }
-        }
-        requestCache[0] = foundRequest;
-        requestState *request = &requestCache[0];
-        request->lastReceivedTime = NoteTimeST();
+        gatewayCalendarHeard(request);
+        request->lastReceivedTime = appTime();
+        request->dbDirty = true;
+        request->relayed = wireReceivedRelayed;
+        request->extendedAck = (wireReceived.Flags & MESSAGE_FLAG_EXTENDED) != 0;
+        request->airtimeMs += radioTimeOnAirMs(wireReceivedLen) * (request->relayed ? 2 : 1);
         traceSetID("fm", request->sensorAddress, request->currentRequestID);
+
+        // A frame heard intact on the sensor's link
+        atpLinkSample(&request->uplinkLink, false);
+
+        // Send full ACKs until the sensor says that it holds one against which to take deltas
+        if ((wireReceivedFields & MESSAGE_FIELD_DELTA) == 0) {
+            request->ackedConfigVersion = 0;
+        }
+
+        // Telemetry omitted from a short-header frame is unchanged from what we last knew
+        if ((wireReceivedFields & MESSAGE_FIELD_MILLIVOLTS) == 0) {
+            wireReceived.Millivolts = request->sensorMv;
+        }
+        if ((wireReceivedFields & MESSAGE_FIELD_RSSI) == 0) {
+            wireReceived.RSSI = request->sensorRSSI;
+        }
+        if ((wireReceivedFields & MESSAGE_FIELD_SNR) == 0) {
+            wireReceived.SNR = request->sensorSNR;
+        }
+        if ((wireReceivedFields & MESSAGE_FIELD_TXP) == 0) {
+            wireReceived.TXP = request->sensorTXP;
+        }
+        if ((wireReceivedFields & MESSAGE_FIELD_LTP) == 0) {
+            wireReceived.LTP = request->sensorLTP;
+        }
         APP_PRINTF("%s rcv txp:%d rssi:%d snr:%d\r\n", tracePeer(), wireReceived.TXP, wireReceived.RSSI, wireReceived.SNR);
 
         // Remember the radio stats
@@ -1341,8 +4122,17 @@ void appGatewayProcess()
         request->sensorLTP = wireReceived.LTP;
         request->sensorMv = wireReceived.Millivolts;
 
-        // Notify atp subsystem of the power of the last message received
-        atpMatchPowerLevel(wireReceived.TXP);
+        // Transmit to this sensor at the lowest power that it will reliably hear, unless what we
+        // send goes through its relay, whose view of the sensor says nothing about our path
+        if (request->relayed) {
+            atpMaximizePowerLevel();
+        } else {
+            if (wireReceiveSignalValid && (wireReceiveRSSI != 0 || wireReceiveSNR != 0)) {
+                atpModelSample(&request->downlinkLoss, wireReceived.TXP - wireReceiveRSSI);
+            }
+            atpNoiseSample(&request->downlinkNoise, wireReceived.RSSI, wireReceived.SNR);
+            atpSetDownlinkPowerLevel(&request->downlinkLoss, &request->downlinkNoise);
+        }
 
         // Display time of receipt
         showReceivedTime((wireReceived.Flags & MESSAGE_FLAG_ACK) != 0 ? "rcv ack" : "rcv msg",
@@ -1350,6 +4140,7 @@ void appGatewayProcess()
 
         // We're sending a response back to the sensor and we get an ack on a chunk
         if ((wireReceived.Flags & MESSAGE_FLAG_ACK) != 0) {
+            gatewayLogPacket(PKTLOG_ACK, 0);
 
             // Send the next chunk of the response
             if (request->dataAcknowledgedLen < request->dataTotalLen) {
@@ -1363,12 +4154,10 @@ void appGatewayProcess()
                 break;
             }
 
-            // Done sending the final response chunk
-            if (request->data != NULL) {
-                memset(request->data, '?', request->dataTotalLen);
-                free(request->data);
-                request->data = NULL;
-            }
+            // Done sending the final response chunk, which is kept in case the sensor
+            // missed our final ACK of it and retries the request
+            freeMessageToSendBuffer();
+            responseCacheStore(request);
 
             // Wait for next incoming message from anyone
             request->receivingRequest = false;
@@ -1378,50 +4167,142 @@ void appGatewayProcess()
 
         }
 
-        // If this is the first chunk of the message, allocate the receive buffer
-        if (wireReceived.Offset == 0 || wireReceived.RequestID != request->currentRequestID) {
+        // If this is the first chunk of the message, allocate the receive buffer.  If the sensor
+        // is resending the request that we're already receiving, though, because our ACK was lost
+        // or chunks had arrived ahead of a lost first chunk, keep what we already have of it.
+        bool resend = (wireReceived.RequestID == request->currentRequestID && request->receivingRequest
+                       && request->data != NULL && wireReceived.TotalLen == request->dataTotalLen);
+        if ((wireReceived.Offset == 0 && !resend) || wireReceived.RequestID != request->currentRequestID) {
+            if (wireReceived.RequestID != request->currentRequestID) {
+                responseCacheRelease(request, wireReceived.RequestID);
+            }
+            request->responseInAck = false;
+            request->responsePending = false;
+            if (request->sendingResponse) {
+                freeMessageToSendBuffer();
+                responseCacheStore(request);
+            }
             if (request->data != NULL) {
                 memset(request->data, '?', request->dataTotalLen);
-                free(request->data);
+                poolFree(request->data);
                 request->data = NULL;
             }
             request->receivingRequest = true;
             request->sendingResponse = false;
             request->responseRequired = (wireReceived.Flags & MESSAGE_FLAG_RESPONSE) != 0;
-            request->data = (uint8_t *) malloc(wireReceived.TotalLen);
+            // Allocate a byte beyond the request so that it can be parsed in place.  A request
+            // larger than we'll hold is still received and acknowledged chunk by chunk, but
+            // isn't kept, so that one sensor can't take the memory needed for all the others.
+            // One that would take more than the budget of what other requests hold, or for which
+            // there's no memory, is turned away until the sensor retries.  A sensor that takes
+            // only the legacy ACK can't be told that, so its request is held whenever it fits.
+            request->data = NULL;
+            request->busy = false;
+            if (wireReceived.TotalLen <= GATEWAY_REQUEST_MAX_BYTES) {
+                uint32_t held = gatewayRequestBytesHeld();
+                if (held == 0 || held + wireReceived.TotalLen+1 <= GATEWAY_REQUEST_BUDGET_BYTES || !request->extendedAck) {
+                    request->data = (uint8_t *) poolAlloc(wireReceived.TotalLen+1);
+                }
+                if (request->data == NULL && !request->extendedAck) {
+                    APP_PRINTF("%s *** request of %d bytes can't be held ***\r\n", tracePeer(), wireReceived.TotalLen);
+                } else if (request->data == NULL) {
+                    request->busy = true;
+                    APP_PRINTF("%s *** busy: request of %d bytes turned away with %d held ***\r\n", tracePeer(), wireReceived.TotalLen, held);
+                }
+            } else {
+                APP_PRINTF("%s *** request of %d bytes is too large to hold ***\r\n", tracePeer(), wireReceived.TotalLen);
+            }
+            if (request->data != NULL) {
+                request->data[wireReceived.TotalLen] = '\0';
+            }
             request->dataTotalLen = wireReceived.TotalLen;
             request->dataAcknowledgedLen = 0;
+            request->dataReceivedMap = 0;
+            request->dataChunkLen = radioChunkLen(0);
             request->currentRequestID = wireReceived.RequestID;
+            request->requestBeganMs = TIMER_IF_GetTimeMs();
+            gatewayChargeRequest(request);
             traceSetID("fm", request->sensorAddress, request->currentRequestID);
             APP_PRINTF("%s now receiving request from sensor\r\n", tracePeer());
         }
 
+        // Chunks that arrived ahead of a lost one are forgotten if the chunk size has changed
+        // since, as it does when a retry returns to the default spreading factor, because the
+        // sensor will now resend them at the new size
+        uint32_t chunkLen = radioChunkLen(0);
+        if (request->dataChunkLen != chunkLen) {
+            request->dataChunkLen = chunkLen;
+            request->dataReceivedMap = 0;
+        }
+
         // If this is a duplicate, skip it
-        if (wireReceived.Offset+wireReceived.Len == request->dataAcknowledgedLen) {
+        uint32_t windowChunk = 0;
+        if (wireReceived.Offset > request->dataAcknowledgedLen) {
+            windowChunk = (wireReceived.Offset - request->dataAcknowledgedLen) / chunkLen;
+        }
+        if (wireReceived.Offset+wireReceived.Len <= request->dataAcknowledgedLen
+                || (windowChunk > 0 && windowChunk <= (sizeof(request->dataReceivedMap)*8)
+                    && (request->dataReceivedMap & (1UL << (windowChunk-1))) != 0)) {
 
             APP_PRINTF("%s *** re-acking duplicate message ***\r\n", tracePeer());
+            gatewayLogPacket(PKTLOG_DUPLICATE, 0);
+
+            // Our ACK was lost, so leave more margin when sending to this sensor
+            atpModelWiden(&request->downlinkLoss);
+            atpSetDownlinkPowerLevel(&request->downlinkLoss, &request->downlinkNoise);
 
         } else {
 
-            // If we're not synchronized on where within the request the transfer is, error
-            if (wireReceived.Offset != request->dataAcknowledgedLen) {
+            // If we're not synchronized on where within the request the transfer is, tell the sensor
+            // what we actually have so that it resends only that.  Chunks that arrive ahead of a
+            // lost chunk are accepted as long as they fall within the window.
+            bool outOfOrder = (wireReceived.Offset != request->dataAcknowledgedLen);
+            if (outOfOrder && (((wireReceived.Offset - request->dataAcknowledgedLen) % chunkLen) != 0
+                               || windowChunk == 0 || windowChunk > (sizeof(request->dataReceivedMap)*8))) {
                 APP_PRINTF("%s *** message has wrong offset *** (%d/%d)\r\n", tracePeer(),
                            wireReceived.Offset, request->dataAcknowledgedLen);
-                gatewayWaitForAnySensorMessage();
+                gatewayLogPacket(PKTLOG_BAD_OFFSET, 0);
+                statsCount(STATS_BAD_OFFSET);
+                twHeatCount(0);
+                if (request->data != NULL && (wireReceived.Flags & MESSAGE_FLAG_WINDOW) == 0) {
+                    gatewaySendAck(request, false);
+                    break;
+                }
+                request->windowAckPending = true;
+                request->windowAckPendingMs = TIMER_IF_GetTimeMs();
+                gatewayWaitForSensorChunk();
                 break;
             }
             if (wireReceived.Offset+wireReceived.Len > request->dataTotalLen) {
                 request->receivingRequest = true;
                 request->sendingResponse = false;
                 APP_PRINTF("%s *** message has wrong length ***\r\n", tracePeer());
+                gatewayLogPacket(PKTLOG_BAD_LENGTH, 0);
                 gatewayWaitForAnySensorMessage();
                 break;
             }
 
-            // Append the successfully received data to the request buffer
+            // Place the successfully received data into the request buffer, and if the chunk
+            // was in sequence absorb any chunks that had arrived ahead of it.
+            gatewayLogPacket(outOfOrder ? PKTLOG_AHEAD : PKTLOG_CHUNK, 0);
             if (request->data != NULL && wireReceived.Len > 0) {
-                memcpy(&request->data[request->dataAcknowledgedLen], wireReceived.Body, wireReceived.Len);
-                request->dataAcknowledgedLen += wireReceived.Len;
+                memcpy(&request->data[wireReceived.Offset], wireReceived.Body, wireReceived.Len);
+                if (outOfOrder) {
+                    request->dataReceivedMap |= (1UL << (windowChunk-1));
+                    APP_PRINTF("%s received chunk ahead of sequence (%d/%d)\r\n", tracePeer(),
+                               wireReceived.Offset, request->dataAcknowledgedLen);
+                } else {
+                    request->dataAcknowledgedLen += wireReceived.Len;
+                    while (request->dataAcknowledgedLen < request->dataTotalLen) {
+                        bool haveNext = (request->dataReceivedMap & 1) != 0;
+                        request->dataReceivedMap >>= 1;
+                        if (!haveNext) {
+                            break;
+                        }
+                        uint32_t left = request->dataTotalLen - request->dataAcknowledgedLen;
+                        request->dataAcknowledgedLen += (left < chunkLen) ? left : chunkLen;
+                    }
+                }
             }
 
         }
@@ -1436,104 +4317,115 @@ void appGatewayProcess()
                 break;
             }
 
-            // Update the key and algorithm for this peer in flash
-            flashConfigUpdatePeer(PEER_TYPE_SENSOR, request->sensorAddress, wireReceived.Body);
-            APP_PRINTF("%s *** beacon: updated sensor key\r\n", tracePeer());
-#ifdef SHOW_KEYS
-            APP_PRINTF("STORE PEER: ");
-            for (int i=0; i<ADDRESS_LEN; i++) {
-                APP_PRINTF("%02x", request->sensorAddress[i]);
-            }
-            APP_PRINTF(": ");
-            for (int i=0; i<AES_KEY_BYTES; i++) {
-                APP_PRINTF("%02x", wireReceived.Body[i]);
+            // Give less-loaded gateways that heard the same beacon the chance to answer first
+            uint32_t deferMs = gatewayPairDeferMs();
+            if (deferMs != 0) {
+                APP_PRINTF("%s *** beacon: deferring %dms to less-loaded gateways ***\r\n", tracePeer(), deferMs);
+                memcpy(pairDeferAddress, request->sensorAddress, sizeof(pairDeferAddress));
+                memcpy(pairDeferKey, wireReceived.Body, sizeof(pairDeferKey));
+                pairDeferring = true;
+                pairDeferYielded = false;
+                pairDeferUntilMs = TIMER_IF_GetTimeMs() + deferMs;
+                restartReceive(deferMs);
+                break;
             }
-            APP_PRINTF("\r\n");
-#endif
+            gatewayPairSensor(request, wireReceived.Body);
 
-            // Notify the notecard and notehub that we've peered with this sensor
-            J *req = NoteNewCommand("hub.log");
-            if (req != NULL) {
-                JAddStringToObject(req, "method", "sensor-provision");
-                char saddr[40];
-                utilAddressToText(request->sensorAddress, saddr, sizeof(saddr));
-                JAddStringToObject(req, "text", saddr);
-                JAddBoolToObject(req, "sync", true);
-                NoteRequest(req);
-            }
-
-        }
-
-        // Prepare the body
-        static gatewayAckBody body = {0};
-        char *zone;
-        int offset;
-        char name[SENSOR_NAME_MAX];
-        flashConfigFindPeerByAddress(request->sensorAddress, NULL, NULL, name);
-        extractNameComponents(name, body.Name, NULL, 0);
-        body.LastProcessedRequestID = request->lastProcessedRequestIDForAck;
-        twRefresh();
-        body.TWModulusSecs = TWModulusSecs;
-        body.TWModulusOffsetSecs = TWModulusOffsetSecs;
-        body.TWSlotBeginsSecs = request->twSlotBeginsSecs;
-        body.TWSlotEndsSecs = request->twSlotEndsSecs;
-        body.TWListenBeforeTalkMs = TWListenBeforeTalkMs;
-#if REBOOT_SENSORS_WHEN_GATEWAY_REBOOTS
-        body.BootTime = gatewayBootTime;
-#else
-        body.BootTime = 0;
-#endif
-        NoteRegion(NULL, NULL, &zone, &offset);
-        body.ZoneOffsetMins = offset;
-        body.ZoneName[0] = zone[0];
-        body.ZoneName[1] = zone[1];
-        body.ZoneName[2] = zone[2];
-
-        // Set the time to be our current time plus an offset of the transmit window,
-        // so that we are as close as possible to synchronized times.  There is also
-        // unfortunately a "transit time" for is message to be AES-encrypted and
-        // transmitted over the wire (given the slow LoRa wire speed), so an
-        // additional adjustment is made.  (This was measured empically.)
-        body.Time = NoteTimeST();
-        body.Time += 4;                 // Estimated transit time from gateway to sensor
-        if (TW_LBT_PERIOD_MS != 0) {    // Delay in transmitting when window is opened
-            body.Time += (TW_LBT_PERIOD_MS/1000)+1;
-        }
-
-        // Make sure that the send buffer is deallocated
-        freeMessageToSendBuffer();
+        }
 
-        // Set the length to what's necessary to transmit the name, using the
-        // assumption that the name is always at the very end of the structure.
-        messageToSendDataLen = sizeof(body);
-        messageToSendDataLen -= SENSOR_NAME_MAX;
-        messageToSendDataLen += strlen(body.Name)+1;
+        // If the sensor is sending a window of chunks back-to-back, only the final
+        // chunk in the window is ACK'ed, so just wait for the next one.
+        if ((wireReceived.Flags & MESSAGE_FLAG_WINDOW) != 0 && request->dataAcknowledgedLen < request->dataTotalLen) {
+            request->windowAckPending = true;
+            request->windowAckPendingMs = TIMER_IF_GetTimeMs();
+            gatewayWaitForSensorChunk();
+            break;
+        }
 
-        // Ack this received packet with the current gateway time
-        messageToSendRequestID = request->currentRequestID;
-        messageToSendFlags = MESSAGE_FLAG_ACK;
-        if ((wireReceived.Flags & MESSAGE_FLAG_BEACON) != 0) {
-            messageToSendFlags |= MESSAGE_FLAG_BEACON;
+        // If the sensor awaits a response to the request that's now complete, perform it before
+        // the final ACK so that the ACK can carry the response
+        if (GATEWAY_RESPONSE_IN_ACK && request->receivingRequest && request->responseRequired
+                && request->dataAcknowledgedLen == request->dataTotalLen
+                && (wireReceived.Flags & MESSAGE_FLAG_BEACON) == 0) {
+            gatewayRespondInAck(request);
+            break;
         }
-        messageToSendData = (uint8_t *) &body;
-        messageToSendAcknowledgedLen = 0;
-        sendMessageToPeer(false, request->sensorAddress);
+
+        // Ack this received packet
+        gatewaySendAck(request, (wireReceived.Flags & MESSAGE_FLAG_BEACON) != 0);
         break;
     }
 
     case TX: {
 
+        // If we just announced ourselves to other gateways, or woke or broadcast to sensors,
+        // go back to listening
+        if ((messageToSendFlags & (MESSAGE_FLAG_GATEWAY|MESSAGE_FLAG_WAKEUP|MESSAGE_FLAG_BROADCAST)) != 0) {
+            gatewayWaitForAnySensorMessage();
+            break;
+        }
+
         // If we just sent a beacon response, we're done.
         if ((messageToSendFlags & MESSAGE_FLAG_BEACON) != 0) {
             gatewayWaitForSensorMessage();
             break;
         }
 
-        // The last received message is the one most recent in the cache
-        requestState *request = &requestCache[0];
-        traceSetID("to", request->sensorAddress, request->currentRequestID);
-        if (memcmp(sentMessageCarrier.Receiver, request->sensorAddress, sizeof(request->sensorAddress)) != 0) {
-            APP_PRINTF("%s $$$ WRONG SENDER $$$\r\n", tracePeer());
+        // Any of the sensors in a group ACK may be the first to resend what we missed
+        if (sentGroupAck) {
+            sentGroupAck = false;
+            gatewayWaitForAnySensorMessage();
+            break;
+        }
+
+        // Now that the sensor has been told what spreading factor to use for the
+        // remainder of the exchange, switch to it ourselves, remembering the one that we
+        // left until we hear the sensor at the new one
+        if ((messageToSendFlags & MESSAGE_FLAG_ACK) != 0) {
+            uint8_t fromSF = radioSpreadingFactor();
+            uint8_t fromCR = radioCodingRate();
+            appSwitchSpreadingFactor(gatewayAckedSpreadingFactor, gatewayAckedCodingRate);
+            if (radioSpreadingFactor() != fromSF || radioCodingRate() != fromCR) {
+                gatewaySwitchUnconfirmed = true;
+                gatewaySwitchFromSpreadingFactor = fromSF;
+                gatewaySwitchFromCodingRate = fromCR;
+            }
+        }
+
+        // The last received message is the one most recent in the cache
+        requestState *request = requestCacheMRU();
+        if (request == NULL) {
+            gatewayWaitForAnySensorMessage();
+            break;
+        }
+        traceSetID("to", request->sensorAddress, request->currentRequestID);
+        if (memcmp(sentMessageCarrier.Receiver, request->sensorAddress, sizeof(request->sensorAddress)) != 0) {
+            APP_PRINTF("%s $$$ WRONG SENDER $$$\r\n", tracePeer());
+        } else {
+            request->airtimeMs += radioTimeOnAirMs(sentMessageCarrierLen) * (request->relayed ? 2 : 1);
+        }
+
+        // A response carried by our final ACK is acknowledged by the sensor's next request,
+        // and one that didn't fit in it follows it now
+        if ((messageToSendFlags & MESSAGE_FLAG_ACK) != 0 && request->responseInAck) {
+            request->responseInAck = false;
+            gatewayWaitForAnySensorMessage();
+            break;
+        }
+        if ((messageToSendFlags & MESSAGE_FLAG_ACK) != 0 && request->responsePending) {
+            request->responsePending = false;
+            request->sendingResponse = true;
+            sendToPeer(false, 0, request->gatewayRSSI, request->gatewaySNR,
+                       request->sensorAddress, request->currentRequestID,
+                       request->data, request->dataTotalLen, false);
+            break;
+        }
+
+        // A sensor whose request we turned away will begin it again
+        if ((messageToSendFlags & MESSAGE_FLAG_ACK) != 0 && request->busy) {
+            request->receivingRequest = false;
+            gatewayWaitForAnySensorMessage();
+            break;
         }
 
         // Process the sensor request when it's completely received
@@ -1563,17 +4455,50 @@ void appGatewayProcess()
     }
 
     // Expected wait
-    case RX_TIMEOUT:
+    case RX_TIMEOUT: {
         if (ListenPhaseBeforeTalk) {
             lbtTalk();
             break;
         }
+        if (pairDeferring) {
+            gatewayPairDeferContinue(true);
+            break;
+        }
+
+        // If a chunk of a window was lost, the sensor is waiting to hear which chunks actually
+        // arrived, so send it a selective ACK.  Another sensor may have spoken in the meantime,
+        // so this needn't be the sensor that we were most recently talking to, and if several
+        // are waiting they are all answered at once.
+        if (gatewaySendGroupAck()) {
+            break;
+        }
+        requestState *request = gatewayWindowAckDue();
+        if (request != NULL) {
+            traceSetID("to", request->sensorAddress, request->currentRequestID);
+            APP_PRINTF("%s *** window chunk lost: sending selective ack ***\r\n", tracePeer());
+            gatewaySendAck(request, false);
+            break;
+        }
+
         traceSetID("fm", wireReceivedCarrier.Sender, wireReceivedCarrier.Message.RequestID);
-        if (wireReceiveTimeoutMs != UNSOLICITED_RX_TIMEOUT_VALUE) {
+
+        // If nothing came at the spreading factor that our ACK announced, the sensor may have
+        // missed the ACK, so listen for its resend at the one that it's still using
+        if (gatewaySwitchUnconfirmed) {
+            gatewaySwitchUnconfirmed = false;
+            APP_PRINTF("%s nothing heard since switching: listening as before\r\n", tracePeer());
+            appSwitchSpreadingFactor(gatewaySwitchFromSpreadingFactor, gatewaySwitchFromCodingRate);
+            gatewayWaitForSensorMessage();
+            break;
+        }
+        if (wireReceiveTimeoutMs != UNSOLICITED_RX_TIMEOUT_VALUE && !gatewayListenHopping) {
             APP_PRINTF("%s *** no response from sensor ***\r\n", tracePeer());
+        } else {
+            radioNoiseSurvey();
         }
         gatewayWaitForAnySensorMessage();
         break;
+    }
 
     case RX_ERROR:
         memset(&wireReceivedCarrier, 0, sizeof(wireReceivedCarrier));
@@ -1590,31 +4515,836 @@ void appGatewayProcess()
             sensorCoreIdle();
             break;
         }
-        showReceivedTime("*** error receiving from sensor ***", 0, 0);
-        restartReceive(wireReceiveTimeoutMs);
-        break;
+        if (pairDeferring) {
+            gatewayPairDeferContinue(false);
+            break;
+        }
+
+        // While awaiting a sensor within an exchange, what we heard garbled was most likely its frame
+        if (wireReceiveTimeoutMs != UNSOLICITED_RX_TIMEOUT_VALUE) {
+            requestState *request = requestCacheMRU();
+            if (request != NULL) {
+                atpLinkSample(&request->uplinkLink, true);
+            }
+        }
+        twHeatCount(0);
+        showReceivedTime("*** error receiving from sensor ***", 0, 0);
+        restartReceive(wireReceiveTimeoutMs);
+        break;
+
+    case TX_TIMEOUT:
+        traceSetID("to", sentMessageCarrier.Receiver, sentMessage.RequestID);
+        APP_PRINTF("%s *** can't transmit to sensor ***\r\n", tracePeer());
+        gatewayWaitForAnySensorMessage();
+        break;
+
+    case LOWPOWER:
+    default:
+        break;
+    }
+
+    TRACE_PRINTF(TRACE_APP, VLEVEL_H, "EXIT %d\r\n", CurrentStateCore);
+
+}
+
+// Find the sensor most recently heard whose window is still awaiting our selective ACK, if
+// it's recent enough that the sensor is still listening for it.  The cache is ordered by
+// when sensors were last heard, so the search stops at the first that's too old.
+requestState *gatewayWindowAckDue()
+{
+    int64_t nowMs = TIMER_IF_GetTimeMs();
+    uint32_t now = appTime();
+    uint32_t listeningMs = radioReplyTimeoutMs(SOLICITED_COMMS_RX_MARGIN_MS);
+    for (uint16_t entry = requestCacheLRUHead; entry != 0; entry = requestCache[entry-1].lruNext) {
+        requestState *request = &requestCache[entry-1];
+        if (request->lastReceivedTime + (listeningMs/1000) + 1 < now) {
+            break;
+        }
+        if (request->receivingRequest && request->windowAckPending) {
+            if (nowMs - request->windowAckPendingMs > listeningMs) {
+                request->windowAckPending = false;
+                continue;
+            }
+            return request;
+        }
+    }
+    return NULL;
+}
+
+// Get the memory held by requests, whether being received, answered or awaiting the Notecard
+uint32_t gatewayRequestBytesHeld()
+{
+    uint32_t bytes = 0;
+    for (int i=0; i<cachedSensors; i++) {
+        if (requestCache[i].data != NULL) {
+            bytes += requestCache[i].dataTotalLen+1;
+        }
+    }
+    for (uint32_t i=0; i<notecardQueued; i++) {
+        if (notecardQueue[i].data != NULL) {
+            bytes += notecardQueue[i].dataLen;
+        }
+    }
+    return bytes;
+}
+
+// Send an ACK to the sensor, telling it how much of the request we've received
+// Account for a request that a sensor has begun, against its allowance
+void gatewayChargeRequest(requestState *request)
+{
+    int64_t now = TIMER_IF_GetTimeMs();
+    if (request->rateAheadMs < now) {
+        request->rateAheadMs = now;
+    }
+    request->rateAheadMs += (60*60*1000) / GATEWAY_SENSOR_REQUESTS_PER_HOUR;
+}
+
+// Determine how long a sensor should hold back its next request, which is until
+// it is no further ahead of its allowance than a burst, and until we could afford the
+// duty-cycle airtime of this ACK and of answering another exchange on its channel
+uint16_t gatewayRetryAfterSecs(requestState *request)
+{
+    int64_t burstMs = ((int64_t) ((60*60*1000) / GATEWAY_SENSOR_REQUESTS_PER_HOUR)) * (GATEWAY_SENSOR_REQUEST_BURST-1);
+    int64_t waitMs = request->rateAheadMs - TIMER_IF_GetTimeMs() - burstMs;
+    int64_t dutyMs = dutyWaitMs(radioChannelFrequency(request->twSlotChannel),
+                                (radioAckTimeOnAirMs(0)*2) + radioMessageTimeOnAirMs(0));
+    if (dutyMs > waitMs) {
+        waitMs = dutyMs;
+    }
+    if (waitMs <= 0) {
+        return 0;
+    }
+    int64_t secs = (waitMs + 999) / 1000;
+    return (secs > 0xFFFF) ? 0xFFFF : (uint16_t) secs;
+}
+
+// The legacy ACK is sent as the beginning of the extended one, followed by the name, and it is
+// the extended ACK's Format that takes the place of the name
+_Static_assert(offsetof(gatewayAckBody, Format) == offsetof(gatewayAckLegacyBody, Name), "ACK must begin as the legacy ACK does");
+
+void gatewaySendAck(requestState *request, bool beacon)
+{
+
+    // A short-header chunk within a request is acknowledged with just which chunks arrived,
+    // unless the request was turned away, which only a full ACK can say
+    uint16_t peerID;
+    if (!beacon && !request->busy && wireShortPeer(request->sensorAddress, &peerID)
+            && wireCompactAckFor(true, wireReceived.Flags, wireReceived.Offset, wireReceived.Len, wireReceived.TotalLen)) {
+        gatewaySendCompactAck(request, peerID);
+        return;
+    }
+
+    // Prepare the body
+    static gatewayAckBody body = {0};
+    static uint8_t ack[(sizeof(gatewayAckBody)+AES_KEY_BYTES) > MESSAGE_MAX_BODY ? (sizeof(gatewayAckBody)+AES_KEY_BYTES) : MESSAGE_MAX_BODY];
+    char *zone;
+    int offset;
+    const char *name = "";
+    if (request->peerHandle < 0) {
+        requestCacheSetPeer(request, flashConfigFindPeerHandle(request->sensorAddress));
+    }
+    flashConfigPeerNameByHandle(request->peerHandle, &name, NULL);
+    strlcpy(body.Name, name, sizeof(body.Name));
+    body.Format = GATEWAY_ACK_EXTENDED;
+    body.LastProcessedRequestID = request->lastProcessedRequestIDForAck;
+    body.AckedLen = request->dataAcknowledgedLen;
+    body.SackBitmap = request->dataReceivedMap;
+    request->windowAckPending = false;
+    twRefresh();
+    body.TWModulusSecs = TWModulusSecs;
+    body.TWModulusOffsetSecs = TWModulusOffsetSecs;
+    body.TWSlotBeginsSecs = request->twSlotBeginsSecs;
+    body.TWSlotEndsSecs = request->twSlotEndsSecs;
+    body.TWListenBeforeTalkMs = TWListenBeforeTalkMs;
+#if REBOOT_SENSORS_WHEN_GATEWAY_REBOOTS
+    body.BootTime = gatewayBootTime;
+#else
+    body.BootTime = 0;
+#endif
+    NoteRegion(NULL, NULL, &zone, &offset);
+    body.ZoneOffsetMins = offset;
+    body.ZoneName[0] = zone[0];
+    body.ZoneName[1] = zone[1];
+    body.ZoneName[2] = zone[2];
+
+    // If the link is strong in both directions, have the sensor finish the exchange at a
+    // lower spreading factor, or for a bulk transfer using FSK.  Beacons are exempt because
+    // the peer isn't yet established.  Frames received in FSK carry no signal measurements,
+    // so once the exchange has switched to FSK it stays there.  A relay listens only at the
+    // default spreading factor and coding rate, as does a sensor that takes only the legacy ACK.
+    body.SpreadingFactor = 0;
+    if (beacon || request->relayed || !request->extendedAck) {
+        // Stay at the default
+    } else if (radioSpreadingFactor() == RADIO_SF_FSK) {
+        body.SpreadingFactor = RADIO_SF_FSK;
+    } else if (request->gatewayRSSI != 0 && request->sensorRSSI != 0) {
+        bool bulk = request->responseRequired
+                    || (request->dataTotalLen - request->dataAcknowledgedLen) >= LORA_ADAPTIVE_FSK_MIN_BYTES;
+        body.SpreadingFactor = atpSpreadingFactor(request->gatewayRSSI, request->gatewaySNR,
+                                                  request->sensorRSSI, request->sensorSNR, bulk);
+    }
+    gatewayAckedSpreadingFactor = body.SpreadingFactor;
+
+    // Trade FEC for fewer retransmissions on a link whose frames are arriving garbled
+    body.CodingRate = 0;
+#if USE_MODEM_LORA
+    if (!beacon && !request->relayed && request->extendedAck) {
+        body.CodingRate = atpCodingRate(&request->uplinkLink, body.SpreadingFactor != 0 ? body.SpreadingFactor : LORA_SPREADING_FACTOR);
+    }
+#endif
+    gatewayAckedCodingRate = body.CodingRate;
+
+    // The chunk size follows from the spreading factor, and if the sensor's next window will
+    // use a different size, the chunks we have ahead of a lost one can't be expressed in it
+#if USE_MODEM_LORA
+    uint8_t nextChunkLen = radioChunkLen(body.SpreadingFactor != 0 ? body.SpreadingFactor : LORA_SPREADING_FACTOR);
+#else
+    uint8_t nextChunkLen = radioChunkLen(0);
+#endif
+    if (nextChunkLen != request->dataChunkLen) {
+        request->dataChunkLen = nextChunkLen;
+        request->dataReceivedMap = 0;
+        body.SackBitmap = 0;
+    }
+
+    // Offer our image to sensors whose image differs
+    uint32_t imageCRC, imageLen;
+    dfuLoraGatewayImage(&imageCRC, &imageLen);
+    body.ImageCRC = imageCRC;
+    body.ImageLen = imageLen;
+
+    // Tell the sensor which channel to use within its slot, when urgent windows open, through
+    // which relay to reach us if it has one, and which version of its settings we hold
+    body.Channel = request->twSlotChannel;
+    body.SettingsVersion = settingsVersionFor(request->sensorAddress);
+    if (!relayDesignatedFor(request->sensorAddress, body.RelayAddress)) {
+        memset(body.RelayAddress, 0, sizeof(body.RelayAddress));
+    }
+    body.TWUrgentPeriodSecs = TW_URGENT_PERIOD_SECS;
+    body.TWUrgentSecs = TW_URGENT_SECS;
+
+    // If this is the final ACK of a request awaiting a response, say when it's expected
+    body.PeerID = (request->peerHandle >= 0) ? (uint16_t) (request->peerHandle + 1) : 0;
+    body.RetryAfterSecs = beacon ? 0 : gatewayRetryAfterSecs(request);
+
+    // A sensor whose request we had no room for begins it again after holding off
+    if (!beacon && request->busy) {
+        body.AckedLen = GATEWAY_ACK_BUSY;
+        body.SackBitmap = 0;
+        body.SpreadingFactor = gatewayAckedSpreadingFactor = 0;
+        body.CodingRate = gatewayAckedCodingRate = 0;
+        if (body.RetryAfterSecs < GATEWAY_BUSY_RETRY_SECS) {
+            body.RetryAfterSecs = GATEWAY_BUSY_RETRY_SECS;
+        }
+    }
+    body.ResponseDelayMs = 0;
+    if (!gatewayAckResponseReady && request->responseRequired && request->dataAcknowledgedLen == request->dataTotalLen) {
+        body.ResponseDelayMs = (request->responseLatencyMs > 0xFFFF) ? 0xFFFF : request->responseLatencyMs;
+    }
+
+    // Stamp the ACK with the time at which it will begin transmitting, so that the sensor
+    // can synchronize to the millisecond.  Until we've finished booting and know the time,
+    // the sensor keeps whatever it has.
+    uint16_t timeMs;
+    body.Time = gatewayTransmitTime(0, &timeMs);
+    body.TimeMs = timeMs;
+    if (gatewayBootTime == 0) {
+        body.Time = 0;
+    }
+
+    // Once the sensor holds this version of the fields that rarely change, send just the rest
+    body.ConfigVersion = gatewayAckConfigVersion(&body);
+    bool delta = RADIO_DELTA_ACK && !beacon && request->ackedConfigVersion == body.ConfigVersion
+                 && wireShortPeer(request->sensorAddress, &peerID);
+    request->ackedConfigVersion = body.ConfigVersion;
+
+    // Make sure that the send buffer is deallocated
+    freeMessageToSendBuffer();
+
+    // Set the length to what's necessary to transmit the name, using the
+    // assumption that the name is always at the very end of the structure.
+    messageToSendDataLen = sizeof(body);
+    messageToSendDataLen -= SENSOR_NAME_MAX;
+    messageToSendDataLen += strlen(body.Name)+1;
+    if (delta) {
+        messageToSendDataLen = sizeof(gatewayAckDeltaBody);
+    }
+
+    // A sensor on older firmware takes the legacy ACK, which carries neither key nor response
+    if (!request->extendedAck) {
+        messageToSendDataLen = offsetof(gatewayAckLegacyBody, Name);
+        memcpy(ack, &body, messageToSendDataLen);
+        memcpy(&ack[messageToSendDataLen], body.Name, strlen(body.Name)+1);
+        messageToSendDataLen += strlen(body.Name)+1;
+        gatewaySendAckFrame(request, beacon, ack);
+        return;
+    }
+
+    // Follow it with our broadcast key if the sensor needs it, and then with the response to
+    // the request if it's ready and fits within what remains of the frame.  A beacon ACK is
+    // sent in cleartext, so a newly paired sensor asks for the key in its first request.
+    bool withKey = (RADIO_SNIFF_PERIOD_MS != 0 && !beacon && (wireReceived.Flags & MESSAGE_FLAG_KEY) != 0);
+    uint32_t keyLen = withKey ? AES_KEY_BYTES : 0;
+    body.ResponseLen = 0;
+    if (gatewayAckResponseReady && gatewayAckResponse != NULL && gatewayAckResponseLen != 0
+            && messageToSendDataLen + keyLen + gatewayAckResponseLen <= radioChunkLen(0)) {
+        body.ResponseLen = (uint16_t) gatewayAckResponseLen;
+        request->responseInAck = true;
+    }
+    if (delta) {
+        gatewayAckDeltaBody deltaBody;
+        deltaBody.ConfigVersion = body.ConfigVersion;
+        deltaBody.AckedLen = body.AckedLen;
+        deltaBody.SackBitmap = body.SackBitmap;
+        deltaBody.Time = body.Time;
+        deltaBody.TimeMs = body.TimeMs;
+        deltaBody.SpreadingFactor = body.SpreadingFactor;
+        deltaBody.CodingRate = body.CodingRate;
+        deltaBody.ResponseDelayMs = body.ResponseDelayMs;
+        deltaBody.RetryAfterSecs = body.RetryAfterSecs;
+        deltaBody.ResponseLen = body.ResponseLen;
+        memcpy(ack, &deltaBody, sizeof(deltaBody));
+    } else {
+        memcpy(ack, &body, messageToSendDataLen);
+    }
+    if (withKey) {
+        memcpy(&ack[messageToSendDataLen], gatewayBroadcastKey, AES_KEY_BYTES);
+        messageToSendDataLen += AES_KEY_BYTES;
+    }
+    if (body.ResponseLen != 0) {
+        memcpy(&ack[messageToSendDataLen], gatewayAckResponse, body.ResponseLen);
+        messageToSendDataLen += body.ResponseLen;
+    }
+
+    // Ack this received packet with the current gateway time
+    messageToSendDelta = delta;
+    gatewaySendAckFrame(request, beacon, ack);
+    messageToSendDelta = false;
+
+}
+
+// Send the ACK that has been formatted, whose length is messageToSendDataLen
+void gatewaySendAckFrame(requestState *request, bool beacon, uint8_t *ack)
+{
+    messageToSendRequestID = request->currentRequestID;
+    messageToSendFlags = MESSAGE_FLAG_ACK;
+    if (beacon) {
+        messageToSendFlags |= MESSAGE_FLAG_BEACON;
+    }
+    messageToSendData = ack;
+    messageToSendAcknowledgedLen = 0;
+    sendMessageToPeer(false, request->sensorAddress);
+}
+
+// Get the version of the fields of an ACK that a delta ACK omits, which is never 0
+uint16_t gatewayAckConfigVersion(gatewayAckBody *body)
+{
+    gatewayAckBody config;
+    memcpy(&config, body, sizeof(config));
+    config.LastProcessedRequestID = 0;
+    config.AckedLen = 0;
+    config.SackBitmap = 0;
+    config.Time = 0;
+    config.TimeMs = 0;
+    config.SpreadingFactor = 0;
+    config.CodingRate = 0;
+    config.ResponseDelayMs = 0;
+    config.RetryAfterSecs = 0;
+    config.ResponseLen = 0;
+    config.ConfigVersion = 0;
+    size_t nameLen = strnlen(config.Name, SENSOR_NAME_MAX);
+    memset(&config.Name[nameLen], 0, SENSOR_NAME_MAX - nameLen);
+    uint32_t crc = utilCRC32(0, (uint8_t *) &config, sizeof(config));
+    uint16_t version = (uint16_t) (crc ^ (crc >> 16));
+    return (version == 0) ? 1 : version;
+}
+
+// Send a compact ACK of a chunk within a request, with an implicit header because the sensor
+// knows from its chunk to expect one.  What was sent is noted just as sendMessageToPeer()
+// would, so that the transmit completes like that of any other ACK, staying at the spreading
+// factor that the exchange is already using.
+void gatewaySendCompactAck(requestState *request, uint16_t peerID)
+{
+    wireCompactAckBody body;
+    body.RequestID = request->currentRequestID;
+    body.AckedLen = request->dataAcknowledgedLen;
+    body.SackBitmap = request->dataReceivedMap;
+    request->windowAckPending = false;
+    uint8_t key[AES_KEY_BYTES];
+    if (!flashConfigFindPeerByAddress(request->sensorAddress, NULL, key, NULL)
+            || !wireCompactAckSeal(key, peerID, &body, sentShortFrame)) {
+        APP_PRINTF("encryption error\r\n");
+    }
+    memcpy(key, invalidKey, sizeof(key));
+    sentGroupAck = false;
+    messageToSendRequestID = request->currentRequestID;
+    messageToSendFlags = MESSAGE_FLAG_ACK;
+    sentMessage.Flags = MESSAGE_FLAG_ACK;
+    sentMessage.RequestID = request->currentRequestID;
+    sentMessage.Offset = 0;
+    sentMessage.Len = 0;
+    sentMessage.TotalLen = 0;
+    memcpy(sentMessageCarrier.Receiver, request->sensorAddress, sizeof(sentMessageCarrier.Receiver));
+    sentFrame = sentShortFrame;
+    sentMessageCarrierLen = sizeof(wireCompactAck);
+    gatewayAckedSpreadingFactor = radioSpreadingFactor();
+    gatewayAckedCodingRate = radioCodingRate();
+    TRACE_EVENT(TRACE_RADIO, VLEVEL_L, "sending compact ACK", {"acked", body.AckedLen}, {"total", request->dataTotalLen}, {"txp", atpPowerLevel()});
+    if (RADIO_TURNAROUND_ALLOWANCE_MS != 0) {
+        HAL_Delay(RADIO_TURNAROUND_ALLOWANCE_MS);
+    }
+    radioImplicitHeaderNext(sizeof(wireCompactAck));
+    lbtTalk();
+}
+
+// When the selective ACKs owed to more than one sensor are due at once, because each was
+// sending a window while we were hearing the others, send them in one group ACK of the compact
+// ACK that each would otherwise have been sent, returning false if fewer than two are due.
+// Only sensors that have IDs can be found in a group ACK.
+bool gatewaySendGroupAck()
+{
+    if (!RADIO_GROUP_ACK || !USE_MODEM_LORA || radioSpreadingFactor() == RADIO_SF_FSK) {
+        return false;
+    }
+
+    // Gather the sensors still listening for their selective ACKs, as gatewayWindowAckDue() would
+    requestState *due[GROUP_ACK_MAX_ENTRIES];
+    uint16_t peerIDs[GROUP_ACK_MAX_ENTRIES];
+    int count = 0;
+    int64_t nowMs = TIMER_IF_GetTimeMs();
+    uint32_t now = appTime();
+    uint32_t listeningMs = radioReplyTimeoutMs(SOLICITED_COMMS_RX_MARGIN_MS);
+    for (uint16_t entry = requestCacheLRUHead; entry != 0 && count < GROUP_ACK_MAX_ENTRIES; entry = requestCache[entry-1].lruNext) {
+        requestState *request = &requestCache[entry-1];
+        if (request->lastReceivedTime + (listeningMs/1000) + 1 < now) {
+            break;
+        }
+        if (request->receivingRequest && request->windowAckPending && !request->busy
+                && nowMs - request->windowAckPendingMs <= listeningMs
+                && wireShortPeer(request->sensorAddress, &peerIDs[count])) {
+            due[count++] = request;
+        }
+    }
+    if (count < 2) {
+        return false;
+    }
+
+    // Seal each sensor's entry with its own key
+    wireGroupAck *group = (wireGroupAck *) sentShortFrame;
+    group->Version = MESSAGE_VERSION_GROUP_ACK;
+    group->Count = (uint8_t) count;
+    sentMessageCarrierLen = sizeof(wireGroupAck) + (count * sizeof(wireCompactAck));
+    uint32_t airtimeMs = radioTimeOnAirMs(sentMessageCarrierLen);
+    uint8_t key[AES_KEY_BYTES];
+    for (int i=0; i<count; i++) {
+        requestState *request = due[i];
+        wireCompactAckBody body;
+        body.RequestID = request->currentRequestID;
+        body.AckedLen = request->dataAcknowledgedLen;
+        body.SackBitmap = request->dataReceivedMap;
+        request->windowAckPending = false;
+        request->airtimeMs += (airtimeMs / count) * (request->relayed ? 2 : 1);
+        if (!flashConfigFindPeerByAddress(request->sensorAddress, NULL, key, NULL)
+                || !wireCompactAckSeal(key, peerIDs[i], &body, (uint8_t *) &group->Entry[i])) {
+            APP_PRINTF("encryption error\r\n");
+        }
+    }
+    memcpy(key, invalidKey, sizeof(key));
+
+    // Note what was sent just as gatewaySendCompactAck() would, but with no one receiver
+    sentGroupAck = true;
+    messageToSendRequestID = 0;
+    messageToSendFlags = MESSAGE_FLAG_ACK;
+    sentMessage.Flags = MESSAGE_FLAG_ACK;
+    sentMessage.RequestID = 0;
+    sentMessage.Offset = 0;
+    sentMessage.Len = 0;
+    sentMessage.TotalLen = 0;
+    memset(sentMessageCarrier.Receiver, 0, sizeof(sentMessageCarrier.Receiver));
+    sentFrame = sentShortFrame;
+    APP_PRINTF("*** window chunks lost: sending group ack to %d sensors ***\r\n", count);
+    TRACE_EVENT(TRACE_RADIO, VLEVEL_L, "sending group ACK", {"sensors", count}, {"txp", atpPowerLevel()});
+    if (RADIO_TURNAROUND_ALLOWANCE_MS != 0) {
+        HAL_Delay(RADIO_TURNAROUND_ALLOWANCE_MS);
+    }
+    lbtTalk();
+    return true;
+}
+
+// Perform a request whose sensor awaits a response before sending our final ACK, so that a
+// response short enough is carried by the ACK instead of following it in frames of its own.
+// One that doesn't fit is sent as soon as the ACK has gone.
+void gatewayRespondInAck(requestState *request)
+{
+
+    // Perform the request, keeping what the ACK must report about how much of it we received
+    uint32_t requestLen = request->dataTotalLen;
+    gatewayPerformRequest(request, true, TIMER_IF_GetTimeMs());
+    gatewayAckResponse = request->data;
+    gatewayAckResponseLen = request->dataTotalLen;
+    request->data = NULL;
+    request->dataTotalLen = requestLen;
+    request->dataAcknowledgedLen = requestLen;
+    request->receivingRequest = false;
+    request->sendingResponse = false;
+
+    // Send the ACK, which takes the response if it fits
+    request->responseInAck = false;
+    gatewayAckResponseReady = true;
+    gatewaySendAck(request, false);
+    gatewayAckResponseReady = false;
+    request->data = gatewayAckResponse;
+    request->dataTotalLen = gatewayAckResponseLen;
+    request->dataAcknowledgedLen = 0;
+    gatewayAckResponse = NULL;
+    gatewayAckResponseLen = 0;
+
+    // A carried response is kept in case the sensor missed our ACK and retries the request
+    if (request->responseInAck) {
+        APP_PRINTF("%s response carried in final ACK (%d)\r\n", tracePeer(), request->dataTotalLen);
+        responseCacheStore(request);
+    } else {
+        request->responsePending = true;
+    }
+
+}
+
+// Complete the pairing of a sensor whose beacon carried the specified key
+void gatewayPairSensor(requestState *request, uint8_t *key)
+{
+
+    // Update the key and algorithm for this peer, which housekeeping writes to flash once the
+    // exchange is done rather than holding off the reply
+    flashConfigSetPeer(PEER_TYPE_SENSOR, request->sensorAddress, key);
+    gatewayProvisionPaired();
+    requestCacheSetPeer(request, flashConfigFindPeerHandle(request->sensorAddress));
+    APP_PRINTF("%s *** beacon: updated sensor key\r\n", tracePeer());
+#ifdef SHOW_KEYS
+    APP_PRINTF("STORE PEER: ");
+    for (int i=0; i<ADDRESS_LEN; i++) {
+        APP_PRINTF("%02x", request->sensorAddress[i]);
+    }
+    APP_PRINTF(": ");
+    for (int i=0; i<AES_KEY_BYTES; i++) {
+        APP_PRINTF("%02x", key[i]);
+    }
+    APP_PRINTF("\r\n");
+#endif
+
+    // Notify the notecard and notehub that we've peered with this sensor
+    J *req = NoteNewCommand("hub.log");
+    if (req != NULL) {
+        JAddStringToObject(req, "method", "sensor-provision");
+        char saddr[40];
+        utilAddressToText(request->sensorAddress, saddr, sizeof(saddr));
+        JAddStringToObject(req, "text", saddr);
+        JAddBoolToObject(req, "sync", true);
+        NoteRequest(req);
+    }
+
+}
+
+// Compute how long to hold back a beacon ACK, which is longer the more neighboring
+// gateways are using fewer slots than we are, so that the least-loaded one answers first.
+uint32_t gatewayPairDeferMs()
+{
+    if (gatewayProvisioning()) {
+        return 0;
+    }
+    uint32_t now = appTime();
+    uint32_t deferMs = 0;
+    for (int i=0; i<GATEWAY_NEIGHBORS_MAX; i++) {
+        gatewayNeighbor *n = &gatewayNeighbors[i];
+        if (n->lastHeardTime == 0 || n->lastHeardTime + GATEWAY_NEIGHBOR_SECS < now) {
+            continue;
+        }
+        if (n->slotUnits < twLastSlotUnits
+                || (n->slotUnits == twLastSlotUnits && memcmp(n->address, ourAddress, ADDRESS_LEN) < 0)) {
+            deferMs += GATEWAY_PAIR_DEFER_MS;
+        }
+    }
+    if (deferMs > GATEWAY_PAIR_DEFER_MAX_MS) {
+        deferMs = GATEWAY_PAIR_DEFER_MAX_MS;
+    }
+    return deferMs;
+}
+
+// Continue holding back a beacon ACK, either yielding to the gateway that answered
+// the sensor in the meantime or pairing with it ourselves when the time is up.
+void gatewayPairDeferContinue(bool expired)
+{
+    bool created;
+
+    // Another gateway paired with the sensor, so don't reserve a slot for it
+    if (pairDeferYielded) {
+        pairDeferring = false;
+        memset(pairDeferKey, 0, sizeof(pairDeferKey));
+        requestState *request = requestCacheLookup(pairDeferAddress, &created);
+        request->lastReceivedTime = 0;
+        traceSetID("fm", request->sensorAddress, request->currentRequestID);
+        APP_PRINTF("%s *** beacon: answered by another gateway ***\r\n", tracePeer());
+        gatewayWaitForAnySensorMessage();
+        return;
+    }
+
+    // Keep listening until the deferral is over
+    int64_t remainingMs = pairDeferUntilMs - TIMER_IF_GetTimeMs();
+    if (!expired && remainingMs > 0) {
+        restartReceive((uint32_t) remainingMs);
+        return;
+    }
+
+    // Nobody else answered, so pair with it
+    pairDeferring = false;
+    requestState *request = requestCacheLookup(pairDeferAddress, &created);
+    traceSetID("fm", request->sensorAddress, request->currentRequestID);
+    gatewayPairSensor(request, pairDeferKey);
+    memset(pairDeferKey, 0, sizeof(pairDeferKey));
+    gatewaySendAck(request, true);
+
+}
+
+// Determine whether it's time to announce ourselves to neighboring gateways, which is
+// only useful once we share the Notecard's notion of time with them.
+bool gatewayAnnounceDue()
+{
+    if (!appTimeValid()) {
+        return false;
+    }
+    uint32_t now = appTime();
+    if (now < gatewayNextAnnounceTime) {
+        return false;
+    }
+    gatewayNextAnnounceTime = now + GATEWAY_ANNOUNCE_SECS + (MY_Random() % GATEWAY_ANNOUNCE_JITTER_SECS);
+    return true;
+}
+
+// Tell neighboring gateways how much of the shared time window we're using
+void gatewayAnnounce()
+{
+    static gatewayAnnounceBody body = {0};
+    twRefresh();
+    body.TWModulusSecs = TWModulusSecs;
+    body.TWModulusOffsetSecs = TWModulusOffsetSecs;
+    body.SlotUnits = (uint16_t) twLastSlotUnits;
+    traceSetID("an", ourAddress, 0);
+    sendToPeer(false, MESSAGE_FLAG_GATEWAY, 0, 0, ourAddress, 0, (uint8_t *) &body, sizeof(body), false);
+}
+
+// Arrange for each active sensor to be woken so that it checks in, returning how many will be
+uint32_t gatewayWakeSensors()
+{
+    if (RADIO_SNIFF_PERIOD_MS == 0) {
+        return 0;
+    }
+    uint32_t woken = 0;
+    uint32_t inactiveTime = appTime() - TW_ACTIVE_SECS;
+    for (int i=0; i<cachedSensors; i++) {
+        requestState *r = &requestCache[i];
+        if (r->ours || r->lastReceivedTime < inactiveTime) {
+            continue;
+        }
+        r->wakePending = true;
+        woken++;
+    }
+    APP_PRINTF("waking %d sensors\r\n", woken);
+    return woken;
+}
+
+// Find the next sensor waiting to be woken
+requestState *gatewayWakeDue()
+{
+    for (int i=0; i<cachedSensors; i++) {
+        if (requestCache[i].wakePending) {
+            requestCache[i].wakePending = false;
+            return &requestCache[i];
+        }
+    }
+    return NULL;
+}
+
+// Wake a sniffing sensor with a message whose preamble spans its sniff period.  The wakeup
+// is encrypted with the sensor's key so that nobody else can drain its battery this way.
+void gatewayWake(requestState *request)
+{
+    radioSetWakeupPreamble(true);
+    traceSetID("wk", request->sensorAddress, 0);
+    sendToPeer(false, MESSAGE_FLAG_WAKEUP, 0, 0, request->sensorAddress, 0, NULL, 0, false);
+}
+
+// Get the time, in secs and the ms past it, at which a frame now being prepared will begin
+// transmitting after the turnaround allowance and the given additional delay
+uint32_t gatewayTransmitTime(uint32_t delayMs, uint16_t *timeMs)
+{
+    int64_t ms = appTimeMs();
+    if (ms == 0) {
+        *timeMs = 0;
+        return 0;
+    }
+    ms += TIME_SYNC_TX_LATENCY_MS + RADIO_TURNAROUND_ALLOWANCE_MS + delayMs;
+    *timeMs = (uint16_t) (ms % 1000);
+    return (uint32_t) (ms / 1000);
+}
+
+// Load the key with which we broadcast to our sensors, creating it on first boot.  It is
+// kept in flash under our own address so that it survives reboots, which is when it's needed.
+void gatewayBroadcastKeyInit()
+{
+    if (flashConfigFindPeerByAddress(ourAddress, NULL, gatewayBroadcastKey, NULL)
+            && memcmp(gatewayBroadcastKey, invalidKey, sizeof(invalidKey)) != 0) {
+        return;
+    }
+    for (size_t i=0; i<sizeof(gatewayBroadcastKey); i++) {
+        gatewayBroadcastKey[i] = MY_Random();
+    }
+    flashConfigUpdatePeer(PEER_TYPE_SELF, ourAddress, gatewayBroadcastKey);
+}
+
+// Determine whether what we'd broadcast to sensors has changed and may be sent now
+bool gatewayBroadcastDue()
+{
+    if (RADIO_SNIFF_PERIOD_MS == 0 || !gatewayBroadcastPending || !appTimeValid() || gatewayBootTime == 0) {
+        return false;
+    }
+    return (appTime() >= gatewayNextBroadcastTime);
+}
+
+// Send all sensors, in one message, what each of them would otherwise learn from its next ACK
+void gatewayBroadcast()
+{
+    static gatewayBroadcastBody body = {0};
+    twRefresh();
+    gatewayBroadcastPending = false;
+    gatewayNextBroadcastTime = appTime() + GATEWAY_BROADCAST_MIN_SECS;
+    body.TWModulusSecs = TWModulusSecs;
+    body.TWModulusOffsetSecs = TWModulusOffsetSecs;
+    body.TWListenBeforeTalkMs = TWListenBeforeTalkMs;
+#if REBOOT_SENSORS_WHEN_GATEWAY_REBOOTS
+    body.BootTime = gatewayBootTime;
+#else
+    body.BootTime = 0;
+#endif
+    char *zone;
+    int offset;
+    NoteRegion(NULL, NULL, &zone, &offset);
+    body.ZoneOffsetMins = offset;
+    body.ZoneName[0] = zone[0];
+    body.ZoneName[1] = zone[1];
+    body.ZoneName[2] = zone[2];
+    uint32_t imageCRC, imageLen;
+    dfuLoraGatewayImage(&imageCRC, &imageLen);
+    body.ImageCRC = imageCRC;
+    body.ImageLen = imageLen;
+
+    // Add the slot of each sensor that has one, for as many as will fit
+    uint32_t slots = 0;
+    for (int i=0; i<cachedSensors && slots<GATEWAY_BROADCAST_SLOTS; i++) {
+        requestState *r = &requestCache[i];
+        if (r->twSlotEndsSecs == 0) {
+            continue;
+        }
+        body.Slots[slots].AddressHash = utilHashAddress(r->sensorAddress);
+        body.Slots[slots].TWSlotBeginsSecs = r->twSlotBeginsSecs;
+        body.Slots[slots].TWSlotEndsSecs = r->twSlotEndsSecs;
+        body.Slots[slots].Channel = r->twSlotChannel;
+        slots++;
+    }
+    uint32_t length = sizeof(body) - sizeof(body.Slots) + (slots * sizeof(gatewayBroadcastSlot));
+
+    // Stamp it as for an ACK, as of the end of the wakeup preamble that precedes the payload
+    radioSetWakeupPreamble(true);
+    uint16_t timeMs;
+    body.Time = gatewayTransmitTime(radioTxTimeOnAirMs(0) - radioTimeOnAirMs(0), &timeMs);
+    body.TimeMs = timeMs;
+    traceSetID("bc", wildcardAddress, 0);
+    sendToPeer(false, MESSAGE_FLAG_BROADCAST, 0, 0, wildcardAddress, 0, (uint8_t *) &body, length, false);
+}
+
+// Note a cleartext message sent by another gateway, returning true if it was
+// something that only matters to gateways.
+bool gatewayNeighborHeard()
+{
+    wireMessage *msg = &wireReceivedCarrier.Message;
+    if (msg->Signature != MESSAGE_SIGNATURE) {
+        return false;
+    }
+
+    // A beacon ACK to the sensor whose ACK we're holding back means that it has paired elsewhere
+    if ((msg->Flags & (MESSAGE_FLAG_ACK|MESSAGE_FLAG_BEACON)) == (MESSAGE_FLAG_ACK|MESSAGE_FLAG_BEACON)) {
+        if (pairDeferring && memcmp(wireReceivedCarrier.Receiver, pairDeferAddress, ADDRESS_LEN) == 0) {
+            pairDeferYielded = true;
+        }
+        return pairDeferring;
+    }
+
+    // An announcement of what a neighbor is doing with the time window
+    if ((msg->Flags & MESSAGE_FLAG_GATEWAY) == 0 || msg->Len < sizeof(gatewayAnnounceBody)) {
+        return false;
+    }
+    gatewayAnnounceBody body;
+    memcpy(&body, msg->Body, sizeof(body));
+    uint32_t now = appTime();
+    int slot = -1;
+    for (int i=0; i<GATEWAY_NEIGHBORS_MAX; i++) {
+        gatewayNeighbor *n = &gatewayNeighbors[i];
+        if (memcmp(n->address, wireReceivedCarrier.Sender, ADDRESS_LEN) == 0) {
+            slot = i;
+            break;
+        }
+        if (slot < 0 || n->lastHeardTime < gatewayNeighbors[slot].lastHeardTime) {
+            slot = i;
+        }
+    }
+    gatewayNeighbor *n = &gatewayNeighbors[slot];
+    memcpy(n->address, wireReceivedCarrier.Sender, ADDRESS_LEN);
+    n->modulusSecs = body.TWModulusSecs;
+    n->modulusOffsetSecs = body.TWModulusOffsetSecs;
+    n->slotUnits = body.SlotUnits;
+    n->lastHeardTime = (now == 0 ? 1 : now);
+    char msgText[40];
+    utilAddressToText(n->address, msgText, sizeof(msgText));
+    APP_PRINTF("%s neighbor gateway %s: %d slots at %d-%d of %ds window\r\n", tracePeer(), msgText,
+               n->slotUnits, n->modulusOffsetSecs, n->modulusOffsetSecs+(n->slotUnits*twMinimumModulusSecs()),
+               n->modulusSecs);
+    return true;
 
-    case TX_TIMEOUT:
-        traceSetID("to", sentMessageCarrier.Receiver, sentMessage.RequestID);
-        APP_PRINTF("%s *** can't transmit to sensor ***\r\n", tracePeer());
-        gatewayWaitForAnySensorMessage();
-        break;
+}
 
-    case LOWPOWER:
-    default:
-        break;
+// Total up the slots used by the neighboring gateways that we've heard from recently,
+// and of those the slots used by gateways that precede us in the shared time window.
+bool gatewayNeighborLoad(uint32_t *neighborUnits, uint32_t *precedingUnits)
+{
+    uint32_t now = appTime();
+    bool found = false;
+    *neighborUnits = 0;
+    *precedingUnits = 0;
+    for (int i=0; i<GATEWAY_NEIGHBORS_MAX; i++) {
+        gatewayNeighbor *n = &gatewayNeighbors[i];
+        if (n->lastHeardTime == 0 || n->lastHeardTime + GATEWAY_NEIGHBOR_SECS < now) {
+            continue;
+        }
+        found = true;
+        *neighborUnits += n->slotUnits;
+        if (memcmp(n->address, ourAddress, ADDRESS_LEN) < 0) {
+            *precedingUnits += n->slotUnits;
+        }
     }
+    return found;
+}
 
-#ifdef TRACE_STATE
-    APP_PRINTF("EXIT %d\r\n", CurrentStateCore);
-#endif
-
+// Record the message just received from a sensor in the packet event log
+void gatewayLogPacket(uint8_t outcome, uint32_t latencyMs)
+{
+    int8_t rssi = wireReceiveSignalValid ? wireReceiveRSSI : 0;
+    int8_t snr = wireReceiveSignalValid ? wireReceiveSNR : 0;
+    pktlogRecord(wireReceivedCarrier.Sender, wireReceived.RequestID, wireReceived.Offset,
+                 rssi, snr, wireReceived.TXP, outcome, latencyMs);
 }
 
 // Show the time that a message was received, as well as when it SHOULD have been received
 void showReceivedTime(char *msg, uint32_t beginSecs, uint32_t endSecs)
 {
-    uint32_t now = NoteTimeST();
+    uint32_t now = appTime();
     uint32_t modSecs = (TWModulusSecs == 0 ? twMinimumModulusSecs() : TWModulusSecs);
     uint32_t slotSecs = twMinimumModulusSecs();
     uint32_t windowRelativeNowTime = now - TWModulusOffsetSecs;
@@ -1632,7 +5362,7 @@ void showReceivedTime(char *msg, uint32_t beginSecs, uint32_t endSecs)
     DEBUG_VARIABLE(nextSlotBeginTime);
     DEBUG_VARIABLE(sensorSlotEndTime);
     APP_PRINTF("%s %s", tracePeer(), msg);
-    if (appIsGateway && NoteTimeValidST() && thisWindowBeginTime > gatewayBootTime) {
+    if (appIsGateway && appTimeValid() && thisWindowBeginTime > gatewayBootTime) {
         APP_PRINTF(" window:%d-%d", thisWindowBeginTime-gatewayBootTime, nextWindowBeginTime-gatewayBootTime);
         APP_PRINTF(" slot#%d/%d(", thisSlotNumber, modSecs/slotSecs);
         char slotOwner[SENSOR_NAME_MAX];
@@ -1662,30 +5392,100 @@ void showReceivedTime(char *msg, uint32_t beginSecs, uint32_t endSecs)
         }
     }
     APP_PRINTF("\r\n");
-    HAL_Delay(5);   // Flush output before sleep
 }
 
 // Validate the received message, making sure that it's for us, and setting wireReceiveMessageError
-bool validateReceivedMessage()
+bool RAMFUNC validateReceivedMessage()
 {
 
     // Clear the message because it's not yet decrypted
     traceSetID("fm", 0, 0);
+    wireReceivedPeerHandle = -1;
+    wireReceivedFields = MESSAGE_FIELDS_ALL;
+    wireReceivedCompact = false;
+    wireReceivedRelayed = false;
+    statsCount(STATS_RX);
+
+    // A frame heard with an implicit header can only be a compact ACK from our gateway
+    if (!appIsGateway && radioImplicitHeaderLen() != 0) {
+        uint8_t key[AES_KEY_BYTES];
+        bool success = flashConfigFindPeerByAddress(ourAddress, NULL, key, NULL) && wireCompactAckOpen(key, &wireReceived);
+        memcpy(key, invalidKey, sizeof(key));
+        if (!success) {
+            APP_PRINTF("%s can't decrypt received message\r\n", tracePeer());
+            statsCount(STATS_DECRYPT_FAILED);
+        }
+        return success;
+    }
+
+    // Our gateway may have acknowledged our window along with those of other sensors
+    if (!appIsGateway && RADIO_GROUP_ACK && wireReceivedCarrier.Version == MESSAGE_VERSION_GROUP_ACK) {
+        uint8_t key[AES_KEY_BYTES];
+        bool success = flashConfigFindPeerByAddress(ourAddress, NULL, key, NULL) && wireGroupAckOpen(key, &wireReceived);
+        memcpy(key, invalidKey, sizeof(key));
+        if (!success) {
+            APP_PRINTF("%s group ack not intended for us\r\n", tracePeer());
+            statsCount(STATS_NOT_FOR_US);
+        }
+        return success;
+    }
 
-    // Exit if not the right protocol version
-    if (wireReceivedCarrier.Version != MESSAGE_VERSION) {
+    // Expand a short-header frame into the full carrier, or exit if not the right protocol version
+    bool shortHeader = (wireReceivedCarrier.Version == MESSAGE_VERSION_SHORT);
+    if (shortHeader) {
+        if (!wireShortExpandCarrier()) {
+            APP_PRINTF("%s message not intended for us\r\n", tracePeer());
+            statsCount(STATS_NOT_FOR_US);
+            return false;
+        }
+    } else if (wireReceivedCarrier.Version != MESSAGE_VERSION) {
         APP_PRINTF("%s invalid protocol version\r\n", tracePeer());
         return false;
     }
 
-    // Exit if not intended for us
+    // A frame repeated by a relay is otherwise just as its sender sent it
+    if (!shortHeader && (wireReceivedCarrier.Algorithm & MESSAGE_ALG_RELAYED) != 0) {
+        wireReceivedCarrier.Algorithm &= ~MESSAGE_ALG_RELAYED;
+        wireReceivedRelayed = true;
+    }
+
+    // Gateways take note of what other gateways on the channel are saying
+    if (appIsGateway && wireReceivedCarrier.Algorithm == MESSAGE_ALG_CLEAR
+            && memcmp(ourAddress, wireReceivedCarrier.Sender, sizeof(ourAddress)) != 0
+            && wireReceivedCarrier.MessageLen <= sizeof(wireReceivedCarrier.Message)
+            && gatewayNeighborHeard()) {
+        return false;
+    }
+
+    // Exit if not intended for us, noting whether it's our gateway's broadcast to all sensors
+    bool broadcast = false;
     if (appIsGateway && ledIsPairInProgress() && memcmp(wildcardAddress, wireReceivedCarrier.Receiver, sizeof(ourAddress)) == 0) {
         APP_PRINTF("%s received pairing beacon\r\n", tracePeer());
-    }  else {
+    } else if (!appIsGateway && sensorHasBroadcastKey && wireReceivedCarrier.Algorithm == MESSAGE_ALG_CTR
+               && memcmp(wildcardAddress, wireReceivedCarrier.Receiver, sizeof(ourAddress)) == 0
+               && memcmp(gatewayAddress, wireReceivedCarrier.Sender, sizeof(gatewayAddress)) == 0) {
+        broadcast = true;
+    } else {
         if (memcmp(ourAddress, wireReceivedCarrier.Receiver, sizeof(ourAddress)) != 0) {
             APP_PRINTF("%s message not intended for us\r\n", tracePeer());
+            statsCount(STATS_NOT_FOR_US);
+            return false;
+        }
+    }
+
+    // The gateway takes relayed frames only from sensors that it has designated a relay for, and
+    // a sensor using its relay ignores the copies of the gateway's frames that reach it directly
+    if (appIsGateway && wireReceivedRelayed) {
+        if (!relayDesignatedFor(wireReceivedCarrier.Sender, NULL)) {
+            APP_PRINTF("%s relayed from a sensor without a relay\r\n", tracePeer());
+            statsCount(STATS_NOT_FOR_US);
             return false;
         }
+        relayReceivedSignal();
+    }
+    if (!appIsGateway && !broadcast && !wireReceivedRelayed && !ledIsPairInProgress() && relayVia() != NULL) {
+        APP_PRINTF("%s heard directly while using our relay\r\n", tracePeer());
+        return false;
     }
 
     // If it's cleartext, we're done
@@ -1698,16 +5498,27 @@ bool validateReceivedMessage()
         return true;
     }
 
-    // Exit if not a supported crypto version
-    if (wireReceivedCarrier.Algorithm != MESSAGE_ALG_CTR) {
+    // Exit if not a supported crypto version, short-header frames always being authenticated
+    if (wireReceivedCarrier.Algorithm != (shortHeader ? MESSAGE_ALG_CCM : MESSAGE_ALG_CTR) || (shortHeader && broadcast)) {
         APP_PRINTF("%s unsupported encryption type\r\n", tracePeer());
         return false;
     }
 
-    // Always use the sensor's key when decrypting
+    // Always use the sensor's key when decrypting, except for broadcasts
     uint8_t key[AES_KEY_BYTES];
     uint8_t *sensorAddress = appIsGateway ? wireReceivedCarrier.Sender : wireReceivedCarrier.Receiver;
-    if (!flashConfigFindPeerByAddress(sensorAddress, NULL, key, NULL)) {
+    bool found = true;
+    if (broadcast) {
+        memcpy(key, sensorBroadcastKey, sizeof(key));
+    } else {
+        PROF_BEGIN(lookupBegan);
+        if (wireReceivedPeerHandle < 0) {
+            wireReceivedPeerHandle = flashConfigFindPeerHandle(sensorAddress);
+        }
+        found = flashConfigPeerByHandle(wireReceivedPeerHandle, NULL, key, NULL);
+        PROF_END(lookupBegan, "peer lookup");
+    }
+    if (!found) {
         APP_PRINTF("%s can't find the sensor's key\r\n", tracePeer());
         return false;
     }
@@ -1725,65 +5536,175 @@ bool validateReceivedMessage()
     APP_PRINTF("\r\n");
 #endif
 
-    // Decrypt it
-    bool success = MX_AES_CTR_Decrypt(key, (uint8_t *)&wireReceivedCarrier.Message, wireReceivedCarrier.MessageLen, (uint8_t *)&wireReceived);
+    // Decrypt it, checking a short-header frame's tag before any of it is parsed
+    PROF_BEGIN(decryptBegan);
+    bool success;
+    if (shortHeader) {
+        static uint8_t plain[sizeof(wireMessage)];
+        uint16_t plainLen;
+        success = wireShortOpen(key, plain, &plainLen)
+                  && wireShortExpandMessage(plain, plainLen, &wireReceived);
+    } else {
+        success = MX_AES_CTR_Decrypt(key, (uint8_t *)&wireReceivedCarrier.Message, wireReceivedCarrier.MessageLen, (uint8_t *)&wireReceived);
+    }
+    PROF_END(decryptBegan, "decrypt");
     memcpy(key, invalidKey, sizeof(key));
     if (success && wireReceived.Signature != MESSAGE_SIGNATURE) {
         success = false;
     }
+    if (success && broadcast && (wireReceived.Flags & MESSAGE_FLAG_BROADCAST) == 0) {
+        success = false;
+    }
 
     // Fail if can't decrypt
     if (!success) {
         APP_PRINTF("%s can't decrypt received message\r\n", tracePeer());
+        statsCount(STATS_DECRYPT_FAILED);
         return false;
     }
 
+    // Reply to the sensor in whichever format it last used
+    if (appIsGateway) {
+        wireShortPeerHeard(wireReceivedPeerHandle, shortHeader);
+    }
+
     // Successful message reception
     return true;
 
 }
 
 // Use the request cache to re-compute the time window parameters, based on the
-// devices that we consider "active"
+// devices that we consider "active" and the airtime that each of them has been using
 void twRefresh()
 {
 
-    // Count the active sensors
-    uint32_t inactiveTime = NoteTimeST() - TW_ACTIVE_SECS;
+    // Close out the airtime measurement period.  A sensor's airtime only counts as measured
+    // once it has been tracked for a full period.
+    uint32_t now = appTime();
+    bool periodEnded = false;
+    if (twAirtimePeriodBegan == 0 || now < twAirtimePeriodBegan) {
+        twAirtimePeriodBegan = now;
+    }
+    if (now - twAirtimePeriodBegan >= TW_AIRTIME_PERIOD_SECS) {
+        for (int i=0; i<cachedSensors; i++) {
+            requestState *r = &requestCache[i];
+            if (r->airtimeTracked) {
+                r->airtimeAvgMs = r->airtimeMeasured ? ((r->airtimeAvgMs*3) + r->airtimeMs) / 4 : r->airtimeMs;
+                r->airtimeMeasured = true;
+            }
+            r->airtimeTracked = true;
+            r->airtimeMs = 0;
+        }
+        twAirtimePeriodBegan = now;
+        periodEnded = true;
+        twHeatFold();
+
+#if RADIO_DUTY_CYCLE
+        // Stretch the modulus when our own transmissions came close to the duty-cycle limit on any
+        // channel, so that sensors solicit fewer of them, and relax it as they fall well below it
+        uint32_t dutyPercent = 0;
+        for (uint8_t c=0; c<radioChannels(); c++) {
+            uint32_t percent = dutyUsedPercent(radioChannelFrequency(c));
+            if (percent > dutyPercent) {
+                dutyPercent = percent;
+            }
+        }
+        if (dutyPercent > RADIO_DUTY_TARGET_PERCENT) {
+            twDutyStretchPercent = (twDutyStretchPercent * dutyPercent) / RADIO_DUTY_TARGET_PERCENT;
+        } else if (dutyPercent < RADIO_DUTY_TARGET_PERCENT/2) {
+            twDutyStretchPercent = (twDutyStretchPercent * 3) / 4;
+        }
+        if (twDutyStretchPercent < 100) {
+            twDutyStretchPercent = 100;
+        }
+        if (twDutyStretchPercent > RADIO_DUTY_STRETCH_MAX) {
+            twDutyStretchPercent = RADIO_DUTY_STRETCH_MAX;
+        }
+        if (dutyPercent != 0) {
+            APP_PRINTF("%s duty cycle %d%% of allowance, modulus at %d%%\r\n", tracePeer(), dutyPercent, twDutyStretchPercent);
+        }
+#endif
+    }
+
+    // Count the active sensors and the slot time that they need
+    uint32_t inactiveTime = now - TW_ACTIVE_SECS;
     uint32_t activeSensors = 0;
+    uint32_t dedicatedUnits = 0;
+    uint32_t sharingSensors = 0;
     for (int i=0; i<cachedSensors; i++) {
-        if (memcmp(requestCache[i].sensorAddress, gatewayAddress, ADDRESS_LEN) == 0) {
+        if (requestCache[i].ours) {
             continue;
         }
         if (requestCache[i].lastReceivedTime < inactiveTime) {
             continue;
         }
         activeSensors++;
+        uint32_t units = twSlotUnits(&requestCache[i]);
+        if (units == 0) {
+            sharingSensors++;
+        }
+        dedicatedUnits += units;
     }
-
-    // Only reassign slots if we change active sensors
-    if (twLastActiveSensors == activeSensors) {
+    uint32_t sharedSlots = (sharingSensors + TW_SLOT_SHARED_SENSORS - 1) / TW_SLOT_SHARED_SENSORS;
+    uint32_t slotUnits = dedicatedUnits + sharedSlots;
+
+    // Slots are only left empty when the modulus is ours alone to lay out
+    uint32_t neighborUnits, precedingUnits;
+    bool hasNeighbors = gatewayNeighborLoad(&neighborUnits, &precedingUnits);
+    uint32_t avoidedSlots = hasNeighbors ? 0 : twAvoidMask;
+
+    // Only reassign slots if we change active sensors, if a new airtime measurement is in,
+    // or if neighboring gateways change theirs
+    if (!periodEnded && twLastActiveSensors == activeSensors && twLastSlotUnits == slotUnits
+            && twLastHadNeighbors == hasNeighbors
+            && twLastNeighborUnits == neighborUnits && twLastPrecedingUnits == precedingUnits
+            && twAvoidedSlots == avoidedSlots) {
         return;
     }
     twLastActiveSensors = activeSensors;
+    twLastSlotUnits = slotUnits;
+    twLastHadNeighbors = hasNeighbors;
+    twLastNeighborUnits = neighborUnits;
+    twLastPrecedingUnits = precedingUnits;
 
     // Force the database to be updated
-    APP_PRINTF("%s **** active sensors changed to %d ****\r\n", tracePeer(), activeSensors);
+    APP_PRINTF("%s **** active sensors changed to %d (%d sharing), using %d slots ****\r\n", tracePeer(),
+               activeSensors, sharingSensors, slotUnits);
     forceSensorRefresh = true;
+    gatewaySnapshotDirty = true;
 
     // Update active sensors and modulus, assigning a modulus offset to keep us from
-    // interfering with other local gateways
-    TWModulusSecs = activeSensors * twMinimumModulusSecs();
-    MX_RNG_Init();
-    TWModulusOffsetSecs = MX_RNG_Get() % 123;
-    MX_RNG_DeInit();
+    // interfering with other local gateways.  The slots stay where they are when the
+    // modulus is stretched for the duty cycle, leaving the remainder of it idle.  While
+    // slots are being avoided the offset is kept, so that they stay where the trouble is,
+    // and the modulus grows by the avoided slots that fall among ours.
+    twAvoidedSlots = avoidedSlots;
+    uint32_t placedUnits = (slotUnits == 0) ? 0 : (twSlotPlace((slotUnits-1) * twMinimumModulusSecs()) / twMinimumModulusSecs()) + 1;
+    TWModulusSecs = (placedUnits * twMinimumModulusSecs() * twDutyStretchPercent) / 100;
+    if (twAvoidedSlots == 0) {
+        TWModulusOffsetSecs = MY_Random() % 123;
+    }
+
+    // When we know of other gateways on the channel, share one modulus with them and
+    // take the run of slots following those of the gateways with lower addresses.
+    if (hasNeighbors) {
+        TWModulusSecs = (slotUnits + neighborUnits) * twMinimumModulusSecs();
+        TWModulusOffsetSecs = (uint16_t) (precedingUnits * twMinimumModulusSecs());
+        APP_PRINTF("%s sharing %ds window with neighbors at offset %ds\r\n", tracePeer(), TWModulusSecs, TWModulusOffsetSecs);
+    }
     TWListenBeforeTalkMs = TW_LBT_PERIOD_MS;
+    gatewayBroadcastPending = true;
 
-    // Re-assign slots to active sensors
+    // Re-assign slots to active sensors, with those needing a slot of their own first
+    // and the sensors that share slots following them.
     uint32_t slotBeginsSecs = 0;
+    uint32_t sharedBeginsSecs = dedicatedUnits * twMinimumModulusSecs();
+    uint32_t sharedSensor = 0;
     for (int i=0; i<cachedSensors; i++) {
         requestCache[i].twSlotBeginsSecs = 0;
-        if (memcmp(requestCache[i].sensorAddress, gatewayAddress, ADDRESS_LEN) == 0) {
+        requestCache[i].twSlotEndsSecs = 0;
+        requestCache[i].twSlotChannel = 0;
+        if (requestCache[i].ours) {
             continue;
         }
         if (requestCache[i].lastReceivedTime < inactiveTime) {
@@ -1791,17 +5712,548 @@ void twRefresh()
         }
 
         // Update the slot
-        requestCache[i].twSlotBeginsSecs = slotBeginsSecs;
-        requestCache[i].twSlotEndsSecs = slotBeginsSecs + twMinimumModulusSecs();
-        slotBeginsSecs += twMinimumModulusSecs();
+        uint32_t beginsSecs, endsSecs;
+        requestCache[i].twSlotChannel = twSlotAssign(twSlotUnits(&requestCache[i]), &slotBeginsSecs, sharedBeginsSecs, &sharedSensor, &beginsSecs, &endsSecs);
+        if (twAvoidedSlots != 0) {
+            endsSecs = twSlotPlace(endsSecs - twMinimumModulusSecs()) + twMinimumModulusSecs();
+            beginsSecs = twSlotPlace(beginsSecs);
+            requestCache[i].twSlotChannel = radioSlotChannel(beginsSecs / twMinimumModulusSecs());
+        }
+        if (relayDesignatedFor(requestCache[i].sensorAddress, NULL)) {
+            requestCache[i].twSlotChannel = 0;      // Where its relay listens
+        }
+        requestCache[i].twSlotBeginsSecs = beginsSecs;
+        requestCache[i].twSlotEndsSecs = endsSecs;
 
         // Display the slot assignment
         char msg[40];
         utilAddressToText(requestCache[i].sensorAddress, msg, sizeof(msg));
-        APP_PRINTF("%s %s assigned slot %d-%d\r\n", tracePeer(), msg, requestCache[i].twSlotBeginsSecs, requestCache[i].twSlotEndsSecs);
+        APP_PRINTF("%s %s assigned slot %d-%d channel %d (airtime %dms)\r\n", tracePeer(), msg,
+                   requestCache[i].twSlotBeginsSecs, requestCache[i].twSlotEndsSecs, requestCache[i].twSlotChannel,
+                   requestCache[i].airtimeAvgMs);
+
+    }
+
+}
+
+// Assign the next slot of the given number of units, where dedicated slots are taken in
+// turn from slotBeginsSecs and sensors needing no units share the slots that follow them
+// from sharedBeginsSecs.  Returns the slot's channel.
+uint8_t twSlotAssign(uint32_t units, uint32_t *slotBeginsSecs, uint32_t sharedBeginsSecs, uint32_t *sharedSensor, uint32_t *beginsSecs, uint32_t *endsSecs)
+{
+    uint32_t slotSecs = twMinimumModulusSecs();
+    if (units == 0) {
+        *beginsSecs = sharedBeginsSecs + (((*sharedSensor)++ / TW_SLOT_SHARED_SENSORS) * slotSecs);
+        *endsSecs = *beginsSecs + slotSecs;
+    } else {
+        *beginsSecs = *slotBeginsSecs;
+        *endsSecs = *slotBeginsSecs + (units * slotSecs);
+        *slotBeginsSecs += units * slotSecs;
+    }
+    return radioSlotChannel(*beginsSecs / slotSecs);
+}
+
+// On the gateway, count receive trouble (an error, a frame that we couldn't use, a resync or
+// a busy channel) heard the given number of seconds ago against the slot that it fell in
+void twHeatCount(uint32_t agoSecs)
+{
+    if (!appIsGateway || !appTimeValid() || TWModulusSecs == 0) {
+        return;
+    }
+    uint32_t windowRelativeSecs = ((appTime() - agoSecs) - TWModulusOffsetSecs) % TWModulusSecs;
+    uint32_t slot = windowRelativeSecs / twMinimumModulusSecs();
+    if (slot < TW_HEAT_SLOTS && twHeatEvents[slot] != 0xFFFF) {
+        twHeatEvents[slot]++;
+    }
+}
+
+// Fold the trouble counted in each slot over the period just ended into its average, and
+// choose the slots to avoid, which are the hottest of those whose trouble has become chronic.
+// An avoided slot stays avoided until its trouble has fallen well below that, because with
+// nobody in it what's still heard there comes from outside our network.
+void twHeatFold()
+{
+    uint32_t modulusSlots = (TWModulusSecs == 0) ? 0 : TWModulusSecs / twMinimumModulusSecs();
+    for (uint32_t i=0; i<TW_HEAT_SLOTS; i++) {
+        twHeatAvg[i] = (uint16_t) ((((uint32_t) twHeatAvg[i] * 3) + twHeatEvents[i]) / 4);
+        twHeatEvents[i] = 0;
+    }
+    uint32_t mask = 0;
+    for (uint32_t n=0; n<TW_HEAT_AVOID_MAX; n++) {
+        int hottest = -1;
+        for (uint32_t i=0; i<TW_HEAT_SLOTS && i<modulusSlots; i++) {
+            uint32_t threshold = ((twAvoidMask & (1U << i)) != 0) ? TW_HEAT_CHRONIC_EVENTS/2 : TW_HEAT_CHRONIC_EVENTS;
+            if ((mask & (1U << i)) == 0 && twHeatAvg[i] >= threshold && twHeatAvg[i] > 0
+                    && (hottest < 0 || twHeatAvg[i] > twHeatAvg[hottest])) {
+                hottest = (int) i;
+            }
+        }
+        if (hottest < 0) {
+            break;
+        }
+        mask |= (1U << hottest);
+    }
+    if (mask != twAvoidMask) {
+        for (uint32_t i=0; i<TW_HEAT_SLOTS && i<modulusSlots; i++) {
+            if (((mask ^ twAvoidMask) & (1U << i)) != 0) {
+                APP_PRINTF("%s slot %d %s (%d rx troubles per period)\r\n", tracePeer(), i,
+                           ((mask & (1U << i)) != 0) ? "avoided" : "no longer avoided", twHeatAvg[i]);
+            }
+        }
+        twAvoidMask = mask;
+    }
+}
+
+// Get where within the modulus a slot laid out as though none were avoided actually begins,
+// which is past however many of the avoided slots precede it.  A longer slot is placed by its
+// first and last parts, and so still covers an avoided slot that it straddles.
+uint32_t twSlotPlace(uint32_t logicalSecs)
+{
+    uint32_t slotSecs = twMinimumModulusSecs();
+    uint32_t logical = logicalSecs / slotSecs;
+    uint32_t slot = 0;
+    for (;;) {
+        if (slot >= TW_HEAT_SLOTS || (twAvoidedSlots & (1U << slot)) == 0) {
+            if (logical-- == 0) {
+                break;
+            }
+        }
+        slot++;
+    }
+    return (slot * slotSecs) + (logicalSecs % slotSecs);
+}
+
+// Compute how many minimum-length slots a sensor needs, based upon its measured airtime,
+// with 0 meaning that its use is light enough for it to share a slot with others.  A sensor
+// with a relay has a slot of its own, which is on the home channel where its relay listens.
+uint32_t twSlotUnits(requestState *request)
+{
+    uint32_t units = twSlotUnitsForAirtime(request->airtimeMeasured, request->airtimeAvgMs);
+    if (units == 0 && relayDesignatedFor(request->sensorAddress, NULL)) {
+        units = 1;
+    }
+    return units;
+}
+
+// Compute the slot units needed for a measured airtime per period
+uint32_t twSlotUnitsForAirtime(bool measured, uint32_t airtimeAvgMs)
+{
+    if (!measured) {
+        return 1;
+    }
+    if (airtimeAvgMs < TW_AIRTIME_LIGHT_MS) {
+        return 0;
+    }
+    uint32_t units = 1 + (airtimeAvgMs / TW_AIRTIME_HEAVY_MS);
+    return (units > TW_SLOT_MAX_UNITS) ? TW_SLOT_MAX_UNITS : units;
+}
+
+// Choose the channel for a sensor transmission that is beginning now.  The gateway only
+// listens on our assigned channel during our own slot, so anything else uses the home channel.
+uint8_t twSensorTransmitChannel()
+{
+    if (twSlotChannel == 0 || !appTimeValid() || TWModulusSecs == 0) {
+        return 0;
+    }
+    uint32_t edgeSecs;
+    if (twUrgentWindow(TWUrgentPeriodSecs, TWUrgentSecs, &edgeSecs)) {
+        return 0;
+    }
+    uint32_t windowRelativeSecs = (appTime() - TWModulusOffsetSecs) % TWModulusSecs;
+    if (windowRelativeSecs < TWSlotBeginsSecs || windowRelativeSecs >= TWSlotEndsSecs) {
+        return 0;
+    }
+    return twSlotChannel;
+}
+
+// Choose the channel on which the gateway listens while idle, which is that of the sensor
+// owning the current slot, along with how long to listen before the next slot begins.  We
+// stay on the home channel whenever pairing or when there is no plan to follow.
+uint8_t twGatewayListenChannel(uint32_t *listenMs)
+{
+    *listenMs = UNSOLICITED_RX_TIMEOUT_VALUE;
+    if (radioChannels() <= 1 || ledIsPairInProgress() || !appTimeValid() || TWModulusSecs == 0) {
+        return 0;
+    }
+    uint32_t slotSecs = twMinimumModulusSecs();
+    uint32_t windowRelativeSecs = (appTime() - TWModulusOffsetSecs) % TWModulusSecs;
+    uint32_t slotEndsSecs = ((windowRelativeSecs / slotSecs) + 1) * slotSecs;
+    *listenMs = (slotEndsSecs - windowRelativeSecs) * 1000;
+    uint32_t edgeSecs;
+    bool urgent = twUrgentWindow(TW_URGENT_PERIOD_SECS, TW_URGENT_SECS, &edgeSecs);
+    if (edgeSecs != 0xFFFFFFFFU && edgeSecs*1000 < *listenMs) {
+        *listenMs = edgeSecs*1000;
+    }
+    if (urgent) {
+        return 0;
+    }
+    for (int i=0; i<cachedSensors; i++) {
+        if (windowRelativeSecs >= requestCache[i].twSlotBeginsSecs && windowRelativeSecs < requestCache[i].twSlotEndsSecs) {
+            return requestCache[i].twSlotChannel;
+        }
+    }
+    return 0;
+}
+
+// See whether we're now within one of the gateway's urgent windows, which open at the start of
+// every period relative to the modulus offset, along with how long it is until this one ends
+// or the next one begins
+bool twUrgentWindow(uint32_t periodSecs, uint32_t windowSecs, uint32_t *edgeSecs)
+{
+    *edgeSecs = 0xFFFFFFFFU;
+    if (periodSecs == 0 || windowSecs == 0 || windowSecs >= periodSecs || !appTimeValid()) {
+        return false;
+    }
+    uint32_t periodRelativeSecs = (appTime() - TWModulusOffsetSecs) % periodSecs;
+    if (periodRelativeSecs < windowSecs) {
+        *edgeSecs = windowSecs - periodRelativeSecs;
+        return true;
+    }
+    *edgeSecs = periodSecs - periodRelativeSecs;
+    return false;
+}
+
+// Compute how long until an urgent request should be sent, at a random moment within the
+// first half of the gateway's current or next urgent window, which becomes the slot that we
+// track.  0xFFFFFFFF is returned if the gateway has no urgent windows.
+uint32_t appNextUrgentWindowDueMs()
+{
+    uint32_t edgeSecs;
+    bool within = twUrgentWindow(TWUrgentPeriodSecs, TWUrgentSecs, &edgeSecs);
+    if (edgeSecs == 0xFFFFFFFFU) {
+        return 0xFFFFFFFFU;
+    }
+    uint32_t beginsSecs = 0;
+    uint32_t lastsSecs = edgeSecs;
+    if (!within) {
+        beginsSecs = edgeSecs;
+        lastsSecs = TWUrgentSecs;
+    } else if (edgeSecs*2 < TWUrgentSecs) {
+        beginsSecs = edgeSecs + (TWUrgentPeriodSecs - TWUrgentSecs);
+        lastsSecs = TWUrgentSecs;
+    }
+    twSlotBeginsTime = appTime() + beginsSecs;
+    twSlotExpiresTime = twSlotBeginsTime + lastsSecs;
+    twSlotExpiresTimeWasValid = false;
+    return (beginsSecs*1000) + (MY_Random() % (((lastsSecs*1000)/2) + 1));
+}
+
+// Compute the home slot of a sensor address within the request cache index
+uint32_t requestCacheHashSlot(uint8_t *address)
+{
+    return utilHashAddress(address) & (REQUEST_CACHE_HASH_SLOTS-1);
+}
+
+// Add a request cache entry to the index, using linear probing
+void requestCacheHashInsert(uint16_t entry)
+{
+    uint32_t slot = requestCacheHashSlot(requestCache[entry-1].sensorAddress);
+    while (requestCacheHash[slot] != 0) {
+        slot = (slot+1) & (REQUEST_CACHE_HASH_SLOTS-1);
+    }
+    requestCacheHash[slot] = entry;
+}
+
+// Remove a request cache entry from the index, shifting back any entries that had
+// probed past it so that lookups never need tombstones.
+void requestCacheHashRemove(uint16_t entry)
+{
+
+    // Find the slot holding the entry
+    uint32_t hole = requestCacheHashSlot(requestCache[entry-1].sensorAddress);
+    for (uint32_t probes=0; requestCacheHash[hole] != entry; probes++) {
+        if (requestCacheHash[hole] == 0 || probes >= REQUEST_CACHE_HASH_SLOTS) {
+            return;
+        }
+        hole = (hole+1) & (REQUEST_CACHE_HASH_SLOTS-1);
+    }
+    requestCacheHash[hole] = 0;
+
+    // Move back any entry in the run that cannot be found now that there is a hole
+    uint32_t slot = hole;
+    while (true) {
+        slot = (slot+1) & (REQUEST_CACHE_HASH_SLOTS-1);
+        if (requestCacheHash[slot] == 0) {
+            return;
+        }
+        uint32_t home = requestCacheHashSlot(requestCache[requestCacheHash[slot]-1].sensorAddress);
+        bool reachable = (hole <= slot) ? (hole < home && home <= slot) : (hole < home || home <= slot);
+        if (!reachable) {
+            requestCacheHash[hole] = requestCacheHash[slot];
+            requestCacheHash[slot] = 0;
+            hole = slot;
+        }
+    }
+
+}
+
+// Remove a request cache entry from the LRU list
+void requestCacheLRUUnlink(uint16_t entry)
+{
+    requestState *request = &requestCache[entry-1];
+    if (request->lruPrev != 0) {
+        requestCache[request->lruPrev-1].lruNext = request->lruNext;
+    } else if (requestCacheLRUHead == entry) {
+        requestCacheLRUHead = request->lruNext;
+    }
+    if (request->lruNext != 0) {
+        requestCache[request->lruNext-1].lruPrev = request->lruPrev;
+    } else if (requestCacheLRUTail == entry) {
+        requestCacheLRUTail = request->lruPrev;
+    }
+    request->lruPrev = 0;
+    request->lruNext = 0;
+}
+
+// Make a request cache entry the most recently used
+void requestCacheLRUPushHead(uint16_t entry)
+{
+    requestState *request = &requestCache[entry-1];
+    request->lruPrev = 0;
+    request->lruNext = requestCacheLRUHead;
+    if (requestCacheLRUHead != 0) {
+        requestCache[requestCacheLRUHead-1].lruPrev = entry;
+    }
+    requestCacheLRUHead = entry;
+    if (requestCacheLRUTail == 0) {
+        requestCacheLRUTail = entry;
+    }
+}
+
+// Find the cache entry for a sensor, making it the most recently used.  If the sensor
+// isn't yet cached a new entry is created, evicting the least recently used entry
+// if the cache is full.
+requestState *requestCacheLookup(uint8_t *address, bool *created)
+{
+
+    // Look it up in the index
+    *created = false;
+    uint32_t slot = requestCacheHashSlot(address);
+    for (uint32_t probes=0; requestCacheHash[slot] != 0 && probes < REQUEST_CACHE_HASH_SLOTS; probes++) {
+        uint16_t entry = requestCacheHash[slot];
+        if (memcmp(requestCache[entry-1].sensorAddress, address, ADDRESS_LEN) == 0) {
+            if (requestCacheLRUHead != entry) {
+                requestCacheLRUUnlink(entry);
+                requestCacheLRUPushHead(entry);
+            }
+            return &requestCache[entry-1];
+        }
+        slot = (slot+1) & (REQUEST_CACHE_HASH_SLOTS-1);
+    }
+
+    // Allocate a new entry, or recycle the least recently used one, sparing those of sensors
+    // that are due shortly and, where possible, those whose stats haven't yet reached sensors.db
+    uint16_t entry;
+    if (cachedSensors < MAX_CACHED_SENSORS) {
+        entry = ++cachedSensors;
+    } else {
+        entry = 0;
+        uint16_t dirtyEntry = 0;
+        for (uint16_t e = requestCacheLRUTail; e != 0; e = requestCache[e-1].lruPrev) {
+            if (gatewayCalendarDueSoon(&requestCache[e-1])) {
+                continue;
+            }
+            if (!requestCache[e-1].dbDirty) {
+                entry = e;
+                break;
+            }
+            if (dirtyEntry == 0) {
+                dirtyEntry = e;
+            }
+        }
+        if (entry == 0) {
+            entry = (dirtyEntry != 0) ? dirtyEntry : requestCacheLRUTail;
+        }
+        requestCacheLRUUnlink(entry);
+        requestCacheHashRemove(entry);
+        requestCacheSetPeer(&requestCache[entry-1], -1);
+        if (requestCache[entry-1].data != NULL) {
+            memset(requestCache[entry-1].data, '?', requestCache[entry-1].dataTotalLen);
+            poolFree(requestCache[entry-1].data);
+        }
+    }
+    requestState *request = &requestCache[entry-1];
+    memset(request, 0, sizeof(requestState));
+    memcpy(request->sensorAddress, address, ADDRESS_LEN);
+    request->peerHandle = -1;
+    request->ours = (memcmp(address, gatewayAddress, ADDRESS_LEN) == 0);
+    requestCacheHashInsert(entry);
+    requestCacheLRUPushHead(entry);
+    *created = true;
+    return request;
+
+}
+
+// Find the cache entry for a sensor without disturbing the order in which sensors were heard,
+// returning NULL if it isn't cached
+requestState *requestCacheFind(uint8_t *address)
+{
+    uint32_t slot = requestCacheHashSlot(address);
+    for (uint32_t probes=0; requestCacheHash[slot] != 0 && probes < REQUEST_CACHE_HASH_SLOTS; probes++) {
+        uint16_t entry = requestCacheHash[slot];
+        if (memcmp(requestCache[entry-1].sensorAddress, address, ADDRESS_LEN) == 0) {
+            return &requestCache[entry-1];
+        }
+        slot = (slot+1) & (REQUEST_CACHE_HASH_SLOTS-1);
+    }
+    return NULL;
+}
+
+// Find the cache entry for a sensor whose peer handle is known, just as requestCacheLookup()
+// does, but by index rather than by searching for its address
+requestState *requestCacheLookupPeer(int handle, uint8_t *address, bool *created)
+{
+    if (handle >= 0 && (uint32_t) handle < MAX_PEER_HANDLES && requestCacheByPeer[handle] != 0) {
+        uint16_t entry = requestCacheByPeer[handle];
+        if (requestCache[entry-1].peerHandle == handle) {
+            *created = false;
+            if (requestCacheLRUHead != entry) {
+                requestCacheLRUUnlink(entry);
+                requestCacheLRUPushHead(entry);
+            }
+            return &requestCache[entry-1];
+        }
+    }
+    requestState *request = requestCacheLookup(address, created);
+    if (request->peerHandle < 0) {
+        requestCacheSetPeer(request, handle);
+    }
+    return request;
+}
+
+// Set the peer handle of a request cache entry, indexing the entry by it
+void requestCacheSetPeer(requestState *request, int handle)
+{
+    uint16_t entry = (uint16_t) ((request - requestCache) + 1);
+    if (request->peerHandle >= 0 && (uint32_t) request->peerHandle < MAX_PEER_HANDLES
+            && requestCacheByPeer[request->peerHandle] == entry) {
+        requestCacheByPeer[request->peerHandle] = 0;
+    }
+    request->peerHandle = handle;
+    if (handle >= 0 && (uint32_t) handle < MAX_PEER_HANDLES) {
+        requestCacheByPeer[handle] = entry;
+    }
+}
+
+// Get the most recently used request cache entry, or NULL if there is none
+requestState *requestCacheMRU()
+{
+    if (requestCacheLRUHead == 0) {
+        return NULL;
+    }
+    return &requestCache[requestCacheLRUHead-1];
+}
+
+// See whether it's time for the periodic snapshot of the request cache
+bool appGatewaySnapshotDue()
+{
+    return (GATEWAY_SNAPSHOT_MINS && gatewaySnapshotDirty
+            && TIMER_IF_GetTimeMs() >= gatewaySnapshotMs + (GATEWAY_SNAPSHOT_MINS*60*1000));
+}
+
+// Write a snapshot of the request cache and the slot plan to flash, returning true if success
+bool appGatewaySnapshotSave()
+{
+    if (!appIsGateway) {
+        return false;
+    }
+    gatewaySnapshotDirty = false;
+    gatewaySnapshotMs = TIMER_IF_GetTimeMs();
+
+    gatewaySnapshotHeader header = {0};
+    header.version = GATEWAY_SNAPSHOT_VERSION;
+    header.recordLen = sizeof(gatewaySnapshotRecord);
+    header.records = cachedSensors;
+    header.modulusOffsetSecs = TWModulusOffsetSecs;
+    header.modulusSecs = TWModulusSecs;
+    header.dutyStretchPercent = twDutyStretchPercent;
+    header.airtimePeriodBegan = twAirtimePeriodBegan;
+    header.lastActiveSensors = twLastActiveSensors;
+    header.lastSlotUnits = twLastSlotUnits;
+    header.lastNeighborUnits = twLastNeighborUnits;
+    header.lastPrecedingUnits = twLastPrecedingUnits;
+    header.lastHadNeighbors = twLastHadNeighbors;
+    bool success = flashSnapshotBegin() && flashSnapshotAppend(&header, sizeof(header));
+
+    // Least recently used first, so that restoring them in order rebuilds the LRU list
+    for (uint16_t entry = requestCacheLRUTail; success && entry != 0; entry = requestCache[entry-1].lruPrev) {
+        requestState *request = &requestCache[entry-1];
+        gatewaySnapshotRecord record = {0};
+        memcpy(record.sensorAddress, request->sensorAddress, ADDRESS_LEN);
+        record.lastReceivedTime = request->lastReceivedTime;
+        memcpy(record.recentRequestIDs, request->recentRequestIDs, sizeof(record.recentRequestIDs));
+        record.requestsProcessed = request->requestsProcessed;
+        record.requestsLost = request->requestsLost;
+        record.airtimeAvgMs = request->airtimeAvgMs;
+        record.twSlotBeginsSecs = request->twSlotBeginsSecs;
+        record.twSlotEndsSecs = request->twSlotEndsSecs;
+        record.twSlotChannel = request->twSlotChannel;
+        record.flags = (request->airtimeMeasured ? GATEWAY_SNAPSHOT_MEASURED : 0)
+                       | (request->dbDirty ? GATEWAY_SNAPSHOT_DB_DIRTY : 0);
+        record.gatewayRSSI = request->gatewayRSSI;
+        record.gatewaySNR = request->gatewaySNR;
+        success = flashSnapshotAppend(&record, sizeof(record));
+    }
+    success = success && flashSnapshotEnd();
+
+    APP_PRINTF("%s request cache snapshot of %d sensors %s\r\n", tracePeer(), cachedSensors, success ? "saved" : "FAILED");
+    return success;
+}
+
+// Restore the request cache and the slot plan from the snapshot last written to flash, so that
+// sensors find their slots where they were and their retried requests are recognized
+void appGatewaySnapshotRestore()
+{
+    uint32_t len;
+    uint8_t *snapshot = flashSnapshot(&len);
+    if (snapshot == NULL) {
+        return;
+    }
+    gatewaySnapshotHeader header;
+    if (len < sizeof(header)) {
+        return;
+    }
+    memcpy(&header, snapshot, sizeof(header));
+    if (header.version != GATEWAY_SNAPSHOT_VERSION || header.recordLen != sizeof(gatewaySnapshotRecord)
+            || len < sizeof(header) + (header.records * sizeof(gatewaySnapshotRecord))) {
+        APP_PRINTF("%s request cache snapshot ignored\r\n", tracePeer());
+        return;
+    }
 
+    for (uint32_t i=0; i<header.records; i++) {
+        gatewaySnapshotRecord record;
+        memcpy(&record, &snapshot[sizeof(header) + (i * sizeof(record))], sizeof(record));
+        bool created;
+        requestState *request = requestCacheLookup(record.sensorAddress, &created);
+        request->lastReceivedTime = record.lastReceivedTime;
+        memcpy(request->recentRequestIDs, record.recentRequestIDs, sizeof(request->recentRequestIDs));
+        request->lastProcessedRequestID = record.recentRequestIDs[0];
+        request->lastProcessedRequestIDForAck = (GATEWAY_RECENT_REQUESTS > 1) ? record.recentRequestIDs[1] : 0;
+        request->requestsProcessed = record.requestsProcessed;
+        request->requestsLost = record.requestsLost;
+        request->airtimeAvgMs = record.airtimeAvgMs;
+        request->airtimeMeasured = (record.flags & GATEWAY_SNAPSHOT_MEASURED) != 0;
+        request->dbDirty = (record.flags & GATEWAY_SNAPSHOT_DB_DIRTY) != 0;
+        request->twSlotBeginsSecs = record.twSlotBeginsSecs;
+        request->twSlotEndsSecs = record.twSlotEndsSecs;
+        request->twSlotChannel = record.twSlotChannel;
+        request->gatewayRSSI = record.gatewayRSSI;
+        request->gatewaySNR = record.gatewaySNR;
     }
 
+    // Take up the slot plan as it was, so that twRefresh() only replans if something changes
+    TWModulusSecs = header.modulusSecs;
+    TWModulusOffsetSecs = header.modulusOffsetSecs;
+    TWListenBeforeTalkMs = TW_LBT_PERIOD_MS;
+    twDutyStretchPercent = header.dutyStretchPercent;
+    twAirtimePeriodBegan = header.airtimePeriodBegan;
+    twLastActiveSensors = header.lastActiveSensors;
+    twLastSlotUnits = header.lastSlotUnits;
+    twLastNeighborUnits = header.lastNeighborUnits;
+    twLastPrecedingUnits = header.lastPrecedingUnits;
+    twLastHadNeighbors = (header.lastHadNeighbors != 0);
+    gatewaySnapshotMs = TIMER_IF_GetTimeMs();
+    APP_PRINTF("%s request cache restored from snapshot: %d sensors, %ds modulus\r\n", tracePeer(), cachedSensors, TWModulusSecs);
 }
 
 // Clear request info in a cache entry
@@ -1809,6 +6261,27 @@ void appSensorCacheEntryResetStats(uint32_t index)
 {
     requestCache[index].requestsProcessed = 0;
     requestCache[index].requestsLost = 0;
+    memset(&requestCache[index].latency, 0, sizeof(requestCache[index].latency));
+    requestCache[index].dbDirty = false;
+}
+
+// Get the percentiles of a sensor's request latency since its stats were last reset,
+// returning false if none has been measured
+bool appSensorCacheEntryLatency(uint32_t index, uint32_t *p50Ms, uint32_t *p90Ms, uint32_t *maxMs)
+{
+    if (index >= cachedSensors || statsLatencyCount(&requestCache[index].latency) == 0) {
+        return false;
+    }
+    *p50Ms = statsLatencyPercentileMs(&requestCache[index].latency, 50);
+    *p90Ms = statsLatencyPercentileMs(&requestCache[index].latency, 90);
+    *maxMs = statsLatencyMaxMs(&requestCache[index].latency);
+    return true;
+}
+
+// See whether a sensor cache entry's stats have changed since they were written to the db
+bool appSensorCacheEntryDirty(uint32_t index)
+{
+    return (index < cachedSensors && requestCache[index].dbDirty);
 }
 
 // Get info about a sensor cache entry
@@ -1826,7 +6299,7 @@ bool appSensorCacheEntry(uint32_t i, uint8_t *address,
     }
 
     // Skim off entries that should be ignored
-    if (memcmp(requestCache[i].sensorAddress, gatewayAddress, ADDRESS_LEN) == 0) {
+    if (requestCache[i].ours) {
         return false;
     }
 
@@ -1913,13 +6386,13 @@ bool appProcessButton()
 void appSendLoRaPacketSizeTestPing()
 {
     static int nextBodySize = TRANSMIT_SIZE_TEST_BEGIN;
-    uint8_t *testmsg = malloc(nextBodySize);
+    uint8_t *testmsg = poolAlloc(nextBodySize);
     if (testmsg != NULL) {
         APP_PRINTF("%s TRANSMIT_SIZE_TEST (%d)\r\n", tracePeer(), nextBodySize);
         memset(testmsg, '?', nextBodySize);
         sensorIgnoreTimeWindow();
         sensorSendToGateway(false, testmsg, nextBodySize);
-        free(testmsg);
+        poolFree(testmsg);
         nextBodySize -= TRANSMIT_SIZE_TEST_DECREMENT;
         if (nextBodySize <= 0) {
             nextBodySize = 0;
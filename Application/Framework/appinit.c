@@ -8,7 +8,9 @@
 #include "framework.h"
 
 // App Role
+#if SPARROW_ROLE == SPARROW_ROLE_ANY
 bool appIsGateway = false;
+#endif
 int64_t appBootMs = 0;
 uint32_t gatewayBootTime = 0;
 bool buttonHeldAtBoot = false;
@@ -16,8 +18,16 @@ bool buttonHeldAtBoot = false;
 // Which SKU we're configured for
 uint32_t SKU = SKU_UNKNOWN;
 
+// Hardware inventory, as probed at boot or as recorded by a previous boot
+static uint32_t inventorySKU = SKU_UNKNOWN;
+static uint32_t hardwareProbed = 0;
+static uint32_t hardwarePresent = 0;
+static bool inventoryChanged = false;
+
 // Forwards
 void registerApp(void);
+void appInventoryLoad(void);
+void appInventorySave(void);
 const char *ioInit(void);
 void unpack32(uint8_t *p, uint32_t value);
 
@@ -31,6 +41,11 @@ const char *appFirmwareVersion()
 void MX_AppMain(void)
 {
 
+#if PROFILER_ON
+    // Start the profiler's cycle counter
+    profInit();
+#endif
+
     // Initialize GPIOs
     const char *rfsel = ioInit();
 
@@ -54,8 +69,15 @@ void MX_AppMain(void)
     // Remember the time when we were booted
     appBootMs = TIMER_IF_GetTimeMs();
 
-    // Initialize the Notecard
+    // Initialize the Notecard, whose presence decides our role unless the image was built
+    // for just one
+#if SPARROW_ROLE == SPARROW_ROLE_ANY
     appIsGateway = noteInit();
+#else
+    if (noteInit() != appIsGateway) {
+        APP_PRINTF(appIsGateway ? "NOTECARD NOT FOUND BY GATEWAY IMAGE\r\n" : "NOTECARD IGNORED BY SENSOR IMAGE\r\n");
+    }
+#endif
 
     // Conditionally enable or disable trace
     if (appIsGateway) {
@@ -77,40 +99,28 @@ void MX_AppMain(void)
         flashDFUInit();
     }
 
-    // Send setup parameters to the Notecard and load config
+    // Use the default env vars until they're loaded.  Sending our setup parameters to the
+    // Notecard and waiting for it to know the time are finished by the gateway's housekeeping
+    // once the radio is up, so that sensors are served from the moment that we boot.
     if (appIsGateway) {
-        noteSetup();
+        dfuLoraGatewayInit();
+        noteHubGatewayInit();
+        uplinkInit();
         gatewaySetEnvVarDefaults();
-    }
-
-    // Blink LED until the time is available, because the sensors depend
-    // upon the fact thst the gateway knows what time it is.
-    if (appIsGateway) {
-        APP_PRINTF("Waiting for time from Notecard\r\n");
-        ledReset();
-        while ( !NoteTimeValidST() || !gatewayEnvVarsLoaded() ) {
-            if (ledButtonCheck() == BUTTON_HELD) {
-                flashConfigFactoryReset();
-            }
-            ledWalk();
-            HAL_Delay(750);
-        }
-        APP_PRINTF("Waiting up to 30 sec for time zone from Notecard\r\n");
-        for (int i=0; i<60 && !NoteRegion(NULL, NULL, NULL, NULL); i++) {
-            ledWalk();
-            HAL_Delay(500);
-        }
-        gatewayBootTime = NoteTimeST();
-        APP_PRINTF("Time: %d\r\n", gatewayBootTime);
+        gatewayCmdRegister();
     }
     ledReset();
 
     // Initialize the radio
     radioInit();
+    radioShowAirtime();
 
-    // Load configuration from flash and start the main task
+    // Load configuration from flash and start the main task, which probes for
+    // any hardware that isn't in the inventory
     flashConfigLoad();
+    appInventoryLoad();
     registerApp();
+    appInventorySave();
 
     // Loop, processing tasks registered with the sequencer
     while (true) {
@@ -128,6 +138,7 @@ void MX_AppISR(uint16_t GPIO_Pin)
         appTraceWakeup();
         return;
     }
+    LATENCY_EDGE(GPIO_Pin);
 
     // Do special processing of button pin, because we
     // do checking for HOLD and other things.  Once
@@ -135,16 +146,18 @@ void MX_AppISR(uint16_t GPIO_Pin)
     // send the interrupt to sensors through a
     // different but compatible path.
     if ((GPIO_Pin & BUTTON1_Pin) != 0) {
-        appButtonWakeup();
+        ledButtonEdge();
         GPIO_Pin &= ~BUTTON1_Pin;
         if (GPIO_Pin == 0) {
             return;
         }
     }
 
-    // Dispatch the interrupts to all sensors
+    // Dispatch the interrupts to all sensors, or to the gateway
     if (!appIsGateway) {
         schedDispatchISR(GPIO_Pin);
+    } else {
+        gatewayInterrupt(GPIO_Pin);
     }
 
 }
@@ -311,15 +324,20 @@ void registerApp(void)
         if (!flashConfigFindPeerByType(PEER_TYPE_GATEWAY, gatewayAddress, NULL, NULL)) {
             memcpy(gatewayAddress, invalidAddress, sizeof(gatewayAddress));
         }
+        relayInit();
     }
 
     // Initialize the primary task
     if (appIsGateway) {
         appGatewayInit();
         UTIL_SEQ_RegTask((1 << CFG_SEQ_Task_Sparrow_Process), UTIL_SEQ_RFU, appGatewayProcess);
+        UTIL_SEQ_RegTask((1 << CFG_SEQ_Task_Sparrow_Event), UTIL_SEQ_RFU, appGatewayEvents);
+        UTIL_SEQ_RegTask((1 << CFG_SEQ_Task_Notecard_Process), UTIL_SEQ_RFU, appGatewayNotecardProcess);
+        UTIL_SEQ_RegTask((1 << CFG_SEQ_Task_Housekeeping), UTIL_SEQ_RFU, appGatewayHousekeepingProcess);
     } else {
         appSensorInit();
         UTIL_SEQ_RegTask((1 << CFG_SEQ_Task_Sparrow_Process), UTIL_SEQ_RFU, appSensorProcess);
+        UTIL_SEQ_RegTask((1 << CFG_SEQ_Task_Sparrow_Event), UTIL_SEQ_RFU, appSensorEvents);
     }
 
 }
@@ -391,6 +409,58 @@ void appEnterSoftAP(void)
 void appSetSKU(int sku)
 {
     SKU = sku;
+    if (SKU != inventorySKU) {
+        inventorySKU = SKU;
+        inventoryChanged = true;
+    }
+}
+
+// Use the hardware inventory of a previous boot, unless this boot followed a power cycle or a
+// reset from the pin, either of which may mean that the hardware has changed.  A software or
+// watchdog reset also sets the pin flag, because it drives NRST, so it is tested first.
+void appInventoryLoad()
+{
+    bool warm = (__HAL_RCC_GET_FLAG(RCC_FLAG_SFTRST) || __HAL_RCC_GET_FLAG(RCC_FLAG_IWDGRST)
+                 || __HAL_RCC_GET_FLAG(RCC_FLAG_WWDGRST) || __HAL_RCC_GET_FLAG(RCC_FLAG_LPWRRST));
+    __HAL_RCC_CLEAR_RESET_FLAGS();
+    if (!warm || !flashInventoryLoad(&inventorySKU, &hardwareProbed, &hardwarePresent)) {
+        inventorySKU = SKU_UNKNOWN;
+        hardwareProbed = hardwarePresent = 0;
+        inventoryChanged = true;
+        return;
+    }
+    inventoryChanged = false;
+    APP_PRINTF("hardware inventory from previous boot\r\n");
+}
+
+// Record the inventory if probing changed it
+void appInventorySave()
+{
+    if (inventoryChanged && hardwareProbed != 0) {
+        flashInventorySave(inventorySKU, hardwareProbed, hardwarePresent);
+    }
+    inventoryChanged = false;
+}
+
+// See if the presence of hardware is already known, so that it needn't be probed
+bool appHardwareProbed(uint32_t hardware, bool *present)
+{
+    if ((hardwareProbed & hardware) == 0) {
+        return false;
+    }
+    *present = ((hardwarePresent & hardware) != 0);
+    return true;
+}
+
+// Record the result of probing for hardware
+void appHardwareFound(uint32_t hardware, bool present)
+{
+    uint32_t wasPresent = hardwarePresent;
+    hardwarePresent = present ? (hardwarePresent | hardware) : (hardwarePresent & ~hardware);
+    if ((hardwareProbed & hardware) == 0 || wasPresent != hardwarePresent) {
+        hardwareProbed |= hardware;
+        inventoryChanged = true;
+    }
 }
 
 // Get the SKU
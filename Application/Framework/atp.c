@@ -24,6 +24,11 @@
 //      the boundary between "good" and "bad" signal levels (as observed).
 // 4/19 Don't kill packet statistics as we're going up and down, and do
 //      loss checks directly as we're about to decrease power as opposed to at the top
+// 10/14 Replace the averaging of the last 3 samples, and the walk down from the initial
+//      level, with an EWMA model of the path loss and its deviation.  The power is set
+//      directly from the model with a confidence margin, so that the level converges
+//      within a packet or two.  Losses widen the margin, and the model is retained in
+//      backup registers across resets.
 
 #include "main.h"
 #include "framework.h"
@@ -37,15 +42,37 @@ static int8_t currentLevel = initialLevel;
 static int8_t lowestLevel = initialLevel;
 
 // Key parameters for averaging and decision-making
-#define SAMPLES                                 3           // Packets before ATP decision-making
 #define NUM_PACKETS_MINIMUM_FOR_SUCCESS_CALC    25
 #define ALLOWED_FAIL_RESETS                     2           // Soft failure becomes hard failure
 #define RECONSIDER_DECREASE_IF_FAIL_PCT_LESS_THAN 5         // If very successful, reconsider a decrease
 #define DONT_DECREASE_POWER_IF_PRIOR_LOSS_EXCEEDS 5         // Can't back down
 #define INCREASE_POWER_INCREMENT                1           // Increment of db when loss exceeds
 #define INCREASE_POWER_IF_QUALITY_BELOW         -20         // SNR (-20dB to +10dB)
-#define INCREASE_POWER_IF_SIGNAL_BELOW          -120        // RSSI (-120dBm to -30dBm)
-#define DECREASE_POWER_IF_SIGNAL_ABOVE          -100
+
+// Path loss model.  The loss is the difference between our power and the gateway's view of
+// our signal, tracked for both RSSI and SNR in 1/16dB so that the fractions of the EWMA
+// accumulate.  We aim for the power at which both targets are met with CONFIDENCE mean
+// deviations of headroom.  The SNR target is a bit above the SF7 demodulation floor so that
+// lowering the power doesn't push the exchange to a slower spreading factor.  The gateway
+// keeps the same kind of model for each sensor, to choose the power of what it sends back.
+#define MODEL_SCALE                             16
+#define MODEL_WEIGHT_SHIFT                      2           // Each sample contributes 1/4
+#define MODEL_TARGET_RSSI                       -110        // dBm at the receiver
+#define MODEL_TARGET_SNR                        -5          // dB at the receiver
+#define MODEL_CONFIDENCE                        2           // Deviations of headroom
+#define MODEL_INITIAL_DEVIATION_DB              4           // Until samples say otherwise
+#define MODEL_MINIMUM_DEVIATION_DB              1
+#define MODEL_LOSS_DEVIATION_DB                 2           // Widening for each packet lost
+#define MODEL_MAXIMUM_DEVIATION_DB              20
+#define MODEL_NOISE_SNR_BELOW                   5           // Above this, SNR saturates and says little about noise
+static atpModel rssiModel;
+static atpModel snrModel;
+
+// The parameters above that the ATP simulation may vary, as they are in use
+static const atpTuning tuned = {
+    MODEL_WEIGHT_SHIFT, MODEL_CONFIDENCE, MODEL_LOSS_DEVIATION_DB,
+    MODEL_TARGET_RSSI, MODEL_TARGET_SNR, INCREASE_POWER_IF_QUALITY_BELOW,
+};
 
 // Total number of packets, and packet losses, per power level
 static uint32_t packetsSent[RBO_LEVELS] = {0};
@@ -54,53 +81,135 @@ static uint32_t packetsLost[RBO_LEVELS] = {0};
 static uint32_t failResets[RBO_LEVELS] = {0};
 #endif
 
-// Recent history, for computing average
-uint8_t pastSamples = 0;
-static int8_t pastRSSI[SAMPLES];
-static int8_t pastSNR[SAMPLES];
-
 // Forwards
 void atpUpdate(bool useSignal, int8_t rssi, int8_t snr);
 bool powerLevelIsLossy(int level);
+int modelPowerNeeded(atpModel *model, int targetDb);
 
 // Received a gateway message, so adjust TXP.  Note that rssi and snr passed-in are
 // the gateway's view of OUR signal strength (because the gateway is the Receiver in RSSI).
 void atpGatewayMessageReceived(int8_t rssi, int8_t snr, int8_t rssiGateway, int8_t snrGateway)
 {
 
-    // Buffer the new sample
-    if (pastSamples < SAMPLES) {
+    // Fold the sample into the model, given the power at which the gateway heard us
+    int txp = atpPowerLevel();
+#if ATP_SIM_ON
+    atpsimRecord(txp, rssi, snr, false);
+#endif
+    atpModelSample(&rssiModel, txp - rssi);
+    atpModelSample(&snrModel, txp - snr);
+
+    // Update the tx power
+    atpUpdate(true, rssi, snr);
 
-        // Insufficient samples to make decisions based on samples
-        pastRSSI[pastSamples] = rssi;
-        pastSNR[pastSamples] = snr;
-        pastSamples++;
-        APP_PRINTF("ATP: buffered sample %d\r\n", pastSamples);
+}
 
-    } else {
+// Get the parameters in use, from which the ATP simulation's alternatives are varied
+const atpTuning *atpTuningInUse()
+{
+    return &tuned;
+}
+
+// Fold a sample, in dB, into a model
+void atpModelSample(atpModel *model, int db)
+{
+    atpModelSampleTuned(&tuned, model, db);
+}
+
+// Fold a sample, in dB, into a model with the given parameters
+void atpModelSampleTuned(const atpTuning *tuning, atpModel *model, int db)
+{
+    int sample = db * MODEL_SCALE;
+    if (model->samples == 0) {
+        model->mean = sample;
+        model->deviation = MODEL_INITIAL_DEVIATION_DB * MODEL_SCALE;
+        model->samples = 1;
+        return;
+    }
+    int error = sample - model->mean;
+    int deviation = model->deviation + (((error < 0 ? -error : error) - (int)model->deviation) / (1 << tuning->weightShift));
+    model->mean += error / (1 << tuning->weightShift);
+    if (deviation < MODEL_MINIMUM_DEVIATION_DB * MODEL_SCALE) {
+        deviation = MODEL_MINIMUM_DEVIATION_DB * MODEL_SCALE;
+    }
+    model->deviation = deviation;
+    if (model->samples < 255) {
+        model->samples++;
+    }
+}
 
-        // Enough samples to make decisions
-        memmove(&pastRSSI[1], &pastRSSI[0], sizeof(pastRSSI)-sizeof(pastRSSI[0]));
-        pastRSSI[0] = rssi;
-        memmove(&pastSNR[1], &pastSNR[0], sizeof(pastSNR)-sizeof(pastSNR[0]));
-        pastSNR[0] = snr;
+// Reduce our confidence in a model, such as when a packet is lost
+void atpModelWiden(atpModel *model)
+{
+    atpModelWidenTuned(&tuned, model);
+}
 
+// Reduce our confidence in a model with the given parameters
+void atpModelWidenTuned(const atpTuning *tuning, atpModel *model)
+{
+    if (model->samples == 0) {
+        return;
+    }
+    int deviation = model->deviation + (tuning->lossDeviationDb * MODEL_SCALE);
+    if (deviation > MODEL_MAXIMUM_DEVIATION_DB * MODEL_SCALE) {
+        deviation = MODEL_MAXIMUM_DEVIATION_DB * MODEL_SCALE;
     }
+    model->deviation = deviation;
+}
 
-    // Update the tx power
-    atpUpdate(true, rssi, snr);
+// The power, in dBm, that the model says will arrive at the target with the desired confidence
+int modelPowerNeeded(atpModel *model, int targetDb)
+{
+    return atpModelPowerNeeded(&tuned, model, targetDb);
+}
 
+// The power, in dBm, that the model says will arrive at the target with the given parameters
+int atpModelPowerNeeded(const atpTuning *tuning, atpModel *model, int targetDb)
+{
+    int needed = (targetDb * MODEL_SCALE) + model->mean + (tuning->confidence * model->deviation);
+    return (needed >= 0) ? (needed + MODEL_SCALE - 1) / MODEL_SCALE : -((-needed) / MODEL_SCALE);
+}
+
+// Set the power at which to transmit to a sensor, given a model of the path loss measured
+// from the sensor's transmissions, which is the same in both directions, and a model of the
+// noise floor at the sensor derived from the RSSI and SNR with which it reports hearing us.
+// A sensor we know nothing about is sent to at full power.
+void atpSetDownlinkPowerLevel(atpModel *loss, atpModel *noise)
+{
+    int needed = RBO_MAX;
+#if ATP_ENABLED
+    if (loss->samples > 0) {
+        needed = modelPowerNeeded(loss, MODEL_TARGET_RSSI);
+        if (noise->samples > 0) {
+            int neededSNR = modelPowerNeeded(loss, 0) + modelPowerNeeded(noise, MODEL_TARGET_SNR);
+            if (neededSNR > needed) {
+                needed = neededSNR;
+            }
+        }
+    }
+    if (needed < RBO_MIN) {
+        needed = RBO_MIN;
+    }
+    if (needed > RBO_MAX) {
+        needed = RBO_MAX;
+    }
+#endif
+    currentLevel = needed - RBO_MIN;
+    radioSetTxPower(atpPowerLevel());
+}
+
+// Fold the sensor's report of how it heard us into a model of the noise floor at the sensor
+void atpNoiseSample(atpModel *noise, int8_t rssi, int8_t snr)
+{
+    if ((rssi != 0 || snr != 0) && snr < MODEL_NOISE_SNR_BELOW) {
+        atpModelSample(noise, rssi - snr);
+    }
 }
 
 // Update the transmit power based on current knowledge
 void atpUpdate(bool useSignal, int8_t rssi, int8_t snr)
 {
 #if ATP_ENABLED
-    bool mustIncreaseTxPower = false;
-    bool mustNotDecreaseTxPower = false;
-    bool shouldIncreaseTxPower = false;
-    bool shouldTryDecreasingTxPower = false;
-    int8_t decreasePowerLevelByDb = 1;
 
     // At certain intervals, if we're at the top power level, reset all parameters and
     // try ATP from scratch.  This is to correct for the fact that during the first several
@@ -129,7 +238,8 @@ void atpUpdate(bool useSignal, int8_t rssi, int8_t snr)
     if (resetATPState) {
         currentLevel = initialLevel;
         lowestLevel = initialLevel;
-        pastSamples = 0;
+        rssiModel.samples = 0;
+        snrModel.samples = 0;
         memset(packetsSent, 0, sizeof(packetsSent));
         memset(packetsLost, 0, sizeof(packetsLost));
         memset(failResets, 0, sizeof(failResets));
@@ -157,105 +267,68 @@ void atpUpdate(bool useSignal, int8_t rssi, int8_t snr)
         }
     }
 
+    // Until we've heard from the gateway there's nothing to model
+    if (rssiModel.samples == 0) {
+        return;
+    }
+
+    // Compute the level that the model calls for, stepping above any that have proven lossy
+    int needed = modelPowerNeeded(&rssiModel, MODEL_TARGET_RSSI);
+    int neededSNR = modelPowerNeeded(&snrModel, MODEL_TARGET_SNR);
+    if (neededSNR > needed) {
+        needed = neededSNR;
+    }
+    int level = needed - RBO_MIN;
+    if (level < 0) {
+        level = 0;
+    }
+    if (level > RBO_LEVELS-1) {
+        level = RBO_LEVELS-1;
+    }
+    while (level < currentLevel && powerLevelIsLossy(level)) {
+        level++;
+    }
+
     // If the instantaneous SNR as perceived by the gateway is too low, it is
     // nothing but danger.  If this is an anomaly it will be corrected later.
-    if (useSignal && snr < INCREASE_POWER_IF_QUALITY_BELOW) {
-        mustIncreaseTxPower = true;
+    if (useSignal && snr < INCREASE_POWER_IF_QUALITY_BELOW && level <= currentLevel && currentLevel < RBO_LEVELS-1) {
+        level = currentLevel + 1;
         APP_PRINTF("ATP: must increase power because snr is %ddb\r\n", snr);
     }
 
-    // Add it to samples
-    int32_t averageRSSI = 0;
-    int32_t averageSNR = 0;
-    if (pastSamples >= SAMPLES) {
-
-        // Compute the average of recents
-        for (int i=0; i<SAMPLES; i++) {
-            averageRSSI += pastRSSI[i];
-            averageSNR += pastSNR[i];
-        }
-        averageRSSI /= SAMPLES;
-        averageSNR /= SAMPLES;
-
-        // Make decisions
-        if (averageSNR < INCREASE_POWER_IF_QUALITY_BELOW) {
-            shouldIncreaseTxPower = true;
-            APP_PRINTF("ATP: would increase power because avg snr is %ddb\r\n", averageSNR);
-        } else if (averageRSSI < INCREASE_POWER_IF_SIGNAL_BELOW) {
-            shouldIncreaseTxPower = true;
-            APP_PRINTF("ATP: would increase power because avg rssi is %ddb\r\n", averageRSSI);
-        } else if (averageRSSI > DECREASE_POWER_IF_SIGNAL_ABOVE) {
-
-            // Attempt to decrease power by a big step
-            shouldTryDecreasingTxPower = true;
-            decreasePowerLevelByDb += 2 * ((averageRSSI - DECREASE_POWER_IF_SIGNAL_ABOVE) / 10);
-            if (decreasePowerLevelByDb > currentLevel) {
-                decreasePowerLevelByDb = currentLevel;
-                APP_PRINTF("ATP: would decrease power but it's already bottomed-out at %ddb\r\n", currentLevel+RBO_MIN);
-            } else {
-                APP_PRINTF("ATP: should decrease power by %ddb because avg rssi is %ddb\r\n", decreasePowerLevelByDb, averageRSSI);
-            }
-
-            // If that step would cause loss, try a single step
-            if (powerLevelIsLossy(currentLevel-decreasePowerLevelByDb)) {
-                APP_PRINTF("ATP: can't decrease power that much because %d/%d lost\r\n",
-                           packetsLost[currentLevel-decreasePowerLevelByDb],
-                           packetsSent[currentLevel-decreasePowerLevelByDb]);
-                decreasePowerLevelByDb = 1;
-                if (decreasePowerLevelByDb > currentLevel) {
-                    decreasePowerLevelByDb = currentLevel;
-                    APP_PRINTF("ATP: would decrease power but it's already bottomed-out at %ddb\r\n", currentLevel+RBO_MIN);
-                } else {
-                    APP_PRINTF("ATP: trying to decrease power by %ddb\r\n", decreasePowerLevelByDb);
-                }
-
-                // If that step would cause loss, give up
-                if (powerLevelIsLossy(currentLevel-decreasePowerLevelByDb)) {
-                    APP_PRINTF("ATP: can't decrease power at all because %d/%d lost\r\n",
-                               packetsLost[currentLevel-decreasePowerLevelByDb],
-                               packetsSent[currentLevel-decreasePowerLevelByDb]);
-                    shouldTryDecreasingTxPower = false;
-                }
-
-            }
-
-        }
-
+    // Without a fresh signal, such as after a loss, the model may only raise the power
+    if (!useSignal && level < currentLevel) {
+        level = currentLevel;
     }
 
-    // Bump the level as appropriate
-    if (currentLevel < (RBO_LEVELS-1) && (mustIncreaseTxPower || shouldIncreaseTxPower)) {
-        currentLevel++;
-        pastSamples = 0;
+    // Move to that level
+    if (level > currentLevel) {
+        currentLevel = level;
         radioSetTxPower(atpPowerLevel());
-        APP_PRINTF("ATP: increased power to %d dBm\r\n", currentLevel+RBO_MIN);
-    } else if (currentLevel > 0 && !mustNotDecreaseTxPower && shouldTryDecreasingTxPower) {
-        currentLevel -= decreasePowerLevelByDb;
+        APP_PRINTF("ATP: increased power to %d dBm\r\n", atpPowerLevel());
+    } else if (level < currentLevel) {
+        currentLevel = level;
         if (currentLevel < lowestLevel) {
             lowestLevel = currentLevel;
         }
-        pastSamples = 0;
         radioSetTxPower(atpPowerLevel());
         APP_PRINTF("ATP: decreased power to %d dbm (%d/%d lost at this level)\r\n",
-                   currentLevel+RBO_MIN, packetsLost[currentLevel], packetsSent[currentLevel]);
+                   atpPowerLevel(), packetsLost[currentLevel], packetsSent[currentLevel]);
     } else {
 
-        // Display signal
+        // Display signal and model, in 1/MODEL_SCALE dB
         if (useSignal) {
-            if (averageRSSI != 0 || averageSNR != 0) {
-                APP_PRINTF("ATP: rssi/snr:%d/%d avg:%d/%d txp:%d\r\n", rssi, snr, averageRSSI, averageSNR, atpPowerLevel());
-            } else {
-                APP_PRINTF("ATP: rssi/snr:%d/%d txp:%d\r\n", rssi, snr, atpPowerLevel());
-            }
+            TRACE_EVENT(TRACE_ATP, VLEVEL_L, "ATP:", {"rssi", rssi}, {"snr", snr}, {"txp", atpPowerLevel()});
         } else {
-            if (averageRSSI != 0 || averageSNR != 0) {
-                APP_PRINTF("ATP: avg:%d/%d txp:%d\r\n", averageRSSI, averageSNR, atpPowerLevel());
-            } else {
-                APP_PRINTF("ATP: txp:%d\r\n", atpPowerLevel());
-            }
+            TRACE_EVENT(TRACE_ATP, VLEVEL_L, "ATP:", {"txp", atpPowerLevel()});
         }
+        TRACE_EVENT(TRACE_ATP, VLEVEL_L, "ATP: loss", {"rssi", rssiModel.mean}, {"dev", rssiModel.deviation},
+                    {"snr", snrModel.mean}, {"dev", snrModel.deviation});
 
         // Display failure stats
+        if (!TRACE_ON(TRACE_ATP, VLEVEL_L)) {
+            return;
+        }
         char msg[256] = {0};
         strlcat(msg, "ATP: ", sizeof(msg));
         for (int i=0; i<RBO_LEVELS; i++) {
@@ -319,8 +392,13 @@ bool powerLevelIsLossy(int level)
 void atpGatewayMessageLost()
 {
 
-    // Bump the stat, which impacts txp decrease decisions
+    // Bump the stat, which impacts txp decrease decisions, and lose some confidence in the model
+#if ATP_SIM_ON
+    atpsimRecord(atpPowerLevel(), 0, 0, true);
+#endif
     packetsLost[currentLevel]++;
+    atpModelWiden(&rssiModel);
+    atpModelWiden(&snrModel);
 
     // If we truly lost a message (which means multiple packets lost), take action
     // by increasing power.
@@ -335,7 +413,6 @@ void atpGatewayMessageLost()
         }
         if (currentLevel != newLevel) {
             currentLevel = newLevel;
-            pastSamples = 0;
             radioSetTxPower(atpPowerLevel());
             APP_PRINTF("ATP: increased power to %d dBm because %d lost\r\n", currentLevel+RBO_MIN, lost);
         }
@@ -366,41 +443,58 @@ int8_t atpLowestPowerLevel()
     return lowestLevel + RBO_MIN;
 }
 
-// Set the ATP power level to match the level of the last received message, which
-// is most critical for devices that are very close to the gateway so that we
-// don't overload their front-end.
-void atpMatchPowerLevel(int level)
+// Set the power level to the maximum, for cases where we have no idea where
+// we are and we just want to make sure a message gets out
+void atpMaximizePowerLevel()
 {
-
-    // Match power level, or transmit at full power, depending upon preference
-#if 1
-
-    // Transmit at full power
     currentLevel = RBO_LEVELS - 1;
+    radioSetTxPower(atpPowerLevel());
+}
 
-#else
+// Get the power levels and path loss model, so that they may be retained across a reset
+void atpSnapshot(uint32_t words[ATP_SNAPSHOT_WORDS])
+{
+    words[0] = (uint8_t) currentLevel | ((uint32_t)(uint8_t)lowestLevel << 8) | ((uint32_t)rssiModel.samples << 16);
+    words[1] = (uint16_t) rssiModel.mean | ((uint32_t)rssiModel.deviation << 16);
+    words[2] = (uint16_t) snrModel.mean | ((uint32_t)snrModel.deviation << 16);
+}
 
-    // Transmit at a slightly higher power level than what was received,
-    // just to ensure that it's able to see our response.
-    level += 5;
-    if (level >= RBO_MIN && level <= RBO_MAX) {
-        currentLevel = (level - RBO_MIN);
-    } else {
-        currentLevel = RBO_LEVELS - 1;
+// Resume with the state previously obtained from atpSnapshot()
+void atpRestore(const uint32_t words[ATP_SNAPSHOT_WORDS])
+{
+    int8_t level = (int8_t) words[0];
+    int8_t lowest = (int8_t) (words[0] >> 8);
+    if (level < 0 || level >= RBO_LEVELS || lowest < 0 || lowest > level) {
+        return;
     }
-
-#endif
-
-    // Set the radio config at that level
+    currentLevel = level;
+    lowestLevel = lowest;
+    rssiModel.samples = snrModel.samples = (uint8_t) (words[0] >> 16);
+    rssiModel.mean = (int16_t) words[1];
+    rssiModel.deviation = (uint16_t) (words[1] >> 16);
+    snrModel.mean = (int16_t) words[2];
+    snrModel.deviation = (uint16_t) (words[2] >> 16);
     radioSetTxPower(atpPowerLevel());
+    APP_PRINTF("ATP: resuming at %d dBm after %d samples\r\n", atpPowerLevel(), rssiModel.samples);
+}
 
+// See whether ATP has had to raise the power as far as it goes
+bool atpAtMaximumPower()
+{
+#if ATP_ENABLED
+    return atpPowerLevel() >= RBO_MAX;
+#else
+    return false;
+#endif
 }
 
-// Set the power level to the maximum, for cases where we have no idea where
-// we are and we just want to make sure a message gets out
-void atpMaximizePowerLevel()
+// Get the percentage of packets lost at the current power level, or 0 if too few were sent to say
+uint32_t atpLossPercent()
 {
-    currentLevel = RBO_LEVELS - 1;
+    if (packetsSent[currentLevel] <= NUM_PACKETS_MINIMUM_FOR_SUCCESS_CALC) {
+        return 0;
+    }
+    return (packetsLost[currentLevel]*100) / packetsSent[currentLevel];
 }
 
 // Get the current power level
@@ -409,6 +503,72 @@ int8_t atpPowerLevel()
 #if ATP_ENABLED
     return currentLevel + RBO_MIN;
 #else
-    return (RBO_LEVELS - 1);
+    return RBO_MAX;
 #endif
 }
+
+// Choose the spreading factor for the remainder of an exchange, given the RSSI and SNR of
+// the sensor's signal as seen by the gateway and of the gateway's signal as seen by the
+// sensor.  Demodulation works down to roughly -7.5dB SNR at SF7, and to 2.5dB lower
+// for each step up to SF12, so we choose the lowest SF whose floor is comfortably
+// below the weaker of the two directions, or 0 for the default.  Because the sensor's ATP may then lower its
+// power, the SNR falls and the next exchange will settle at a correspondingly higher SF.
+// A bulk transfer over a link strong enough for FSK uses FSK instead.
+uint8_t atpSpreadingFactor(int8_t rssiGateway, int8_t snrGateway, int8_t rssiSensor, int8_t snrSensor, bool bulk)
+{
+#if LORA_ADAPTIVE_FSK
+    if (bulk && rssiGateway >= LORA_ADAPTIVE_FSK_MIN_RSSI && rssiSensor >= LORA_ADAPTIVE_FSK_MIN_RSSI
+            && snrGateway >= LORA_ADAPTIVE_FSK_MIN_SNR && snrSensor >= LORA_ADAPTIVE_FSK_MIN_SNR) {
+        return RADIO_SF_FSK;
+    }
+#endif
+#if LORA_ADAPTIVE_SF
+    int snrTenthsDb = (snrGateway < snrSensor ? snrGateway : snrSensor) * 10;
+    for (int sf=LORA_ADAPTIVE_SF_MINIMUM; sf<LORA_SPREADING_FACTOR; sf++) {
+        int floorTenthsDb = -75 - ((sf - 7) * 25);
+        if (snrTenthsDb >= floorTenthsDb + (LORA_ADAPTIVE_SF_MARGIN_DB * 10)) {
+            return sf;
+        }
+    }
+#endif
+    return 0;
+}
+
+// Note whether a frame heard on a link arrived garbled, in a fraction that is smoothed just
+// as the path loss model is so that a burst of interference is remembered for a while
+void atpLinkSample(atpLink *link, bool garbled)
+{
+    int sample = garbled ? 1024 : 0;
+    link->garbled = (uint16_t) ((int) link->garbled + ((sample - (int) link->garbled) >> MODEL_WEIGHT_SHIFT));
+}
+
+// Choose the coding rate for the remainder of an exchange on a link, given the spreading
+// factor that it will use, or 0 for the default.  A rate is kept until the garbled fraction
+// falls below half of what warranted it, so that the link doesn't oscillate between two.
+uint8_t atpCodingRate(atpLink *link, uint8_t sf)
+{
+#if LORA_ADAPTIVE_CR
+    static const uint8_t percent[4] = {0, LORA_ADAPTIVE_CR_PERCENT_46, LORA_ADAPTIVE_CR_PERCENT_47, LORA_ADAPTIVE_CR_PERCENT_48};
+    uint32_t garbledPercent = ((uint32_t) link->garbled * 100) / 1024;
+    uint8_t current = (link->codingRate != 0) ? link->codingRate : LORA_CODINGRATE;
+    uint8_t cr = LORA_CODINGRATE;
+    for (uint8_t i=LORA_CODINGRATE+1; i<=4; i++) {
+        uint32_t threshold = percent[i-1];
+        if (i <= current) {
+            threshold /= 2;
+        }
+        if (garbledPercent >= threshold) {
+            cr = i;
+        }
+    }
+    uint8_t maxCR = radioCodingRateMax(sf);
+    if (cr > maxCR) {
+        cr = maxCR;
+    }
+    link->codingRate = (cr == LORA_CODINGRATE) ? 0 : cr;
+    return link->codingRate;
+#else
+    return 0;
+#endif
+}
+
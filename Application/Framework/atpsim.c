@@ -0,0 +1,270 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Trace-driven simulation of adaptive transmit power.  The gateway's view of each packet that
+// ATP sent is recorded along with the power at which it was sent, or that it was lost, and
+// the trace is replayed through the same path loss model that atp.c uses under alternative
+// parameters.  Because the path loss is the same at any power, a packet replayed at another
+// power arrives that many dB stronger or weaker, and is lost if that is below what the gateway
+// can demodulate; a packet that was actually lost is only taken to have arrived if replayed at
+// a few dB more.  Each parameter set is scored on the energy radiated, which is the power
+// times the time on air, and on the packets lost, so that tuning the constants can be judged
+// against the field rather than by months of trials.  The replay models the EWMA, the quality
+// floor and the step up after losses, but not the per-level loss bookkeeping that atpUpdate()
+// uses to hold off decreases, so it slightly favors sets that are quick to decrease.  A trace
+// can be shown as 'atp+' commands, so that one captured on a sensor can be loaded into another
+// and replayed there.
+
+#include <stdio.h>
+#include "framework.h"
+
+#if ATP_SIM_ON
+
+// Simulation parameters
+#define ATPSIM_SENSITIVITY_DBM  -124            // Weakest signal that the gateway demodulates
+#define ATPSIM_RECOVER_DB       3               // Extra power at which a lost packet would have arrived
+#define ATPSIM_SHOW_PACKETS     8               // Shown per call, so the console isn't held for long
+
+// Recorded packets, in order
+typedef struct {
+    int8_t txp;
+    int8_t rssi;
+    int8_t snr;
+    bool lost;
+} atpsimPacket;
+static atpsimPacket ring[ATP_SIM_PACKETS];
+static uint32_t ringNext = 0;
+static uint32_t ringCount = 0;
+
+// Parameter sets replayed, each combination of these with the targets that are in use
+static const uint8_t atpsimWeightShifts[] = { 1, 2, 3 };
+static const uint8_t atpsimConfidences[] = { 1, 2, 3 };
+static const uint8_t atpsimLossDeviations[] = { 1, 2, 4 };
+#define ATPSIM_SETS (sizeof(atpsimWeightShifts) * sizeof(atpsimConfidences) * sizeof(atpsimLossDeviations))
+
+// Progress of the paged commands
+static uint32_t runNext = 0;
+static uint32_t showNext = 0;
+
+// Results of one replay
+typedef struct {
+    uint64_t microjoules;
+    uint32_t lost;
+    int8_t finalTxp;
+} atpsimResult;
+
+// Forwards
+atpsimPacket *atpsimAt(uint32_t i);
+int atpsimLevel(const atpTuning *tuning, atpModel *rssiModel, atpModel *snrModel);
+void atpsimReplay(const atpTuning *tuning, atpsimResult *result);
+void atpsimReport(const char *label, uint32_t packets, atpsimResult *result);
+
+// Record a packet that ATP sent, given the gateway's view of it or that it was lost
+void atpsimRecord(int8_t txp, int8_t rssi, int8_t snr, bool lost)
+{
+    atpsimPacket *p = &ring[ringNext];
+    p->txp = txp;
+    p->rssi = rssi;
+    p->snr = snr;
+    p->lost = lost;
+    ringNext = (ringNext + 1) % ATP_SIM_PACKETS;
+    if (ringCount < ATP_SIM_PACKETS) {
+        ringCount++;
+    }
+}
+
+// Append a packet given as "<txp> <rssi> <snr>", or "<txp> lost", returning false if malformed
+bool atpsimAppend(char *args)
+{
+    char *p = args;
+    long txp = strtol(p, &p, 10);
+    if (p == args || txp < RBO_MIN || txp > RBO_MAX) {
+        return false;
+    }
+    while (*p == ' ') {
+        p++;
+    }
+    if (strcmp(p, "lost") == 0) {
+        atpsimRecord((int8_t) txp, 0, 0, true);
+        return true;
+    }
+    char *q = p;
+    long rssi = strtol(p, &p, 10);
+    long snr = strtol(p, &p, 10);
+    if (p == q) {
+        return false;
+    }
+    atpsimRecord((int8_t) txp, (int8_t) rssi, (int8_t) snr, false);
+    return true;
+}
+
+// Forget the recorded packets
+void atpsimReset()
+{
+    ringNext = ringCount = 0;
+    runNext = showNext = 0;
+}
+
+// Get the i'th oldest packet
+atpsimPacket *atpsimAt(uint32_t i)
+{
+    return &ring[(ringNext + ATP_SIM_PACKETS - ringCount + i) % ATP_SIM_PACKETS];
+}
+
+// Show the next few packets as the commands that would load them, returning true until all
+// have been shown
+bool atpsimShow()
+{
+    for (int n=0; n<ATPSIM_SHOW_PACKETS && showNext < ringCount; n++, showNext++) {
+        atpsimPacket *p = atpsimAt(showNext);
+        if (p->lost) {
+            APP_PRINTF("atp+ %d lost\r\n", p->txp);
+        } else {
+            APP_PRINTF("atp+ %d %d %d\r\n", p->txp, p->rssi, p->snr);
+        }
+    }
+    if (showNext < ringCount) {
+        return true;
+    }
+    showNext = 0;
+    return false;
+}
+
+// The level that a model calls for, as atpUpdate() computes it
+int atpsimLevel(const atpTuning *tuning, atpModel *rssiModel, atpModel *snrModel)
+{
+    int needed = atpModelPowerNeeded(tuning, rssiModel, tuning->targetRssi);
+    int neededSNR = atpModelPowerNeeded(tuning, snrModel, tuning->targetSnr);
+    if (neededSNR > needed) {
+        needed = neededSNR;
+    }
+    int level = needed - RBO_MIN;
+    if (level < 0) {
+        level = 0;
+    }
+    if (level > RBO_LEVELS-1) {
+        level = RBO_LEVELS-1;
+    }
+    return level;
+}
+
+// Replay the recorded packets with a parameter set, beginning as ATP does after boot
+void atpsimReplay(const atpTuning *tuning, atpsimResult *result)
+{
+    atpModel rssiModel = {0};
+    atpModel snrModel = {0};
+    uint32_t lostAtLevel[RBO_LEVELS] = {0};
+    uint32_t airtimeMs = radioMessageTimeOnAirMs(0);
+    int level = RBO_INITIAL - RBO_MIN;
+    memset(result, 0, sizeof(*result));
+    for (uint32_t i=0; i<ringCount; i++) {
+        atpsimPacket *p = atpsimAt(i);
+        int txp = level + RBO_MIN;
+        result->microjoules += (schedHundredthsMw((int8_t) txp) * airtimeMs) / 100;
+
+        // See whether the packet would have arrived at this power
+        int shift = txp - p->txp;
+        int snrFloorTenthsDb = -75 - ((LORA_SPREADING_FACTOR - 7) * 25);
+        bool arrived;
+        if (p->lost) {
+            arrived = (shift >= ATPSIM_RECOVER_DB);
+        } else {
+            arrived = (p->rssi + shift >= ATPSIM_SENSITIVITY_DBM) && ((p->snr + shift) * 10 >= snrFloorTenthsDb);
+        }
+
+        // A loss widens the model and, after the first at a level, steps the power up, after
+        // which the model may only raise it further
+        if (!arrived) {
+            result->lost++;
+            lostAtLevel[level]++;
+            atpModelWidenTuned(tuning, &rssiModel);
+            atpModelWidenTuned(tuning, &snrModel);
+            if (lostAtLevel[level] > 1 && level < RBO_LEVELS-1) {
+                level++;
+            }
+            if (rssiModel.samples > 0) {
+                int modelLevel = atpsimLevel(tuning, &rssiModel, &snrModel);
+                if (modelLevel > level) {
+                    level = modelLevel;
+                }
+            }
+            continue;
+        }
+
+        // A packet that was lost when recorded says nothing about the signal
+        if (p->lost) {
+            continue;
+        }
+
+        // Fold the path loss into the model and move to the level that it calls for
+        int snr = p->snr + shift;
+        atpModelSampleTuned(tuning, &rssiModel, p->txp - p->rssi);
+        atpModelSampleTuned(tuning, &snrModel, p->txp - p->snr);
+        int newLevel = atpsimLevel(tuning, &rssiModel, &snrModel);
+        if (snr < tuning->qualityBelow && newLevel <= level && level < RBO_LEVELS-1) {
+            newLevel = level + 1;
+        }
+        level = newLevel;
+
+    }
+    result->finalTxp = (int8_t) (level + RBO_MIN);
+}
+
+// Display the score of a replay
+void atpsimReport(const char *label, uint32_t packets, atpsimResult *result)
+{
+    uint32_t lostTenths = packets ? (result->lost * 1000) / packets : 0;
+    APP_PRINTF("atpsim: %s: %dmJ, %d/%d lost (%d.%d%%), ending at %d dBm\r\n", label,
+               (uint32_t) (result->microjoules / 1000), result->lost, packets,
+               lostTenths / 10, lostTenths % 10, result->finalTxp);
+}
+
+// Replay the next parameter set, beginning with what was recorded, returning true until all
+// have been replayed
+bool atpsimRun()
+{
+    if (ringCount == 0) {
+        APP_PRINTF("atpsim: no packets recorded\r\n");
+        return false;
+    }
+
+    // Score what actually happened
+    if (runNext == 0) {
+        atpsimResult recorded = {0};
+        uint32_t airtimeMs = radioMessageTimeOnAirMs(0);
+        for (uint32_t i=0; i<ringCount; i++) {
+            atpsimPacket *p = atpsimAt(i);
+            recorded.microjoules += (schedHundredthsMw(p->txp) * airtimeMs) / 100;
+            recorded.lost += p->lost ? 1 : 0;
+            recorded.finalTxp = p->txp;
+        }
+        atpsimReport("recorded", ringCount, &recorded);
+        runNext++;
+        return true;
+    }
+
+    // Replay one parameter set per call
+    const atpTuning *inUse = atpTuningInUse();
+    uint32_t set = runNext - 1;
+    atpTuning tuning = *inUse;
+    tuning.weightShift = atpsimWeightShifts[set % sizeof(atpsimWeightShifts)];
+    set /= sizeof(atpsimWeightShifts);
+    tuning.confidence = atpsimConfidences[set % sizeof(atpsimConfidences)];
+    set /= sizeof(atpsimConfidences);
+    tuning.lossDeviationDb = atpsimLossDeviations[set];
+    atpsimResult result;
+    atpsimReplay(&tuning, &result);
+    char label[64];
+    snprintf(label, sizeof(label), "shift %d confidence %d loss %ddB%s",
+             tuning.weightShift, tuning.confidence, tuning.lossDeviationDb,
+             (memcmp(&tuning, inUse, sizeof(tuning)) == 0) ? " (in use)" : "");
+    atpsimReport(label, ringCount, &result);
+    if (++runNext <= ATPSIM_SETS) {
+        return true;
+    }
+    runNext = 0;
+    return false;
+}
+
+#endif
@@ -0,0 +1,999 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Compact binary encoding of templated note.add requests.  When a sensor has registered
+// a note.template for a notefile, each note.add to that notefile goes over the air as the
+// template's ID followed by the packed field values, rather than as JSON text.  The
+// gateway learns the template when it relays the note.template to the notecard (or,
+// if it has since restarted, by asking the notecard for it), and expands the compact
+// request back into JSON only when handing it to the notecard.  Fields are always
+// ordered by name so that both sides derive the same layout and template ID.
+//
+// Sensor apps may also write a request field by field into a compactNote on the stack,
+// rather than building a J tree.  When the request is sent it's encoded compactly if
+// its notefile has a template, and otherwise it's written straight out as JSON text.
+//
+// A sensor's health is sent as a fixed binary record rather than as a note, and the gateway
+// expands it into a note of its own templated health notefile.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "framework.h"
+
+// Field types, which are the field's size in bytes plus a flag indicating its kind
+#define COMPACT_TYPE_SIGNED     0x00
+#define COMPACT_TYPE_UNSIGNED   0x20
+#define COMPACT_TYPE_FLOAT      0x40
+#define COMPACT_TYPE_BOOL       0x80
+#define COMPACT_TYPE_KIND       0xE0
+#define COMPACT_TYPE_SIZE       0x1F
+
+// Flags within a compact note.add
+#define COMPACT_FLAG_SYNC       0x01
+#define COMPACT_FLAG_TIME       0x02
+
+// A learned template.  Because its ID is derived from its notefile and layout, the gateway
+// holds one for each that is in use, keyed on both, however many sensors share it.  A sensor
+// holds its own, which are marked as such and found by notefile alone.  When the table is full,
+// the template used least recently is replaced, preferring one that isn't the sensor's own.
+typedef struct {
+    bool valid;
+    bool own;
+    uint16_t templateID;
+    uint32_t lastUsed;
+    char file[COMPACT_FILE_MAX];
+    uint8_t fields;
+    uint8_t type[COMPACT_MAX_FIELDS];
+    uint8_t nameOffset[COMPACT_MAX_FIELDS];
+    char names[COMPACT_NAMES_MAX];
+} compactTemplate;
+static compactTemplate templates[COMPACT_MAX_TEMPLATES] = {0};
+static uint32_t templateUses = 0;
+
+// Whether the gateway has registered the template of its health notefile since it booted
+static bool healthTemplateRegistered = false;
+
+// Forwards
+void compactHealthBody(J *body, const char *sensor, const char *name, compactHealth *h, bool template);
+bool compactHealthRegisterTemplate(void);
+compactTemplate *compactFindTemplate(const char *file, bool own, uint16_t templateID);
+bool compactParseTemplate(const char *file, J *body, compactTemplate *t);
+uint8_t compactFieldType(J *item);
+uint16_t compactFloatToHalf(float value);
+float compactHalfToFloat(uint16_t half);
+uint64_t compactPackValue(uint8_t type, JNUMBER number, bool boolean);
+compactNoteItem *compactNoteAdd(compactNote *note, bool inBody, const char *name, uint8_t kind);
+bool compactNoteEncodeCompact(compactNote *note, uint8_t **retData, uint32_t *retLen);
+uint32_t compactWriteJSONString(char *out, const char *s);
+uint32_t compactWriteJSONItem(char *out, compactNoteItem *item, bool first);
+
+// Find one of our own templates by notefile, or one learned from sensors by notefile and ID
+compactTemplate *compactFindTemplate(const char *file, bool own, uint16_t templateID)
+{
+    for (uint32_t i=0; i<COMPACT_MAX_TEMPLATES; i++) {
+        compactTemplate *t = &templates[i];
+        if (t->valid && t->own == own && (own || t->templateID == templateID) && strcmp(t->file, file) == 0) {
+            t->lastUsed = ++templateUses;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+// Map a note.template field definition to a compact field type, or 0 if it can't be packed
+uint8_t compactFieldType(J *item)
+{
+    switch (JGetItemType(item)) {
+    case JTYPE_BOOL_TRUE:
+        return COMPACT_TYPE_BOOL | 1;
+    case JTYPE_NUMBER:
+        break;
+    default:
+        return 0;
+    }
+    JNUMBER value = JNumberValue(item);
+    if (value == TFLOAT16) {
+        return COMPACT_TYPE_FLOAT | 2;
+    }
+    if (value == TFLOAT32) {
+        return COMPACT_TYPE_FLOAT | 4;
+    }
+    if (value == TFLOAT64) {
+        return COMPACT_TYPE_FLOAT | 8;
+    }
+    int intValue = (int) value;
+    if (intValue != value) {
+        return 0;
+    }
+    if ((intValue >= TINT8 && intValue <= TINT32) || intValue == TINT64) {
+        return COMPACT_TYPE_SIGNED | (intValue - 10);
+    }
+    if (intValue >= TUINT8 && intValue <= TUINT32) {
+        return COMPACT_TYPE_UNSIGNED | (intValue - 20);
+    }
+    return 0;
+}
+
+// Parse the body of a note.template into a template, failing if any field can't be packed
+bool compactParseTemplate(const char *file, J *body, compactTemplate *t)
+{
+
+    // Validate the notefile
+    memset(t, 0, sizeof(compactTemplate));
+    if (body == NULL || file[0] == '\0' || strlen(file) >= sizeof(t->file)) {
+        return false;
+    }
+    strlcpy(t->file, file, sizeof(t->file));
+
+    // Insert the fields in name order
+    uint32_t namesLen = 0;
+    J *field = NULL;
+    JObjectForEach(field, body) {
+        const char *name = JGetItemName(field);
+        uint8_t type = compactFieldType(field);
+        uint32_t nameLen = strlen(name) + 1;
+        if (type == 0 || t->fields >= COMPACT_MAX_FIELDS || namesLen + nameLen > sizeof(t->names)) {
+            return false;
+        }
+        memcpy(&t->names[namesLen], name, nameLen);
+        int i = t->fields++;
+        while (i > 0 && strcmp(&t->names[t->nameOffset[i-1]], name) > 0) {
+            t->nameOffset[i] = t->nameOffset[i-1];
+            t->type[i] = t->type[i-1];
+            i--;
+        }
+        t->nameOffset[i] = namesLen;
+        t->type[i] = type;
+        namesLen += nameLen;
+    }
+    if (t->fields == 0) {
+        return false;
+    }
+
+    // Derive the template ID (FNV-1a) from the notefile and the layout
+    uint32_t hash = 2166136261UL;
+    for (const char *p = t->file; *p != '\0'; p++) {
+        hash = (hash ^ (uint8_t) *p) * 16777619UL;
+    }
+    for (int i=0; i<t->fields; i++) {
+        for (const char *p = &t->names[t->nameOffset[i]]; *p != '\0'; p++) {
+            hash = (hash ^ (uint8_t) *p) * 16777619UL;
+        }
+        hash = (hash ^ t->type[i]) * 16777619UL;
+    }
+    t->templateID = (uint16_t) (hash ^ (hash >> 16));
+    t->valid = true;
+    return true;
+
+}
+
+// Learn (or forget) the template being registered by a note.template request, which is one
+// of our own if no sensor address is given
+void compactLearnTemplate(uint8_t *address, J *req)
+{
+
+    // Only note.template is of interest
+    if (strcmp(JGetString(req, "req"), "note.template") != 0) {
+        return;
+    }
+    const char *file = JGetString(req, "file");
+    bool own = (address == NULL);
+
+    // Parse it.  Our own replaces any previous template for the notefile, but one learned from
+    // a sensor leaves those of other layouts, which other sensors may still be using.
+    compactTemplate t;
+    bool valid = compactParseTemplate(file, JGetObject(req, "body"), &t);
+    t.own = own;
+    compactTemplate *existing = compactFindTemplate(file, own, t.templateID);
+    if (existing != NULL && own) {
+        existing->valid = false;
+    }
+    if (!valid) {
+        return;
+    }
+    if (existing == NULL) {
+        for (uint32_t i=0; i<COMPACT_MAX_TEMPLATES; i++) {
+            compactTemplate *c = &templates[i];
+            if (!c->valid) {
+                existing = c;
+                break;
+            }
+            if (existing == NULL || (existing->own && !c->own)
+                    || (existing->own == c->own && c->lastUsed < existing->lastUsed)) {
+                existing = c;
+            }
+        }
+    }
+    t.lastUsed = ++templateUses;
+    memcpy(existing, &t, sizeof(compactTemplate));
+
+}
+
+// Encode a note.add request compactly, if its notefile has a template and the request
+// contains nothing that the compact encoding can't represent
+bool compactEncodeRequest(J *req, uint8_t **retData, uint32_t *retLen)
+{
+
+    // Only note.add requests for templated notefiles are eligible
+    if (strcmp(JGetString(req, "req"), "note.add") != 0) {
+        return false;
+    }
+    const char *file = JGetString(req, "file");
+    compactTemplate *t = compactFindTemplate(file, true, 0);
+    if (t == NULL) {
+        return false;
+    }
+
+    // Validate the request fields
+    J *body = NULL;
+    uint8_t flags = 0;
+    J *item = NULL;
+    JObjectForEach(item, req) {
+        const char *name = JGetItemName(item);
+        if (strcmp(name, "req") == 0 || strcmp(name, "file") == 0) {
+            continue;
+        }
+        if (strcmp(name, "body") == 0) {
+            body = item;
+            continue;
+        }
+        if (strcmp(name, "time") == 0) {
+            flags |= COMPACT_FLAG_TIME;
+            continue;
+        }
+        if (strcmp(name, "sync") == 0) {
+            if (JBoolValue(item)) {
+                flags |= COMPACT_FLAG_SYNC;
+            }
+            continue;
+        }
+        return false;
+    }
+
+    // Determine which fields are present, and that there aren't any others
+    uint16_t present = 0;
+    uint32_t valuesLen = 0;
+    int bodyFields = 0;
+    JObjectForEach(item, body) {
+        bodyFields++;
+    }
+    for (int i=0; i<t->fields; i++) {
+        if (JIsPresent(body, &t->names[t->nameOffset[i]])) {
+            present |= (1 << i);
+            valuesLen += t->type[i] & COMPACT_TYPE_SIZE;
+            bodyFields--;
+        }
+    }
+    if (bodyFields != 0) {
+        return false;
+    }
+
+    // Allocate the request
+    uint32_t fileLen = strlen(file);
+    uint32_t len = 1 + 1 + sizeof(uint16_t) + ((flags & COMPACT_FLAG_TIME) ? sizeof(uint32_t) : 0) + 1 + fileLen + sizeof(uint16_t) + valuesLen;
+    uint8_t *data = (uint8_t *) poolAlloc(len);
+    if (data == NULL) {
+        return false;
+    }
+
+    // Generate the header
+    uint8_t *p = data;
+    *p++ = COMPACT_NOTE_ADD;
+    *p++ = flags;
+    *p++ = (uint8_t) (t->templateID >> 0);
+    *p++ = (uint8_t) (t->templateID >> 8);
+    if (flags & COMPACT_FLAG_TIME) {
+        uint32_t time = (uint32_t) JGetNumber(req, "time");
+        for (uint32_t i=0; i<sizeof(uint32_t); i++) {
+            *p++ = (uint8_t) (time >> (i*8));
+        }
+    }
+    *p++ = (uint8_t) fileLen;
+    memcpy(p, file, fileLen);
+    p += fileLen;
+    *p++ = (uint8_t) (present >> 0);
+    *p++ = (uint8_t) (present >> 8);
+
+    // Pack the fields
+    for (int i=0; i<t->fields; i++) {
+        if ((present & (1 << i)) == 0) {
+            continue;
+        }
+        const char *name = &t->names[t->nameOffset[i]];
+        uint8_t size = t->type[i] & COMPACT_TYPE_SIZE;
+        uint64_t bits = compactPackValue(t->type[i], JGetNumber(body, name), JGetBool(body, name));
+        for (int j=0; j<size; j++) {
+            *p++ = (uint8_t) (bits >> (j*8));
+        }
+    }
+
+    // Done
+    *retData = data;
+    *retLen = len;
+    return true;
+
+}
+
+// Pack a field's value as its compact type
+uint64_t compactPackValue(uint8_t type, JNUMBER number, bool boolean)
+{
+    uint8_t size = type & COMPACT_TYPE_SIZE;
+    uint64_t bits = 0;
+    switch (type & COMPACT_TYPE_KIND) {
+    case COMPACT_TYPE_BOOL:
+        bits = boolean ? 1 : 0;
+        break;
+    case COMPACT_TYPE_FLOAT:
+        if (size == 2) {
+            bits = compactFloatToHalf((float) number);
+        } else if (size == 4) {
+            float value = (float) number;
+            uint32_t value32;
+            memcpy(&value32, &value, sizeof(value32));
+            bits = value32;
+        } else {
+            double value = (double) number;
+            memcpy(&bits, &value, sizeof(bits));
+        }
+        break;
+    case COMPACT_TYPE_UNSIGNED:
+        bits = (uint64_t) number;
+        break;
+    default:
+        bits = (uint64_t) (int64_t) number;
+        break;
+    }
+    return bits;
+}
+
+// Begin writing a request, with the notefile that it's for or NULL if none
+void compactNoteBegin(compactNote *note, const char *req, const char *file)
+{
+    note->req = req;
+    note->file = file;
+    note->items = 0;
+    note->overflow = false;
+}
+
+// Append an item to a request being written, returning NULL if there's no room for it
+compactNoteItem *compactNoteAdd(compactNote *note, bool inBody, const char *name, uint8_t kind)
+{
+    if (note->items >= COMPACT_NOTE_ITEMS) {
+        note->overflow = true;
+        return NULL;
+    }
+    compactNoteItem *item = &note->item[note->items++];
+    item->name = name;
+    item->kind = kind;
+    item->inBody = inBody;
+    return item;
+}
+
+// Add a number to the request, or to its body
+void compactNoteNumber(compactNote *note, bool inBody, const char *name, JNUMBER value)
+{
+    compactNoteItem *item = compactNoteAdd(note, inBody, name, COMPACT_ITEM_NUMBER);
+    if (item != NULL) {
+        item->value.number = value;
+    }
+}
+
+// Add a bool to the request, or to its body
+void compactNoteBool(compactNote *note, bool inBody, const char *name, bool value)
+{
+    compactNoteItem *item = compactNoteAdd(note, inBody, name, COMPACT_ITEM_BOOL);
+    if (item != NULL) {
+        item->value.boolean = value;
+    }
+}
+
+// Add a string to the request, or to its body.  The string isn't copied, so it must remain
+// valid until the request has been handed to noteSendNoteToGatewayAsync().
+void compactNoteString(compactNote *note, bool inBody, const char *name, const char *value)
+{
+    compactNoteItem *item = compactNoteAdd(note, inBody, name, COMPACT_ITEM_STRING);
+    if (item != NULL) {
+        item->value.string = value;
+    }
+}
+
+// Encode a written note.add compactly, if its notefile has a template and the request
+// contains nothing that the compact encoding can't represent
+bool compactNoteEncodeCompact(compactNote *note, uint8_t **retData, uint32_t *retLen)
+{
+
+    // Only note.add requests for templated notefiles are eligible
+    if (strcmp(note->req, "note.add") != 0 || note->file == NULL) {
+        return false;
+    }
+    compactTemplate *t = compactFindTemplate(note->file, true, 0);
+    if (t == NULL) {
+        return false;
+    }
+
+    // Match each item to the request's flags or to a field of the template
+    uint8_t flags = 0;
+    uint32_t time = 0;
+    uint16_t present = 0;
+    uint32_t valuesLen = 0;
+    uint64_t bits[COMPACT_MAX_FIELDS];
+    for (int i=0; i<note->items; i++) {
+        compactNoteItem *item = &note->item[i];
+        if (!item->inBody) {
+            if (strcmp(item->name, "time") == 0 && item->kind == COMPACT_ITEM_NUMBER) {
+                flags |= COMPACT_FLAG_TIME;
+                time = (uint32_t) item->value.number;
+            } else if (strcmp(item->name, "sync") == 0 && item->kind == COMPACT_ITEM_BOOL) {
+                flags |= item->value.boolean ? COMPACT_FLAG_SYNC : 0;
+            } else {
+                return false;
+            }
+            continue;
+        }
+        int field;
+        for (field=0; field<t->fields; field++) {
+            if (strcmp(item->name, &t->names[t->nameOffset[field]]) == 0) {
+                break;
+            }
+        }
+        if (field >= t->fields || item->kind == COMPACT_ITEM_STRING) {
+            return false;
+        }
+        if ((present & (1 << field)) == 0) {
+            present |= (1 << field);
+            valuesLen += t->type[field] & COMPACT_TYPE_SIZE;
+        }
+        bits[field] = compactPackValue(t->type[field], item->value.number, item->value.boolean);
+    }
+
+    // Allocate the request
+    uint32_t fileLen = strlen(note->file);
+    uint32_t len = 1 + 1 + sizeof(uint16_t) + ((flags & COMPACT_FLAG_TIME) ? sizeof(uint32_t) : 0) + 1 + fileLen + sizeof(uint16_t) + valuesLen;
+    uint8_t *data = (uint8_t *) poolAlloc(len);
+    if (data == NULL) {
+        return false;
+    }
+
+    // Generate the header and pack the fields, just as compactEncodeRequest() does
+    uint8_t *p = data;
+    *p++ = COMPACT_NOTE_ADD;
+    *p++ = flags;
+    *p++ = (uint8_t) (t->templateID >> 0);
+    *p++ = (uint8_t) (t->templateID >> 8);
+    if (flags & COMPACT_FLAG_TIME) {
+        for (uint32_t i=0; i<sizeof(uint32_t); i++) {
+            *p++ = (uint8_t) (time >> (i*8));
+        }
+    }
+    *p++ = (uint8_t) fileLen;
+    memcpy(p, note->file, fileLen);
+    p += fileLen;
+    *p++ = (uint8_t) (present >> 0);
+    *p++ = (uint8_t) (present >> 8);
+    for (int i=0; i<t->fields; i++) {
+        if ((present & (1 << i)) == 0) {
+            continue;
+        }
+        uint8_t size = t->type[i] & COMPACT_TYPE_SIZE;
+        for (int j=0; j<size; j++) {
+            *p++ = (uint8_t) (bits[i] >> (j*8));
+        }
+    }
+
+    *retData = data;
+    *retLen = len;
+    return true;
+
+}
+
+// Write a string as JSON, or if out is NULL just measure it
+uint32_t compactWriteJSONString(char *out, const char *s)
+{
+    uint32_t len = 0;
+    if (out != NULL) {
+        out[len] = '"';
+    }
+    len++;
+    for (; *s != '\0'; s++) {
+        char escaped[7];
+        uint32_t n = 0;
+        uint8_t c = (uint8_t) *s;
+        if (c == '"' || c == '\\') {
+            escaped[n++] = '\\';
+            escaped[n++] = (char) c;
+        } else if (c < ' ') {
+            const char *hex = "0123456789abcdef";
+            memcpy(escaped, "\\u00", 4);
+            n = 4;
+            escaped[n++] = hex[c >> 4];
+            escaped[n++] = hex[c & 0x0F];
+        } else {
+            escaped[n++] = (char) c;
+        }
+        if (out != NULL) {
+            memcpy(&out[len], escaped, n);
+        }
+        len += n;
+    }
+    if (out != NULL) {
+        out[len] = '"';
+    }
+    len++;
+    return len;
+}
+
+// Write an item as a JSON name and value, preceded by a comma unless it's the first
+uint32_t compactWriteJSONItem(char *out, compactNoteItem *item, bool first)
+{
+    char number[JNTOA_MAX];
+    const char *value = number;
+    uint32_t len = 0;
+    if (!first) {
+        if (out != NULL) {
+            out[len] = ',';
+        }
+        len++;
+    }
+    len += compactWriteJSONString(out == NULL ? NULL : &out[len], item->name);
+    if (out != NULL) {
+        out[len] = ':';
+    }
+    len++;
+    switch (item->kind) {
+    case COMPACT_ITEM_STRING:
+        return len + compactWriteJSONString(out == NULL ? NULL : &out[len], item->value.string);
+    case COMPACT_ITEM_BOOL:
+        value = item->value.boolean ? "true" : "false";
+        break;
+    default:
+        JNtoA(item->value.number, number, -1);
+        break;
+    }
+    uint32_t valueLen = strlen(value);
+    if (out != NULL) {
+        memcpy(&out[len], value, valueLen);
+    }
+    return len + valueLen;
+}
+
+// Write a request as JSON text without a terminator, or if out is NULL just measure it
+uint32_t compactNoteWriteJSON(compactNote *note, char *out)
+{
+    compactNoteItem req = {.name = "req", .kind = COMPACT_ITEM_STRING, .value.string = note->req};
+    compactNoteItem file = {.name = "file", .kind = COMPACT_ITEM_STRING, .value.string = note->file};
+    uint32_t len = 0;
+    if (out != NULL) {
+        out[len] = '{';
+    }
+    len++;
+    len += compactWriteJSONItem(out == NULL ? NULL : &out[len], &req, true);
+    if (note->file != NULL) {
+        len += compactWriteJSONItem(out == NULL ? NULL : &out[len], &file, false);
+    }
+    bool haveBody = false;
+    for (int i=0; i<note->items; i++) {
+        if (note->item[i].inBody) {
+            haveBody = true;
+        } else {
+            len += compactWriteJSONItem(out == NULL ? NULL : &out[len], &note->item[i], false);
+        }
+    }
+    if (haveBody) {
+        if (out != NULL) {
+            memcpy(&out[len], ",\"body\":{", 9);
+        }
+        len += 9;
+        bool first = true;
+        for (int i=0; i<note->items; i++) {
+            if (note->item[i].inBody) {
+                len += compactWriteJSONItem(out == NULL ? NULL : &out[len], &note->item[i], first);
+                first = false;
+            }
+        }
+        if (out != NULL) {
+            out[len] = '}';
+        }
+        len++;
+    }
+    if (out != NULL) {
+        out[len] = '}';
+    }
+    len++;
+    return len;
+}
+
+// Encode a written request for the gateway, compactly if possible and otherwise as JSON
+bool compactNoteEncode(compactNote *note, uint8_t **retData, uint32_t *retLen)
+{
+    if (note->overflow) {
+        return false;
+    }
+    if (compactNoteEncodeCompact(note, retData, retLen)) {
+        return true;
+    }
+    uint32_t len = compactNoteWriteJSON(note, NULL);
+    char *json = (char *) poolAlloc(len+1);
+    if (json == NULL) {
+        return false;
+    }
+    compactNoteWriteJSON(note, json);
+    json[len] = '\0';
+    *retData = (uint8_t *) json;
+    *retLen = len;
+    return true;
+}
+
+// Decode a compact note.add request from a sensor into a compactNote, whose notefile is
+// held in the file buffer, returning false with an explanation in errbuf if it cannot be
+// decoded.  Field names refer to the template, and remain valid until it is replaced.
+bool compactDecodeNote(uint8_t *sensorAddress, const char *sensorName, const char *sensorLocationOLC, uint8_t *data, uint32_t len, compactNote *note, char *file, uint32_t filelen, char *errbuf, uint32_t errbuflen)
+{
+
+    // Decode the header
+    uint8_t *p = data;
+    uint8_t *end = data + len;
+    if (len < 5 || *p++ != COMPACT_NOTE_ADD) {
+        strlcpy(errbuf, "compact request: invalid header", errbuflen);
+        return false;
+    }
+    uint8_t flags = *p++;
+    uint16_t templateID = p[0] | (p[1] << 8);
+    p += sizeof(uint16_t);
+    uint32_t time = 0;
+    if (flags & COMPACT_FLAG_TIME) {
+        if ((size_t) (end - p) < sizeof(uint32_t)) {
+            strlcpy(errbuf, "compact request: truncated", errbuflen);
+            return false;
+        }
+        time = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        p += sizeof(uint32_t);
+    }
+    if ((size_t) (end - p) < sizeof(uint8_t)) {
+        strlcpy(errbuf, "compact request: truncated", errbuflen);
+        return false;
+    }
+    uint8_t fileLen = *p++;
+    if (fileLen >= COMPACT_FILE_MAX || fileLen >= filelen || (size_t) (end - p) < fileLen + sizeof(uint16_t)) {
+        strlcpy(errbuf, "compact request: truncated", errbuflen);
+        return false;
+    }
+    memcpy(file, p, fileLen);
+    file[fileLen] = '\0';
+    p += fileLen;
+    uint16_t present = p[0] | (p[1] << 8);
+    p += sizeof(uint16_t);
+
+    // Find the template, asking the notecard for it if no sensor has been seen registering it
+    compactTemplate *t = compactFindTemplate(file, false, templateID);
+    if (t == NULL) {
+        J *req = NoteNewRequest("note.template");
+        if (req != NULL) {
+            JAddStringToObject(req, "file", file);
+            JAddBoolToObject(req, "verify", true);
+            J *rsp = authRequest(sensorAddress, sensorName, sensorLocationOLC, req);
+            if (rsp != NULL) {
+                JDelete(req);
+            } else {
+                rsp = NoteRequestResponse(req);
+            }
+            if (rsp != NULL) {
+                J *learn = NoteNewRequest("note.template");
+                if (learn != NULL) {
+                    JAddStringToObject(learn, "file", file);
+                    JAddItemToObject(learn, "body", JDetachItemFromObject(rsp, "body"));
+                    compactLearnTemplate(sensorAddress, learn);
+                    JDelete(learn);
+                }
+                JDelete(rsp);
+            }
+        }
+        t = compactFindTemplate(file, false, templateID);
+        if (t == NULL) {
+            strlcpy(errbuf, "compact request: unknown template", errbuflen);
+            return false;
+        }
+    }
+
+    // Begin the request
+    compactNoteBegin(note, "note.add", file);
+    if (flags & COMPACT_FLAG_SYNC) {
+        compactNoteBool(note, false, "sync", true);
+    }
+    if (flags & COMPACT_FLAG_TIME) {
+        compactNoteNumber(note, false, "time", time);
+    }
+
+    // Unpack the fields
+    for (int i=0; i<t->fields; i++) {
+        if ((present & (1 << i)) == 0) {
+            continue;
+        }
+        const char *name = &t->names[t->nameOffset[i]];
+        uint8_t size = t->type[i] & COMPACT_TYPE_SIZE;
+        if (end - p < size) {
+            strlcpy(errbuf, "compact request: truncated", errbuflen);
+            return false;
+        }
+        uint64_t bits = 0;
+        for (int j=0; j<size; j++) {
+            bits |= ((uint64_t) *p++) << (j*8);
+        }
+        switch (t->type[i] & COMPACT_TYPE_KIND) {
+        case COMPACT_TYPE_BOOL:
+            compactNoteBool(note, true, name, bits != 0);
+            break;
+        case COMPACT_TYPE_FLOAT:
+            if (size == 2) {
+                compactNoteNumber(note, true, name, compactHalfToFloat((uint16_t) bits));
+            } else if (size == 4) {
+                uint32_t value32 = (uint32_t) bits;
+                float value;
+                memcpy(&value, &value32, sizeof(value));
+                compactNoteNumber(note, true, name, value);
+            } else {
+                double value;
+                memcpy(&value, &bits, sizeof(value));
+                compactNoteNumber(note, true, name, value);
+            }
+            break;
+        case COMPACT_TYPE_UNSIGNED:
+            compactNoteNumber(note, true, name, (JNUMBER) bits);
+            break;
+        default:
+            if (size < sizeof(bits) && (bits & ((uint64_t) 1 << ((size*8)-1))) != 0) {
+                bits |= ~(uint64_t)0 << (size*8);
+            }
+            compactNoteNumber(note, true, name, (JNUMBER) (int64_t) bits);
+            break;
+        }
+    }
+
+    return true;
+
+}
+
+// Decode a compact note.add request from a sensor back into JSON, returning NULL
+// with an explanation in errbuf if it cannot be decoded.
+J *compactDecodeRequest(uint8_t *sensorAddress, const char *sensorName, const char *sensorLocationOLC, uint8_t *data, uint32_t len, char *errbuf, uint32_t errbuflen)
+{
+
+    // Decode it
+    compactNote note;
+    char file[COMPACT_FILE_MAX];
+    if (!compactDecodeNote(sensorAddress, sensorName, sensorLocationOLC, data, len, &note, file, sizeof(file), errbuf, errbuflen)) {
+        return NULL;
+    }
+
+    // Create the request
+    J *req = NoteNewRequest(note.req);
+    J *body = JCreateObject();
+    if (req == NULL || body == NULL) {
+        if (req != NULL) {
+            JDelete(req);
+        }
+        if (body != NULL) {
+            JDelete(body);
+        }
+        strlcpy(errbuf, "compact request: insufficient memory", errbuflen);
+        return NULL;
+    }
+    JAddStringToObject(req, "file", note.file);
+    JAddItemToObject(req, "body", body);
+
+    // Add the fields
+    for (int i=0; i<note.items; i++) {
+        compactNoteItem *item = &note.item[i];
+        J *obj = item->inBody ? body : req;
+        switch (item->kind) {
+        case COMPACT_ITEM_BOOL:
+            JAddBoolToObject(obj, item->name, item->value.boolean);
+            break;
+        case COMPACT_ITEM_STRING:
+            JAddStringToObject(obj, item->name, item->value.string);
+            break;
+        default:
+            JAddNumberToObject(obj, item->name, item->value.number);
+            break;
+        }
+    }
+
+    return req;
+
+}
+
+// Add the fields of a health note to its body, or to its template
+void compactHealthBody(J *body, const char *sensor, const char *name, compactHealth *h, bool template)
+{
+    static const char * const modeNames[COMPACT_HEALTH_MODES] = { "run_pct", "sleep_pct", "stop2_pct", "off_pct" };
+    static const char * const wakeNames[COMPACT_HEALTH_WAKES] = { "wake_rtc", "wake_exti", "wake_radio", "wake_uart", "wake_other" };
+    uint16_t millivolts = 0;
+    int8_t ltp = 0;
+    int8_t gtxdb = 0, grssi = 0, grsnr = 0, stxdb = 0, srssi = 0, srsnr = 0;
+    if (!template) {
+        appReceivedMessageSensor(&millivolts, &ltp);
+        appReceivedMessageStats(&gtxdb, &grssi, &grsnr, &stxdb, &srssi, &srsnr);
+    }
+    JAddStringToObject(body, "sensor", template ? TSTRING(40) : sensor);
+    JAddStringToObject(body, "name", template ? TSTRING(40) : name);
+    JAddNumberToObject(body, "mv", template ? TINT16 : millivolts);
+    JAddNumberToObject(body, "gtxdb", template ? TINT8 : gtxdb);
+    JAddNumberToObject(body, "grssi", template ? TINT16 : grssi);
+    JAddNumberToObject(body, "grsnr", template ? TINT8 : grsnr);
+    JAddNumberToObject(body, "stxdb", template ? TINT8 : stxdb);
+    JAddNumberToObject(body, "srssi", template ? TINT16 : srssi);
+    JAddNumberToObject(body, "srsnr", template ? TINT8 : srsnr);
+    JAddNumberToObject(body, "ltp", template ? TINT8 : ltp);
+    JAddNumberToObject(body, "uptime_secs", template ? TINT32 : h->UptimeSecs);
+    for (int i=0; i<COMPACT_HEALTH_MODES; i++) {
+        JAddNumberToObject(body, modeNames[i], template ? TFLOAT16 : ((JNUMBER) h->ModePermille[i]) / 10);
+    }
+    for (int i=0; i<COMPACT_HEALTH_WAKES; i++) {
+        JAddNumberToObject(body, wakeNames[i], template ? TINT32 : h->Wakes[i]);
+    }
+    JAddNumberToObject(body, "tx_ms", template ? TINT32 : h->TxMs);
+    JAddNumberToObject(body, "tx_mj", template ? TINT32 : h->TxMicrojoules / 1000);
+    JAddNumberToObject(body, "rx_ms", template ? TINT32 : h->RxMs);
+    JAddNumberToObject(body, "cpu_ms", template ? TINT32 : h->AwakeMs);
+}
+
+// Register the template of the health notefile on the Notecard
+bool compactHealthRegisterTemplate()
+{
+    J *req = NoteNewRequest("note.template");
+    if (req == NULL) {
+        return false;
+    }
+    JAddStringToObject(req, "file", HEALTH_NOTEFILE);
+    J *body = JCreateObject();
+    if (body == NULL) {
+        JDelete(req);
+        return false;
+    }
+    compactHealthBody(body, NULL, NULL, NULL, true);
+    JAddItemToObject(req, "body", body);
+    return NoteRequest(req);
+}
+
+// Expand a sensor's health record into the note.add of a health note, along with the battery
+// and signal of the message that carried it, returning NULL with an explanation in errbuf if
+// it cannot be decoded.  When sensor requests go to the wired uplink, the computer is left to
+// make of the note what it will, and no template is registered.
+J *compactDecodeHealth(uint8_t *sensorAddress, const char *sensorName, uint8_t *data, uint32_t len, char *errbuf, uint32_t errbuflen)
+{
+
+    // Decode it
+    if (len < sizeof(compactHealth) || data[0] != COMPACT_HEALTH) {
+        strlcpy(errbuf, "health record: invalid", errbuflen);
+        return NULL;
+    }
+    compactHealth h;
+    memcpy(&h, data, sizeof(h));
+
+    // Register the template the first time that it's needed
+    if (!healthTemplateRegistered && !uplinkIsActive()) {
+        healthTemplateRegistered = compactHealthRegisterTemplate();
+    }
+
+    // Create the request
+    J *req = NoteNewRequest("note.add");
+    J *body = JCreateObject();
+    if (req == NULL || body == NULL) {
+        if (req != NULL) {
+            JDelete(req);
+        }
+        if (body != NULL) {
+            JDelete(body);
+        }
+        strlcpy(errbuf, "health record: insufficient memory", errbuflen);
+        return NULL;
+    }
+    JAddStringToObject(req, "file", HEALTH_NOTEFILE);
+    JAddNumberToObject(req, "id", h.RequestID);
+    if (h.Time != 0) {
+        JAddNumberToObject(req, "time", h.Time);
+    }
+    if ((h.Flags & COMPACT_HEALTH_SYNC) != 0) {
+        JAddBoolToObject(req, "sync", true);
+    }
+    char sensor[ADDRESS_LEN*3];
+    utilAddressToText(sensorAddress, sensor, sizeof(sensor));
+    compactHealthBody(body, sensor, sensorName, &h, false);
+    JAddItemToObject(req, "body", body);
+    return req;
+
+}
+
+// Convert a float to IEEE 754 half precision, rounding to nearest
+uint16_t compactFloatToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t mantissa = bits & 0x007fffff;
+    if (((bits >> 23) & 0xff) == 0xff) {
+        return sign | 0x7c00 | (mantissa != 0 ? 0x0200 : 0);
+    }
+    int32_t exponent = (int32_t) ((bits >> 23) & 0xff) - 127 + 15;
+    if (exponent >= 31) {
+        return sign | 0x7c00;
+    }
+    if (exponent <= 0) {
+        if (exponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x00800000;
+        uint32_t shift = 14 - exponent;
+        uint16_t half = mantissa >> shift;
+        if ((mantissa >> (shift-1)) & 1) {
+            half++;
+        }
+        return sign | half;
+    }
+    uint16_t half = sign | (exponent << 10) | (mantissa >> 13);
+    if (mantissa & 0x00001000) {
+        half++;
+    }
+    return half;
+}
+
+// Convert an IEEE 754 half precision value to a float
+float compactHalfToFloat(uint16_t half)
+{
+    uint32_t sign = ((uint32_t) half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x03ff;
+    uint32_t bits;
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            bits = sign;
+        } else {
+            exponent = 127 - 15 + 1;
+            while ((mantissa & 0x0400) == 0) {
+                mantissa <<= 1;
+                exponent--;
+            }
+            bits = sign | (exponent << 23) | ((mantissa & 0x03ff) << 13);
+        }
+    } else if (exponent == 31) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Format the prefix that advertises a sensor's schedule to its gateway, returning its length,
+// which is at most COMPACT_SCHEDULE_MAX
+uint32_t compactEncodeSchedule(uint8_t *prefix, uint32_t periodSecs, uint32_t dueSecs)
+{
+    uint32_t len = 0;
+    prefix[len++] = COMPACT_SCHEDULE;
+    len += wirePutVarint(&prefix[len], periodSecs);
+    len += wirePutVarint(&prefix[len], dueSecs);
+    return len;
+}
+
+// Find the length of the schedule prefix that a request begins with, extracting what it
+// advertises, returning 0 if it has none or if it is malformed
+uint32_t compactDecodeSchedule(uint8_t *data, uint32_t len, uint32_t *periodSecs, uint32_t *dueSecs)
+{
+    if (data == NULL || len == 0 || data[0] != COMPACT_SCHEDULE) {
+        return 0;
+    }
+    uint8_t *p = &data[1];
+    uint32_t period, due;
+    if (!wireGetVarint(&p, &data[len], &period) || !wireGetVarint(&p, &data[len], &due)) {
+        return 0;
+    }
+    if (periodSecs != NULL) {
+        *periodSecs = period;
+    }
+    if (dueSecs != NULL) {
+        *dueSecs = due;
+    }
+    return (uint32_t) (p - data);
+}
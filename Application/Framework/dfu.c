@@ -5,6 +5,70 @@
 #include "main.h"
 #include "framework.h"
 
+// MD5 of the active image, computed the first time an image is offered.  The active image
+// only changes across a reset, so there's no need to rehash it on every dfu.status poll.
+static char activeImageMD5[NOTE_MD5_HASH_STRING_SIZE] = {0};
+
+// Buffer into which each chunk is decoded, doubleword-aligned so that a full page can be
+// programmed straight from it, and with room for the slack in JB64DecodeLen().  It is only
+// allocated for the duration of a transfer.
+#define DFU_CHUNK_BUFFER_BYTES (((FLASH_PAGE_SIZE/sizeof(uint64_t))+2)*sizeof(uint64_t))
+
+// Forwards
+uint32_t dfuCompressedImageLen(uint8_t *image, uint32_t imageLen, uint32_t maxBytes);
+bool dfuTransfer(uint8_t *flashCodeActiveBase, uint8_t *flashCodeDFUBase, uint32_t flashCodeMaxBytes,
+                 uint32_t imageLength, const char *imageMD5, uint64_t *chunkBuffer);
+
+// Validate the token stream of a compressed image (see dfuload.c) without decompressing it, so
+// that dfuLoaderLZ() needn't check it as it goes.  Every match must reach back only into output
+// already produced, and never into page 1, and the output must be exactly the raw length, which
+// is returned.  Returns 0 if the image isn't a valid compressed image.
+uint32_t dfuCompressedImageLen(uint8_t *image, uint32_t imageLen, uint32_t maxBytes)
+{
+    uint32_t header[DFU_LZ_HEADER_BYTES/sizeof(uint32_t)];
+    if (imageLen < DFU_LZ_HEADER_BYTES) {
+        return 0;
+    }
+    memcpy(header, image, sizeof(header));
+    uint32_t rawLen = header[1];
+    if (header[0] != DFU_LZ_MAGIC || rawLen == 0 || rawLen > maxBytes || header[2] != imageLen - DFU_LZ_HEADER_BYTES) {
+        return 0;
+    }
+    uint8_t *in = &image[DFU_LZ_HEADER_BYTES];
+    uint8_t *end = &image[imageLen];
+    uint32_t out = 0;
+    while (in < end) {
+        uint8_t c = *in++;
+        uint32_t len;
+        if (c < 0x80) {
+            len = (uint32_t) c + 1;
+            if (len > (uint32_t) (end - in)) {
+                return 0;
+            }
+            in += len;
+        } else {
+            len = (uint32_t) (c & 0x7f) + 3;
+            if (end - in < 2) {
+                return 0;
+            }
+            uint32_t distance = (uint32_t) in[0] | ((uint32_t) in[1] << 8);
+            in += 2;
+            if (distance == 0 || distance > out) {
+                return 0;
+            }
+            uint32_t from = out - distance;
+            if (from < 2*FLASH_PAGE_SIZE && from+len > FLASH_PAGE_SIZE) {
+                return 0;
+            }
+        }
+        out += len;
+        if (out > rawLen) {
+            return 0;
+        }
+    }
+    return (out == rawLen) ? rawLen : 0;
+}
+
 // Check to see if a firmware update is available, and perform the update if it is.  If
 // the update isn't available, return false.  If the update was available but the update
 // failed for whatever reason, return true.  (When true is returned, the hub mode must
@@ -22,7 +86,6 @@ bool noteFirmwareUpdateIfAvailable()
     bool imageIsReady = false;
     bool imageIsSameAsCurrent = false;
     char imageMD5[NOTE_MD5_HASH_STRING_SIZE] = {0};
-    char currentMD5[NOTE_MD5_HASH_STRING_SIZE] = {0};
     uint32_t imageLength = 0;
     J *rsp = NoteRequestResponse(NoteNewRequest("dfu.status"));
     if (rsp != NULL) {
@@ -36,9 +99,10 @@ bool noteFirmwareUpdateIfAvailable()
                     return false;
                 }
                 strlcpy(imageMD5, JGetString(body, "md5"), sizeof(imageMD5));
-                uint32_t currentImageSize = MX_Image_Size();
-                NoteMD5HashString(flashCodeActiveBase, currentImageSize, currentMD5, sizeof(currentMD5));
-                imageIsSameAsCurrent = (strcmp(currentMD5, imageMD5) == 0);
+                if (activeImageMD5[0] == '\0') {
+                    NoteMD5HashString(flashCodeActiveBase, MX_Image_Size(), activeImageMD5, sizeof(activeImageMD5));
+                }
+                imageIsSameAsCurrent = (strcmp(activeImageMD5, imageMD5) == 0);
                 if (imageIsSameAsCurrent) {
                     // Tell the notecard that the DFU is completed
 #ifndef DFU_TESTING
@@ -61,6 +125,25 @@ bool noteFirmwareUpdateIfAvailable()
         return false;
     }
 
+    // Take the buffer for the chunks, which is held only while the image is transferred, and
+    // perform the update
+    uint64_t *chunkBuffer = (uint64_t *) poolAlloc(DFU_CHUNK_BUFFER_BYTES);
+    if (chunkBuffer == NULL) {
+        APP_PRINTF("dfu: insufficient memory\r\n");
+        return false;
+    }
+    bool result = dfuTransfer(flashCodeActiveBase, flashCodeDFUBase, flashCodeMaxBytes, imageLength, imageMD5, chunkBuffer);
+    poolFree(chunkBuffer);
+    return result;
+
+}
+
+// Transfer an image from the Notecard into the DFU partition a chunk at a time, and if it is
+// valid, copy it to the active partition, returning true if it fails
+bool dfuTransfer(uint8_t *flashCodeActiveBase, uint8_t *flashCodeDFUBase, uint32_t flashCodeMaxBytes,
+                 uint32_t imageLength, const char *imageMD5, uint64_t *chunkBuffer)
+{
+
     // Compute the number of pages that the image will take
     uint32_t flashCodePages = (imageLength / FLASH_PAGE_SIZE);
     if ((imageLength % FLASH_PAGE_SIZE) != 0) {
@@ -122,7 +205,7 @@ bool noteFirmwareUpdateIfAvailable()
         // If anywhere, this is the location of the highest probability of I/O error
         // on the I2C or serial bus, simply because of the amount of data being transferred.
         // As such, it's a conservative measure just to retry.
-        char *payload = NULL;
+        uint8_t *payload = NULL;
         for (int retry=0; retry<5; retry++) {
             APP_PRINTF("dfu: reading chunk (offset:%d length:%d try:%d)\r\n", offset, thislen, retry+1);
             // Request the next chunk from the notecard
@@ -150,24 +233,21 @@ bool noteFirmwareUpdateIfAvailable()
                     NoteDeleteResponse(rsp);
                     return true;
                 }
-                payload = (char *) malloc(JB64DecodeLen(payloadB64));
-                if (payload == NULL) {
-                    APP_PRINTF("dfu: can't allocate payload decode buffer\r\n");
+                if ((size_t) JB64DecodeLen(payloadB64) > DFU_CHUNK_BUFFER_BYTES) {
+                    APP_PRINTF("dfu: payload too large for decode buffer\r\n");
                     NoteDeleteResponse(rsp);
                     return true;
                 }
-                int actuallen = JB64Decode(payload, payloadB64);
-                const char *expectedMD5 = JGetString(rsp, "status");;
+                int actuallen = JB64Decode((char *) chunkBuffer, payloadB64);
+                const char *expectedMD5 = JGetString(rsp, "status");
                 char chunkMD5[NOTE_MD5_HASH_STRING_SIZE] = {0};
-                NoteMD5HashString((uint8_t *)payload, actuallen, chunkMD5, sizeof(chunkMD5));
+                NoteMD5HashString((uint8_t *) chunkBuffer, actuallen, chunkMD5, sizeof(chunkMD5));
                 if (actuallen == thislen && strcmp(chunkMD5, expectedMD5) == 0) {
+                    payload = (uint8_t *) chunkBuffer;
                     NoteDeleteResponse(rsp);
                     break;
                 }
 
-                free(payload);
-                payload = NULL;
-
                 if (thislen != actuallen) {
                     APP_PRINTF("dfu: decoded data not the correct length (%d != actual %d)", thislen, actuallen);
                 } else {
@@ -185,17 +265,15 @@ bool noteFirmwareUpdateIfAvailable()
         }
 
         // MD5 the chunk
-        NoteMD5Update(&md5Context, (uint8_t *)payload, thislen);
+        NoteMD5Update(&md5Context, payload, thislen);
 
         // Write the chunk
         bool success = flashWrite(&flashCodeDFUBase[offset], payload, thislen);
         if (!success) {
-            free(payload);
             return true;
         }
 
         // Move to next chunk
-        free(payload);
         APP_PRINTF("dfu: successfully transferred offset:%d len:%d\r\n", offset, thislen);
         offset += thislen;
         left -= thislen;
@@ -232,7 +310,29 @@ bool noteFirmwareUpdateIfAvailable()
     }
 #endif
 
-    // Jump to the DFU copying method
+    // A compressed image is decompressed into the active partition by the loader, which must be
+    // one that can, because the loader in page 1 is never itself replaced by an update
+    bool compressed = (imageLength >= sizeof(uint32_t) && *((uint32_t *) flashCodeDFUBase) == DFU_LZ_MAGIC);
+    uint32_t rawLength = 0;
+    if (compressed) {
+        rawLength = dfuCompressedImageLen(flashCodeDFUBase, imageLength, flashCodeMaxBytes);
+        if (rawLength == 0) {
+            APP_PRINTF("dfu: compressed image is invalid\r\n");
+            return true;
+        }
+        volatile const dfuLoaderInfo *resident = &dfuLoaderResident;
+        if (resident->magic != DFU_LZ_MAGIC || resident->loaderLZ != dfuLoaderLZ) {
+            APP_PRINTF("dfu: resident loader can't decompress images\r\n");
+            return true;
+        }
+    }
+
+    // Keep what the gateway knows of its sensors for the new image, then jump to the DFU copying method
+    appGatewaySnapshotSave();
+    if (compressed) {
+        APP_PRINTF("dfu: decompress %d bytes to %d in active partition", imageLength, rawLength);
+        dfuLoaderLZ(flashCodeActiveBase, flashCodeDFUBase, chunkBuffer);
+    }
     APP_PRINTF("dfu: copy %d pages to active partition", flashCodePages);
     dfuLoader(flashCodeActiveBase, flashCodeDFUBase, flashCodePages);
 
@@ -2,6 +2,7 @@
 // Use of this source code is governed by licenses granted by the
 // copyright holder including that found in the LICENSE file.
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -14,11 +15,22 @@
 // future versions of itself is that it will always, always have this
 // method in page 1.  Period.
 //
-// This is the one and only function published by this source file.  The
-// reason we don't use any #includes above is to prevent one from inadvertently
-// referencing some other method that isn't in this Flash Page 1.
+// This is the one and only function published by this source file, along
+// with the LZ variant below.  The reason we don't use any #includes above is
+// to prevent one from inadvertently referencing some other method that isn't
+// in this Flash Page 1.
 void dfuLoader(uint8_t *flashDest, uint8_t *source, uint32_t pages);
 
+// A compressed image begins with a header of three little-endian words: the
+// magic "SPLZ", the length of the raw image, and the length of the token stream
+// that follows.  Each token begins with a control byte c.  If c < 0x80, then
+// c+1 literal bytes follow; otherwise a match of (c & 0x7f)+3 bytes follows as
+// a 16-bit little-endian distance back from the current output position.  A
+// match must never reach into page 1, which isn't written, and the stream is
+// validated by the running image before the loader is called.
+void dfuLoaderLZ(uint8_t *flashDest, uint8_t *source, uint64_t *pageBuffer);
+#define LZ_HEADER_BYTES 12
+
 // Ensure that this code is put into the linker section because it will remain in-place
 // and won't be overwritten by itself.  Note that if you define DEPENDENCY_TEST this
 // will temporarily define these all as ramfunc's, which has the benefit that you
@@ -29,6 +41,21 @@ void dfuLoader(uint8_t *flashDest, uint8_t *source, uint32_t pages);
 #else
 #define DFULOADER_FUNC __attribute__((__section__(".dfuloader")))
 #endif
+#define DFULOADER_DATA __attribute__((__section__(".dfuloader_info")))
+
+// Because page 1 is never replaced by an update, a running image must not assume that the
+// resident loader is the one that it was built with.  This record, which the linker places in
+// page 1 after the loader's code (a section of its own, because data can't share a section
+// with code), and which must match framework.h, is how it tells that the resident loader can
+// decompress.
+typedef struct {
+    uint32_t magic;
+    void (*loaderLZ)(uint8_t *dst, uint8_t *src, uint64_t *pageBuffer);
+} dfuLoaderInfo;
+const dfuLoaderInfo DFULOADER_DATA dfuLoaderResident = {
+    .magic = 0x5a4c5053,
+    .loaderLZ = dfuLoaderLZ,
+};
 
 // Forwards to local copies of HAL methods
 static void local__NVIC_SystemReset(void);
@@ -40,9 +67,11 @@ static void local_FLASH_AcknowledgePageErase(void);
 static void local_FLASH_FlushCaches(void);
 static void local_HAL_FLASH_Program(uint32_t Address, uint64_t Data);
 static void local_FLASH_Program_DoubleWord(uint32_t Address, uint64_t Data);
+static bool local_PageSame(uint64_t *a, uint64_t *b);
 
-// Transfer pages from source to destination, safely skipping THIS code's page.  The src and dst
-// must be aligned on a page boundary.
+// Transfer pages from source to destination, safely skipping THIS code's page and any page that
+// is already the same, so that only the pages that changed are exposed to a loss of power.  The
+// src and dst must be aligned on a page boundary.
 void DFULOADER_FUNC dfuLoader(uint8_t *flashDst, uint8_t *flashSrc, uint32_t pages)
 {
 
@@ -59,8 +88,10 @@ void DFULOADER_FUNC dfuLoader(uint8_t *flashDst, uint8_t *flashSrc, uint32_t pag
     // Loop, copying pages
     for (size_t page=0; page<pages; page++) {
 
-        // Skip the current page that contains this code
-        if (page == 1) {
+        // Skip the current page that contains this code, and pages that haven't changed
+        uint64_t *sourceDoubleWord = (uint64_t *) (flashSrc + (FLASH_PAGE_SIZE * page));
+        uint8_t *destPageBase = (uint8_t *) (flashDst + (FLASH_PAGE_SIZE * page));
+        if (page == 1 || local_PageSame(sourceDoubleWord, (uint64_t *) destPageBase)) {
             continue;
         }
 
@@ -68,8 +99,6 @@ void DFULOADER_FUNC dfuLoader(uint8_t *flashDst, uint8_t *flashSrc, uint32_t pag
         local_HAL_FLASHEx_Erase(page, 1);
 
         // Program the page
-        uint64_t *sourceDoubleWord = (uint64_t *) (flashSrc + (FLASH_PAGE_SIZE * page));
-        uint8_t *destPageBase = (uint8_t *) (flashDst + (FLASH_PAGE_SIZE * page));
         for (size_t i=0; i<FLASH_PAGE_SIZE; i+=8) {
             local_HAL_FLASH_Program((uint32_t)(&destPageBase[i]), sourceDoubleWord[i/8]);
         }
@@ -81,6 +110,88 @@ void DFULOADER_FUNC dfuLoader(uint8_t *flashDst, uint8_t *flashSrc, uint32_t pag
 
 }
 
+// Decompress an image from source to destination a page at a time, through a page buffer in RAM,
+// safely skipping THIS code's page.  A match that reaches back beyond the page being built is
+// read from the destination, whose earlier pages have already been programmed.
+void DFULOADER_FUNC dfuLoaderLZ(uint8_t *flashDst, uint8_t *flashSrc, uint64_t *pageBuffer)
+{
+
+    // Disable interrupts, because we'll be stepping on the interrupt vectors
+    __disable_irq();
+
+    // Unlock the program memory
+    local_HAL_FLASH_Unlock();
+
+    // Clear all FLASH flags
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_PGSERR | FLASH_FLAG_WRPERR | FLASH_FLAG_OPTVERR);
+
+    // Loop, decoding tokens
+    uint32_t *header = (uint32_t *) flashSrc;
+    uint32_t rawLen = header[1];
+    uint8_t *in = flashSrc + LZ_HEADER_BYTES;
+    uint8_t *inEnd = in + header[2];
+    uint8_t *page = (uint8_t *) pageBuffer;
+    uint32_t pageStart = 0;
+    uint32_t out = 0;
+    while (out < rawLen && in < inEnd) {
+        uint8_t c = *in++;
+        bool literal = (c < 0x80);
+        uint32_t len = literal ? (uint32_t) c + 1 : (uint32_t) (c & 0x7f) + 3;
+        uint32_t from = 0;
+        if (!literal) {
+            from = out - ((uint32_t) in[0] | ((uint32_t) in[1] << 8));
+            in += 2;
+        }
+        while (len-- > 0 && out < rawLen) {
+
+            // Produce the next byte
+            uint8_t b;
+            if (literal) {
+                b = *in++;
+            } else {
+                b = (from >= pageStart) ? page[from - pageStart] : flashDst[from];
+                from++;
+            }
+            page[out - pageStart] = b;
+            out++;
+
+            // Program the page when it's full, or when the image is complete
+            if (out - pageStart == FLASH_PAGE_SIZE || out == rawLen) {
+                for (size_t i=out-pageStart; i<FLASH_PAGE_SIZE; i++) {
+                    page[i] = 0xff;
+                }
+                uint32_t pageIndex = pageStart / FLASH_PAGE_SIZE;
+                uint8_t *destPageBase = flashDst + pageStart;
+                if (pageIndex != 1 && !local_PageSame(pageBuffer, (uint64_t *) destPageBase)) {
+                    local_HAL_FLASHEx_Erase(pageIndex, 1);
+                    for (size_t i=0; i<FLASH_PAGE_SIZE; i+=8) {
+                        local_HAL_FLASH_Program((uint32_t)(&destPageBase[i]), pageBuffer[i/8]);
+                    }
+                    local_FLASH_FlushCaches();
+                }
+                pageStart += FLASH_PAGE_SIZE;
+            }
+
+        }
+    }
+
+    // Restart and run the new firmware
+    local__NVIC_SystemReset();
+
+}
+
+// See whether two pages are the same
+static bool DFULOADER_FUNC local_PageSame(uint64_t *a, uint64_t *b)
+{
+    for (size_t i=0; i<FLASH_PAGE_SIZE/8; i++) {
+        if (a[i] != b[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
 // Reboot
 static void DFULOADER_FUNC local__NVIC_SystemReset(void)
 {
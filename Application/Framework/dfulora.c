@@ -0,0 +1,405 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Sensor firmware update over LoRa.  Gateways and sensors run the same image, so a gateway
+// that has taken an update via dfu.c can pass it along to its sensors.  A gateway built for
+// the gateway role alone runs an image that can't act as a sensor, so it never offers its
+// image, and its sensors must be updated some other way.  When the gateway's
+// sensor_dfu env var is set, every ACK carries the CRC-32 and length of the gateway's active
+// image.  A sensor whose own image differs pulls it, one block per request in its own transmit
+// window, staging it in its DFU partition a page at a time.  Each block carries its own CRC,
+// and the staged image must match the advertised CRC before it is copied by dfuLoader().
+//
+// Most of a new release is usually the same as the image that it replaces, block for block.
+// With each request the sensor sends the CRCs of the blocks of its own image that follow, and
+// the gateway answers with how many bytes of those it already holds and then the first block
+// that differs.  The sensor stages what it holds from its own active image, which is untouched
+// until dfuLoader() runs, so only the blocks that changed are sent over the air.
+
+#include "main.h"
+#include "framework.h"
+
+// States for the sensor's local state machine
+#define STATE_REQUEST_BLOCK         0
+
+// Gateway state
+uint32_t var_gateway_sensor_dfu = 0;
+static uint32_t gatewayImageCRC = 0;
+
+// Sensor state
+static int appID = -1;
+static uint32_t ourImageCRC = 0;
+static uint32_t targetImageCRC = 0;
+static uint32_t targetImageLen = 0;
+static uint32_t stagedImageCRC = 0;
+static uint32_t stagedLen = 0;
+static uint8_t *pageBuffer = NULL;
+
+// Forwards
+void dfuLoraEnabledChanged(const char *name);
+bool dfuLoraActivate(int appID, void *appContext);
+void dfuLoraPoll(int appID, int state, void *appContext);
+void dfuLoraResponse(int appID, J *rsp, void *appContext);
+void dfuLoraRestart(void);
+uint32_t dfuLoraBlockLen(uint32_t offset, uint32_t imageLen);
+bool dfuLoraStage(const uint8_t *data, uint32_t len);
+bool dfuLoraStagePage(uint32_t pageOffset, uint32_t pageLen);
+
+// Register the env var that enables updating sensors from the gateway's image
+void dfuLoraGatewayInit()
+{
+    gatewayEnvVarRegisterInt(VAR_GATEWAY_SENSOR_DFU, &var_gateway_sensor_dfu, DEFAULT_GATEWAY_SENSOR_DFU, dfuLoraEnabledChanged);
+}
+
+// Compute the CRC of the active image when sensor updates are first enabled, so that it isn't
+// done while sending an ACK.
+void dfuLoraEnabledChanged(const char *name)
+{
+    if (SPARROW_ROLE != SPARROW_ROLE_ANY) {
+        if (var_gateway_sensor_dfu != 0) {
+            APP_PRINTF("dfu: this gateway-only image can't be offered to sensors\r\n");
+        }
+        return;
+    }
+    if (var_gateway_sensor_dfu != 0 && gatewayImageCRC == 0) {
+        uint8_t *activeBase, *dfuBase;
+        uint32_t maxBytes, maxPages;
+        flashCodeParams(&activeBase, &dfuBase, &maxBytes, &maxPages);
+        gatewayImageCRC = utilCRC32(0, activeBase, MX_Image_Size());
+        APP_PRINTF("dfu: offering image %08x (%d bytes) to sensors\r\n", gatewayImageCRC, MX_Image_Size());
+    }
+}
+
+// Get the length of the block of the image at this offset, which never crosses a page boundary
+uint32_t dfuLoraBlockLen(uint32_t offset, uint32_t imageLen)
+{
+    uint32_t length = imageLen - offset;
+    if (length > DFU_LORA_BLOCK_BYTES) {
+        length = DFU_LORA_BLOCK_BYTES;
+    }
+    if (length > FLASH_PAGE_SIZE - (offset % FLASH_PAGE_SIZE)) {
+        length = FLASH_PAGE_SIZE - (offset % FLASH_PAGE_SIZE);
+    }
+    return length;
+}
+
+// Get the image that the gateway is offering to sensors, returning false if none
+bool dfuLoraGatewayImage(uint32_t *imageCRC, uint32_t *imageLen)
+{
+    if (SPARROW_ROLE != SPARROW_ROLE_ANY || var_gateway_sensor_dfu == 0 || gatewayImageCRC == 0) {
+        *imageCRC = 0;
+        *imageLen = 0;
+        return false;
+    }
+    *imageCRC = gatewayImageCRC;
+    *imageLen = MX_Image_Size();
+    return true;
+}
+
+// Perform a sensor's request for a block of the gateway's image
+J *dfuLoraGatewayRequest(J *req)
+{
+    J *rsp = JCreateObject();
+    if (rsp == NULL) {
+        return NULL;
+    }
+
+    // Validate the request against what we're offering
+    uint32_t imageCRC, imageLen;
+    uint32_t offset = (uint32_t) JGetInt(req, "offset");
+    uint32_t length = (uint32_t) JGetInt(req, "length");
+    if (!dfuLoraGatewayImage(&imageCRC, &imageLen)) {
+        JAddStringToObject(rsp, "err", "sensor firmware update isn't enabled");
+        return rsp;
+    }
+    if ((uint32_t) JGetInt(req, "image") != imageCRC) {
+        JAddStringToObject(rsp, "err", "image is no longer available");
+        return rsp;
+    }
+    if (offset >= imageLen || length == 0 || length > DFU_LORA_BLOCK_BYTES) {
+        JAddStringToObject(rsp, "err", "block is out of range");
+        return rsp;
+    }
+    if (length > imageLen - offset) {
+        length = imageLen - offset;
+    }
+
+    // Skip the blocks that the sensor already holds, whose CRCs it sent in the order that they
+    // follow in its own image
+    uint8_t *activeBase, *dfuBase;
+    uint32_t maxBytes, maxPages;
+    flashCodeParams(&activeBase, &dfuBase, &maxBytes, &maxPages);
+    uint32_t same = 0;
+    J *have = JGetObjectItem(req, "have");
+    for (int i=0; i<JGetArraySize(have) && offset+same < imageLen; i++) {
+        uint32_t blockLen = dfuLoraBlockLen(offset+same, imageLen);
+        if ((uint32_t) JNumberValue(JGetArrayItem(have, i)) != utilCRC32(0, &activeBase[offset+same], blockLen)) {
+            break;
+        }
+        same += blockLen;
+    }
+    JAddNumberToObject(rsp, "image", imageCRC);
+    JAddNumberToObject(rsp, "offset", offset);
+    if (same > 0) {
+        JAddNumberToObject(rsp, "same", same);
+        if (offset+same == imageLen) {
+            APP_PRINTF("%s dfu: sensor holds the rest of the image\r\n", tracePeer());
+            return rsp;
+        }
+        length = dfuLoraBlockLen(offset+same, imageLen);
+    }
+
+    // Encode the first block that differs directly from the active image
+    char *payload = (char *) poolAlloc(JB64EncodeLen(length));
+    if (payload == NULL) {
+        JDelete(rsp);
+        return NULL;
+    }
+    JB64Encode(payload, (const char *) &activeBase[offset+same], length);
+    JAddNumberToObject(rsp, "crc", utilCRC32(0, &activeBase[offset+same], length));
+    JAddStringToObject(rsp, "payload", payload);
+    poolFree(payload);
+    APP_PRINTF("%s dfu: sent block %d/%d (%d bytes held)\r\n", tracePeer(), offset+same+length, imageLen, same);
+    return rsp;
+
+}
+
+// Register the sensor's update app
+bool dfuLoraSensorInit()
+{
+    schedAppConfig config = {
+        .name = "dfu",
+        .activationPeriodSecs = DFU_LORA_CHECK_SECS,
+        .pollPeriodSecs = 1,
+        .activateFn = dfuLoraActivate,
+        .interruptFn = NULL,
+        .pollFn = dfuLoraPoll,
+        .responseFn = dfuLoraResponse,
+    };
+    appID = schedRegisterApp(&config);
+    return (appID >= 0);
+}
+
+// Note the image advertised in an ACK from the gateway
+void dfuLoraSensorAck(uint32_t imageCRC, uint32_t imageLen)
+{
+    if (imageCRC != 0 && ourImageCRC == 0) {
+        uint8_t *activeBase, *dfuBase;
+        uint32_t maxBytes, maxPages;
+        flashCodeParams(&activeBase, &dfuBase, &maxBytes, &maxPages);
+        ourImageCRC = utilCRC32(0, activeBase, MX_Image_Size());
+    }
+    if (imageCRC != targetImageCRC) {
+        targetImageCRC = imageCRC;
+        targetImageLen = imageLen;
+        dfuLoraRestart();
+        if (imageCRC != 0 && imageCRC != ourImageCRC) {
+            schedActivateNowFromISR(appID, false, STATE_ACTIVATED);
+        }
+    }
+}
+
+// Discard whatever has been staged
+void dfuLoraRestart()
+{
+    stagedImageCRC = 0;
+    stagedLen = 0;
+    if (pageBuffer != NULL) {
+        poolFree(pageBuffer);
+        pageBuffer = NULL;
+    }
+}
+
+// Activate only when the gateway is offering an image different from ours
+bool dfuLoraActivate(int appID, void *appContext)
+{
+    if (targetImageCRC == 0 || targetImageCRC == ourImageCRC) {
+        return false;
+    }
+    uint8_t *activeBase, *dfuBase;
+    uint32_t maxBytes, maxPages;
+    flashCodeParams(&activeBase, &dfuBase, &maxBytes, &maxPages);
+    if (targetImageLen == 0 || targetImageLen > maxBytes) {
+        return false;
+    }
+    return true;
+}
+
+// Request the next block of the image
+void dfuLoraPoll(int appID, int state, void *appContext)
+{
+
+    switch (state) {
+
+    case STATE_ACTIVATED:
+    case STATE_REQUEST_BLOCK: {
+
+        // Begin a new image, or resume the one that was in progress
+        if (stagedImageCRC != targetImageCRC) {
+            dfuLoraRestart();
+            stagedImageCRC = targetImageCRC;
+            APP_PRINTF("dfu: receiving image %08x (%d bytes) from gateway\r\n", targetImageCRC, targetImageLen);
+        }
+        if (pageBuffer == NULL) {
+            pageBuffer = (uint8_t *) poolAlloc(FLASH_PAGE_SIZE);
+            if (pageBuffer == NULL) {
+                schedSetState(appID, STATE_DEACTIVATED, "dfu: can't allocate page buffer");
+                break;
+            }
+            // Resume at the start of the page being staged, whose blocks were discarded
+            stagedLen -= (stagedLen % FLASH_PAGE_SIZE);
+        }
+
+        // Request the block, never crossing a page boundary
+        J *req = NoteNewRequest(DFU_LORA_REQUEST);
+        if (req == NULL) {
+            schedSetState(appID, STATE_DEACTIVATED, "dfu: can't allocate request");
+            break;
+        }
+        JAddNumberToObject(req, "image", targetImageCRC);
+        JAddNumberToObject(req, "offset", stagedLen);
+        JAddNumberToObject(req, "length", dfuLoraBlockLen(stagedLen, targetImageLen));
+
+        // Send the CRCs of the blocks of our own image that follow, so that the gateway need
+        // send only those that differ
+        J *have = (DFU_LORA_DELTA_BLOCKS > 0) ? JAddArrayToObject(req, "have") : NULL;
+        if (have != NULL) {
+            uint8_t *activeBase, *dfuBase;
+            uint32_t maxBytes, maxPages;
+            flashCodeParams(&activeBase, &dfuBase, &maxBytes, &maxPages);
+            uint32_t offset = stagedLen;
+            for (int i=0; i<DFU_LORA_DELTA_BLOCKS && offset < targetImageLen; i++) {
+                uint32_t blockLen = dfuLoraBlockLen(offset, targetImageLen);
+                JAddItemToArray(have, JCreateNumber(utilCRC32(0, &activeBase[offset], blockLen)));
+                offset += blockLen;
+            }
+        }
+        noteSendToGatewayAsync(req, true);
+        schedSetCompletionState(appID, STATE_REQUEST_BLOCK, STATE_DEACTIVATED);
+        break;
+    }
+
+    }
+
+}
+
+// Stage a block received from the gateway
+void dfuLoraResponse(int appID, J *rsp, void *appContext)
+{
+
+    // A timeout, for which we'll resume at the next activation
+    if (rsp == NULL) {
+        return;
+    }
+
+    // If the gateway is no longer offering this image, wait until we hear what it is offering
+    if (JIsPresent(rsp, "err")) {
+        APP_PRINTF("dfu: %s\r\n", JGetString(rsp, "err"));
+        targetImageCRC = 0;
+        dfuLoraRestart();
+        schedSetState(appID, STATE_DEACTIVATED, "dfu: abandoned");
+        return;
+    }
+
+    // Validate the response against what we requested
+    char *payload = JGetString(rsp, "payload");
+    uint32_t same = (uint32_t) JGetInt(rsp, "same");
+    if ((uint32_t) JGetInt(rsp, "image") != stagedImageCRC
+            || (uint32_t) JGetInt(rsp, "offset") != stagedLen
+            || pageBuffer == NULL
+            || same > targetImageLen - stagedLen
+            || (payload[0] == '\0' && stagedLen+same != targetImageLen)
+            || (size_t) JB64DecodeLen(payload) > DFU_LORA_BLOCK_BYTES+sizeof(uint32_t)) {
+        schedSetState(appID, STATE_DEACTIVATED, "dfu: unexpected block");
+        return;
+    }
+
+    // Stage what we already hold from our own image
+    if (same > 0) {
+        uint8_t *activeBase, *dfuBase;
+        uint32_t maxBytes, maxPages;
+        flashCodeParams(&activeBase, &dfuBase, &maxBytes, &maxPages);
+        if (!dfuLoraStage(&activeBase[stagedLen], same)) {
+            return;
+        }
+    }
+    if (payload[0] == '\0') {
+        return;
+    }
+
+    // Decode and stage the block that differs
+    uint8_t *block = (uint8_t *) poolAlloc(JB64DecodeLen(payload));
+    if (block == NULL) {
+        schedSetState(appID, STATE_DEACTIVATED, "dfu: can't allocate block");
+        return;
+    }
+    int decodedLen = JB64Decode((char *) block, payload);
+    uint32_t blockLen = (decodedLen > 0) ? (uint32_t) decodedLen : 0;
+    if (blockLen == 0 || blockLen > FLASH_PAGE_SIZE - (stagedLen % FLASH_PAGE_SIZE) || blockLen > targetImageLen - stagedLen
+            || utilCRC32(0, block, blockLen) != (uint32_t) JGetInt(rsp, "crc")) {
+        poolFree(block);
+        schedSetState(appID, STATE_REQUEST_BLOCK, "dfu: block CRC mismatch");
+        return;
+    }
+    dfuLoraStage(block, blockLen);
+    poolFree(block);
+
+}
+
+// Stage bytes of the image into the page buffer, programming each page when it's full or when
+// the image is complete, and returning false if a page couldn't be written
+bool dfuLoraStage(const uint8_t *data, uint32_t len)
+{
+    while (len > 0) {
+        uint32_t pageOffset = stagedLen % FLASH_PAGE_SIZE;
+        uint32_t chunkLen = FLASH_PAGE_SIZE - pageOffset;
+        if (chunkLen > len) {
+            chunkLen = len;
+        }
+        memcpy(&pageBuffer[pageOffset], data, chunkLen);
+        stagedLen += chunkLen;
+        data += chunkLen;
+        len -= chunkLen;
+        pageOffset += chunkLen;
+        if (pageOffset == FLASH_PAGE_SIZE || stagedLen == targetImageLen) {
+            if (!dfuLoraStagePage(stagedLen - pageOffset, pageOffset)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Program a page of the staged image, and apply the image if this completed it, returning
+// false if the page couldn't be written
+bool dfuLoraStagePage(uint32_t pageOffset, uint32_t pageLen)
+{
+    uint8_t *activeBase, *dfuBase;
+    uint32_t maxBytes, maxPages;
+    flashCodeParams(&activeBase, &dfuBase, &maxBytes, &maxPages);
+    if (!flashWrite(&dfuBase[pageOffset], pageBuffer, pageLen)) {
+        stagedLen = pageOffset;
+        schedSetState(appID, STATE_DEACTIVATED, "dfu: can't write page");
+        return false;
+    }
+    if (stagedLen < targetImageLen) {
+        return true;
+    }
+
+    // Verify the whole image as staged, starting over if it doesn't match
+    dfuLoraRestart();
+    uint32_t crc = utilCRC32(0, dfuBase, targetImageLen);
+    if (crc != targetImageCRC) {
+        APP_PRINTF("dfu: staged image CRC %08x doesn't match %08x\r\n", crc, targetImageCRC);
+        schedSetState(appID, STATE_DEACTIVATED, "dfu: image CRC mismatch");
+        return true;
+    }
+
+    // Copy it to the active partition and restart
+    uint32_t pages = (targetImageLen + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+    APP_PRINTF("dfu: copy %d pages to active partition\r\n", pages);
+    dfuLoader(activeBase, dfuBase, pages);
+    return true;
+
+}
@@ -0,0 +1,140 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Regional duty-cycle accounting.  Where regulations limit each transmitter to a fraction
+// of the time within a sub-band, as EU868 does, the time on air of everything that we
+// transmit is charged to the band of its frequency in a ledger of buckets spanning a
+// sliding window.  A transmission that would exceed its band's allowance is refused, the
+// gateway asks sensors to hold off until it can afford to answer them, and its slot
+// allocator stretches the modulus when it runs close to the limit.
+
+#include "framework.h"
+
+// Sub-bands, as configured
+typedef struct {
+    uint32_t lowHz;
+    uint32_t highHz;
+    uint16_t hundredthsPercent;
+} dutyBand;
+#if RADIO_DUTY_CYCLE
+static const dutyBand dutyBands[] = RADIO_DUTY_BANDS;
+#define DUTY_BANDS (sizeof(dutyBands)/sizeof(dutyBands[0]))
+#else
+static const dutyBand dutyBands[] = { { 0, 0, 10000 } };
+#define DUTY_BANDS 0
+#endif
+
+// The ledger holds one more bucket than the window so that a charge is only forgotten
+// once the whole window has passed since it was made, however late in its bucket it was
+#define DUTY_BUCKET_MS      ((RADIO_DUTY_WINDOW_SECS*1000)/RADIO_DUTY_BUCKETS)
+#define DUTY_SLOTS          (RADIO_DUTY_BUCKETS+1)
+static uint32_t dutyUsedMs[DUTY_BANDS ? DUTY_BANDS : 1][DUTY_SLOTS];
+static int64_t dutyBucket = 0;
+
+// Forwards
+static int dutyBandOf(uint32_t frequency);
+static void dutyAdvance(void);
+static uint32_t dutyAllowanceMs(int band);
+static uint32_t dutyBandUsedMs(int band);
+
+// Find the band containing a frequency, or -1 if it is not limited
+static int dutyBandOf(uint32_t frequency)
+{
+    for (int i=0; i<(int)DUTY_BANDS; i++) {
+        if (frequency >= dutyBands[i].lowHz && frequency < dutyBands[i].highHz) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Bring the ledger up to date, emptying the buckets that have aged out of the window
+static void dutyAdvance()
+{
+    int64_t bucket = TIMER_IF_GetTimeMs() / DUTY_BUCKET_MS;
+    if (bucket <= dutyBucket) {
+        return;
+    }
+    int64_t steps = bucket - dutyBucket;
+    if (steps > DUTY_SLOTS) {
+        steps = DUTY_SLOTS;
+    }
+    for (int64_t b=bucket-steps+1; b<=bucket; b++) {
+        for (int i=0; i<(int)DUTY_BANDS; i++) {
+            dutyUsedMs[i][b % DUTY_SLOTS] = 0;
+        }
+    }
+    dutyBucket = bucket;
+}
+
+// The airtime that a band allows within the window
+static uint32_t dutyAllowanceMs(int band)
+{
+    return (uint32_t) (((uint64_t) RADIO_DUTY_WINDOW_SECS * 1000 * dutyBands[band].hundredthsPercent) / 10000);
+}
+
+// The airtime used in a band within the window
+static uint32_t dutyBandUsedMs(int band)
+{
+    uint32_t used = 0;
+    for (int i=0; i<DUTY_SLOTS; i++) {
+        used += dutyUsedMs[band][i];
+    }
+    return used;
+}
+
+// Charge a transmission to the band of the frequency on which it was sent
+void dutyCharge(uint32_t frequency, uint32_t ms)
+{
+    int band = dutyBandOf(frequency);
+    if (band < 0) {
+        return;
+    }
+    dutyAdvance();
+    dutyUsedMs[band][dutyBucket % DUTY_SLOTS] += ms;
+}
+
+// Get how long we must wait before a transmission of the given time on air may be sent on
+// the frequency, which is 0 if it may be sent now
+uint32_t dutyWaitMs(uint32_t frequency, uint32_t ms)
+{
+    int band = dutyBandOf(frequency);
+    if (band < 0) {
+        return 0;
+    }
+    dutyAdvance();
+    uint32_t allowance = dutyAllowanceMs(band);
+    uint32_t used = dutyBandUsedMs(band);
+    if (used + ms <= allowance) {
+        return 0;
+    }
+    if (ms > allowance) {
+        return RADIO_DUTY_WINDOW_SECS * 1000;
+    }
+
+    // Find the oldest bucket whose expiry frees enough, where the oldest expires at the
+    // beginning of the next bucket
+    int64_t nowMs = TIMER_IF_GetTimeMs();
+    for (int age=0; age<DUTY_SLOTS; age++) {
+        int64_t b = dutyBucket + 1 + age;
+        used -= dutyUsedMs[band][b % DUTY_SLOTS];
+        if (used + ms <= allowance) {
+            int64_t waitMs = (b * DUTY_BUCKET_MS) - nowMs;
+            return (waitMs > 0) ? (uint32_t) waitMs : 0;
+        }
+    }
+    return RADIO_DUTY_WINDOW_SECS * 1000;
+}
+
+// Get the percentage of the band's allowance used within the window, or 0 if not limited
+uint32_t dutyUsedPercent(uint32_t frequency)
+{
+    int band = dutyBandOf(frequency);
+    if (band < 0) {
+        return 0;
+    }
+    dutyAdvance();
+    uint32_t allowance = dutyAllowanceMs(band);
+    return allowance ? (uint32_t) (((uint64_t) dutyBandUsedMs(band) * 100) / allowance) : 100;
+}
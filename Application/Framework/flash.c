@@ -9,6 +9,11 @@
 #include "main.h"
 #include "framework.h"
 
+// Macros
+#define GMAX(x, y) (((x) > (y)) ? (x) : (y))
+#define GMIN(x, y) (((x) < (y)) ? (x) : (y))
+#define ROUND_DOWN(a, b) (((a) / (b)) * (b))
+
 // Flash config device descriptor
 typedef struct __attribute__((__packed__))
 {
@@ -19,17 +24,20 @@ typedef struct __attribute__((__packed__))
 }
 peerConfig;
 
-// Flash configuration header
+// Flash configuration header.  A V1 header, whose peer count was 32 bits, is taken to be of
+// generation 0.
 #define FLASH_CONFIG_SIGNATURE_V1   0xF00DD00D
-#define FLASH_CONFIG_SIGNATURE      FLASH_CONFIG_SIGNATURE_V1
-#define MAX_PEERS                   150
+#define FLASH_CONFIG_SIGNATURE_V2   0xF00DD00E
+#define FLASH_CONFIG_SIGNATURE      FLASH_CONFIG_SIGNATURE_V2
 typedef struct {
     uint32_t signature;             // Both signature and version overloaded
-    uint32_t peers;                 // Number of peers located immediately after sizeof(flashConfig)
+    uint16_t peers;                 // Number of peers located immediately after sizeof(flashConfig)
+    uint16_t generation;            // Advanced by each rewrite of the table, and never 0 once rewritten
 } flashConfig;
 
-// Locations of config data
-#define FLASH_CONFIG_BYTES          (FLASH_PAGE_SIZE*8)
+// Locations of config data, which is the peer table and its index in FLASH_PEER_PAGES,
+// followed by the log
+#define FLASH_CONFIG_BYTES          ((FLASH_PEER_PAGES+FLASH_LOG_PAGES)*FLASH_PAGE_SIZE)
 #define FLASH_CONFIG_BASE_ADDRESS   ((FLASH_BASE+FLASH_SIZE)-FLASH_CONFIG_BYTES)
 #define FLASH_PEER_CONFIG_ADDRESS   (FLASH_CONFIG_BASE_ADDRESS)
 #define FLASH_PEER_CONFIG_BYTES     (sizeof(flashConfig))
@@ -38,24 +46,218 @@ typedef struct {
 #define FLASH_PEER_TABLE_BYTES      (MAX_PEERS*FLASH_PEER_ENTRY_BYTES)
 #define FLASH_MAX_USED_BYTES        (FLASH_PEER_CONFIG_BYTES+FLASH_PEER_TABLE_BYTES)
 
-// Locations of firmware
-#define FLASH_CODE_PAGES            (((FLASH_SIZE-FLASH_CONFIG_BYTES)/2)/FLASH_PAGE_SIZE)
+// Index of the peer table, keyed on address, in the last bytes of its pages.  This is an
+// open-addressed hash table of peer numbers whose empty slots are left erased, and it must be a
+// power of two that is at least a third larger than MAX_PEERS, which is as many as fit in the
+// pages along with the index.  It is written along with the table whenever the table is
+// rewritten, and covers the peers that the table then held, so that finding any of them takes
+// no RAM however many there are.  Because peers are only ever appended to the table, the peer
+// number serves as a stable handle that callers may retain.
+#define PEER_INDEX_SLOTS            ((FLASH_PEER_PAGES < 8) ? 256 : (FLASH_PEER_PAGES < 16) ? 512 : (FLASH_PEER_PAGES < 32) ? 1024 : 2048)
+#define PEER_INDEX_EMPTY            0xFFFF
+#define FLASH_PEER_INDEX_BYTES      (sizeof(flashIndexHeader)+(PEER_INDEX_SLOTS*sizeof(uint16_t)))
+#define FLASH_PEER_INDEX_ADDRESS    (FLASH_LOG_ADDRESS-FLASH_PEER_INDEX_BYTES)
+#define FLASH_PEER_INDEX_PAGE       ((FLASH_PEER_INDEX_ADDRESS-FLASH_CONFIG_BASE_ADDRESS)/FLASH_PAGE_SIZE)
+#define FLASH_INDEX_SIGNATURE       0xF00D1DE7
+#define MAX_PEERS                   GMIN((FLASH_PEER_PAGES*FLASH_PAGE_SIZE-FLASH_PEER_CONFIG_BYTES-FLASH_PEER_INDEX_BYTES)/FLASH_PEER_ENTRY_BYTES, (PEER_INDEX_SLOTS*3)/4)
+typedef struct {
+    uint32_t signature;
+    uint16_t peers;                 // The peers that it covers, which are those that precede this one
+    uint16_t checksum;              // Sum of the bytes of the slots
+} flashIndexHeader;
+_Static_assert(sizeof(flashIndexHeader) == sizeof(uint64_t), "index header must be one doubleword");
+_Static_assert(PEER_INDEX_SLOTS <= PEER_INDEX_EMPTY, "peer numbers must fit an index slot");
+_Static_assert(MAX_PEERS <= MAX_PEER_HANDLES, "peer numbers must fit the tables indexed by peer handle");
+
+// Log of changes to the peer table, in the pages at the end of the config area, so that
+// changing a peer appends a record rather than erasing and rewriting the whole table.  Each
+// record is a header followed by the full peer entry, and the header is programmed last so
+// that a record interrupted by a reset is never taken to be valid.  When the log fills, the
+// table is rewritten with all changes applied, and the log is erased.  The log begins with a
+// record of the generation of the table to which its changes apply, so that a log left over
+// by a reset after the table was rewritten, but before the log was erased, isn't replayed
+// over the newer table.  A log without one applies to a table of generation 0.
+#define FLASH_LOG_PAGES             1
+#define FLASH_LOG_BYTES             (FLASH_LOG_PAGES*FLASH_PAGE_SIZE)
+#define FLASH_LOG_ADDRESS           (FLASH_CONFIG_BASE_ADDRESS+FLASH_CONFIG_BYTES-FLASH_LOG_BYTES)
+#define FLASH_LOG_SIGNATURE         0xF00D109E
+#define FLASH_LOG_PAYLOAD_BYTES     ((FLASH_PEER_ENTRY_BYTES+7) & ~7)
+#define FLASH_LOG_RECORD_BYTES      (sizeof(flashLogHeader)+FLASH_LOG_PAYLOAD_BYTES)
+#define FLASH_LOG_RECORDS           (FLASH_LOG_BYTES/FLASH_LOG_RECORD_BYTES)
+typedef struct {
+    uint32_t signature;
+    uint16_t peer;                  // Peer number, which is appended if it is the next one
+    uint16_t checksum;              // Sum of the bytes of the peer entry
+} flashLogHeader;
+_Static_assert(sizeof(flashLogHeader) == sizeof(uint64_t), "log header must be one doubleword");
+_Static_assert(FLASH_MAX_USED_BYTES <= (FLASH_PEER_PAGES*FLASH_PAGE_SIZE)-FLASH_PEER_INDEX_BYTES, "peer table overlaps its index");
+
+// The hardware inventory found by probing at boot, which is held in the log as a record with
+// a reserved peer number, and re-appended whenever the log is erased.  It is only valid for
+// the firmware that wrote it, because a new image may probe differently.
+#define FLASH_LOG_INVENTORY         0xFFFF
+#define FLASH_LOG_GENERATION        0xFFFD
+_Static_assert(MAX_PEERS < FLASH_LOG_GENERATION, "peer numbers must not collide with reserved records");
+typedef struct {
+    uint32_t firmware;              // utilCRC32 of appFirmwareVersion()
+    uint32_t sku;
+    uint32_t probed;                // HARDWARE_* whose presence has been determined
+    uint32_t present;               // HARDWARE_* that were found
+} flashInventory;
+_Static_assert(sizeof(flashInventory) <= FLASH_LOG_PAYLOAD_BYTES, "inventory must fit a log record");
+static flashInventory inventory = {0};
+static bool inventoryValid = false;
+
+// The note.templates that a sensor has registered with its gateway, held in the log as a
+// record with a reserved peer number just as the inventory is, so that they needn't be
+// registered again after a restart.  They are only valid for the gateway that accepted them,
+// and only for as long as it hasn't rebooted since.
+#define FLASH_LOG_TEMPLATES         0xFFFE
+#define FLASH_TEMPLATES_MAX         8
+typedef struct {
+    uint32_t gateway;               // utilHashAddress of the gateway, or 0 if none are held
+    uint32_t bootTime;              // The gateway's boot time when they were registered
+    uint32_t hash[FLASH_TEMPLATES_MAX]; // utilCRC32 of each registration, newest first, or 0
+} flashTemplates;
+_Static_assert(sizeof(flashTemplates) <= FLASH_LOG_PAYLOAD_BYTES, "templates must fit a log record");
+static flashTemplates templates = {0};
+static bool templatesValid = false;
+
+// Outbound store of notes that a sensor couldn't deliver to the gateway, in the pages just
+// below the config area, which are used in turn as a ring.  Each page begins with a header
+// holding its sequence number, followed by records appended in order.  A record is a header,
+// programmed after the payload so that an interrupted append is never taken to be valid, then
+// a doubleword left erased until the record has been delivered, then the payload.  A page is
+// only erased for reuse once everything in it has been delivered, and when none can be, the
+// store is full and refuses further notes.
+#define FLASH_STORE_PAGES           2
+#define FLASH_STORE_BYTES           (FLASH_STORE_PAGES*FLASH_PAGE_SIZE)
+#define FLASH_STORE_ADDRESS         (FLASH_CONFIG_BASE_ADDRESS-FLASH_STORE_BYTES)
+#define FLASH_STORE_SIGNATURE       0xF00D5704
+#define FLASH_STORE_RECORD          0x5704
+#define FLASH_STORE_FIRST_RECORD    (sizeof(flashStorePage))
+#define FLASH_STORE_PAYLOAD_MAX     (FLASH_PAGE_SIZE-sizeof(flashStorePage)-sizeof(flashStoreHeader)-sizeof(uint64_t))
+typedef struct {
+    uint32_t signature;
+    uint32_t sequence;              // Increases with each page put into use
+} flashStorePage;
+typedef struct {
+    uint16_t signature;
+    uint16_t len;                   // Length of the payload
+    uint16_t checksum;              // Sum of the bytes of the payload
+    uint16_t reserved;
+} flashStoreHeader;
+_Static_assert(sizeof(flashStorePage) == sizeof(uint64_t), "store page header must be one doubleword");
+_Static_assert(sizeof(flashStoreHeader) == sizeof(uint64_t), "store header must be one doubleword");
+static bool storeScanned = false;
+static uint32_t storeSequence[FLASH_STORE_PAGES] = {0};    // 0 if the page isn't in use
+static uint32_t storeEnd[FLASH_STORE_PAGES] = {0};         // Where the next record goes in the page
+static uint8_t storeOrder[FLASH_STORE_PAGES] = {0};        // Pages in use, oldest first
+static uint32_t storePagesInUse = 0;
+static uint32_t storePending = 0;
+
+// Snapshot of the gateway's request cache, in the pages just below the outbound store, so that
+// it comes back from a reboot or DFU with the state that it had.  The payload is appended a
+// doubleword at a time following the header, which is programmed last so that an interrupted
+// snapshot is never taken to be valid.
+#define FLASH_SNAPSHOT_PAGES        4
+#define FLASH_SNAPSHOT_BYTES        (FLASH_SNAPSHOT_PAGES*FLASH_PAGE_SIZE)
+#define FLASH_SNAPSHOT_ADDRESS      (FLASH_STORE_ADDRESS-FLASH_SNAPSHOT_BYTES)
+#define FLASH_SNAPSHOT_SIGNATURE    0xF00D5A55
+typedef struct {
+    uint32_t signature;
+    uint32_t len;                   // Length of the payload
+    uint32_t crc;                   // utilCRC32 of the payload
+    uint32_t reserved;
+} flashSnapshotHeader;
+_Static_assert((sizeof(flashSnapshotHeader) % sizeof(uint64_t)) == 0, "snapshot header must be whole doublewords");
+static uint32_t snapshotEnd = 0;
+static bool snapshotWriting = false;
+
+// Locations of firmware, which share what is left below the snapshot.  The linker script
+// checks that the image fits, and must be told of any change to the pages taken above.
+#define FLASH_CODE_PAGES            (((FLASH_SIZE-FLASH_CONFIG_BYTES-FLASH_STORE_BYTES-FLASH_SNAPSHOT_BYTES)/2)/FLASH_PAGE_SIZE)
 #define FLASH_CODE_MAX_BYTES        (FLASH_CODE_PAGES*FLASH_PAGE_SIZE)
 #define FLASH_CODE_BASE             (FLASH_BASE)
 #define FLASH_CODE_DFU_BASE         (FLASH_BASE+FLASH_CODE_MAX_BYTES)
 
-// In-memory flash config
+// In-memory flash config.  The peers themselves are read where they lie in memory-mapped
+// flash, either in the table or in the log record that last changed them, for which the peer
+// number plus one that each record of the log holds is noted in logPeer[], or zero if the
+// record holds no peer.
 static flashConfig config = {0};
-static peerConfig *peer = NULL;
+static uint16_t logPeer[FLASH_LOG_RECORDS] = {0};
 
-// Macros
-#define GMAX(x, y) (((x) > (y)) ? (x) : (y))
-#define GMIN(x, y) (((x) < (y)) ? (x) : (y))
-#define ROUND_DOWN(a, b) (((a) / (b)) * (b))
+// Peers changed in RAM but not yet written to flash, which are read from this overlay rather
+// than from flash until they are.  An edit that finds it full first writes what it holds.  An
+// entry that is no longer dirty is being written by a rewrite of the table, and is dropped
+// once the rewrite completes.
+#define PEER_OVERLAY_MAX            16
+typedef struct {
+    uint16_t number;                // Peer number plus one, or zero if the entry is free
+    bool dirty;                     // Must be written by the next flashConfigUpdate()
+    peerConfig entry;
+} peerOverlay;
+static peerOverlay overlay[PEER_OVERLAY_MAX] = {0};
+
+// RAM-resident index of the peers that the index in flash doesn't cover, which are those
+// appended since the table was last rewritten and so are no more than the log and overlay
+// hold.  It is keyed and probed as the index in flash, but holds peer number plus one so that
+// zero means empty.  Should it fill, as when the index in flash isn't valid, those peers are
+// found by a scan until the table has been rewritten.
+#define PEER_RAM_INDEX_SLOTS        64
+static uint16_t peerIndex[PEER_RAM_INDEX_SLOTS] = {0};
+static bool peerIndexFull = false;
+static uint32_t indexPeers = 0;             // Peers covered by the index in flash
+
+// The number of log records used, and the generation of the table to which those that
+// follow the last generation record apply
+static uint32_t logRecords = 0;
+static uint16_t logGeneration = 0;
+
+// Incremental writer, which persists changes one slice per flashConfigUpdateStep() so that
+// no single slice holds the CPU for longer than one page erase.  Dirty peers are appended
+// to the log one record per slice.  When the log can't hold them, the table is rewritten
+// one page per slice, last page first so that the header that validates the new peer
+// count is written last, and the log is erased only once the table holds everything.  A
+// reset midway is harmless because the log still holds every change made before it began,
+// and once the header is written, the log is of an older generation than the table.
+static bool compacting = false;
+static int32_t compactPage = 0;             // Next page of the table to rewrite, or -1 for the log
+static int32_t compactTablePage = 0;        // Last page holding peers, below which none are skipped
+static uint32_t compactPeers = 0;           // Peer count that the rewritten table holds
+static uint16_t compactGeneration = 0;      // Generation of the rewritten table
+static bool updateFailed = false;
 
 // Forwards
 uint32_t FLASH_Init(void);
 bool FLASH_write_at(uint32_t address, uint64_t *pData, uint32_t datalen);
+void peerIndexRebuild(void);
+void peerIndexInsert(uint32_t i);
+bool peerIndexLoad(void);
+bool peerIndexBuild(uint8_t *index);
+bool peerGrow(void);
+peerConfig *peerEntry(uint32_t i);
+peerConfig *peerEdit(uint32_t i, bool copy);
+void peerOverlayFree(uint32_t j);
+bool flashErase(uint32_t address, uint32_t pages);
+uint16_t flashLogChecksum(uint8_t *p, uint32_t len);
+void flashLogReplay(void);
+bool flashLogAppend(uint32_t i);
+bool flashLogAppendRecord(uint16_t peerNumber, void *entry, uint32_t len);
+bool flashLogAppendGeneration(void);
+bool flashConfigCompact(void);
+void flashConfigCompactBegin(void);
+bool flashConfigCompactPage(uint32_t page);
+uint32_t flashConfigDirtyPeers(void);
+uint32_t flashFirmwareID(void);
+void storeScan(void);
+flashStoreHeader *storeRecordAt(uint32_t page, uint32_t offset);
+bool storeDelivered(flashStoreHeader *header);
+uint32_t storeRecordBytes(uint32_t len);
+flashStoreHeader *storeFind(uint32_t index);
+bool storePagePending(uint32_t page);
+bool storeErased(uint32_t address, uint32_t len);
 
 // Get DFU-related flash parameters
 void flashCodeParams(uint8_t **activeBase, uint8_t **dfuBase, uint32_t *maxBytes, uint32_t *maxPages)
@@ -140,7 +342,9 @@ void flashDFUInit()
     APP_PRINTF("\r\n");
     APP_PRINTF("flash:  peers: %d\r\n", MAX_PEERS);
     APP_PRINTF("       config: %d bytes\r\n", FLASH_MAX_USED_BYTES);
-    APP_PRINTF("               %d spare\r\n", FLASH_CONFIG_BYTES-FLASH_MAX_USED_BYTES);
+    APP_PRINTF("        index: %d bytes\r\n", FLASH_PEER_INDEX_BYTES);
+    APP_PRINTF("               %d spare\r\n", (FLASH_PEER_PAGES*FLASH_PAGE_SIZE)-FLASH_MAX_USED_BYTES-FLASH_PEER_INDEX_BYTES);
+    APP_PRINTF("          log: %d records\r\n", FLASH_LOG_RECORDS);
     APP_PRINTF("         code: %d bytes\r\n", MX_Image_Size());
     APP_PRINTF("               %d pages\r\n", MX_Image_Pages());
     APP_PRINTF("          max: %d bytes\r\n", FLASH_CODE_MAX_BYTES);
@@ -151,29 +355,38 @@ void flashDFUInit()
 
 }
 
-// Write to flash, returning true if success
+// Write to flash, returning true if success.  Whole pages that are doubleword-aligned in
+// RAM are programmed directly from the source, and only partial pages are merged with the
+// existing contents of flash in a page cache.
 bool flashWrite(uint8_t *flashDest, void *source, uint32_t bytes)
 {
     uint8_t *ramSource = source;
     bool success = true;
-    int remaining = bytes;
-
-    uint8_t *page_cache = malloc(FLASH_PAGE_SIZE);
-    if (page_cache == NULL) {
-        return false;
-    }
+    uint32_t remaining = bytes;
+    uint8_t *page_cache = NULL;
 
     FLASH_Init();
 
     do {
         uint32_t fl_addr = ROUND_DOWN((uint32_t)flashDest, FLASH_PAGE_SIZE);
-        int fl_offset = (uint32_t)flashDest - fl_addr;
-        int len = GMIN(FLASH_PAGE_SIZE - fl_offset, bytes);
+        uint32_t fl_offset = (uint32_t)flashDest - fl_addr;
+        uint32_t len = GMIN(FLASH_PAGE_SIZE - fl_offset, remaining);
 
-        // Load from the flash into the cache
-        memcpy(page_cache, (void *) fl_addr, FLASH_PAGE_SIZE);
-        // Update the cache from the source
-        memcpy((uint8_t *)page_cache + fl_offset, ramSource, len);
+        // Use the source as it is if it covers the page, else merge it into the cache
+        uint8_t *page_source = ramSource;
+        if (len != FLASH_PAGE_SIZE || ((uint32_t)ramSource & (sizeof(uint64_t)-1)) != 0) {
+            if (page_cache == NULL) {
+                page_cache = malloc(FLASH_PAGE_SIZE);
+                if (page_cache == NULL) {
+                    return false;
+                }
+            }
+            // Load from the flash into the cache
+            memcpy(page_cache, (void *) fl_addr, FLASH_PAGE_SIZE);
+            // Update the cache from the source
+            memcpy((uint8_t *)page_cache + fl_offset, ramSource, len);
+            page_source = page_cache;
+        }
 
         // Erase the page, and write the cache
         uint32_t PageError;
@@ -188,9 +401,9 @@ bool flashWrite(uint8_t *flashDest, void *source, uint32_t bytes)
             APP_PRINTF("flash: hal erase error\r\n");
             success = false;
         } else {
-            if (!FLASH_write_at(fl_addr, (uint64_t *)page_cache, FLASH_PAGE_SIZE)) {
-                APP_PRINTF("flash: retrying write error\r\n");
-                if (!FLASH_write_at(fl_addr, (uint64_t *)page_cache, FLASH_PAGE_SIZE)) {
+            if (!FLASH_write_at(fl_addr, (uint64_t *)page_source, FLASH_PAGE_SIZE)) {
+                TRACE_PRINTF(TRACE_FLASH, VLEVEL_L, "flash: retrying write error\r\n");
+                if (!FLASH_write_at(fl_addr, (uint64_t *)page_source, FLASH_PAGE_SIZE)) {
                     APP_PRINTF("flash: unrecoverable write error\r\n");
                     success = false;
                 }
@@ -204,11 +417,32 @@ bool flashWrite(uint8_t *flashDest, void *source, uint32_t bytes)
     } while (success && (remaining > 0));
 
     // Done
-    free(page_cache);
+    if (page_cache != NULL) {
+        free(page_cache);
+    }
     return success;
 
 }
 
+// Erase pages of flash, returning true if success
+bool flashErase(uint32_t address, uint32_t pages)
+{
+    FLASH_Init();
+    uint32_t PageError;
+    FLASH_EraseInitTypeDef EraseInit = {0};
+    EraseInit.NbPages = pages;
+    EraseInit.TypeErase = FLASH_TYPEERASE_PAGES;
+    EraseInit.Page = (address - FLASH_BASE) / FLASH_PAGE_SIZE;
+    if (HAL_FLASH_Unlock() != HAL_OK) {
+        APP_PRINTF("flash: error unlocking flash for Erase\r\n");
+    }
+    if (HAL_FLASHEx_Erase(&EraseInit, &PageError) != HAL_OK) {
+        APP_PRINTF("flash: hal erase error\r\n");
+        return false;
+    }
+    return true;
+}
+
 // Get the number of peers
 uint32_t flashConfigPeers()
 {
@@ -219,46 +453,609 @@ uint32_t flashConfigPeers()
 void flashConfigLoad()
 {
 
-    // Read the header
+    // Read the header.  If the table isn't valid, neither is anything in the log, so mark
+    // the log full so that the next update rewrites the table and erases the log.
+    bool replayLog = true;
     memcpy(&config, (uint8_t *)FLASH_CONFIG_BASE_ADDRESS, sizeof(flashConfig));
+    inventoryValid = false;
+    templatesValid = false;
+    if (config.signature == FLASH_CONFIG_SIGNATURE_V1) {
+        config.signature = FLASH_CONFIG_SIGNATURE;
+        config.generation = 0;
+    }
     if (config.signature != FLASH_CONFIG_SIGNATURE) {
         config.signature = FLASH_CONFIG_SIGNATURE;
         config.peers = 0;
+        config.generation = 0;
+        replayLog = false;
+        logRecords = FLASH_LOG_RECORDS;
     }
+    if (config.peers > MAX_PEERS) {
+        APP_PRINTF("*** peer table truncated to %d peers ***\r\n", MAX_PEERS);
+        config.peers = MAX_PEERS;
+    }
+
+    // Every peer is where the table holds it, unless the log has changed it since
+    memset(logPeer, 0, sizeof(logPeer));
+    memset(overlay, 0, sizeof(overlay));
+    compacting = false;
 
-    // Allocate peer buffer
-    if (peer != NULL) {
-        free(peer);
+    // Apply the changes made since the table was written
+    if (replayLog) {
+        flashLogReplay();
     }
-    peer = (peerConfig *) malloc(config.peers * sizeof(peerConfig));
-    if (peer == NULL) {
-        config.peers = 0;
-        APP_PRINTF("*** can't allocate peers - peer table reset ***\r\n");
-        return;
+
+    // Index by address the peers that the index in flash doesn't cover, and if they are too
+    // many, as after an update from firmware that kept no index in flash, rewrite the table
+    // so that it does
+    indexPeers = (replayLog && peerIndexLoad()) ? GMIN(((flashIndexHeader *) FLASH_PEER_INDEX_ADDRESS)->peers, config.peers) : 0;
+    peerIndexRebuild();
+    if (peerIndexFull) {
+        APP_PRINTF("flash: %d peers aren't indexed in flash, so rewriting the table\r\n", config.peers - indexPeers);
+        flashConfigCompactBegin();
     }
-    memcpy(peer, (uint8_t *)FLASH_PEER_TABLE_ADDRESS, config.peers * sizeof(peerConfig));
 
 }
 
-// Update the config
-bool flashConfigUpdate()
+// Grow the peer table by one entry, returning true if success
+bool peerGrow()
+{
+    if (config.peers >= MAX_PEERS) {
+        APP_PRINTF("*** peer table full ***\r\n");
+        return false;
+    }
+    config.peers++;
+    return true;
+}
+
+// Get the current entry of a peer, from the overlay if it has been changed in RAM, and
+// otherwise from wherever it lies in flash
+peerConfig *peerEntry(uint32_t i)
+{
+    for (uint32_t j=0; j<PEER_OVERLAY_MAX; j++) {
+        if (overlay[j].number == i+1) {
+            return &overlay[j].entry;
+        }
+    }
+    for (uint32_t record=logRecords; record>0; record--) {
+        if (logPeer[record-1] == i+1) {
+            return (peerConfig *) (FLASH_LOG_ADDRESS + ((record-1)*FLASH_LOG_RECORD_BYTES) + sizeof(flashLogHeader));
+        }
+    }
+    return (peerConfig *) (FLASH_PEER_TABLE_ADDRESS + (i*sizeof(peerConfig)));
+}
+
+// Get the overlay entry of a peer to change it, noting that it must be written by the next
+// flashConfigUpdate().  A new entry begins as a copy of the peer's current one, or empty if the
+// peer is being appended.  Returns NULL if there's no room even after writing the overlay.
+peerConfig *peerEdit(uint32_t i, bool copy)
+{
+    int slot = -1;
+    for (uint32_t j=0; j<PEER_OVERLAY_MAX; j++) {
+        if (overlay[j].number == i+1) {
+            overlay[j].dirty = true;
+            return &overlay[j].entry;
+        }
+        if (overlay[j].number == 0 && slot < 0) {
+            slot = (int) j;
+        }
+    }
+    if (slot < 0) {
+        flashConfigUpdate();
+        for (uint32_t j=0; j<PEER_OVERLAY_MAX && slot < 0; j++) {
+            if (overlay[j].number == 0) {
+                slot = (int) j;
+            }
+        }
+        if (slot < 0) {
+            APP_PRINTF("*** can't write peers to make room for changes ***\r\n");
+            return NULL;
+        }
+    }
+    if (copy) {
+        memcpy(&overlay[slot].entry, peerEntry(i), sizeof(peerConfig));
+    } else {
+        memset(&overlay[slot].entry, 0, sizeof(peerConfig));
+    }
+    overlay[slot].number = (uint16_t) (i+1);
+    overlay[slot].dirty = true;
+    return &overlay[slot].entry;
+}
+
+// Drop a peer's overlay entry, now that flash holds what it did
+void peerOverlayFree(uint32_t j)
+{
+    overlay[j].number = 0;
+    overlay[j].dirty = false;
+}
+
+// Compute the checksum of a peer entry in the log
+uint16_t flashLogChecksum(uint8_t *p, uint32_t len)
+{
+    uint16_t sum = 0;
+    for (uint32_t i=0; i<len; i++) {
+        sum += p[i];
+    }
+    return sum;
+}
+
+// Locate the peers changed by the records in the log, in the order written, and note how
+// many record slots have been used.  A slot whose header was never programmed
+// but whose entry was is the remnant of an interrupted append, and is skipped, as are the
+// changes that the table already holds because it is of a later generation.
+void flashLogReplay()
 {
+    logGeneration = 0;
+    for (logRecords=0; logRecords<FLASH_LOG_RECORDS; logRecords++) {
+        uint8_t *record = (uint8_t *) (FLASH_LOG_ADDRESS + (logRecords*FLASH_LOG_RECORD_BYTES));
+        flashLogHeader *header = (flashLogHeader *) record;
+        uint8_t *entry = record + sizeof(flashLogHeader);
+        if (header->signature != FLASH_LOG_SIGNATURE) {
+            bool erased = true;
+            for (uint32_t i=0; i<FLASH_LOG_RECORD_BYTES && erased; i++) {
+                erased = (record[i] == 0xff);
+            }
+            if (erased) {
+                break;
+            }
+            continue;
+        }
+        if (header->peer == FLASH_LOG_INVENTORY) {
+            if (header->checksum == flashLogChecksum(entry, sizeof(flashInventory))) {
+                memcpy(&inventory, entry, sizeof(flashInventory));
+                inventoryValid = true;
+            }
+            continue;
+        }
+        if (header->peer == FLASH_LOG_TEMPLATES) {
+            if (header->checksum == flashLogChecksum(entry, sizeof(flashTemplates))) {
+                memcpy(&templates, entry, sizeof(flashTemplates));
+                templatesValid = (templates.gateway != 0);
+            }
+            continue;
+        }
+        if (header->peer == FLASH_LOG_GENERATION) {
+            if (header->checksum == flashLogChecksum(entry, sizeof(logGeneration))) {
+                memcpy(&logGeneration, entry, sizeof(logGeneration));
+            }
+            continue;
+        }
+        if (logGeneration != config.generation) {
+            continue;
+        }
+        if (header->checksum != flashLogChecksum(entry, sizeof(peerConfig)) || header->peer > config.peers) {
+            continue;
+        }
+        if (header->peer == config.peers && !peerGrow()) {
+            continue;
+        }
+        logPeer[logRecords] = header->peer+1;
+    }
+}
 
-    // Update peer table
-    if (!flashWrite((uint8_t *)FLASH_PEER_TABLE_ADDRESS, peer, config.peers * sizeof(peerConfig))) {
-        APP_PRINTF("*** can't write peers ***\r\n");
+// Append a peer's entry to the log, returning true if success, after which it is read from there
+bool flashLogAppend(uint32_t i)
+{
+    if (logGeneration != config.generation && !flashLogAppendGeneration()) {
+        return false;
+    }
+    uint32_t record = logRecords;
+    if (!flashLogAppendRecord(i, peerEntry(i), sizeof(peerConfig))) {
         return false;
     }
+    logPeer[record] = (uint16_t) (i+1);
+    return true;
+}
 
-    // Update header
-    if (!flashWrite((uint8_t *)FLASH_CONFIG_BASE_ADDRESS, &config, sizeof(flashConfig))) {
-        APP_PRINTF("*** can't write config ***\r\n");
+// Append a record to the log, returning true if success
+bool flashLogAppendRecord(uint16_t peerNumber, void *record, uint32_t len)
+{
+    if (logRecords >= FLASH_LOG_RECORDS) {
         return false;
     }
+    uint32_t address = FLASH_LOG_ADDRESS + (logRecords*FLASH_LOG_RECORD_BYTES);
+
+    // The slot is consumed even if programming fails, because it's no longer erased
+    logRecords++;
 
-    // Success
+    // Program the entry, and then the header that validates it
+    uint64_t entry[FLASH_LOG_PAYLOAD_BYTES/sizeof(uint64_t)];
+    memset(entry, 0, sizeof(entry));
+    memcpy(entry, record, len);
+    flashLogHeader header = {0};
+    header.signature = FLASH_LOG_SIGNATURE;
+    header.peer = peerNumber;
+    header.checksum = flashLogChecksum((uint8_t *) entry, len);
+    uint64_t headerWord;
+    memcpy(&headerWord, &header, sizeof(headerWord));
+    FLASH_Init();
+    if (HAL_FLASH_Unlock() != HAL_OK) {
+        APP_PRINTF("flash: error unlocking flash for log\r\n");
+        return false;
+    }
+    bool success = FLASH_write_at(address+sizeof(flashLogHeader), entry, sizeof(entry))
+                   && FLASH_write_at(address, &headerWord, sizeof(headerWord));
+    HAL_FLASH_Lock();
+    return success;
+}
+
+// Append the record of the table's generation, which the changes appended after it apply to
+bool flashLogAppendGeneration()
+{
+    if (!flashLogAppendRecord(FLASH_LOG_GENERATION, &config.generation, sizeof(config.generation))) {
+        return false;
+    }
+    logGeneration = config.generation;
+    return true;
+}
+
+// Add a peer that the index in flash doesn't cover to the RAM index, noting if it's full
+void peerIndexInsert(uint32_t i)
+{
+    uint32_t slot = utilHashAddress(peerEntry(i)->address) & (PEER_RAM_INDEX_SLOTS-1);
+    for (uint32_t probes=0; peerIndex[slot] != 0; probes++) {
+        if (probes >= PEER_RAM_INDEX_SLOTS/2) {
+            peerIndexFull = true;
+            return;
+        }
+        slot = (slot+1) & (PEER_RAM_INDEX_SLOTS-1);
+    }
+    peerIndex[slot] = i+1;
+}
+
+// Rebuild the RAM index from the peers that the index in flash doesn't cover
+void peerIndexRebuild()
+{
+    memset(peerIndex, 0, sizeof(peerIndex));
+    peerIndexFull = false;
+    for (size_t i=indexPeers; i<config.peers; i++) {
+        peerIndexInsert(i);
+    }
+}
+
+// See whether the index in flash is valid
+bool peerIndexLoad()
+{
+    flashIndexHeader *header = (flashIndexHeader *) FLASH_PEER_INDEX_ADDRESS;
+    return header->signature == FLASH_INDEX_SIGNATURE
+           && header->checksum == flashLogChecksum((uint8_t *) (header+1), PEER_INDEX_SLOTS*sizeof(uint16_t));
+}
+
+// Build the index in flash of the peers that the table is being rewritten with, returning
+// false if it could not
+bool peerIndexBuild(uint8_t *index)
+{
+    flashIndexHeader *header = (flashIndexHeader *) index;
+    uint16_t *slots = (uint16_t *) (header+1);
+    memset(slots, 0xff, PEER_INDEX_SLOTS*sizeof(uint16_t));
+    for (uint32_t i=0; i<compactPeers; i++) {
+        uint32_t slot = utilHashAddress(peerEntry(i)->address) & (PEER_INDEX_SLOTS-1);
+        for (uint32_t probes=0; slots[slot] != PEER_INDEX_EMPTY; probes++) {
+            if (probes >= PEER_INDEX_SLOTS) {
+                return false;
+            }
+            slot = (slot+1) & (PEER_INDEX_SLOTS-1);
+        }
+        slots[slot] = (uint16_t) i;
+    }
+    header->signature = FLASH_INDEX_SIGNATURE;
+    header->peers = (uint16_t) compactPeers;
+    header->checksum = flashLogChecksum((uint8_t *) slots, PEER_INDEX_SLOTS*sizeof(uint16_t));
+    return true;
+}
+
+// Find the handle of a peer by address, returning -1 if not found, from the index in flash
+// and then the RAM index of those appended since it was written
+int flashConfigFindPeerHandle(uint8_t *address)
+{
+    uint32_t hash = utilHashAddress(address);
+    if (indexPeers != 0) {
+        uint16_t *slots = (uint16_t *) (FLASH_PEER_INDEX_ADDRESS + sizeof(flashIndexHeader));
+        uint32_t slot = hash & (PEER_INDEX_SLOTS-1);
+        for (uint32_t probes=0; slots[slot] != PEER_INDEX_EMPTY && probes < PEER_INDEX_SLOTS; probes++) {
+            uint32_t i = slots[slot];
+            if (i < indexPeers && memcmp(address, peerEntry(i)->address, ADDRESS_LEN) == 0) {
+                return (int) i;
+            }
+            slot = (slot+1) & (PEER_INDEX_SLOTS-1);
+        }
+    }
+    uint32_t slot = hash & (PEER_RAM_INDEX_SLOTS-1);
+    for (uint32_t probes=0; peerIndex[slot] != 0 && probes < PEER_RAM_INDEX_SLOTS; probes++) {
+        uint32_t i = peerIndex[slot]-1;
+        if (i < config.peers && memcmp(address, peerEntry(i)->address, ADDRESS_LEN) == 0) {
+            return (int) i;
+        }
+        slot = (slot+1) & (PEER_RAM_INDEX_SLOTS-1);
+    }
+    for (uint32_t i=indexPeers; peerIndexFull && i<config.peers; i++) {
+        if (memcmp(address, peerEntry(i)->address, ADDRESS_LEN) == 0) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+// Get a peer's info by handle, returning true if the handle is valid
+bool flashConfigPeerByHandle(int handle, uint16_t *retPeerType, uint8_t *retKey, char *retName)
+{
+    if (handle < 0 || handle >= config.peers) {
+        return false;
+    }
+    peerConfig *entry = peerEntry(handle);
+    if (retPeerType != NULL) {
+        *retPeerType = entry->type;
+    }
+    if (retKey != NULL) {
+        memcpy(retKey, entry->key, AES_KEY_BYTES);
+    }
+    if (retName != NULL) {
+        memcpy(retName, entry->name, SENSOR_NAME_MAX);
+    }
     return true;
+}
 
+// Get a peer's address by handle, returning true if the handle is valid
+bool flashConfigPeerAddressByHandle(int handle, uint8_t *retAddress)
+{
+    if (handle < 0 || handle >= config.peers) {
+        return false;
+    }
+    memcpy(retAddress, peerEntry(handle)->address, ADDRESS_LEN);
+    return true;
+}
+
+// Count the peers that have changed
+uint32_t flashConfigDirtyPeers()
+{
+    uint32_t dirty = 0;
+    for (uint32_t j=0; j<PEER_OVERLAY_MAX; j++) {
+        if (overlay[j].number != 0 && overlay[j].dirty) {
+            dirty++;
+        }
+    }
+    return dirty;
+}
+
+// Write the next slice of the peers that have changed, returning true if more remain.  A
+// failed slice is retried by the next step, and is noted for flashConfigUpdate().
+bool flashConfigUpdateStep()
+{
+
+    // Continue a rewrite of the table that is underway, finishing by erasing the log
+    if (compacting) {
+        if (compactPage >= 0) {
+            if (!flashConfigCompactPage(compactPage)) {
+                APP_PRINTF("*** can't write peers ***\r\n");
+                updateFailed = true;
+                return true;
+            }
+            compactPage--;
+            if (compactPage < (int32_t) FLASH_PEER_INDEX_PAGE && compactPage > compactTablePage) {
+                compactPage = compactTablePage;
+            }
+            return true;
+        }
+        if (!flashErase(FLASH_LOG_ADDRESS, FLASH_LOG_PAGES)) {
+            APP_PRINTF("*** can't erase config log ***\r\n");
+            updateFailed = true;
+            return true;
+        }
+        compacting = false;
+        logRecords = 0;
+        config.generation = compactGeneration;
+        flashLogAppendGeneration();
+
+        // The table now holds every peer that it was rewritten with, including those in
+        // the overlay that haven't changed again since, and the index in flash covers them
+        memset(logPeer, 0, sizeof(logPeer));
+        for (uint32_t j=0; j<PEER_OVERLAY_MAX; j++) {
+            if (overlay[j].number != 0 && !overlay[j].dirty) {
+                peerOverlayFree(j);
+            }
+        }
+        indexPeers = compactPeers;
+        peerIndexRebuild();
+        if (inventoryValid) {
+            flashLogAppendRecord(FLASH_LOG_INVENTORY, &inventory, sizeof(flashInventory));
+        }
+        if (templatesValid) {
+            flashLogAppendRecord(FLASH_LOG_TEMPLATES, &templates, sizeof(flashTemplates));
+        }
+        return (flashConfigDirtyPeers() != 0);
+    }
+
+    // Append one changed peer if they all fit in the log, else begin rewriting the table
+    uint32_t dirty = flashConfigDirtyPeers();
+    if (dirty == 0) {
+        return false;
+    }
+    if (dirty > FLASH_LOG_RECORDS-logRecords) {
+        flashConfigCompactBegin();
+        return true;
+    }
+    // Lowest first, because a peer that is appended must follow those before it in the log
+    int next = -1;
+    for (uint32_t j=0; j<PEER_OVERLAY_MAX; j++) {
+        if (overlay[j].number != 0 && overlay[j].dirty && (next < 0 || overlay[j].number < overlay[next].number)) {
+            next = (int) j;
+        }
+    }
+    if (flashLogAppend(overlay[next].number-1)) {
+        peerOverlayFree(next);
+    } else {
+        flashConfigCompactBegin();
+    }
+    return true;
+
+}
+
+// Write the peers that have changed, returning when they are all in flash
+bool flashConfigUpdate()
+{
+    updateFailed = false;
+    while (!updateFailed && flashConfigUpdateStep()) {
+    }
+    return !updateFailed;
+}
+
+// Begin rewriting the table with all changes applied, which covers every dirty peer
+void flashConfigCompactBegin()
+{
+    for (uint32_t j=0; j<PEER_OVERLAY_MAX; j++) {
+        overlay[j].dirty = false;
+    }
+    compactPeers = config.peers;
+    compactGeneration = (config.generation == 0xFFFF) ? 1 : config.generation+1;
+    compactTablePage = (FLASH_PEER_CONFIG_BYTES + (compactPeers * sizeof(peerConfig)) - 1) / FLASH_PAGE_SIZE;
+    compactPage = FLASH_PEER_PAGES-1;
+    compacting = true;
+}
+
+// Rewrite one page of the header, table and index, returning true if success.  The peers are
+// used as they are now, so those changed since the rewrite began are simply written again
+// afterward.  Pages are copied before being erased, so a peer may be read from the page
+// being rewritten.
+bool flashConfigCompactPage(uint32_t page)
+{
+    uint8_t *cache = malloc(FLASH_PAGE_SIZE);
+    if (cache == NULL) {
+        return false;
+    }
+    uint32_t pageBegin = page * FLASH_PAGE_SIZE;
+    uint32_t pageEnd = pageBegin + FLASH_PAGE_SIZE;
+    memcpy(cache, (uint8_t *) (FLASH_CONFIG_BASE_ADDRESS + pageBegin), FLASH_PAGE_SIZE);
+    if (page == 0) {
+        flashConfig header = config;
+        header.peers = compactPeers;
+        header.generation = compactGeneration;
+        memcpy(cache, &header, sizeof(header));
+    }
+    uint32_t tableBegin = FLASH_PEER_CONFIG_BYTES;
+    uint32_t tableEnd = tableBegin + (compactPeers * sizeof(peerConfig));
+    uint32_t begin = GMAX(pageBegin, tableBegin);
+    uint32_t end = GMIN(pageEnd, tableEnd);
+    for (uint32_t i = (begin < end) ? (begin-tableBegin)/sizeof(peerConfig) : compactPeers; i<compactPeers; i++) {
+        uint32_t entryBegin = tableBegin + (i*sizeof(peerConfig));
+        uint32_t from = GMAX(begin, entryBegin);
+        uint32_t to = GMIN(end, entryBegin+sizeof(peerConfig));
+        if (from >= to) {
+            break;
+        }
+        memcpy(&cache[from-pageBegin], ((uint8_t *) peerEntry(i)) + (from-entryBegin), to-from);
+    }
+    uint32_t indexBegin = FLASH_PEER_INDEX_ADDRESS - FLASH_CONFIG_BASE_ADDRESS;
+    if (pageEnd > indexBegin) {
+        uint8_t *index = malloc(FLASH_PEER_INDEX_BYTES);
+        if (index == NULL || !peerIndexBuild(index)) {
+            free(index);
+            free(cache);
+            return false;
+        }
+        begin = GMAX(pageBegin, indexBegin);
+        memcpy(&cache[begin-pageBegin], &index[begin-indexBegin], pageEnd-begin);
+        free(index);
+    }
+    bool success = flashWrite((uint8_t *) (FLASH_CONFIG_BASE_ADDRESS + pageBegin), cache, FLASH_PAGE_SIZE);
+    free(cache);
+    return success;
+}
+
+// Rewrite the peer table and header with all changes applied, and erase the log, returning
+// when done
+bool flashConfigCompact()
+{
+    if (!compacting) {
+        flashConfigCompactBegin();
+    }
+    updateFailed = false;
+    while (!updateFailed && compacting) {
+        flashConfigUpdateStep();
+    }
+    return !updateFailed;
+}
+
+// Identify the running firmware
+uint32_t flashFirmwareID()
+{
+    const char *version = appFirmwareVersion();
+    return utilCRC32(0, (const uint8_t *) version, strlen(version));
+}
+
+// Get the hardware inventory recorded by this firmware, returning false if there is none
+bool flashInventoryLoad(uint32_t *sku, uint32_t *probed, uint32_t *present)
+{
+    if (!inventoryValid || inventory.firmware != flashFirmwareID()) {
+        return false;
+    }
+    *sku = inventory.sku;
+    *probed = inventory.probed;
+    *present = inventory.present;
+    return true;
+}
+
+// Record the hardware inventory, rewriting the table if the log is full
+bool flashInventorySave(uint32_t sku, uint32_t probed, uint32_t present)
+{
+    inventory.firmware = flashFirmwareID();
+    inventory.sku = sku;
+    inventory.probed = probed;
+    inventory.present = present;
+    inventoryValid = true;
+    if (flashLogAppendRecord(FLASH_LOG_INVENTORY, &inventory, sizeof(flashInventory))) {
+        return true;
+    }
+    return flashConfigCompact();
+}
+
+// See whether a template registration was accepted by the gateway before we restarted, with
+// a boot time of 0 meaning that we haven't yet heard from the gateway whether it has rebooted
+bool flashTemplateKnown(uint32_t gateway, uint32_t bootTime, uint32_t hash)
+{
+    if (!templatesValid || templates.gateway != gateway || (bootTime != 0 && bootTime != templates.bootTime)) {
+        return false;
+    }
+    for (int i=0; i<FLASH_TEMPLATES_MAX; i++) {
+        if (templates.hash[i] == hash) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Record a template registration that the gateway accepted, forgetting those accepted by a
+// different gateway or before it rebooted, and rewriting the table if the log is full
+bool flashTemplateSave(uint32_t gateway, uint32_t bootTime, uint32_t hash)
+{
+    if (flashTemplateKnown(gateway, bootTime, hash)) {
+        return true;
+    }
+    if (!templatesValid || templates.gateway != gateway || templates.bootTime != bootTime) {
+        memset(&templates, 0, sizeof(templates));
+        templates.gateway = gateway;
+        templates.bootTime = bootTime;
+    }
+    memmove(&templates.hash[1], &templates.hash[0], sizeof(templates.hash) - sizeof(templates.hash[0]));
+    templates.hash[0] = hash;
+    templatesValid = true;
+    if (flashLogAppendRecord(FLASH_LOG_TEMPLATES, &templates, sizeof(flashTemplates))) {
+        return true;
+    }
+    return flashConfigCompact();
+}
+
+// Forget the template registrations if the gateway has rebooted since it accepted them
+bool flashTemplatesGatewayBooted(uint32_t bootTime)
+{
+    if (!templatesValid || templates.bootTime == bootTime) {
+        return true;
+    }
+    memset(&templates, 0, sizeof(templates));
+    templatesValid = false;
+    if (flashLogAppendRecord(FLASH_LOG_TEMPLATES, &templates, sizeof(flashTemplates))) {
+        return true;
+    }
+    return flashConfigCompact();
 }
 
 // Clear the config and restart
@@ -270,8 +1067,12 @@ void flashConfigFactoryReset()
     if (!flashWrite((uint8_t *)FLASH_CONFIG_BASE_ADDRESS, &config, sizeof(flashConfig))) {
         APP_PRINTF("*** can't reset config ***\r\n");
     }
+    flashErase(FLASH_LOG_ADDRESS, FLASH_LOG_PAGES);
+    flashErase(FLASH_STORE_ADDRESS, FLASH_STORE_PAGES);
+    flashErase(FLASH_SNAPSHOT_ADDRESS, FLASH_SNAPSHOT_PAGES);
 
     ledIndicateAck(3);
+    ledIndicateWait();
 
     NVIC_SystemReset();
 
@@ -281,15 +1082,16 @@ void flashConfigFactoryReset()
 bool flashConfigFindPeerByType(uint16_t peertype, uint8_t *retAddress, uint8_t *retKey, char *retName)
 {
     for (size_t i=0; i<config.peers; i++) {
-        if ((peer[i].type & peertype) != 0) {
+        peerConfig *entry = peerEntry(i);
+        if ((entry->type & peertype) != 0) {
             if (retAddress != NULL) {
-                memcpy(retAddress, peer[i].address, ADDRESS_LEN);
+                memcpy(retAddress, entry->address, ADDRESS_LEN);
             }
             if (retKey != NULL) {
-                memcpy(retKey, peer[i].key, AES_KEY_BYTES);
+                memcpy(retKey, entry->key, AES_KEY_BYTES);
             }
             if (retName != NULL) {
-                memcpy(retName, peer[i].name, SENSOR_NAME_MAX);
+                memcpy(retName, entry->name, SENSOR_NAME_MAX);
             }
             return true;
         }
@@ -300,41 +1102,110 @@ bool flashConfigFindPeerByType(uint16_t peertype, uint8_t *retAddress, uint8_t *
 // Find a peer by Address, returning true if found
 bool flashConfigFindPeerByAddress(uint8_t *address, uint16_t *retPeerType, uint8_t *retKey, char *retName)
 {
-    for (size_t i=0; i<config.peers; i++) {
-        if (memcmp(address, peer[i].address, ADDRESS_LEN) == 0) {
-            if (retPeerType != NULL) {
-                *retPeerType = peer->type;
-            }
-            if (retKey != NULL) {
-                memcpy(retKey, peer[i].key, AES_KEY_BYTES);
-            }
-            if (retName != NULL) {
-                memcpy(retName, peer[i].name, SENSOR_NAME_MAX);
-            }
-            return true;
+    return flashConfigPeerByHandle(flashConfigFindPeerHandle(address), retPeerType, retKey, retName);
+}
+
+// Get a peer's name and location by handle, pointing into its entry rather than copying them.  The
+// name field holds the name and then the location, each null-terminated and the rest zero, so
+// that neither need be parsed on the path of each request.  A location that isn't plausibly an
+// Open Location Code, as in a field written in the former "name [loc]" form, is taken as none
+// until the config DB next rewrites the field.  Returns false if the handle is invalid.
+bool flashConfigPeerNameByHandle(int handle, const char **retName, const char **retLocation)
+{
+    if (handle < 0 || handle >= (int) config.peers) {
+        return false;
+    }
+    const char *field = peerEntry(handle)->name;
+    uint32_t nameLen = strnlen(field, SENSOR_NAME_MAX);
+    const char *location = "";
+    if (nameLen+1 < SENSOR_NAME_MAX) {
+        const char *loc = &field[nameLen+1];
+        uint32_t locLen = strnlen(loc, SENSOR_NAME_MAX-(nameLen+1));
+        bool valid = (nameLen+1+locLen < SENSOR_NAME_MAX);
+        for (uint32_t i=0; valid && i<locLen; i++) {
+            valid = (strchr("23456789CFGHJMPQRVWX+", loc[i]) != NULL);
+        }
+        if (valid) {
+            location = loc;
         }
     }
-    return false;
+    if (retName != NULL) {
+        *retName = (nameLen < SENSOR_NAME_MAX) ? field : "";
+    }
+    if (retLocation != NULL) {
+        *retLocation = location;
+    }
+    return true;
 }
 
-// Update the name of a sensor in-memory if the address matches at least the least significant bytes
-// of the address specified, and return true if it is found and if it was changed.
-bool flashConfigUpdatePeerName(uint8_t *address, uint8_t addressLen, char *name)
+// Get a peer's name and location by address, as flashConfigPeerNameByHandle()
+bool flashConfigFindPeerName(uint8_t *address, const char **retName, const char **retLocation)
 {
-    for (size_t i=0; i<config.peers; i++) {
-        if (memcmp(address, peer[i].address, addressLen) == 0) {
-            if (strcmp(name, peer[i].name) == 0) {
-                return false;
+    return flashConfigPeerNameByHandle(flashConfigFindPeerHandle(address), retName, retLocation);
+}
+
+// Update the name and location of a sensor in-memory if the address matches at least the least
+// significant bytes of the address specified, and return true if it is found and if it was
+// changed.  A full address is found through the index; only abbreviated addresses require a scan
+// of the peer table.  The name is truncated as needed to leave room for the location.  The
+// caller is responsible for calling flashConfigUpdate(), so that many names may be updated with
+// a single write.
+bool flashConfigUpdatePeerName(uint8_t *address, uint8_t addressLen, const char *name, const char *location)
+{
+    int handle = -1;
+    if (addressLen == ADDRESS_LEN) {
+        handle = flashConfigFindPeerHandle(address);
+    } else {
+        for (size_t i=0; i<config.peers; i++) {
+            if (memcmp(address, peerEntry(i)->address, addressLen) == 0) {
+                handle = (int) i;
+                break;
             }
-            strlcpy(peer[i].name, name, sizeof(peer[i].name));
-            return true;
         }
     }
-    return false;
+    if (handle < 0) {
+        return false;
+    }
+
+    // Lay out the field as the name and then the location
+    char field[SENSOR_NAME_MAX] = {0};
+    uint32_t locLen = strlen(location);
+    if (locLen > SENSOR_NAME_MAX/2) {
+        locLen = 0;
+    }
+    uint32_t nameLen = strlen(name);
+    if (nameLen > SENSOR_NAME_MAX-2-locLen) {
+        nameLen = SENSOR_NAME_MAX-2-locLen;
+    }
+    memcpy(field, name, nameLen);
+    memcpy(&field[nameLen+1], location, locLen);
+    if (memcmp(field, peerEntry(handle)->name, SENSOR_NAME_MAX) == 0) {
+        return false;
+    }
+    peerConfig *entry = peerEdit(handle, true);
+    if (entry == NULL) {
+        return false;
+    }
+    memcpy(entry->name, field, sizeof(entry->name));
+    return true;
 }
 
-// Add a peer if it's not already there, and replace it if it's there
+// Add a peer if it's not already there, and replace it if it's there, writing it to flash
 bool flashConfigUpdatePeer(uint16_t peertype, uint8_t *address, uint8_t *key)
+{
+    if (!flashConfigSetPeer(peertype, address, key)) {
+        return false;
+    }
+    if (!flashConfigUpdate()) {
+        APP_PRINTF("*** can't update config ***\r\n");
+        return false;
+    }
+    return true;
+}
+
+// Add a peer if it's not already there, and replace it if it's there, leaving the change to
+// be written by flashConfigUpdateStep() or flashConfigUpdate()
+bool flashConfigSetPeer(uint16_t peertype, uint8_t *address, uint8_t *key)
 {
 
     // Create a new entry
@@ -343,47 +1214,349 @@ bool flashConfigUpdatePeer(uint16_t peertype, uint8_t *address, uint8_t *key)
     memcpy(newEntry.address, address, sizeof(newEntry.address));
     memcpy(newEntry.key, key, sizeof(newEntry.key));
 
-    // Find the peer
-    peerConfig *entry = NULL;
-    for (size_t i=0; i<config.peers; i++) {
-        if (memcmp(address, peer[i].address, ADDRESS_LEN) == 0) {
-            entry = &peer[i];
-            memcpy(newEntry.name, entry->name, sizeof(newEntry.name));
-            break;
+    // If not present, append it
+    int handle = flashConfigFindPeerHandle(address);
+    if (handle < 0) {
+        if (config.peers >= MAX_PEERS) {
+            APP_PRINTF("*** peer table full ***\r\n");
+            return false;
+        }
+        peerConfig *entry = peerEdit(config.peers, false);
+        if (entry == NULL || !peerGrow()) {
+            return false;
         }
+        handle = config.peers-1;
+        memcpy(entry, &newEntry, sizeof(newEntry));
+        peerIndexInsert(handle);
+        return true;
     }
 
-    // If not present, grow, else update if different
-    bool update = false;
-    if (entry == NULL) {
-        peerConfig *new = (peerConfig *) malloc((config.peers+1) * sizeof(peerConfig));
-        if (new == NULL) {
+    // Otherwise update it if different
+    peerConfig *entry = peerEntry(handle);
+    memcpy(newEntry.name, entry->name, sizeof(newEntry.name));
+    if (entry->type != newEntry.type || memcmp(entry->key, newEntry.key, sizeof(newEntry.key)) != 0) {
+        entry = peerEdit(handle, true);
+        if (entry == NULL) {
             return false;
         }
-        memcpy(new, peer, config.peers * sizeof(peerConfig));
-        free(peer);
-        peer = new;
-        entry = &peer[config.peers++];
-        update = true;
-    } else {
-        if (entry->type != newEntry.type) {
-            update = true;
+        memcpy(entry, &newEntry, sizeof(newEntry));
+    }
+
+    // Done
+    return true;
+
+}
+
+// Get the bytes that a record of the outbound store occupies, for a payload of the given length
+uint32_t storeRecordBytes(uint32_t len)
+{
+    return sizeof(flashStoreHeader) + sizeof(uint64_t) + ((len+7) & ~7);
+}
+
+// See if a region of flash is erased
+bool storeErased(uint32_t address, uint32_t len)
+{
+    for (uint32_t i=0; i+sizeof(uint32_t)<=len; i+=sizeof(uint32_t)) {
+        if (*((uint32_t *) (address+i)) != 0xFFFFFFFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Get the valid record at an offset within a page of the outbound store, or NULL if there
+// isn't one, which is where the page's records end
+flashStoreHeader *storeRecordAt(uint32_t page, uint32_t offset)
+{
+    if (offset + storeRecordBytes(0) > FLASH_PAGE_SIZE) {
+        return NULL;
+    }
+    flashStoreHeader *header = (flashStoreHeader *) (FLASH_STORE_ADDRESS + (page*FLASH_PAGE_SIZE) + offset);
+    if (header->signature != FLASH_STORE_RECORD || header->len == 0
+            || offset + storeRecordBytes(header->len) > FLASH_PAGE_SIZE) {
+        return NULL;
+    }
+    uint8_t *payload = ((uint8_t *) header) + sizeof(flashStoreHeader) + sizeof(uint64_t);
+    if (flashLogChecksum(payload, header->len) != header->checksum) {
+        return NULL;
+    }
+    return header;
+}
+
+// See if a record of the outbound store has been delivered, which is so once the doubleword
+// following its header is no longer erased
+bool storeDelivered(flashStoreHeader *header)
+{
+    return *((uint64_t *) (header+1)) != 0xFFFFFFFFFFFFFFFFULL;
+}
+
+// Find the pages of the outbound store that are in use, in order, and count the records not
+// yet delivered.  A page whose records end before anything that isn't erased, left by an
+// append interrupted by a reset, takes no further records.
+void storeScan()
+{
+    if (storeScanned) {
+        return;
+    }
+    storeScanned = true;
+    storePagesInUse = 0;
+    storePending = 0;
+    for (uint32_t page=0; page<FLASH_STORE_PAGES; page++) {
+        flashStorePage *pageHeader = (flashStorePage *) (FLASH_STORE_ADDRESS + (page*FLASH_PAGE_SIZE));
+        storeSequence[page] = 0;
+        storeEnd[page] = FLASH_PAGE_SIZE;
+        if (pageHeader->signature != FLASH_STORE_SIGNATURE || pageHeader->sequence == 0 || pageHeader->sequence == 0xFFFFFFFF) {
+            continue;
         }
-        if (memcmp(entry->key, newEntry.key, sizeof(newEntry.key)) != 0) {
-            update = true;
+        storeSequence[page] = pageHeader->sequence;
+        uint32_t i = storePagesInUse++;
+        while (i > 0 && storeSequence[storeOrder[i-1]] > storeSequence[page]) {
+            storeOrder[i] = storeOrder[i-1];
+            i--;
+        }
+        storeOrder[i] = (uint8_t) page;
+        uint32_t offset = FLASH_STORE_FIRST_RECORD;
+        flashStoreHeader *header;
+        while ((header = storeRecordAt(page, offset)) != NULL) {
+            if (!storeDelivered(header)) {
+                storePending++;
+            }
+            offset += storeRecordBytes(header->len);
+        }
+        uint32_t address = FLASH_STORE_ADDRESS + (page*FLASH_PAGE_SIZE) + offset;
+        if (storeErased(address, FLASH_PAGE_SIZE-offset)) {
+            storeEnd[page] = offset;
         }
     }
+}
 
-    // Update if appropriate
-    if (update) {
-        memcpy(entry, &newEntry, sizeof(newEntry));
-        if (!flashConfigUpdate()) {
-            APP_PRINTF("*** can't update config ***\r\n");
-            return false;
+// Find a record of the outbound store not yet delivered, where 0 is the oldest
+flashStoreHeader *storeFind(uint32_t index)
+{
+    for (uint32_t i=0; i<storePagesInUse; i++) {
+        uint32_t page = storeOrder[i];
+        uint32_t offset = FLASH_STORE_FIRST_RECORD;
+        flashStoreHeader *header;
+        while ((header = storeRecordAt(page, offset)) != NULL) {
+            if (!storeDelivered(header) && index-- == 0) {
+                return header;
+            }
+            offset += storeRecordBytes(header->len);
         }
     }
+    return NULL;
+}
 
-    // Done
+// See if a page of the outbound store holds anything not yet delivered
+bool storePagePending(uint32_t page)
+{
+    if (storeSequence[page] == 0) {
+        return false;
+    }
+    uint32_t offset = FLASH_STORE_FIRST_RECORD;
+    flashStoreHeader *header;
+    while ((header = storeRecordAt(page, offset)) != NULL) {
+        if (!storeDelivered(header)) {
+            return true;
+        }
+        offset += storeRecordBytes(header->len);
+    }
+    return false;
+}
+
+// Get the number of notes in the outbound store that are yet to be delivered
+uint32_t flashStorePending()
+{
+    storeScan();
+    return storePending;
+}
+
+// Get a note in the outbound store that is yet to be delivered, where 0 is the oldest.  The
+// data remains in flash, and is valid until the note is released.
+bool flashStoreRecord(uint32_t index, uint8_t **data, uint32_t *len)
+{
+    storeScan();
+    flashStoreHeader *header = storeFind(index);
+    if (header == NULL) {
+        return false;
+    }
+    *data = ((uint8_t *) header) + sizeof(flashStoreHeader) + sizeof(uint64_t);
+    *len = header->len;
     return true;
+}
+
+// Append a note to the outbound store, returning false if it won't fit or the store is full
+bool flashStoreAppend(uint8_t *data, uint32_t len)
+{
+    storeScan();
+    if (len == 0 || len > FLASH_STORE_PAYLOAD_MAX) {
+        return false;
+    }
+    uint32_t recordBytes = storeRecordBytes(len);
+
+    // Move on to the next page of the ring if the newest can't hold the record, reusing it
+    // only if everything in it has been delivered
+    int newest = (storePagesInUse == 0) ? -1 : storeOrder[storePagesInUse-1];
+    if (newest < 0 || storeEnd[newest] + recordBytes > FLASH_PAGE_SIZE) {
+        uint32_t page = (newest < 0) ? 0 : (newest+1) % FLASH_STORE_PAGES;
+        if (storePagePending(page)) {
+            APP_PRINTF("flash: outbound store is full\r\n");
+            return false;
+        }
+        flashStorePage pageHeader;
+        pageHeader.signature = FLASH_STORE_SIGNATURE;
+        pageHeader.sequence = (newest < 0) ? 1 : storeSequence[newest]+1;
+        uint64_t pageWord;
+        memcpy(&pageWord, &pageHeader, sizeof(pageWord));
+        uint32_t address = FLASH_STORE_ADDRESS + (page*FLASH_PAGE_SIZE);
+        bool success = flashErase(address, 1) && FLASH_write_at(address, &pageWord, sizeof(pageWord));
+        HAL_FLASH_Lock();
 
+        // The page is no longer the oldest in use, if it was, but the newest
+        uint32_t j = 0;
+        for (uint32_t i=0; i<storePagesInUse; i++) {
+            if (storeOrder[i] != page) {
+                storeOrder[j++] = storeOrder[i];
+            }
+        }
+        storePagesInUse = j;
+        storeSequence[page] = 0;
+        storeEnd[page] = FLASH_PAGE_SIZE;
+        if (!success) {
+            APP_PRINTF("flash: can't begin outbound store page\r\n");
+            return false;
+        }
+        storeOrder[storePagesInUse++] = (uint8_t) page;
+        storeSequence[page] = pageHeader.sequence;
+        storeEnd[page] = FLASH_STORE_FIRST_RECORD;
+        newest = page;
+    }
+    uint32_t address = FLASH_STORE_ADDRESS + (newest*FLASH_PAGE_SIZE) + storeEnd[newest];
+
+    // The space is consumed even if programming fails, because it's no longer erased
+    storeEnd[newest] += recordBytes;
+
+    // Program the payload a doubleword at a time, because it needn't be aligned, and then the
+    // header that validates it
+    FLASH_Init();
+    if (HAL_FLASH_Unlock() != HAL_OK) {
+        APP_PRINTF("flash: error unlocking flash for outbound store\r\n");
+        return false;
+    }
+    bool success = true;
+    uint32_t payloadAddress = address + sizeof(flashStoreHeader) + sizeof(uint64_t);
+    for (uint32_t i=0; success && i<len; i+=sizeof(uint64_t)) {
+        uint64_t word = 0;
+        memcpy(&word, &data[i], GMIN(sizeof(uint64_t), len-i));
+        success = FLASH_write_at(payloadAddress+i, &word, sizeof(word));
+    }
+    flashStoreHeader header = {0};
+    header.signature = FLASH_STORE_RECORD;
+    header.len = (uint16_t) len;
+    header.checksum = flashLogChecksum(data, len);
+    uint64_t headerWord;
+    memcpy(&headerWord, &header, sizeof(headerWord));
+    success = success && FLASH_write_at(address, &headerWord, sizeof(headerWord));
+    HAL_FLASH_Lock();
+    if (success) {
+        storePending++;
+    }
+    return success;
+}
+
+// Release the oldest notes in the outbound store once they have been delivered
+void flashStoreRelease(uint32_t count)
+{
+    storeScan();
+    FLASH_Init();
+    if (HAL_FLASH_Unlock() != HAL_OK) {
+        APP_PRINTF("flash: error unlocking flash for outbound store\r\n");
+        return;
+    }
+    uint64_t delivered = 0;
+    for (uint32_t i=0; i<count; i++) {
+        flashStoreHeader *header = storeFind(0);
+        if (header == NULL) {
+            break;
+        }
+        if (!FLASH_write_at((uint32_t) (header+1), &delivered, sizeof(delivered))) {
+            break;
+        }
+        storePending--;
+    }
+    HAL_FLASH_Lock();
+}
+
+// Begin a snapshot, erasing the one before it
+bool flashSnapshotBegin()
+{
+    snapshotEnd = sizeof(flashSnapshotHeader);
+    snapshotWriting = flashErase(FLASH_SNAPSHOT_ADDRESS, FLASH_SNAPSHOT_PAGES);
+    HAL_FLASH_Lock();
+    if (!snapshotWriting) {
+        APP_PRINTF("flash: can't erase snapshot\r\n");
+    }
+    return snapshotWriting;
+}
+
+// Append to the snapshot being written, returning false if it won't fit or can't be programmed
+bool flashSnapshotAppend(void *data, uint32_t len)
+{
+    uint32_t bytes = ((len + sizeof(uint64_t) - 1) / sizeof(uint64_t)) * sizeof(uint64_t);
+    if (!snapshotWriting || snapshotEnd + bytes > FLASH_SNAPSHOT_BYTES) {
+        snapshotWriting = false;
+        return false;
+    }
+    FLASH_Init();
+    if (HAL_FLASH_Unlock() != HAL_OK) {
+        APP_PRINTF("flash: error unlocking flash for snapshot\r\n");
+        snapshotWriting = false;
+        return false;
+    }
+    uint8_t *p = data;
+    uint32_t address = FLASH_SNAPSHOT_ADDRESS + snapshotEnd;
+    for (uint32_t i=0; snapshotWriting && i<len; i+=sizeof(uint64_t)) {
+        uint64_t word = 0;
+        memcpy(&word, &p[i], GMIN(sizeof(uint64_t), len-i));
+        snapshotWriting = FLASH_write_at(address+i, &word, sizeof(word));
+    }
+    HAL_FLASH_Lock();
+    snapshotEnd += bytes;
+    return snapshotWriting;
+}
+
+// Complete the snapshot being written by programming the header that validates it
+bool flashSnapshotEnd()
+{
+    if (!snapshotWriting) {
+        return false;
+    }
+    snapshotWriting = false;
+    flashSnapshotHeader header = {0};
+    header.signature = FLASH_SNAPSHOT_SIGNATURE;
+    header.len = snapshotEnd - sizeof(flashSnapshotHeader);
+    header.crc = utilCRC32(0, (uint8_t *) (FLASH_SNAPSHOT_ADDRESS + sizeof(flashSnapshotHeader)), header.len);
+    uint64_t headerWords[sizeof(flashSnapshotHeader)/sizeof(uint64_t)];
+    memcpy(headerWords, &header, sizeof(headerWords));
+    FLASH_Init();
+    if (HAL_FLASH_Unlock() != HAL_OK) {
+        APP_PRINTF("flash: error unlocking flash for snapshot\r\n");
+        return false;
+    }
+    bool success = FLASH_write_at(FLASH_SNAPSHOT_ADDRESS, headerWords, sizeof(headerWords));
+    HAL_FLASH_Lock();
+    return success;
+}
+
+// Get the payload of the last snapshot completed, or NULL if there's no valid snapshot
+uint8_t *flashSnapshot(uint32_t *len)
+{
+    flashSnapshotHeader *header = (flashSnapshotHeader *) FLASH_SNAPSHOT_ADDRESS;
+    uint8_t *payload = (uint8_t *) (FLASH_SNAPSHOT_ADDRESS + sizeof(flashSnapshotHeader));
+    if (header->signature != FLASH_SNAPSHOT_SIGNATURE || header->len > FLASH_SNAPSHOT_BYTES-sizeof(flashSnapshotHeader)
+            || utilCRC32(0, payload, header->len) != header->crc) {
+        return NULL;
+    }
+    *len = header->len;
+    return payload;
 }
@@ -27,24 +27,34 @@ typedef enum {
     TX,
     TX_TIMEOUT,
     TW_OPEN,
+    RX_WINDOW_OPEN,
 } States_t;
 extern int64_t appBootMs;
+#if SPARROW_ROLE == SPARROW_ROLE_GATEWAY
+#define appIsGateway true
+#elif SPARROW_ROLE == SPARROW_ROLE_SENSOR
+#define appIsGateway false
+#else
 extern bool appIsGateway;
+#endif
 extern uint32_t gatewayBootTime;
 extern char ourAddressText[ADDRESS_LEN*3];
 extern uint8_t ourAddress[ADDRESS_LEN];
 extern uint8_t gatewayAddress[ADDRESS_LEN];
 extern uint8_t invalidAddress[ADDRESS_LEN];
 extern char sensorName[SENSOR_NAME_MAX];
+extern uint16_t batteryMillivolts;
 
 // So that receiver can access them
 extern wireMessageCarrier wireReceivedCarrier;
 extern uint32_t wireReceivedLen;
+extern int wireReceivedPeerHandle;
 extern uint32_t wireReceiveTimeoutMs;
 extern bool wireReceiveSignalValid;
 extern int8_t wireReceiveRSSI;
 extern int8_t wireReceiveSNR;
 extern int8_t wireTransmitDb;
+extern bool radioCadActivityDetected;
 
 typedef struct sensorConfig_c sensorConfig;
 
@@ -54,6 +64,9 @@ typedef struct sensorConfig_c sensorConfig;
 #define SKU_REFERENCE   2
 int appSKU(void);
 void appSetSKU(int);
+#define HARDWARE_BME280 0x00000001
+bool appHardwareProbed(uint32_t hardware, bool *present);
+void appHardwareFound(uint32_t hardware, bool present);
 const char *appFirmwareVersion(void);
 void appEnterSoftAP(void);
 void MX_AppMain(void);
@@ -70,10 +83,39 @@ void appTimerWakeup(void);
 void appButtonWakeup(void);
 void appGatewayInit(void);
 void appGatewayProcess(void);
+void appGatewayEvents(void);
+void appGatewayNotecardProcess(void);
+void appGatewayHousekeepingProcess(void);
+bool appGatewaySnapshotDue(void);
+bool appGatewaySnapshotSave(void);
+void appGatewaySnapshotRestore(void);
+uint32_t gatewaySlotGapSecs(uint32_t *waitSecs);
+void appGatewayCalendarShow(void);
 void appSensorInit(void);
 void appSensorProcess(void);
+void appSensorEvents(void);
 void sensorIgnoreTimeWindow(void);
 void sensorSendReqToGateway(J *req, bool replyRequested);
+void sensorSendDataToGateway(uint8_t *reqData, uint32_t reqDataLen, bool responseRequested);
+void sensorQueueFlush(void);
+uint32_t sensorHoldOffSecs(void);
+uint32_t twMinimumModulusSecs(void);
+uint32_t twSlotStartTime(uint32_t now, uint32_t offsetSecs, uint32_t modulusSecs, uint32_t beginsSecs, uint32_t endsSecs, uint32_t *expiresTime);
+uint8_t twSlotAssign(uint32_t units, uint32_t *slotBeginsSecs, uint32_t sharedBeginsSecs, uint32_t *sharedSensor, uint32_t *beginsSecs, uint32_t *endsSecs);
+uint32_t twSlotUnitsForAirtime(bool measured, uint32_t airtimeAvgMs);
+void twHeatCount(uint32_t agoSecs);
+
+// twsim.c
+bool twsimRun(uint32_t sensors);
+
+// atpsim.c
+void atpsimRecord(int8_t txp, int8_t rssi, int8_t snr, bool lost);
+bool atpsimAppend(char *args);
+void atpsimReset(void);
+bool atpsimShow(void);
+bool atpsimRun(void);
+int sensorRadioApp(void);
+uint32_t sensorQueueDeferSecs(void);
 bool appSensorCacheEntry(uint32_t i, uint8_t *address,
                          int8_t *gatewayRSSI, int8_t *gatewaySNR,
                          int8_t *sensorRSSI, int8_t *sensorSNR,
@@ -81,12 +123,50 @@ bool appSensorCacheEntry(uint32_t i, uint8_t *address,
                          uint32_t *lastReceivedTime,
                          uint32_t *requestsProcessed, uint32_t *requestsLost);
 void appSensorCacheEntryResetStats(uint32_t index);
+bool appSensorCacheEntryDirty(uint32_t index);
+bool appSensorCacheEntryLatency(uint32_t index, uint32_t *p50Ms, uint32_t *p90Ms, uint32_t *maxMs);
 void appSendBeaconToGateway(void);
 void appSendLoRaPacketSizeTestPing(void);
 bool appProcessButton(void);
 uint32_t appTransmitWindowWaitMaxSecs(void);
 uint32_t appNextTransmitWindowDueSecs(void);
+uint32_t appTransmitWindowBeginsAt(uint32_t time);
+int64_t appTimeMs(void);
+uint32_t appTime(void);
+bool appTimeValid(void);
+bool appTimeSyncDue(void);
+void appTimeSync(void);
 void appReceivedMessageStats(int8_t *gtxdb, int8_t *grssi, int8_t *grsnr, int8_t *stxdb, int8_t *srssi, int8_t *srsnr);
+void appReceivedMessageSensor(uint16_t *millivolts, int8_t *ltp);
+uint32_t gatewayWakeSensors(void);
+uint8_t appRadioSyncWord(bool cleartext);
+#define SENSOR_CHECKIN_REQUEST  "sensor.checkin"
+
+// latency.c
+#define LATENCY_HOP_EDGE        0
+#define LATENCY_HOP_ACTIVATED   1
+#define LATENCY_HOP_TIMER       2
+#define LATENCY_HOP_TASK        3
+#define LATENCY_HOPS            4
+#if LATENCY_ON
+void latencyEdge(uint16_t pins);
+void latencyDispatch(uint16_t pins);
+void latencyActivated(int appID);
+void latencyHop(int hop);
+void latencyPolled(int appID);
+void latencyShow(bool reset);
+#define LATENCY_EDGE(pins)          latencyEdge(pins)
+#define LATENCY_DISPATCH(pins)      latencyDispatch(pins)
+#define LATENCY_ACTIVATED(appID)    latencyActivated(appID)
+#define LATENCY_HOP(hop)            latencyHop(hop)
+#define LATENCY_POLLED(appID)       latencyPolled(appID)
+#else
+#define LATENCY_EDGE(pins)
+#define LATENCY_DISPATCH(pins)
+#define LATENCY_ACTIVATED(appID)
+#define LATENCY_HOP(hop)
+#define LATENCY_POLLED(appID)
+#endif
 
 // led.c
 void ledSet(void);
@@ -95,17 +175,24 @@ void ledWalk(void);
 void ledIndicatePairInProgress(bool on);
 bool ledIsPairInProgress(void);
 bool ledIsPairMandatory(void);
+void ledPairExtend(void);
+uint32_t ledPairBeaconWaitSecs(void);
+void ledPairBeaconSent(void);
 void ledIndicateReceiveInProgress(bool on);
 bool ledIsReceiveInProgress(void);
 bool ledIsTransmitInProgress(void);
 void ledIndicateTransmitInProgress(bool on);
+void ledIndicateTransmitWindowWait(void);
 void ledIndicateAck(int flashes);
+void ledIndicateNotPaired(void);
+void ledIndicateWait(void);
 bool ledDisabled(void);
 #define BUTTON_UNCHANGED    0
 #define BUTTON_PRESSED      1
 #define BUTTON_HOLD_ABORTED 2
 #define BUTTON_HELD         3
 uint16_t ledButtonCheck(void);
+void ledButtonEdge(void);
 
 // flash.c
 void flashDFUInit(void);
@@ -113,15 +200,36 @@ void flashCodeParams(uint8_t **activeBase, uint8_t **dfuBase, uint32_t *maxBytes
 void flashConfigFactoryReset(void);
 void flashConfigLoad(void);
 bool flashConfigUpdate(void);
+bool flashConfigUpdateStep(void);
 #define PEER_TYPE_SELF              0x0001
 #define PEER_TYPE_GATEWAY           0x0002
 #define PEER_TYPE_SENSOR            0x0004
+#define PEER_TYPE_RELAY             0x0008
 bool flashConfigUpdatePeer(uint16_t peertype, uint8_t *address, uint8_t *key);
+bool flashConfigSetPeer(uint16_t peertype, uint8_t *address, uint8_t *key);
 bool flashConfigFindPeerByAddress(uint8_t *address, uint16_t *retPeerType, uint8_t *retKey, char *retName);
+int flashConfigFindPeerHandle(uint8_t *address);
+bool flashConfigPeerByHandle(int handle, uint16_t *retPeerType, uint8_t *retKey, char *retName);
+bool flashConfigPeerAddressByHandle(int handle, uint8_t *retAddress);
 bool flashConfigFindPeerByType(uint16_t peertype, uint8_t *retAddress, uint8_t *retKey, char *retName);
-bool flashConfigUpdatePeerName(uint8_t *address, uint8_t addressLen, char *name);
+bool flashConfigUpdatePeerName(uint8_t *address, uint8_t addressLen, const char *name, const char *location);
+bool flashConfigPeerNameByHandle(int handle, const char **retName, const char **retLocation);
+bool flashConfigFindPeerName(uint8_t *address, const char **retName, const char **retLocation);
 uint32_t flashConfigPeers(void);
+bool flashInventoryLoad(uint32_t *sku, uint32_t *probed, uint32_t *present);
+bool flashInventorySave(uint32_t sku, uint32_t probed, uint32_t present);
+bool flashTemplateKnown(uint32_t gateway, uint32_t bootTime, uint32_t hash);
+bool flashTemplateSave(uint32_t gateway, uint32_t bootTime, uint32_t hash);
+bool flashTemplatesGatewayBooted(uint32_t bootTime);
 bool flashWrite(uint8_t *flashDest, void *ramSource, uint32_t bytes);
+uint32_t flashStorePending(void);
+bool flashStoreRecord(uint32_t index, uint8_t **data, uint32_t *len);
+bool flashStoreAppend(uint8_t *data, uint32_t len);
+void flashStoreRelease(uint32_t count);
+bool flashSnapshotBegin(void);
+bool flashSnapshotAppend(void *data, uint32_t len);
+bool flashSnapshotEnd(void);
+uint8_t *flashSnapshot(uint32_t *len);
 
 // radioinit.c
 void radioInit(void);
@@ -129,15 +237,46 @@ void radioDeInit(void);
 bool radioDeepSleep(void);
 void radioDeepWake(void);
 void radioSetChannel(void);
+void radioSetChannelIndex(uint8_t channel);
+uint8_t radioChannelIndex(void);
+uint8_t radioChannels(void);
+void radioNoiseSurvey(void);
+uint8_t radioSlotChannel(uint32_t slot);
+uint32_t radioRxErrorsTake(uint32_t *agoMs);
+uint32_t radioRxQueued(void);
+uint32_t radioChannelFrequency(uint8_t channel);
 void radioSetRFFrequency(uint32_t frequency);
 uint32_t radioWakeupRequiredMs(void);
+uint32_t radioTimeOnAirMs(uint8_t size);
+uint32_t radioTxTimeOnAirMs(uint8_t size);
+uint32_t radioMessageTimeOnAirMs(uint8_t sf);
+uint32_t radioAckTimeOnAirMs(uint8_t sf);
+uint8_t radioChunkLen(uint8_t sf);
+uint32_t radioReplyTimeoutMs(uint32_t marginMs);
+void radioShowAirtime(void);
 void radioRx(uint32_t timeoutMs);
+int64_t radioReceivedMs(void);
+void radioCapture(bool on);
+bool radioReplayAppend(const char *hex);
+bool radioReplayQueue(uint32_t delayMs, int8_t rssi, int8_t snr);
+bool radioSniff(void);
+bool radioRelayListen(void);
+bool radioIsSniffing(void);
+void radioSetWakeupPreamble(bool on);
+void radioImplicitHeaderNext(uint8_t len);
+uint8_t radioImplicitHeaderLen(void);
+void radioSetSyncWord(uint8_t syncWord);
+bool radioCad(void);
 void radioTx(uint8_t *buffer, uint8_t size);
 void radioSetTxPower(int8_t powerLevel);
 void radioSetTxPowerUnknown(void);
+void radioSetSpreadingFactor(uint8_t sf);
+uint8_t radioSpreadingFactor(void);
+void radioSetCodingRate(uint8_t cr);
+uint8_t radioCodingRate(void);
+uint8_t radioCodingRateMax(uint8_t sf);
 
 // sensor.c
-void sensorCmd(char *cmd);
 void sensorTimerCancel(void);
 void sensorTimerStart(void);
 void sensorPoll(void);
@@ -146,32 +285,254 @@ void sensorTimerWakeFromISR(void);
 
 // gateway.c
 bool gatewayProcessSensorRequest(uint8_t *sensorAddress, uint8_t *req, uint32_t reqLen, uint8_t **rsp, uint32_t *rspLen);
+char *gatewayFormatCompactNote(uint8_t *sensorAddress, uint8_t *reqData, uint32_t reqDataLen, uint32_t *lineLen);
+bool gatewayPerformCompactNoteLines(char **lines, uint32_t *lineLen, uint32_t count);
 void gatewayInterrupt(uint16_t interruptType);
 bool gatewayHousekeeping(bool sensorsChanged, uint32_t cachedSensors);
 void gatewayHousekeepingDefer(void);
 void gatewaySetEnvVarDefaults(void);
 bool gatewayEnvVarsLoaded(void);
-void gatewayCmd(char *cmd);
+bool gatewayBootContinue(void);
+bool gatewayProvisioning(void);
+void gatewayProvisionPaired(void);
+typedef void (*gatewayEnvVarChangedFn)(const char *name);
+bool gatewayEnvVarRegisterInt(const char *name, uint32_t *value, uint32_t defaultValue, gatewayEnvVarChangedFn changed);
+bool gatewayEnvVarRegisterString(const char *name, char *value, uint32_t valueLen, const char *defaultValue, gatewayEnvVarChangedFn changed);
+void gatewayCmdRegister(void);
+
+// pktlog.c
+#define PKTLOG_CHUNK                1       // Chunk received in sequence
+#define PKTLOG_AHEAD                2       // Chunk received ahead of a lost chunk
+#define PKTLOG_DUPLICATE            3       // Chunk already received, so our ACK was lost
+#define PKTLOG_BAD_OFFSET           4
+#define PKTLOG_BAD_LENGTH           5
+#define PKTLOG_ACK                  6       // Sensor's ACK of a response chunk
+#define PKTLOG_COMPLETED            7       // Request processed
+#define PKTLOG_IGNORED              8       // Request was a duplicate of one already processed
+void pktlogRecord(const uint8_t *sender, uint32_t requestID, uint32_t offset, int8_t rssi, int8_t snr, int8_t txp, uint8_t outcome, uint32_t latencyMs);
+bool pktlogUpload(void);
+
+// stats.c
+#define STATS_RX                    0       // Packets received, valid or not
+#define STATS_DECRYPT_FAILED        1
+#define STATS_NOT_FOR_US            2
+#define STATS_BAD_OFFSET            3       // Chunks that forced a resync of the transfer
+#define STATS_LBT_BUSY              4       // Listen-before-talk retries on a busy channel
+#define STATS_COUNTERS              5
+#define STATS_SENSOR_LATENCY_BUCKETS 12     // Bucket i counts less than STATS_SENSOR_LATENCY_UNIT_MS<<i,
+#define STATS_SENSOR_LATENCY_UNIT_MS 128    // with the last also holding everything longer
+typedef struct {
+    uint8_t buckets[STATS_SENSOR_LATENCY_BUCKETS];
+    uint16_t maxUnits;              // Longest, in STATS_SENSOR_LATENCY_UNIT_MS rounded up, saturating
+} statsLatency;
+void statsCount(int counter);
+void statsLatencyAdd(statsLatency *l, uint32_t ms);
+uint32_t statsLatencyCount(statsLatency *l);
+uint32_t statsLatencyMaxMs(statsLatency *l);
+uint32_t statsLatencyPercentileMs(statsLatency *l, uint32_t percent);
+void statsNotecardTransaction(const char *req, uint32_t ms, uint32_t bytes);
+void statsNotecardShow(void);
+bool statsLoadTest(uint8_t *sensorAddress, uint8_t *data, uint32_t len, uint32_t latencyMs);
+void statsLoadTestShow(void);
+void statsRadioListening(bool listening);
+bool statsUpload(void);
+
+// relay.c
+bool relayFrameReceived(void);
+bool relayTransmitDone(void);
+void relayCancel(void);
+void relayInit(void);
+void relaySetVia(uint8_t *address);
+uint8_t *relayVia(void);
+void relayLinkFailed(void);
+uint32_t relayHopMs(void);
+void relayDesignationsClear(void);
+void relayDesignationRemove(uint8_t *sensorAddress);
+bool relayDesignate(uint8_t *sensorAddress, uint8_t *relay);
+bool relayDesignatedFor(uint8_t *sensorAddress, uint8_t *retRelayAddress);
+void relayReceivedSignal(void);
+
+// duty.c
+void dutyCharge(uint32_t frequency, uint32_t ms);
+uint32_t dutyWaitMs(uint32_t frequency, uint32_t ms);
+uint32_t dutyUsedPercent(uint32_t frequency);
+
+// compact.c
+#define COMPACT_NOTE_ADD            0x01    // First byte of a compact note.add request
+#define COMPACT_BATCH               0x02    // First byte of a batch of length-prefixed requests
+#define COMPACT_LOAD_TEST           0x05    // First byte of load-test traffic, absorbed by the gateway
+#define COMPACT_AGED                0x04    // First byte of a request prefixed by its age
+#define COMPACT_AGED_PREFIX         (1+sizeof(uint32_t))
+typedef struct __attribute__((__packed__)) {
+    uint8_t Marker;                 // COMPACT_LOAD_TEST
+    uint8_t Stream;                 // Which of the logical sensors emulated by the sender
+    uint32_t Sequence;              // Numbered from 1 within the stream, then padded to size
+} compactLoadTest;
+#define COMPACT_HEALTH              0x06    // First byte of a health record, expanded by the gateway
+#define COMPACT_HEALTH_SYNC         0x01    // The note is to be synced to the notehub immediately
+#define COMPACT_HEALTH_MODES        4       // Run, sleep, STOP2 and off, as PWR_MODE_*
+#define COMPACT_HEALTH_WAKES        5       // RTC, EXTI, radio, UART and other, as PWR_WAKE_*
+typedef struct __attribute__((__packed__)) {
+    uint8_t Marker;                 // COMPACT_HEALTH
+    uint8_t Flags;                  // COMPACT_HEALTH_*
+    uint16_t RequestID;             // Echoed back as the "id" of the response
+    uint32_t Time;                  // When sent, or 0 if the time isn't known
+    uint32_t UptimeSecs;
+    uint16_t ModePermille[COMPACT_HEALTH_MODES];
+    uint16_t Wakes[COMPACT_HEALTH_WAKES];
+    uint32_t TxMs;                  // What all apps and the framework cost since the last record
+    uint32_t TxMicrojoules;
+    uint32_t RxMs;
+    uint32_t AwakeMs;
+} compactHealth;
+#define COMPACT_SCHEDULE            0x07    // First byte of a request prefixed by its sender's schedule
+#define COMPACT_SCHEDULE_MAX        (1+5+5)
+#define COMPACT_MAX_TEMPLATES       8
+#define COMPACT_MAX_FIELDS          16
+#define COMPACT_FILE_MAX            32
+#define COMPACT_NAMES_MAX           160
+#define COMPACT_NOTE_ITEMS          (COMPACT_MAX_FIELDS+4)
+#define COMPACT_ITEM_NUMBER         0
+#define COMPACT_ITEM_BOOL           1
+#define COMPACT_ITEM_STRING         2
+typedef struct {
+    const char *name;
+    uint8_t kind;                   // COMPACT_ITEM_*
+    bool inBody;
+    union {
+        JNUMBER number;
+        bool boolean;
+        const char *string;
+    } value;
+} compactNoteItem;
+typedef struct {
+    const char *req;
+    const char *file;
+    uint8_t items;
+    bool overflow;
+    compactNoteItem item[COMPACT_NOTE_ITEMS];
+} compactNote;
+void compactLearnTemplate(uint8_t *address, J *req);
+bool compactEncodeRequest(J *req, uint8_t **retData, uint32_t *retLen);
+void compactNoteBegin(compactNote *note, const char *req, const char *file);
+void compactNoteNumber(compactNote *note, bool inBody, const char *name, JNUMBER value);
+void compactNoteBool(compactNote *note, bool inBody, const char *name, bool value);
+void compactNoteString(compactNote *note, bool inBody, const char *name, const char *value);
+bool compactNoteEncode(compactNote *note, uint8_t **retData, uint32_t *retLen);
+uint32_t compactNoteWriteJSON(compactNote *note, char *out);
+bool compactDecodeNote(uint8_t *sensorAddress, const char *sensorName, const char *sensorLocationOLC, uint8_t *data, uint32_t len, compactNote *note, char *file, uint32_t filelen, char *errbuf, uint32_t errbuflen);
+J *compactDecodeRequest(uint8_t *sensorAddress, const char *sensorName, const char *sensorLocationOLC, uint8_t *data, uint32_t len, char *errbuf, uint32_t errbuflen);
+J *compactDecodeHealth(uint8_t *sensorAddress, const char *sensorName, uint8_t *data, uint32_t len, char *errbuf, uint32_t errbuflen);
+uint32_t compactEncodeSchedule(uint8_t *prefix, uint32_t periodSecs, uint32_t dueSecs);
+uint32_t compactDecodeSchedule(uint8_t *data, uint32_t len, uint32_t *periodSecs, uint32_t *dueSecs);
+
+// wire.c
+extern uint16_t wirePeerID;
+extern uint8_t wireReceivedFields;
+extern bool wireReceivedCompact;
+extern bool wireReceivedRelayed;
+bool wireShortPeer(uint8_t *address, uint16_t *retPeerID);
+void wireShortPeerHeard(int handle, bool shortHeader);
+uint16_t wireShortFormat(uint8_t *toAddress, uint16_t peerID, wireMessage *msg, bool delta, wireShortCarrier *frame, uint8_t *plain);
+bool wireShortSeal(uint8_t *key, wireShortCarrier *frame, uint8_t *plain, uint16_t len);
+bool wireShortExpandCarrier(void);
+bool wireShortOpen(uint8_t *key, uint8_t *plain, uint16_t *retLen);
+bool wireCompactAckFor(bool shortHeader, uint8_t flags, uint32_t offset, uint32_t len, uint32_t totalLen);
+bool wireCompactAckSeal(uint8_t *key, uint16_t peerID, wireCompactAckBody *body, uint8_t *frame);
+bool wireCompactAckOpen(uint8_t *key, wireMessage *msg);
+bool wireGroupAckOpen(uint8_t *key, wireMessage *msg);
+bool wireShortExpandMessage(uint8_t *plain, uint16_t len, wireMessage *msg);
+uint32_t wirePutVarint(uint8_t *p, uint32_t value);
+bool wireGetVarint(uint8_t **p, uint8_t *end, uint32_t *value);
+
+// jfields.c
+bool jfieldsParse(const char *json, uint32_t len, const schedField *fields, void *out);
+
+// squeeze.c
+#define SQUEEZE_RESPONSE            0x03    // First byte of a squeezed response, distinct from COMPACT_*
+#define SQUEEZE_MAX_BYTES           4096    // Largest response that may be squeezed or expanded
+bool squeezeResponse(uint8_t *data, uint32_t len, uint8_t **retData, uint32_t *retLen);
+bool squeezeExpand(uint8_t *data, uint32_t len, uint8_t **retData, uint32_t *retLen);
 
 // note.c
 bool noteInit(void);
 bool noteSetup(void);
+void noteHubGatewayInit(void);
+void noteHubUrgent(void);
+bool noteHubAdapt(void);
 void noteSendToGatewayAsync(J *req, bool responseExpected);
+void noteSendNoteToGatewayAsync(compactNote *note, bool responseExpected);
+void noteSendHealthToGatewayAsync(uint16_t requestID, bool sync);
+bool noteTemplateKnown(J *req);
+void noteTemplateRegistered(void);
+uint32_t noteI2CBytesMoved(void);
 
 // util.c
 void utilHTOA8(unsigned char n, char *p);
 void utilAddressToText(const uint8_t *address, char *buf, uint32_t buflen);
-void extractNameComponents(char *in, char *namebuf, char *olcbuf, uint32_t olcbuflen);
+int utilTextToAddress(const char *text, uint8_t *address);
+int utilHexDigit(char ch);
+uint32_t utilHashAddress(const uint8_t *address);
+uint32_t utilCRC32(uint32_t crc, const uint8_t *data, uint32_t len);
 
 // auth.c
-J *authRequest(uint8_t *sensorAddress, char *sensorName, char *sensorLocationOLC, J *req);
+J *authRequest(uint8_t *sensorAddress, const char *sensorName, const char *sensorLocationOLC, J *req);
+bool authNote(uint8_t *sensorAddress, const char *sensorName, const char *sensorLocationOLC, compactNote *note, char *file, uint32_t filelen);
 
 // dfuload.c
+#define DFU_LZ_MAGIC            0x5a4c5053  // "SPLZ", which begins the header of a compressed image
+#define DFU_LZ_HEADER_BYTES     12          // Magic, raw length, and length of the token stream
+typedef struct {
+    uint32_t magic;
+    void (*loaderLZ)(uint8_t *dst, uint8_t *src, uint64_t *pageBuffer);
+} dfuLoaderInfo;
+extern const dfuLoaderInfo dfuLoaderResident;
 void dfuLoader(uint8_t *dst, uint8_t *src, uint32_t pages);
+void dfuLoaderLZ(uint8_t *dst, uint8_t *src, uint64_t *pageBuffer);
 
 // dfu.c
 bool noteFirmwareUpdateIfAvailable(void);
 
+// dfulora.c
+#define DFU_LORA_REQUEST        "sensor.dfu.get"
+void dfuLoraGatewayInit(void);
+bool dfuLoraGatewayImage(uint32_t *imageCRC, uint32_t *imageLen);
+J *dfuLoraGatewayRequest(J *req);
+bool dfuLoraSensorInit(void);
+void dfuLoraSensorAck(uint32_t imageCRC, uint32_t imageLen);
+
+// settings.c
+#define SETTINGS_REQUEST        "sensor.settings.get"
+void settingsClear(void);
+void settingsRemove(uint8_t *sensorAddress);
+bool settingsDesignate(const char *noteID, uint8_t *sensorAddress, J *settings);
+uint16_t settingsVersionFor(uint8_t *sensorAddress);
+J *settingsGatewayRequest(uint8_t *sensorAddress);
+bool settingsSensorInit(void);
+void settingsSensorAck(uint16_t version);
+uint16_t settingsVersion(void);
+bool settingsGet(const schedField *fields, void *out);
+
+// timeline.c
+#define TIMELINE_CORE           0
+#define TIMELINE_NOTECARD       1
+#define TIMELINE_LPM            2
+#define TIMELINE_APP            3
+#if TIMELINE_ON
+void timelineRecord(uint8_t track, uint8_t id, int16_t state);
+void timelineLowPower(uint8_t mode);
+bool timelineShow(bool reset);
+#define TIMELINE(track, id, state)  timelineRecord(track, id, state)
+#else
+#define TIMELINE(track, id, state)
+#endif
+
+// uplink.c
+bool uplinkInit(void);
+bool uplinkIsActive(void);
+char *uplinkRequestResponseJSON(const char *reqJSON);
+J *uplinkRequestResponse(J *req);
+
 // post.c
 #define POST_GPIO       0x00000001
 #define POST_BME        0x00000002
@@ -180,18 +541,104 @@ char *post(uint32_t whatToTest);
 // atp.c
 int8_t atpPowerLevel(void);
 int8_t atpLowestPowerLevel(void);
+bool atpAtMaximumPower(void);
+uint32_t atpLossPercent(void);
 void atpMaximizePowerLevel(void);
-void atpMatchPowerLevel(int level);
+typedef struct {
+    int16_t mean;                   // 1/16dB
+    uint16_t deviation;             // 1/16dB
+    uint8_t samples;
+} atpModel;
+typedef struct {
+    uint8_t weightShift;            // Each sample contributes 1/(1<<weightShift)
+    uint8_t confidence;             // Deviations of headroom
+    uint8_t lossDeviationDb;        // Widening for each packet lost
+    int8_t targetRssi;              // dBm at the receiver
+    int8_t targetSnr;               // dB at the receiver
+    int8_t qualityBelow;            // Instantaneous SNR below which the power is raised
+} atpTuning;
+const atpTuning *atpTuningInUse(void);
+void atpModelSample(atpModel *model, int db);
+void atpModelSampleTuned(const atpTuning *tuning, atpModel *model, int db);
+void atpModelWiden(atpModel *model);
+void atpModelWidenTuned(const atpTuning *tuning, atpModel *model);
+int atpModelPowerNeeded(const atpTuning *tuning, atpModel *model, int targetDb);
+void atpNoiseSample(atpModel *noise, int8_t rssi, int8_t snr);
+void atpSetDownlinkPowerLevel(atpModel *loss, atpModel *noise);
+#define ATP_SNAPSHOT_WORDS 3
+void atpSnapshot(uint32_t words[ATP_SNAPSHOT_WORDS]);
+void atpRestore(const uint32_t words[ATP_SNAPSHOT_WORDS]);
 void atpGatewayMessageReceived(int8_t rssi, int8_t snr, int8_t rssiGateway, int8_t snrGateway);
 void atpGatewayMessageLost(void);
 void atpGatewayMessageSent(void);
+uint8_t atpSpreadingFactor(int8_t rssiGateway, int8_t snrGateway, int8_t rssiSensor, int8_t snrSensor, bool bulk);
+typedef struct {
+    uint16_t garbled;               // Smoothed fraction of frames garbled, in 1/1024
+    uint8_t codingRate;             // Coding rate last chosen for the link, or 0 for the default
+} atpLink;
+void atpLinkSample(atpLink *link, bool garbled);
+uint8_t atpCodingRate(atpLink *link, uint8_t sf);
+
+// pool.c
+void *poolAlloc(size_t size);
+void *poolAllocLasting(size_t size);
+void poolFree(void *p);
+void poolArenaBegin(void);
+void *poolArenaEnd(void *keep, size_t len);
+void poolShow(void);
+void poolHighWater(uint32_t *poolBytes, uint32_t *heapBlocks, bool reset);
+
+// prof.c
+#if PROFILER_ON
+void profInit(void);
+uint32_t profCycles(void);
+void profSpan(const char *name, uint32_t beganCycles);
+void profTally(const char *name, uint32_t beganCycles);
+void profMarkBegin(const char *name);
+void profMarkEnd(const char *name);
+void profReset(void);
+void profShow(void);
+void profBenchMem(void);
+void profBenchPrintf(void);
+bool profBenchSuite(uint32_t group);
+#define PROF_BEGIN(var)             uint32_t var = profCycles()
+#define PROF_END(var, name)         profSpan(name, var)
+#define PROF_TALLY(var, name)       profTally(name, var)
+#define PROF_MARK_BEGIN(name)       profMarkBegin(name)
+#define PROF_MARK_END(name)         profMarkEnd(name)
+#else
+#define PROF_BEGIN(var)
+#define PROF_END(var, name)
+#define PROF_TALLY(var, name)
+#define PROF_MARK_BEGIN(name)
+#define PROF_MARK_END(name)
+#endif
+
+// log.c
+#if LOG_DEFERRED
+void logDeferred(const char *format, ...);
+void logDeferredTask(void);
+void logDeferredResume(void);
+#endif
 
 // App logging macros
 #include "stm32_adv_trace.h"
+#if LOG_DEFERRED
+#define APP_PPRINTF(...)  do{ {logDeferred(__VA_ARGS__);} }while(0); /* Queued, so never spins */
+#else
 #define APP_PPRINTF(...)  do{ } while( UTIL_ADV_TRACE_OK \
                               != UTIL_ADV_TRACE_COND_FSend(VLEVEL_L, T_REG_OFF, TS_OFF, __VA_ARGS__) ) /* Polling Mode */
+#endif
 #define APP_TPRINTF(...)   do{ {UTIL_ADV_TRACE_COND_FSend(VLEVEL_L, T_REG_OFF, TS_ON, __VA_ARGS__);} }while(0); /* with timestamp */
+#if LOG_DEFERRED && PROFILER_ON
+#define APP_PRINTF(...)   do{ {PROF_BEGIN(_printfBegan); logDeferred(__VA_ARGS__); PROF_TALLY(_printfBegan, "printf");} }while(0);
+#elif LOG_DEFERRED
+#define APP_PRINTF(...)   do{ {logDeferred(__VA_ARGS__);} }while(0);
+#elif PROFILER_ON
+#define APP_PRINTF(...)   do{ {PROF_BEGIN(_printfBegan); UTIL_ADV_TRACE_COND_FSend(VLEVEL_L, T_REG_OFF, TS_OFF, __VA_ARGS__); PROF_TALLY(_printfBegan, "printf");} }while(0);
+#else
 #define APP_PRINTF(...)   do{ {UTIL_ADV_TRACE_COND_FSend(VLEVEL_L, T_REG_OFF, TS_OFF, __VA_ARGS__);} }while(0);
+#endif
 #if defined (APP_LOG_ENABLED) && (APP_LOG_ENABLED == 1)
 #define APP_LOG(TS,VL,...)   do{ {UTIL_ADV_TRACE_COND_FSend(VL, T_REG_OFF, TS, __VA_ARGS__);} }while(0);
 #elif defined (APP_LOG_ENABLED) && (APP_LOG_ENABLED == 0) /* APP_LOG disabled */
@@ -5,74 +5,666 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "stm32_timer.h"
+#include "stm32_seq.h"
+#include "utilities_def.h"
 #include "main.h"
 #include "board.h"
 #include "framework.h"
 
 // Housekeeping
 uint32_t dbLastUpdateTime = 0;
+bool dbVisitAllSensors = true;
 uint32_t envLastUpdateTime = 0;
 uint32_t envLastModifiedTime = 0;
 uint32_t envLastPeers = 0;
+bool dbConfigRestart = true;
+bool bootNoteSetupDone = false;
+int64_t bootTimeValidMs = 0;
+
+// Housekeeping steps, which are taken one at a time in the gaps between sensors' windows
+#define HK_IDLE             0
+#define HK_DFU              1
+#define HK_ENV_MODIFIED     2
+#define HK_ENV_GET          3
+#define HK_DB_SYNC          4
+#define HK_DB_CHANGES       5
+#define HK_DB_SENSORS       6
+#define HK_ATTN             7
+static uint8_t hkStep = HK_IDLE;
+static uint32_t hkSensor = 0;
+static uint32_t hkCachedSensors = 0;
+static bool hkVisitAll = false;
+static bool hkEnvLoaded = false;
+static volatile bool hkYield = false;
+static int64_t hkLastStepMs = 0;
+static UTIL_TIMER_Object_t hkTimer;
+static bool hkTimerCreated = false;
+
+// Notecard ATTN, which once armed rises when the environment or the config DB changes, so
+// that neither needs to be polled
+#ifdef NOTECARD_ATTN_Pin
+#define GATEWAY_ATTN        true
+#else
+#define GATEWAY_ATTN        false
+#endif
+static volatile bool hkAttnFired = false;
+static bool hkAttnArmed = false;
+static uint32_t hkAttnArmedTime = 0;
+static bool hkAttnEnvChanged = false;
+static bool hkAttnConfigChanged = false;
+static bool hkConfigLoaded = false;
+
+// Sensor counts for the time-window simulation, which simulates one per call
+static const uint16_t twsimSensors[] = { 10, 25, 50, 100, 150 };
+static uint32_t twsimNext = 0;
+
+// A console benchmark of the Notecard's I2C throughput, which performs one request per call
+#define GATEWAY_BENCH_DEFAULT   20
+static uint32_t benchRemaining = 0;
+static uint32_t benchRequests = 0;
+static uint32_t benchStartBytes = 0;
+static int64_t benchStartMs = 0;
+
+// Provisioning
+int64_t provisionLastPairedMs = 0;
 
 // Environment variables
 uint32_t var_gateway_env_update_mins;
 uint32_t var_gateway_pairing_timeout_mins;
+uint32_t var_gateway_pairing_provision;
 uint32_t var_gateway_sensordb_update_mins;
 uint32_t var_gateway_sensordb_reset_counts;
 uint32_t last_var_gateway_sensordb_reset_counts = 0;
 uint32_t time_var_gateway_sensordb_reset_counts = 0;
 
+// Registered environment variables, each parsed into its typed local when its value changes
+#define ENV_VAR_INT     1
+#define ENV_VAR_STRING  2
+typedef struct {
+    const char *name;
+    uint32_t hash;
+    uint8_t type;
+    void *value;
+    uint32_t valueLen;
+    uint32_t defaultInt;
+    const char *defaultString;
+    gatewayEnvVarChangedFn changed;
+} envVarEntry;
+static envVarEntry envVars[GATEWAY_ENV_VARS_MAX];
+static uint32_t envVarCount = 0;
+static bool envDefaultsSet = false;
+
+// Cached responses to sensors' env.get requests, keyed on the request's JSON, and valid
+// only while the environment's modified time is the one at which they were fetched
+typedef struct {
+    uint32_t hash;
+    char *reqJSON;
+    char *rspJSON;
+    uint32_t modifiedTime;
+    uint32_t lastUsed;
+} envCacheEntry;
+static envCacheEntry envCache[GATEWAY_ENV_CACHE];
+static uint32_t envCacheUses = 0;
+
+// Cached responses to sensors' note.template requests, keyed on the CRC and length of the
+// request's JSON without its id and time, which is after the notefile has been substituted
+typedef struct {
+    uint32_t hash;
+    uint32_t len;
+    char rspJSON[GATEWAY_TEMPLATE_CACHE_MAX_BYTES];
+    uint32_t lastUsed;
+} templateCacheEntry;
+static templateCacheEntry templateCache[GATEWAY_TEMPLATE_CACHE];
+static uint32_t templateCacheUses = 0;
+
 // Forwards
-void gatewayUpdateEnvVar(const char *name, const char *value);
+uint32_t gatewayEnvVarHash(const char *name);
+bool gatewayEnvVarRegister(envVarEntry *var);
+void gatewaySetEnvVarDefault(envVarEntry *var);
+bool gatewayUpdateEnvVar(envVarEntry *var, const char *value);
+void gatewayResetCountsChanged(const char *name);
+bool gatewayHousekeepingGap(void);
+bool gatewayHousekeepingStep(void);
+void gatewayHousekeepingResumeLater(void);
+void gatewayHousekeepingEvent(void *context);
+bool gatewayHousekeepingEnvModified(void);
+void gatewayHousekeepingEnvGet(void);
+bool gatewayHousekeepingSyncStatus(void);
+bool gatewayHousekeepingConfigChanges(void);
+void gatewayHousekeepingAttn(void);
+void gatewayAttnInit(void);
+bool gatewayHousekeepingSensor(size_t i);
+bool gatewayCmdRefresh(char *args);
+bool gatewayCmdCounts(char *args);
+bool gatewayCmdWake(char *args);
+bool gatewayCmdBench(char *args);
+bool gatewayCmdStats(char *args);
+bool gatewayCmdCapture(char *args);
+bool gatewayCmdReplayData(char *args);
+bool gatewayCmdReplay(char *args);
+bool gatewayCmdSimulate(char *args);
+bool gatewayCmdCalendar(char *args);
+J *gatewayPerformSensorData(uint8_t *sensorAddress, const char *sensorName, const char *sensorLocationOLC, uint8_t *reqData, uint32_t reqDataLen);
+bool gatewayForwardCompactNote(uint8_t *sensorAddress, const char *sensorName, const char *sensorLocationOLC, uint8_t *reqData, uint32_t reqDataLen, uint8_t **rspJSON, uint32_t *rspJSONLen);
+char *gatewayFormatCompactNoteLine(uint8_t *sensorAddress, const char *sensorName, const char *sensorLocationOLC, uint8_t *reqData, uint32_t reqDataLen, uint32_t *lineLen);
+J *gatewayPerformSensorRequest(uint8_t *sensorAddress, const char *sensorName, const char *sensorLocationOLC, J *req);
+J *gatewayPerformSensorBatch(uint8_t *sensorAddress, const char *sensorName, const char *sensorLocationOLC, uint8_t *batch, uint32_t batchLen);
+J *gatewayEnvCacheLookup(const char *reqJSON, uint32_t hash);
+bool gatewayProcessSensorRequestInArena(uint8_t *sensorAddress, uint8_t *reqData, uint32_t reqDataLen, uint8_t **rspJSON, uint32_t *rspJSONLen);
+void gatewayEnvCacheStore(char *reqJSON, uint32_t hash, J *rsp);
+void gatewayEnvCacheFlush(void);
+uint32_t gatewayTemplateHash(J *req, uint32_t *retLen);
+J *gatewayTemplateCacheLookup(uint32_t hash, uint32_t len, J *req);
+void gatewayTemplateCacheStore(uint32_t hash, uint32_t len, J *rsp);
+
+// Process the received message, which must be followed by at least one writable byte
+// so that JSON requests can be parsed in place.  Everything allocated along the way comes
+// from the pool's arena, which is released as one once the response has been copied out.
+bool gatewayProcessSensorRequest(uint8_t *sensorAddress, uint8_t *reqData, uint32_t reqDataLen, uint8_t **rspJSON, uint32_t *rspJSONLen)
+{
+    poolArenaBegin();
+    bool success = gatewayProcessSensorRequestInArena(sensorAddress, reqData, reqDataLen, rspJSON, rspJSONLen);
+    uint8_t *rsp = (uint8_t *) poolArenaEnd(success ? *rspJSON : NULL, success ? *rspJSONLen : 0);
+    if (success && rsp == NULL) {
+        APP_PRINTF("%s processing sensor request: can't allocate response\r\n", tracePeer());
+        success = false;
+    }
+    *rspJSON = success ? rsp : NULL;
+    return success;
+}
+
+// Process the received message within the arena
+bool gatewayProcessSensorRequestInArena(uint8_t *sensorAddress, uint8_t *reqData, uint32_t reqDataLen, uint8_t **rspJSON, uint32_t *rspJSONLen)
+{
+
+    // Look up the sensor's name and location, which are used when authorizing its requests
+    const char *sensorName = "";
+    const char *sensorLocationOLC = "";
+    flashConfigFindPeerName(sensorAddress, &sensorName, &sensorLocationOLC);
+
+    // Forward a compact note.add straight to the notecard if we can, and otherwise perform
+    // the request, or each request within a batch
+    *rspJSON = NULL;
+    bool forwarded = false;
+    if (GATEWAY_FORWARD_COMPACT_NOTES && reqDataLen > 0 && reqData[0] == COMPACT_NOTE_ADD) {
+        forwarded = gatewayForwardCompactNote(sensorAddress, sensorName, sensorLocationOLC, reqData, reqDataLen, rspJSON, rspJSONLen);
+        if (forwarded && *rspJSON == NULL) {
+            return false;
+        }
+    }
+    if (!forwarded) {
+        J *rsp = gatewayPerformSensorData(sensorAddress, sensorName, sensorLocationOLC, reqData, reqDataLen);
+        if (rsp == NULL) {
+            return false;
+        }
+
+        // Send the response back to the sensor
+        PROF_BEGIN(encodeBegan);
+        *rspJSON = (uint8_t *) JConvertToJSONString(rsp);
+        JDelete(rsp);
+        PROF_END(encodeBegan, "json encode");
+        if (*rspJSON == NULL) {
+            APP_PRINTF("%s processing sensor request: can't allocate response\r\n", tracePeer());
+            return false;
+        }
+        *rspJSONLen = strlen((char *)*rspJSON);
+    }
+
+    // Squeeze it for the trip back if the sensor can expand it
+    uint16_t peerID;
+    uint8_t *squeezed;
+    uint32_t squeezedLen;
+    if (GATEWAY_SQUEEZE_RESPONSES && wireShortPeer(sensorAddress, &peerID)
+            && squeezeResponse(*rspJSON, *rspJSONLen, &squeezed, &squeezedLen)) {
+        TRACE_PRINTF(TRACE_GATEWAY, VLEVEL_L, "%s response squeezed from %d to %d bytes\r\n", tracePeer(), *rspJSONLen, squeezedLen);
+        poolFree(*rspJSON);
+        *rspJSON = squeezed;
+        *rspJSONLen = squeezedLen;
+    }
+    return true;
+
+}
+
+// Decode and authorize a compact note.add, formatting it directly from its packed fields as
+// a single newline-terminated line of JSON, or returning NULL if it must instead be
+// performed by way of a J tree
+char *gatewayFormatCompactNoteLine(uint8_t *sensorAddress, const char *sensorName, const char *sensorLocationOLC, uint8_t *reqData, uint32_t reqDataLen, uint32_t *lineLen)
+{
+    PROF_BEGIN(decodeBegan);
+    compactNote note;
+    char file[64];
+    char errbuf[64];
+    if (!compactDecodeNote(sensorAddress, sensorName, sensorLocationOLC, reqData, reqDataLen, &note, file, sizeof(file), errbuf, sizeof(errbuf))) {
+        return NULL;
+    }
+    if (!authNote(sensorAddress, sensorName, sensorLocationOLC, &note, file, sizeof(file)) || note.overflow) {
+        return NULL;
+    }
+    for (int i=0; i<note.items; i++) {
+        if (!note.item[i].inBody && note.item[i].kind == COMPACT_ITEM_BOOL && note.item[i].value.boolean && strcmp(note.item[i].name, "sync") == 0) {
+            noteHubUrgent();
+        }
+    }
+    uint32_t len = compactNoteWriteJSON(&note, NULL);
+    char *line = (char *) poolAlloc(len+2);
+    if (line == NULL) {
+        return NULL;
+    }
+    compactNoteWriteJSON(&note, line);
+    line[len++] = '\n';
+    line[len] = '\0';
+    PROF_END(decodeBegan, "compact format");
+    *lineLen = len;
+    return line;
+}
+
+// Format a sensor's compact note.add for gatewayPerformCompactNoteLines, looking up the
+// sensor's name and location by which it is authorized
+char *gatewayFormatCompactNote(uint8_t *sensorAddress, uint8_t *reqData, uint32_t reqDataLen, uint32_t *lineLen)
+{
+    if (!GATEWAY_FORWARD_COMPACT_NOTES || reqDataLen == 0 || reqData[0] != COMPACT_NOTE_ADD) {
+        return NULL;
+    }
+    const char *sensorName = "";
+    const char *sensorLocationOLC = "";
+    flashConfigFindPeerName(sensorAddress, &sensorName, &sensorLocationOLC);
+    return gatewayFormatCompactNoteLine(sensorAddress, sensorName, sensorLocationOLC, reqData, reqDataLen, lineLen);
+}
+
+// Perform formatted note.add lines, possibly from several sensors, in a single Notecard
+// transaction.  All but the last are sent as commands, whose responses the Notecard
+// doesn't send and we don't await, and the last as a request whose response shows that
+// the Notecard has taken them all.  Returns false if the transaction failed.
+bool gatewayPerformCompactNoteLines(char **lines, uint32_t *lineLen, uint32_t count)
+{
+    uint32_t len = 0;
+    for (uint32_t i=0; i<count; i++) {
+        len += lineLen[i];
+    }
+    char *reqJSON = (char *) poolAlloc(len+1);
+    if (reqJSON == NULL) {
+        return false;
+    }
+    len = 0;
+    for (uint32_t i=0; i<count; i++) {
+        memcpy(&reqJSON[len], lines[i], lineLen[i]);
+        if (i+1 < count && memcmp(&reqJSON[len], "{\"req\"", 6) == 0) {
+            memcpy(&reqJSON[len+2], "cmd", 3);
+        }
+        len += lineLen[i];
+    }
+    reqJSON[len] = '\0';
+    TRACE_PRINTF(TRACE_GATEWAY, VLEVEL_L, "%s performing %d coalesced notes\r\n", tracePeer(), count);
+    PROF_BEGIN(notecardBegan);
+    char *rsp = uplinkIsActive() ? uplinkRequestResponseJSON(reqJSON) : NoteRequestResponseJSON(reqJSON);
+    PROF_END(notecardBegan, "notecard coalesced request");
+    memset(reqJSON, '?', len);
+    poolFree(reqJSON);
+    if (rsp == NULL) {
+        return false;
+    }
+    if (strstr(rsp, "\"err\"") != NULL) {
+        APP_PRINTF("%s coalesced note failed: %s\r\n", tracePeer(), rsp);
+    }
+    poolFree(rsp);
+    return true;
+}
+
+// Write a compact note.add to the notecard as JSON text formatted directly from its packed
+// fields, returning false if it must instead be performed by way of a J tree, or true with
+// a NULL response if the notecard transaction failed.
+bool gatewayForwardCompactNote(uint8_t *sensorAddress, const char *sensorName, const char *sensorLocationOLC, uint8_t *reqData, uint32_t reqDataLen, uint8_t **rspJSON, uint32_t *rspJSONLen)
+{
+
+    // Decode, authorize, and format it, leaving anything unusual to the general path
+    uint32_t len;
+    char *reqJSON = gatewayFormatCompactNoteLine(sensorAddress, sensorName, sensorLocationOLC, reqData, reqDataLen, &len);
+    if (reqJSON == NULL) {
+        return false;
+    }
 
-// Process the received message
-bool gatewayProcessSensorRequest(uint8_t *sensorAddress, uint8_t *reqJSON, uint32_t reqJSONLen, uint8_t **rspJSON, uint32_t *rspJSONLen)
+    // Perform it, and trim the response's terminator
+    TRACE_PRINTF(TRACE_GATEWAY, VLEVEL_L, "%s processing sensor request:\r\n", tracePeer());
+    PROF_BEGIN(notecardBegan);
+    char *rsp = uplinkIsActive() ? uplinkRequestResponseJSON(reqJSON) : NoteRequestResponseJSON(reqJSON);
+    PROF_END(notecardBegan, "notecard request");
+    poolFree(reqJSON);
+    if (rsp == NULL) {
+        return true;
+    }
+    len = strlen(rsp);
+    while (len > 0 && (rsp[len-1] == '\n' || rsp[len-1] == '\r')) {
+        rsp[--len] = '\0';
+    }
+    *rspJSON = (uint8_t *) rsp;
+    *rspJSONLen = len;
+    return true;
+
+}
+
+// Decode and perform a request in any of the forms in which a sensor may send it,
+// which are JSON text, a compact note.add, a health record, or a batch of them.
+J *gatewayPerformSensorData(uint8_t *sensorAddress, const char *sensorName, const char *sensorLocationOLC, uint8_t *reqData, uint32_t reqDataLen)
 {
 
-    // Marshal the JSON
-    char *reqstr = JAllocString(reqJSON, reqJSONLen);
-    J *req = JConvertFromJSONString(reqstr);
-    JFree(reqstr);
-    J *rsp = NULL;
+    // Perform each of the requests in a batch
+    if (reqDataLen > 0 && reqData[0] == COMPACT_BATCH) {
+        return gatewayPerformSensorBatch(sensorAddress, sensorName, sensorLocationOLC, reqData, reqDataLen);
+    }
+
+    // Marshal the request
+    char errbuf[64];
+    J *req = NULL;
+    if (reqDataLen > 0 && reqData[0] == COMPACT_NOTE_ADD) {
+        PROF_BEGIN(decodeBegan);
+        req = compactDecodeRequest(sensorAddress, sensorName, sensorLocationOLC, reqData, reqDataLen, errbuf, sizeof(errbuf));
+        PROF_END(decodeBegan, "compact decode");
+    } else if (reqDataLen > 0 && reqData[0] == COMPACT_HEALTH) {
+        req = compactDecodeHealth(sensorAddress, sensorName, reqData, reqDataLen, errbuf, sizeof(errbuf));
+    } else {
+        strlcpy(errbuf, "unable to interpret JSON request", sizeof(errbuf));
+        // Parse in place rather than copying the request into a new string.  The byte
+        // following the request is either the allocated terminator or the length of the
+        // next request in a batch, so it is temporarily replaced with a terminator.
+        PROF_BEGIN(parseBegan);
+        uint8_t following = reqData[reqDataLen];
+        reqData[reqDataLen] = '\0';
+        req = JConvertFromJSONString((const char *)reqData);
+        reqData[reqDataLen] = following;
+        PROF_END(parseBegan, "json parse");
+    }
     if (req == NULL) {
-        rsp = JCreateObject();
-        JAddStringToObject(rsp, "err", "unable to interpret JSON request");
+        J *rsp = JCreateObject();
+        JAddStringToObject(rsp, "err", errbuf);
+        return rsp;
+    }
+
+    // Perform it
+    return gatewayPerformSensorRequest(sensorAddress, sensorName, sensorLocationOLC, req);
+
+}
+
+// Authorize and perform a single sensor request, returning the response
+J *gatewayPerformSensorRequest(uint8_t *sensorAddress, const char *sensorName, const char *sensorLocationOLC, J *req)
+{
+    J *rsp;
+
+    // Requests for blocks of a firmware image are served by the gateway itself
+    if (strcmp(JGetString(req, "req"), DFU_LORA_REQUEST) == 0) {
+        rsp = dfuLoraGatewayRequest(req);
+        JDelete(req);
+        return rsp;
+    }
+
+    // Requests for a sensor's settings are served from the config DB by the gateway itself
+    if (strcmp(JGetString(req, "req"), SETTINGS_REQUEST) == 0) {
+        JDelete(req);
+        return settingsGatewayRequest(sensorAddress);
+    }
+
+    // A sensor checking in after being woken needs nothing beyond the ACK
+    if (strcmp(JGetString(req, "req"), SENSOR_CHECKIN_REQUEST) == 0) {
+        JDelete(req);
+        return JCreateObject();
     }
 
+    // Remember templates, so that the sensor's compact requests can be expanded.  This
+    // must be done before the request is authorized, which may rewrite the notefile.
+    compactLearnTemplate(sensorAddress, req);
+
     // Disallow certain requests
-    if (rsp == NULL) {
-        char compositeName[SENSOR_NAME_MAX] = {0};
-        char sensorName[SENSOR_NAME_MAX] = {0};
-        char sensorLocationOLC[16] = {0};
-        if (flashConfigFindPeerByAddress(sensorAddress, NULL, NULL, compositeName)) {
-            extractNameComponents(compositeName, sensorName, sensorLocationOLC, sizeof(sensorLocationOLC));
+    rsp = authRequest(sensorAddress, sensorName, sensorLocationOLC, req);
+    if (rsp != NULL) {
+        JDelete(req);
+        return rsp;
+    }
+
+    // Answer env.get from the cache when the environment hasn't changed since it was fetched
+    char *envReqJSON = NULL;
+    uint32_t envReqHash = 0;
+    if (strcmp(JGetString(req, "req"), "env.get") == 0 && envLastModifiedTime != 0) {
+        envReqJSON = JConvertToJSONString(req);
+        if (envReqJSON != NULL) {
+            envReqHash = gatewayEnvVarHash(envReqJSON);
+            rsp = gatewayEnvCacheLookup(envReqJSON, envReqHash);
+            if (rsp != NULL) {
+                TRACE_PRINTF(TRACE_GATEWAY, VLEVEL_L, "%s env.get answered from cache\r\n", tracePeer());
+                poolFree(envReqJSON);
+                JDelete(req);
+                return rsp;
+            }
         }
-        rsp = authRequest(sensorAddress, sensorName, sensorLocationOLC, req);
     }
 
-    // Perform the request
-    if (rsp != NULL) {
-        if (req != NULL) {
+    // Answer a note.template from the cache when the Notecard already holds it for the notefile,
+    // as it does when many sensors share a notefile, or when a sensor registers it again
+    uint32_t templateHash = 0;
+    uint32_t templateLen = 0;
+    if (strcmp(JGetString(req, "req"), "note.template") == 0) {
+        templateHash = gatewayTemplateHash(req, &templateLen);
+        rsp = gatewayTemplateCacheLookup(templateHash, templateLen, req);
+        if (rsp != NULL) {
+            TRACE_PRINTF(TRACE_GATEWAY, VLEVEL_L, "%s note.template answered from cache\r\n", tracePeer());
             JDelete(req);
+            return rsp;
         }
-    } else {
-        APP_PRINTF("%s processing sensor request:\r\n", tracePeer());
-        rsp = NoteRequestResponse(req);
-        if (rsp == NULL) {
-            return false;
+    }
+
+    // A note that asks to be synced keeps an adaptive gateway's Notecard connected for a while
+    if (JGetBool(req, "sync")) {
+        noteHubUrgent();
+    }
+
+    // Perform the request
+    TRACE_PRINTF(TRACE_GATEWAY, VLEVEL_L, "%s processing sensor request:\r\n", tracePeer());
+    PROF_BEGIN(notecardBegan);
+    rsp = uplinkIsActive() ? uplinkRequestResponse(req) : NoteRequestResponse(req);
+    PROF_END(notecardBegan, "notecard request");
+    if (envReqJSON != NULL) {
+        gatewayEnvCacheStore(envReqJSON, envReqHash, rsp);
+    }
+    if (templateLen != 0) {
+        gatewayTemplateCacheStore(templateHash, templateLen, rsp);
+    }
+    return rsp;
+
+}
+
+// Find a cached env.get response, returning a copy of it
+J *gatewayEnvCacheLookup(const char *reqJSON, uint32_t hash)
+{
+    for (int i=0; i<GATEWAY_ENV_CACHE; i++) {
+        envCacheEntry *e = &envCache[i];
+        if (e->reqJSON != NULL && e->hash == hash && e->modifiedTime == envLastModifiedTime
+                && strcmp(e->reqJSON, reqJSON) == 0) {
+            e->lastUsed = ++envCacheUses;
+            return JConvertFromJSONString(e->rspJSON);
+        }
+    }
+    return NULL;
+}
+
+// Cache a successful env.get response in place of the least recently used entry, taking
+// ownership of the request's JSON
+void gatewayEnvCacheStore(char *reqJSON, uint32_t hash, J *rsp)
+{
+    char *rspJSON = (rsp == NULL || NoteResponseError(rsp)) ? NULL : JConvertToJSONString(rsp);
+    if (rspJSON == NULL || strlen(rspJSON) > GATEWAY_ENV_CACHE_MAX_BYTES) {
+        poolFree(rspJSON);
+        poolFree(reqJSON);
+        return;
+    }
+
+    // The cache outlives the arena in which the request is performed
+    char *keptReqJSON = (char *) poolAllocLasting(strlen(reqJSON)+1);
+    char *keptRspJSON = (char *) poolAllocLasting(strlen(rspJSON)+1);
+    if (keptReqJSON != NULL) {
+        strcpy(keptReqJSON, reqJSON);
+    }
+    if (keptRspJSON != NULL) {
+        strcpy(keptRspJSON, rspJSON);
+    }
+    poolFree(reqJSON);
+    poolFree(rspJSON);
+    reqJSON = keptReqJSON;
+    rspJSON = keptRspJSON;
+    if (reqJSON == NULL || rspJSON == NULL) {
+        poolFree(reqJSON);
+        poolFree(rspJSON);
+        return;
+    }
+    envCacheEntry *slot = &envCache[0];
+    for (int i=0; i<GATEWAY_ENV_CACHE; i++) {
+        envCacheEntry *e = &envCache[i];
+        if (e->reqJSON == NULL || (e->hash == hash && strcmp(e->reqJSON, reqJSON) == 0)) {
+            slot = e;
+            break;
+        }
+        if (e->lastUsed < slot->lastUsed) {
+            slot = e;
+        }
+    }
+    poolFree(slot->reqJSON);
+    poolFree(slot->rspJSON);
+    slot->hash = hash;
+    slot->reqJSON = reqJSON;
+    slot->rspJSON = rspJSON;
+    slot->modifiedTime = envLastModifiedTime;
+    slot->lastUsed = ++envCacheUses;
+}
+
+// Discard all cached env.get responses
+void gatewayEnvCacheFlush()
+{
+    for (int i=0; i<GATEWAY_ENV_CACHE; i++) {
+        envCacheEntry *e = &envCache[i];
+        poolFree(e->reqJSON);
+        poolFree(e->rspJSON);
+        e->reqJSON = NULL;
+        e->rspJSON = NULL;
+    }
+}
+
+// Hash a note.template request without the id and time that differ each time it's sent, returning
+// a length of 0 if it can't be hashed
+uint32_t gatewayTemplateHash(J *req, uint32_t *retLen)
+{
+    J *id = JDetachItemFromObject(req, "id");
+    J *time = JDetachItemFromObject(req, "time");
+    char *json = JConvertToJSONString(req);
+    if (id != NULL) {
+        JAddItemToObject(req, "id", id);
+    }
+    if (time != NULL) {
+        JAddItemToObject(req, "time", time);
+    }
+    *retLen = 0;
+    if (json == NULL) {
+        return 0;
+    }
+    *retLen = strlen(json);
+    uint32_t hash = utilCRC32(0, (uint8_t *) json, *retLen);
+    JFree(json);
+    return hash;
+}
+
+// Find a cached note.template response, returning a copy of it bearing the request's id
+J *gatewayTemplateCacheLookup(uint32_t hash, uint32_t len, J *req)
+{
+    if (len == 0) {
+        return NULL;
+    }
+    for (int i=0; i<GATEWAY_TEMPLATE_CACHE; i++) {
+        templateCacheEntry *e = &templateCache[i];
+        if (e->len == len && e->hash == hash) {
+            e->lastUsed = ++templateCacheUses;
+            J *rsp = JConvertFromJSONString(e->rspJSON);
+            if (rsp != NULL && JIsPresent(req, "id")) {
+                JAddNumberToObject(rsp, "id", JGetNumber(req, "id"));
+            }
+            return rsp;
         }
     }
+    return NULL;
+}
 
-    // Send the response back to the sensor
-    *rspJSON = (uint8_t *) JConvertToJSONString(rsp);
-    JDelete(rsp);
+// Cache a successful note.template response, without its id, in place of the least recently
+// used entry
+void gatewayTemplateCacheStore(uint32_t hash, uint32_t len, J *rsp)
+{
+    if (rsp == NULL || NoteResponseError(rsp)) {
+        return;
+    }
+    J *id = JDetachItemFromObject(rsp, "id");
+    char *rspJSON = JConvertToJSONString(rsp);
+    if (id != NULL) {
+        JAddItemToObject(rsp, "id", id);
+    }
     if (rspJSON == NULL) {
-        APP_PRINTF("%s processing sensor request: can't allocate response\r\n", tracePeer());
-        return false;
+        return;
     }
-    *rspJSONLen = strlen((char *)*rspJSON);
-    return true;
+    if (strlen(rspJSON) < GATEWAY_TEMPLATE_CACHE_MAX_BYTES) {
+        templateCacheEntry *slot = &templateCache[0];
+        for (int i=0; i<GATEWAY_TEMPLATE_CACHE; i++) {
+            templateCacheEntry *e = &templateCache[i];
+            if (e->len == 0) {
+                slot = e;
+                break;
+            }
+            if (e->lastUsed < slot->lastUsed) {
+                slot = e;
+            }
+        }
+        slot->hash = hash;
+        slot->len = len;
+        strlcpy(slot->rspJSON, rspJSON, sizeof(slot->rspJSON));
+        slot->lastUsed = ++templateCacheUses;
+    }
+    JFree(rspJSON);
+}
+
+// Perform, in order, each of the requests within a batch sent by a sensor.  Each is
+// preceded by its 16-bit length.  Sensors only batch requests that don't require a
+// response, so the individual responses are discarded and just a summary is returned.
+J *gatewayPerformSensorBatch(uint8_t *sensorAddress, const char *sensorName, const char *sensorLocationOLC, uint8_t *batch, uint32_t batchLen)
+{
+
+    int count = 0;
+    int failed = 0;
+    uint32_t offset = 1;
+    TRACE_PRINTF(TRACE_GATEWAY, VLEVEL_L, "%s processing batch of sensor requests\r\n", tracePeer());
+    while (offset + sizeof(uint16_t) <= batchLen) {
+        uint32_t reqDataLen = batch[offset] | (batch[offset+1] << 8);
+        offset += sizeof(uint16_t);
+        if (reqDataLen == 0 || offset + reqDataLen > batchLen || batch[offset] == COMPACT_BATCH) {
+            APP_PRINTF("%s batch is malformed\r\n", tracePeer());
+            failed++;
+            break;
+        }
+        count++;
+        J *rsp = gatewayPerformSensorData(sensorAddress, sensorName, sensorLocationOLC, &batch[offset], reqDataLen);
+        offset += reqDataLen;
+        if (rsp == NULL) {
+            failed++;
+            continue;
+        }
+        if (JIsPresent(rsp, "err")) {
+            APP_PRINTF("%s batched request failed: %s\r\n", tracePeer(), JGetString(rsp, "err"));
+            failed++;
+        }
+        JDelete(rsp);
+    }
+
+    // Summarize the results
+    J *rsp = JCreateObject();
+    if (rsp != NULL) {
+        JAddNumberToObject(rsp, "count", count);
+        if (failed) {
+            JAddNumberToObject(rsp, "failed", failed);
+        }
+    }
+    return rsp;
 
 }
 
@@ -85,399 +677,1017 @@ bool gatewayEnvVarsLoaded()
     return gatewayHousekeeping(false, 0);
 }
 
-// Do periodic housekeeping related to the gateway
+// True if the gateway is in pairing mode for mass provisioning
+bool gatewayProvisioning()
+{
+    return (var_gateway_pairing_provision != 0 && ledIsPairInProgress());
+}
+
+// Note that a sensor has paired while provisioning, keeping pairing mode open for the next
+void gatewayProvisionPaired()
+{
+    if (gatewayProvisioning()) {
+        provisionLastPairedMs = TIMER_IF_GetTimeMs();
+        ledPairExtend();
+    }
+}
+
+// Finish the parts of the boot that depend upon the Notecard, returning true when done.  Until
+// then the gateway serves sensors without giving them its time, because they adopt it.
+bool gatewayBootContinue()
+{
+    if (gatewayBootTime != 0) {
+        return true;
+    }
+    if (!bootNoteSetupDone) {
+        noteSetup();
+        gatewayAttnInit();
+        bootNoteSetupDone = true;
+        APP_PRINTF("Waiting for time from Notecard\r\n");
+    }
+    if (!NoteTimeValidST()) {
+        return false;
+    }
+
+    // Wait a while for the time zone too, which the sensors adopt along with the time
+    int64_t nowMs = TIMER_IF_GetTimeMs();
+    if (bootTimeValidMs == 0) {
+        bootTimeValidMs = nowMs;
+    }
+    if (!NoteRegion(NULL, NULL, NULL, NULL) && nowMs < bootTimeValidMs + (GATEWAY_BOOT_ZONE_WAIT_SECS*1000)) {
+        return false;
+    }
+    appTimeSync();
+    gatewayBootTime = appTime();
+    APP_PRINTF("Time: %d (%dms after boot)\r\n", gatewayBootTime, (int) (nowMs - appBootMs));
+    return true;
+}
+
+// See if a slice of housekeeping fits in the time before a sensor is next expected to
+// transmit.  So that housekeeping is never starved by a busy gateway, a step is taken
+// regardless once none has been for a while.
+bool gatewayHousekeepingGap()
+{
+    if (hkYield) {
+        return false;
+    }
+    if (gatewaySlotGapSecs(NULL) >= GATEWAY_HOUSEKEEPING_GAP_SECS) {
+        return true;
+    }
+    return (TIMER_IF_GetTimeMs() >= hkLastStepMs + (GATEWAY_HOUSEKEEPING_STARVE_SECS*1000));
+}
+
+// Stop taking housekeeping steps because a sensor's frame has arrived, which is called
+// from ISRs.  Whatever step is in progress completes first.
+void gatewayHousekeepingDefer()
+{
+    hkYield = true;
+}
+
+// Do periodic housekeeping related to the gateway.  The work is broken into steps, each
+// of at most a couple of Notecard transactions, that are taken only in the gaps between
+// the transmit windows of the sensors, and whatever is left is resumed at the next gap.
 bool gatewayHousekeeping(bool sensorsChanged, uint32_t cachedSensors)
 {
-    uint32_t now = NoteTimeST();
 
-    // If we've added peers since last time, we need to refresh the environment so that
-    // we force the peer table to get the new name for the peer.
+    // Finish booting
+    gatewayBootContinue();
+    hkCachedSensors = cachedSensors;
+    hkYield = false;
+
+    // See if we need to refresh the db
+    if (sensorsChanged) {
+        dbLastUpdateTime = 0;
+        dbVisitAllSensors = true;
+    }
+
+    // If we've added peers since last time, we need to refresh the environment and read the
+    // whole config DB again, so that we force the peer table to get the new name for the peer.
     if (envLastPeers != flashConfigPeers()) {
         envLastUpdateTime = 0;
         envLastModifiedTime = 0;
         envLastPeers = flashConfigPeers();
+        dbConfigRestart = true;
+    }
+
+    // Take steps for as long as no sensor is expected to transmit, leaving a timer to
+    // resume at the next gap if any remain.  Until the env vars have first been loaded
+    // there's no waiting for a gap, because nothing is configured until they are.
+    bool more = true;
+    while (more && (!hkEnvLoaded || gatewayHousekeepingGap())) {
+        more = gatewayHousekeepingStep();
+        hkLastStepMs = TIMER_IF_GetTimeMs();
+        if (!hkEnvLoaded && hkStep == HK_IDLE) {
+            break;
+        }
+    }
+    if (more) {
+        gatewayHousekeepingResumeLater();
     }
 
-    // See if we need to refresh the environment
-    int mins = var_gateway_env_update_mins ? var_gateway_env_update_mins : DEFAULT_GATEWAY_ENV_UPDATE_MINS;
-    while (envLastUpdateTime == 0 || now >= envLastUpdateTime+(mins*60)) {
-        envLastUpdateTime = now;
+    // Return a flag as to whether or not env vars have been loaded
+    return (envLastUpdateTime != 0);
+
+}
+
+// Arm a timer to resume housekeeping when the window that we're in should be finished
+void gatewayHousekeepingResumeLater()
+{
+    uint32_t waitSecs = 0;
+    gatewaySlotGapSecs(&waitSecs);
+    if (waitSecs == 0 || waitSecs > GATEWAY_HOUSEKEEPING_STARVE_SECS) {
+        waitSecs = 1;
+    }
+    if (!hkTimerCreated) {
+        hkTimerCreated = true;
+        UTIL_TIMER_Create(&hkTimer, 0xFFFFFFFFU, UTIL_TIMER_ONESHOT, gatewayHousekeepingEvent, NULL);
+    }
+    UTIL_TIMER_Stop(&hkTimer);
+    UTIL_TIMER_SetPeriod(&hkTimer, waitSecs*1000);
+    UTIL_TIMER_Start(&hkTimer);
+}
+
+// Housekeeping timer has fired, so resume in the background
+void gatewayHousekeepingEvent(void *context)
+{
+    UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Housekeeping), CFG_SEQ_Prio_Notecard);
+}
+
+// Take the next step of housekeeping, returning true if there are more to take
+bool gatewayHousekeepingStep()
+{
+    uint32_t now = appTime();
+    switch (hkStep) {
+
+    case HK_IDLE: {
+
+        // Persist a slice of any peer changes, because no sensor frame is expected right now.
+        // While provisioning, wait for pairings to pause so that they are written together.
+        if (!gatewayProvisioning() || TIMER_IF_GetTimeMs() >= provisionLastPairedMs + (GATEWAY_PROVISION_COMMIT_QUIET_SECS*1000)) {
+            if (flashConfigUpdateStep()) {
+                return true;
+            }
+        }
+
+        // Find out why the Notecard raised ATTN, arming it again now and then in case the
+        // Notecard has restarted and forgotten it, and pick up what it says has changed
+        if (GATEWAY_ATTN && (hkAttnFired || hkAttnArmedTime == 0 || now >= hkAttnArmedTime+(GATEWAY_ATTN_REARM_MINS*60))) {
+            hkStep = HK_ATTN;
+            return true;
+        }
+        if (hkAttnEnvChanged) {
+            hkAttnEnvChanged = false;
+            hkStep = HK_ENV_MODIFIED;
+            return true;
+        }
+        if (hkAttnConfigChanged) {
+            hkAttnConfigChanged = false;
+            hkStep = HK_DB_CHANGES;
+            hkSensor = 0;
+            hkVisitAll = dbVisitAllSensors;
+            dbVisitAllSensors = false;
+            return true;
+        }
+
+        // See if we need to refresh the environment
+        uint32_t mins = var_gateway_env_update_mins ? var_gateway_env_update_mins : DEFAULT_GATEWAY_ENV_UPDATE_MINS;
+        if (envLastUpdateTime == 0 || now >= envLastUpdateTime+(mins*60)) {
+            envLastUpdateTime = now;
+            hkStep = HK_DFU;
+            return true;
+        }
+
+        // See if we need to refresh the db
+        mins = var_gateway_sensordb_update_mins ? var_gateway_sensordb_update_mins : DEFAULT_GATEWAY_SENSORDB_UPDATE_MINS;
+        if (dbLastUpdateTime == 0 || now >= dbLastUpdateTime+(mins*60)) {
+            dbLastUpdateTime = now;
+            hkStep = HK_DB_SYNC;
+            return true;
+        }
+
+        // Snapshot the request cache now and then, so that a reset doesn't lose the slot plan
+        if (appGatewaySnapshotDue()) {
+            appGatewaySnapshotSave();
+            return true;
+        }
+
+        // Set our clock from the Notecard's time now and then, because the RTC drifts
+        if (appTimeSyncDue()) {
+            appTimeSync();
+            return true;
+        }
+
+        // Adapt the Notecard's connection mode to the load on a battery or solar gateway
+        if (noteHubAdapt()) {
+            return true;
+        }
+
+        // Upload the packet event log and the gateway's statistics if they are due
+        if (pktlogUpload()) {
+            return true;
+        }
+        statsUpload();
+        return false;
+    }
+
+    case HK_DFU:
 
         // See if a firmware update is waiting for us.  If we return from this method with true, it
         // means that the update wasn't successfully completed and so we need to restore our modes.
         // A return with false means that no firmware update was available.
         if (noteFirmwareUpdateIfAvailable()) {
             noteSetup();
+            hkAttnArmedTime = 0;
         }
 
-        // See if env vars need to be checked
-        bool refreshEnvVars = false;
-        J *rsp = NoteRequestResponse(NoteNewRequest("env.modified"));
-        if (rsp == NULL) {
-            refreshEnvVars = true;
-            envLastUpdateTime = 0;
+        // Once ATTN is armed, the environment needn't be polled for changes
+        hkStep = (GATEWAY_ATTN && hkAttnArmed && hkEnvLoaded) ? HK_IDLE : HK_ENV_MODIFIED;
+        return true;
+
+    case HK_ENV_MODIFIED:
+        hkStep = gatewayHousekeepingEnvModified() ? HK_ENV_GET : HK_IDLE;
+        hkEnvLoaded |= (hkStep == HK_IDLE && envLastUpdateTime != 0);
+        return true;
+
+    case HK_ENV_GET:
+        gatewayHousekeepingEnvGet();
+        hkStep = HK_IDLE;
+        hkEnvLoaded |= (envLastUpdateTime != 0);
+        return true;
+
+    case HK_DB_SYNC:
+
+        // Once ATTN is armed, the config DB needn't be polled for changes
+        if (GATEWAY_ATTN && hkAttnArmed && hkConfigLoaded) {
+            hkStep = HK_DB_SENSORS;
         } else {
-            if (NoteResponseError(rsp)) {
-                refreshEnvVars = true;
-                envLastUpdateTime = 0;
-            } else {
-                uint32_t modifiedTime = (uint32_t) JGetNumber(rsp, "time");
-                if (envLastModifiedTime != modifiedTime) {
-                    refreshEnvVars = true;
-                    envLastModifiedTime = modifiedTime;
+            hkStep = gatewayHousekeepingSyncStatus() ? HK_DB_CHANGES : HK_DB_SENSORS;
+        }
+        hkSensor = 0;
+        hkVisitAll = dbVisitAllSensors;
+        dbVisitAllSensors = false;
+        return true;
+
+    case HK_DB_CHANGES:
+        if (gatewayHousekeepingConfigChanges()) {
+            return true;
+        }
+        hkStep = HK_DB_SENSORS;
+        hkConfigLoaded = true;
+        return true;
+
+    case HK_ATTN:
+        gatewayHousekeepingAttn();
+        hkStep = HK_IDLE;
+        return true;
+
+    case HK_DB_SENSORS:
+
+        // Visit the sensors, updating those whose stats have changed, and stopping after
+        // each one that needed the Notecard.  Once a sensor's note has been read, what we
+        // write is remembered so that subsequent updates needn't read it back; but when
+        // sensors or their names change, or when the counts are reset, every sensor's note
+        // is read and updated.
+        while (hkSensor < hkCachedSensors) {
+            if (gatewayHousekeepingSensor(hkSensor++)) {
+                return true;
+            }
+        }
+        hkStep = HK_IDLE;
+        return true;
+
+    }
+
+    hkStep = HK_IDLE;
+    return false;
+}
+
+// Configure the input to which the Notecard's ATTN is wired
+void gatewayAttnInit()
+{
+#ifdef NOTECARD_ATTN_Pin
+    GPIO_InitTypeDef init = {0};
+    init.Mode = GPIO_MODE_IT_RISING;
+    init.Pull = GPIO_PULLDOWN;
+    init.Speed = GPIO_SPEED_FREQ_LOW;
+    init.Pin = NOTECARD_ATTN_Pin;
+    HAL_GPIO_Init(NOTECARD_ATTN_GPIO_Port, &init);
+    HAL_NVIC_SetPriority(NOTECARD_ATTN_EXTI_IRQn, NOTECARD_ATTN_IT_PRIORITY, 0x00);
+    HAL_NVIC_EnableIRQ(NOTECARD_ATTN_EXTI_IRQn);
+#endif
+}
+
+// Handle an interrupt on the gateway, which is called from ISRs.  When the Notecard raises
+// ATTN, housekeeping is woken to find out why in the next gap between windows.
+void gatewayInterrupt(uint16_t interruptType)
+{
+#ifdef NOTECARD_ATTN_Pin
+    if ((interruptType & NOTECARD_ATTN_Pin) != 0) {
+        hkAttnFired = true;
+        UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Housekeeping), CFG_SEQ_Prio_Notecard);
+    }
+#endif
+}
+
+// Find out what has changed since ATTN was armed, and arm it again for changes to the
+// environment and to the config DB.  If it rose without saying why, both are reloaded.
+void gatewayHousekeepingAttn()
+{
+    bool fired = hkAttnFired;
+    hkAttnFired = false;
+    hkAttnArmedTime = appTime();
+    if (hkAttnArmed) {
+        J *rsp = NoteRequestResponse(NoteNewRequest("card.attn"));
+        if (rsp != NULL) {
+            bool envChanged = JGetBool(rsp, "env");
+            bool configChanged = false;
+            J *files = JGetObject(rsp, "files");
+            for (int i=0; i<JGetArraySize(files); i++) {
+                if (strcmp(JStringValue(JGetArrayItem(files, i)), CONFIGDB) == 0) {
+                    configChanged = true;
                 }
             }
+            if (fired && !envChanged && !configChanged) {
+                envChanged = configChanged = true;
+            }
+            hkAttnEnvChanged |= envChanged;
+            hkAttnConfigChanged |= configChanged;
             NoteDeleteResponse(rsp);
         }
-        if (!refreshEnvVars) {
-            break;
+    }
+    J *req = NoteNewRequest("card.attn");
+    JAddStringToObject(req, "mode", "arm,env,files");
+    J *files = JAddArrayToObject(req, "files");
+    JAddItemToArray(files, JCreateString(CONFIGDB));
+    J *rsp = NoteRequestResponse(req);
+    hkAttnArmed = (rsp != NULL && !NoteResponseError(rsp));
+    if (rsp != NULL) {
+        if (!hkAttnArmed) {
+            APP_PRINTF("gateway: can't arm notecard ATTN: %s\r\n", JGetString(rsp, "err"));
         }
+        NoteDeleteResponse(rsp);
+    }
+}
 
-        // Load the entire set of env vars, to minimize latency.  We need
-        // to keep latency to a minimum because for every second we spend in
-        // here, it's a second we don't have a receive outstanding.
-        rsp = NoteRequestResponse(NoteNewRequest("env.get"));
-        if (rsp == NULL) {
+// See if the environment has been modified, returning true if it must be reloaded
+bool gatewayHousekeepingEnvModified()
+{
+
+    // See if env vars need to be checked
+    bool refreshEnvVars = false;
+    J *rsp = NoteRequestResponse(NoteNewRequest("env.modified"));
+    if (rsp == NULL) {
+        refreshEnvVars = true;
+        envLastUpdateTime = 0;
+    } else {
+        if (NoteResponseError(rsp)) {
+            refreshEnvVars = true;
             envLastUpdateTime = 0;
-            break;
+        } else {
+            uint32_t modifiedTime = (uint32_t) JGetNumber(rsp, "time");
+            if (envLastModifiedTime != modifiedTime) {
+                refreshEnvVars = true;
+                envLastModifiedTime = modifiedTime;
+                gatewayEnvCacheFlush();
+            }
         }
-
-        // Get the body
-        J *body = JDetachItemFromObject(rsp, "body");
         NoteDeleteResponse(rsp);
+    }
+    return refreshEnvVars;
 
-        // Enumerate fields in the environment body
-        J *field = NULL;
-        JObjectForEach(field, body) {
-            char *value = JStringValue(field);
-            const char *name = JGetItemName(field);
-            gatewayUpdateEnvVar(name, value);
+}
 
-        }
+// Load the environment, updating the registered vars whose values have changed
+void gatewayHousekeepingEnvGet()
+{
 
-        // Done with body, and done refreshing env vars as a batch
-        JDelete(body);
+    // Load the entire set of env vars, to minimize latency.  We need
+    // to keep latency to a minimum because for every second we spend in
+    // here, it's a second we don't have a receive outstanding.
+    J *rsp = NoteRequestResponse(NoteNewRequest("env.get"));
+    if (rsp == NULL) {
+        envLastUpdateTime = 0;
+        return;
+    }
+
+    // Get the body
+    J *body = JDetachItemFromObject(rsp, "body");
+    NoteDeleteResponse(rsp);
 
+    // Enumerate fields in the environment body, updating only the registered vars
+    // whose values have changed, and notifying their owners after the batch so that
+    // they see a consistent set of values.
+    bool changed[GATEWAY_ENV_VARS_MAX] = {0};
+    bool anyChanged = false;
+    J *field = NULL;
+    JObjectForEach(field, body) {
+        const char *name = JGetItemName(field);
+        uint32_t hash = gatewayEnvVarHash(name);
+        for (uint32_t i=0; i<envVarCount; i++) {
+            if (envVars[i].hash == hash && strcmp(envVars[i].name, name) == 0) {
+                changed[i] = gatewayUpdateEnvVar(&envVars[i], JStringValue(field));
+                break;
+            }
+        }
+    }
+    for (uint32_t i=0; i<envVarCount; i++) {
+        if (changed[i] && envVars[i].changed != NULL) {
+            envVars[i].changed(envVars[i].name);
+        }
+        anyChanged |= changed[i];
     }
 
-    // Update the last reset time
-    if (last_var_gateway_sensordb_reset_counts != 0
-            && var_gateway_sensordb_reset_counts != 0
-            && last_var_gateway_sensordb_reset_counts != var_gateway_sensordb_reset_counts) {
-        time_var_gateway_sensordb_reset_counts = NoteTimeST();
+    // Wake the sensors so that their next ACK reflects what changed
+    if (anyChanged) {
+        gatewayWakeSensors();
     }
-    last_var_gateway_sensordb_reset_counts = var_gateway_sensordb_reset_counts;
 
-    // See if we need to refresh the db
-    if (sensorsChanged) {
-        dbLastUpdateTime = 0;
+    // Done with body, and done refreshing env vars as a batch
+    JDelete(body);
+
+}
+
+// See if the service has been synced with, returning true if the config DB should be reloaded
+bool gatewayHousekeepingSyncStatus()
+{
+
+    // Update from the config DB at most when we do a full sync with the service
+    bool updateFromConfigDatabase = false;
+    J *rsp = NoteRequestResponse(NoteNewRequest("hub.sync.status"));
+    if (rsp != NULL) {
+        if (!NoteResponseError(rsp)) {
+            static JTIME lastSyncTime = 0;
+            JTIME syncTime = JGetInt(rsp, "time");
+            if (lastSyncTime == 0 || syncTime != lastSyncTime) {
+                lastSyncTime = syncTime;
+                updateFromConfigDatabase = true;
+            }
+        }
+        NoteDeleteResponse(rsp);
+    }
+    return updateFromConfigDatabase;
+
+}
+
+// Load a page of the names, locations, relays and settings of the sensors from the config DB,
+// returning true if more changes remain to be loaded.  Only the notes that changed since the
+// last page are read, so that with many sensors no one transaction is long, because for every
+// second we spend in here it's a second we don't have a receive outstanding.  After boot, when
+// peers are added, or when a page was lost, the tracker is started over and everything is
+// reloaded.
+bool gatewayHousekeepingConfigChanges()
+{
+
+    // Read the next page of changes
+    bool restart = dbConfigRestart;
+    J *req = NoteNewRequest("note.changes");
+    if (req == NULL) {
+        return false;
     }
-    mins = var_gateway_sensordb_update_mins ? var_gateway_sensordb_update_mins : DEFAULT_GATEWAY_SENSORDB_UPDATE_MINS;
-    if (dbLastUpdateTime == 0 || now >= dbLastUpdateTime+(mins*60)) {
-        dbLastUpdateTime = now;
+    JAddStringToObject(req, "file", CONFIGDB);
+    JAddStringToObject(req, "tracker", CONFIGDB_TRACKER);
+    JAddNumberToObject(req, "max", CONFIGDB_CHANGES_MAX);
+    JAddBoolToObject(req, "deleted", true);
+    if (restart) {
+        JAddBoolToObject(req, "start", true);
+    }
+    NoteSuspendTransactionDebug();
+    J *rsp = NoteRequestResponse(req);
+    NoteResumeTransactionDebug();
 
-        // Update from the config DB at most when we do a full sync with the service
-        bool updateFromConfigDatabase = false;
-        J *rsp = NoteRequestResponse(NoteNewRequest("hub.sync.status"));
+    // The tracker may have moved past changes that we never saw, so start it over next time
+    if (rsp == NULL || NoteResponseError(rsp)) {
         if (rsp != NULL) {
-            if (!NoteResponseError(rsp)) {
-                static JTIME lastSyncTime = 0;
-                JTIME syncTime = JGetInt(rsp, "time");
-                if (lastSyncTime == 0 || syncTime != lastSyncTime) {
-                    lastSyncTime = syncTime;
-                    updateFromConfigDatabase = true;
-                }
-            }
             NoteDeleteResponse(rsp);
         }
+        dbConfigRestart = true;
+        return false;
+    }
+    dbConfigRestart = false;
 
-        // Load the entire set of configuration notes, to minimize latency.  We need
-        // to keep latency to a minimum because for every second we spend in here
-        // it's a second we don't have a receive outstanding.
-        if (updateFromConfigDatabase) {
-            J *req = NoteNewRequest("note.changes");
-            JAddStringToObject(req, "file", CONFIGDB);
-            NoteSuspendTransactionDebug();
-            J *rsp = NoteRequestResponse(req);
-            NoteResumeTransactionDebug();
-            if (rsp != NULL) {
+    // Get the results
+    uint32_t remaining = JGetInt(rsp, "changes");
+    J *notes = JDetachItemFromObject(rsp, "notes");
+    NoteDeleteResponse(rsp);
 
-                // Get the results
-                J *notes = JDetachItemFromObject(rsp, "notes");
-
-                // We no longer need the response
-                NoteDeleteResponse(rsp);
-
-                // Enumerate notes within the results
-                J *note = NULL;
-                bool updateConfig = false;
-                JObjectForEach(note, notes) {
-
-                    // Get the sensor ID (in hex)
-                    const char *sensorIDHex = JGetItemName(note);
-
-                    // Get the sensor location (encoded in OLC format)
-                    const char *bodyName = "";
-                    const char *bodyLoc = "";
-                    J *body = JGetObject(note, "body");
-                    if (body != NULL) {
-                        bodyName = JGetString(body, "name");
-                        bodyLoc = JGetString(body, "loc");
-                    }
-
-                    // Get the sensor name, and create a composite with the location
-                    char sensorName[256];
-                    strlcpy(sensorName, bodyName, sizeof(sensorName));
-                    if (bodyLoc[0] != '\0') {
-                        strlcat(sensorName, " [", sizeof(sensorName));
-                        strlcat(sensorName, bodyLoc, sizeof(sensorName));
-                        strlcat(sensorName, "]", sizeof(sensorName));
-                    }
-
-                    // Convert the sensor ID from hex to binary
-                    bool validHex = true;
-                    uint8_t addrbuf[ADDRESS_LEN];
-                    int addrlen = 0;
-                    const char *p = sensorIDHex;
-                    while (*p != '\0' && *(p+1) != '\0') {
-                        char ch1 = *p++;
-                        char ch2 = *p++;
-                        uint8_t value = 0;
-                        if (ch1 >= '0' && ch1 <= '9') {
-                            value |= (ch1 - '0') << 4;
-                        } else if (ch1 >= 'a' && ch1 <= 'f') {
-                            value |= ((ch1 - 'a') + 10) << 4;
-                        } else if (ch1 >= 'A' && ch1 <= 'F') {
-                            value |= ((ch1 - 'A') + 10) << 4;
-                        } else {
-                            validHex = false;
-                            break;
-                        }
-                        if (ch2 >= '0' && ch2 <= '9') {
-                            value |= (ch2 - '0');
-                        } else if (ch2 >= 'a' && ch2 <= 'f') {
-                            value |= ((ch2 - 'a') + 10);
-                        } else if (ch2 >= 'A' && ch2 <= 'F') {
-                            value |= ((ch2 - 'A') + 10);
-                        } else {
-                            validHex = false;
-                            break;
-                        }
-                        if (addrlen >= ADDRESS_LEN) {
-                            validHex = false;
-                            break;
-                        }
-                        addrlen++;
-                        addrbuf[ADDRESS_LEN-addrlen] = value;
-                    }
-
-                    // If valid hex and the length is at least 2 bytes, set the name
-                    if (validHex && addrlen >= 2) {
-                        if (flashConfigUpdatePeerName(&addrbuf[ADDRESS_LEN-addrlen], addrlen, sensorName)) {
-                            APP_PRINTF("config: %s name updated to '%s'\r\n", sensorIDHex, sensorName);
-                            updateConfig = true;
-                        } else {
-#if 0
-                            APP_PRINTF("config: %s name remains '%s'\r\n", sensorIDHex, sensorName);
-#endif
-                        }
-                    }
+    // When starting over, forget what was loaded before rather than only what changed
+    if (restart) {
+        relayDesignationsClear();
+        settingsClear();
+    }
 
-                }
+    // Enumerate the changed notes, each of which holds a sensor's relay designation and settings
+    J *note = NULL;
+    uint32_t changed = 0;
+    bool updateConfig = false;
+    JObjectForEach(note, notes) {
+        changed++;
 
-                // Done with all configured notes
-                JDelete(notes);
+        // Get the sensor ID (in hex)
+        const char *sensorIDHex = JGetItemName(note);
 
-                // Update the config if something changed
-                if (updateConfig) {
-                    flashConfigUpdate();
-                }
-            }
+        // Get the sensor location (encoded in OLC format)
+        const char *bodyName = "";
+        const char *bodyLoc = "";
+        const char *bodyRelay = "";
+        J *bodySettings = NULL;
+        J *body = JGetObject(note, "body");
+        if (body != NULL) {
+            bodyName = JGetString(body, "name");
+            bodyLoc = JGetString(body, "loc");
+            bodyRelay = JGetString(body, "relay");
+            bodySettings = JGetObject(body, "settings");
         }
 
-        // Now, loop over all sensors, updating them
-        uint32_t notesUpdated = 0;
-        for (size_t i=0; i<cachedSensors; i++) {
-
-            // Get the info
-            uint8_t sensorAddress[ADDRESS_LEN];
-            uint16_t sensorMv;
-            int8_t gatewayRSSI, gatewaySNR, sensorRSSI, sensorSNR, sensorTXP, sensorLTP;
-            uint32_t lastReceivedTime, requestsProcessed, requestsLost;
-            bool valid = appSensorCacheEntry(i, sensorAddress,
-                                             &gatewayRSSI, &gatewaySNR,
-                                             &sensorRSSI, &sensorSNR,
-                                             &sensorTXP, &sensorLTP, &sensorMv,
-                                             &lastReceivedTime,
-                                             &requestsProcessed, &requestsLost);
-            if (!valid) {
-                continue;
-            }
+        // Convert the sensor ID from hex to binary
+        uint8_t addrbuf[ADDRESS_LEN];
+        int addrlen = utilTextToAddress(sensorIDHex, addrbuf);
 
-            // Load the record from the DB, creating the body if it doesn't exist
-            J *req = NoteNewRequest("note.get");
-            if (req == NULL) {
-                continue;
-            }
-            char noteID[40];
-            utilAddressToText(sensorAddress, noteID, sizeof(noteID));
-            JAddStringToObject(req, "note", noteID);
-            JAddStringToObject(req, "file", SENSORDB);
-            NoteSuspendTransactionDebug();
-            J *rsp = NoteRequestResponse(req);
-            NoteResumeTransactionDebug();
-            if (rsp == NULL) {
-                continue;
-            }
-            J *body;
-            bool updateRequired = false;
-            if (NoteResponseError(rsp)) {
-                if (!NoteResponseErrorContains(rsp, "{note-noexist}")) {
-                    NoteDeleteResponse(rsp);
-                    continue;
-                }
-                body = JCreateObject();
-                updateRequired = true;
+        // What the note designated before it changed is replaced by what it says now, and a
+        // deleted note designates nothing
+        if (addrlen == ADDRESS_LEN) {
+            relayDesignationRemove(addrbuf);
+            settingsRemove(addrbuf);
+        }
+        if (JGetBool(note, "deleted")) {
+            continue;
+        }
+
+        // If valid hex and the length is at least 2 bytes, set the name, deferring
+        // the flash write until all notes have been examined
+        if (addrlen >= 2) {
+            if (flashConfigUpdatePeerName(addrbuf, addrlen, bodyName, bodyLoc)) {
+                TRACE_PRINTF(TRACE_GATEWAY, VLEVEL_L, "config: %s name updated to '%s' [%s]\r\n", sensorIDHex, bodyName, bodyLoc);
+                updateConfig = true;
             } else {
-                body = JDetachItemFromObject(rsp, "body");
-                if (body == NULL) {
-                    body = JCreateObject();
-                    updateRequired = true;
-                }
+#if 0
+                TRACE_PRINTF(TRACE_GATEWAY, VLEVEL_L, "config: %s name remains '%s'\r\n", sensorIDHex, bodyName);
+#endif
             }
-            NoteDeleteResponse(rsp);
+        }
 
-            // Update the name in the note if it has changed
-            char sensorName[SENSOR_NAME_MAX];
-            if (flashConfigFindPeerByAddress(sensorAddress, NULL, NULL, sensorName)) {
-                char cleanName[SENSOR_NAME_MAX];
-                extractNameComponents(sensorName, cleanName, NULL, 0);
-                if (strcmp(JGetString(body, SENSORDB_FIELD_NAME), cleanName) != 0) {
-                    JDeleteItemFromObject(body, SENSORDB_FIELD_NAME);
-                    JAddStringToObject(body, SENSORDB_FIELD_NAME, cleanName);
-                    updateRequired = true;
-                }
+        // A sensor beyond our reach may be designated the full address of its relay
+        uint8_t relaybuf[ADDRESS_LEN];
+        if (bodyRelay[0] != '\0') {
+            if (addrlen != ADDRESS_LEN || utilTextToAddress(bodyRelay, relaybuf) != ADDRESS_LEN) {
+                TRACE_PRINTF(TRACE_GATEWAY, VLEVEL_L, "config: %s relay must be a full address\r\n", sensorIDHex);
+            } else if (!relayDesignate(addrbuf, relaybuf)) {
+                TRACE_PRINTF(TRACE_GATEWAY, VLEVEL_L, "config: %s can't be relayed: too many relays\r\n", sensorIDHex);
             }
+        }
 
-            // Update error/success counts, or reset them
-            if (var_gateway_sensordb_reset_counts != 0
-                    && time_var_gateway_sensordb_reset_counts != 0
-                    && (size_t)JGetInt(body, SENSORDB_FIELD_WHEN) < time_var_gateway_sensordb_reset_counts) {
-                JDeleteItemFromObject(body, SENSORDB_FIELD_RECEIVED);
-                JAddNumberToObject(body, SENSORDB_FIELD_RECEIVED, 0);
-                JDeleteItemFromObject(body, SENSORDB_FIELD_LOST);
-                JAddNumberToObject(body, SENSORDB_FIELD_LOST, 0);
-                updateRequired = true;
-            } else if (requestsProcessed > 0 || requestsLost > 0) {
-                requestsProcessed += JGetInt(body, SENSORDB_FIELD_RECEIVED);
-                JDeleteItemFromObject(body, SENSORDB_FIELD_RECEIVED);
-                JAddNumberToObject(body, SENSORDB_FIELD_RECEIVED, requestsProcessed);
-                requestsLost += JGetInt(body, SENSORDB_FIELD_LOST);
-                JDeleteItemFromObject(body, SENSORDB_FIELD_LOST);
-                JAddNumberToObject(body, SENSORDB_FIELD_LOST, requestsLost);
-                updateRequired = true;
+        // A sensor may be given settings, which it fetches when their version changes
+        if (bodySettings != NULL) {
+            if (addrlen != ADDRESS_LEN) {
+                TRACE_PRINTF(TRACE_GATEWAY, VLEVEL_L, "config: %s settings need a full address\r\n", sensorIDHex);
+            } else if (!settingsDesignate(sensorIDHex, addrbuf, bodySettings)) {
+                TRACE_PRINTF(TRACE_GATEWAY, VLEVEL_L, "config: %s settings ignored: too many sensors with settings\r\n", sensorIDHex);
             }
+        }
 
-            // Update signal strength and quality
-            if (lastReceivedTime != (size_t)JGetInt(body, SENSORDB_FIELD_WHEN)) {
-                JDeleteItemFromObject(body, SENSORDB_FIELD_WHEN);
-                JAddNumberToObject(body, SENSORDB_FIELD_WHEN, lastReceivedTime);
-                if (gatewayRSSI != 0 || gatewaySNR != 0) {
-                    JDeleteItemFromObject(body, SENSORDB_FIELD_GATEWAY_RSSI);
-                    JAddNumberToObject(body, SENSORDB_FIELD_GATEWAY_RSSI, gatewayRSSI);
-                    JDeleteItemFromObject(body, SENSORDB_FIELD_GATEWAY_SNR);
-                    JAddNumberToObject(body, SENSORDB_FIELD_GATEWAY_SNR, gatewaySNR);
-                }
-                if (sensorRSSI != 0 || sensorSNR != 0) {
-                    JDeleteItemFromObject(body, SENSORDB_FIELD_SENSOR_RSSI);
-                    JAddNumberToObject(body, SENSORDB_FIELD_SENSOR_RSSI, sensorRSSI);
-                    JDeleteItemFromObject(body, SENSORDB_FIELD_SENSOR_SNR);
-                    JAddNumberToObject(body, SENSORDB_FIELD_SENSOR_SNR, sensorSNR);
-                }
-                JDeleteItemFromObject(body, SENSORDB_FIELD_SENSOR_TXP);
-                JAddNumberToObject(body, SENSORDB_FIELD_SENSOR_TXP, sensorTXP);
-                JDeleteItemFromObject(body, SENSORDB_FIELD_SENSOR_LTP);
-                JAddNumberToObject(body, SENSORDB_FIELD_SENSOR_LTP, sensorLTP);
-                JNUMBER voltage = ((JNUMBER) sensorMv) / 1000;
-                if (voltage != 0) {
-                    JDeleteItemFromObject(body, SENSORDB_FIELD_VOLTAGE);
-                    JAddNumberToObject(body, SENSORDB_FIELD_VOLTAGE, voltage);
-                }
-                updateRequired = true;
-            }
+    }
 
-            // If no update required, continue
-            if (!updateRequired) {
-                JDelete(body);
-                continue;
-            }
+    // Done with this page of notes
+    JDelete(notes);
+    TRACE_PRINTF(TRACE_GATEWAY, VLEVEL_M, "config: %d changed notes loaded, %d remaining\r\n", changed, remaining);
 
-            // Update the note
-            req = NoteNewRequest("note.update");
-            if (req == NULL) {
-                JDelete(body);
-                APP_PRINTF("sensordb update error\r\n");
-                continue;
-            }
-            JAddStringToObject(req, "note", noteID);
-            JAddStringToObject(req, "file", SENSORDB);
-            JAddItemToObject(req, "body", body);
-            bool success = NoteRequest(req);
-            if (!success) {
-                continue;
-            }
-            notesUpdated++;
+    // Names that changed are written to flash in slices by housekeeping
+    if (updateConfig) {
+        TRACE_PRINTF(TRACE_GATEWAY, VLEVEL_L, "gateway: sensor names changed\r\n");
+    }
+
+    // Another page is read in the next step if the tracker has more changes
+    return (remaining > 0 && changed > 0);
+
+}
+
+// Update the sensor DB note of a cached sensor, returning true if the Notecard was used
+bool gatewayHousekeepingSensor(size_t i)
+{
+
+    // Get the info
+    uint8_t sensorAddress[ADDRESS_LEN];
+    uint16_t sensorMv;
+    int8_t gatewayRSSI, gatewaySNR, sensorRSSI, sensorSNR, sensorTXP, sensorLTP;
+    uint32_t lastReceivedTime, requestsProcessed, requestsLost;
+    bool valid = appSensorCacheEntry(i, sensorAddress,
+                                     &gatewayRSSI, &gatewaySNR,
+                                     &sensorRSSI, &sensorSNR,
+                                     &sensorTXP, &sensorLTP, &sensorMv,
+                                     &lastReceivedTime,
+                                     &requestsProcessed, &requestsLost);
+    if (!valid) {
+        return false;
+    }
+    if (!hkVisitAll && !appSensorCacheEntryDirty(i)) {
+        return false;
+    }
+    char noteID[40];
+    utilAddressToText(sensorAddress, noteID, sizeof(noteID));
 
-            // Now that we've updated the note, clear the stats in the cache
-            appSensorCacheEntryResetStats(i);
-            APP_PRINTF("sensordb updated %s\r\n", noteID);
+    // Load the record from the DB, creating the body if it doesn't exist.  Only the dirty bit is
+    // kept for each cached sensor, so the fields that aren't supplied again below are carried
+    // forward from the note itself.
+    J *body;
+    J *req;
+    bool updateRequired = false;
+    req = NoteNewRequest("note.get");
+    if (req == NULL) {
+        return false;
+    }
+    JAddStringToObject(req, "note", noteID);
+    JAddStringToObject(req, "file", SENSORDB);
+    NoteSuspendTransactionDebug();
+    J *rsp = NoteRequestResponse(req);
+    NoteResumeTransactionDebug();
+    if (rsp == NULL) {
+        return true;
+    }
+    if (NoteResponseError(rsp)) {
+        if (!NoteResponseErrorContains(rsp, "{note-noexist}")) {
+            NoteDeleteResponse(rsp);
+            return true;
+        }
+        body = JCreateObject();
+        updateRequired = true;
+    } else {
+        body = JDetachItemFromObject(rsp, "body");
+        if (body == NULL) {
+            body = JCreateObject();
+            updateRequired = true;
+        }
+    }
+    NoteDeleteResponse(rsp);
 
+    // Update the name in the note if it has changed
+    const char *sensorName;
+    if (flashConfigFindPeerName(sensorAddress, &sensorName, NULL)) {
+        if (strcmp(JGetString(body, SENSORDB_FIELD_NAME), sensorName) != 0) {
+            JDeleteItemFromObject(body, SENSORDB_FIELD_NAME);
+            JAddStringToObject(body, SENSORDB_FIELD_NAME, sensorName);
+            updateRequired = true;
         }
+    }
 
+    // Update error/success counts, or reset them
+    if (var_gateway_sensordb_reset_counts != 0
+            && time_var_gateway_sensordb_reset_counts != 0
+            && (size_t)JGetInt(body, SENSORDB_FIELD_WHEN) < time_var_gateway_sensordb_reset_counts) {
+        JDeleteItemFromObject(body, SENSORDB_FIELD_RECEIVED);
+        JAddNumberToObject(body, SENSORDB_FIELD_RECEIVED, 0);
+        JDeleteItemFromObject(body, SENSORDB_FIELD_LOST);
+        JAddNumberToObject(body, SENSORDB_FIELD_LOST, 0);
+        updateRequired = true;
+    } else if (requestsProcessed > 0 || requestsLost > 0) {
+        requestsProcessed += JGetInt(body, SENSORDB_FIELD_RECEIVED);
+        JDeleteItemFromObject(body, SENSORDB_FIELD_RECEIVED);
+        JAddNumberToObject(body, SENSORDB_FIELD_RECEIVED, requestsProcessed);
+        requestsLost += JGetInt(body, SENSORDB_FIELD_LOST);
+        JDeleteItemFromObject(body, SENSORDB_FIELD_LOST);
+        JAddNumberToObject(body, SENSORDB_FIELD_LOST, requestsLost);
+        updateRequired = true;
     }
 
-    // Return a flag as to whether or not env vars have been loaded
-    return (envLastUpdateTime != 0);
+    // Update signal strength and quality
+    if (lastReceivedTime != (size_t)JGetInt(body, SENSORDB_FIELD_WHEN)) {
+        JDeleteItemFromObject(body, SENSORDB_FIELD_WHEN);
+        JAddNumberToObject(body, SENSORDB_FIELD_WHEN, lastReceivedTime);
+        if (gatewayRSSI != 0 || gatewaySNR != 0) {
+            JDeleteItemFromObject(body, SENSORDB_FIELD_GATEWAY_RSSI);
+            JAddNumberToObject(body, SENSORDB_FIELD_GATEWAY_RSSI, gatewayRSSI);
+            JDeleteItemFromObject(body, SENSORDB_FIELD_GATEWAY_SNR);
+            JAddNumberToObject(body, SENSORDB_FIELD_GATEWAY_SNR, gatewaySNR);
+        }
+        if (sensorRSSI != 0 || sensorSNR != 0) {
+            JDeleteItemFromObject(body, SENSORDB_FIELD_SENSOR_RSSI);
+            JAddNumberToObject(body, SENSORDB_FIELD_SENSOR_RSSI, sensorRSSI);
+            JDeleteItemFromObject(body, SENSORDB_FIELD_SENSOR_SNR);
+            JAddNumberToObject(body, SENSORDB_FIELD_SENSOR_SNR, sensorSNR);
+        }
+        JDeleteItemFromObject(body, SENSORDB_FIELD_SENSOR_TXP);
+        JAddNumberToObject(body, SENSORDB_FIELD_SENSOR_TXP, sensorTXP);
+        JDeleteItemFromObject(body, SENSORDB_FIELD_SENSOR_LTP);
+        JAddNumberToObject(body, SENSORDB_FIELD_SENSOR_LTP, sensorLTP);
+        JNUMBER voltage = ((JNUMBER) sensorMv) / 1000;
+        if (voltage != 0) {
+            JDeleteItemFromObject(body, SENSORDB_FIELD_VOLTAGE);
+            JAddNumberToObject(body, SENSORDB_FIELD_VOLTAGE, voltage);
+        }
+        updateRequired = true;
+    }
+
+    // Update how long the sensor's requests took to reach the Notecard, if any were measured
+    uint32_t latencyP50Ms, latencyP90Ms, latencyMaxMs;
+    if (appSensorCacheEntryLatency(i, &latencyP50Ms, &latencyP90Ms, &latencyMaxMs)) {
+        JDeleteItemFromObject(body, SENSORDB_FIELD_LATENCY_P50);
+        JAddNumberToObject(body, SENSORDB_FIELD_LATENCY_P50, latencyP50Ms);
+        JDeleteItemFromObject(body, SENSORDB_FIELD_LATENCY_P90);
+        JAddNumberToObject(body, SENSORDB_FIELD_LATENCY_P90, latencyP90Ms);
+        JDeleteItemFromObject(body, SENSORDB_FIELD_LATENCY_MAX);
+        JAddNumberToObject(body, SENSORDB_FIELD_LATENCY_MAX, latencyMaxMs);
+        updateRequired = true;
+    }
+
+    // If no update required, continue
+    if (!updateRequired) {
+        JDelete(body);
+        return true;
+    }
+
+    // Update the note, sent as a command because we needn't wait for its response
+    req = NoteNewCommand("note.update");
+    if (req == NULL) {
+        JDelete(body);
+        APP_PRINTF("sensordb update error\r\n");
+        return true;
+    }
+    JAddStringToObject(req, "note", noteID);
+    JAddStringToObject(req, "file", SENSORDB);
+    JAddItemToObject(req, "body", body);
+    bool success = NoteRequest(req);
+    if (!success) {
+        return true;
+    }
+
+    // Now that we've updated the note, clear the stats in the cache
+    appSensorCacheEntryResetStats(i);
+    TRACE_PRINTF(TRACE_GATEWAY, VLEVEL_L, "sensordb updated %s\r\n", noteID);
+    return true;
 
 }
 
-// Set defaults for env vars
-void gatewaySetEnvVarDefaults()
+// Hash an env var name, using FNV-1a
+uint32_t gatewayEnvVarHash(const char *name)
 {
-    NoteSetEnvDefaultInt(VAR_GATEWAY_ENV_UPDATE_MINS, DEFAULT_GATEWAY_ENV_UPDATE_MINS);
-    NoteSetEnvDefaultInt(VAR_PAIRING_BEACON_GATEWAY_TIMEOUT_MINS, DEFAULT_PAIRING_BEACON_GATEWAY_TIMEOUT_MINS);
-    NoteSetEnvDefaultInt(VAR_GATEWAY_SENSORDB_UPDATE_MINS, DEFAULT_GATEWAY_SENSORDB_UPDATE_MINS);
-    NoteSetEnvDefaultInt(VAR_GATEWAY_SENSORDB_RESET_COUNTS, DEFAULT_GATEWAY_SENSORDB_RESET_COUNTS);
+    uint32_t hash = 2166136261U;
+    while (*name != '\0') {
+        hash = (hash ^ (uint8_t) *name++) * 16777619U;
+    }
+    return hash;
 }
 
-// Update local vars
-void gatewayUpdateEnvVar(const char *name, const char *value)
+// Add an env var to the table and apply its default locally, as well as to the Notecard
+// if the defaults for the built-in vars have already been sent.
+bool gatewayEnvVarRegister(envVarEntry *var)
 {
-    if (strcmp(VAR_GATEWAY_ENV_UPDATE_MINS, name) == 0) {
-        var_gateway_env_update_mins = JAtoI(value);
+    if (envVarCount >= GATEWAY_ENV_VARS_MAX) {
+        APP_PRINTF("env: no room to register %s\r\n", var->name);
+        return false;
     }
-    if (strcmp(VAR_PAIRING_BEACON_GATEWAY_TIMEOUT_MINS, name) == 0) {
-        var_gateway_pairing_timeout_mins = JAtoI(value);
+    var->hash = gatewayEnvVarHash(var->name);
+    envVars[envVarCount] = *var;
+    var = &envVars[envVarCount++];
+    if (var->type == ENV_VAR_INT) {
+        *((uint32_t *) var->value) = var->defaultInt;
+    } else {
+        strlcpy((char *) var->value, var->defaultString, var->valueLen);
     }
-    if (strcmp(VAR_GATEWAY_SENSORDB_UPDATE_MINS, name) == 0) {
-        var_gateway_sensordb_update_mins = JAtoI(value);
+    if (envDefaultsSet) {
+        gatewaySetEnvVarDefault(var);
+        envLastModifiedTime = 0;
     }
-    if (strcmp(VAR_GATEWAY_SENSORDB_RESET_COUNTS, name) == 0) {
-        var_gateway_sensordb_reset_counts = JAtoI(value);
+    return true;
+}
+
+// Register an integer env var
+bool gatewayEnvVarRegisterInt(const char *name, uint32_t *value, uint32_t defaultValue, gatewayEnvVarChangedFn changed)
+{
+    envVarEntry var = {
+        .name = name,
+        .type = ENV_VAR_INT,
+        .value = value,
+        .valueLen = sizeof(uint32_t),
+        .defaultInt = defaultValue,
+        .changed = changed,
+    };
+    return gatewayEnvVarRegister(&var);
+}
+
+// Register a string env var, whose value is truncated to fit the buffer
+bool gatewayEnvVarRegisterString(const char *name, char *value, uint32_t valueLen, const char *defaultValue, gatewayEnvVarChangedFn changed)
+{
+    if (valueLen == 0) {
+        return false;
+    }
+    if (defaultValue == NULL) {
+        defaultValue = "";
     }
+    envVarEntry var = {
+        .name = name,
+        .type = ENV_VAR_STRING,
+        .value = value,
+        .valueLen = valueLen,
+        .defaultString = defaultValue,
+        .changed = changed,
+    };
+    return gatewayEnvVarRegister(&var);
 }
 
-// Execute console command
-void gatewayCmd(char *cmd)
+// Send an env var's default to the Notecard
+void gatewaySetEnvVarDefault(envVarEntry *var)
 {
-    if (strcmp(cmd, "refresh") == 0 || strcmp(cmd, "r") == 0) {
-        APP_PRINTF("REFRESH DB\r\n");
-        dbLastUpdateTime = 0;
-    } else if (strcmp(cmd, "counts") == 0 || strcmp(cmd, "count") == 0 || strcmp(cmd, "c") == 0) {
-        APP_PRINTF("RESET COUNTS\r\n");
-        time_var_gateway_sensordb_reset_counts = NoteTimeST();
-        dbLastUpdateTime = 0;
+    if (var->type == ENV_VAR_INT) {
+        NoteSetEnvDefaultInt(var->name, (JINTEGER) var->defaultInt);
     } else {
-        APP_PRINTF("??\r\n");
+        NoteSetEnvDefault(var->name, (char *) var->defaultString);
+    }
+}
+
+// Register the gateway's own env vars, and set defaults for all registered env vars
+void gatewaySetEnvVarDefaults()
+{
+    if (!envDefaultsSet) {
+        gatewayEnvVarRegisterInt(VAR_GATEWAY_ENV_UPDATE_MINS, &var_gateway_env_update_mins, DEFAULT_GATEWAY_ENV_UPDATE_MINS, NULL);
+        gatewayEnvVarRegisterInt(VAR_PAIRING_BEACON_GATEWAY_TIMEOUT_MINS, &var_gateway_pairing_timeout_mins, DEFAULT_PAIRING_BEACON_GATEWAY_TIMEOUT_MINS, NULL);
+        gatewayEnvVarRegisterInt(VAR_PAIRING_PROVISION, &var_gateway_pairing_provision, DEFAULT_PAIRING_PROVISION, NULL);
+        gatewayEnvVarRegisterInt(VAR_GATEWAY_SENSORDB_UPDATE_MINS, &var_gateway_sensordb_update_mins, DEFAULT_GATEWAY_SENSORDB_UPDATE_MINS, NULL);
+        gatewayEnvVarRegisterInt(VAR_GATEWAY_SENSORDB_RESET_COUNTS, &var_gateway_sensordb_reset_counts, DEFAULT_GATEWAY_SENSORDB_RESET_COUNTS, gatewayResetCountsChanged);
+        gatewayEnvVarRegisterInt(VAR_GATEWAY_PKTLOG_MINS, &var_gateway_pktlog_mins, DEFAULT_GATEWAY_PKTLOG_MINS, NULL);
+    }
+    for (uint32_t i=0; i<envVarCount; i++) {
+        gatewaySetEnvVarDefault(&envVars[i]);
+    }
+    envDefaultsSet = true;
+}
+
+// Parse a new value into an env var's local, returning true if the local changed
+bool gatewayUpdateEnvVar(envVarEntry *var, const char *value)
+{
+    if (value == NULL) {
+        value = "";
+    }
+    if (var->type == ENV_VAR_INT) {
+        uint32_t newValue = (uint32_t) JAtoI(value);
+        uint32_t *local = (uint32_t *) var->value;
+        if (*local == newValue) {
+            return false;
+        }
+        *local = newValue;
+        return true;
+    }
+    if (var->type == ENV_VAR_STRING) {
+        char *local = (char *) var->value;
+        if (strncmp(local, value, var->valueLen-1) == 0) {
+            return false;
+        }
+        strlcpy(local, value, var->valueLen);
+        return true;
+    }
+    return false;
+}
+
+// When the reset counter changes, note the time of the reset so that the counts in every
+// sensor's sensors.db note are cleared.  The first value loaded after boot isn't a reset.
+void gatewayResetCountsChanged(const char *name)
+{
+    if (last_var_gateway_sensordb_reset_counts != 0 && var_gateway_sensordb_reset_counts != 0) {
+        time_var_gateway_sensordb_reset_counts = appTime();
+        dbVisitAllSensors = true;
+    }
+    last_var_gateway_sensordb_reset_counts = var_gateway_sensordb_reset_counts;
+}
+
+// Console command to refresh the sensor database at the next housekeeping
+bool gatewayCmdRefresh(char *args)
+{
+    APP_PRINTF("REFRESH DB\r\n");
+    dbLastUpdateTime = 0;
+    return false;
+}
+
+// Console command to reset the sensor counts at the next housekeeping
+bool gatewayCmdCounts(char *args)
+{
+    APP_PRINTF("RESET COUNTS\r\n");
+    time_var_gateway_sensordb_reset_counts = appTime();
+    dbLastUpdateTime = 0;
+    return false;
+}
+
+// Console command to wake all sensors
+bool gatewayCmdWake(char *args)
+{
+    APP_PRINTF("WAKE SENSORS\r\n");
+    gatewayWakeSensors();
+    return false;
+}
+
+// Console command to show when the sensors are next due
+bool gatewayCmdCalendar(char *args)
+{
+    appGatewayCalendarShow();
+    return false;
+}
+
+// Gateway console commands
+static const traceCmd gatewayCmds[] = {
+    {"refresh", "r", TRACE_CMD_GATEWAY, gatewayCmdRefresh},
+    {"counts", "c", TRACE_CMD_GATEWAY, gatewayCmdCounts},
+    {"count", NULL, TRACE_CMD_GATEWAY, gatewayCmdCounts},
+    {"wake", "w", TRACE_CMD_GATEWAY, gatewayCmdWake},
+    {"i2cbench", NULL, TRACE_CMD_GATEWAY, gatewayCmdBench},
+    {"stats", NULL, TRACE_CMD_GATEWAY, gatewayCmdStats},
+    {"capture", NULL, TRACE_CMD_GATEWAY|TRACE_CMD_ARGS, gatewayCmdCapture},
+    {"rx+", NULL, TRACE_CMD_GATEWAY|TRACE_CMD_ARGS, gatewayCmdReplayData},
+    {"rx", NULL, TRACE_CMD_GATEWAY|TRACE_CMD_ARGS, gatewayCmdReplay},
+    {"twsim", NULL, TRACE_CMD_GATEWAY, gatewayCmdSimulate},
+    {"calendar", NULL, TRACE_CMD_GATEWAY, gatewayCmdCalendar},
+};
+
+// Console command to measure the Notecard's I2C throughput over a number of card.version
+// requests, which defaults to GATEWAY_BENCH_DEFAULT
+bool gatewayCmdBench(char *args)
+{
+
+    // Begin
+    if (benchRemaining == 0) {
+        uint32_t count = (uint32_t) atoi(args);
+        benchRemaining = (count == 0) ? GATEWAY_BENCH_DEFAULT : count;
+        benchRequests = 0;
+        benchStartBytes = noteI2CBytesMoved();
+        benchStartMs = TIMER_IF_GetTimeMs();
+        APP_PRINTF("BENCH %d requests at %dkHz with %d-byte segments\r\n", benchRemaining, NOTECARD_I2C_KHZ, NOTECARD_I2C_SEGMENT_BYTES);
     }
+
+    // Perform one request per call so that the console and radio aren't starved
+    J *rsp = NoteRequestResponse(NoteNewRequest("card.version"));
+    if (rsp != NULL) {
+        if (!NoteResponseError(rsp)) {
+            benchRequests++;
+        }
+        NoteDeleteResponse(rsp);
+    }
+    if (--benchRemaining > 0) {
+        return true;
+    }
+
+    // Report
+    uint32_t ms = (uint32_t) (TIMER_IF_GetTimeMs() - benchStartMs);
+    uint32_t bytes = noteI2CBytesMoved() - benchStartBytes;
+    if (ms == 0) {
+        ms = 1;
+    }
+    APP_PRINTF("BENCH %d ok, %d bytes in %dms: %d bytes/s, %dms/request\r\n", benchRequests, bytes, ms, (uint32_t) (((uint64_t) bytes * 1000) / ms), benchRequests ? ms / benchRequests : 0);
+    return false;
+
+}
+
+// Console command to display the Notecard's latency by request type, and what load-test
+// traffic has achieved
+bool gatewayCmdStats(char *args)
+{
+    statsNotecardShow();
+    statsLoadTestShow();
+    return false;
+}
+
+// Console command to turn on, or with "off" to turn off, the capture of received frames
+bool gatewayCmdCapture(char *args)
+{
+    bool on = (strcmp(args, "off") != 0);
+    radioCapture(on);
+    APP_PRINTF("CAPTURE %s\r\n", on ? "ON" : "OFF");
+    return false;
+}
+
+// Console command to append hex to the frame being staged for replay
+bool gatewayCmdReplayData(char *args)
+{
+    if (!radioReplayAppend(args)) {
+        APP_PRINTF("replay: bad frame data\r\n");
+    }
+    return false;
+}
+
+// Console command to replay the staged frame, given its delay after the previous frame
+// and its RSSI and SNR
+bool gatewayCmdReplay(char *args)
+{
+    char *p = args;
+    uint32_t delayMs = (uint32_t) strtol(p, &p, 10);
+    int8_t rssi = (int8_t) strtol(p, &p, 10);
+    int8_t snr = (int8_t) strtol(p, &p, 10);
+    if (!radioReplayQueue(delayMs, rssi, snr)) {
+        APP_PRINTF("replay: queue full\r\n");
+    }
+    return false;
+}
+
+// Console command to simulate the time-window plan at increasing numbers of sensors
+bool gatewayCmdSimulate(char *args)
+{
+    if (!twsimRun(twsimSensors[twsimNext])) {
+        APP_PRINTF("twsim: insufficient memory for %d sensors\r\n", twsimSensors[twsimNext]);
+    }
+    if (++twsimNext < sizeof(twsimSensors)/sizeof(twsimSensors[0])) {
+        return true;
+    }
+    twsimNext = 0;
+    return false;
+}
+
+// Register the gateway's console commands
+void gatewayCmdRegister(void)
+{
+    traceCmdRegister(gatewayCmds, sizeof(gatewayCmds) / sizeof(gatewayCmds[0]));
 }
@@ -0,0 +1,286 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Extraction of the fields that an app declares from the JSON text of a gateway response, in
+// a single pass and straight into the app's own struct, so that the sensor builds no tree of
+// the response.  Only the top-level members of the response object are examined, and any
+// whose name isn't declared, or whose value isn't of the declared type, is skipped over
+// whatever it holds.  Members that aren't present are left zero, as JGet* would have them.
+
+#include "framework.h"
+
+// Longest member name that can match a declared field
+#define JFIELDS_NAME_MAX        32
+
+// Position within the text being parsed
+typedef struct {
+    const char *p;
+    const char *end;
+} jfieldsCursor;
+
+// Forwards
+void jfieldsSpace(jfieldsCursor *c);
+bool jfieldsString(jfieldsCursor *c, char *buf, uint32_t size, uint32_t *retLen);
+bool jfieldsInt(jfieldsCursor *c, int32_t *value);
+bool jfieldsLiteral(jfieldsCursor *c, const char *literal);
+bool jfieldsSkip(jfieldsCursor *c);
+bool jfieldsValue(jfieldsCursor *c, const schedField *field, uint8_t *out);
+
+// Skip whitespace
+void jfieldsSpace(jfieldsCursor *c)
+{
+    while (c->p < c->end && (*c->p == ' ' || *c->p == '\t' || *c->p == '\r' || *c->p == '\n')) {
+        c->p++;
+    }
+}
+
+// Parse a string, copying as much of its text as fits into the buffer if there is one, and
+// always terminating it.  Characters escaped beyond ASCII become '?', because nothing that a
+// sensor looks for in a response needs them.
+bool jfieldsString(jfieldsCursor *c, char *buf, uint32_t size, uint32_t *retLen)
+{
+    if (c->p >= c->end || *c->p != '"') {
+        return false;
+    }
+    c->p++;
+    uint32_t len = 0;
+    uint32_t copied = 0;
+    while (c->p < c->end && *c->p != '"') {
+        char ch = *c->p++;
+        if (ch == '\\') {
+            if (c->p >= c->end) {
+                return false;
+            }
+            ch = *c->p++;
+            switch (ch) {
+            case 'b':
+                ch = '\b';
+                break;
+            case 'f':
+                ch = '\f';
+                break;
+            case 'n':
+                ch = '\n';
+                break;
+            case 'r':
+                ch = '\r';
+                break;
+            case 't':
+                ch = '\t';
+                break;
+            case 'u': {
+                if (c->end - c->p < 4) {
+                    return false;
+                }
+                uint32_t code = 0;
+                for (int i=0; i<4; i++) {
+                    char h = *c->p++;
+                    code = (code << 4) | (uint32_t) ((h >= '0' && h <= '9') ? h-'0' : ((h|0x20) >= 'a' && (h|0x20) <= 'f') ? (h|0x20)-'a'+10 : 0);
+                }
+                ch = (code < 0x80) ? (char) code : '?';
+                break;
+            }
+            default:
+                break;
+            }
+        }
+        if (buf != NULL && copied+1 < size) {
+            buf[copied++] = ch;
+        }
+        len++;
+    }
+    if (c->p >= c->end) {
+        return false;
+    }
+    c->p++;
+    if (buf != NULL && size > 0) {
+        buf[copied] = '\0';
+    }
+    if (retLen != NULL) {
+        *retLen = len;
+    }
+    return true;
+}
+
+// Parse a number as an integer, discarding any fraction or exponent
+bool jfieldsInt(jfieldsCursor *c, int32_t *value)
+{
+    bool negative = (c->p < c->end && *c->p == '-');
+    if (negative) {
+        c->p++;
+    }
+    if (c->p >= c->end || *c->p < '0' || *c->p > '9') {
+        return false;
+    }
+    int64_t v = 0;
+    while (c->p < c->end && *c->p >= '0' && *c->p <= '9') {
+        if (v <= INT32_MAX) {
+            v = (v * 10) + (*c->p - '0');
+        }
+        c->p++;
+    }
+    while (c->p < c->end && ((*c->p >= '0' && *c->p <= '9') || *c->p == '.' || *c->p == 'e' || *c->p == 'E' || *c->p == '+' || *c->p == '-')) {
+        c->p++;
+    }
+    if (v > INT32_MAX) {
+        v = INT32_MAX;
+    }
+    *value = (int32_t) (negative ? -v : v);
+    return true;
+}
+
+// Consume a literal such as true, returning false if it isn't what's at the cursor
+bool jfieldsLiteral(jfieldsCursor *c, const char *literal)
+{
+    uint32_t len = strlen(literal);
+    if ((uint32_t) (c->end - c->p) < len || memcmp(c->p, literal, len) != 0) {
+        return false;
+    }
+    c->p += len;
+    return true;
+}
+
+// Skip a value of any type, including whatever an object or array holds
+bool jfieldsSkip(jfieldsCursor *c)
+{
+    uint32_t depth = 0;
+    do {
+        jfieldsSpace(c);
+        if (c->p >= c->end) {
+            return false;
+        }
+        char ch = *c->p;
+        if (ch == '"') {
+            if (!jfieldsString(c, NULL, 0, NULL)) {
+                return false;
+            }
+        } else if (ch == '{' || ch == '[') {
+            depth++;
+            c->p++;
+        } else if (ch == '}' || ch == ']') {
+            if (depth == 0) {
+                return false;
+            }
+            depth--;
+            c->p++;
+        } else if (ch == ',' || ch == ':') {
+            if (depth == 0) {
+                return false;
+            }
+            c->p++;
+        } else {
+            const char *began = c->p;
+            while (c->p < c->end && strchr(",:{}[]\" \t\r\n", *c->p) == NULL) {
+                c->p++;
+            }
+            if (c->p == began) {
+                return false;
+            }
+        }
+    } while (depth > 0);
+    return true;
+}
+
+// Parse the value of a declared field into the app's struct, skipping it if it isn't of
+// the declared type
+bool jfieldsValue(jfieldsCursor *c, const schedField *field, uint8_t *out)
+{
+    char ch = *c->p;
+    switch (field->type) {
+
+    case SCHED_FIELD_STRING:
+        if (ch == '"') {
+            return jfieldsString(c, (char *) &out[field->offset], field->size, NULL);
+        }
+        break;
+
+    case SCHED_FIELD_INT:
+        if (ch == '-' || (ch >= '0' && ch <= '9')) {
+            int32_t value;
+            if (!jfieldsInt(c, &value)) {
+                return false;
+            }
+            memcpy(&out[field->offset], &value, sizeof(value));
+            return true;
+        }
+        break;
+
+    case SCHED_FIELD_BOOL:
+        if (ch == 't' || ch == 'f') {
+            bool value = (ch == 't');
+            if (!jfieldsLiteral(c, value ? "true" : "false")) {
+                return false;
+            }
+            memcpy(&out[field->offset], &value, sizeof(value));
+            return true;
+        }
+        break;
+
+    }
+    return jfieldsSkip(c);
+}
+
+// Extract the declared fields, which end with one of type SCHED_FIELD_END, from a response into
+// the struct, returning false if the response isn't a valid JSON object
+bool jfieldsParse(const char *json, uint32_t len, const schedField *fields, void *out)
+{
+    for (const schedField *f = fields; f->type != SCHED_FIELD_END; f++) {
+        memset(&((uint8_t *) out)[f->offset], 0, f->size);
+    }
+    jfieldsCursor c = { json, json + len };
+    jfieldsSpace(&c);
+    if (c.p >= c.end || *c.p != '{') {
+        return false;
+    }
+    c.p++;
+    jfieldsSpace(&c);
+    if (c.p < c.end && *c.p == '}') {
+        return true;
+    }
+    for (;;) {
+
+        // The member's name, and the field declared by it if any
+        char name[JFIELDS_NAME_MAX];
+        uint32_t nameLen;
+        jfieldsSpace(&c);
+        if (!jfieldsString(&c, name, sizeof(name), &nameLen)) {
+            return false;
+        }
+        const schedField *field = NULL;
+        if (nameLen < sizeof(name)) {
+            for (const schedField *f = fields; f->type != SCHED_FIELD_END; f++) {
+                if (strcmp(f->name, name) == 0) {
+                    field = f;
+                    break;
+                }
+            }
+        }
+        jfieldsSpace(&c);
+        if (c.p >= c.end || *c.p != ':') {
+            return false;
+        }
+        c.p++;
+        jfieldsSpace(&c);
+        if (c.p >= c.end) {
+            return false;
+        }
+
+        // Its value
+        if (!(field != NULL ? jfieldsValue(&c, field, (uint8_t *) out) : jfieldsSkip(&c))) {
+            return false;
+        }
+        jfieldsSpace(&c);
+        if (c.p >= c.end) {
+            return false;
+        }
+        if (*c.p == '}') {
+            return true;
+        }
+        if (*c.p != ',') {
+            return false;
+        }
+        c.p++;
+
+    }
+}
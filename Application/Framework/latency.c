@@ -0,0 +1,192 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Interrupt-to-handler latency.  An external event reaches its app in hops: the EXTI edge,
+// the app being activated as its ISR is dispatched, the wakeup timer's expiry, the sensor
+// event task being run by the sequencer, and finally the app's poll function.  Each hop is
+// stamped with the RTC's timer value, which unlike the cycle counter keeps counting through
+// STOP2, at a resolution of 1/1024 second.  When an activated app is polled, the time taken
+// by each stage is accumulated for the app along with a histogram of the total, in
+// power-of-two milliseconds.  An activation that didn't come from an edge, such as one from
+// a timer, is counted from its activation.  The 'latency' console command displays them,
+// and 'latency reset' clears them.  When LATENCY_ON is false, the LATENCY macros compile
+// to nothing.
+
+#include "framework.h"
+
+#if LATENCY_ON
+
+// Histogram buckets, the first for less than 1ms and the last for 2^(n-2)ms or more
+#define LATENCY_BUCKETS         12
+
+// Stages, each ending at the next hop, the last at the poll
+static const char *stageName[LATENCY_HOPS] = { "isr", "timer", "task", "poll" };
+
+// The edge last seen on each EXTI line, and the oldest of those being dispatched
+#define LATENCY_EXTI_LINES      16
+static uint32_t edgeTicks[LATENCY_EXTI_LINES];
+static uint32_t dispatchEdgeTicks = 0;
+
+// For each app, the hops of the activation in progress and what has become of those done
+typedef struct {
+    bool pending;
+    uint32_t hopTicks[LATENCY_HOPS];
+    uint32_t count;
+    uint32_t sumTicks[LATENCY_HOPS];
+    uint32_t maxTicks[LATENCY_HOPS];
+    uint32_t maxTotalTicks;
+    uint16_t bucket[LATENCY_BUCKETS];
+} latencyApp;
+static latencyApp apps[SCHED_MAX_APPS];
+
+// Forwards
+uint32_t latencyBucket(uint32_t ticks);
+
+// Note an edge on the EXTI lines, from the ISR
+void latencyEdge(uint16_t pins)
+{
+    uint32_t now = TIMER_IF_GetTimerValue();
+    for (uint32_t p = pins; p != 0; p &= p - 1) {
+        edgeTicks[__CLZ(__RBIT(p))] = now;
+    }
+}
+
+// Begin dispatching the edges on the lines to the apps, or end it if there are none
+void latencyDispatch(uint16_t pins)
+{
+    uint32_t now = TIMER_IF_GetTimerValue();
+    dispatchEdgeTicks = 0;
+    for (uint32_t p = pins; p != 0; p &= p - 1) {
+        int line = __CLZ(__RBIT(p));
+        if (edgeTicks[line] != 0 && (dispatchEdgeTicks == 0 || now - edgeTicks[line] > now - dispatchEdgeTicks)) {
+            dispatchEdgeTicks = edgeTicks[line];
+        }
+        edgeTicks[line] = 0;
+    }
+}
+
+// Note that an app has been activated, which may be called from an ISR
+void latencyActivated(int appID)
+{
+    if (appID < 0 || appID >= SCHED_MAX_APPS) {
+        return;
+    }
+    uint32_t now = TIMER_IF_GetTimerValue();
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    latencyApp *a = &apps[appID];
+    if (!a->pending) {
+        memset(a->hopTicks, 0, sizeof(a->hopTicks));
+        a->hopTicks[LATENCY_HOP_EDGE] = (dispatchEdgeTicks != 0) ? dispatchEdgeTicks : now;
+        a->hopTicks[LATENCY_HOP_ACTIVATED] = now;
+        a->pending = true;
+    }
+    __set_PRIMASK(primask);
+}
+
+// Stamp the hop for each activation in progress that hasn't yet reached it
+void latencyHop(int hop)
+{
+    uint32_t now = TIMER_IF_GetTimerValue();
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    for (int i=0; i<SCHED_MAX_APPS; i++) {
+        if (apps[i].pending && apps[i].hopTicks[hop] == 0) {
+            apps[i].hopTicks[hop] = now;
+        }
+    }
+    __set_PRIMASK(primask);
+}
+
+// Get the histogram bucket of a latency
+uint32_t latencyBucket(uint32_t ticks)
+{
+    uint32_t ms = TIMER_IF_Convert_Tick2ms(ticks);
+    uint32_t bucket = (ms == 0) ? 0 : (32 - __CLZ(ms));
+    return (bucket < LATENCY_BUCKETS) ? bucket : LATENCY_BUCKETS-1;
+}
+
+// Account for the activation of an app that is about to be polled, if one is in progress.
+// A hop that was skipped, such as the timer when the task was already due to run, is taken
+// to have been reached along with the next.
+void latencyPolled(int appID)
+{
+    if (appID < 0 || appID >= SCHED_MAX_APPS) {
+        return;
+    }
+    uint32_t now = TIMER_IF_GetTimerValue();
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    latencyApp *a = &apps[appID];
+    if (!a->pending) {
+        __set_PRIMASK(primask);
+        return;
+    }
+    uint32_t hopTicks[LATENCY_HOPS+1];
+    memcpy(hopTicks, a->hopTicks, sizeof(a->hopTicks));
+    a->pending = false;
+    __set_PRIMASK(primask);
+    hopTicks[LATENCY_HOPS] = now;
+    for (int hop=LATENCY_HOPS-1; hop>=0; hop--) {
+        if (hopTicks[hop] == 0) {
+            hopTicks[hop] = hopTicks[hop+1];
+        }
+    }
+    for (int stage=0; stage<LATENCY_HOPS; stage++) {
+        uint32_t ticks = hopTicks[stage+1] - hopTicks[stage];
+        a->sumTicks[stage] += ticks;
+        if (ticks > a->maxTicks[stage]) {
+            a->maxTicks[stage] = ticks;
+        }
+    }
+    uint32_t totalTicks = now - hopTicks[LATENCY_HOP_EDGE];
+    if (totalTicks > a->maxTotalTicks) {
+        a->maxTotalTicks = totalTicks;
+    }
+    a->bucket[latencyBucket(totalTicks)]++;
+    a->count++;
+}
+
+// Display the latencies of each app that has been activated, or clear them
+void latencyShow(bool reset)
+{
+    if (reset) {
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        memset(apps, 0, sizeof(apps));
+        __set_PRIMASK(primask);
+        APP_PRINTF("LATENCY RESET\r\n");
+        return;
+    }
+    bool shown = false;
+    for (int i=0; i<schedAppCount() && i<SCHED_MAX_APPS; i++) {
+        latencyApp *a = &apps[i];
+        if (a->count == 0) {
+            continue;
+        }
+        shown = true;
+        APP_PRINTF("latency: %s %d activations, max %dms, stage mean/max ms:", schedAppName(i), a->count, TIMER_IF_Convert_Tick2ms(a->maxTotalTicks));
+        for (int stage=0; stage<LATENCY_HOPS; stage++) {
+            APP_PRINTF(" %s %d/%d", stageName[stage], TIMER_IF_Convert_Tick2ms(a->sumTicks[stage] / a->count), TIMER_IF_Convert_Tick2ms(a->maxTicks[stage]));
+        }
+        APP_PRINTF("\r\n");
+        APP_PRINTF("   ");
+        for (int b=0; b<LATENCY_BUCKETS; b++) {
+            if (a->bucket[b] == 0) {
+                continue;
+            }
+            if (b == LATENCY_BUCKETS-1) {
+                APP_PRINTF(" >=%dms:%d", 1 << (b-1), a->bucket[b]);
+            } else {
+                APP_PRINTF(" <%dms:%d", 1 << b, a->bucket[b]);
+            }
+        }
+        APP_PRINTF("\r\n");
+    }
+    if (!shown) {
+        APP_PRINTF("latency: no activations seen\r\n");
+    }
+}
+
+#endif
@@ -3,6 +3,7 @@
 // copyright holder including that found in the LICENSE file.
 
 #include "main.h"
+#include "stm32_timer.h"
 #include "framework.h"
 
 // State
@@ -10,9 +11,71 @@ uint32_t walkState = 0;
 bool ledStatePair = false;
 bool ledStatePairTimeWasValid = false;
 uint32_t ledStatePairBeganTime = 0;
+uint32_t ledStatePairBeacons = 0;
+int64_t ledStatePairBeaconDueMs = 0;
 bool ledStateReceive = false;
 bool ledStateTransmit = false;
 
+// Patterns are played without blocking, as a sequence of steps each lighting a set of LEDs
+// for a time, advanced by a timer so that the CPU can sleep and the radio keep running
+// while they are shown.  When the pattern ends the LEDs go back to showing the state.
+#define LED_PAIR    0x01
+#define LED_RX      0x02
+#define LED_TX      0x04
+typedef struct {
+    uint8_t leds;
+    uint16_t ms;
+} ledStep;
+static UTIL_TIMER_Object_t ledPatternTimer;
+static bool ledPatternTimerCreated = false;
+static const ledStep *ledPatternSteps = NULL;
+static uint8_t ledPatternStepCount = 0;
+static uint8_t ledPatternStep = 0;
+static uint8_t ledPatternRepeats = 0;
+
+// Patterns
+static const ledStep ledPatternTransmitWindowWait[] = {
+    { LED_RX, 100 },
+    { LED_TX, 100 },
+};
+static const ledStep ledPatternAck[] = {
+    { LED_PAIR|LED_RX|LED_TX, 250 },
+    { 0, 250 },
+};
+static const ledStep ledPatternWalk[] = {
+    { LED_PAIR, 50 },
+    { LED_RX, 50 },
+    { LED_TX, 50 },
+    { LED_RX, 50 },
+    { LED_PAIR, 50 },
+};
+
+// The button is debounced and timed without blocking.  An edge starts a timer after which
+// the button is sampled, and while it is held the same timer flashes the LEDs.  Its release,
+// or its being held for long enough, leaves an event for the event task.
+#define BUTTON_DEBOUNCE_MS  30
+#define BUTTON_HOLD_MS      15000
+static UTIL_TIMER_Object_t buttonTimer;
+static bool buttonTimerCreated = false;
+static bool buttonDebouncing = false;
+static bool buttonDown = false;
+static int64_t buttonDownMs = 0;
+static uint32_t buttonFlashes = 0;
+static uint32_t buttonFlashMs = 0;
+static uint32_t buttonQuartile = 0;
+static uint8_t buttonLedsWere = 0;
+static volatile uint16_t buttonEvent = BUTTON_UNCHANGED;
+
+// Forwards
+void ledPatternPlay(const ledStep *steps, uint8_t count, uint8_t repeats);
+void ledPatternShow(uint8_t leds);
+void ledPatternEvent(void *context);
+void ledPatternStop(void);
+void ledButtonEvent(void *context);
+static bool ledButtonPressed(void);
+static uint8_t ledShown(void);
+static void ledButtonDone(uint16_t event);
+
 // On sensor, enable/disabled for battery savings
 #define ledsEnabledMins 15
 int64_t ledsEnabledMs = 0;
@@ -110,11 +173,11 @@ bool ledIsPairInProgress()
 
     // Time-out the pairing
     if (ledStatePairBeganTime > 0) {
-        if (!ledStatePairTimeWasValid && NoteTimeValidST()) {
-            ledStatePairBeganTime = NoteTimeST();
+        if (!ledStatePairTimeWasValid && appTimeValid()) {
+            ledStatePairBeganTime = appTime();
         }
         uint32_t timeoutSecs = 60*(appIsGateway ? var_gateway_pairing_timeout_mins : PAIRING_BEACON_SENSOR_TIMEOUT_MINS);
-        if (NoteTimeST() > ledStatePairBeganTime + timeoutSecs) {
+        if (appTime() > ledStatePairBeganTime + timeoutSecs) {
             ledIndicatePairInProgress(false);
         }
     }
@@ -143,14 +206,47 @@ bool ledIsPairInProgress()
 void ledIndicatePairInProgress(bool on)
 {
     ledStatePair = on;
-    ledStatePairBeganTime = on ? NoteTimeST() : 0;
-    ledStatePairTimeWasValid = NoteTimeValidST();
+    ledStatePairBeganTime = on ? appTime() : 0;
+    ledStatePairTimeWasValid = appTimeValid();
+    ledStatePairBeacons = 0;
+    ledStatePairBeaconDueMs = 0;
 #ifdef USE_LED_PAIR
     HAL_GPIO_WritePin(LED_PAIR_GPIO_Port, LED_PAIR_Pin, on ? LED_PAIR_ON : LED_PAIR_OFF);
 #endif
     APP_PRINTF("%s\r\n", on ? "pairing mode ON" : "pairing mode OFF");
 }
 
+// Restart the pairing timeout, so that pairing mode lasts as long as it is being used
+void ledPairExtend()
+{
+    if (ledStatePair) {
+        ledStatePairBeganTime = appTime();
+        ledStatePairTimeWasValid = appTimeValid();
+    }
+}
+
+// Get the number of seconds until the next pairing beacon is due
+uint32_t ledPairBeaconWaitSecs()
+{
+    int64_t waitMs = ledStatePairBeaconDueMs - TIMER_IF_GetTimeMs();
+    return (waitMs <= 0) ? 0 : (uint32_t) ((waitMs + 999) / 1000);
+}
+
+// Note that a pairing beacon was sent, and back off before the next
+void ledPairBeaconSent()
+{
+    uint32_t secs = PAIRING_BEACON_MIN_SECS;
+    for (uint32_t i=0; i<ledStatePairBeacons && secs < PAIRING_BEACON_SECS; i++) {
+        secs *= 2;
+    }
+    if (secs > PAIRING_BEACON_SECS) {
+        secs = PAIRING_BEACON_SECS;
+    }
+    ledStatePairBeacons++;
+    uint32_t jitterMs = MY_Random() % ((secs * 1000 / 4) + 1);
+    ledStatePairBeaconDueMs = TIMER_IF_GetTimeMs() + (secs * 1000) + jitterMs;
+}
+
 // Is in progress?
 bool ledIsReceiveInProgress()
 {
@@ -160,6 +256,7 @@ bool ledIsReceiveInProgress()
 // Indicate that a receive is in progress
 void ledIndicateReceiveInProgress(bool on)
 {
+    ledPatternStop();
 #ifdef USE_LED_RX
     ledStateReceive = on;
     if (ledDisabled()) {
@@ -179,6 +276,7 @@ bool ledIsTransmitInProgress()
 // Indicate that a transmit is in progress
 void ledIndicateTransmitInProgress(bool on)
 {
+    ledPatternStop();
 #ifdef USE_LED_TX
     ledStateTransmit = on;
     if (ledDisabled()) {
@@ -189,79 +287,202 @@ void ledIndicateTransmitInProgress(bool on)
 #endif
 }
 
-// Indicate OK
-void ledIndicateAck(int flashes)
+// Flash RX then TX to show that we're waiting for a transmit window
+void ledIndicateTransmitWindowWait()
 {
-    for (int i=0; i<flashes; i++) {
-        ledSet();
-        HAL_Delay(250);
-        ledReset();
-        HAL_Delay(250);
+#if defined(USE_LED_RX) && defined(USE_LED_TX)
+    if (ledDisabled()) {
+        ledPatternStop();
+        return;
     }
+    ledPatternPlay(ledPatternTransmitWindowWait, sizeof(ledPatternTransmitWindowWait)/sizeof(ledStep), 1);
+#endif
 }
 
-// Toggle LEDs with a pattern so long as a given button is being held down
-uint16_t ledButtonCheck()
+// Walk the LEDs briefly to show that we aren't paired
+void ledIndicateNotPaired()
 {
+    ledPatternPlay(ledPatternWalk, sizeof(ledPatternWalk)/sizeof(ledStep), 1);
+}
 
-    // Exit if button isn't even being pressed
-    if (HAL_GPIO_ReadPin(BUTTON1_GPIO_Port, BUTTON1_Pin) == (BUTTON1_ACTIVE_HIGH ? GPIO_PIN_RESET : GPIO_PIN_SET)) {
-        return BUTTON_UNCHANGED;
+// Indicate OK
+void ledIndicateAck(int flashes)
+{
+    ledPatternPlay(ledPatternAck, sizeof(ledPatternAck)/sizeof(ledStep), flashes > 0xFF ? 0xFF : (uint8_t) flashes);
+}
+
+// Wait for the pattern being played to finish, such as before a restart
+void ledIndicateWait()
+{
+    while (ledPatternSteps != NULL) {
+        HAL_Delay(10);
     }
+}
 
-    // Enable LEDs for some period of time after the button has been pressed
-    ledsEnabledMs = TIMER_IF_GetTimeMs();
+// Begin playing a pattern, replacing any that is being played
+void ledPatternPlay(const ledStep *steps, uint8_t count, uint8_t repeats)
+{
+    ledPatternStop();
+    if (count == 0 || repeats == 0) {
+        return;
+    }
+    if (!ledPatternTimerCreated) {
+        UTIL_TIMER_Create(&ledPatternTimer, 0xFFFFFFFFU, UTIL_TIMER_ONESHOT, ledPatternEvent, NULL);
+        ledPatternTimerCreated = true;
+    }
+    ledPatternSteps = steps;
+    ledPatternStepCount = count;
+    ledPatternStep = 0;
+    ledPatternRepeats = repeats;
+    ledPatternEvent(NULL);
+}
 
-    // Wait until released
-#ifdef USE_LED_TX
-    bool txWasOn = (LED_TX_ON == HAL_GPIO_ReadPin(LED_TX_GPIO_Port, LED_TX_Pin));
-#endif
-#ifdef USE_LED_RX
-    bool rxWasOn = (LED_RX_ON == HAL_GPIO_ReadPin(LED_RX_GPIO_Port, LED_RX_Pin));
-#endif
+// Light exactly the given set of LEDs
+void ledPatternShow(uint8_t leds)
+{
 #ifdef USE_LED_PAIR
-    bool pairWasOn = (LED_PAIR_ON == HAL_GPIO_ReadPin(LED_PAIR_GPIO_Port, LED_PAIR_Pin));
-#endif
-    int flashes = 0;
-    uint32_t beganSecs = NoteTimeST();
-    uint32_t expireSecs = 15;
-    uint32_t currentDelayMs = 750;
-    uint32_t prevQuartile = 0;
-    while (NoteTimeST() < beganSecs+expireSecs) {
-        if (HAL_GPIO_ReadPin(BUTTON1_GPIO_Port, BUTTON1_Pin) == (BUTTON1_ACTIVE_HIGH ? GPIO_PIN_RESET : GPIO_PIN_SET)) {
-#ifdef USE_LED_TX
-            HAL_GPIO_WritePin(LED_TX_GPIO_Port, LED_TX_Pin, txWasOn ? LED_TX_ON : LED_TX_OFF);
+    HAL_GPIO_WritePin(LED_PAIR_GPIO_Port, LED_PAIR_Pin, (leds & LED_PAIR) ? LED_PAIR_ON : LED_PAIR_OFF);
 #endif
 #ifdef USE_LED_RX
-            HAL_GPIO_WritePin(LED_RX_GPIO_Port, LED_RX_Pin, rxWasOn ? LED_RX_ON : LED_RX_OFF);
+    HAL_GPIO_WritePin(LED_RX_GPIO_Port, LED_RX_Pin, (leds & LED_RX) ? LED_RX_ON : LED_RX_OFF);
 #endif
-#ifdef USE_LED_PAIR
-            HAL_GPIO_WritePin(LED_PAIR_GPIO_Port, LED_PAIR_Pin, pairWasOn ? LED_PAIR_ON : LED_PAIR_OFF);
+#ifdef USE_LED_TX
+    HAL_GPIO_WritePin(LED_TX_GPIO_Port, LED_TX_Pin, (leds & LED_TX) ? LED_TX_ON : LED_TX_OFF);
 #endif
-            return (flashes < 2) ? BUTTON_PRESSED : BUTTON_HOLD_ABORTED;
+}
+
+// Show the next step of the pattern, which is called from the timer's ISR
+void ledPatternEvent(void *context)
+{
+    if (ledPatternSteps == NULL) {
+        return;
+    }
+    if (ledPatternStep >= ledPatternStepCount) {
+        ledPatternStep = 0;
+        if (--ledPatternRepeats == 0) {
+            ledPatternStop();
+            return;
         }
-        if (flashes >= 1) {
-#ifdef USE_LED_TX
-            HAL_GPIO_WritePin(LED_TX_GPIO_Port, LED_TX_Pin, (flashes & 1) ? LED_TX_ON : LED_TX_OFF);
+    }
+    const ledStep *step = &ledPatternSteps[ledPatternStep++];
+    ledPatternShow(step->leds);
+    UTIL_TIMER_SetPeriod(&ledPatternTimer, step->ms);
+    UTIL_TIMER_Start(&ledPatternTimer);
+}
+
+// End the pattern being played, leaving the LEDs showing the current state
+void ledPatternStop()
+{
+    if (ledPatternSteps == NULL) {
+        return;
+    }
+    ledPatternSteps = NULL;
+    UTIL_TIMER_Stop(&ledPatternTimer);
+    bool on = !ledDisabled();
+    ledPatternShow((ledStatePair ? LED_PAIR : 0) | ((on && ledStateReceive) ? LED_RX : 0) | ((on && ledStateTransmit) ? LED_TX : 0));
+}
+
+// Whether the button is being pressed
+static bool ledButtonPressed()
+{
+    return (HAL_GPIO_ReadPin(BUTTON1_GPIO_Port, BUTTON1_Pin) == (BUTTON1_ACTIVE_HIGH ? GPIO_PIN_SET : GPIO_PIN_RESET));
+}
+
+// The set of LEDs that are lit
+static uint8_t ledShown()
+{
+    uint8_t leds = 0;
+#ifdef USE_LED_PAIR
+    leds |= (LED_PAIR_ON == HAL_GPIO_ReadPin(LED_PAIR_GPIO_Port, LED_PAIR_Pin)) ? LED_PAIR : 0;
 #endif
 #ifdef USE_LED_RX
-            HAL_GPIO_WritePin(LED_RX_GPIO_Port, LED_RX_Pin, (flashes & 1) ? LED_RX_ON : LED_RX_OFF);
+    leds |= (LED_RX_ON == HAL_GPIO_ReadPin(LED_RX_GPIO_Port, LED_RX_Pin)) ? LED_RX : 0;
 #endif
-#ifdef USE_LED_PAIR
-            HAL_GPIO_WritePin(LED_PAIR_GPIO_Port, LED_PAIR_Pin, (flashes & 1) ? LED_PAIR_ON : LED_PAIR_OFF);
+#ifdef USE_LED_TX
+    leds |= (LED_TX_ON == HAL_GPIO_ReadPin(LED_TX_GPIO_Port, LED_TX_Pin)) ? LED_TX : 0;
 #endif
+    return leds;
+}
+
+// Leave a button event for the event task to pick up with ledButtonCheck
+static void ledButtonDone(uint16_t event)
+{
+    buttonDown = false;
+    buttonEvent = event;
+    appButtonWakeup();
+}
+
+// Note an edge on the button, which is called from its ISR, sampling it once it has settled
+void ledButtonEdge()
+{
+    if (!buttonTimerCreated) {
+        UTIL_TIMER_Create(&buttonTimer, 0xFFFFFFFFU, UTIL_TIMER_ONESHOT, ledButtonEvent, NULL);
+        buttonTimerCreated = true;
+    }
+    buttonDebouncing = true;
+    UTIL_TIMER_SetPeriod(&buttonTimer, BUTTON_DEBOUNCE_MS);
+    UTIL_TIMER_Start(&buttonTimer);
+}
+
+// Sample the button once it has settled, or take the next step of flashing the LEDs while
+// it is held, faster in each successive quarter of the hold.  This is called from the
+// timer's ISR.
+void ledButtonEvent(void *context)
+{
+    int64_t nowMs = TIMER_IF_GetTimeMs();
+
+    // The button has settled after an edge
+    if (buttonDebouncing) {
+        buttonDebouncing = false;
+        bool pressed = ledButtonPressed();
+        if (pressed && !buttonDown) {
+            ledPatternStop();
+            buttonDown = true;
+            buttonDownMs = nowMs;
+            buttonFlashes = 0;
+            buttonFlashMs = 750;
+            buttonQuartile = 0;
+            buttonLedsWere = ledShown();
+            ledsEnabledMs = nowMs;
+        } else if (!pressed && buttonDown) {
+            ledPatternShow(buttonLedsWere);
+            ledButtonDone((buttonFlashes < 2) ? BUTTON_PRESSED : BUTTON_HOLD_ABORTED);
+            return;
         }
-        uint32_t elapsed = NoteTimeST() - beganSecs;
-        uint32_t quartile = elapsed / (expireSecs/4);
-        if (prevQuartile != quartile) {
-            prevQuartile = quartile;
-            currentDelayMs -= currentDelayMs < 250 ? 0 : 200;
+        if (buttonDown) {
+            UTIL_TIMER_SetPeriod(&buttonTimer, buttonFlashMs);
+            UTIL_TIMER_Start(&buttonTimer);
         }
-        HAL_Delay(currentDelayMs);
-        flashes++;
+        return;
     }
 
     // Held down for a while
-    return BUTTON_HELD;
+    if (!buttonDown) {
+        return;
+    }
+    buttonFlashes++;
+    uint32_t elapsedMs = (uint32_t) (nowMs - buttonDownMs);
+    if (elapsedMs >= BUTTON_HOLD_MS) {
+        ledButtonDone(BUTTON_HELD);
+        return;
+    }
+    ledPatternShow((buttonFlashes & 1) ? (LED_PAIR|LED_RX|LED_TX) : 0);
+    uint32_t quartile = elapsedMs / (BUTTON_HOLD_MS/4);
+    if (buttonQuartile != quartile) {
+        buttonQuartile = quartile;
+        buttonFlashMs -= buttonFlashMs < 250 ? 0 : 200;
+    }
+    UTIL_TIMER_SetPeriod(&buttonTimer, buttonFlashMs);
+    UTIL_TIMER_Start(&buttonTimer);
+}
 
+// Take the button event that has completed since last checked, if any
+uint16_t ledButtonCheck()
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint16_t event = buttonEvent;
+    buttonEvent = BUTTON_UNCHANGED;
+    __set_PRIMASK(primask);
+    return event;
 }
@@ -0,0 +1,158 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Deferred logging.  When LOG_DEFERRED is enabled, APP_PRINTF doesn't format at the call
+// site; it queues the format pointer and its raw argument words into a ring, copying any
+// %s arguments because they commonly point at stack or reused buffers.  The ring is
+// formatted into the trace FIFO by a low-priority sequencer task, so that the radio and
+// scheduler paths pay only for a short scan of the format string.  Every conversion
+// supported by the tiny printf consumes exactly one 32-bit word, which is what allows
+// the words to be replayed as the varargs of the original call.
+
+#include <stdarg.h>
+#include "stm32_seq.h"
+#include "utilities_def.h"
+#include "main.h"
+#include "framework.h"
+
+#if LOG_DEFERRED
+
+#if UINTPTR_MAX != 0xFFFFFFFFu
+#error "deferred logging requires that pointers and ints are 32-bit words"
+#endif
+#if LOG_DEFERRED_ARGS != 8
+#error "logDeferredTask replays exactly 8 argument words"
+#endif
+
+// A queued line
+typedef struct {
+    const char *format;
+    uint32_t args[LOG_DEFERRED_ARGS];
+    char strings[LOG_DEFERRED_STRING_BYTES];
+} logRecord;
+static logRecord records[LOG_DEFERRED_RECORDS];
+static uint32_t recordHead = 0;
+static uint32_t recordTail = 0;
+static uint32_t recordCount = 0;
+static uint32_t recordsDropped = 0;
+
+// The line being formatted, which is static because the trace FIFO copies it
+static char line[UTIL_ADV_TRACE_TMP_BUF_SIZE];
+
+// Forwards
+int logFormat(char *buf, int size, const char *format, ...);
+
+// Queue a line for formatting in idle time
+void logDeferred(const char *format, ...)
+{
+
+    // Honor the same verbosity test as the immediate path
+    if (VLEVEL_L > UTIL_ADV_TRACE_GetVerboseLevel()) {
+        return;
+    }
+
+    // Claim a record, filling it with interrupts masked because lines are also logged
+    // from radio callbacks
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (recordCount >= LOG_DEFERRED_RECORDS) {
+        recordsDropped++;
+        __set_PRIMASK(primask);
+        return;
+    }
+    logRecord *r = &records[recordHead];
+    recordHead = (recordHead + 1) % LOG_DEFERRED_RECORDS;
+    recordCount++;
+
+    // Capture one word per conversion
+    va_list ap;
+    va_start(ap, format);
+    r->format = format;
+    uint32_t args = 0;
+    uint32_t used = 0;
+    for (const char *p = format; *p != '\0' && args < LOG_DEFERRED_ARGS; p++) {
+        if (*p != '%') {
+            continue;
+        }
+        p++;
+        while (*p != '\0' && strchr("-+ #0123456789.lL", *p) != NULL) {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        if (*p == 's') {
+            const char *s = va_arg(ap, const char *);
+            if (s == NULL) {
+                s = "<NULL>";
+            }
+            if (used >= sizeof(r->strings)) {
+                r->args[args++] = (uint32_t) "";
+                continue;
+            }
+            char *copy = &r->strings[used];
+            strlcpy(copy, s, sizeof(r->strings) - used);
+            used += strlen(copy) + 1;
+            r->args[args++] = (uint32_t) copy;
+        } else if (strchr("cdiuxXpo", *p) != NULL) {
+            r->args[args++] = va_arg(ap, uint32_t);
+        }
+    }
+    va_end(ap);
+    __set_PRIMASK(primask);
+
+    UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Log_Drain), CFG_SEQ_Prio_Event);
+
+}
+
+// Format with the tiny printf used by the trace package
+int logFormat(char *buf, int size, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    int len = tiny_vsnprintf_like(buf, size, format, ap);
+    va_end(ap);
+    return len;
+}
+
+// Sequencer task that formats queued lines into the trace FIFO until it is full
+void logDeferredTask(void)
+{
+
+    // Report lines that were lost while the ring was full
+    if (recordsDropped != 0) {
+        int len = logFormat(line, sizeof(line), "log: %d lines dropped\r\n", recordsDropped);
+        if (UTIL_ADV_TRACE_Send((uint8_t *) line, len) != UTIL_ADV_TRACE_OK) {
+            return;
+        }
+        recordsDropped = 0;
+    }
+
+    // Drain the ring, leaving the oldest record in place if the FIFO can't take it.  The
+    // task is resumed by logDeferredResume() once the FIFO has emptied.
+    while (recordCount > 0) {
+        logRecord *r = &records[recordTail];
+        uint32_t *a = r->args;
+        int len = logFormat(line, sizeof(line), r->format, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+        if (UTIL_ADV_TRACE_Send((uint8_t *) line, len) != UTIL_ADV_TRACE_OK) {
+            return;
+        }
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        recordTail = (recordTail + 1) % LOG_DEFERRED_RECORDS;
+        recordCount--;
+        __set_PRIMASK(primask);
+    }
+
+}
+
+// Called when the trace FIFO has been transmitted, to continue a drain that it stalled
+void logDeferredResume(void)
+{
+    if (recordCount > 0 || recordsDropped != 0) {
+        UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Log_Drain), CFG_SEQ_Prio_Event);
+    }
+}
+
+#endif // LOG_DEFERRED
@@ -5,10 +5,42 @@
 #include "main.h"
 #include "framework.h"
 
-// For Notecard I2C I/O using ST HAL
-extern I2C_HandleTypeDef hi2c2;
+// For Notecard I2C I/O using ST HAL.  A segment is at most 255 bytes because its length
+// is sent as a single byte, and it is staged along with its 1- or 2-byte header.
+#define NOTE_I2C_SEGMENT_MAX        255
+#define NOTE_I2C_RETRIES            5
+#define NOTE_I2C_TIMEOUT_BASE_MS    20
+#define NOTE_I2C_BACKOFF_MIN_MS     2
+#define NOTE_I2C_BACKOFF_MAX_MS     50
+static uint8_t noteI2CSegment[NOTE_I2C_SEGMENT_MAX+2];
+#if NOTECARD_I2C_SEGMENT_BYTES > NOTE_I2C_SEGMENT_MAX
+#error "NOTECARD_I2C_SEGMENT_BYTES exceeds what a segment length byte can express"
+#endif
+
+// Bytes moved over the bus to and from the Notecard, headers included, for benchmarking
+static uint32_t noteI2CBytes = 0;
+
+// On a sensor, the template registration that each app is awaiting the gateway's response to
+static uint32_t noteTemplatePending[SCHED_MAX_APPS] = {0};
+
+// When the current Notecard transaction began, the request that it performs as found in
+// its first segment, and the bytes moved before it, for the gateway's latency statistics
+static int64_t noteTransactionBeganMs = 0;
+static char noteTransactionReq[24];
+static bool noteTransactionSegmented = false;
+static uint32_t noteTransactionBytes = 0;
+
+// On a battery or solar gateway, the connection mode that the Notecard was last given by the
+// adaptive controller, and until when a sensor's urgent note keeps it in continuous mode
+uint32_t var_gateway_hub_adaptive = 0;
+static bool hubAdaptiveApplied = false;
+static bool hubContinuous = false;
+static uint32_t hubOutboundMins = 0;
+static uint32_t hubLastCheckTime = 0;
+static uint32_t hubUrgentUntil = 0;
 
 // Forwards
+bool noteHubSet(bool continuous, uint32_t outboundMins, uint32_t inboundMins);
 bool noteI2CReset(uint16_t DevAddress);
 const char *noteI2CTransmit(uint16_t DevAddress, uint8_t* pBuffer, uint16_t Size);
 const char *noteI2CReceive(uint16_t DevAddress, uint8_t* pBuffer, uint16_t Size, uint32_t *available);
@@ -16,17 +48,20 @@ void noteDelay(uint32_t ms);
 uint32_t noteMillis(void);
 void noteBeginTransaction(void);
 void noteEndTransaction(void);
+uint32_t noteI2CTimeoutMs(uint32_t len);
+void noteTransactionFindReq(const uint8_t *segment, uint32_t len);
+void noteI2CBackoff(int attempt);
 
 // Initialize the note subsystem
 bool noteInit()
 {
 
     // Register callbacks with note-c subsystem that it needs for I/O, memory, timer
-    NoteSetFn(malloc, free, noteDelay, noteMillis);
+    NoteSetFn(poolAlloc, poolFree, noteDelay, noteMillis);
 
     // On the gateway, register I2C
     NoteSetFnMutex(NULL, NULL, noteBeginTransaction, noteEndTransaction);
-    NoteSetFnI2C(NOTE_I2C_ADDR_DEFAULT, NOTE_I2C_MAX_DEFAULT, noteI2CReset, noteI2CTransmit, noteI2CReceive);
+    NoteSetFnI2C(NOTE_I2C_ADDR_DEFAULT, NOTECARD_I2C_SEGMENT_BYTES, noteI2CReset, noteI2CTransmit, noteI2CReceive);
 
     // Test to see if a notecard is present
     if (!NoteReset()) {
@@ -85,7 +120,8 @@ bool noteSetup()
             APP_PRINTF("\r\n");
         }
 
-        // Set the product UID and essential info
+        // Set the product UID and essential info, which the adaptive controller then adjusts
+        hubAdaptiveApplied = false;
         J *req = NoteNewRequest("hub.set");
         if (req != NULL) {
             if (productUID != NULL) {
@@ -118,16 +154,126 @@ bool noteSetup()
 
 }
 
+// Register the env var that lets a battery or solar gateway adapt its connection mode to its load
+void noteHubGatewayInit()
+{
+    gatewayEnvVarRegisterInt(VAR_GATEWAY_HUB_ADAPTIVE, &var_gateway_hub_adaptive, DEFAULT_GATEWAY_HUB_ADAPTIVE, NULL);
+}
+
+// Set the Notecard's connection mode, returning true if it was accepted
+bool noteHubSet(bool continuous, uint32_t outboundMins, uint32_t inboundMins)
+{
+    J *req = NoteNewRequest("hub.set");
+    if (req == NULL) {
+        return false;
+    }
+    JAddStringToObject(req, "mode", continuous ? "continuous" : "periodic");
+    JAddNumberToObject(req, "outbound", outboundMins);
+    JAddNumberToObject(req, "inbound", inboundMins);
+    if (continuous) {
+        JAddBoolToObject(req, "sync", NOTECARD_CONTINUOUS_SYNC);
+    }
+    return NoteRequest(req);
+}
+
+// Keep the Notecard in continuous mode for a while because a sensor's note asked to be synced
+void noteHubUrgent()
+{
+    if (var_gateway_hub_adaptive != 0) {
+        hubUrgentUntil = appTime() + (NOTECARD_ADAPTIVE_URGENT_MINS*60);
+    }
+}
+
+// On the gateway, adapt the Notecard's connection mode to the load when hub_adaptive is set.
+// The Notecard is held in continuous mode while a sensor's urgent note is recent or while much
+// is queued, and is otherwise left periodic, syncing outbound more often as more is queued.
+// This is a housekeeping step, returning true if it performed a Notecard transaction.
+bool noteHubAdapt()
+{
+
+    // Restore the configured mode when adaptation is turned off
+    if (var_gateway_hub_adaptive == 0) {
+        if (!hubAdaptiveApplied) {
+            return false;
+        }
+        hubAdaptiveApplied = false;
+        hubLastCheckTime = 0;
+        noteHubSet(strcmp(NOTECARD_CONNECTION_MODE, "continuous") == 0, NOTECARD_OUTBOUND_PERIOD_MINS, NOTECARD_INBOUND_PERIOD_MINS);
+        APP_PRINTF("hub: %s, as configured\r\n", NOTECARD_CONNECTION_MODE);
+        return true;
+    }
+
+    // Check the load now and then, but at once when an urgent note arrives while periodic
+    uint32_t now = appTime();
+    bool urgent = (now < hubUrgentUntil);
+    if (hubAdaptiveApplied && !(urgent && !hubContinuous) && now < hubLastCheckTime + (NOTECARD_ADAPTIVE_CHECK_MINS*60)) {
+        return false;
+    }
+    hubLastCheckTime = now;
+
+    // See how many notes are waiting to be synced
+    uint32_t pending = 0;
+    if (!urgent) {
+        J *rsp = NoteRequestResponse(NoteNewRequest("file.changes.pending"));
+        if (rsp == NULL) {
+            return true;
+        }
+        pending = (uint32_t) JGetInt(rsp, "total");
+        NoteDeleteResponse(rsp);
+    }
+
+    // Derive the mode, halving the outbound period for each so many notes that are queued
+    bool continuous = (urgent || pending >= NOTECARD_ADAPTIVE_CONTINUOUS_NOTES);
+    uint32_t outboundMins = NOTECARD_ADAPTIVE_OUTBOUND_MAX_MINS;
+    for (uint32_t i=0; i<pending/NOTECARD_ADAPTIVE_NOTES_PER_HALVING && outboundMins > NOTECARD_ADAPTIVE_OUTBOUND_MIN_MINS; i++) {
+        outboundMins /= 2;
+    }
+    if (outboundMins < NOTECARD_ADAPTIVE_OUTBOUND_MIN_MINS) {
+        outboundMins = NOTECARD_ADAPTIVE_OUTBOUND_MIN_MINS;
+    }
+    if (continuous) {
+        outboundMins = NOTECARD_OUTBOUND_PERIOD_MINS;
+    }
+    if (hubAdaptiveApplied && continuous == hubContinuous && outboundMins == hubOutboundMins) {
+        return true;
+    }
+
+    // Apply it, syncing inbound a few times less often than outbound while periodic
+    uint32_t inboundMins = continuous ? NOTECARD_INBOUND_PERIOD_MINS : outboundMins*NOTECARD_ADAPTIVE_INBOUND_FACTOR;
+    if (inboundMins > NOTECARD_INBOUND_PERIOD_MINS) {
+        inboundMins = NOTECARD_INBOUND_PERIOD_MINS;
+    }
+    if (noteHubSet(continuous, outboundMins, inboundMins)) {
+        hubAdaptiveApplied = true;
+        hubContinuous = continuous;
+        hubOutboundMins = outboundMins;
+        if (continuous) {
+            APP_PRINTF("hub: continuous (%s)\r\n", urgent ? "urgent note" : "queue is long");
+        } else {
+            APP_PRINTF("hub: periodic, outbound %d inbound %d mins (%d pending)\r\n", outboundMins, inboundMins, pending);
+        }
+    }
+    return true;
+
+}
+
 // Begin a notecard transaction which may involve many I2C transactions
 void noteBeginTransaction()
 {
-    MX_I2C2_Init();
+    MY_I2C2_Acquire();
+    TIMELINE(TIMELINE_NOTECARD, 0, 1);
+    noteTransactionBeganMs = TIMER_IF_GetTimeMs();
+    noteTransactionReq[0] = '\0';
+    noteTransactionSegmented = false;
+    noteTransactionBytes = noteI2CBytes;
 }
 
 // End a notecard transaction
 void noteEndTransaction()
 {
-    MX_I2C2_DeInit();
+    statsNotecardTransaction(noteTransactionReq, (uint32_t) (TIMER_IF_GetTimeMs() - noteTransactionBeganMs), noteI2CBytes - noteTransactionBytes);
+    TIMELINE(TIMELINE_NOTECARD, 0, 0);
+    MY_I2C2_Release();
 }
 
 // Arduino-like delay function
@@ -145,104 +291,137 @@ uint32_t noteMillis()
 // I2C reset procedure, called before any I/O and called again upon I/O error
 bool noteI2CReset(uint16_t DevAddress)
 {
-    MX_I2C2_DeInit();
-    MX_I2C2_Init();
+    MY_I2C2_Reset();
     return true;
 }
 
-// Transmits in master mode an amount of data, in blocking mode.     The address
+// Transmits in master mode an amount of data, using DMA.  The address
 // is the actual address; the caller should have shifted it right so that the
 // low bit is NOT the read/write bit. An error message is returned, else NULL if success.
 const char *noteI2CTransmit(uint16_t DevAddress, uint8_t* pBuffer, uint16_t Size)
 {
-    char *errstr;
-    int writelen = sizeof(uint8_t) + Size;
-    uint8_t *writebuf = malloc(writelen);
-    if (writebuf == NULL) {
-        return "i2c: insufficient memory (write)";
+    if (Size > NOTE_I2C_SEGMENT_MAX) {
+        return "i2c: segment too large (write)";
     }
 
+    // The first segment of a transaction begins with the request's JSON, naming it
+    if (!noteTransactionSegmented) {
+        noteTransactionSegmented = true;
+        noteTransactionFindReq(pBuffer, Size);
+    }
+
+    // Stage the segment behind its length byte
+    int writelen = sizeof(uint8_t) + Size;
+    noteI2CSegment[0] = Size;
+    memcpy(&noteI2CSegment[1], pBuffer, Size);
+
     // Retry so that we're resiliant in the context of customer designs that have unclean SDA/SCL signals
-    writebuf[0] = Size;
-    memcpy(&writebuf[1], pBuffer, Size);
-    errstr = "i2c: write error {io}";
-    for (int i=0; i<5; i++) {
-        HAL_StatusTypeDef err_code = HAL_I2C_Master_Transmit(&hi2c2, DevAddress<<1, writebuf, writelen, 250);
-        if (err_code == HAL_OK) {
-            errstr = NULL;
-            break;
+    for (int i=0; i<NOTE_I2C_RETRIES; i++) {
+        if (MY_I2C2_Transmit(DevAddress, noteI2CSegment, writelen, noteI2CTimeoutMs(writelen))) {
+            noteI2CBytes += writelen;
+            return NULL;
         }
-        HAL_Delay(100);
+        noteI2CBackoff(i);
     }
-    if (errstr != NULL) {
-        free(writebuf);
-        return errstr;
-    }
-
-    // Done
-    free(writebuf);
-    return NULL;
+    return "i2c: write error {io}";
 
 }
 
-// Receives in master mode an amount of data in blocking mode. An error mesage returned, else NULL if success.
+// Receives in master mode an amount of data, using DMA. An error mesage returned, else NULL if success.
 const char *noteI2CReceive(uint16_t DevAddress, uint8_t* pBuffer, uint16_t Size, uint32_t *available)
 {
-    const char *errstr;
+    if (Size > NOTE_I2C_SEGMENT_MAX) {
+        return "i2c: segment too large (read)";
+    }
 
     // Retry so that we're resiliant in the context of customer designs that have unclean SDA/SCL signals
     uint8_t hdr[2];
     hdr[0] = (uint8_t) 0;
     hdr[1] = (uint8_t) Size;
-    errstr = "i2c: write error {io}";
-    for (int i=0; i<5; i++) {
-        HAL_StatusTypeDef err_code = HAL_I2C_Master_Transmit(&hi2c2, DevAddress<<1, hdr, sizeof(hdr), 250);
-        if (err_code == HAL_OK) {
-            errstr = NULL;
+    bool success = false;
+    for (int i=0; i<NOTE_I2C_RETRIES; i++) {
+        if (MY_I2C2_Transmit(DevAddress, hdr, sizeof(hdr), noteI2CTimeoutMs(sizeof(hdr)))) {
+            success = true;
             break;
         }
-        HAL_Delay(100);
+        noteI2CBackoff(i);
     }
-    if (errstr != NULL) {
-        return errstr;
+    if (!success) {
+        return "i2c: write error {io}";
     }
 
     // Only receive if we successfully began transmission
     int readlen = Size + (sizeof(uint8_t)*2);
-    uint8_t *readbuf = malloc(readlen);
-    if (readbuf == NULL) {
-        return "i2c: insufficient memory (read)";
-    }
-
-    // Retry so that we're resiliant in the context of customer designs that have unclean SDA/SCL signals
-    errstr = "i2c: read error {io}";
-    for (int i=0; i<5; i++) {
-        HAL_StatusTypeDef err_code = HAL_I2C_Master_Receive(&hi2c2, DevAddress<<1, readbuf, readlen, 10);
-        if (err_code == HAL_OK) {
-            errstr = NULL;
+    success = false;
+    for (int i=0; i<NOTE_I2C_RETRIES; i++) {
+        if (MY_I2C2_Receive(DevAddress, noteI2CSegment, readlen, noteI2CTimeoutMs(readlen))) {
+            success = true;
             break;
         }
-        HAL_Delay(100);
+        noteI2CBackoff(i);
     }
-    if (errstr != NULL) {
-        free(readbuf);
-        return errstr;
+    if (!success) {
+        return "i2c: read error {io}";
     }
 
-    uint8_t availbyte = readbuf[0];
-    uint8_t goodbyte = readbuf[1];
+    noteI2CBytes += sizeof(hdr) + readlen;
+    uint8_t availbyte = noteI2CSegment[0];
+    uint8_t goodbyte = noteI2CSegment[1];
     if (goodbyte != Size) {
-        free(readbuf);
         return "i2c: incorrect amount of data";
     }
 
     *available = availbyte;
-    memcpy(pBuffer, &readbuf[2], Size);
-    free(readbuf);
+    memcpy(pBuffer, &noteI2CSegment[2], Size);
     return NULL;
 
 }
 
+// Time allowed for a DMA transfer of the specified length, where each byte takes about 9
+// clocks and its ack on the bus, but which the Notecard may stretch while it is busy.
+uint32_t noteI2CTimeoutMs(uint32_t len)
+{
+    return NOTE_I2C_TIMEOUT_BASE_MS + ((len * 10) / NOTECARD_I2C_KHZ);
+}
+
+// Find the name of the request or command at the start of a transaction's first segment,
+// which is left empty if the segment doesn't hold enough of it
+void noteTransactionFindReq(const uint8_t *segment, uint32_t len)
+{
+    for (uint32_t i=0; i+7<=len; i++) {
+        if (segment[i] != '"') {
+            continue;
+        }
+        if (memcmp(&segment[i], "\"req\":\"", 7) != 0 && memcmp(&segment[i], "\"cmd\":\"", 7) != 0) {
+            continue;
+        }
+        uint32_t n = 0;
+        for (i+=7; i<len && segment[i] != '"' && n < sizeof(noteTransactionReq)-1; i++) {
+            noteTransactionReq[n++] = segment[i];
+        }
+        noteTransactionReq[(i<len && segment[i] == '"') ? n : 0] = '\0';
+        return;
+    }
+}
+
+// Get the bytes moved to and from the Notecard since boot, for benchmarking
+uint32_t noteI2CBytesMoved()
+{
+    return noteI2CBytes;
+}
+
+// Wait before the next retry, doubling the wait each time up to a limit.  After a failed
+// transfer the peripheral may have been left mid-transaction, so it is also reset.
+void noteI2CBackoff(int attempt)
+{
+    uint32_t ms = NOTE_I2C_BACKOFF_MIN_MS << attempt;
+    if (ms > NOTE_I2C_BACKOFF_MAX_MS) {
+        ms = NOTE_I2C_BACKOFF_MAX_MS;
+    }
+    MY_I2C2_Reset();
+    HAL_Delay(ms);
+}
+
 // Send a note to the gateway async
 void noteSendToGatewayAsync(J *req, bool responseExpected)
 {
@@ -250,11 +429,106 @@ void noteSendToGatewayAsync(J *req, bool responseExpected)
     // Add the time to the request, because it may be quite a while
     // to acquire a transmit window and we'd like the time to be
     // as accurate as it can be.
-    if (NoteTimeValidST()) {
-        JAddNumberToObject(req, "time", NoteTimeST());
+    if (appTimeValid()) {
+        JAddNumberToObject(req, "time", appTime());
     }
 
     // Enqueue it to the gateway
     sensorSendReqToGateway(req, responseExpected);
 
 }
+
+// See whether the gateway already holds the template that a note.template request registers,
+// because we registered the same one with it before we restarted.  If so, the request is only
+// learned locally, so that notes to its notefile are still sent compactly, and is deleted.
+// Otherwise it's noted for noteTemplateRegistered(), and is left for the app to send.
+bool noteTemplateKnown(J *req)
+{
+    char *json = JConvertToJSONString(req);
+    if (json == NULL) {
+        return false;
+    }
+    uint32_t hash = utilCRC32(0, (uint8_t *) json, strlen(json));
+    JFree(json);
+    if (hash == 0) {
+        hash = 1;
+    }
+    if (flashTemplateKnown(utilHashAddress(gatewayAddress), gatewayBootTime, hash)) {
+        APP_PRINTF("%s %s template already registered\r\n", tracePeer(), JGetString(req, "file"));
+        compactLearnTemplate(NULL, req);
+        JDelete(req);
+        return true;
+    }
+    int appID = schedCurrentApp();
+    if (appID >= 0 && appID < SCHED_MAX_APPS) {
+        noteTemplatePending[appID] = hash;
+    }
+    return false;
+}
+
+// Record that the gateway accepted the template that the app whose response this is
+// registered, so that it needn't be registered again after we restart
+void noteTemplateRegistered()
+{
+    int appID = schedCurrentApp();
+    if (appID < 0 || appID >= SCHED_MAX_APPS || noteTemplatePending[appID] == 0) {
+        return;
+    }
+    flashTemplateSave(utilHashAddress(gatewayAddress), gatewayBootTime, noteTemplatePending[appID]);
+    noteTemplatePending[appID] = 0;
+}
+
+// Send a health record to the gateway async, which it expands into a note of its own, in place
+// of a hub.log whose text would be many times the size.  The record has no battery or signal
+// fields because the gateway takes those from the header of the message that carries it.
+void noteSendHealthToGatewayAsync(uint16_t requestID, bool sync)
+{
+    APP_PRINTF("%s health\r\n", tracePeer());
+    uint8_t *data = (uint8_t *) poolAlloc(sizeof(compactHealth));
+    if (data != NULL) {
+        compactHealth h;
+        h.Marker = COMPACT_HEALTH;
+        h.Flags = sync ? COMPACT_HEALTH_SYNC : 0;
+        h.RequestID = requestID;
+        h.Time = appTimeValid() ? appTime() : 0;
+        h.UptimeSecs = (uint32_t) ((TIMER_IF_GetTimeMs() - appBootMs) / 1000);
+        uint16_t permille[COMPACT_HEALTH_MODES];
+        uint32_t wakes[COMPACT_HEALTH_WAKES];
+        schedPowerResidency(permille, wakes, true);
+        for (int i=0; i<COMPACT_HEALTH_MODES; i++) {
+            h.ModePermille[i] = permille[i];
+        }
+        for (int i=0; i<COMPACT_HEALTH_WAKES; i++) {
+            h.Wakes[i] = (wakes[i] > 0xFFFF) ? 0xFFFF : (uint16_t) wakes[i];
+        }
+        uint32_t txMs, txMicrojoules, rxMs, awakeMs;
+        schedCostTotal(&txMs, &txMicrojoules, &rxMs, &awakeMs, true);
+        h.TxMs = txMs;
+        h.TxMicrojoules = txMicrojoules;
+        h.RxMs = rxMs;
+        h.AwakeMs = awakeMs;
+        memcpy(data, &h, sizeof(h));
+    }
+    sensorSendDataToGateway(data, (data == NULL) ? 0 : sizeof(compactHealth), true);
+}
+
+// Send a request written with compactNote*() to the gateway async, without a J tree
+void noteSendNoteToGatewayAsync(compactNote *note, bool responseExpected)
+{
+
+    // Add the time to the request, as above
+    if (appTimeValid()) {
+        compactNoteNumber(note, false, "time", appTime());
+    }
+
+    // Encode it and enqueue it to the gateway
+    APP_PRINTF("%s %s\r\n", tracePeer(), note->req);
+    uint8_t *reqData = NULL;
+    uint32_t reqDataLen = 0;
+    if (!compactNoteEncode(note, &reqData, &reqDataLen)) {
+        reqData = NULL;
+        reqDataLen = 0;
+    }
+    sensorSendDataToGateway(reqData, reqDataLen, responseExpected);
+
+}
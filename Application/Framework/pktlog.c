@@ -0,0 +1,126 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Gateway packet event log.  Each packet the gateway receives from a sensor, and each
+// request that it completes, is recorded as a small fixed-size binary event in a ring.
+// The ring is periodically uploaded as a single note whose payload holds the events
+// back-to-back, each time-stamped as an offset from the note's base time, so that the
+// whole fleet's link quality and latency can be studied without a debugger or a stream
+// of hub.log requests.
+
+#include "framework.h"
+
+// An event as uploaded.  The layout is versioned by PKTLOG_FORMAT in the note's body.
+#define PKTLOG_FORMAT   1
+typedef struct __attribute__((packed)) {
+    uint16_t secs;              // Seconds after the note body's "time"
+    uint32_t sender;            // utilHashAddress() of the sensor
+    uint32_t requestID;
+    uint16_t offset;            // Offset of the chunk, or total length when completed
+    int8_t rssi;                // As heard by the gateway
+    int8_t snr;
+    int8_t txp;                 // The sensor's transmit power
+    uint8_t outcome;            // PKTLOG_*
+    uint16_t latencyMs;         // For completed requests, time since the first chunk
+} pktlogWireEvent;
+
+// Events as held in the ring, with their full time
+typedef struct {
+    uint32_t time;
+    pktlogWireEvent e;
+} pktlogEvent;
+static pktlogEvent events[PKTLOG_EVENTS];
+static uint32_t eventsNext = 0;
+static uint32_t eventsCount = 0;
+static uint32_t eventsDropped = 0;
+static uint32_t lastUploadTime = 0;
+
+// Environment variables
+uint32_t var_gateway_pktlog_mins;
+
+// Record a packet event, overwriting the oldest when the ring is full
+void pktlogRecord(const uint8_t *sender, uint32_t requestID, uint32_t offset, int8_t rssi, int8_t snr, int8_t txp, uint8_t outcome, uint32_t latencyMs)
+{
+    pktlogEvent *ev = &events[eventsNext];
+    eventsNext = (eventsNext + 1) % PKTLOG_EVENTS;
+    if (eventsCount < PKTLOG_EVENTS) {
+        eventsCount++;
+    } else {
+        eventsDropped++;
+    }
+    ev->time = appTime();
+    ev->e.sender = utilHashAddress(sender);
+    ev->e.requestID = requestID;
+    ev->e.offset = (offset > 0xFFFF) ? 0xFFFF : (uint16_t) offset;
+    ev->e.rssi = rssi;
+    ev->e.snr = snr;
+    ev->e.txp = txp;
+    ev->e.outcome = outcome;
+    ev->e.latencyMs = (latencyMs > 0xFFFF) ? 0xFFFF : (uint16_t) latencyMs;
+}
+
+// Upload the ring as a single note when it is nearly full or the upload interval has
+// elapsed, returning true if a note was added
+bool pktlogUpload(void)
+{
+    uint32_t now = appTime();
+    if (lastUploadTime == 0) {
+        lastUploadTime = now;
+    }
+    uint32_t mins = var_gateway_pktlog_mins ? var_gateway_pktlog_mins : DEFAULT_GATEWAY_PKTLOG_MINS;
+    if (eventsCount == 0 || (eventsCount < (PKTLOG_EVENTS*3)/4 && now < lastUploadTime+(mins*60))) {
+        return false;
+    }
+
+    // Flatten the ring oldest-first into wire events, relative to the oldest event's time.
+    // Events older than the 16-bit offset allows, which can only happen if the clock was
+    // set while they were held, are pinned to the base time.
+    uint32_t first = (eventsNext + PKTLOG_EVENTS - eventsCount) % PKTLOG_EVENTS;
+    uint32_t baseTime = events[first].time;
+    uint32_t len = eventsCount * sizeof(pktlogWireEvent);
+    pktlogWireEvent *wire = (pktlogWireEvent *) poolAlloc(len);
+    if (wire == NULL) {
+        return false;
+    }
+    for (uint32_t i=0; i<eventsCount; i++) {
+        pktlogEvent *ev = &events[(first + i) % PKTLOG_EVENTS];
+        wire[i] = ev->e;
+        uint32_t secs = (ev->time >= baseTime) ? ev->time - baseTime : 0;
+        wire[i].secs = (secs > 0xFFFF) ? 0xFFFF : (uint16_t) secs;
+    }
+    char *payload = (char *) poolAlloc(JB64EncodeLen(len));
+    if (payload == NULL) {
+        poolFree(wire);
+        return false;
+    }
+    JB64Encode(payload, (const char *) wire, len);
+    poolFree(wire);
+
+    // Add the note, sent as a command because we needn't wait for its response, and
+    // leave the ring intact for the next attempt if it couldn't be sent
+    bool success = false;
+    J *req = NoteNewCommand("note.add");
+    if (req != NULL) {
+        JAddStringToObject(req, "file", PKTLOG_NOTEFILE);
+        J *body = JCreateObject();
+        if (body != NULL) {
+            JAddNumberToObject(body, "format", PKTLOG_FORMAT);
+            JAddNumberToObject(body, "time", baseTime);
+            JAddNumberToObject(body, "events", eventsCount);
+            JAddNumberToObject(body, "dropped", eventsDropped);
+            JAddItemToObject(req, "body", body);
+        }
+        JAddStringToObject(req, "payload", payload);
+        success = NoteRequest(req);
+    }
+    poolFree(payload);
+    if (!success) {
+        return false;
+    }
+    APP_PRINTF("pktlog: uploaded %d events (%d dropped)\r\n", eventsCount, eventsDropped);
+    eventsCount = 0;
+    eventsDropped = 0;
+    lastUploadTime = now;
+    return true;
+}
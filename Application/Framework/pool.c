@@ -0,0 +1,256 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Fixed-block allocator for the buffers that are allocated and freed on every message,
+// so that a long-running gateway doesn't fragment its small heap.  Requests are served
+// from the smallest size class that fits, and from the heap when no block is free or
+// the request exceeds the largest class.  poolFree() accepts either kind of pointer.
+//
+// While the gateway performs a sensor request, everything is instead served from an arena by
+// bumping a pointer, and what is freed within it is only released when the arena is ended, all
+// at once.  The J trees that note-c builds and tears down for the request then cost nothing to
+// allocate, can't fragment anything, and use a measured amount of memory.  What outlives the
+// request is copied out of the arena as it ends, or allocated with poolAllocLasting().
+
+#include "framework.h"
+
+// Block sizes must be a multiple of 8 so that every block is suitably aligned
+#if (POOL_SMALL_BYTES % 8) != 0 || (POOL_MEDIUM_BYTES % 8) != 0 || (POOL_LARGE_BYTES % 8) != 0
+#error "pool block sizes must be a multiple of 8"
+#endif
+#if POOL_MEDIUM_BYTES < MESSAGE_MAX_BODY
+#error "POOL_MEDIUM_BYTES must hold a message body"
+#endif
+#if ((POOL_SMALL_BYTES*POOL_SMALL_BLOCKS)+(POOL_MEDIUM_BYTES*POOL_MEDIUM_BLOCKS)+(POOL_LARGE_BYTES*POOL_LARGE_BLOCKS)) > POOL_STATIC_BYTES
+#error "pool storage exceeds its share of RAM"
+#endif
+
+// Storage for each size class
+static uint64_t smallBlocks[POOL_SMALL_BLOCKS][POOL_SMALL_BYTES/sizeof(uint64_t)];
+static uint64_t mediumBlocks[POOL_MEDIUM_BLOCKS][POOL_MEDIUM_BYTES/sizeof(uint64_t)];
+static uint64_t largeBlocks[POOL_LARGE_BLOCKS][POOL_LARGE_BYTES/sizeof(uint64_t)];
+
+// A size class, whose free blocks are linked through their first word
+typedef struct poolBlock_s {
+    struct poolBlock_s *next;
+} poolBlock;
+typedef struct {
+    const char *name;
+    uint8_t *storage;
+    uint32_t blockBytes;
+    uint32_t blocks;
+    poolBlock *free;
+    uint32_t inUse;
+    uint32_t highWater;
+    uint32_t allocs;
+    uint32_t exhausted;
+} poolClass;
+static uint32_t poolBytesInUse = 0;
+static uint32_t poolBytesHighWater = 0;
+static poolClass classes[] = {
+    { .name = "small", .storage = (uint8_t *) smallBlocks, .blockBytes = POOL_SMALL_BYTES, .blocks = POOL_SMALL_BLOCKS },
+    { .name = "medium", .storage = (uint8_t *) mediumBlocks, .blockBytes = POOL_MEDIUM_BYTES, .blocks = POOL_MEDIUM_BLOCKS },
+    { .name = "large", .storage = (uint8_t *) largeBlocks, .blockBytes = POOL_LARGE_BYTES, .blocks = POOL_LARGE_BLOCKS },
+};
+#define POOL_CLASSES (sizeof(classes)/sizeof(classes[0]))
+static bool poolInitialized = false;
+
+// Heap fallbacks, of which those in heapTracked[] are counted as in use.  One made when it's
+// full, like any buffer from the heap that poolFree() is asked to free but that poolAlloc()
+// didn't, is freed without being counted.
+static uint32_t heapAllocs = 0;
+static uint32_t heapInUse = 0;
+static uint32_t heapHighWater = 0;
+static void *heapTracked[POOL_HEAP_TRACKED] = {0};
+
+// Arena, which is taken from the heap when the gateway first needs it and then kept
+static uint8_t *arena = NULL;
+static bool arenaActive = false;
+static uint32_t arenaUsed = 0;
+static uint32_t arenaHighWater = 0;
+static uint32_t arenaScopes = 0;
+static uint32_t arenaOverflows = 0;
+
+// Forwards
+void poolInit(void);
+void *poolAllocBlock(size_t size);
+
+// Link every block of every class onto its free list
+void poolInit()
+{
+    for (uint32_t i=0; i<POOL_CLASSES; i++) {
+        poolClass *c = &classes[i];
+        c->free = NULL;
+        for (uint32_t j=c->blocks; j>0; j--) {
+            poolBlock *b = (poolBlock *) &c->storage[(j-1)*c->blockBytes];
+            b->next = c->free;
+            c->free = b;
+        }
+        c->inUse = 0;
+    }
+    poolInitialized = true;
+}
+
+// Allocate a buffer, from the arena while one is active, and otherwise from the pool if possible
+void *poolAlloc(size_t size)
+{
+    if (arenaActive) {
+        uint32_t bytes = (size == 0) ? 8 : ((size + 7) & ~7);
+        if (arenaUsed + bytes <= POOL_ARENA_BYTES) {
+            void *p = &arena[arenaUsed];
+            arenaUsed += bytes;
+            if (arenaUsed > arenaHighWater) {
+                arenaHighWater = arenaUsed;
+            }
+            return p;
+        }
+        arenaOverflows++;
+    }
+    return poolAllocBlock(size);
+}
+
+// Allocate a buffer that outlives the arena, if one is active
+void *poolAllocLasting(size_t size)
+{
+    return poolAllocBlock(size);
+}
+
+// Allocate a buffer from the pool if possible
+void *poolAllocBlock(size_t size)
+{
+
+    // The lists are built on first use, because note-c may allocate before appInit
+    if (!poolInitialized) {
+        poolInit();
+    }
+
+    // Take a block from the smallest class that fits and has one available
+    for (uint32_t i=0; i<POOL_CLASSES; i++) {
+        poolClass *c = &classes[i];
+        if (size > c->blockBytes) {
+            continue;
+        }
+        if (c->free == NULL) {
+            c->exhausted++;
+            continue;
+        }
+        poolBlock *b = c->free;
+        c->free = b->next;
+        c->allocs++;
+        if (++c->inUse > c->highWater) {
+            c->highWater = c->inUse;
+        }
+        poolBytesInUse += c->blockBytes;
+        if (poolBytesInUse > poolBytesHighWater) {
+            poolBytesHighWater = poolBytesInUse;
+        }
+        return b;
+    }
+
+    // Fall back to the heap
+    void *p = malloc(size);
+    if (p != NULL) {
+        heapAllocs++;
+        for (uint32_t i=0; i<POOL_HEAP_TRACKED; i++) {
+            if (heapTracked[i] == NULL) {
+                heapTracked[i] = p;
+                if (++heapInUse > heapHighWater) {
+                    heapHighWater = heapInUse;
+                }
+                break;
+            }
+        }
+    }
+    return p;
+
+}
+
+// Free a buffer allocated by poolAlloc()
+void poolFree(void *p)
+{
+    if (p == NULL) {
+        return;
+    }
+    if (arena != NULL && (uint8_t *) p >= arena && (uint8_t *) p < &arena[POOL_ARENA_BYTES]) {
+        return;
+    }
+    for (uint32_t i=0; i<POOL_CLASSES; i++) {
+        poolClass *c = &classes[i];
+        uint8_t *u = (uint8_t *) p;
+        if (u >= c->storage && u < &c->storage[c->blocks*c->blockBytes]) {
+            poolBlock *b = (poolBlock *) p;
+            b->next = c->free;
+            c->free = b;
+            c->inUse--;
+            poolBytesInUse -= c->blockBytes;
+            return;
+        }
+    }
+    for (uint32_t i=0; i<POOL_HEAP_TRACKED; i++) {
+        if (heapTracked[i] == p) {
+            heapTracked[i] = NULL;
+            heapInUse--;
+            break;
+        }
+    }
+    free(p);
+}
+
+// Serve allocations from the arena until poolArenaEnd(), if it can be had
+void poolArenaBegin()
+{
+    if (arena == NULL) {
+        arena = (uint8_t *) malloc(POOL_ARENA_BYTES);
+    }
+    arenaUsed = 0;
+    arenaActive = (arena != NULL);
+    arenaScopes++;
+}
+
+// Release everything allocated from the arena at once, first copying a buffer of the given
+// length out of it if it lies within it, with a terminator, and returning where the buffer
+// now is, or NULL if there's no room to copy it.  The arena's contents remain intact until
+// the next poolArenaBegin(), which is what makes the copy possible.
+void *poolArenaEnd(void *keep, size_t len)
+{
+    arenaActive = false;
+    if (keep == NULL || arena == NULL || (uint8_t *) keep < arena || (uint8_t *) keep >= &arena[POOL_ARENA_BYTES]) {
+        return keep;
+    }
+    uint8_t *copy = (uint8_t *) poolAllocBlock(len+1);
+    if (copy != NULL) {
+        memcpy(copy, keep, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+// Display usage statistics
+void poolShow()
+{
+    APP_PRINTF("pool: class bytes blocks inuse high allocs exhausted\r\n");
+    for (uint32_t i=0; i<POOL_CLASSES; i++) {
+        poolClass *c = &classes[i];
+        APP_PRINTF("  %6s %5d %6d %5d %4d %6d %9d\r\n", c->name, c->blockBytes, c->blocks,
+                   c->inUse, c->highWater, c->allocs, c->exhausted);
+    }
+    APP_PRINTF("  %6s %5s %6s %5d %4d %6d\r\n", "heap", "-", "-", heapInUse, heapHighWater, heapAllocs);
+    APP_PRINTF("  %6s %5d %6s %5d %4d %6d %9d\r\n", "arena", POOL_ARENA_BYTES, "-", arenaUsed, arenaHighWater, arenaScopes, arenaOverflows);
+}
+
+// Get the most pool bytes, and the most heap fallback allocations, that have been in use
+// at once, optionally restarting the measurement from what is in use now
+void poolHighWater(uint32_t *poolBytes, uint32_t *heapBlocks, bool reset)
+{
+    if (poolBytes != NULL) {
+        *poolBytes = poolBytesHighWater;
+    }
+    if (heapBlocks != NULL) {
+        *heapBlocks = heapHighWater;
+    }
+    if (reset) {
+        poolBytesHighWater = poolBytesInUse;
+        heapHighWater = heapInUse;
+    }
+}
@@ -0,0 +1,478 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Hot-path profiler.  Named spans are timed with the DWT cycle counter and recorded
+// into a ring buffer of recent spans, as well as into per-name totals.  The 'prof'
+// console command displays both, 'prof reset' clears them, 'prof mem' benchmarks
+// the memory moves used by the radio and the sequencer, and 'prof printf' benchmarks
+// the trace formatter against the C library's.  The 'bench' console command runs a suite
+// of the primitives that everything depends upon, one group per call, as a fixed table
+// that can be compared across firmware versions.  When PROFILER_ON
+// is false, the PROF_ macros compile to nothing.  Note that the cycle counter does
+// not advance in STOP2, so spans must not include time spent in low-power mode.
+
+#include <stdio.h>
+#include <stdarg.h>
+#include "main.h"
+#include "framework.h"
+#include "stm32_mem.h"
+#include "stm32_tiny_vsnprintf.h"
+
+#if PROFILER_ON
+
+// Recent spans
+#define PROF_RING_ENTRIES   64
+typedef struct {
+    const char *name;
+    uint32_t beganCycles;
+    uint32_t cycles;
+} profSpanEntry;
+static profSpanEntry ring[PROF_RING_ENTRIES];
+static uint32_t ringNext = 0;
+static uint32_t ringCount = 0;
+
+// Totals by span name
+#define PROF_NAMES          16
+typedef struct {
+    const char *name;
+    uint32_t count;
+    uint64_t totalCycles;
+    uint32_t maxCycles;
+} profNameEntry;
+static profNameEntry names[PROF_NAMES];
+
+// Spans that begin and end in different functions, such as in an ISR and in the task
+#define PROF_MARKS          4
+typedef struct {
+    const char *name;
+    uint32_t beganCycles;
+} profMarkEntry;
+static profMarkEntry marks[PROF_MARKS];
+
+// Buffers for the memory benchmark, sized for a radio payload plus room to misalign
+#define PROF_BENCH_BYTES    256
+static uint8_t benchSrc[PROF_BENCH_BYTES+4] __attribute__((aligned(4)));
+static uint8_t benchDst[PROF_BENCH_BYTES+4] __attribute__((aligned(4)));
+
+// Forwards
+void profRecord(const char *name, uint32_t beganCycles, bool recent);
+uint32_t profMicroseconds(uint64_t cycles);
+void profBenchByteCopy(void *dst, const void *src, uint16_t size);
+void profBenchByteSet(void *dst, uint8_t value, uint16_t size);
+uint32_t profBenchFormat(bool tiny, const char *format, ...);
+void profBenchRow(const char *name, uint32_t arg, uint32_t cycles);
+void profBenchRowMs(const char *name, uint32_t arg, uint32_t ms);
+void profBenchAES(void);
+void profBenchPeers(void);
+void profBenchJSON(void);
+void profBenchFlash(void);
+void profBenchNotecard(void);
+
+// A typical note, as the gateway receives it from sensors and forwards it to the Notecard
+static const char *benchNote = "{\"req\":\"note.add\",\"file\":\"air.qo\",\"body\":{\"temperature\":23.5,\"humidity\":61.2,\"pressure\":101325,\"voltage\":3.29},\"sync\":true}";
+
+// Start the cycle counter
+void profInit()
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+// Get the current cycle count
+uint32_t profCycles()
+{
+    return DWT->CYCCNT;
+}
+
+// Record a span into the totals, and optionally into the ring of recent spans
+void profRecord(const char *name, uint32_t beganCycles, bool recent)
+{
+    uint32_t cycles = DWT->CYCCNT - beganCycles;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (recent) {
+        ring[ringNext].name = name;
+        ring[ringNext].beganCycles = beganCycles;
+        ring[ringNext].cycles = cycles;
+        ringNext = (ringNext + 1) % PROF_RING_ENTRIES;
+        if (ringCount < PROF_RING_ENTRIES) {
+            ringCount++;
+        }
+    }
+    for (int i=0; i<PROF_NAMES; i++) {
+        if (names[i].name == NULL) {
+            names[i].name = name;
+        } else if (strcmp(names[i].name, name) != 0) {
+            continue;
+        }
+        names[i].count++;
+        names[i].totalCycles += cycles;
+        if (cycles > names[i].maxCycles) {
+            names[i].maxCycles = cycles;
+        }
+        break;
+    }
+    __set_PRIMASK(primask);
+}
+
+// Record a completed span
+void profSpan(const char *name, uint32_t beganCycles)
+{
+    profRecord(name, beganCycles, true);
+}
+
+// Record a completed span only into the totals, for spans so frequent that they would
+// otherwise crowd everything else out of the ring
+void profTally(const char *name, uint32_t beganCycles)
+{
+    profRecord(name, beganCycles, false);
+}
+
+// Open a span that will be closed elsewhere, replacing any that is already open
+void profMarkBegin(const char *name)
+{
+    uint32_t now = DWT->CYCCNT;
+    int available = -1;
+    for (int i=0; i<PROF_MARKS; i++) {
+        if (marks[i].name == NULL) {
+            if (available < 0) {
+                available = i;
+            }
+        } else if (strcmp(marks[i].name, name) == 0) {
+            marks[i].beganCycles = now;
+            return;
+        }
+    }
+    if (available >= 0) {
+        marks[available].beganCycles = now;
+        marks[available].name = name;
+    }
+}
+
+// Close a span opened by profMarkBegin, if it is open
+void profMarkEnd(const char *name)
+{
+    for (int i=0; i<PROF_MARKS; i++) {
+        if (marks[i].name != NULL && strcmp(marks[i].name, name) == 0) {
+            marks[i].name = NULL;
+            profSpan(name, marks[i].beganCycles);
+            return;
+        }
+    }
+}
+
+// Convert cycles to microseconds
+uint32_t profMicroseconds(uint64_t cycles)
+{
+    uint32_t cyclesPerUs = SystemCoreClock / 1000000;
+    if (cyclesPerUs == 0) {
+        cyclesPerUs = 1;
+    }
+    return (uint32_t) (cycles / cyclesPerUs);
+}
+
+// Clear all recorded spans
+void profReset()
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    memset(ring, 0, sizeof(ring));
+    memset(names, 0, sizeof(names));
+    memset(marks, 0, sizeof(marks));
+    ringNext = 0;
+    ringCount = 0;
+    __set_PRIMASK(primask);
+}
+
+// The byte loops that UTIL_MEM used to be, kept from being turned into library calls so
+// that the benchmark has something to compare against
+void __attribute__((noinline, optimize("no-tree-loop-distribute-patterns"))) profBenchByteCopy(void *dst, const void *src, uint16_t size)
+{
+    uint8_t *dst8 = (uint8_t *) dst;
+    const uint8_t *src8 = (const uint8_t *) src;
+    while (size--) {
+        *dst8++ = *src8++;
+    }
+}
+
+// The byte loop that UTIL_MEM_set_8 used to be
+void __attribute__((noinline, optimize("no-tree-loop-distribute-patterns"))) profBenchByteSet(void *dst, uint8_t value, uint16_t size)
+{
+    uint8_t *dst8 = (uint8_t *) dst;
+    while (size--) {
+        *dst8++ = value;
+    }
+}
+
+// Display the cycles taken to move a radio payload with the byte loops, with UTIL_MEM, and
+// with the C library, with interrupts masked so that the counts are repeatable
+void profBenchMem()
+{
+    uint32_t cycles[8];
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint32_t began = DWT->CYCCNT;
+    profBenchByteCopy(benchDst, benchSrc, PROF_BENCH_BYTES);
+    cycles[0] = DWT->CYCCNT - began;
+    began = DWT->CYCCNT;
+    UTIL_MEM_cpy_8(benchDst, benchSrc, PROF_BENCH_BYTES);
+    cycles[1] = DWT->CYCCNT - began;
+    began = DWT->CYCCNT;
+    UTIL_MEM_cpy_8(&benchDst[2], benchSrc, PROF_BENCH_BYTES);
+    cycles[2] = DWT->CYCCNT - began;
+    began = DWT->CYCCNT;
+    UTIL_MEM_cpy_8(&benchDst[1], benchSrc, PROF_BENCH_BYTES);
+    cycles[3] = DWT->CYCCNT - began;
+    began = DWT->CYCCNT;
+    memcpy(benchDst, benchSrc, PROF_BENCH_BYTES);
+    cycles[4] = DWT->CYCCNT - began;
+    began = DWT->CYCCNT;
+    profBenchByteSet(benchDst, 0xA5, PROF_BENCH_BYTES);
+    cycles[5] = DWT->CYCCNT - began;
+    began = DWT->CYCCNT;
+    UTIL_MEM_set_8(benchDst, 0xA5, PROF_BENCH_BYTES);
+    cycles[6] = DWT->CYCCNT - began;
+    began = DWT->CYCCNT;
+    memset(benchDst, 0xA5, PROF_BENCH_BYTES);
+    cycles[7] = DWT->CYCCNT - began;
+    __set_PRIMASK(primask);
+    APP_PRINTF("prof: cycles per %d bytes at %dMHz\r\n", PROF_BENCH_BYTES, SystemCoreClock / 1000000);
+    APP_PRINTF("  copy: bytes %d, util %d, util half-aligned %d, util unaligned %d, memcpy %d\r\n",
+               cycles[0], cycles[1], cycles[2], cycles[3], cycles[4]);
+    APP_PRINTF("  set:  bytes %d, util %d, memset %d\r\n", cycles[5], cycles[6], cycles[7]);
+}
+
+// Format into the benchmark buffer with the trace formatter or with the C library's,
+// returning the cycles taken
+uint32_t profBenchFormat(bool tiny, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    uint32_t began = DWT->CYCCNT;
+    if (tiny) {
+        tiny_vsnprintf_like((char *) benchDst, PROF_BENCH_BYTES, format, ap);
+    } else {
+        vsnprintf((char *) benchDst, PROF_BENCH_BYTES, format, ap);
+    }
+    uint32_t cycles = DWT->CYCCNT - began;
+    va_end(ap);
+    return cycles;
+}
+
+// Display the cycles taken to format lines like those that the framework traces most,
+// with the trace formatter and with the C library, with interrupts masked
+void profBenchPrintf()
+{
+    static const char *peer = "gateway 5F2A0C3E";
+    uint32_t cycles[8];
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    for (int i=0; i<2; i++) {
+        bool tiny = (i == 0);
+        cycles[(i*4)+0] = profBenchFormat(tiny, "%s rssi:%d snr:%d sf:%d\r\n", peer, -97, 7, 10);
+        cycles[(i*4)+1] = profBenchFormat(tiny, "%s %d %d %d %d\r\n", peer, 1697040000, 3600, 12345, 255);
+        cycles[(i*4)+2] = profBenchFormat(tiny, "%08x%08x %02X%02X\r\n", 0x5F2A0C3E, 0xDEADBEEF, 0xA5, 0x0F);
+        cycles[(i*4)+3] = profBenchFormat(tiny, "%s %s: %s\r\n", peer, "notecard", "{\"req\":\"note.add\",\"file\":\"sensors.db\"}");
+    }
+    __set_PRIMASK(primask);
+    APP_PRINTF("prof: cycles per line at %dMHz (tiny, libc)\r\n", SystemCoreClock / 1000000);
+    APP_PRINTF("  rssi line  %6d %6d\r\n", cycles[0], cycles[4]);
+    APP_PRINTF("  decimals   %6d %6d\r\n", cycles[1], cycles[5]);
+    APP_PRINTF("  hex        %6d %6d\r\n", cycles[2], cycles[6]);
+    APP_PRINTF("  strings    %6d %6d\r\n", cycles[3], cycles[7]);
+}
+
+// Display a row of the benchmark table timed in cycles
+void profBenchRow(const char *name, uint32_t arg, uint32_t cycles)
+{
+    APP_PRINTF("  %-20s %6d %10d %8d\r\n", name, arg, cycles, profMicroseconds(cycles));
+}
+
+// Display a row of the benchmark table timed by the clock, for operations that may sleep
+// in STOP2 where the cycle counter doesn't advance
+void profBenchRowMs(const char *name, uint32_t arg, uint32_t ms)
+{
+    APP_PRINTF("  %-20s %6d %10s %8d\r\n", name, arg, "-", ms*1000);
+}
+
+// Benchmark AES-CTR at the sizes of radio payloads, leaving interrupts enabled since
+// the peripheral completes by DMA
+void profBenchAES()
+{
+    static const uint16_t sizes[] = { 32, 64, 128, 256 };
+    uint8_t key[AES_KEY_BYTES];
+    memset(key, 0x5A, sizeof(key));
+    for (int i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+        uint32_t began = DWT->CYCCNT;
+        MX_AES_CTR_Encrypt(key, benchSrc, sizes[i], benchDst);
+        profBenchRow("aes encrypt", sizes[i], DWT->CYCCNT - began);
+    }
+    for (int i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+        uint32_t began = DWT->CYCCNT;
+        MX_AES_CTR_Decrypt(key, benchDst, sizes[i], benchSrc);
+        profBenchRow("aes decrypt", sizes[i], DWT->CYCCNT - began);
+    }
+}
+
+// Benchmark the lookup of the first and last peers and of an unknown address, with the
+// argument being the number of peers presently configured
+void profBenchPeers()
+{
+    uint32_t peers = flashConfigPeers();
+    uint8_t address[ADDRESS_LEN];
+    uint16_t peerType;
+    uint8_t key[AES_KEY_BYTES];
+    for (int i=0; i<3; i++) {
+        const char *name;
+        if (i == 0) {
+            name = "peer find first";
+            if (peers == 0 || !flashConfigPeerAddressByHandle(0, address)) {
+                continue;
+            }
+        } else if (i == 1) {
+            name = "peer find last";
+            if (peers == 0 || !flashConfigPeerAddressByHandle(peers-1, address)) {
+                continue;
+            }
+        } else {
+            name = "peer find unknown";
+            memset(address, 0xEE, sizeof(address));
+        }
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        uint32_t began = DWT->CYCCNT;
+        flashConfigFindPeerByAddress(address, &peerType, key, NULL);
+        uint32_t cycles = DWT->CYCCNT - began;
+        __set_PRIMASK(primask);
+        profBenchRow(name, peers, cycles);
+    }
+}
+
+// Benchmark parsing and serializing a typical note, with the argument being its length
+void profBenchJSON()
+{
+    uint32_t len = strlen(benchNote);
+    uint32_t began = DWT->CYCCNT;
+    J *note = JConvertFromJSONString(benchNote);
+    uint32_t cycles = DWT->CYCCNT - began;
+    if (note == NULL) {
+        return;
+    }
+    profBenchRow("json parse", len, cycles);
+    began = DWT->CYCCNT;
+    char *json = JConvertToJSONString(note);
+    cycles = DWT->CYCCNT - began;
+    if (json != NULL) {
+        profBenchRow("json serialize", len, cycles);
+        JFree(json);
+    }
+    JDelete(note);
+}
+
+// Benchmark rewriting a page of flash, for which the last page of the DFU area is
+// rewritten with its own contents so that nothing that it holds is lost
+void profBenchFlash()
+{
+    uint8_t *activeBase, *dfuBase;
+    uint32_t maxBytes, maxPages;
+    flashCodeParams(&activeBase, &dfuBase, &maxBytes, &maxPages);
+    uint8_t *page = dfuBase + maxBytes - FLASH_PAGE_SIZE;
+    uint8_t *copy = malloc(FLASH_PAGE_SIZE);
+    if (copy == NULL) {
+        return;
+    }
+    memcpy(copy, page, FLASH_PAGE_SIZE);
+    int64_t beganMs = TIMER_IF_GetTimeMs();
+    bool success = flashWrite(page, copy, FLASH_PAGE_SIZE);
+    uint32_t ms = (uint32_t) (TIMER_IF_GetTimeMs() - beganMs);
+    free(copy);
+    if (success) {
+        profBenchRowMs("flash write page", FLASH_PAGE_SIZE, ms);
+    }
+}
+
+// Benchmark a round trip to the Notecard, on the gateway
+void profBenchNotecard()
+{
+    if (!appIsGateway) {
+        return;
+    }
+    int64_t beganMs = TIMER_IF_GetTimeMs();
+    J *rsp = NoteRequestResponse(NoteNewRequest("card.version"));
+    uint32_t ms = (uint32_t) (TIMER_IF_GetTimeMs() - beganMs);
+    if (rsp != NULL) {
+        bool success = !NoteResponseError(rsp);
+        NoteDeleteResponse(rsp);
+        if (success) {
+            profBenchRowMs("notecard round trip", 0, ms);
+        }
+    }
+}
+
+// Run one group of the benchmark suite, returning true if there are more to run
+bool profBenchSuite(uint32_t group)
+{
+    uint32_t cycles[3];
+    uint32_t primask;
+    switch (group) {
+
+    case 0:
+        APP_PRINTF("bench: %s at %dMHz\r\n", appFirmwareVersion(), SystemCoreClock / 1000000);
+        APP_PRINTF("  %-20s %6s %10s %8s\r\n", "primitive", "arg", "cycles", "us");
+        profBenchAES();
+        return true;
+
+    case 1:
+        profBenchPeers();
+        profBenchJSON();
+        return true;
+
+    case 2:
+        primask = __get_PRIMASK();
+        __disable_irq();
+        uint32_t began = DWT->CYCCNT;
+        UTIL_MEM_cpy_8(benchDst, benchSrc, PROF_BENCH_BYTES);
+        cycles[0] = DWT->CYCCNT - began;
+        began = DWT->CYCCNT;
+        UTIL_MEM_cpy_8(&benchDst[1], benchSrc, PROF_BENCH_BYTES);
+        cycles[1] = DWT->CYCCNT - began;
+        cycles[2] = profBenchFormat(true, "%s rssi:%d snr:%d sf:%d\r\n", "gateway 5F2A0C3E", -97, 7, 10);
+        __set_PRIMASK(primask);
+        profBenchRow("mem copy", PROF_BENCH_BYTES, cycles[0]);
+        profBenchRow("mem copy unaligned", PROF_BENCH_BYTES, cycles[1]);
+        profBenchRow("tiny_vsnprintf", 0, cycles[2]);
+        return true;
+
+    case 3:
+        profBenchFlash();
+        return true;
+
+    case 4:
+        profBenchNotecard();
+        break;
+
+    }
+    return false;
+}
+
+// Display the recent spans, oldest first, followed by the totals
+void profShow()
+{
+    uint32_t first = (ringNext + PROF_RING_ENTRIES - ringCount) % PROF_RING_ENTRIES;
+    uint32_t baseCycles = ring[first].beganCycles;
+    APP_PRINTF("prof: %d recent spans (us since first, duration us)\r\n", ringCount);
+    for (int i=0; i<ringCount; i++) {
+        profSpanEntry *e = &ring[(first + i) % PROF_RING_ENTRIES];
+        APP_PRINTF("  %10d %8d %s\r\n", profMicroseconds(e->beganCycles - baseCycles), profMicroseconds(e->cycles), e->name);
+    }
+    APP_PRINTF("prof: totals (count, total us, avg us, max us)\r\n");
+    for (int i=0; i<PROF_NAMES && names[i].name != NULL; i++) {
+        profNameEntry *e = &names[i];
+        APP_PRINTF("  %6d %10d %8d %8d %s\r\n", e->count, profMicroseconds(e->totalCycles),
+                   profMicroseconds(e->totalCycles / e->count), profMicroseconds(e->maxCycles), e->name);
+    }
+}
+
+#endif // PROFILER_ON
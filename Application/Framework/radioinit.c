@@ -2,9 +2,13 @@
 // Use of this source code is governed by licenses granted by the
 // copyright holder including that found in the LICENSE file.
 
+#include "stm32_timer.h"
+#include "stm32_seq.h"
+#include "utilities_def.h"
 #include "main.h"
 #include "framework.h"
 #include "radio.h"
+#include "radio_driver.h"
 
 // Global radio data
 bool wireReceiveSignalValid = false;
@@ -12,10 +16,88 @@ int8_t wireReceiveRSSI = 0;
 int8_t wireReceiveSNR = 0;
 int8_t wireTransmitDb = 0;
 bool radioIsDeepSleep = false;
+static bool radioIsWarmSleep = false;
 bool radioIOPending = false;
+bool radioCadActivityDetected = false;
 
 // IO vars
 uint32_t ioRFFrequency;
+static const int32_t ioChannelPlanHz[] = RADIO_CHANNEL_PLAN_HZ;
+#define RADIO_CHANNELS (sizeof(ioChannelPlanHz)/sizeof(ioChannelPlanHz[0]))
+static uint8_t ioChannel = 0;
+
+// The noise floor of each channel in the plan, in sixteenths of a dBm, as surveyed by the
+// gateway while it is idle, along with the channels found to be quiet enough to assign
+static int16_t ioNoiseFloor[RADIO_CHANNELS];
+static bool ioNoiseKnown[RADIO_CHANNELS];
+static uint32_t ioNoiseQuietMask = 0;
+static int64_t ioNoiseSurveyedMs = 0;
+
+// Time on air of a full-size message and of a full-size ACK, by spreading factor and then
+// for FSK, computed once so that timeouts and slot lengths follow from the radio parameters
+#define RADIO_SF_MIN 7
+#define RADIO_SF_MAX 12
+#define RADIO_AIRTIME_FSK (RADIO_SF_MAX-RADIO_SF_MIN+1)
+static uint16_t airtimeMessageMs[RADIO_AIRTIME_FSK+1];
+static uint16_t airtimeAckMs[RADIO_AIRTIME_FSK+1];
+static uint8_t airtimeChunkLen[RADIO_AIRTIME_FSK+1];
+static bool airtimeComputed = false;
+static int8_t ioTxPowerDb = 0;
+#if USE_MODEM_LORA
+static uint8_t ioSpreadingFactor = LORA_SPREADING_FACTOR;
+static uint8_t ioCodingRate = LORA_CODINGRATE;
+static uint16_t ioPreambleSymbols = LORA_PREAMBLE_LENGTH;
+#endif
+
+// The payload length of implicit-header frames, or 0 when using explicit headers, and the length
+// that the next transmit or receive is to use, after which the radio returns to explicit headers
+static uint8_t ioImplicitLen = 0;
+static uint8_t ioImplicitNextLen = 0;
+static bool ioSniffing = false;
+static bool ioRelayListening = false;
+static uint8_t ioSyncWord = RADIO_COMMON_SYNC_WORD;
+static uint32_t ioFrequency = 0;
+
+// Received frames are queued by the radio ISR and handed to the state machine by a sequencer
+// task, so that a frame arriving before the previous one has been consumed can't overwrite
+// it.  The ring has a single producer and a single consumer, each of which owns one of the
+// free-running indices, so neither side needs to mask interrupts.  The gateway listens
+// continuously, in which case ioRxListening is set while the receiver is running.  In
+// either mode ioRxWaiting is set while the state machine waits for a frame or a timeout.
+typedef struct {
+    int64_t receivedMs;
+    uint8_t len;
+    int8_t rssi;
+    int8_t snr;
+    uint8_t data[sizeof(wireMessageCarrier)];
+} radioRxFrame;
+static radioRxFrame rxQueue[RADIO_RX_QUEUE_FRAMES];
+static volatile uint32_t rxQueuePut = 0;
+static volatile uint32_t rxQueueTake = 0;
+static volatile uint32_t rxQueueOverflows = 0;
+static uint32_t rxQueueOverflowsReported = 0;
+static int64_t rxReceivedMs = 0;
+static bool ioRxListening = false;
+static volatile uint32_t ioRxListenErrors = 0;
+static volatile int64_t ioRxListenErrorMs = 0;
+static bool ioRxWaiting = false;
+static UTIL_TIMER_Object_t ioRxTimer;
+static bool ioRxTimerCreated = false;
+
+// When the current receive began, so that a sensor can charge its time to an app
+static int64_t ioRxBeganMs = 0;
+
+// Capture of received frames to the console, and their replay, where each replayed frame's
+// receivedMs holds its delay after the frame before it
+static bool captureOn = false;
+static int64_t captureLastMs = 0;
+static radioRxFrame replayStaged;
+static radioRxFrame replayQueue[RADIO_REPLAY_FRAMES];
+static uint32_t replayPut = 0;
+static uint32_t replayTake = 0;
+static int64_t replayLastMs = 0;
+static UTIL_TIMER_Object_t replayTimer;
+static bool replayTimerCreated = false;
 
 /* Radio events function pointer */
 static RadioEvents_t RadioEvents;
@@ -24,6 +106,32 @@ static void OnRxDone(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr);
 static void OnTxTimeout(void);
 static void OnRxTimeout(void);
 static void OnRxError(void);
+static void OnCadDone(bool channelActivityDetected);
+static void radioSetTxConfig(void);
+static uint8_t radioPaFor(int8_t powerLevel);
+static void radioSetPaConfig(int8_t powerLevel);
+static void radioSetRxConfig(void);
+static void radioSetHeaderMode(uint8_t implicitLen);
+static void radioAirtimeInit(void);
+static uint32_t radioFskTimeOnAirMs(uint8_t size);
+static uint32_t radioAirtimeEntryMs(uint32_t entry, uint8_t size);
+static uint32_t radioAirtimeIndex(uint8_t sf);
+static uint32_t radioCodingRateScaledMs(uint8_t sf, uint32_t ms);
+static void radioSniffStop(void);
+static bool radioRxIsContinuous(void);
+static void radioRxContinuous(uint32_t timeoutMs);
+static void radioRxEnqueue(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr);
+static void radioRxTimeoutEvent(void *context);
+static void radioListenStop(void);
+static uint32_t radioNoiseQuiet(void);
+static void radioRxCharge(void);
+static void radioCaptureFrame(radioRxFrame *frame);
+static void radioReplayEvent(void *context);
+static void radioReplayKick(void);
+void radioReceivedTask(void);
+#if USE_MODEM_LORA
+static uint32_t radioSymbolUs(void);
+#endif
 
 // Initialize the radio
 void radioInit()
@@ -31,6 +139,7 @@ void radioInit()
 
     // Ensure that our scheduler knows that we're awake
     radioIsDeepSleep = false;
+    radioIsWarmSleep = false;
 
     uint16_t sizeWM = sizeof(wireMessage);
     uint16_t sizeWMC = sizeof(wireMessageCarrier);
@@ -43,19 +152,19 @@ void radioInit()
     RadioEvents.TxTimeout = OnTxTimeout;
     RadioEvents.RxTimeout = OnRxTimeout;
     RadioEvents.RxError = OnRxError;
+    RadioEvents.CadDone = OnCadDone;
 
     radioIOPending = false;
+    ioRxListening = false;
     Radio.Init(&RadioEvents);
+    ioSyncWord = RADIO_COMMON_SYNC_WORD;
+    ioFrequency = 0;
 
 #if USE_MODEM_LORA
-    radioSetTxPower(atpPowerLevel());
-    Radio.SetRxConfig(MODEM_LORA,
-                      LORA_BANDWIDTH,
-                      LORA_SPREADING_FACTOR,
-                      LORA_CODINGRATE, 0, LORA_PREAMBLE_LENGTH,
-                      LORA_SYMBOL_TIMEOUT, LORA_FIX_LENGTH_PAYLOAD_ON,
-                      0, true, 0, 0, LORA_IQ_INVERSION_ON, true);
-    Radio.SetMaxPayloadLength(MODEM_LORA, sizeof(wireMessageCarrier));
+    ioTxPowerDb = atpPowerLevel();
+    radioSetTxConfig();
+    radioSetRxConfig();
+    Radio.SetMaxPayloadLength((ioSpreadingFactor == RADIO_SF_FSK) ? MODEM_FSK : MODEM_LORA, sizeof(wireMessageCarrier));
 #endif
 
 #if USE_MODEM_FSK
@@ -77,11 +186,14 @@ void radioInit()
 // De-initialize the radio
 void radioDeInit()
 {
+    radioListenStop();
     Radio.DeInit();
     radioIsDeepSleep = true;
+    radioIsWarmSleep = false;
 }
 
-// Place the radio in deep-sleep mode if no I/O is pending
+// Place the radio in deep-sleep mode if no I/O is pending.  With RADIO_WARM_SLEEP the radio
+// retains its configuration while asleep, so that waking needn't set it up again.
 bool radioDeepSleep()
 {
     if (radioIsDeepSleep) {
@@ -90,14 +202,26 @@ bool radioDeepSleep()
     if (radioIOPending) {
         return false;
     }
+#if RADIO_WARM_SLEEP
+    Radio.Sleep();
+    radioIsWarmSleep = true;
+#else
     Radio.DeepSleep();
+#endif
     radioIsDeepSleep = true;
     return true;
 }
 
-// Wake the radio from deep sleep if we're sleeping
+// Wake the radio from deep sleep if we're sleeping.  A radio in warm sleep wakes by itself at
+// the next command with everything that we last gave it, including its calibration, so only a
+// radio that lost its configuration is set up again.
 void radioDeepWake()
 {
+    if (radioIsDeepSleep && radioIsWarmSleep) {
+        radioIsDeepSleep = false;
+        radioIsWarmSleep = false;
+        return;
+    }
     if (radioIsDeepSleep) {
         radioInit();
         HAL_Delay(500);
@@ -107,6 +231,7 @@ void radioDeepWake()
 // Transmit Timeout ISR
 static void OnTxTimeout(void)
 {
+    statsRadioListening(false);
     radioIOPending = false;
     Radio.Sleep();
     ledIndicateTransmitInProgress(false);
@@ -116,6 +241,12 @@ static void OnTxTimeout(void)
 // Receive Timeout ISR
 static void OnRxTimeout(void)
 {
+    if (ioRxListening) {
+        return;
+    }
+    ioRxWaiting = false;
+    statsRadioListening(false);
+    radioRxCharge();
     wireReceivedLen = 0;
     radioIOPending = false;
     Radio.Sleep();
@@ -126,6 +257,14 @@ static void OnRxTimeout(void)
 // Receive Error ISR
 static void OnRxError(void)
 {
+    if (ioRxListening) {
+        ioRxListenErrors++;
+        ioRxListenErrorMs = TIMER_IF_GetTimeMs();
+        return;
+    }
+    ioRxWaiting = false;
+    statsRadioListening(false);
+    radioRxCharge();
     wireReceivedLen = 0;
     radioIOPending = false;
     Radio.Sleep();
@@ -133,9 +272,34 @@ static void OnRxError(void)
     appSetCoreState(RX_ERROR);
 }
 
+// Channel Activity Detection ISR, which completes as a timeout if the channel is clear
+// and as an error if it is busy, just as a listen-before-talk receive would.
+static void OnCadDone(bool channelActivityDetected)
+{
+    statsRadioListening(false);
+    radioIOPending = false;
+    radioCadActivityDetected = channelActivityDetected;
+    Radio.Sleep();
+    ledIndicateReceiveInProgress(false);
+    appSetCoreState(channelActivityDetected ? RX_ERROR : RX_TIMEOUT);
+}
+
+// Charge the receive that just completed to the app on whose behalf the sensor is using
+// the radio, which is called from radio ISRs
+static void radioRxCharge()
+{
+    if (ioRxBeganMs != 0) {
+        if (!appIsGateway) {
+            schedChargeReceive(sensorRadioApp(), (uint32_t) (TIMER_IF_GetTimeMs() - ioRxBeganMs));
+        }
+        ioRxBeganMs = 0;
+    }
+}
+
 // Transmit Completed ISR
 static void OnTxDone(void)
 {
+    statsRadioListening(false);
     radioIOPending = false;
     Radio.Sleep();
     ledIndicateTransmitInProgress(false);
@@ -143,25 +307,27 @@ static void OnTxDone(void)
 }
 
 // Receive Completed ISR
-static void OnRxDone(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr)
+static void RAMFUNC OnRxDone(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr)
 {
+    PROF_MARK_BEGIN("rxdone-to-rx");
 
-    if (size > sizeof(wireMessageCarrier)) {
-        wireReceivedLen = 0;
-    } else {
-        wireReceivedLen = size;
-        memcpy(&wireReceivedCarrier, payload, size);
+    // When listening continuously the radio is still receiving
+    if (!ioRxListening) {
+        radioIOPending = false;
+        Radio.Sleep();
+        statsRadioListening(false);
+        radioRxCharge();
     }
 
-    radioIOPending = false;
-    Radio.Sleep();
-
-    wireReceiveRSSI = rssi;
-    wireReceiveSNR = snr;
-    wireReceiveSignalValid = true;
-
-    ledIndicateReceiveInProgress(false);
-    appSetCoreState(RX);
+    // In FSK the radio reports an average RSSI and a frequency error rather than the
+    // packet's RSSI and SNR, so report them as unknown rather than mislead ATP
+#if USE_MODEM_LORA
+    if (ioSpreadingFactor == RADIO_SF_FSK) {
+        rssi = 0;
+        snr = 0;
+    }
+#endif
+    radioRxEnqueue(payload, size, rssi, snr);
 
 }
 
@@ -171,10 +337,256 @@ void radioSetRFFrequency(uint32_t frequency)
     ioRFFrequency = frequency;
 }
 
-// Set the channel for transmit or receive
+// Get the frequency of a channel in the plan
+uint32_t radioChannelFrequency(uint8_t channel)
+{
+    return ioRFFrequency + ioChannelPlanHz[(channel < RADIO_CHANNELS) ? channel : 0];
+}
+
+// Set the channel for transmit or receive, which the radio retains until it is set up again
 void radioSetChannel()
 {
-    Radio.SetChannel(ioRFFrequency);
+    uint32_t frequency = radioChannelFrequency(ioChannel);
+    if (frequency == ioFrequency) {
+        return;
+    }
+    radioListenStop();
+    Radio.SetChannel(frequency);
+    ioFrequency = frequency;
+}
+
+// Select the channel within the plan to be used by radioSetChannel(), where 0 is the home channel
+void radioSetChannelIndex(uint8_t channel)
+{
+    ioChannel = (channel < RADIO_CHANNELS) ? channel : 0;
+}
+
+// Get the currently-selected channel
+uint8_t radioChannelIndex()
+{
+    return ioChannel;
+}
+
+// Get the number of channels in the plan
+uint8_t radioChannels()
+{
+    return RADIO_CHANNELS;
+}
+
+// Sample the noise on each channel of the plan during one of the gateway's idle gaps, at most
+// once per survey period, folding each sample into that channel's noise floor.  The floor
+// falls quickly and rises slowly, so that a frame which happens to be in the air as we sample
+// barely moves it while an interferer that stays on the channel soon shows.  The receiver is
+// left stopped on the last channel, and is set up again by the next receive.
+void radioNoiseSurvey()
+{
+    if (RADIO_CHANNELS <= 1 || !ioRxListening || rxQueuePut != rxQueueTake) {
+        return;
+    }
+    int64_t now = TIMER_IF_GetTimeMs();
+    if (ioNoiseSurveyedMs != 0 && now - ioNoiseSurveyedMs < (RADIO_NOISE_SURVEY_SECS*1000)) {
+        return;
+    }
+    ioNoiseSurveyedMs = now;
+    radioListenStop();
+    for (uint8_t c=0; c<RADIO_CHANNELS; c++) {
+        ioFrequency = radioChannelFrequency(c);
+        Radio.SetChannel(ioFrequency);
+        Radio.Rx(0);
+        HAL_Delay(RADIO_NOISE_SETTLE_MS);
+        int16_t sample = Radio.Rssi(MODEM_LORA) * 16;
+        Radio.Standby();
+        if (!ioNoiseKnown[c]) {
+            ioNoiseFloor[c] = sample;
+            ioNoiseKnown[c] = true;
+        } else if (sample < ioNoiseFloor[c]) {
+            ioNoiseFloor[c] += (sample - ioNoiseFloor[c]) / 2;
+        } else {
+            ioNoiseFloor[c] += (sample - ioNoiseFloor[c]) / 8;
+        }
+    }
+
+    // Report when the channels that we'll assign have changed
+    uint32_t quiet = radioNoiseQuiet();
+    if (quiet != ioNoiseQuietMask) {
+        ioNoiseQuietMask = quiet;
+        for (uint8_t c=0; c<RADIO_CHANNELS; c++) {
+            APP_PRINTF("radio: channel %d noise floor %ddBm%s\r\n", c, ioNoiseFloor[c] / 16,
+                       ((quiet & (1U << c)) != 0) ? "" : " (avoided)");
+        }
+    }
+
+}
+
+// Get the mask of the channels whose noise floor is within the margin of the quietest, where
+// a channel not yet surveyed counts as quiet
+static uint32_t radioNoiseQuiet()
+{
+    int16_t quietest = INT16_MAX;
+    for (uint8_t c=0; c<RADIO_CHANNELS; c++) {
+        if (ioNoiseKnown[c] && ioNoiseFloor[c] < quietest) {
+            quietest = ioNoiseFloor[c];
+        }
+    }
+    uint32_t mask = 0;
+    for (uint8_t c=0; c<RADIO_CHANNELS && c<32; c++) {
+        if (!ioNoiseKnown[c] || ioNoiseFloor[c] <= quietest + (RADIO_NOISE_MARGIN_DB*16)) {
+            mask |= (1U << c);
+        }
+    }
+    return mask;
+}
+
+// Get the channel for the given slot, taking the quiet channels round-robin so that
+// adjacent slots are on different channels
+uint8_t radioSlotChannel(uint32_t slot)
+{
+    uint32_t quiet = radioNoiseQuiet();
+    uint32_t count = 0;
+    for (uint8_t c=0; c<RADIO_CHANNELS && c<32; c++) {
+        if ((quiet & (1U << c)) != 0) {
+            count++;
+        }
+    }
+    if (count == 0) {
+        return 0;
+    }
+    uint32_t n = slot % count;
+    for (uint8_t c=0; c<RADIO_CHANNELS && c<32; c++) {
+        if ((quiet & (1U << c)) != 0 && n-- == 0) {
+            return c;
+        }
+    }
+    return 0;
+}
+
+// Get the time on air of a packet of the specified size at the current spreading factor
+uint32_t radioTimeOnAirMs(uint8_t size)
+{
+#if USE_MODEM_LORA
+    if (ioSpreadingFactor != RADIO_SF_FSK) {
+        return Radio.TimeOnAir(MODEM_LORA, LORA_BANDWIDTH, ioSpreadingFactor, ioCodingRate,
+                               LORA_PREAMBLE_LENGTH, LORA_FIX_LENGTH_PAYLOAD_ON || ioImplicitLen != 0, size, true);
+    }
+#endif
+    return radioFskTimeOnAirMs(size);
+}
+
+// Get the time on air of a packet of the specified size as we would transmit it now,
+// including any wakeup preamble
+uint32_t radioTxTimeOnAirMs(uint8_t size)
+{
+    uint32_t ms = radioTimeOnAirMs(size);
+#if USE_MODEM_LORA
+    if (ioSpreadingFactor != RADIO_SF_FSK) {
+        ms += ((ioPreambleSymbols - LORA_PREAMBLE_LENGTH) * radioSymbolUs()) / 1000;
+    }
+#endif
+    return ms;
+}
+
+// Get the time on air of a packet of the specified size when using FSK
+static uint32_t radioFskTimeOnAirMs(uint8_t size)
+{
+    return Radio.TimeOnAir(MODEM_FSK, FSK_BANDWIDTH, FSK_DATARATE, 0,
+                           FSK_PREAMBLE_LENGTH, FSK_FIX_LENGTH_PAYLOAD_ON, size, true);
+}
+
+// Get the time on air of a packet of the specified size for an entry of the airtime tables
+static uint32_t radioAirtimeEntryMs(uint32_t entry, uint8_t size)
+{
+#if USE_MODEM_LORA
+    if (entry != RADIO_AIRTIME_FSK) {
+        return Radio.TimeOnAir(MODEM_LORA, LORA_BANDWIDTH, RADIO_SF_MIN+entry, LORA_CODINGRATE,
+                               LORA_PREAMBLE_LENGTH, LORA_FIX_LENGTH_PAYLOAD_ON, size, true);
+    }
+#endif
+    return radioFskTimeOnAirMs(size);
+}
+
+// Compute the chunk size at every spreading factor, and the time on air of messages
+// carrying a chunk of that size and of full-size ACKs
+static void radioAirtimeInit()
+{
+    uint8_t headerLen = sizeof(wireMessageCarrier) - MESSAGE_MAX_BODY;
+    uint8_t ackLen = headerLen + sizeof(gatewayAckBody);
+    for (uint32_t i=0; i<=RADIO_AIRTIME_FSK; i++) {
+        uint8_t chunkLen = MESSAGE_MAX_BODY;
+        while (chunkLen > MESSAGE_MIN_CHUNK && radioAirtimeEntryMs(i, headerLen + chunkLen) > MESSAGE_MAX_AIRTIME_MS) {
+            chunkLen--;
+        }
+        airtimeChunkLen[i] = chunkLen;
+        airtimeMessageMs[i] = radioAirtimeEntryMs(i, headerLen + chunkLen);
+        airtimeAckMs[i] = radioAirtimeEntryMs(i, ackLen);
+    }
+    airtimeComputed = true;
+}
+
+// Map a spreading factor, where 0 means the one in use, to an index into the airtime tables
+static uint32_t radioAirtimeIndex(uint8_t sf)
+{
+    if (!airtimeComputed) {
+        radioAirtimeInit();
+    }
+#if USE_MODEM_LORA
+    if (sf == 0) {
+        sf = ioSpreadingFactor;
+    }
+    if (sf == RADIO_SF_FSK) {
+        return RADIO_AIRTIME_FSK;
+    }
+#endif
+    if (sf < RADIO_SF_MIN || sf > RADIO_SF_MAX) {
+        sf = RADIO_SF_MAX;
+    }
+    return sf - RADIO_SF_MIN;
+}
+
+// Scale a time on air from the tables, which are at LORA_CODINGRATE, to the coding rate in use
+static uint32_t radioCodingRateScaledMs(uint8_t sf, uint32_t ms)
+{
+#if USE_MODEM_LORA
+    if (sf == 0 && ioSpreadingFactor != RADIO_SF_FSK && ioCodingRate != LORA_CODINGRATE) {
+        return (ms * (4 + ioCodingRate)) / (4 + LORA_CODINGRATE);
+    }
+#endif
+    return ms;
+}
+
+// Get the time on air of a full-size message at the specified spreading factor (0 for current)
+uint32_t radioMessageTimeOnAirMs(uint8_t sf)
+{
+    return radioCodingRateScaledMs(sf, airtimeMessageMs[radioAirtimeIndex(sf)]);
+}
+
+// Get the largest chunk of a request or response that may be sent in one message at the
+// specified spreading factor (0 for current)
+uint8_t radioChunkLen(uint8_t sf)
+{
+    return airtimeChunkLen[radioAirtimeIndex(sf)];
+}
+
+// Get the time on air of a full-size ACK at the specified spreading factor (0 for current)
+uint32_t radioAckTimeOnAirMs(uint8_t sf)
+{
+    return radioCodingRateScaledMs(sf, airtimeAckMs[radioAirtimeIndex(sf)]);
+}
+
+// Get how long to wait for a reply from a peer that needs the specified time to prepare it
+uint32_t radioReplyTimeoutMs(uint32_t marginMs)
+{
+    return radioWakeupRequiredMs() + RADIO_TURNAROUND_ALLOWANCE_MS + radioMessageTimeOnAirMs(0) + marginMs;
+}
+
+// Display the airtime table
+void radioShowAirtime()
+{
+    for (int sf=RADIO_SF_MIN; sf<=RADIO_SF_MAX; sf++) {
+        APP_PRINTF("radio: SF%d chunk %d message %dms ack %dms\r\n", sf, radioChunkLen(sf), radioMessageTimeOnAirMs(sf), radioAckTimeOnAirMs(sf));
+    }
+#if LORA_ADAPTIVE_FSK
+    APP_PRINTF("radio: FSK chunk %d message %dms ack %dms\r\n", radioChunkLen(RADIO_SF_FSK), radioMessageTimeOnAirMs(RADIO_SF_FSK), radioAckTimeOnAirMs(RADIO_SF_FSK));
+#endif
 }
 
 // Get the amount of time necessary to come out of sleep
@@ -186,40 +598,679 @@ uint32_t radioWakeupRequiredMs()
 // Start a receive
 void radioRx(uint32_t timeoutMs)
 {
+    PROF_MARK_END("rxdone-to-rx");
+    radioSniffStop();
     radioDeepWake();
+    radioSetSyncWord(appRadioSyncWord(false));
+    radioSetHeaderMode(ioImplicitNextLen);
+    ioImplicitNextLen = 0;
+    if (radioRxIsContinuous()) {
+        radioRxContinuous(timeoutMs);
+        return;
+    }
+    ioRxWaiting = true;
+    ioRxBeganMs = TIMER_IF_GetTimeMs();
     Radio.Rx(timeoutMs);
     radioIOPending = true;
+    statsRadioListening(true);
+}
+
+// See whether receives are continuous, which is only worthwhile for the gateway and for a
+// relay, because any other sensor only ever expects a reply from the one peer that it just sent to
+static bool radioRxIsContinuous()
+{
+    return ((appIsGateway || SENSOR_RELAY) && RADIO_RX_QUEUE_FRAMES > 0);
+}
+
+// Wait for the next frame, leaving the receiver running if it already is so that nothing
+// sent while we were busy is missed.  The timeout is ours rather than the radio's because
+// the receive itself never ends.
+static void radioRxContinuous(uint32_t timeoutMs)
+{
+    if (!ioRxTimerCreated) {
+        UTIL_TIMER_Create(&ioRxTimer, 0xFFFFFFFFU, UTIL_TIMER_ONESHOT, radioRxTimeoutEvent, NULL);
+        ioRxTimerCreated = true;
+    }
+    if (!ioRxListening) {
+        Radio.Rx(0);
+        ioRxListening = true;
+        radioIOPending = true;
+        statsRadioListening(true);
+    }
+    UTIL_TIMER_Stop(&ioRxTimer);
+    UTIL_TIMER_SetPeriod(&ioRxTimer, timeoutMs);
+    UTIL_TIMER_Start(&ioRxTimer);
+    ioRxWaiting = true;
+    if (rxQueuePut != rxQueueTake) {
+        UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Radio_Received), CFG_SEQ_Prio_Radio);
+    }
+}
+
+// Queue a received frame, which is called only from the radio ISR.  A frame too large to be
+// ours is queued as empty so that the receive still completes.  When the queue is full the
+// new frame is dropped, just as it would have been missed if we hadn't been listening.
+static void radioRxEnqueue(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr)
+{
+    uint32_t put = rxQueuePut;
+    if (put - rxQueueTake >= RADIO_RX_QUEUE_FRAMES) {
+        rxQueueOverflows++;
+        return;
+    }
+    radioRxFrame *frame = &rxQueue[put % RADIO_RX_QUEUE_FRAMES];
+    frame->receivedMs = TIMER_IF_GetTimeMs();
+    frame->len = (size > sizeof(wireMessageCarrier)) ? 0 : (uint8_t) size;
+    frame->rssi = (int8_t) rssi;
+    frame->snr = snr;
+    memcpy(frame->data, payload, frame->len);
+    __DMB();
+    rxQueuePut = put + 1;
+    if (ioRxWaiting) {
+        UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Radio_Received), CFG_SEQ_Prio_Radio);
+    }
+}
+
+// Sequencer task that hands the oldest queued frame to the state machine if it is waiting,
+// discarding frames that have waited so long that their sender no longer expects a reply
+void radioReceivedTask()
+{
+    if (!ioRxWaiting) {
+        return;
+    }
+    int64_t nowMs = TIMER_IF_GetTimeMs();
+    uint32_t take = rxQueueTake;
+    uint32_t stale = 0;
+    while (radioRxIsContinuous() && take != rxQueuePut && (nowMs - rxQueue[take % RADIO_RX_QUEUE_FRAMES].receivedMs) > RADIO_RX_QUEUE_MAX_AGE_MS) {
+        radioCaptureFrame(&rxQueue[take % RADIO_RX_QUEUE_FRAMES]);
+        take++;
+        stale++;
+    }
+    if (take == rxQueuePut) {
+        rxQueueTake = take;
+        return;
+    }
+    radioRxFrame *frame = &rxQueue[take % RADIO_RX_QUEUE_FRAMES];
+    radioCaptureFrame(frame);
+    memcpy(&wireReceivedCarrier, frame->data, frame->len);
+    wireReceivedLen = frame->len;
+    wireReceiveRSSI = frame->rssi;
+    wireReceiveSNR = frame->snr;
+    wireReceiveSignalValid = true;
+    rxReceivedMs = frame->receivedMs;
+    __DMB();
+    rxQueueTake = take + 1;
+    ioRxWaiting = false;
+
+    if (ioRxTimerCreated) {
+        UTIL_TIMER_Stop(&ioRxTimer);
+    }
+    uint32_t overflows = rxQueueOverflows;
+    if (stale != 0 || overflows != rxQueueOverflowsReported) {
+        APP_PRINTF("radio: %d received frames dropped\r\n", stale + (overflows - rxQueueOverflowsReported));
+        rxQueueOverflowsReported = overflows;
+    }
+    ledIndicateReceiveInProgress(false);
+    appSetCoreState(RX);
+}
+
+// Turn the capture of received frames to the console on or off
+void radioCapture(bool on)
+{
+    captureOn = on;
+    captureLastMs = 0;
+}
+
+// Trace a received frame as the console commands that replay it, with its delay after the
+// last frame captured
+static void radioCaptureFrame(radioRxFrame *frame)
+{
+    if (!captureOn) {
+        return;
+    }
+    for (uint32_t i=0; i<frame->len; i+=RADIO_REPLAY_LINE_BYTES) {
+        char hex[(RADIO_REPLAY_LINE_BYTES*2)+1];
+        uint32_t n = (frame->len - i > RADIO_REPLAY_LINE_BYTES) ? RADIO_REPLAY_LINE_BYTES : frame->len - i;
+        for (uint32_t j=0; j<n; j++) {
+            utilHTOA8(frame->data[i+j], &hex[j*2]);
+        }
+        hex[n*2] = '\0';
+        APP_PRINTF("rx+ %s\r\n", hex);
+    }
+    uint32_t delayMs = (captureLastMs == 0) ? 0 : (uint32_t) (frame->receivedMs - captureLastMs);
+    captureLastMs = frame->receivedMs;
+    APP_PRINTF("rx %d %d %d\r\n", delayMs, frame->rssi, frame->snr);
+}
+
+// Append hex to the frame being staged for replay, returning false if it is malformed or
+// if the frame would be too large
+bool radioReplayAppend(const char *hex)
+{
+    for (; hex[0] != '\0' && hex[1] != '\0'; hex += 2) {
+        int hi = utilHexDigit(hex[0]);
+        int lo = utilHexDigit(hex[1]);
+        if (hi < 0 || lo < 0 || replayStaged.len >= sizeof(replayStaged.data)) {
+            replayStaged.len = 0;
+            return false;
+        }
+        replayStaged.data[replayStaged.len++] = (uint8_t) ((hi << 4) | lo);
+    }
+    return (hex[0] == '\0');
+}
+
+// Queue the staged frame to be received after the given delay following the last frame
+// replayed, returning false if the queue is full
+bool radioReplayQueue(uint32_t delayMs, int8_t rssi, int8_t snr)
+{
+    if (replayPut - replayTake >= RADIO_REPLAY_FRAMES) {
+        return false;
+    }
+    radioRxFrame *frame = &replayQueue[replayPut % RADIO_REPLAY_FRAMES];
+    memcpy(frame, &replayStaged, sizeof(replayStaged));
+    frame->receivedMs = delayMs;
+    frame->rssi = rssi;
+    frame->snr = snr;
+    replayStaged.len = 0;
+    __DMB();
+    replayPut++;
+    if (!replayTimerCreated) {
+        UTIL_TIMER_Create(&replayTimer, 0, UTIL_TIMER_ONESHOT, radioReplayEvent, NULL);
+        replayTimerCreated = true;
+    }
+    radioReplayKick();
+    return true;
+}
+
+// Receive the queued frames that are due just as OnRxDone would, and wait for the next,
+// where a frame whose time has already passed is received at once
+static void radioReplayKick()
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    UTIL_TIMER_Stop(&replayTimer);
+    while (replayTake != replayPut) {
+        radioRxFrame *frame = &replayQueue[replayTake % RADIO_REPLAY_FRAMES];
+        int64_t nowMs = TIMER_IF_GetTimeMs();
+        int64_t dueMs = replayLastMs + frame->receivedMs;
+        if (replayLastMs != 0 && dueMs > nowMs) {
+            UTIL_TIMER_SetPeriod(&replayTimer, (uint32_t) (dueMs - nowMs));
+            UTIL_TIMER_Start(&replayTimer);
+            break;
+        }
+        radioRxEnqueue(frame->data, frame->len, frame->rssi, frame->snr);
+        replayLastMs = nowMs;
+        replayTake++;
+    }
+    __set_PRIMASK(primask);
+}
+
+// Timer event for the next replayed frame
+static void radioReplayEvent(void *context)
+{
+    radioReplayKick();
+}
+
+// When the frame last handed to the state machine was received
+int64_t radioReceivedMs()
+{
+    return rxReceivedMs;
+}
+
+// Timer event for the end of a continuous receive's wait, which leaves the receiver running
+static void radioRxTimeoutEvent(void *context)
+{
+    if (!ioRxWaiting) {
+        return;
+    }
+    ioRxWaiting = false;
+    wireReceivedLen = 0;
+    ledIndicateReceiveInProgress(false);
+    appSetCoreState(RX_TIMEOUT);
+}
+
+// Get the number of received frames waiting to be handed to the state machine
+uint32_t radioRxQueued()
+{
+    return rxQueuePut - rxQueueTake;
+}
+
+// Take the count of frames that were heard garbled while listening continuously, along with
+// how long ago the most recent of them was
+uint32_t radioRxErrorsTake(uint32_t *agoMs)
+{
+    uint32_t errors = ioRxListenErrors;
+    ioRxListenErrors -= errors;
+    *agoMs = (errors == 0) ? 0 : (uint32_t) (TIMER_IF_GetTimeMs() - ioRxListenErrorMs);
+    return errors;
+}
+
+// Stop listening continuously before the radio is used or reconfigured for anything else,
+// keeping whatever is queued for the next receive
+static void radioListenStop()
+{
+    ioRxWaiting = false;
+    if (ioRxTimerCreated) {
+        UTIL_TIMER_Stop(&ioRxTimer);
+    }
+    if (ioRxListening) {
+        ioRxListening = false;
+        radioIOPending = false;
+        Radio.Standby();
+        statsRadioListening(false);
+    }
+}
+
+// Sample the channel for a few symbols to see if anyone is transmitting at our spreading
+// factor, returning false if CAD isn't possible because we aren't using LoRa
+bool radioCad()
+{
+#if USE_MODEM_LORA
+    if (ioSpreadingFactor == RADIO_SF_FSK) {
+        return false;
+    }
+    // Detection peak thresholds for a 4-symbol CAD, indexed by bandwidth and then by SF7..SF12.
+    // Semtech AN1200.48 gives those for 125 and 500 kHz, and those for 250 kHz lie between them,
+    // rounded up so that noise isn't taken for a transmission.
+    static const uint8_t cadDetPeak[3][RADIO_SF_MAX-RADIO_SF_MIN+1] = {
+        { 22, 22, 23, 24, 25, 28 },
+        { 22, 22, 23, 24, 25, 29 },
+        { 21, 22, 22, 23, 25, 29 },
+    };
+    _Static_assert(LORA_BANDWIDTH < 3, "no CAD thresholds for LORA_BANDWIDTH");
+    if (ioSpreadingFactor < RADIO_SF_MIN || ioSpreadingFactor > RADIO_SF_MAX) {
+        return false;
+    }
+    radioSniffStop();
+    radioDeepWake();
+    radioListenStop();
+    radioSetHeaderMode(0);
+    radioCadActivityDetected = false;
+    SUBGRF_SetCadParams(LORA_CAD_04_SYMBOL, cadDetPeak[LORA_BANDWIDTH][ioSpreadingFactor-RADIO_SF_MIN], LORA_CAD_DET_MIN, LORA_CAD_ONLY, 0);
+    RBI_ConfigRFSwitch(RBI_SWITCH_RX);
+    Radio.StartCad();
+    radioIOPending = true;
+    statsRadioListening(true);
+    return true;
+#else
+    return false;
+#endif
 }
 
 // Transmit
 void radioTx(uint8_t *buffer, uint8_t size)
 {
+    radioSniffStop();
     radioDeepWake();
+    radioListenStop();
+    radioSetHeaderMode(ioImplicitNextLen);
+    ioImplicitNextLen = 0;
+    radioSetSyncWord((ioImplicitLen != 0) ? appRadioSyncWord(false) : appRadioSyncWord(((wireMessageCarrier *) buffer)->Algorithm == MESSAGE_ALG_CLEAR));
+    statsRadioListening(false);
+    dutyCharge(radioChannelFrequency(ioChannel), radioTxTimeOnAirMs(size));
+    if (!appIsGateway) {
+        schedChargeTransmit(sensorRadioApp(), radioTxTimeOnAirMs(size), ioTxPowerDb);
+    }
     Radio.Send(buffer, size);
     radioIOPending = true;
 }
 
+// Listen in the radio's duty-cycled receive mode, in which it wakes for a few symbols each
+// sniff period and stays awake only if it detects a preamble.  This catches a message sent
+// with the wakeup preamble, and completes as an ordinary receive.  Returns false if disabled.
+bool radioSniff()
+{
+#if USE_MODEM_LORA
+    uint32_t rxUs = RADIO_SNIFF_RX_SYMBOLS * radioSymbolUs();
+    uint32_t periodUs = RADIO_SNIFF_PERIOD_MS * 1000;
+    if (rxUs >= periodUs) {
+        return false;
+    }
+    radioDeepWake();
+    radioListenStop();
+    radioSetHeaderMode(0);
+    radioSetSyncWord(appRadioSyncWord(false));
+    SUBGRF_SetDioIrqParams(IRQ_RADIO_ALL, IRQ_RADIO_ALL, IRQ_RADIO_NONE, IRQ_RADIO_NONE);
+    // Duty cycle periods are in units of 15.625us
+    ioRxWaiting = true;
+    Radio.SetRxDutyCycle((rxUs*64)/1000, ((periodUs-rxUs)*64)/1000);
+    ioSniffing = true;
+    radioIOPending = true;
+    statsRadioListening(true);
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Listen continuously on the home channel for frames to relay, which complete as receives begun
+// by radioSniff() do so that they're handled between exchanges in the same way.  Returns false
+// if this sensor isn't a relay.
+bool radioRelayListen()
+{
+    if (!SENSOR_RELAY || appIsGateway || !radioRxIsContinuous()) {
+        return false;
+    }
+    radioSniffStop();
+    radioDeepWake();
+    radioSetSyncWord(appRadioSyncWord(false));
+    radioSetHeaderMode(0);
+    ioImplicitNextLen = 0;
+    radioSetChannelIndex(0);
+    radioSetChannel();
+    radioRxContinuous(UNSOLICITED_RX_TIMEOUT_VALUE);
+    ioRelayListening = true;
+    return true;
+}
+
+// See whether the last receive was begun by radioSniff() or radioRelayListen()
+bool radioIsSniffing()
+{
+    return ioSniffing || ioRelayListening;
+}
+
+// Set the LoRa sync word, in which each nibble of the one-byte form is followed by the
+// nibble 4 in the radio's two-byte register (so that 0x12 is written as 0x1424)
+void radioSetSyncWord(uint8_t syncWord)
+{
+#if USE_MODEM_LORA
+    if (syncWord == ioSyncWord) {
+        return;
+    }
+    radioListenStop();
+    SUBGRF_WriteRegister(REG_LR_SYNCWORD, (syncWord & 0xF0) | 0x04);
+    SUBGRF_WriteRegister(REG_LR_SYNCWORD + 1, ((syncWord & 0x0F) << 4) | 0x04);
+    ioSyncWord = syncWord;
+#endif
+}
+
+// Leave duty-cycled receive mode before beginning other I/O, or stop treating what the
+// continuous receiver hears as heard while listening for frames to relay
+static void radioSniffStop()
+{
+    ioRelayListening = false;
+    if (ioSniffing) {
+        ioSniffing = false;
+        Radio.Standby();
+    }
+}
+
+// Lengthen the preamble of what we transmit so that it spans a full sniff period, which
+// guarantees that a sniffing peer will detect it.  This must be turned off again before
+// anything else is sent, because it makes every message a sniff period longer on air.
+void radioSetWakeupPreamble(bool on)
+{
+#if USE_MODEM_LORA
+    uint16_t symbols = LORA_PREAMBLE_LENGTH;
+    if (on && RADIO_SNIFF_PERIOD_MS != 0) {
+        uint32_t symbolUs = radioSymbolUs();
+        symbols += ((RADIO_SNIFF_PERIOD_MS*1000) + symbolUs - 1) / symbolUs;
+        symbols += RADIO_SNIFF_RX_SYMBOLS;
+    }
+    if (symbols == ioPreambleSymbols) {
+        return;
+    }
+    ioPreambleSymbols = symbols;
+
+    // If asleep without its configuration, the new preamble will be applied by radioInit() on wake
+    if (radioIsDeepSleep && !radioIsWarmSleep) {
+        return;
+    }
+    radioSetTxConfig();
+#endif
+}
+
+#if USE_MODEM_LORA
+// Get the duration of a symbol at the spreading factor in use
+static uint32_t radioSymbolUs()
+{
+    return ((1 << ioSpreadingFactor) * 1000000) / (125000 << LORA_BANDWIDTH);
+}
+#endif
+
 // Set last known tx power to unknown
 void radioSetTxPowerUnknown()
 {
     wireTransmitDb = 0;
 }
 
-// Set tx power
+// Get the PA that the radio driver selects for a power level, as SUBGRF_SetRfTxPower() does
+static uint8_t radioPaFor(int8_t powerLevel)
+{
+    switch (RBI_GetTxConfig()) {
+    case RBI_CONF_RFO_LP_HP:
+        return (powerLevel > 15) ? RFO_HP : RFO_LP;
+    case RBI_CONF_RFO_HP:
+        return RFO_HP;
+    default:
+        return RFO_LP;
+    }
+}
+
+#ifdef RBI_PA_TABLE
+// The board's characterized PA settings
+typedef struct {
+    int8_t dBm;
+    bool hp;
+    uint8_t paDutyCycle;
+    uint8_t hpMax;
+    int8_t powerRegister;
+    uint8_t mA;
+} radioPaSetting;
+static const radioPaSetting radioPaTable[] = RBI_PA_TABLE;
+#endif
+
+// Replace the driver's generic PA settings for a power level with the board's characterized
+// ones, using the lowest-current setting of the PA in use that delivers at least the level
+static void radioSetPaConfig(int8_t powerLevel)
+{
+#ifdef RBI_PA_TABLE
+    bool hp = (radioPaFor(powerLevel) == RFO_HP);
+    const radioPaSetting *best = NULL;
+    for (uint32_t i=0; i<sizeof(radioPaTable)/sizeof(radioPaTable[0]); i++) {
+        const radioPaSetting *s = &radioPaTable[i];
+        if (s->hp == hp && s->dBm >= powerLevel && (best == NULL || s->mA < best->mA)) {
+            best = s;
+        }
+    }
+    if (best == NULL) {
+        return;
+    }
+    int8_t powerRegister = best->powerRegister - (best->dBm - powerLevel);
+    if (powerRegister < (hp ? -9 : -17)) {
+        powerRegister = (hp ? -9 : -17);
+    }
+    SUBGRF_SetPaConfig(best->paDutyCycle, best->hpMax, hp ? 0 : 1, 1);
+    uint8_t buf[2] = { (uint8_t) powerRegister, RADIO_RAMP_40_US };
+    HAL_SUBGHZ_ExecSetCmd(&hsubghz, RADIO_SET_TXPARAMS, buf, sizeof(buf));
+#endif
+}
+
+// Set tx power.  When the driver would keep the same PA, only the PA's power is written, as
+// it is for every relayed frame, rather than the whole of the modem's tx config.
 void radioSetTxPower(int8_t powerLevel)
 {
     wireTransmitDb = powerLevel;
+    if (powerLevel == ioTxPowerDb) {
+        return;
+    }
+    bool samePa = (radioPaFor(powerLevel) == radioPaFor(ioTxPowerDb));
+    ioTxPowerDb = powerLevel;
+    if (samePa && (!radioIsDeepSleep || radioIsWarmSleep)) {
+        radioListenStop();
+        SUBGRF_SetRfTxPower(powerLevel);
+        radioSetPaConfig(powerLevel);
+        return;
+    }
+    radioSetTxConfig();
+}
+
+// Apply the current tx power and spreading factor to the radio
+static void radioSetTxConfig()
+{
+    radioListenStop();
+    if (ioSpreadingFactor == RADIO_SF_FSK) {
+        Radio.SetTxConfig(MODEM_FSK, ioTxPowerDb, FSK_FDEV, 0,
+                          FSK_DATARATE, 0,
+                          FSK_PREAMBLE_LENGTH, FSK_FIX_LENGTH_PAYLOAD_ON,
+                          true, 0, 0, 0, radioMessageTimeOnAirMs(RADIO_SF_FSK) + TX_TIMEOUT_MARGIN_MS);
+        radioSetPaConfig(ioTxPowerDb);
+        return;
+    }
+    uint32_t extraPreambleMs = ((ioPreambleSymbols - LORA_PREAMBLE_LENGTH) * radioSymbolUs()) / 1000;
     Radio.SetTxConfig(MODEM_LORA,
-                      powerLevel,                   // output power in dBm
+                      ioTxPowerDb,                  // output power in dBm
                       0,                            // unused for LoRa
                       LORA_BANDWIDTH,
-                      LORA_SPREADING_FACTOR,
-                      LORA_CODINGRATE,
-                      LORA_PREAMBLE_LENGTH,
-                      LORA_FIX_LENGTH_PAYLOAD_ON,
+                      ioSpreadingFactor,
+                      ioCodingRate,
+                      ioPreambleSymbols,
+                      LORA_FIX_LENGTH_PAYLOAD_ON || ioImplicitLen != 0,
                       true,                         // CRC on/off
                       0,                            // Frequency hopping off/on
                       0,                            // # of symbols between hops
                       LORA_IQ_INVERSION_ON,         // Invert IQ signal
-                      TX_TIMEOUT_VALUE);            // Timeout on radio.Send()
+                      radioMessageTimeOnAirMs(0) + extraPreambleMs + TX_TIMEOUT_MARGIN_MS);   // Timeout on radio.Send()
+    radioSetPaConfig(ioTxPowerDb);
+}
+
+// Apply the current spreading factor to the radio's receiver
+static void radioSetRxConfig()
+{
+    radioListenStop();
+    if (ioSpreadingFactor == RADIO_SF_FSK) {
+        Radio.SetRxConfig(MODEM_FSK, FSK_BANDWIDTH, FSK_DATARATE,
+                          0, FSK_AFC_BANDWIDTH, FSK_PREAMBLE_LENGTH,
+                          0, FSK_FIX_LENGTH_PAYLOAD_ON, 0, true,
+                          0, 0, false, radioRxIsContinuous());
+        return;
+    }
+    Radio.SetRxConfig(MODEM_LORA,
+                      LORA_BANDWIDTH,
+                      ioSpreadingFactor,
+                      ioCodingRate, 0, LORA_PREAMBLE_LENGTH,
+                      LORA_SYMBOL_TIMEOUT, LORA_FIX_LENGTH_PAYLOAD_ON || ioImplicitLen != 0,
+                      ioImplicitLen, true, 0, 0, LORA_IQ_INVERSION_ON, radioRxIsContinuous());
+}
+
+// Have the next transmit or receive use an implicit header with a payload of the given length,
+// which both ends must agree upon in advance because it isn't sent.  Only LoRa has implicit
+// headers, so at other times or with a length of 0 the radio stays with explicit headers.
+void radioImplicitHeaderNext(uint8_t len)
+{
+    ioImplicitNextLen = len;
+}
+
+// Get the payload length if the radio is using implicit headers, or 0
+uint8_t radioImplicitHeaderLen()
+{
+    return ioImplicitLen;
+}
+
+// Switch between explicit and implicit headers, for both transmit and receive because the
+// radio shares the packet parameters between them
+static void radioSetHeaderMode(uint8_t implicitLen)
+{
+#if USE_MODEM_LORA
+    if (ioSpreadingFactor == RADIO_SF_FSK) {
+        implicitLen = 0;
+    }
+    if (implicitLen == ioImplicitLen) {
+        return;
+    }
+    ioImplicitLen = implicitLen;
+    radioSetTxConfig();
+    radioSetRxConfig();
+#endif
+}
+
+// Set the spreading factor used for both tx and rx, where 0, or one outside SF7..SF12, means
+// the configured default and RADIO_SF_FSK means FSK.  Both ends of a link must agree, so this is only changed by
+// mutual agreement during a solicited exchange, and must be set back to the default before
+// listening for unsolicited messages.
+void radioSetSpreadingFactor(uint8_t sf)
+{
+#if USE_MODEM_LORA
+    if (sf == 0 || (sf == RADIO_SF_FSK && !LORA_ADAPTIVE_FSK)) {
+        sf = LORA_SPREADING_FACTOR;
+    }
+    if (sf != RADIO_SF_FSK && (sf < RADIO_SF_MIN || sf > RADIO_SF_MAX)) {
+        sf = LORA_SPREADING_FACTOR;
+    }
+    if (sf == ioSpreadingFactor) {
+        return;
+    }
+    ioSpreadingFactor = sf;
+
+    // If asleep, the new spreading factor will be applied by radioInit() on wake
+    if (radioIsDeepSleep) {
+        return;
+    }
+    radioSetTxConfig();
+    radioSetRxConfig();
+#endif
+}
+
+// Get the spreading factor currently in use
+uint8_t radioSpreadingFactor()
+{
+#if USE_MODEM_LORA
+    return ioSpreadingFactor;
+#else
+    return 0;
+#endif
+}
+
+// Set the LoRa coding rate used for both tx and rx, where 0 means the configured default.  As
+// with the spreading factor, both ends of a link must agree, so this is only changed during a
+// solicited exchange and must be set back to the default before listening for unsolicited
+// messages.
+void radioSetCodingRate(uint8_t cr)
+{
+#if USE_MODEM_LORA
+    if (cr == 0 || cr > 4) {
+        cr = LORA_CODINGRATE;
+    }
+    if (cr == ioCodingRate) {
+        return;
+    }
+    ioCodingRate = cr;
+
+    // If asleep, the new coding rate will be applied by radioInit() on wake
+    if (radioIsDeepSleep) {
+        return;
+    }
+    radioSetTxConfig();
+    radioSetRxConfig();
+#endif
+}
+
+// Get the coding rate currently in use
+uint8_t radioCodingRate()
+{
+#if USE_MODEM_LORA
+    return ioCodingRate;
+#else
+    return 0;
+#endif
+}
+
+// Get the highest coding rate at which a full-size message at the specified spreading factor
+// stays within MESSAGE_MAX_AIRTIME_MS, which is never below LORA_CODINGRATE
+uint8_t radioCodingRateMax(uint8_t sf)
+{
+#if USE_MODEM_LORA
+    if (sf == 0) {
+        sf = ioSpreadingFactor;
+    }
+    if (sf == RADIO_SF_FSK) {
+        return LORA_CODINGRATE;
+    }
+    uint8_t len = (sizeof(wireMessageCarrier) - MESSAGE_MAX_BODY) + radioChunkLen(sf);
+    uint8_t cr = 4;
+    while (cr > LORA_CODINGRATE && Radio.TimeOnAir(MODEM_LORA, LORA_BANDWIDTH, sf, cr, LORA_PREAMBLE_LENGTH,
+                                                   LORA_FIX_LENGTH_PAYLOAD_ON, len, true) > MESSAGE_MAX_AIRTIME_MS) {
+        cr--;
+    }
+    return cr;
+#else
+    return 0;
+#endif
 }
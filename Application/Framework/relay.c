@@ -0,0 +1,255 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Single-hop relaying for sensors beyond the reach of their gateway.  The operator designates a
+// mains-powered sensor built with SENSOR_RELAY as the relay of a far sensor by setting the
+// "relay" field of the far sensor's note in the gateway's config DB, and the gateway then names
+// the relay in its full ACKs.  The far sensor addresses its full-header frames to the relay,
+// which listens continuously between its own exchanges and repeats each such frame to the
+// gateway as soon as it has heard it, marked with MESSAGE_ALG_RELAYED and followed by its own
+// view of the far sensor's signal.  Frames that the gateway sends to the far sensor are repeated
+// back to it in the same way.  The relay neither decrypts nor holds anything, so the exchange
+// runs end to end within the far sensor's slot, which the gateway lengthens to cover both hops.
+// A far sensor whose exchange fails switches between its relay and the gateway until one works.
+
+#include "framework.h"
+
+// The far sensors whose frames we've recently relayed, so that we know which of the gateway's
+// frames to relay back to them
+typedef struct {
+    uint8_t address[ADDRESS_LEN];
+    int64_t heardMs;
+} relayPeer;
+static relayPeer relayPeers[RELAY_PEERS_MAX];
+static uint8_t relayFrame[sizeof(wireMessageCarrier)];
+static bool relayTransmitPending = false;
+
+// On a far sensor, the relay that the gateway told us to use, and whether we're using it
+static uint8_t relayAddress[ADDRESS_LEN];
+static bool relayKnown = false;
+static bool relayUsing = false;
+
+// On the gateway, the relays designated for far sensors
+typedef struct {
+    uint8_t sensorAddress[ADDRESS_LEN];
+    uint8_t relayAddress[ADDRESS_LEN];
+} relayDesignation;
+static relayDesignation relayDesignations[GATEWAY_RELAYS_MAX];
+static uint32_t relayDesignationCount = 0;
+
+// Forwards
+static relayPeer *relayPeerFind(uint8_t *address, int64_t nowMs);
+static void relayPeerHeard(uint8_t *address, int64_t nowMs);
+
+// Find a far sensor that we've relayed for within RELAY_PEER_SECS
+static relayPeer *relayPeerFind(uint8_t *address, int64_t nowMs)
+{
+    for (int i=0; i<RELAY_PEERS_MAX; i++) {
+        if (relayPeers[i].heardMs != 0 && nowMs - relayPeers[i].heardMs < (RELAY_PEER_SECS*1000)
+                && memcmp(relayPeers[i].address, address, ADDRESS_LEN) == 0) {
+            return &relayPeers[i];
+        }
+    }
+    return NULL;
+}
+
+// Note that we've just relayed for a far sensor, replacing the one that we heard least recently
+static void relayPeerHeard(uint8_t *address, int64_t nowMs)
+{
+    relayPeer *peer = relayPeerFind(address, nowMs);
+    if (peer == NULL) {
+        peer = &relayPeers[0];
+        for (int i=1; i<RELAY_PEERS_MAX; i++) {
+            if (relayPeers[i].heardMs < peer->heardMs) {
+                peer = &relayPeers[i];
+            }
+        }
+        memcpy(peer->address, address, ADDRESS_LEN);
+    }
+    peer->heardMs = nowMs;
+}
+
+// Repeat the frame just heard between exchanges if it's one that we relay, returning true if
+// it's being transmitted, in which case relayTransmitDone() is to be called when that completes
+bool relayFrameReceived()
+{
+    wireMessageCarrier *carrier = &wireReceivedCarrier;
+    uint32_t headerLen = sizeof(wireMessageCarrier) - sizeof(wireMessage);
+    if (!SENSOR_RELAY || appIsGateway || wireReceivedLen < headerLen
+            || carrier->Version != MESSAGE_VERSION || carrier->Algorithm != MESSAGE_ALG_CTR
+            || headerLen + carrier->MessageLen != wireReceivedLen) {
+        return false;
+    }
+
+    // A far sensor's frame to us goes on to the gateway, along with how well we heard it, and
+    // the gateway's frame to a far sensor that we've recently relayed for goes back to it
+    int64_t nowMs = TIMER_IF_GetTimeMs();
+    uint32_t len = wireReceivedLen;
+    bool uplink;
+    if (memcmp(carrier->Receiver, ourAddress, ADDRESS_LEN) == 0
+            && memcmp(carrier->Sender, gatewayAddress, ADDRESS_LEN) != 0
+            && memcmp(carrier->Sender, ourAddress, ADDRESS_LEN) != 0) {
+        uplink = true;
+        relayPeerHeard(carrier->Sender, nowMs);
+        memcpy(relayFrame, carrier, len);
+        memcpy(((wireMessageCarrier *) relayFrame)->Receiver, gatewayAddress, ADDRESS_LEN);
+        if (len + sizeof(wireRelayTrailer) <= sizeof(relayFrame)) {
+            wireRelayTrailer trailer;
+            trailer.RSSI = wireReceiveRSSI;
+            trailer.SNR = wireReceiveSNR;
+            memcpy(&relayFrame[len], &trailer, sizeof(trailer));
+            len += sizeof(trailer);
+        }
+    } else if (memcmp(carrier->Sender, gatewayAddress, ADDRESS_LEN) == 0
+               && relayPeerFind(carrier->Receiver, nowMs) != NULL) {
+        uplink = false;
+        memcpy(relayFrame, carrier, len);
+    } else {
+        return false;
+    }
+    ((wireMessageCarrier *) relayFrame)->Algorithm |= MESSAGE_ALG_RELAYED;
+
+    // Repeat it at full power, on the home channel at the default spreading factor on which
+    // we're listening
+    TRACE_EVENT(TRACE_RADIO, VLEVEL_L, uplink ? "relaying to gateway" : "relaying to sensor",
+                {"len", len}, {"rssi", wireReceiveRSSI}, {"snr", wireReceiveSNR});
+    radioSetTxPower(RBO_MAX);
+    relayTransmitPending = true;
+    radioTx(relayFrame, (uint8_t) len);
+    return true;
+
+}
+
+// Complete the transmit of a relayed frame, returning false if what completed wasn't one
+bool relayTransmitDone()
+{
+    if (!relayTransmitPending) {
+        return false;
+    }
+    relayTransmitPending = false;
+    radioSetTxPower(atpPowerLevel());
+    return true;
+}
+
+// Abandon the relayed frame being transmitted, because our own exchange is beginning
+void relayCancel()
+{
+    if (relayTransmitDone()) {
+        APP_PRINTF("relay: transmit abandoned for our own exchange\r\n");
+    }
+}
+
+// On a far sensor, load the relay that the gateway last told us to use
+void relayInit()
+{
+    relayKnown = flashConfigFindPeerByType(PEER_TYPE_RELAY, relayAddress, NULL, NULL);
+    relayUsing = relayKnown;
+}
+
+// On a far sensor, adopt the relay named in a full ACK, or all zeros if we are to reach the
+// gateway directly.  A relay that is unchanged leaves us sending however we were.
+void relaySetVia(uint8_t *address)
+{
+    bool known = (memcmp(address, invalidAddress, ADDRESS_LEN) != 0);
+    if (known == relayKnown && (!known || memcmp(address, relayAddress, ADDRESS_LEN) == 0)) {
+        return;
+    }
+    uint8_t noKey[AES_KEY_BYTES] = {0};
+    if (relayKnown) {
+        flashConfigSetPeer(0, relayAddress, noKey);
+    }
+    if (known) {
+        memcpy(relayAddress, address, ADDRESS_LEN);
+        flashConfigSetPeer(PEER_TYPE_RELAY, relayAddress, noKey);
+    }
+    flashConfigUpdate();
+    relayKnown = relayUsing = known;
+    char text[40];
+    utilAddressToText(address, text, sizeof(text));
+    APP_PRINTF("relay: %s\r\n", known ? text : "none");
+}
+
+// On a far sensor, get the relay through which to reach the gateway, or NULL if reaching it directly
+uint8_t *relayVia()
+{
+    return (relayKnown && relayUsing) ? relayAddress : NULL;
+}
+
+// On a far sensor, switch between the relay and the gateway after an exchange has failed
+void relayLinkFailed()
+{
+    if (!relayKnown) {
+        return;
+    }
+    relayUsing = !relayUsing;
+    APP_PRINTF("relay: now trying the %s\r\n", relayUsing ? "relay" : "gateway directly");
+}
+
+// On a far sensor, the further time that a frame and its reply take when relayed
+uint32_t relayHopMs()
+{
+    if (relayVia() == NULL) {
+        return 0;
+    }
+    return RADIO_TURNAROUND_ALLOWANCE_MS + radioMessageTimeOnAirMs(0);
+}
+
+// On the gateway, forget the designations before they are reloaded from the config DB
+void relayDesignationsClear()
+{
+    relayDesignationCount = 0;
+}
+
+// On the gateway, forget the designation of a sensor whose config DB note has changed
+void relayDesignationRemove(uint8_t *sensorAddress)
+{
+    for (uint32_t i=0; i<relayDesignationCount; i++) {
+        if (memcmp(relayDesignations[i].sensorAddress, sensorAddress, ADDRESS_LEN) == 0) {
+            relayDesignations[i] = relayDesignations[--relayDesignationCount];
+            return;
+        }
+    }
+}
+
+// On the gateway, designate the relay of a far sensor, returning false if there's no room
+bool relayDesignate(uint8_t *sensorAddress, uint8_t *relay)
+{
+    if (relayDesignationCount >= GATEWAY_RELAYS_MAX) {
+        return false;
+    }
+    memcpy(relayDesignations[relayDesignationCount].sensorAddress, sensorAddress, ADDRESS_LEN);
+    memcpy(relayDesignations[relayDesignationCount].relayAddress, relay, ADDRESS_LEN);
+    relayDesignationCount++;
+    return true;
+}
+
+// On the gateway, find the relay designated for a sensor, returning false if it has none
+bool relayDesignatedFor(uint8_t *sensorAddress, uint8_t *retRelayAddress)
+{
+    for (uint32_t i=0; i<relayDesignationCount; i++) {
+        if (memcmp(relayDesignations[i].sensorAddress, sensorAddress, ADDRESS_LEN) == 0) {
+            if (retRelayAddress != NULL) {
+                memcpy(retRelayAddress, relayDesignations[i].relayAddress, ADDRESS_LEN);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// On the gateway, take the signal of a relayed frame to be the relay's view of the sensor,
+// which is what the sensor's power and spreading factor must suit, or as unknown if the
+// relay couldn't fit it in the frame
+void relayReceivedSignal()
+{
+    uint32_t headerLen = sizeof(wireMessageCarrier) - sizeof(wireMessage);
+    if (wireReceivedLen != headerLen + wireReceivedCarrier.MessageLen + sizeof(wireRelayTrailer)) {
+        wireReceiveSignalValid = false;
+        return;
+    }
+    wireRelayTrailer trailer;
+    memcpy(&trailer, &((uint8_t *) &wireReceivedCarrier)[wireReceivedLen - sizeof(trailer)], sizeof(trailer));
+    wireReceiveRSSI = trailer.RSSI;
+    wireReceiveSNR = trailer.SNR;
+}
@@ -3,7 +3,19 @@
 // copyright holder including that found in the LICENSE file.
 
 // App Scheduler
+#include <stdio.h>
+#include "stm32_timer.h"
 #include "framework.h"
+#include "stm32_lpm_if.h"
+
+// The radio and processor time charged to an app since it was last reported, where the
+// energy radiated is the time on air multiplied by the transmit power
+typedef struct {
+    uint32_t txMs;
+    uint32_t txMicrojoules;
+    uint32_t rxMs;
+    uint32_t awakeTicks;
+} schedCost;
 
 // Current operational state of a scheduled app
 typedef struct {
@@ -11,6 +23,7 @@ typedef struct {
     bool active;
     bool requestPending;
     bool responsePending;
+    bool requestQueued;
     uint32_t requestSentTimeValid;
     uint32_t requestSentTime;
     uint32_t activationBaseTime;
@@ -18,15 +31,78 @@ typedef struct {
     int currentState;
     int completionSuccessState;
     int completionErrorState;
+    uint32_t dueTime;           // When next due for activation, or 0 if due now
+    uint32_t activatedSeq;      // Order of last activation, for round-robin among apps due together
+    int heapIndex;              // Position in the heap, or -1 if active
+    volatile bool rekey;        // Activated from an ISR, so dueTime is stale
+    uint32_t pollAgainMs;       // Asked by the poll just made to be polled again this soon
+    int64_t awaitUntilMs;       // Not to be polled until then, or 0
+    volatile uint16_t awaitPins;    // Awaiting an interrupt on these pins, or 0
+    int awaitResumeState;       // The state to assume on the interrupt
+    schedCost cost;
 } schedAppState;
 
-static schedAppState *state = NULL;
-static schedAppConfig *config = NULL;
+// Registered apps, in fixed tables so that registration never touches the heap
+static schedAppState state[SCHED_MAX_APPS];
+static schedAppConfig config[SCHED_MAX_APPS];
 static int apps = 0;
 
+// For each EXTI line, the apps whose ISRs subscribe to it, as a bit per app ID
+#define SCHED_EXTI_LINES    16
+#if SCHED_MAX_APPS > 32
+#error "SCHED_MAX_APPS exceeds the width of the dispatch table's app masks"
+#endif
+static uint32_t pinApps[SCHED_EXTI_LINES];
+
+// The apps that are currently active, in order of activation, and the inactive apps
+// in a min-heap ordered by when they're next due.  The current app is the one whose
+// handler is being called, on whose behalf any request it makes is sent.
+static int active[SCHED_MAX_APPS];
+static int activeApps = 0;
+static int currentApp = -1;
+static int heap[SCHED_MAX_APPS];
+static int heapApps = 0;
+static uint32_t activatedSeq = 0;
+static volatile bool rekeyPending = false;
+static bool heapTimeValid = false;
+static uint32_t heapTime = 0;
+
+// Milliseconds after the last poll within which an active app polled at millisecond
+// resolution is next to be polled, or 0 if none is
+static uint32_t pollDueMs = 0;
+
+// Armed for the earliest second at which an app's pending request or response times out,
+// so that the scheduler is woken to time it out then rather than on some later wakeup
+static UTIL_TIMER_Object_t deadlineTimer;
+static bool deadlineTimerCreated = false;
+
+// Scale applied to the activation periods of apps that declare bounds, in 1/4ths
+static uint32_t adaptScale4 = 4;
+
+// Radio time used on no app's behalf, such as for beacons, pairing, and stored notes
+static schedCost frameworkCost;
+
+// Transmit power in hundredths of a milliwatt for each tenth of a decade of dBm
+static const uint16_t dbmHundredthsMw[10] = { 100, 126, 158, 200, 251, 316, 398, 501, 631, 794 };
+
 // Forwards
 uint32_t secsUntilDue(uint32_t alignmentBaseSecs, uint32_t nowSecs, uint32_t lastSecs, uint32_t periodSecs);
 uint32_t nextActivationDueSecs(int i);
+bool heapBefore(int a, int b);
+void heapSwap(int a, int b);
+void heapSiftUp(int pos);
+void heapSiftDown(int pos);
+void heapPush(int i);
+void heapPop(void);
+void heapRekey(int i, uint32_t now);
+void heapRebuild(uint32_t now);
+void activeRemove(int pos);
+bool schedAdaptPeriods(void);
+schedCost *schedCostOf(int appID);
+void schedChargeAwake(int appID, uint32_t beganTicks);
+void schedCostAppend(char *buf, uint32_t buflen, const char *name, schedCost *cost);
+void schedDeadlineArm(void);
+void schedDeadlineEvent(void *context);
 
 // Init the app scheduler
 void schedInit()
@@ -43,48 +119,213 @@ void schedInit()
 // Register an app to be scheduled, returning app ID (or -1 if failure)
 int schedRegisterApp(schedAppConfig *appToRegister)
 {
-    int newAppID = -1;
 
-    // Allocate a new config and state table
-    schedAppConfig *newConfig = malloc((apps+1)*sizeof(schedAppConfig));
-    if (newConfig == NULL) {
-        return newAppID;
+    // Take the next entry in the tables
+    if (apps >= SCHED_MAX_APPS) {
+        APP_PRINTF("%s *** can't register: SCHED_MAX_APPS exceeded ***\r\n", appToRegister->name);
+        return -1;
     }
-    schedAppState *newState = malloc((apps+1)*sizeof(schedAppState));
-    if (newState == NULL) {
-        free(newConfig);
-        return newAppID;
-    }
-
-    // switch to, and initialize, new config and state
-    if (apps) {
-        memcpy(newConfig, config, apps * sizeof(schedAppConfig));
-        free(config);
-        memcpy(newState, state, apps * sizeof(schedAppState));
-        free(state);
-    }
-    newAppID = apps;
-    memcpy(&newConfig[newAppID], appToRegister, sizeof(schedAppConfig));
-    config = newConfig;
-    memset(&newState[newAppID], 0, sizeof(schedAppConfig));
-    state = newState;
+    int newAppID = apps;
+    memcpy(&config[newAppID], appToRegister, sizeof(schedAppConfig));
+    memset(&state[newAppID], 0, sizeof(schedAppState));
     state[newAppID].currentState = STATE_ONCE;
     state[newAppID].completionSuccessState = STATE_UNDEFINED;
     state[newAppID].completionErrorState = STATE_UNDEFINED;
 
-    // We now have coherent config and state tables
+    // We now have coherent config and state tables, and the new app is due now
     apps++;
+    heapPush(newAppID);
+
+    // Subscribe its ISR to its pins
+    if (config[newAppID].interruptFn != NULL) {
+        uint16_t pins = config[newAppID].interruptPins ? config[newAppID].interruptPins : 0xFFFF;
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        for (int line=0; line<SCHED_EXTI_LINES; line++) {
+            if ((pins & (1 << line)) != 0) {
+                pinApps[line] |= (1UL << newAppID);
+            }
+        }
+        __set_PRIMASK(primask);
+    }
 
     // Done
     return newAppID;
 }
 
+// Get the app whose handler is currently being called, or -1 if none
+int schedCurrentApp()
+{
+    return currentApp;
+}
+
+// The cost ledger of an app, or of the framework itself if the app is unknown
+schedCost *schedCostOf(int appID)
+{
+    if (appID < 0 || appID >= apps) {
+        return &frameworkCost;
+    }
+    return &state[appID].cost;
+}
+
+// Charge an app for the time that its handler was running.  Handlers are usually shorter
+// than an RTC tick, but because they begin at random within one the ticks that they span
+// still add up to an unbiased measure of their time.  Delays within a handler, during
+// which the processor may have been in STOP2, are charged as awake time.
+void schedChargeAwake(int appID, uint32_t beganTicks)
+{
+    schedCostOf(appID)->awakeTicks += TIMER_IF_GetTimerValue() - beganTicks;
+}
+
+// Convert a transmit power to hundredths of a mW
+uint32_t schedHundredthsMw(int8_t dBm)
+{
+    int32_t decade = (dBm >= 0) ? (dBm / 10) : -((9 - dBm) / 10);
+    uint32_t hundredthsMw = dbmHundredthsMw[dBm - (decade * 10)];
+    for (; decade > 0; decade--) {
+        hundredthsMw *= 10;
+    }
+    for (; decade < 0; decade++) {
+        hundredthsMw /= 10;
+    }
+    return hundredthsMw;
+}
+
+// Charge an app for a transmission, which may be called from an ISR
+void schedChargeTransmit(int appID, uint32_t ms, int8_t dBm)
+{
+    uint32_t hundredthsMw = schedHundredthsMw(dBm);
+    schedCost *cost = schedCostOf(appID);
+    cost->txMs += ms;
+    cost->txMicrojoules += (ms * hundredthsMw) / 100;
+}
+
+// Charge an app for time spent receiving, which may be called from an ISR
+void schedChargeReceive(int appID, uint32_t ms)
+{
+    schedCostOf(appID)->rxMs += ms;
+}
+
+// Append one ledger to a summary
+void schedCostAppend(char *buf, uint32_t buflen, const char *name, schedCost *cost)
+{
+    char text[80];
+    snprintf(text, sizeof(text), " %s tx:%lums/%lumJ rx:%lums cpu:%lums", name,
+             (unsigned long) cost->txMs, (unsigned long) (cost->txMicrojoules / 1000),
+             (unsigned long) cost->rxMs, (unsigned long) TIMER_IF_Convert_Tick2ms(cost->awakeTicks));
+    strlcat(buf, text, buflen);
+}
+
+// Append a summary of what each app and the framework have cost since the last reset to
+// the text in the buffer, optionally resetting the ledgers after it has been taken
+void schedCostSummary(char *buf, uint32_t buflen, bool reset)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    schedCost costs[SCHED_MAX_APPS+1];
+    for (int i=0; i<apps; i++) {
+        costs[i] = state[i].cost;
+        if (reset) {
+            memset(&state[i].cost, 0, sizeof(state[i].cost));
+        }
+    }
+    costs[apps] = frameworkCost;
+    if (reset) {
+        memset(&frameworkCost, 0, sizeof(frameworkCost));
+    }
+    __set_PRIMASK(primask);
+    for (int i=0; i<apps; i++) {
+        schedCostAppend(buf, buflen, config[i].name, &costs[i]);
+    }
+    schedCostAppend(buf, buflen, "framework", &costs[apps]);
+}
+
+// Append a summary of the share of time spent running and in each low-power mode since the
+// last reset, in tenths of a percent, and of what woke the processor, optionally resetting
+// the counters after they have been taken
+void schedPowerSummary(char *buf, uint32_t buflen, bool reset)
+{
+    uint16_t permille[PWR_MODES];
+    uint32_t wakes[PWR_WAKES];
+    schedPowerResidency(permille, wakes, reset);
+    char text[128];
+    snprintf(text, sizeof(text), " run:%lu.%lu%% sleep:%lu.%lu%% stop2:%lu.%lu%% off:%lu.%lu%% wakes rtc:%lu exti:%lu radio:%lu uart:%lu other:%lu",
+             (unsigned long) permille[PWR_MODE_RUN] / 10, (unsigned long) permille[PWR_MODE_RUN] % 10,
+             (unsigned long) permille[PWR_MODE_SLEEP] / 10, (unsigned long) permille[PWR_MODE_SLEEP] % 10,
+             (unsigned long) permille[PWR_MODE_STOP2] / 10, (unsigned long) permille[PWR_MODE_STOP2] % 10,
+             (unsigned long) permille[PWR_MODE_OFF] / 10, (unsigned long) permille[PWR_MODE_OFF] % 10,
+             (unsigned long) wakes[PWR_WAKE_RTC], (unsigned long) wakes[PWR_WAKE_EXTI],
+             (unsigned long) wakes[PWR_WAKE_RADIO], (unsigned long) wakes[PWR_WAKE_UART],
+             (unsigned long) wakes[PWR_WAKE_OTHER]);
+    strlcat(buf, text, buflen);
+}
+
+// Get the share of time spent in each power mode since the last reset, in tenths of a percent,
+// and how many times each source woke the processor, optionally resetting the counters.  The
+// arrays may be sized as those of the health record.
+#if PWR_MODES != COMPACT_HEALTH_MODES || PWR_WAKES != COMPACT_HEALTH_WAKES
+#error "the health record doesn't match the power modes and wake sources"
+#endif
+void schedPowerResidency(uint16_t *modePermille, uint32_t *wakes, bool reset)
+{
+    uint32_t ticks[PWR_MODES];
+    PWR_Residency(ticks, wakes, reset);
+    uint64_t totalTicks = 0;
+    for (int i=0; i<PWR_MODES; i++) {
+        totalTicks += ticks[i];
+    }
+    for (int i=0; i<PWR_MODES; i++) {
+        modePermille[i] = (totalTicks == 0) ? 0 : (uint16_t) ((((uint64_t) ticks[i]) * 1000) / totalTicks);
+    }
+}
+
+// Get what all apps and the framework together have cost since the last reset, optionally
+// resetting the ledgers after it has been taken
+void schedCostTotal(uint32_t *txMs, uint32_t *txMicrojoules, uint32_t *rxMs, uint32_t *awakeMs, bool reset)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    schedCost total = frameworkCost;
+    for (int i=0; i<apps; i++) {
+        total.txMs += state[i].cost.txMs;
+        total.txMicrojoules += state[i].cost.txMicrojoules;
+        total.rxMs += state[i].cost.rxMs;
+        total.awakeTicks += state[i].cost.awakeTicks;
+        if (reset) {
+            memset(&state[i].cost, 0, sizeof(state[i].cost));
+        }
+    }
+    if (reset) {
+        memset(&frameworkCost, 0, sizeof(frameworkCost));
+    }
+    __set_PRIMASK(primask);
+    *txMs = total.txMs;
+    *txMicrojoules = total.txMicrojoules;
+    *rxMs = total.rxMs;
+    *awakeMs = TIMER_IF_Convert_Tick2ms(total.awakeTicks);
+}
+
 // Get the name of the scheduled app
 const char *schedAppName(int appID)
 {
     return config[appID].name;
 }
 
+// Get the number of registered apps
+int schedAppCount()
+{
+    return apps;
+}
+
+// Get the priority class of an app's requests
+uint8_t schedAppPriority(int appID)
+{
+    if (appID < 0) {
+        return SCHED_PRIORITY_NORMAL;
+    }
+    return config[appID].priority;
+}
+
 // Activate ASAP, as if from an ISR
 bool schedActivateNowFromISR(int appID, bool interruptIfActive, int nextState)
 {
@@ -96,10 +337,45 @@ bool schedActivateNowFromISR(int appID, bool interruptIfActive, int nextState)
     }
     state[appID].currentState = nextState;
     state[appID].lastActivatedTime = 0;
+    state[appID].rekey = true;
+    rekeyPending = true;
+    LATENCY_ACTIVATED(appID);
     sensorTimerWakeFromISR();
     return true;
 }
 
+// From within an app's poll function, ask that it be polled again this many milliseconds
+// from now rather than after its poll period, so that it can sleep through a short wait
+// such as a sensor's conversion instead of blocking
+void schedPollAgainMs(int appID, uint32_t ms)
+{
+    state[appID].pollAgainMs = (ms == 0) ? 1 : ms;
+}
+
+// The milliseconds after the last schedPoll() within which it must be called again for an
+// app polled at millisecond resolution, or 0 if whole seconds will do
+uint32_t schedPollDueMs()
+{
+    return pollDueMs;
+}
+
+// From within an app's poll function, assume the state and don't poll the app again until
+// the milliseconds have passed
+void schedAwaitMs(int appID, uint32_t ms, int resumeState)
+{
+    schedSetState(appID, resumeState, NULL);
+    state[appID].awaitUntilMs = TIMER_IF_GetTimeMs() + (ms == 0 ? 1 : ms);
+}
+
+// From within an app's poll function, leave the app idle until an interrupt on any of the
+// pins, upon which it assumes the state and is polled
+void schedAwaitPins(int appID, uint16_t pins, int resumeState)
+{
+    schedSetState(appID, STATE_AWAITING_PIN, NULL);
+    state[appID].awaitResumeState = resumeState;
+    state[appID].awaitPins = pins;
+}
+
 // Disable this app permanently, for example in case of hardware failure
 void schedDisable(int appID)
 {
@@ -109,14 +385,40 @@ void schedDisable(int appID)
     }
 }
 
-// Dispatch the interrupt to all apps' ISRs
+// Dispatch the interrupt to the ISRs of the apps subscribed to its pins, each called once
+// and in the order registered
 void schedDispatchISR(uint16_t pins)
 {
+
+    // Resume the apps awaiting the pins
+    LATENCY_DISPATCH(pins);
+    bool resumed = false;
     for (int i=0; i<apps; i++) {
-        if (!state[i].disabled && config[i].interruptFn != NULL) {
+        if ((state[i].awaitPins & pins) != 0) {
+            state[i].awaitPins = 0;
+            state[i].currentState = state[i].awaitResumeState;
+            LATENCY_ACTIVATED(i);
+            resumed = true;
+        }
+    }
+    if (resumed) {
+        sensorTimerWakeFromISR();
+    }
+
+    // Dispatch to the ISRs
+    uint32_t subscribers = 0;
+    for (uint32_t p = pins; p != 0; p &= p - 1) {
+        subscribers |= pinApps[__CLZ(__RBIT(p))];
+    }
+    for (; subscribers != 0; subscribers &= subscribers - 1) {
+        int i = __CLZ(__RBIT(subscribers));
+        if (!state[i].disabled) {
+            uint32_t beganTicks = TIMER_IF_GetTimerValue();
             config[i].interruptFn(i, pins, config[i].appContext);
+            schedChargeAwake(i, beganTicks);
         }
     }
+    LATENCY_DISPATCH(0);
 }
 
 // Translate a state ID to a state name (reentrant)
@@ -143,6 +445,9 @@ void schedStateName(int state, char * state_name_buffer, size_t buffer_len)
     case STATE_RECEIVING_RESPONSE:
         strlcpy(state_name_buffer, "RECEIVING_RESPONSE", buffer_len);
         break;
+    case STATE_AWAITING_PIN:
+        strlcpy(state_name_buffer, "AWAITING_PIN", buffer_len);
+        break;
     default:
         JItoA(state, state_name_buffer);
         break;
@@ -166,6 +471,10 @@ void schedSetState(int appID, int newstate, const char *why)
 {
     if (state[appID].currentState != newstate) {
         state[appID].currentState = newstate;
+        TIMELINE(TIMELINE_APP, appID, newstate);
+        if (!TRACE_ON(TRACE_SCHED, VLEVEL_L)) {
+            return;
+        }
         char state_name[20];
         schedStateName(newstate, state_name, sizeof(state_name));
         APP_PRINTF("%s now %s", config[appID].name, state_name);
@@ -183,6 +492,9 @@ void schedSetCompletionState(int appID, int successstate, int errorstate)
     if (state[appID].completionSuccessState != successstate || state[appID].completionErrorState != errorstate) {
         state[appID].completionSuccessState = successstate;
         state[appID].completionErrorState = errorstate;
+        if (!TRACE_ON(TRACE_SCHED, VLEVEL_L)) {
+            return;
+        }
         char success_state_name[20], error_state_name[20];
         schedStateName(successstate, success_state_name, sizeof(success_state_name));
         schedStateName(errorstate, error_state_name, sizeof(error_state_name));
@@ -191,68 +503,138 @@ void schedSetCompletionState(int appID, int successstate, int errorstate)
     }
 }
 
-// Note that we're sending a request, so we can change the state
-void schedSendingRequest(bool responseRequested)
+// Note that we're sending a request on behalf of an app, so we can change its state
+void schedSendingRequest(int i, bool responseRequested)
 {
-    for (int i=0; i<apps; i++) {
-        if (!state[i].disabled && state[i].active) {
-            state[i].requestSentTime = NoteTimeST();
-            state[i].requestSentTimeValid = NoteTimeValidST();
-            state[i].requestPending = true;
-            state[i].responsePending = responseRequested;
-            state[i].completionSuccessState = STATE_DEACTIVATED;
-            state[i].completionErrorState = STATE_DEACTIVATED;
-            schedSetState(i, STATE_SENDING_REQUEST, NULL);
-            break;
-        }
+    if (i < 0 || state[i].disabled || state[i].requestQueued) {
+        return;
     }
+    state[i].requestSentTime = appTime();
+    state[i].requestSentTimeValid = appTimeValid();
+    state[i].requestPending = true;
+    state[i].responsePending = responseRequested;
+    state[i].completionSuccessState = STATE_DEACTIVATED;
+    state[i].completionErrorState = STATE_DEACTIVATED;
+    schedSetState(i, STATE_SENDING_REQUEST, NULL);
+    schedDeadlineArm();
 }
 
-// Notify that a request has been completed
-void schedRequestCompleted(void)
+// Note that the request just sent is being held in the sensor's outbound queue rather than
+// having been transmitted.  If no response is required it will be treated as completed on
+// the next poll, else the app keeps waiting until the request is actually transmitted.
+void schedRequestQueued(int i)
 {
-    for (int i=0; i<apps; i++) {
-        if (!state[i].disabled && state[i].active) {
-            if (state[i].requestPending) {
-                state[i].requestPending = false;
-                if (state[i].responsePending) {
-                    schedSetState(i, STATE_RECEIVING_RESPONSE, "waiting for response");
-                } else {
-                    schedSetState(i, state[i].completionSuccessState, "request completed");
-                }
-            }
-            break;
+    if (i >= 0 && !state[i].disabled && state[i].requestPending) {
+        state[i].requestQueued = true;
+    }
+}
+
+// Note that a queued request that requires a response has now been transmitted
+void schedRequestDequeued(int i)
+{
+    if (i >= 0 && !state[i].disabled && state[i].requestQueued) {
+        state[i].requestQueued = false;
+        state[i].requestSentTime = appTime();
+        state[i].requestSentTimeValid = appTimeValid();
+        schedDeadlineArm();
+    }
+}
+
+// Notify an app of the loss of a request that it queued without asking for a response, which
+// it has long since been told was sent
+void schedRequestLost(int i)
+{
+    if (i < 0 || state[i].disabled) {
+        return;
+    }
+    APP_PRINTF("%s queued request lost\r\n", config[i].name);
+    if (config[i].requestLostFn != NULL) {
+        int prevApp = currentApp;
+        currentApp = i;
+        uint32_t beganTicks = TIMER_IF_GetTimerValue();
+        config[i].requestLostFn(i, config[i].appContext);
+        schedChargeAwake(i, beganTicks);
+        currentApp = prevApp;
+    }
+}
+
+// Notify that an app's request has been completed
+void schedRequestCompleted(int i)
+{
+    if (i < 0 || state[i].disabled || state[i].requestQueued) {
+        return;
+    }
+    if (state[i].requestPending) {
+        state[i].requestPending = false;
+        if (state[i].responsePending) {
+            schedSetState(i, STATE_RECEIVING_RESPONSE, "waiting for response");
+        } else {
+            schedSetState(i, state[i].completionSuccessState, "request completed");
+            schedDeadlineArm();
         }
     }
 }
 
-// Dispatch a gateway response to the active app's processing method
-void schedResponseCompleted(J *rsp)
+// Dispatch a gateway response to the processing method of the app that made the request,
+// with rsp being NULL for an app that takes the fields it declared in its responseStruct
+void schedResponseCompleted(int i, J *rsp)
 {
-    for (int i=0; i<apps; i++) {
-        if (!state[i].disabled && state[i].active) {
-            if (state[i].responsePending) {
-                state[i].responsePending = false;
-                schedSetState(i, state[i].completionSuccessState, "response completed");
-                if (config[i].responseFn != NULL) {
-                    config[i].responseFn(i, rsp, config[i].appContext);
-                }
+    if (i < 0 || state[i].disabled) {
+        return;
+    }
+    if (state[i].responsePending && !state[i].requestQueued) {
+        state[i].responsePending = false;
+        schedSetState(i, state[i].completionSuccessState, "response completed");
+        int prevApp = currentApp;
+        currentApp = i;
+        uint32_t beganTicks = TIMER_IF_GetTimerValue();
+        if (config[i].responseFields != NULL) {
+            if (config[i].responseFieldsFn != NULL) {
+                config[i].responseFieldsFn(i, config[i].responseStruct, config[i].appContext);
             }
+        } else if (config[i].responseFn != NULL) {
+            config[i].responseFn(i, rsp, config[i].appContext);
         }
+        schedChargeAwake(i, beganTicks);
+        currentApp = prevApp;
+        schedDeadlineArm();
     }
 }
 
-// Process a request or response timeout
-void schedRequestResponseTimeout(void)
+// Dispatch a gateway response in its JSON text, which must be terminated, extracting just the
+// fields that the app declared if it did so, and otherwise parsing it into a tree.  Returns
+// false if it isn't valid JSON.
+bool schedResponseCompletedJSON(int i, char *json, uint32_t len)
 {
-    for (int i=0; i<apps; i++) {
-        if (!state[i].disabled && state[i].active) {
-            if (state[i].requestPending || state[i].responsePending) {
-                schedSetState(i, state[i].completionErrorState, "error/timeout");
-                state[i].requestPending = false;
-                state[i].responsePending = false;
-            }
+    if (i >= 0 && config[i].responseFields != NULL) {
+        uint32_t beganTicks = TIMER_IF_GetTimerValue();
+        bool valid = jfieldsParse(json, len, config[i].responseFields, config[i].responseStruct);
+        schedChargeAwake(i, beganTicks);
+        if (valid) {
+            schedResponseCompleted(i, NULL);
         }
+        return valid;
+    }
+    J *rsp = JConvertFromJSONString(json);
+    if (rsp == NULL) {
+        return false;
+    }
+    schedResponseCompleted(i, rsp);
+    JDelete(rsp);
+    return true;
+}
+
+// Process a timeout of an app's request or response
+void schedRequestResponseTimeout(int i)
+{
+    if (i < 0 || state[i].disabled || state[i].requestQueued) {
+        return;
+    }
+    if (state[i].requestPending || state[i].responsePending) {
+        schedSetState(i, state[i].completionErrorState, "error/timeout");
+        state[i].requestPending = false;
+        state[i].responsePending = false;
+        schedDeadlineArm();
     }
 }
 
@@ -261,27 +643,71 @@ void schedRequestResponseTimeoutCheck(void)
 {
 
     // We can't really check timeouts until we have a valid time
-    if (!NoteTimeValidST()) {
+    if (!appTimeValid()) {
         return;
     }
 
-    // See if any of the pending responses have timed out
-    for (int i=0; i<apps; i++) {
-        if (!state[i].disabled && state[i].active) {
-            if (state[i].requestPending || state[i].responsePending) {
-                if (!state[i].requestSentTimeValid) {
-                    state[i].requestSentTimeValid = true;
-                    state[i].requestSentTime = NoteTimeST();
-                }
-                if (NoteTimeST() > state[i].requestSentTime + appTransmitWindowWaitMaxSecs()) {
-                    schedSetState(i, state[i].completionErrorState, "timeout");
-                    state[i].requestPending = false;
-                    state[i].responsePending = false;
-                }
+    // See if any active app's pending response has timed out
+    for (int pos=0; pos<activeApps; pos++) {
+        int i = active[pos];
+        if (state[i].disabled || state[i].requestQueued) {
+            continue;
+        }
+        if (state[i].requestPending || state[i].responsePending) {
+            if (!state[i].requestSentTimeValid) {
+                state[i].requestSentTimeValid = true;
+                state[i].requestSentTime = appTime();
+            }
+            if (appTime() > state[i].requestSentTime + appTransmitWindowWaitMaxSecs()) {
+                schedSetState(i, state[i].completionErrorState, "timeout");
+                state[i].requestPending = false;
+                state[i].responsePending = false;
             }
         }
     }
 
+    // Wake for whichever times out next
+    schedDeadlineArm();
+
+}
+
+// Arm the deadline timer for the first second at which a pending request or response would
+// be timed out by schedRequestResponseTimeoutCheck(), or stop it if there is none
+void schedDeadlineArm()
+{
+    if (!deadlineTimerCreated) {
+        UTIL_TIMER_Create(&deadlineTimer, 0xFFFFFFFFU, UTIL_TIMER_ONESHOT, schedDeadlineEvent, NULL);
+        deadlineTimerCreated = true;
+    }
+    UTIL_TIMER_Stop(&deadlineTimer);
+    if (!appTimeValid()) {
+        return;
+    }
+    uint32_t deadline = 0;
+    for (int pos=0; pos<activeApps; pos++) {
+        int i = active[pos];
+        if (state[i].disabled || state[i].requestQueued || !state[i].requestSentTimeValid) {
+            continue;
+        }
+        if (state[i].requestPending || state[i].responsePending) {
+            uint32_t due = state[i].requestSentTime + appTransmitWindowWaitMaxSecs() + 1;
+            if (deadline == 0 || due < deadline) {
+                deadline = due;
+            }
+        }
+    }
+    if (deadline == 0) {
+        return;
+    }
+    uint32_t now = appTime();
+    UTIL_TIMER_SetPeriod(&deadlineTimer, (deadline > now) ? (deadline - now) * 1000 : 1);
+    UTIL_TIMER_Start(&deadlineTimer);
+}
+
+// The deadline has passed, so wake the scheduler, which times out whatever is due
+void schedDeadlineEvent(void *context)
+{
+    sensorTimerWakeFromISR();
 }
 
 // Compute seconds until due, optionally aligned to a base.  If the event is currently or past-due, 0 is returned
@@ -328,13 +754,103 @@ uint32_t secsUntilDue(uint32_t alignmentBaseSecs, uint32_t nowSecs, uint32_t las
 
 }
 
+// Re-evaluate the scale of adaptive activation periods, returning true if it changed
+bool schedAdaptPeriods()
+{
+    uint32_t scale = 4;
+    bool stretched = false;
+    if (batteryMillivolts != 0 && batteryMillivolts < SCHED_ADAPT_BATTERY_LOW_MV) {
+        scale *= (batteryMillivolts < SCHED_ADAPT_BATTERY_CRITICAL_MV) ? 4 : 2;
+        stretched = true;
+    }
+    if (atpAtMaximumPower()) {
+        scale *= 2;
+        stretched = true;
+    }
+    if (atpLossPercent() > SCHED_ADAPT_LOSS_PCT) {
+        scale *= 2;
+        stretched = true;
+    }
+    if (sensorHoldOffSecs() != 0) {
+        scale *= 2;
+        stretched = true;
+    }
+    if (!stretched && batteryMillivolts >= SCHED_ADAPT_BATTERY_GOOD_MV) {
+        scale /= 2;
+    }
+    if (scale > SCHED_ADAPT_MAX_SCALE*4) {
+        scale = SCHED_ADAPT_MAX_SCALE*4;
+    }
+    if (scale == adaptScale4) {
+        return false;
+    }
+    TRACE_PRINTF(TRACE_SCHED, VLEVEL_L, "sched: adaptive activation periods now scaled by %d.%02d\r\n", scale/4, (scale%4)*25);
+    adaptScale4 = scale;
+    return true;
+}
+
+// Get an app's activation period, adapted to conditions within the app's bounds
+uint32_t schedActivationPeriodSecs(int appID)
+{
+    if (appID < 0 || appID >= apps) {
+        return 0;
+    }
+    uint32_t periodSecs = config[appID].activationPeriodSecs;
+    if (config[appID].activationPeriodMinSecs == 0 && config[appID].activationPeriodMaxSecs == 0) {
+        return periodSecs;
+    }
+    uint32_t minSecs = config[appID].activationPeriodMinSecs ? config[appID].activationPeriodMinSecs : periodSecs;
+    uint32_t maxSecs = config[appID].activationPeriodMaxSecs ? config[appID].activationPeriodMaxSecs : periodSecs;
+    uint64_t adaptedSecs = ((uint64_t) periodSecs * adaptScale4) / 4;
+    if (adaptedSecs < minSecs) {
+        adaptedSecs = minSecs;
+    }
+    if (adaptedSecs > maxSecs) {
+        adaptedSecs = maxSecs;
+    }
+    return (uint32_t) adaptedSecs;
+}
+
+// Get the shortest of the activation periods of the enabled periodic apps and how long until
+// the first of them is next due, returning false if there are none or the time isn't known
+bool schedNextDue(uint32_t *periodSecs, uint32_t *dueSecs)
+{
+    *periodSecs = 0;
+    *dueSecs = 0;
+    if (!appTimeValid()) {
+        return false;
+    }
+    uint32_t now = appTime();
+    bool found = false;
+    for (int i=0; i<apps; i++) {
+        if (state[i].disabled || config[i].activationPeriodSecs == 0) {
+            continue;
+        }
+        uint32_t period = schedActivationPeriodSecs(i);
+        uint32_t due;
+        if (state[i].heapIndex >= 0 && !state[i].rekey) {
+            due = (state[i].dueTime > now) ? state[i].dueTime - now : 0;
+        } else {
+            due = nextActivationDueSecs(i);
+        }
+        if (!found || period < *periodSecs) {
+            *periodSecs = period;
+        }
+        if (!found || due < *dueSecs) {
+            *dueSecs = due;
+        }
+        found = true;
+    }
+    return found;
+}
+
 // Find the next activation time for an app
 uint32_t nextActivationDueSecs(int i)
 {
-    uint32_t now = NoteTimeST();
+    uint32_t now = appTime();
 
     // The time when this app was first activated after having a valid time
-    if (state[i].activationBaseTime == 0 && NoteTimeValidST()) {
+    if (state[i].activationBaseTime == 0 && appTimeValid()) {
         state[i].activationBaseTime = now;
     }
 
@@ -346,102 +862,316 @@ uint32_t nextActivationDueSecs(int i)
     }
 
     // Compute the next period
-    return secsUntilDue(state[i].activationBaseTime, now, state[i].lastActivatedTime, config[i].activationPeriodSecs);
+    uint32_t periodSecs = schedActivationPeriodSecs(i);
+    uint32_t secs = secsUntilDue(state[i].activationBaseTime, now, state[i].lastActivatedTime, periodSecs);
+
+    // Move it to just before the slot that follows, unless that would be a period late
+    if (SCHED_ALIGN_WINDOW && config[i].alignToWindow && secs != 0) {
+        uint32_t dueTime = now + secs;
+        uint32_t slotTime = appTransmitWindowBeginsAt(dueTime + SCHED_ALIGN_WINDOW_LEAD_SECS);
+        if (slotTime != 0 && slotTime - SCHED_ALIGN_WINDOW_LEAD_SECS - dueTime < periodSecs) {
+            secs = slotTime - SCHED_ALIGN_WINDOW_LEAD_SECS - now;
+        }
+    }
+    return secs;
 
 }
 
+// Order apps by due time, then least recently activated, then app ID
+bool heapBefore(int a, int b)
+{
+    if (state[a].dueTime != state[b].dueTime) {
+        return state[a].dueTime < state[b].dueTime;
+    }
+    if (state[a].activatedSeq != state[b].activatedSeq) {
+        return state[a].activatedSeq < state[b].activatedSeq;
+    }
+    return a < b;
+}
+
+// Exchange two heap positions
+void heapSwap(int a, int b)
+{
+    int t = heap[a];
+    heap[a] = heap[b];
+    heap[b] = t;
+    state[heap[a]].heapIndex = a;
+    state[heap[b]].heapIndex = b;
+}
+
+// Move an entry toward the root until its parent is due first
+void heapSiftUp(int pos)
+{
+    while (pos > 0) {
+        int parent = (pos-1) / 2;
+        if (!heapBefore(heap[pos], heap[parent])) {
+            break;
+        }
+        heapSwap(pos, parent);
+        pos = parent;
+    }
+}
+
+// Move an entry toward the leaves until it's due before both children
+void heapSiftDown(int pos)
+{
+    while (true) {
+        int first = pos;
+        int left = (2*pos) + 1;
+        int right = left + 1;
+        if (left < heapApps && heapBefore(heap[left], heap[first])) {
+            first = left;
+        }
+        if (right < heapApps && heapBefore(heap[right], heap[first])) {
+            first = right;
+        }
+        if (first == pos) {
+            break;
+        }
+        heapSwap(pos, first);
+        pos = first;
+    }
+}
+
+// Add an inactive app to the heap, computing when it's next due
+void heapPush(int i)
+{
+    uint32_t secs = nextActivationDueSecs(i);
+    state[i].dueTime = (secs == 0) ? 0 : appTime() + secs;
+    state[i].heapIndex = heapApps;
+    heap[heapApps++] = i;
+    heapSiftUp(state[i].heapIndex);
+}
+
+// Remove the app that is due first
+void heapPop()
+{
+    int i = heap[0];
+    state[i].heapIndex = -1;
+    if (--heapApps > 0) {
+        heap[0] = heap[heapApps];
+        state[heap[0]].heapIndex = 0;
+        heapSiftDown(0);
+    }
+}
+
+// Recompute when an app in the heap is due, and restore the heap's order
+void heapRekey(int i, uint32_t now)
+{
+    uint32_t secs = nextActivationDueSecs(i);
+    state[i].dueTime = (secs == 0) ? 0 : now + secs;
+    heapSiftUp(state[i].heapIndex);
+    heapSiftDown(state[i].heapIndex);
+}
+
+// Recompute every due time, which is needed only when the clock is set or steps backward
+void heapRebuild(uint32_t now)
+{
+    for (int pos=0; pos<heapApps; pos++) {
+        int i = heap[pos];
+        uint32_t secs = nextActivationDueSecs(i);
+        state[i].dueTime = (secs == 0) ? 0 : now + secs;
+    }
+    for (int pos=(heapApps/2)-1; pos>=0; pos--) {
+        heapSiftDown(pos);
+    }
+}
+
+// Remove an app from the active list, preserving the order of the others
+void activeRemove(int pos)
+{
+    activeApps--;
+    memmove(&active[pos], &active[pos+1], (activeApps-pos) * sizeof(int));
+}
+
 // Primary scheduler poller, returns the time of next scheduling (or 0 to be called back immediately)
 uint32_t schedPoll()
 {
-    static int lastActiveApp = -1;
-    uint32_t now = NoteTimeST();
+    uint32_t now = appTime();
+    pollDueMs = 0;
 
     // Don't poll if we're pairing or if we can't do any work because
     // we don't yet know the gateway's address
     if (ledIsPairInProgress() || ledIsPairMandatory()) {
-        return NoteTimeST() + (60*60*24);
+        return appTime() + (60*60*24);
     }
 
-    // Poll the active app
-    for (int i=0; i<apps; i++) {
-        if (!state[i].disabled && state[i].active && config[i].pollFn != NULL) {
+    // Due times are absolute, so they're only invalidated when the clock is set or steps
+    // backward, or when an ISR asks that an app be activated now.
+    // Adapting the activation periods likewise moves their due times.
+    bool timeValid = appTimeValid();
+    if (schedAdaptPeriods() || timeValid != heapTimeValid || now < heapTime) {
+        heapTimeValid = timeValid;
+        heapRebuild(now);
+    } else if (rekeyPending) {
+        rekeyPending = false;
+        for (int i=0; i<apps; i++) {
+            if (state[i].rekey) {
+                state[i].rekey = false;
+                if (state[i].heapIndex >= 0) {
+                    heapRekey(i, now);
+                }
+            }
+        }
+    }
+    heapTime = now;
+
+    // Poll each active app, each of which may have its own request outstanding.  One that
+    // was disabled while active will never deactivate itself, and one without a poll
+    // function has nothing more to do once activated.
+    uint32_t nextPollTime = 0;
+    for (int pos=0; pos<activeApps;) {
+        int i = active[pos];
+        if (state[i].disabled) {
+            state[i].active = false;
+            activeRemove(pos);
+            continue;
+        }
+        if (config[i].pollFn != NULL) {
+            if (state[i].awaitUntilMs != 0) {
+                int64_t remainingMs = state[i].awaitUntilMs - TIMER_IF_GetTimeMs();
+                if (remainingMs > 0) {
+                    if (pollDueMs == 0 || (uint32_t) remainingMs < pollDueMs) {
+                        pollDueMs = (uint32_t) remainingMs;
+                    }
+                    uint32_t awaitSecs = (uint32_t) ((remainingMs + 999) / 1000);
+                    if (nextPollTime == 0 || now + awaitSecs < nextPollTime) {
+                        nextPollTime = now + awaitSecs;
+                    }
+                    pos++;
+                    continue;
+                }
+                state[i].awaitUntilMs = 0;
+            }
+            currentApp = i;
+            if (state[i].requestQueued && !state[i].responsePending) {
+                state[i].requestQueued = false;
+                state[i].requestPending = false;
+                schedSetState(i, state[i].completionSuccessState, "request queued");
+            }
+            LATENCY_POLLED(i);
+            uint32_t beganTicks = TIMER_IF_GetTimerValue();
+            state[i].pollAgainMs = 0;
             config[i].pollFn(i, state[i].currentState, config[i].appContext);
             if (state[i].currentState == STATE_ONCE) {
                 state[i].currentState = STATE_ACTIVATED;
                 config[i].pollFn(i, state[i].currentState, config[i].appContext);
             }
-            if (state[i].currentState == STATE_DEACTIVATED) {
-
-                // Deactivate and also set state to a plain "activate" for next iteration.  This
-                // state can be overridden by an ISR that wakes it for some other reason.
-                state[i].active = false;
-                state[i].currentState = STATE_ACTIVATED;
-                APP_PRINTF("%s deactivated\r\n", config[i].name);
-                break;
-
+            schedChargeAwake(i, beganTicks);
+            currentApp = -1;
+            if (state[i].currentState != STATE_DEACTIVATED) {
+                uint32_t pollSecs = config[i].pollPeriodSecs;
+                uint32_t pollMs = (state[i].pollAgainMs != 0) ? state[i].pollAgainMs : config[i].pollPeriodMs;
+                if (pollMs != 0) {
+                    if (pollDueMs == 0 || pollMs < pollDueMs) {
+                        pollDueMs = pollMs;
+                    }
+                    pollSecs = (pollMs + 999) / 1000;
+                }
+                if (nextPollTime == 0 || now + pollSecs < nextPollTime) {
+                    nextPollTime = now + pollSecs;
+                }
+                pos++;
+                continue;
             }
-            return (now + config[i].pollPeriodSecs);
         }
-    }
 
-    // There are no active apps, so see what's available to activate
-    while (true) {
+        // Deactivate and also set state to a plain "activate" for next iteration.  This
+        // state can be overridden by an ISR that wakes it for some other reason.
+        state[i].active = false;
+        state[i].currentState = STATE_ACTIVATED;
+        state[i].rekey = false;
+        state[i].awaitUntilMs = 0;
+        state[i].awaitPins = 0;
+        activeRemove(pos);
+        heapPush(i);
+        TRACE_PRINTF(TRACE_SCHED, VLEVEL_L, "%s deactivated\r\n", config[i].name);
 
-        // Nothing is active, so we will loop to find the next active app.  However,
-        // to be fair, we process them in a round-robin manner by starting with the
-        // app immediately after the last-activated app, and by remembering
-        // the first one in the case where multiple are due at the same time.
-        uint32_t earliestDueSecs = 0;
-        int earliestDueApp = -1;
-        int nextApp = lastActiveApp;
-        for (int s=0; s<apps; s++) {
-            int i = (++nextApp) % apps;
-            if (!state[i].disabled) {
-                uint32_t thisDueSecs = nextActivationDueSecs(i);
-                if (earliestDueApp == -1 || thisDueSecs < earliestDueSecs) {
-                    earliestDueSecs = thisDueSecs;
-                    earliestDueApp = i;
-                }
-            }
-        }
+    }
+
+    // Activate whatever is due, up to the limit on concurrently active apps.  Apps that are
+    // due at the same time are taken in the order in which they were last activated, which
+    // is round-robin.  Disabled apps are dropped from the heap as they surface.
+    bool activated = false;
+    uint32_t firstActivatedSeq = activatedSeq;
+    while (activeApps < SCHED_MAX_ACTIVE_APPS) {
 
         // Something should be schedulable, even if it's a long time out.  This
         // is just defensive coding to ensure that we have some kind of wakeup.
-        if (earliestDueApp == -1) {
-            APP_PRINTF("*** no apps enabled ***\r\n");
-            return now + 60*60;
+        while (heapApps > 0 && state[heap[0]].disabled) {
+            heapPop();
+        }
+        if (heapApps == 0) {
+            if (activeApps == 0) {
+                APP_PRINTF("*** no apps enabled ***\r\n");
+                return now + SENSOR_SLEEP_MAX_SECS;
+            }
+            break;
         }
 
-        // If something is due but not ready to activate, return the time when it's due.  We
+        // If something is due but not ready to activate, note the time when it's due.  We
         // add 1 to increase the chance that it will actually be ready when the timer expires.
-        if (earliestDueSecs > 0) {
-            APP_PRINTF("%s next up in %ds\r\n", config[earliestDueApp].name, earliestDueSecs);
-            return now + earliestDueSecs + 1;
+        int next = heap[0];
+        if (state[next].dueTime > now) {
+            if (!activated) {
+                TRACE_PRINTF(TRACE_SCHED, VLEVEL_L, "%s next up in %ds\r\n", config[next].name, state[next].dueTime - now);
+            }
+            if (nextPollTime == 0 || state[next].dueTime + 1 < nextPollTime) {
+                nextPollTime = state[next].dueTime + 1;
+            }
+            break;
+        }
+
+        // Each app is offered activation once per poll.  One that declined is due again at
+        // once whenever its due time can't move past now, as while the clock still reads 0
+        // just after boot, so it is offered again at the next poll rather than here.
+        if (state[next].activatedSeq > firstActivatedSeq) {
+            if (nextPollTime == 0 || now + 1 < nextPollTime) {
+                nextPollTime = now + 1;
+            }
+            break;
         }
 
         // Mark this as the last app activated, even if the app
         // refuses activation below.  This ensures round-robin behavior.
-        lastActiveApp = earliestDueApp;
-        state[lastActiveApp].lastActivatedTime = now;
-        state[lastActiveApp].active = true;
+        heapPop();
+        state[next].lastActivatedTime = now;
+        state[next].activatedSeq = ++activatedSeq;
+        state[next].active = true;
 
         // An app is due now.  Activate it and come back quickly.
-        if (config[lastActiveApp].activateFn == NULL) {
-            break;
+        bool accepted = true;
+        if (config[next].activateFn != NULL) {
+            currentApp = next;
+            uint32_t beganTicks = TIMER_IF_GetTimerValue();
+            accepted = config[next].activateFn(next, config[next].appContext);
+            schedChargeAwake(next, beganTicks);
+            currentApp = -1;
         }
-        if (config[lastActiveApp].activateFn(lastActiveApp, config[lastActiveApp].appContext)) {
-            break;
+        if (accepted) {
+            active[activeApps++] = next;
+            activated = true;
+            if (config[next].pollPeriodMs != 0) {
+                TRACE_PRINTF(TRACE_SCHED, VLEVEL_L, "%s activated with %ds activation period and %dms poll interval\r\n",
+                             config[next].name, schedActivationPeriodSecs(next), config[next].pollPeriodMs);
+            } else {
+                TRACE_PRINTF(TRACE_SCHED, VLEVEL_L, "%s activated with %ds activation period and %ds poll interval\r\n",
+                             config[next].name, schedActivationPeriodSecs(next), config[next].pollPeriodSecs);
+            }
+            continue;
         }
 
         // The activation failed, so just move on to the next one
-        state[lastActiveApp].active = false;
-        APP_PRINTF("%s declined activation\r\n", config[lastActiveApp].name);
+        state[next].active = false;
+        heapPush(next);
+        TRACE_PRINTF(TRACE_SCHED, VLEVEL_L, "%s declined activation\r\n", config[next].name);
 
     }
 
-    // Mark the app as active
-    APP_PRINTF("%s activated with %ds activation period and %ds poll interval\r\n",
-               config[lastActiveApp].name, config[lastActiveApp].activationPeriodSecs, config[lastActiveApp].pollPeriodSecs);
-    return now;
+    // Come back quickly to poll anything just activated
+    if (activated) {
+        return now;
+    }
+    return nextPollTime;
 
 }
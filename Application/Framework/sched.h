@@ -3,6 +3,7 @@
 // copyright holder including that found in the LICENSE file.
 
 #include <stdbool.h>
+#include <stddef.h>
 #include "note.h"
 
 #pragma once
@@ -22,16 +23,75 @@ typedef bool (*schedActivateFunc) (int appID, void *appContext);
 #define STATE_DEACTIVATED           -4
 #define STATE_SENDING_REQUEST       -5
 #define STATE_RECEIVING_RESPONSE    -6
+#define STATE_AWAITING_PIN          -7
 typedef void (*schedPollFunc) (int appID, int state, void *appContext);
 
+// A poll function may instead be written as a coroutine, running straight through an
+// activation from SCHED_BEGIN to SCHED_END and yielding to the scheduler at each await, which
+// resumes it from there on a later poll rather than blocking.  Its state is the line of the
+// await from which it's to resume.  Because it returns at each await, its local variables
+// don't survive one, and an await can't be placed within a switch statement of its own.
+//   SCHED_AWAIT_MS        resumes once the milliseconds have passed, sleeping meanwhile
+//   SCHED_AWAIT_RESPONSE  resumes once the request just sent has completed, or its response
+//                         has been processed if it asked for one, setting *retOK to whether
+//                         that succeeded rather than failing or timing out
+//   SCHED_AWAIT_PIN       resumes after an interrupt on any of the EXTI pins, which the app
+//                         must already have configured to interrupt
+//   SCHED_EXIT            deactivates, ending this activation with the reason given
+#define SCHED_AWAIT_ERROR           0x10000
+#define SCHED_BEGIN(state)          switch (state) { case STATE_ACTIVATED:
+#define SCHED_END(appID, why)       schedSetState(appID, STATE_DEACTIVATED, why); }
+#define SCHED_EXIT(appID, why)      do { schedSetState(appID, STATE_DEACTIVATED, why); return; } while (0)
+#define SCHED_AWAIT_MS(appID, ms) \
+    do { schedAwaitMs(appID, ms, __LINE__); return; case __LINE__:; } while (0)
+#define SCHED_AWAIT_PIN(appID, pins) \
+    do { schedAwaitPins(appID, pins, __LINE__); return; case __LINE__:; } while (0)
+#define SCHED_AWAIT_RESPONSE(appID, retOK) \
+    do { schedSetCompletionState(appID, __LINE__, __LINE__ + SCHED_AWAIT_ERROR); return; \
+         case __LINE__: *(retOK) = true; break; \
+         case __LINE__ + SCHED_AWAIT_ERROR: *(retOK) = false; } while (0)
+
 // Called when an app does a notecard request and asynchronously receives
 // a reply.  This will be called when a response comes back or when it
 // times out; if timeout the "rsp" field will be null.
 typedef void (*schedResponseFunc) (int appID, J *rsp, void *appContext);
 
+// Called instead of responseFn for an app that declares responseFields, once the fields
+// have been extracted from the response into the app's responseStruct, which is passed.
+typedef void (*schedResponseFieldsFunc) (int appID, void *rsp, void *appContext);
+
+// Called for each request that the app queued without asking for a response that was given up
+// on after its retries, having been neither delivered nor stored to be delivered later.
+typedef void (*schedRequestLostFunc) (int appID, void *appContext);
+
+// A field of a gateway response that an app declares so that it's extracted straight into
+// a member of its own struct, without a J tree being built.  Strings are truncated to fit
+// and always terminated, and integers have any fraction discarded.  Fields that aren't in
+// the response are zero.  A declaration ends with a field of type SCHED_FIELD_END.
+#define SCHED_FIELD_END             0
+#define SCHED_FIELD_STRING          1       // char[]
+#define SCHED_FIELD_INT             2       // int32_t
+#define SCHED_FIELD_BOOL            3       // bool
+typedef struct {
+    const char *name;
+    uint8_t type;
+    uint16_t offset;
+    uint16_t size;
+} schedField;
+#define SCHED_FIELD(name, type, structType, member) \
+    { name, type, offsetof(structType, member), sizeof(((structType *) 0)->member) }
+#define SCHED_FIELDS_END            { NULL, SCHED_FIELD_END, 0, 0 }
+
 // An ISR that is called on ANY+ALL interrupts; pins indicates exti lines that changed.
 typedef void (*schedInterruptFunc) (int appID, uint16_t pins, void *appContext);
 
+// Priority classes of an app's requests to the gateway.  Urgent requests go ahead of whatever
+// is queued and are sent in the gateway's next urgent window rather than in our slot, while
+// low-priority requests that need no response are held back so that others may join them.
+#define SCHED_PRIORITY_NORMAL       0
+#define SCHED_PRIORITY_URGENT       1
+#define SCHED_PRIORITY_LOW          2
+
 // App Configuration definition
 typedef struct {
 
@@ -41,8 +101,15 @@ typedef struct {
     // How often we get activated
     uint32_t activationPeriodSecs;
 
-    // While app is active, how often it's polled
+    // If either is nonzero, the bounds within which the activation period adapts to the
+    // battery and link, with a zero bound meaning activationPeriodSecs itself
+    uint32_t activationPeriodMinSecs;
+    uint32_t activationPeriodMaxSecs;
+
+    // While app is active, how often it's polled, in milliseconds instead if pollPeriodMs is
+    // nonzero.  Either may be overridden for the next poll by schedPollAgainMs().
     uint32_t pollPeriodSecs;
+    uint32_t pollPeriodMs;
 
     // Handlers
     schedActivateFunc activateFn;
@@ -50,9 +117,27 @@ typedef struct {
     schedPollFunc pollFn;
     schedResponseFunc responseFn;
 
+    // If set, the fields that responseFieldsFn takes from a response into responseStruct
+    const schedField *responseFields;
+    void *responseStruct;
+    schedResponseFieldsFunc responseFieldsFn;
+
+    // If set, told of the loss of requests that needed no response
+    schedRequestLostFunc requestLostFn;
+
     // Application Context
     void *appContext;
 
+    // The EXTI pins whose interrupts are dispatched to interruptFn, or 0 for all of them
+    uint16_t interruptPins;
+
+    // The priority class of the app's requests, SCHED_PRIORITY_NORMAL if unset
+    uint8_t priority;
+
+    // If set, periodic activations are moved later to just before the sensor's next slot, so
+    // that the requests of all apps aligned in this way go out in the same transmit window
+    bool alignToWindow;
+
 } schedAppConfig;
 
 // init.c
@@ -60,8 +145,15 @@ void schedAppInit(void);
 
 // sched.c
 void schedActivateNow(int appID);
+void schedAwaitMs(int appID, uint32_t ms, int resumeState);
+void schedAwaitPins(int appID, uint16_t pins, int resumeState);
+uint32_t schedActivationPeriodSecs(int appID);
+bool schedNextDue(uint32_t *periodSecs, uint32_t *dueSecs);
 bool schedActivateNowFromISR(int appID, bool interruptIfActive, int nextState);
 const char *schedAppName(int appID);
+int schedAppCount(void);
+uint8_t schedAppPriority(int appID);
+int schedCurrentApp(void);
 void schedDisable(int appID);
 void schedDispatchISR(uint16_t pins);
 void schedDispatchResponse(J *rsp);
@@ -69,12 +161,25 @@ int schedGetState(int appID);
 void schedInit(void);
 bool schedIsActive(int appID);
 uint32_t schedPoll(void);
+void schedPollAgainMs(int appID, uint32_t ms);
+uint32_t schedPollDueMs(void);
 int schedRegisterApp(schedAppConfig *sensorToRegister);
-void schedRequestCompleted(void);
-void schedRequestResponseTimeout(void);
+void schedRequestCompleted(int appID);
+void schedRequestDequeued(int appID);
+void schedRequestLost(int appID);
+void schedRequestQueued(int appID);
+void schedRequestResponseTimeout(int appID);
 void schedRequestResponseTimeoutCheck(void);
-void schedResponseCompleted(J *rsp);
-void schedSendingRequest(bool responseRequested);
+void schedResponseCompleted(int appID, J *rsp);
+bool schedResponseCompletedJSON(int appID, char *json, uint32_t len);
+void schedSendingRequest(int appID, bool responseRequested);
 void schedSetCompletionState(int appID, int successState, int errorState);
 void schedSetState(int appID, int newstate, const char *why);
 void schedStateName(int state, char * state_name_buffer, size_t buffer_len);
+uint32_t schedHundredthsMw(int8_t dBm);
+void schedChargeTransmit(int appID, uint32_t ms, int8_t dBm);
+void schedChargeReceive(int appID, uint32_t ms);
+void schedCostSummary(char *buf, uint32_t buflen, bool reset);
+void schedPowerSummary(char *buf, uint32_t buflen, bool reset);
+void schedPowerResidency(uint16_t *modePermille, uint32_t *wakes, bool reset);
+void schedCostTotal(uint32_t *txMs, uint32_t *txMicrojoules, uint32_t *rxMs, uint32_t *awakeMs, bool reset);
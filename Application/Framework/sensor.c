@@ -7,51 +7,77 @@
 #include "framework.h"
 
 // App Scheduler Sleep Timer
-#define sensorSleepMaxSecs          (60*60)         // Wake up at least hourly
 static UTIL_TIMER_Object_t sensorSleepTimer;
+static bool sensorSleepTimerCreated = false;
 uint32_t sensorWorkDueTime = 0;                     // Time of next work that is due for the app
 
 // Forwards
 void sensorTimerEvent(void *context);
+void sensorTimerSet(uint32_t ms);
 
 // Process the timed event
 void sensorTimerEvent(void *context)
 {
+    LATENCY_HOP(LATENCY_HOP_TIMER);
     appTimerWakeup();
 }
 
+// (Re)start the sleep timer, which is created only once
+void sensorTimerSet(uint32_t ms)
+{
+    if (!sensorSleepTimerCreated) {
+        UTIL_TIMER_Create(&sensorSleepTimer, 0xFFFFFFFFU, UTIL_TIMER_ONESHOT, sensorTimerEvent, NULL);
+        sensorSleepTimerCreated = true;
+    }
+    UTIL_TIMER_Stop(&sensorSleepTimer);
+    UTIL_TIMER_SetPeriod(&sensorSleepTimer, ms);
+    UTIL_TIMER_Start(&sensorSleepTimer);
+}
+
 // Set an immediate timer to wake up now
 void sensorTimerWakeFromISR()
 {
-    sensorTimerCancel();
     sensorWorkDueTime = 0;
-    UTIL_TIMER_Create(&sensorSleepTimer, 0xFFFFFFFFU, UTIL_TIMER_ONESHOT, sensorTimerEvent, NULL);
-    UTIL_TIMER_SetPeriod(&sensorSleepTimer, 1);
-    UTIL_TIMER_Start(&sensorSleepTimer);
+    sensorTimerSet(1);
 }
 
 // Place the CPU into a sleep mode until the next event occurs
 void sensorTimerStart()
 {
 
-    // Cancel any pending timer
+    // Cancel any pending timer.  There's no need to wait for debug output to drain
+    // before sleeping, because STOP2 is held off while the trace UART is transmitting.
     sensorTimerCancel();
 
-    // Wait a moment to allow any pending I/O to be completed (such as debugger output)
-    HAL_Delay(500);
-
-    // Compute the sleep time based on when our work polling is due
-    uint32_t thisSleepSecs = sensorSleepMaxSecs;
+    // Compute the sleep time based on when our work polling is due, sleeping for as long as
+    // is allowed if nothing is
+    uint32_t thisSleepSecs = SENSOR_SLEEP_MAX_SECS;
 
-    // Minimize it based on whether or not we are beaconing for pairing
+    // Minimize it based on when our next pairing beacon is due
     if (ledIsPairInProgress()) {
-        if (thisSleepSecs > PAIRING_BEACON_SECS) {
-            thisSleepSecs = PAIRING_BEACON_SECS;
+        uint32_t beaconSecs = ledPairBeaconWaitSecs();
+        if (beaconSecs == 0) {
+            beaconSecs = 1;
         }
+        if (thisSleepSecs > beaconSecs) {
+            thisSleepSecs = beaconSecs;
+        }
+    }
+
+    // Minimize it so that requests the gateway asked us to hold back are sent when it's ready
+    uint32_t holdOffSecs = sensorHoldOffSecs();
+    if (holdOffSecs != 0 && thisSleepSecs > holdOffSecs) {
+        thisSleepSecs = holdOffSecs;
+    }
+
+    // Minimize it so that low-priority requests being held back go out when they're due
+    uint32_t deferSecs = sensorQueueDeferSecs();
+    if (deferSecs != 0 && thisSleepSecs > deferSecs) {
+        thisSleepSecs = deferSecs;
     }
 
     // Minimize the sleep based on how often we should do data-related work
-    uint32_t now = NoteTimeST();
+    uint32_t now = appTime();
     uint32_t sensorWakeupSecs = 1;
     if (sensorWorkDueTime >= now) {
         sensorWakeupSecs = sensorWorkDueTime - now;
@@ -60,8 +86,18 @@ void sensorTimerStart()
         thisSleepSecs = sensorWakeupSecs;
     }
 
+    // Minimize it to the millisecond when an app asked to be polled sooner than a second
+    uint32_t thisSleepMs = thisSleepSecs * 1000;
+    uint32_t pollMs = schedPollDueMs();
+    if (pollMs != 0 && pollMs < thisSleepMs) {
+        thisSleepMs = pollMs;
+        thisSleepSecs = pollMs / 1000;
+    }
+
     // Schedule the timer
-    if (thisSleepSecs > 1) {
+    if (thisSleepSecs >= SENSOR_SLEEP_MAX_SECS) {
+        APP_PRINTF("sched: idle, sleeping until there is work\r\n");
+    } else if (thisSleepSecs > 1) {
         uint32_t transmitWindowDueSecs = appNextTransmitWindowDueSecs();
         if (transmitWindowDueSecs == 0) {
             APP_PRINTF("sched: sleeping %ds\r\n", thisSleepSecs);
@@ -77,16 +113,16 @@ void sensorTimerStart()
     }
 
     // Go to sleep
-    UTIL_TIMER_Create(&sensorSleepTimer, 0xFFFFFFFFU, UTIL_TIMER_ONESHOT, sensorTimerEvent, NULL);
-    UTIL_TIMER_SetPeriod(&sensorSleepTimer, thisSleepSecs*1000);
-    UTIL_TIMER_Start(&sensorSleepTimer);
+    sensorTimerSet(thisSleepMs);
 
 }
 
 // Cancel any pending scheduled app timer
 void sensorTimerCancel()
 {
-    UTIL_TIMER_Stop(&sensorSleepTimer);
+    if (sensorSleepTimerCreated) {
+        UTIL_TIMER_Stop(&sensorSleepTimer);
+    }
 }
 
 // Poll for something worth doing, and call sensorSendToGateway or sensorSendReqToGateway
@@ -101,16 +137,14 @@ void sensorPoll()
     sensorWorkDueTime = schedPoll();
     sensorTimerStart();
 
-    // Send a pairing beacon to the listening gateway
-    if (ledIsPairInProgress()) {
+    // Send anything that the apps have queued for the gateway
+    sensorQueueFlush();
+
+    // Send a pairing beacon to the listening gateway when one is due
+    if (ledIsPairInProgress() && ledPairBeaconWaitSecs() == 0) {
+        ledPairBeaconSent();
         appSendBeaconToGateway();
         return;
     }
 
 }
-
-// Execute console command for a sensor
-void sensorCmd(char *cmd)
-{
-    APP_PRINTF("??\r\n");
-}
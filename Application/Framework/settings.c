@@ -0,0 +1,258 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Per-sensor settings pushed from the gateway.  The operator gives a sensor its settings as the
+// "settings" object of its note in the gateway's config DB, alongside its name and location.
+// The gateway keeps only a version of each sensor's settings, a hash of their JSON text, and
+// carries it in every full ACK, so that a delta ACK changes version along with it.  A sensor
+// whose version differs fetches its settings with a single request that the gateway serves
+// itself from the config DB, and then holds their JSON text for its apps, which extract what
+// they declare with settingsGet() whenever settingsVersion() changes.  Apps thus never poll
+// for settings, and once a sensor holds its settings no traffic is spent on them at all.
+
+#include "framework.h"
+
+// Gateway state, holding the version of each sensor's settings and the note that holds them
+typedef struct {
+    uint8_t address[ADDRESS_LEN];
+    char noteID[(ADDRESS_LEN*2)+1];
+    uint16_t version;
+} settingsSensor;
+static settingsSensor settingsSensors[GATEWAY_SETTINGS_MAX];
+static uint32_t settingsSensorCount = 0;
+
+// Sensor state
+static int appID = -1;
+static uint16_t targetVersion = 0;
+static uint16_t heldVersion = 0;
+static char heldSettings[SENSOR_SETTINGS_MAX_BYTES];
+
+// Forwards
+uint16_t settingsVersionOf(J *settings);
+settingsSensor *settingsSensorFind(uint8_t *sensorAddress);
+bool settingsActivate(int appID, void *appContext);
+void settingsPoll(int appID, int state, void *appContext);
+void settingsResponse(int appID, J *rsp, void *appContext);
+
+// Get the version of a sensor's settings, which is 0 if it has none
+uint16_t settingsVersionOf(J *settings)
+{
+    if (settings == NULL) {
+        return 0;
+    }
+    char *json = JConvertToJSONString(settings);
+    if (json == NULL) {
+        return 0;
+    }
+    uint32_t crc = utilCRC32(0, (uint8_t *) json, strlen(json));
+    JFree(json);
+    uint16_t version = (uint16_t) (crc ^ (crc >> 16));
+    return (version == 0) ? 1 : version;
+}
+
+// On the gateway, find the entry of a sensor that has settings
+settingsSensor *settingsSensorFind(uint8_t *sensorAddress)
+{
+    for (uint32_t i=0; i<settingsSensorCount; i++) {
+        if (memcmp(settingsSensors[i].address, sensorAddress, ADDRESS_LEN) == 0) {
+            return &settingsSensors[i];
+        }
+    }
+    return NULL;
+}
+
+// On the gateway, forget the settings before they are reloaded from the config DB
+void settingsClear()
+{
+    settingsSensorCount = 0;
+}
+
+// On the gateway, forget the settings of a sensor whose config DB note has changed
+void settingsRemove(uint8_t *sensorAddress)
+{
+    settingsSensor *s = settingsSensorFind(sensorAddress);
+    if (s != NULL) {
+        *s = settingsSensors[--settingsSensorCount];
+    }
+}
+
+// On the gateway, note the settings of a sensor found in the config DB note of that ID,
+// returning false if there's no room
+bool settingsDesignate(const char *noteID, uint8_t *sensorAddress, J *settings)
+{
+    if (settingsSensorCount >= GATEWAY_SETTINGS_MAX || strlen(noteID) >= sizeof(settingsSensors[0].noteID)) {
+        return false;
+    }
+    settingsSensor *s = &settingsSensors[settingsSensorCount];
+    memcpy(s->address, sensorAddress, ADDRESS_LEN);
+    strlcpy(s->noteID, noteID, sizeof(s->noteID));
+    s->version = settingsVersionOf(settings);
+    settingsSensorCount++;
+    return true;
+}
+
+// On the gateway, get the version of a sensor's settings for its ACK, or 0 if it has none
+uint16_t settingsVersionFor(uint8_t *sensorAddress)
+{
+    settingsSensor *s = settingsSensorFind(sensorAddress);
+    return (s == NULL) ? 0 : s->version;
+}
+
+// Perform a sensor's request for its settings, reading them from the config DB so that what
+// is returned is current even if it changed after the version was last loaded
+J *settingsGatewayRequest(uint8_t *sensorAddress)
+{
+    J *rsp = JCreateObject();
+    if (rsp == NULL) {
+        return NULL;
+    }
+    settingsSensor *s = settingsSensorFind(sensorAddress);
+    if (s == NULL) {
+        JAddNumberToObject(rsp, "version", 0);
+        return rsp;
+    }
+
+    // Read the sensor's note
+    J *req = NoteNewRequest("note.get");
+    if (req == NULL) {
+        JDelete(rsp);
+        return NULL;
+    }
+    JAddStringToObject(req, "file", CONFIGDB);
+    JAddStringToObject(req, "note", s->noteID);
+    J *noteRsp = NoteRequestResponse(req);
+    if (noteRsp == NULL) {
+        JAddStringToObject(rsp, "err", "settings are unavailable");
+        return rsp;
+    }
+    if (NoteResponseError(noteRsp)) {
+        JAddStringToObject(rsp, "err", "settings are unavailable");
+        NoteDeleteResponse(noteRsp);
+        return rsp;
+    }
+
+    // Return its settings with their version, which is 0 if they've been removed
+    J *settings = JDetachItemFromObject(JGetObject(noteRsp, "body"), "settings");
+    NoteDeleteResponse(noteRsp);
+    uint16_t version = settingsVersionOf(settings);
+    JAddNumberToObject(rsp, "version", version);
+    if (settings != NULL) {
+        JAddItemToObject(rsp, "settings", settings);
+    }
+    APP_PRINTF("%s settings: sent version %04x\r\n", tracePeer(), version);
+    return rsp;
+}
+
+// Register the sensor's settings app
+bool settingsSensorInit()
+{
+    schedAppConfig config = {
+        .name = "settings",
+        .activationPeriodSecs = SENSOR_SETTINGS_CHECK_SECS,
+        .pollPeriodSecs = 1,
+        .activateFn = settingsActivate,
+        .interruptFn = NULL,
+        .pollFn = settingsPoll,
+        .responseFn = settingsResponse,
+    };
+    appID = schedRegisterApp(&config);
+    return (appID >= 0);
+}
+
+// Note the version of our settings given in an ACK from the gateway
+void settingsSensorAck(uint16_t version)
+{
+    if (version == targetVersion) {
+        return;
+    }
+    targetVersion = version;
+    if (version == 0 && heldVersion != 0) {
+        heldVersion = 0;
+        heldSettings[0] = '\0';
+        APP_PRINTF("settings: removed by gateway\r\n");
+    } else if (version != heldVersion) {
+        schedActivateNowFromISR(appID, false, STATE_ACTIVATED);
+    }
+}
+
+// Activate only when the gateway holds settings different from ours
+bool settingsActivate(int appID, void *appContext)
+{
+    return (targetVersion != 0 && targetVersion != heldVersion);
+}
+
+// Request our settings
+void settingsPoll(int appID, int state, void *appContext)
+{
+
+    switch (state) {
+
+    case STATE_ACTIVATED: {
+        J *req = NoteNewRequest(SETTINGS_REQUEST);
+        if (req == NULL) {
+            schedSetState(appID, STATE_DEACTIVATED, "settings: can't allocate request");
+            break;
+        }
+        noteSendToGatewayAsync(req, true);
+        schedSetCompletionState(appID, STATE_DEACTIVATED, STATE_DEACTIVATED);
+        break;
+    }
+
+    }
+
+}
+
+// Hold the settings received from the gateway
+void settingsResponse(int appID, J *rsp, void *appContext)
+{
+
+    // A timeout or failure, for which we'll try again at the next activation
+    if (rsp == NULL) {
+        return;
+    }
+    if (JIsPresent(rsp, "err")) {
+        APP_PRINTF("settings: %s\r\n", JGetString(rsp, "err"));
+        return;
+    }
+
+    // Settings that were removed since the ACK leave us with none
+    uint16_t version = (uint16_t) JGetInt(rsp, "version");
+    J *settings = JGetObject(rsp, "settings");
+    if (version == 0 || settings == NULL) {
+        heldVersion = 0;
+        heldSettings[0] = '\0';
+        APP_PRINTF("settings: none held by gateway\r\n");
+        return;
+    }
+
+    // Hold their text, for apps to extract what they need from
+    char *json = JConvertToJSONString(settings);
+    if (json == NULL) {
+        return;
+    }
+    if (strlen(json) >= sizeof(heldSettings)) {
+        APP_PRINTF("settings: version %04x is too large (%d bytes)\r\n", version, strlen(json));
+        JFree(json);
+        return;
+    }
+    strlcpy(heldSettings, json, sizeof(heldSettings));
+    JFree(json);
+    heldVersion = version;
+    APP_PRINTF("settings: now at version %04x\r\n", heldVersion);
+
+}
+
+// Get the version of the settings that we hold, which changes whenever they do, or 0 if none
+uint16_t settingsVersion()
+{
+    return heldVersion;
+}
+
+// Extract the declared fields, which end with one of type SCHED_FIELD_END, from the settings
+// into the struct, returning false if we hold none
+bool settingsGet(const schedField *fields, void *out)
+{
+    bool valid = jfieldsParse(heldSettings, strlen(heldSettings), fields, out);
+    return (valid && heldVersion != 0);
+}
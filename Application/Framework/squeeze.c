@@ -0,0 +1,232 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Squeezed JSON responses.  A response that the gateway sends back to a sensor is JSON
+// text whose keys and punctuation are drawn from a small vocabulary, so before it's sent
+// it's encoded as a stream in which ASCII bytes stand for themselves, bytes 0x80-0xDF stand
+// for entries of a static dictionary of common Notecard JSON fragments, and bytes 0xE0-0xFD
+// followed by a distance copy a run of 3 to 32 bytes from earlier in the response.  A byte
+// that isn't ASCII is sent after an escape.  The stream is preceded by SQUEEZE_RESPONSE and
+// by the response's length as a varint, which is why JSON text is never mistaken for it,
+// and the sensor expands it back into JSON as soon as it has been completely received.
+
+#include "framework.h"
+
+// Codes within the stream
+#define SQUEEZE_DICT_BASE       0x80
+#define SQUEEZE_REF_BASE        0xE0
+#define SQUEEZE_ESCAPE          0xFF
+#define SQUEEZE_REF_MIN         3
+#define SQUEEZE_REF_MAX         (SQUEEZE_REF_MIN + (0xFD - SQUEEZE_REF_BASE))
+#define SQUEEZE_REF_DISTANCE    255
+
+// Responses shorter than this aren't worth squeezing
+#define SQUEEZE_MIN_BYTES       24
+
+// The dictionary, which may never change order or have entries removed because sensors and
+// gateways must agree on it; entries may only be appended, up to 96 of them.  Longer
+// fragments that begin with shorter ones are listed first so that they're found first.
+static const char * const dictionary[] = {
+    "{\"body\":{\"",
+    "\"body\":{\"",
+    "\"body\":",
+    "{\"time\":",
+    "\"time\":",
+    "{\"err\":\"",
+    "\"err\":\"",
+    "{\"text\":\"",
+    "\"text\":\"",
+    "\"value\":\"",
+    "\"value\":",
+    "\"names\":[\"",
+    "\"name\":\"",
+    "\"files\":[\"",
+    "\"file\":\"",
+    "\"notes\":{\"",
+    "\"note\":\"",
+    "\"total\":",
+    "\"changes\":",
+    "\"status\":\"",
+    "\"payload\":\"",
+    "\"modified\":",
+    "\"connected\":",
+    "\"completed\":",
+    "\"requested\":",
+    "\"pending\":",
+    "\"deleted\":",
+    "\"mode\":\"",
+    "\"zone\":\"",
+    "\"area\":\"",
+    "\"country\":\"",
+    "\"minutes\":",
+    "\"seconds\":",
+    "\"count\":",
+    "\"lat\":",
+    "\"lon\":",
+    "\"sync\":",
+    "\"alert\":",
+    "\"device\":\"",
+    "\"product\":\"",
+    "\"version\":\"",
+    "\"voltage\":",
+    "\"temp\":",
+    "\"usb\":",
+    "\"storage\":",
+    "\"data\":\"",
+    "\"id\":",
+    "\"sn\":\"",
+    "dev:",
+    "true",
+    "false",
+    "null",
+    "_mins\"",
+    "_secs\"",
+    "\":{\"",
+    "\":[\"",
+    "\",\"",
+    "\":\"",
+    "\"},\"",
+    "\"}}",
+    "\"}",
+    "},\"",
+    "}}",
+    "\":",
+    ",\"",
+    "\"]",
+    "{\"",
+};
+#define SQUEEZE_DICT_ENTRIES    (sizeof(dictionary)/sizeof(dictionary[0]))
+
+// Squeeze a JSON response into a newly-allocated buffer, returning false if it isn't worth it
+bool squeezeResponse(uint8_t *data, uint32_t len, uint8_t **retData, uint32_t *retLen)
+{
+
+    // Only a result smaller than the response is of any use, so that bounds the output
+    if (len < SQUEEZE_MIN_BYTES || len > SQUEEZE_MAX_BYTES) {
+        return false;
+    }
+    uint8_t *out = (uint8_t *) poolAlloc(len);
+    if (out == NULL) {
+        return false;
+    }
+    uint32_t outLen = 0;
+    out[outLen++] = SQUEEZE_RESPONSE;
+    outLen += wirePutVarint(&out[outLen], len);
+
+    // At each position emit whichever of a dictionary entry, a copy, or a literal saves the most
+    uint32_t i = 0;
+    while (i < len) {
+        if (outLen + 2 > len) {
+            poolFree(out);
+            return false;
+        }
+        uint32_t bestSaving = 0;
+        uint32_t bestLen = 1;
+        uint32_t bestEntry = 0;
+        uint32_t bestDistance = 0;
+        for (uint32_t e=0; e<SQUEEZE_DICT_ENTRIES; e++) {
+            uint32_t n = strlen(dictionary[e]);
+            if (n-1 > bestSaving && n <= len-i && memcmp(&data[i], dictionary[e], n) == 0) {
+                bestSaving = n-1;
+                bestLen = n;
+                bestEntry = SQUEEZE_DICT_BASE + e;
+            }
+        }
+        uint32_t maxDistance = (i < SQUEEZE_REF_DISTANCE) ? i : SQUEEZE_REF_DISTANCE;
+        for (uint32_t d=1; d<=maxDistance; d++) {
+            if (data[i] != data[i-d]) {
+                continue;
+            }
+            uint32_t n = 1;
+            while (n < SQUEEZE_REF_MAX && i+n < len && data[i+n] == data[i-d+n]) {
+                n++;
+            }
+            if (n >= SQUEEZE_REF_MIN && n-2 > bestSaving) {
+                bestSaving = n-2;
+                bestLen = n;
+                bestEntry = 0;
+                bestDistance = d;
+            }
+        }
+        if (bestDistance != 0) {
+            out[outLen++] = (uint8_t) (SQUEEZE_REF_BASE + bestLen - SQUEEZE_REF_MIN);
+            out[outLen++] = (uint8_t) bestDistance;
+        } else if (bestEntry != 0) {
+            out[outLen++] = (uint8_t) bestEntry;
+        } else if (data[i] >= 0x80) {
+            out[outLen++] = SQUEEZE_ESCAPE;
+            out[outLen++] = data[i];
+        } else {
+            out[outLen++] = data[i];
+        }
+        i += bestLen;
+    }
+
+    *retData = out;
+    *retLen = outLen;
+    return true;
+
+}
+
+// Expand a squeezed response into a newly-allocated buffer with room for a terminator beyond
+// it, returning false if it is malformed or can't be allocated
+bool squeezeExpand(uint8_t *data, uint32_t len, uint8_t **retData, uint32_t *retLen)
+{
+
+    // Validate the header and allocate the result
+    uint8_t *p = data;
+    uint8_t *end = data + len;
+    uint32_t expandedLen;
+    if (len == 0 || *p++ != SQUEEZE_RESPONSE || !wireGetVarint(&p, end, &expandedLen) || expandedLen > SQUEEZE_MAX_BYTES) {
+        return false;
+    }
+    uint8_t *out = (uint8_t *) poolAlloc(expandedLen+1);
+    if (out == NULL) {
+        return false;
+    }
+
+    // Expand the stream, making sure that nothing falls outside either buffer
+    uint32_t outLen = 0;
+    bool success = true;
+    while (success && p < end) {
+        uint8_t code = *p++;
+        if (code < SQUEEZE_DICT_BASE) {
+            success = (outLen < expandedLen);
+            if (success) {
+                out[outLen++] = code;
+            }
+        } else if (code == SQUEEZE_ESCAPE) {
+            success = (p < end && outLen < expandedLen);
+            if (success) {
+                out[outLen++] = *p++;
+            }
+        } else if (code >= SQUEEZE_REF_BASE) {
+            uint32_t n = code - SQUEEZE_REF_BASE + SQUEEZE_REF_MIN;
+            uint32_t d = (p < end) ? *p++ : 0;
+            success = (d != 0 && d <= outLen && n <= expandedLen-outLen);
+            for (uint32_t j=0; success && j<n; j++) {
+                out[outLen] = out[outLen-d];
+                outLen++;
+            }
+        } else {
+            uint32_t e = code - SQUEEZE_DICT_BASE;
+            uint32_t n = (e < SQUEEZE_DICT_ENTRIES) ? strlen(dictionary[e]) : 0;
+            success = (n != 0 && n <= expandedLen-outLen);
+            if (success) {
+                memcpy(&out[outLen], dictionary[e], n);
+                outLen += n;
+            }
+        }
+    }
+    if (!success || outLen != expandedLen) {
+        poolFree(out);
+        return false;
+    }
+
+    out[outLen] = '\0';
+    *retData = out;
+    *retLen = outLen;
+    return true;
+
+}
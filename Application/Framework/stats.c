@@ -0,0 +1,503 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Gateway-wide statistics.  Counters of the reasons that received packets are discarded,
+// histograms of Notecard transaction latency overall and by request type along with the
+// bytes that each type moved over I2C, the buffer pool's and the stack's high-water marks, and the
+// time that the radio was not listening are aggregated in fixed-size structures, and are
+// emitted as a single templated note each sensordb_update_mins so that changes in the
+// gateway's capacity are visible in production.  Load-test traffic from sensors is
+// absorbed here rather than reaching the Notecard, and what of it was achieved is
+// summarized alongside.
+
+#include <stdio.h>
+#include "main.h"
+#include "framework.h"
+
+// Latency histogram, in which bucket i counts transactions taking less than 2^i ms and
+// at least 2^(i-1) ms, with the last bucket also holding everything longer
+#define STATS_LATENCY_BUCKETS       16
+static uint16_t latency[STATS_LATENCY_BUCKETS];
+static uint32_t latencyCount = 0;
+static uint32_t latencyMaxMs = 0;
+
+// The same histogram kept for each of the requests that the gateway makes most often, so
+// that a stall can be attributed, with anything else counted under the last entry
+typedef struct {
+    const char *req;
+    const char *field;
+} statsReqType;
+static const statsReqType reqTypes[] = {
+    { "note.add", "add" },
+    { "note.get", "get" },
+    { "note.changes", "changes" },
+    { "env.get", "env" },
+    { "env.modified", "envmod" },
+    { "hub.sync.status", "sync" },
+    { "dfu.status", "dfustatus" },
+    { "dfu.get", "dfuget" },
+    { "card.attn", "attn" },
+    { NULL, "other" },
+};
+#define STATS_REQ_TYPES (sizeof(reqTypes)/sizeof(reqTypes[0]))
+typedef struct {
+    uint16_t latency[STATS_LATENCY_BUCKETS];
+    uint32_t count;
+    uint32_t maxMs;
+    uint32_t bytes;
+} statsReqLatency;
+static statsReqLatency reqLatency[STATS_REQ_TYPES];
+
+// Load-test traffic, tracked by each logical sensor that a test sensor emulates so that what
+// was lost can be told from the gaps in that stream's sequence.  Streams outlive intervals.
+#define STATS_LOAD_STREAMS          32
+typedef struct {
+    uint32_t sensorHash;
+    uint8_t stream;
+    uint32_t lastSequence;
+} statsLoadStream;
+static statsLoadStream loadStreams[STATS_LOAD_STREAMS];
+static uint32_t loadStreamsUsed = 0;
+static uint32_t loadReceived = 0;
+static uint32_t loadLost = 0;
+static uint32_t loadBytes = 0;
+static int64_t loadBeganMs = 0;
+static uint16_t loadLatency[STATS_LATENCY_BUCKETS];
+static uint32_t loadLatencyMaxMs = 0;
+
+// Counters and radio listening time for the current interval
+static uint32_t counters[STATS_COUNTERS];
+static uint32_t deafMs = 0;
+static int64_t deafSinceMs = 0;
+static uint32_t intervalBeganTime = 0;
+static bool templateRegistered = false;
+
+// Forwards
+static uint32_t statsBucket(uint32_t ms);
+static uint32_t statsPercentileMs(const uint16_t *buckets, uint32_t count, uint32_t maxMs, uint32_t percent);
+static uint32_t statsReqTypeOf(const char *req);
+static void statsAddReqFields(J *body, uint32_t i, bool template);
+static bool statsLoadTestFrame(uint8_t *data, uint32_t len);
+static void statsLoadTestRecord(uint32_t sensorHash, uint8_t *data, uint32_t len, uint32_t latencyMs);
+static void statsLoadTestReset(void);
+static bool statsRegisterTemplate(void);
+
+// Count an event
+void statsCount(int counter)
+{
+    if (counter >= 0 && counter < STATS_COUNTERS) {
+        counters[counter]++;
+    }
+}
+
+// Add a duration to a sensor's latency histogram, whose buckets are halved together whenever
+// one would overflow, so that it remains the shape of the distribution.  It is kept small
+// because there is one for each cached sensor.
+void statsLatencyAdd(statsLatency *l, uint32_t ms)
+{
+    uint32_t bucket = 0;
+    while (bucket < STATS_SENSOR_LATENCY_BUCKETS-1 && ms >= (((uint32_t) STATS_SENSOR_LATENCY_UNIT_MS) << bucket)) {
+        bucket++;
+    }
+    if (l->buckets[bucket] == 0xFF) {
+        for (uint32_t i=0; i<STATS_SENSOR_LATENCY_BUCKETS; i++) {
+            l->buckets[i] /= 2;
+        }
+    }
+    l->buckets[bucket]++;
+    uint32_t units = (ms / STATS_SENSOR_LATENCY_UNIT_MS) + ((ms % STATS_SENSOR_LATENCY_UNIT_MS) ? 1 : 0);
+    if (units > l->maxUnits) {
+        l->maxUnits = (units > 0xFFFF) ? 0xFFFF : (uint16_t) units;
+    }
+}
+
+// The number of durations that a sensor's latency histogram holds
+uint32_t statsLatencyCount(statsLatency *l)
+{
+    uint32_t count = 0;
+    for (uint32_t i=0; i<STATS_SENSOR_LATENCY_BUCKETS; i++) {
+        count += l->buckets[i];
+    }
+    return count;
+}
+
+// The longest duration added to a sensor's latency histogram, to the resolution it is held
+uint32_t statsLatencyMaxMs(statsLatency *l)
+{
+    return ((uint32_t) l->maxUnits) * STATS_SENSOR_LATENCY_UNIT_MS;
+}
+
+// The upper bound of the bucket of a sensor's latency histogram holding the given percentile
+uint32_t statsLatencyPercentileMs(statsLatency *l, uint32_t percent)
+{
+    uint32_t count = statsLatencyCount(l);
+    if (count == 0) {
+        return 0;
+    }
+    uint32_t maxMs = statsLatencyMaxMs(l);
+    uint32_t target = ((count * percent) + 99) / 100;
+    uint32_t seen = 0;
+    for (uint32_t i=0; i<STATS_SENSOR_LATENCY_BUCKETS-1; i++) {
+        seen += l->buckets[i];
+        if (seen >= target) {
+            uint32_t boundMs = ((uint32_t) STATS_SENSOR_LATENCY_UNIT_MS) << i;
+            return (boundMs < maxMs) ? boundMs : maxMs;
+        }
+    }
+    return maxMs;
+}
+
+// The histogram bucket for a duration
+static uint32_t statsBucket(uint32_t ms)
+{
+    uint32_t bucket = 0;
+    while (bucket < STATS_LATENCY_BUCKETS-1 && ms >= (1UL << bucket)) {
+        bucket++;
+    }
+    return bucket;
+}
+
+// Find the entry for a request type, which is the last if it isn't one that we break out
+static uint32_t statsReqTypeOf(const char *req)
+{
+    uint32_t i;
+    for (i=0; i<STATS_REQ_TYPES-1; i++) {
+        if (strcmp(req, reqTypes[i].req) == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+// Record the duration of a Notecard transaction, the request that it performed (or "" if
+// unknown), and the bytes that it moved over I2C
+void statsNotecardTransaction(const char *req, uint32_t ms, uint32_t bytes)
+{
+    uint32_t bucket = statsBucket(ms);
+    if (latency[bucket] < 0xFFFF) {
+        latency[bucket]++;
+    }
+    latencyCount++;
+    if (ms > latencyMaxMs) {
+        latencyMaxMs = ms;
+    }
+    statsReqLatency *t = &reqLatency[statsReqTypeOf(req)];
+    if (t->latency[bucket] < 0xFFFF) {
+        t->latency[bucket]++;
+    }
+    t->count++;
+    t->bytes += bytes;
+    if (ms > t->maxMs) {
+        t->maxMs = ms;
+    }
+}
+
+// Note when the radio starts or stops listening, which is called from radio ISRs
+void statsRadioListening(bool listening)
+{
+    int64_t nowMs = TIMER_IF_GetTimeMs();
+    if (listening) {
+        if (deafSinceMs != 0) {
+            deafMs += (uint32_t) (nowMs - deafSinceMs);
+            deafSinceMs = 0;
+        }
+    } else if (deafSinceMs == 0) {
+        deafSinceMs = nowMs;
+    }
+}
+
+// The upper bound of the histogram bucket holding the given percentile of transactions
+static uint32_t statsPercentileMs(const uint16_t *buckets, uint32_t count, uint32_t maxMs, uint32_t percent)
+{
+    if (count == 0) {
+        return 0;
+    }
+    uint32_t target = ((count * percent) + 99) / 100;
+    uint32_t seen = 0;
+    for (uint32_t i=0; i<STATS_LATENCY_BUCKETS-1; i++) {
+        seen += buckets[i];
+        if (seen >= target) {
+            return (1UL << i);
+        }
+    }
+    return maxMs;
+}
+
+// See whether what a sensor sent is a load-test frame
+static bool statsLoadTestFrame(uint8_t *data, uint32_t len)
+{
+    return len >= sizeof(compactLoadTest) && data[0] == COMPACT_LOAD_TEST;
+}
+
+// Account for a load-test frame, from whose sequence anything lost since the last from its
+// stream is counted.  A sequence that begins again is taken to be its sensor restarting, and
+// one already seen to be a repeat, which achieves nothing.
+static void statsLoadTestRecord(uint32_t sensorHash, uint8_t *data, uint32_t len, uint32_t latencyMs)
+{
+    compactLoadTest frame;
+    memcpy(&frame, data, sizeof(frame));
+    statsLoadStream *s = NULL;
+    for (uint32_t i=0; i<loadStreamsUsed; i++) {
+        if (loadStreams[i].sensorHash == sensorHash && loadStreams[i].stream == frame.Stream) {
+            s = &loadStreams[i];
+            break;
+        }
+    }
+    if (s == NULL && loadStreamsUsed < STATS_LOAD_STREAMS) {
+        s = &loadStreams[loadStreamsUsed++];
+        s->sensorHash = sensorHash;
+        s->stream = frame.Stream;
+        s->lastSequence = 0;
+    }
+    if (s != NULL) {
+        if (frame.Sequence <= s->lastSequence && frame.Sequence != 1) {
+            return;
+        }
+        if (frame.Sequence > s->lastSequence+1) {
+            loadLost += frame.Sequence - (s->lastSequence+1);
+        }
+        s->lastSequence = frame.Sequence;
+    }
+    if (loadReceived == 0) {
+        loadBeganMs = TIMER_IF_GetTimeMs();
+    }
+    loadReceived++;
+    loadBytes += len;
+    uint32_t bucket = statsBucket(latencyMs);
+    if (loadLatency[bucket] < 0xFFFF) {
+        loadLatency[bucket]++;
+    }
+    if (latencyMs > loadLatencyMaxMs) {
+        loadLatencyMaxMs = latencyMs;
+    }
+}
+
+// Absorb what a sensor sent if it's load-test traffic, alone or as a batch holding nothing
+// else, given how long it took from its first chunk arriving until it was complete.  Returns
+// false, having done nothing, if it's anything else.
+bool statsLoadTest(uint8_t *sensorAddress, uint8_t *data, uint32_t len, uint32_t latencyMs)
+{
+    uint32_t sensorHash = utilHashAddress(sensorAddress);
+    if (statsLoadTestFrame(data, len)) {
+        statsLoadTestRecord(sensorHash, data, len, latencyMs);
+        return true;
+    }
+    if (len < 1 + sizeof(uint16_t) || data[0] != COMPACT_BATCH) {
+        return false;
+    }
+    for (int pass=0; pass<2; pass++) {
+        uint32_t offset = 1;
+        while (offset < len) {
+            uint32_t reqLen = (offset + sizeof(uint16_t) <= len) ? (data[offset] | (data[offset+1] << 8)) : 0;
+            offset += sizeof(uint16_t);
+            if (offset + reqLen > len || !statsLoadTestFrame(&data[offset], reqLen)) {
+                return false;
+            }
+            if (pass == 1) {
+                statsLoadTestRecord(sensorHash, &data[offset], reqLen, latencyMs);
+            }
+            offset += reqLen;
+        }
+    }
+    return true;
+}
+
+// Begin a new interval of load-test accounting
+static void statsLoadTestReset()
+{
+    loadReceived = 0;
+    loadLost = 0;
+    loadBytes = 0;
+    memset(loadLatency, 0, sizeof(loadLatency));
+    loadLatencyMaxMs = 0;
+}
+
+// Display what load-test traffic achieved in the interval so far
+void statsLoadTestShow()
+{
+    if (loadReceived == 0) {
+        return;
+    }
+    uint32_t ms = (uint32_t) (TIMER_IF_GetTimeMs() - loadBeganMs);
+    if (ms == 0) {
+        ms = 1;
+    }
+    uint32_t sent = loadReceived + loadLost;
+    APP_PRINTF("load: %d of %d received from %d streams (%d.%d%% lost), %d requests/min, %d bytes/s, latency p50 %dms p90 %dms max %dms\r\n",
+               loadReceived, sent, loadStreamsUsed, (loadLost*100)/sent, ((loadLost*1000)/sent)%10,
+               (uint32_t) (((uint64_t) loadReceived * 60000) / ms), (uint32_t) (((uint64_t) loadBytes * 1000) / ms),
+               statsPercentileMs(loadLatency, loadReceived, loadLatencyMaxMs, 50),
+               statsPercentileMs(loadLatency, loadReceived, loadLatencyMaxMs, 90), loadLatencyMaxMs);
+}
+
+// Display the Notecard latency by request type for the interval so far
+void statsNotecardShow()
+{
+    APP_PRINTF("notecard: %d transactions, p50 %dms p90 %dms max %dms\r\n", latencyCount,
+               statsPercentileMs(latency, latencyCount, latencyMaxMs, 50),
+               statsPercentileMs(latency, latencyCount, latencyMaxMs, 90), latencyMaxMs);
+    for (uint32_t i=0; i<STATS_REQ_TYPES; i++) {
+        statsReqLatency *t = &reqLatency[i];
+        if (t->count == 0) {
+            continue;
+        }
+        char hist[STATS_LATENCY_BUCKETS*6+1] = {0};
+        for (uint32_t b=0; b<STATS_LATENCY_BUCKETS; b++) {
+            char num[8];
+            snprintf(num, sizeof(num), " %d", t->latency[b]);
+            strlcat(hist, num, sizeof(hist));
+        }
+        APP_PRINTF("  %s: %d, p50 %dms p90 %dms max %dms, %d bytes, log2ms%s\r\n",
+                   reqTypes[i].req ? reqTypes[i].req : reqTypes[i].field, t->count,
+                   statsPercentileMs(t->latency, t->count, t->maxMs, 50),
+                   statsPercentileMs(t->latency, t->count, t->maxMs, 90), t->maxMs, t->bytes, hist);
+    }
+}
+
+// Add the fields for a request type to the stats note's body, or to its template
+static void statsAddReqFields(J *body, uint32_t i, bool template)
+{
+    char field[32];
+    statsReqLatency *t = &reqLatency[i];
+    snprintf(field, sizeof(field), "nc_%s", reqTypes[i].field);
+    JAddNumberToObject(body, field, template ? TINT32 : t->count);
+    snprintf(field, sizeof(field), "nc_%s_p90_ms", reqTypes[i].field);
+    JAddNumberToObject(body, field, template ? TINT32 : statsPercentileMs(t->latency, t->count, t->maxMs, 90));
+    snprintf(field, sizeof(field), "nc_%s_max_ms", reqTypes[i].field);
+    JAddNumberToObject(body, field, template ? TINT32 : t->maxMs);
+    snprintf(field, sizeof(field), "nc_%s_bytes", reqTypes[i].field);
+    JAddNumberToObject(body, field, template ? TINT32 : t->bytes);
+}
+
+// Register the template for the stats note on the Notecard
+static bool statsRegisterTemplate()
+{
+    J *req = NoteNewRequest("note.template");
+    if (req == NULL) {
+        return false;
+    }
+    JAddStringToObject(req, "file", STATS_NOTEFILE);
+    J *body = JCreateObject();
+    if (body == NULL) {
+        JDelete(req);
+        return false;
+    }
+    JAddNumberToObject(body, "secs", TINT32);
+    JAddNumberToObject(body, "rx", TINT32);
+    JAddNumberToObject(body, "rx_per_min", TFLOAT16);
+    JAddNumberToObject(body, "decrypt_failed", TINT32);
+    JAddNumberToObject(body, "not_for_us", TINT32);
+    JAddNumberToObject(body, "bad_offset", TINT32);
+    JAddNumberToObject(body, "lbt_busy", TINT32);
+    JAddNumberToObject(body, "notecard", TINT32);
+    JAddNumberToObject(body, "notecard_p50_ms", TINT32);
+    JAddNumberToObject(body, "notecard_p90_ms", TINT32);
+    JAddNumberToObject(body, "notecard_p99_ms", TINT32);
+    JAddNumberToObject(body, "notecard_max_ms", TINT32);
+    for (uint32_t i=0; i<STATS_REQ_TYPES; i++) {
+        statsAddReqFields(body, i, true);
+    }
+    JAddNumberToObject(body, "pool_high_bytes", TINT32);
+    JAddNumberToObject(body, "heap_high_blocks", TINT16);
+    JAddNumberToObject(body, "stack_high_bytes", TINT32);
+    JAddNumberToObject(body, "deaf_ms", TINT32);
+    JAddNumberToObject(body, "load_rx", TINT32);
+    JAddNumberToObject(body, "load_lost", TINT32);
+    JAddNumberToObject(body, "load_bytes", TINT32);
+    JAddNumberToObject(body, "load_p90_ms", TINT32);
+    JAddNumberToObject(body, "load_max_ms", TINT32);
+    JAddItemToObject(req, "body", body);
+    return NoteRequest(req);
+}
+
+// Emit the stats for the interval if it has elapsed, returning true if a note was added
+bool statsUpload(void)
+{
+    uint32_t now = appTime();
+    if (intervalBeganTime == 0) {
+        intervalBeganTime = now;
+        return false;
+    }
+    uint32_t mins = var_gateway_sensordb_update_mins ? var_gateway_sensordb_update_mins : DEFAULT_GATEWAY_SENSORDB_UPDATE_MINS;
+    if (now < intervalBeganTime+(mins*60)) {
+        return false;
+    }
+    if (!templateRegistered) {
+        templateRegistered = statsRegisterTemplate();
+        if (!templateRegistered) {
+            return false;
+        }
+    }
+
+    // Close out the time that the radio has been deaf so far
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (deafSinceMs != 0) {
+        int64_t nowMs = TIMER_IF_GetTimeMs();
+        deafMs += (uint32_t) (nowMs - deafSinceMs);
+        deafSinceMs = nowMs;
+    }
+    uint32_t deaf = deafMs;
+    __set_PRIMASK(primask);
+
+    // Add the note, sent as a command because we needn't wait for its response
+    uint32_t secs = now - intervalBeganTime;
+    uint32_t poolHighBytes, heapHighBlocks;
+    poolHighWater(&poolHighBytes, &heapHighBlocks, false);
+    J *req = NoteNewCommand("note.add");
+    if (req == NULL) {
+        return false;
+    }
+    JAddStringToObject(req, "file", STATS_NOTEFILE);
+    J *body = JCreateObject();
+    if (body == NULL) {
+        JDelete(req);
+        return false;
+    }
+    JAddNumberToObject(body, "secs", secs);
+    JAddNumberToObject(body, "rx", counters[STATS_RX]);
+    JAddNumberToObject(body, "rx_per_min", (((double) counters[STATS_RX]) * 60) / (secs ? secs : 1));
+    JAddNumberToObject(body, "decrypt_failed", counters[STATS_DECRYPT_FAILED]);
+    JAddNumberToObject(body, "not_for_us", counters[STATS_NOT_FOR_US]);
+    JAddNumberToObject(body, "bad_offset", counters[STATS_BAD_OFFSET]);
+    JAddNumberToObject(body, "lbt_busy", counters[STATS_LBT_BUSY]);
+    JAddNumberToObject(body, "notecard", latencyCount);
+    JAddNumberToObject(body, "notecard_p50_ms", statsPercentileMs(latency, latencyCount, latencyMaxMs, 50));
+    JAddNumberToObject(body, "notecard_p90_ms", statsPercentileMs(latency, latencyCount, latencyMaxMs, 90));
+    JAddNumberToObject(body, "notecard_p99_ms", statsPercentileMs(latency, latencyCount, latencyMaxMs, 99));
+    JAddNumberToObject(body, "notecard_max_ms", latencyMaxMs);
+    for (uint32_t i=0; i<STATS_REQ_TYPES; i++) {
+        statsAddReqFields(body, i, false);
+    }
+    JAddNumberToObject(body, "pool_high_bytes", poolHighBytes);
+    JAddNumberToObject(body, "heap_high_blocks", heapHighBlocks);
+    JAddNumberToObject(body, "stack_high_bytes", MX_Stack_HighWater(NULL));
+    JAddNumberToObject(body, "deaf_ms", deaf);
+    JAddNumberToObject(body, "load_rx", loadReceived);
+    JAddNumberToObject(body, "load_lost", loadLost);
+    JAddNumberToObject(body, "load_bytes", loadBytes);
+    JAddNumberToObject(body, "load_p90_ms", statsPercentileMs(loadLatency, loadReceived, loadLatencyMaxMs, 90));
+    JAddNumberToObject(body, "load_max_ms", loadLatencyMaxMs);
+    JAddItemToObject(req, "body", body);
+    if (!NoteRequest(req)) {
+        return false;
+    }
+    APP_PRINTF("stats: %d packets in %d secs, radio deaf %dms\r\n", counters[STATS_RX], secs, deaf);
+    statsLoadTestShow();
+
+    // Begin the next interval
+    memset(counters, 0, sizeof(counters));
+    memset(latency, 0, sizeof(latency));
+    latencyCount = 0;
+    latencyMaxMs = 0;
+    memset(reqLatency, 0, sizeof(reqLatency));
+    statsLoadTestReset();
+    primask = __get_PRIMASK();
+    __disable_irq();
+    deafMs -= deaf;
+    __set_PRIMASK(primask);
+    poolHighWater(NULL, NULL, true);
+    intervalBeganTime = now;
+    return true;
+}
@@ -0,0 +1,175 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// System-wide event timeline.  Changes of the core state, of each app's state, of Notecard
+// transactions and of low-power mode are recorded with their time into a ring of recent
+// events, from ISRs as well as from tasks.  The 'timeline' console command writes them out as
+// Chrome trace events, one complete event per line with the duration running until the next
+// change on the same track, which when saved to a file can be opened by chrome://tracing or
+// by Perfetto to show how they overlap, the format allowing the array to be left open so that
+// nothing need follow the last event.  Idle periods of each track, such as an app that is
+// deactivated or a processor that is running, are left as gaps.  Recording is paused while
+// the events are written, and 'timeline reset' clears them.  When TIMELINE_ON is false, the
+// TIMELINE macro compiles to nothing.
+
+#include "framework.h"
+
+#if TIMELINE_ON
+
+// Tracks, which are the trace's thread IDs, with those of apps following the fixed ones
+#define TIMELINE_TID_APPS       16
+
+// Recorded events
+typedef struct {
+    uint32_t ms;
+    uint8_t track;
+    uint8_t id;
+    int16_t state;
+} timelineEvent;
+static timelineEvent ring[TIMELINE_EVENTS];
+static uint32_t ringNext = 0;
+static uint32_t ringCount = 0;
+
+// Writing out, which is done a few events per call so that the console task never holds
+// the processor for long
+static bool dumping = false;
+static uint32_t dumpNext = 0;
+#define TIMELINE_DUMP_EVENTS    8
+
+// Names of the core states
+static const char *coreStateName[] = {
+    "unknown", "lowpower", "rx", "rx-timeout", "rx-error", "tx", "tx-timeout", "tw-open", "rx-window-open",
+};
+
+// Forwards
+timelineEvent *timelineAt(uint32_t i);
+bool timelineIsGap(timelineEvent *e);
+uint32_t timelineTid(timelineEvent *e);
+void timelineEventName(timelineEvent *e, char *name, uint32_t nameLen);
+
+// Record an event, which may be called from an ISR
+void timelineRecord(uint8_t track, uint8_t id, int16_t state)
+{
+    uint32_t ms = (uint32_t) TIMER_IF_GetTimeMs();
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (!dumping) {
+        timelineEvent *e = &ring[ringNext];
+        e->ms = ms;
+        e->track = track;
+        e->id = id;
+        e->state = state;
+        ringNext = (ringNext + 1) % TIMELINE_EVENTS;
+        if (ringCount < TIMELINE_EVENTS) {
+            ringCount++;
+        }
+    }
+    __set_PRIMASK(primask);
+}
+
+// Record the low-power mode being entered, or 0 when running again
+void timelineLowPower(uint8_t mode)
+{
+    timelineRecord(TIMELINE_LPM, 0, mode);
+}
+
+// Get the i'th oldest event
+timelineEvent *timelineAt(uint32_t i)
+{
+    return &ring[(ringNext + TIMELINE_EVENTS - ringCount + i) % TIMELINE_EVENTS];
+}
+
+// See whether an event begins an idle period of its track, which isn't shown
+bool timelineIsGap(timelineEvent *e)
+{
+    switch (e->track) {
+    case TIMELINE_NOTECARD:
+    case TIMELINE_LPM:
+        return (e->state == 0);
+    case TIMELINE_APP:
+        return (e->state == STATE_DEACTIVATED);
+    }
+    return false;
+}
+
+// Get the trace's thread ID for an event's track
+uint32_t timelineTid(timelineEvent *e)
+{
+    return (e->track == TIMELINE_APP) ? (TIMELINE_TID_APPS + e->id) : (1 + e->track);
+}
+
+// Get the name of the state that an event begins
+void timelineEventName(timelineEvent *e, char *name, uint32_t nameLen)
+{
+    switch (e->track) {
+    case TIMELINE_CORE:
+        strlcpy(name, (e->state < (sizeof(coreStateName)/sizeof(coreStateName[0]))) ? coreStateName[e->state] : "?", nameLen);
+        break;
+    case TIMELINE_APP:
+        schedStateName(e->state, name, nameLen);
+        break;
+    case TIMELINE_NOTECARD:
+        strlcpy(name, "transaction", nameLen);
+        break;
+    case TIMELINE_LPM:
+        strlcpy(name, (e->state == 2) ? "stop2" : "sleep", nameLen);
+        break;
+    default:
+        strlcpy(name, "?", nameLen);
+        break;
+    }
+}
+
+// Write out the next few events in Chrome trace format, returning true until all have been
+// written, or clear them
+bool timelineShow(bool reset)
+{
+    if (reset) {
+        ringNext = ringCount = 0;
+        APP_PRINTF("TIMELINE RESET\r\n");
+        return false;
+    }
+
+    // Begin with the names of the tracks
+    if (!dumping) {
+        dumping = true;
+        dumpNext = 0;
+        APP_PRINTF("[\r\n");
+        APP_PRINTF("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"core\"}},\r\n", 1 + TIMELINE_CORE);
+        APP_PRINTF("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"notecard\"}},\r\n", 1 + TIMELINE_NOTECARD);
+        APP_PRINTF("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"lpm\"}},\r\n", 1 + TIMELINE_LPM);
+        for (int i=0; i<schedAppCount(); i++) {
+            APP_PRINTF("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\r\n", TIMELINE_TID_APPS + i, schedAppName(i));
+        }
+        return true;
+    }
+
+    // Each event lasts until the next on its track, or until now if it's the last
+    uint32_t nowMs = (uint32_t) TIMER_IF_GetTimeMs();
+    for (int n=0; n<TIMELINE_DUMP_EVENTS && dumpNext < ringCount; n++, dumpNext++) {
+        timelineEvent *e = timelineAt(dumpNext);
+        if (timelineIsGap(e)) {
+            continue;
+        }
+        uint32_t endMs = nowMs;
+        for (uint32_t j=dumpNext+1; j<ringCount; j++) {
+            timelineEvent *next = timelineAt(j);
+            if (next->track == e->track && next->id == e->id) {
+                endMs = next->ms;
+                break;
+            }
+        }
+        char name[24];
+        timelineEventName(e, name, sizeof(name));
+        APP_PRINTF("{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%u000,\"dur\":%u000,\"pid\":1,\"tid\":%d},\r\n",
+                   name, e->ms, endMs - e->ms, timelineTid(e));
+    }
+    if (dumpNext < ringCount) {
+        return true;
+    }
+    dumping = false;
+    return false;
+}
+
+#endif
@@ -5,6 +5,9 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "stm32_timer.h"
+#include "stm32_seq.h"
+#include "utilities_def.h"
 #include "framework.h"
 #include "main.h"
 #include "stm32wlxx_ll_gpio.h"
@@ -12,10 +15,42 @@
 // The current identity of the subject of the tracing
 char traceID[40] = {0};
 
+// Per-subsystem verbosity for TRACE_EVENT
+uint8_t traceLevel[TRACE_SUBSYSTEMS] = {
+    TRACE_SUBSYSTEM_LEVEL, TRACE_SUBSYSTEM_LEVEL, TRACE_SUBSYSTEM_LEVEL, TRACE_SUBSYSTEM_LEVEL,
+    TRACE_SUBSYSTEM_LEVEL, TRACE_SUBSYSTEM_LEVEL, TRACE_SUBSYSTEM_LEVEL,
+};
+#if DEBUGGER_ON
+static const char *traceSubsystemName[TRACE_SUBSYSTEMS] = {
+    "app", "radio", "atp", "sched", "tw", "gateway", "flash",
+};
+#endif
+
 // Forwards
-bool commonCmd(char *cmd);
 bool commonCharCmd(char ch);
+traceCmdFn traceCmdFind(char *cmd, char **args);
+void traceCmdExecute(char *cmd);
+bool cmdTraceOn(char *args);
+bool cmdTraceLevel(char *args);
+bool cmdNoteTrace(char *args);
+bool cmdTest(char *args);
+bool cmdTestRef(char *args);
+bool cmdRestart(char *args);
+bool cmdPool(char *args);
+bool cmdMem(char *args);
+bool cmdProf(char *args);
+bool cmdBench(char *args);
+bool cmdProbe(char *args);
+bool cmdTimeline(char *args);
+bool cmdLatency(char *args);
+bool cmdPower(char *args);
+bool cmdAtpSim(char *args);
+bool cmdAtpAppend(char *args);
+void restartEvent(void *context);
 void probePin(GPIO_TypeDef *GPIOx, char *pinprefix);
+uint32_t traceDigits(int32_t value);
+void tracePutString(uint8_t *fifo, uint16_t fifoSize, uint16_t *pos, const char *s);
+void tracePutNumber(uint8_t *fifo, uint16_t fifoSize, uint16_t *pos, int32_t value);
 
 // Return the trace prefix
 char *tracePeer()
@@ -68,15 +103,202 @@ void traceSetID(const char *state, const uint8_t *address, uint32_t requestID)
     }
 }
 
+// Number of characters needed to display a value in decimal
+uint32_t traceDigits(int32_t value)
+{
+    uint32_t digits = (value < 0) ? 2 : 1;
+    uint32_t u = (value < 0) ? (uint32_t) 0 - (uint32_t) value : (uint32_t) value;
+    while (u >= 10) {
+        u /= 10;
+        digits++;
+    }
+    return digits;
+}
+
+// Copy a string into the trace FIFO, which wraps
+void tracePutString(uint8_t *fifo, uint16_t fifoSize, uint16_t *pos, const char *s)
+{
+    uint16_t p = *pos;
+    while (*s != '\0') {
+        fifo[p] = (uint8_t) *s++;
+        p = (p + 1 == fifoSize) ? 0 : p + 1;
+    }
+    *pos = p;
+}
+
+// Write a value into the trace FIFO in decimal
+void tracePutNumber(uint8_t *fifo, uint16_t fifoSize, uint16_t *pos, int32_t value)
+{
+    char buf[12];
+    char *s = &buf[sizeof(buf)-1];
+    *s = '\0';
+    uint32_t u = (value < 0) ? (uint32_t) 0 - (uint32_t) value : (uint32_t) value;
+    do {
+        *--s = (char) ('0' + (u % 10));
+        u /= 10;
+    } while (u != 0);
+    if (value < 0) {
+        *--s = '-';
+    }
+    tracePutString(fifo, fifoSize, pos, s);
+}
+
+// Write a fixed-field event directly into the trace FIFO.  The length is computed up front
+// so that the line can be allocated in place, avoiding both printf and the staging copy.
+// When LOG_DEFERRED is enabled these lines may appear ahead of APP_PRINTF lines that are
+// still queued.
+void traceEvent(uint32_t level, const char *event, const traceField *fields, uint32_t fieldCount)
+{
+    const char *peer = tracePeer();
+    uint32_t length = strlen(event) + 2;
+    if (peer[0] != '\0') {
+        length += strlen(peer) + 1;
+    }
+    for (uint32_t i=0; i<fieldCount; i++) {
+        length += 1 + strlen(fields[i].name) + 1 + traceDigits(fields[i].value);
+    }
+    if (length > UTIL_ADV_TRACE_TMP_BUF_SIZE) {
+        return;
+    }
+
+    // A full FIFO drops the line rather than waiting for the UART
+    uint8_t *fifo;
+    uint16_t fifoSize, pos;
+    if (UTIL_ADV_TRACE_COND_ZCSend_Allocation(level, T_REG_OFF, TS_OFF, (uint16_t) length, &fifo, &fifoSize, &pos) != UTIL_ADV_TRACE_OK) {
+        return;
+    }
+    if (peer[0] != '\0') {
+        tracePutString(fifo, fifoSize, &pos, peer);
+        tracePutString(fifo, fifoSize, &pos, " ");
+    }
+    tracePutString(fifo, fifoSize, &pos, event);
+    for (uint32_t i=0; i<fieldCount; i++) {
+        tracePutString(fifo, fifoSize, &pos, " ");
+        tracePutString(fifo, fifoSize, &pos, fields[i].name);
+        tracePutString(fifo, fifoSize, &pos, ":");
+        tracePutNumber(fifo, fifoSize, &pos, fields[i].value);
+    }
+    tracePutString(fifo, fifoSize, &pos, "\r\n");
+    UTIL_ADV_TRACE_COND_ZCSend_Finalize();
+}
+
 #if DEBUGGER_ON
 
+// Commands common to both gateway and sensor
+static const traceCmd commonCmds[] = {
+    {"trace", "t", 0, cmdTraceOn},
+    {"trace", NULL, TRACE_CMD_ARGS, cmdTraceLevel},
+    {"note", "n", TRACE_CMD_GATEWAY, cmdNoteTrace},
+    {"test", "{\"req\":\"card.test\"}", 0, cmdTest},
+    {"test-ref", "{\"req\":\"card.test\",\"sku\":\"ref\"}", 0, cmdTestRef},
+    {"restart", NULL, 0, cmdRestart},
+    {"pool", NULL, 0, cmdPool},
+    {"mem", NULL, 0, cmdMem},
+    {"power", NULL, TRACE_CMD_ARGS, cmdPower},
+#if PROFILER_ON
+    {"prof", NULL, TRACE_CMD_ARGS, cmdProf},
+    {"bench", NULL, 0, cmdBench},
+#endif
+#if TIMELINE_ON
+    {"timeline", NULL, TRACE_CMD_ARGS, cmdTimeline},
+#endif
+#if LATENCY_ON
+    {"latency", NULL, TRACE_CMD_ARGS, cmdLatency},
+#endif
+#if ATP_SIM_ON
+    {"atpsim", NULL, TRACE_CMD_ARGS, cmdAtpSim},
+    {"atp+", NULL, TRACE_CMD_ARGS, cmdAtpAppend},
+#endif
+    {"probe", NULL, 0, cmdProbe},
+};
+static const uint32_t commonCmdCount = sizeof(commonCmds) / sizeof(commonCmds[0]);
+
 // See if trace input is available
 bool traceInputAvailable(void)
 {
     return MX_DBG_Available();
 }
 
-// Process trace input.
+// Registered command tables, the first of which is the common table
+static const traceCmd *cmdTables[TRACE_CMD_TABLES];
+static uint32_t cmdTableCounts[TRACE_CMD_TABLES];
+static uint32_t cmdTablesRegistered = 0;
+
+// A command whose handler has asked to be called again, and its arguments
+static traceCmdFn cmdPending = NULL;
+static char cmdPendingArgs[80];
+
+// State of a probe that is walking the ports one per call
+static uint32_t probePort = 0;
+
+// The next group of the benchmark suite, which is also run one per call
+static uint32_t benchGroup = 0;
+
+// Deferred restart, so that the message has time to drain to the console
+static UTIL_TIMER_Object_t restartTimer;
+static bool restartTimerCreated = false;
+
+// Register a table of console commands, returning false if there's no room for it
+bool traceCmdRegister(const traceCmd *cmds, uint32_t count)
+{
+    if (cmdTablesRegistered == 0) {
+        cmdTables[cmdTablesRegistered] = commonCmds;
+        cmdTableCounts[cmdTablesRegistered++] = commonCmdCount;
+    }
+    if (cmdTablesRegistered >= TRACE_CMD_TABLES) {
+        return false;
+    }
+    cmdTables[cmdTablesRegistered] = cmds;
+    cmdTableCounts[cmdTablesRegistered++] = count;
+    return true;
+}
+
+// Find the handler for a command line, pointing args at whatever follows the name
+traceCmdFn traceCmdFind(char *cmd, char **args)
+{
+    if (cmdTablesRegistered == 0) {
+        traceCmdRegister(NULL, 0);
+    }
+    for (uint32_t t=0; t<cmdTablesRegistered; t++) {
+        for (uint32_t i=0; i<cmdTableCounts[t]; i++) {
+            const traceCmd *c = &cmdTables[t][i];
+            if ((c->flags & TRACE_CMD_GATEWAY) != 0 && !appIsGateway) {
+                continue;
+            }
+            if (strcmp(cmd, c->name) == 0 || (c->alias != NULL && strcmp(cmd, c->alias) == 0)) {
+                *args = &cmd[strlen(cmd)];
+                return c->fn;
+            }
+            size_t len = strlen(c->name);
+            if ((c->flags & TRACE_CMD_ARGS) != 0 && strncmp(cmd, c->name, len) == 0 && cmd[len] == ' ') {
+                *args = &cmd[len+1];
+                return c->fn;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Dispatch a command line, remembering the command if it has more work to do
+void traceCmdExecute(char *cmd)
+{
+    char *args;
+    traceCmdFn fn = traceCmdFind(cmd, &args);
+    if (fn == NULL) {
+        MX_DBG_Enable();
+        APP_PRINTF("??\r\n");
+        return;
+    }
+    strlcpy(cmdPendingArgs, args, sizeof(cmdPendingArgs));
+    if (fn(cmdPendingArgs)) {
+        cmdPending = fn;
+        UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Console), CFG_SEQ_Prio_Console);
+    }
+}
+
+// Process trace input, which runs as the console task.  Only the characters already
+// received are consumed, and a command that has more to do is resumed before any new
+// line is dispatched.
 void traceInput(void)
 {
     static char cmd[80];
@@ -86,7 +308,15 @@ void traceInput(void)
     static char cmdTerm = '\n';
     static char cmdSkip = 0;
 
-    // For now, just echo the input
+    // Continue a command that isn't yet finished
+    if (cmdPending != NULL) {
+        if (cmdPending(cmdPendingArgs)) {
+            UTIL_SEQ_SetTask((1 << CFG_SEQ_Task_Console), CFG_SEQ_Prio_Console);
+            return;
+        }
+        cmdPending = NULL;
+    }
+
     while (MX_DBG_Available()) {
         char ch = MX_DBG_Receive(NULL, NULL);
         if (ch == '\r') {
@@ -99,14 +329,13 @@ void traceInput(void)
         if (ch == cmdTerm) {
             if (cmdChars != 0) {
                 cmd[cmdChars] = '\0';
-                if (!commonCmd(cmd)) {
-                    if (appIsGateway) {
-                        gatewayCmd(cmd);
-                    } else {
-                        sensorCmd(cmd);
-                    }
-                }
                 cmdChars = 0;
+                traceCmdExecute(cmd);
+
+                // Leave anything typed after a long command until it has finished
+                if (cmdPending != NULL) {
+                    return;
+                }
             }
             continue;
         }
@@ -131,7 +360,7 @@ bool commonCharCmd(char ch)
     // Display time
     if (ch == '=') {
         MX_DBG_Enable();
-        uint32_t localTimeSecs = NoteTimeST();
+        uint32_t localTimeSecs = appTime();
         int64_t localTimeMs = TIMER_IF_GetTimeMs();
         if (appIsGateway) {
             NoteSuspendTransactionDebug();
@@ -221,54 +450,216 @@ size_t trace(const char *message)
     return strlen(message);
 }
 
-// Execute console command
-bool commonCmd(char *cmd)
+// Turn trace on
+bool cmdTraceOn(char *args)
 {
+    MX_DBG_Enable();
+    APP_PRINTF("TRACE ON\r\n");
+    return false;
+}
 
-    // Turn trace on/off
-    if (strcmp(cmd, "trace") == 0 || strcmp(cmd, "t") == 0) {
-        MX_DBG_Enable();
-        APP_PRINTF("TRACE ON\r\n");
-        return true;
+// Set the verbosity of a subsystem's trace events, as "trace <subsystem> <level>"
+bool cmdTraceLevel(char *args)
+{
+    char *value = strchr(args, ' ');
+    if (value != NULL) {
+        *value++ = '\0';
+        for (int i=0; i<TRACE_SUBSYSTEMS; i++) {
+            if (strcmp(args, traceSubsystemName[i]) == 0) {
+                traceLevel[i] = (uint8_t) JAtoI(value);
+                MX_DBG_Enable();
+                APP_PRINTF("%s trace level %d\r\n", traceSubsystemName[i], traceLevel[i]);
+                return false;
+            }
+        }
     }
+    MX_DBG_Enable();
+    APP_PRINTF("trace <app|radio|atp|sched|tw|gateway|flash> <level>\r\n");
+    return false;
+}
 
-    // Turn notecard I/O trace on/off
-    if (appIsGateway && (strcmp(cmd, "note") == 0 || strcmp(cmd, "n") == 0)) {
-        NoteSetFnDebugOutput(trace);
-        MX_DBG_Enable();
-        APP_PRINTF("NOTECARD TRACE ON\r\n");
+// Turn notecard I/O trace on
+bool cmdNoteTrace(char *args)
+{
+    NoteSetFnDebugOutput(trace);
+    MX_DBG_Enable();
+    APP_PRINTF("NOTECARD TRACE ON\r\n");
+    return false;
+}
+
+// Perform a self-test
+bool cmdTest(char *args)
+{
+    post(POST_GPIO);
+    return false;
+}
+
+// Perform a self-test of the reference hardware
+bool cmdTestRef(char *args)
+{
+    post(POST_GPIO|POST_BME);
+    return false;
+}
+
+// Restart the module once the console has had a chance to drain
+void restartEvent(void *context)
+{
+    MX_DBG_Drain(1000);
+    appGatewaySnapshotSave();
+    NVIC_SystemReset();
+}
+
+// Restart the module
+bool cmdRestart(char *args)
+{
+    MX_DBG_Enable();
+    APP_PRINTF("restarting...\r\n");
+    if (!restartTimerCreated) {
+        restartTimerCreated = true;
+        UTIL_TIMER_Create(&restartTimer, 1000, UTIL_TIMER_ONESHOT, restartEvent, NULL);
+    }
+    UTIL_TIMER_Start(&restartTimer);
+    return false;
+}
+
+// Display buffer pool usage
+bool cmdPool(char *args)
+{
+    MX_DBG_Enable();
+    poolShow();
+    return false;
+}
+
+// Display how much of the heap and the stack has been used, and how much is left, for sizing
+// the peer table and the gateway's caches, and the stack that the linker reserves
+bool cmdMem(char *args)
+{
+    MX_DBG_Enable();
+    uint32_t highWater, freeBytes, largest;
+    MX_Heap_Usage(&highWater, &freeBytes, &largest);
+    APP_PRINTF("mem: heap %d bytes, high-water %d, free below it %d\r\n", MX_Heap_Size(NULL), highWater, freeBytes);
+    APP_PRINTF("     largest free block %d\r\n", largest);
+    uint32_t stackSize;
+    uint32_t stackUsed = MX_Stack_HighWater(&stackSize);
+    APP_PRINTF("     stack high-water %d of %d bytes%s\r\n", stackUsed, stackSize, stackUsed >= stackSize ? " *** OVERRUN ***" : "");
+    return false;
+}
+
+// Display how the time since the last reset has been split between running and each
+// low-power mode, what woke the processor, and what each app has cost, optionally resetting
+// the counters.  A sensor's health record, which carries only the totals, also resets them.
+bool cmdPower(char *args)
+{
+    MX_DBG_Enable();
+    bool reset = (strcmp(args, "reset") == 0);
+    char summary[160] = {0};
+    schedPowerSummary(summary, sizeof(summary), reset);
+    APP_PRINTF("power:%s\r\n", summary);
+    char costs[384] = {0};
+    schedCostSummary(costs, sizeof(costs), reset);
+    APP_PRINTF("cost:%s\r\n", costs);
+    return false;
+}
+
+#if PROFILER_ON
+// Display or reset the hot-path profile
+bool cmdProf(char *args)
+{
+    MX_DBG_Enable();
+    if (strcmp(args, "reset") == 0) {
+        profReset();
+        APP_PRINTF("PROFILE RESET\r\n");
+    } else if (strcmp(args, "mem") == 0) {
+        profBenchMem();
+    } else if (strcmp(args, "printf") == 0) {
+        profBenchPrintf();
+    } else {
+        profShow();
+    }
+    return false;
+}
+
+// Run the micro-benchmark suite, one group per call
+bool cmdBench(char *args)
+{
+    MX_DBG_Enable();
+    if (profBenchSuite(benchGroup++)) {
         return true;
     }
+    benchGroup = 0;
+    return false;
+}
+#endif
+
+#if TIMELINE_ON
+// Write out the timeline, a few events per call, or clear it
+bool cmdTimeline(char *args)
+{
+    MX_DBG_Enable();
+    return timelineShow(strcmp(args, "reset") == 0);
+}
+#endif
 
-    // Perform a self-test
-    if (strcmp(cmd, "{\"req\":\"card.test\"}") == 0 || strcmp(cmd, "test") == 0) {
-        post(POST_GPIO);
+#if LATENCY_ON
+// Display the latency from each app's interrupts to its poll function, or clear it
+bool cmdLatency(char *args)
+{
+    MX_DBG_Enable();
+    latencyShow(strcmp(args, "reset") == 0);
+    return false;
+}
+#endif
+
+#if ATP_SIM_ON
+// Replay the recorded ATP trace through alternative parameters one set per call, show the
+// trace, or clear it
+bool cmdAtpSim(char *args)
+{
+    MX_DBG_Enable();
+    if (strcmp(args, "reset") == 0) {
+        atpsimReset();
+        APP_PRINTF("ATPSIM RESET\r\n");
+        return false;
     }
-    if (strcmp(cmd, "{\"req\":\"card.test\",\"sku\":\"ref\"}") == 0 || strcmp(cmd, "test-ref") == 0) {
-        post(POST_GPIO|POST_BME);
+    if (strcmp(args, "show") == 0) {
+        return atpsimShow();
     }
+    return atpsimRun();
+}
 
-    // Restart the module
-    if (strcmp(cmd, "restart") == 0) {
-        MX_DBG_Enable();
-        APP_PRINTF("restarting...\r\n");
-        HAL_Delay(1000);
-        NVIC_SystemReset();
+// Append a packet to the ATP trace
+bool cmdAtpAppend(char *args)
+{
+    if (!atpsimAppend(args)) {
+        APP_PRINTF("atpsim: expected <txp> <rssi> <snr> or <txp> lost\r\n");
     }
+    return false;
+}
+#endif
 
-    // When debugging power issues, show state of all pins
-    if (strcmp(cmd, "probe") == 0) {
-        MX_DBG_Enable();
+// When debugging power issues, show state of all pins, one port per call so that the
+// console task never holds the processor for long
+bool cmdProbe(char *args)
+{
+    MX_DBG_Enable();
+    switch (probePort++) {
+    case 0:
         probePin(GPIOA, "PA");
+        return true;
+    case 1:
         probePin(GPIOB, "PB");
+        return true;
+    case 2:
         probePin(GPIOC, "PC");
+        return true;
+    case 3:
         probePin(GPIOH, "PH");
-        char buf[128];
-        MY_ActivePeripherals(buf, sizeof(buf));
-        APP_PRINTF("%s\r\n", buf);
         return true;
     }
-
+    char buf[128];
+    MY_ActivePeripherals(buf, sizeof(buf));
+    APP_PRINTF("%s\r\n", buf);
+    probePort = 0;
     return false;
 }
 
@@ -0,0 +1,245 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Monte-Carlo simulation of the time-window plan.  A number of sensors with a mix of
+// traffic are given slots by the same twSlotAssign() and twSlotUnitsForAirtime() that
+// twRefresh() uses, and find their windows with the same twSlotStartTime() that sensors
+// use, but with clocks that are synchronized to within a few ms and that drift between windows.  Their
+// exchanges contend for each channel with listen-before-talk as lbtListenBeforeTalk()
+// does it, and where two overlap the stronger survives if its signal is far enough above
+// the other's.  The collision rate and mean latency are reported both for the steady state
+// and for the random spread after a power failure, so that changes to the parameters can
+// be judged before they are rolled out.  The simulation is seeded identically on each run
+// so that its output can be compared across firmware versions.
+
+#include "framework.h"
+
+// Simulation parameters
+#define TWSIM_WINDOWS           16          // Windows simulated in the steady state
+#define TWSIM_DRIFT_PPM         50          // Worst-case drift of a sensor's clock
+#define TWSIM_SYNC_ERROR_MS     20          // Error in synchronizing it from the gateway's ACK
+#define TWSIM_WAKE_JITTER_MS    250         // Variation in when a sensor begins after its alarm
+#define TWSIM_BLIND_MS          RADIO_TURNAROUND_ALLOWANCE_MS   // Too soon after another begins for LBT to hear it
+#define TWSIM_CAPTURE_DB        6           // Margin by which the stronger of two overlapping frames survives
+#define TWSIM_RSSI_MIN          -125
+#define TWSIM_RSSI_MAX          -60
+#define TWSIM_LIGHT_PERCENT     70          // Traffic mix, with the remainder being heavy
+#define TWSIM_MEDIUM_PERCENT    25
+#define TWSIM_BASE_TIME         1700000000  // An arbitrary time at which the simulation begins
+
+// A simulated sensor, and its exchange within the window being simulated
+typedef struct {
+    uint32_t beginsSecs;
+    uint32_t endsSecs;
+    uint8_t channel;
+    uint8_t units;
+    int8_t rssi;
+    int32_t intendedMs;
+    int32_t startMs;
+    int32_t durationMs;
+    uint16_t retries;
+    bool pending;
+    bool collided;
+} twsimSensor;
+
+// Results of one scenario
+typedef struct {
+    uint32_t exchanges;
+    uint32_t collisions;
+    uint64_t latencyMs;
+} twsimResult;
+
+// Deterministic random numbers
+static uint32_t twsimSeed = 1;
+
+// Forwards
+uint32_t twsimRandom(uint32_t range);
+uint32_t twsimExchangeMs(void);
+void twsimContend(twsimSensor *s, uint32_t sensors, uint8_t channel, uint32_t retryPenaltyMs, twsimResult *result);
+uint32_t twsimTenthsPercent(uint32_t n, uint32_t d);
+
+// Get a random number in [0, range)
+uint32_t twsimRandom(uint32_t range)
+{
+    twsimSeed ^= twsimSeed << 13;
+    twsimSeed ^= twsimSeed >> 17;
+    twsimSeed ^= twsimSeed << 5;
+    return range ? (twsimSeed % range) : 0;
+}
+
+// The time taken by one message exchange, as counted by twMinimumModulusSecs()
+uint32_t twsimExchangeMs()
+{
+#if USE_MODEM_LORA
+    uint8_t sf = LORA_SPREADING_FACTOR;
+#else
+    uint8_t sf = 0;
+#endif
+    return radioMessageTimeOnAirMs(sf) + radioAckTimeOnAirMs(sf) + (RADIO_TURNAROUND_ALLOWANCE_MS*2);
+}
+
+// Resolve the contention among the pending exchanges on a channel, taking each in turn as it
+// begins.  One that begins while another is on the air listens again a period later if it
+// can hear it, and otherwise, or once it has run out of retries, transmits over it.  A
+// collided exchange is retried in the next window, for which it is charged the penalty.
+void twsimContend(twsimSensor *s, uint32_t sensors, uint8_t channel, uint32_t retryPenaltyMs, twsimResult *result)
+{
+    int active = -1;
+    int32_t busyUntilMs = 0;
+    for (;;) {
+
+        // Take the exchange that begins next
+        int next = -1;
+        for (uint32_t i=0; i<sensors; i++) {
+            if (s[i].pending && s[i].channel == channel && (next < 0 || s[i].startMs < s[next].startMs)) {
+                next = (int) i;
+            }
+        }
+        if (next < 0) {
+            break;
+        }
+        twsimSensor *p = &s[next];
+
+        // Listen before talk, if the channel is busy and we can hear it
+        if (active >= 0 && p->startMs < busyUntilMs) {
+            if (p->startMs - s[active].startMs >= TWSIM_BLIND_MS && p->retries > 0) {
+                p->retries--;
+                p->startMs += TW_LBT_PERIOD_MS;
+                continue;
+            }
+
+            // Collide, unless one is strong enough to capture the receiver
+            int margin = p->rssi - s[active].rssi;
+            if (margin < TWSIM_CAPTURE_DB) {
+                p->collided = true;
+            }
+            if (margin > -TWSIM_CAPTURE_DB) {
+                s[active].collided = true;
+            }
+
+        }
+
+        // Transmit
+        p->pending = false;
+        if (active < 0 || p->startMs + p->durationMs > busyUntilMs) {
+            active = next;
+            busyUntilMs = p->startMs + p->durationMs;
+        }
+
+    }
+
+    // Tally the exchanges on this channel
+    for (uint32_t i=0; i<sensors; i++) {
+        if (s[i].channel != channel) {
+            continue;
+        }
+        result->exchanges++;
+        result->latencyMs += (s[i].startMs - s[i].intendedMs) + s[i].durationMs;
+        if (s[i].collided) {
+            result->collisions++;
+            result->latencyMs += retryPenaltyMs;
+        }
+    }
+
+}
+
+// A ratio in tenths of a percent
+uint32_t twsimTenthsPercent(uint32_t n, uint32_t d)
+{
+    return d ? (uint32_t) (((uint64_t) n * 1000) / d) : 0;
+}
+
+// Simulate the given number of sensors, returning false if there is no memory to do so
+bool twsimRun(uint32_t sensors)
+{
+    twsimSensor *s = poolAlloc(sensors * sizeof(twsimSensor));
+    if (s == NULL) {
+        return false;
+    }
+    twsimSeed = 1;
+    uint32_t slotSecs = twMinimumModulusSecs();
+    uint32_t exchangeMs = twsimExchangeMs();
+
+    // Draw each sensor's traffic, and count the slots needed just as twRefresh() does
+    uint32_t dedicatedUnits = 0;
+    uint32_t sharingSensors = 0;
+    for (uint32_t i=0; i<sensors; i++) {
+        uint32_t mix = twsimRandom(100);
+        uint32_t airtimeMs;
+        if (mix < TWSIM_LIGHT_PERCENT) {
+            airtimeMs = twsimRandom(TW_AIRTIME_LIGHT_MS);
+        } else if (mix < TWSIM_LIGHT_PERCENT + TWSIM_MEDIUM_PERCENT) {
+            airtimeMs = TW_AIRTIME_LIGHT_MS + twsimRandom(TW_AIRTIME_HEAVY_MS - TW_AIRTIME_LIGHT_MS);
+        } else {
+            airtimeMs = TW_AIRTIME_HEAVY_MS + twsimRandom(TW_AIRTIME_HEAVY_MS * TW_SLOT_MAX_UNITS);
+        }
+        s[i].units = (uint8_t) twSlotUnitsForAirtime(true, airtimeMs);
+        s[i].rssi = (int8_t) (TWSIM_RSSI_MIN + (int) twsimRandom(TWSIM_RSSI_MAX - TWSIM_RSSI_MIN));
+        if (s[i].units == 0) {
+            sharingSensors++;
+        }
+        dedicatedUnits += s[i].units;
+    }
+    uint32_t sharedSlots = (sharingSensors + TW_SLOT_SHARED_SENSORS - 1) / TW_SLOT_SHARED_SENSORS;
+    uint32_t modulusSecs = (dedicatedUnits + sharedSlots) * slotSecs;
+    if (modulusSecs < slotSecs) {
+        modulusSecs = slotSecs;
+    }
+
+    // Assign the slots
+    uint32_t slotBeginsSecs = 0;
+    uint32_t sharedSensor = 0;
+    for (uint32_t i=0; i<sensors; i++) {
+        s[i].channel = twSlotAssign(s[i].units, &slotBeginsSecs, dedicatedUnits * slotSecs, &sharedSensor, &s[i].beginsSecs, &s[i].endsSecs);
+    }
+
+    // Simulate the steady state, in which each sensor wakes ahead of its slot in each window
+    // by a clock that was synchronized at its last exchange and has drifted since
+    twsimResult steady = {0};
+    uint32_t driftMaxMs = (uint32_t) (((uint64_t) modulusSecs * 1000 * TWSIM_DRIFT_PPM) / 1000000);
+    for (uint32_t w=0; w<TWSIM_WINDOWS; w++) {
+        uint32_t windowTime = TWSIM_BASE_TIME - (TWSIM_BASE_TIME % modulusSecs) + (w * modulusSecs);
+        for (uint32_t i=0; i<sensors; i++) {
+            // The sensor's clock is behind by this much, so its slot begins that late
+            int32_t clockErrorMs = (int32_t) twsimRandom(TWSIM_SYNC_ERROR_MS) + (int32_t) twsimRandom((driftMaxMs*2)+1) - (int32_t) driftMaxMs;
+            uint32_t expiresTime;
+            uint32_t beginsTime = twSlotStartTime(windowTime, 0, modulusSecs, s[i].beginsSecs, s[i].endsSecs, &expiresTime);
+            s[i].intendedMs = (int32_t) ((beginsTime - windowTime) * 1000) + clockErrorMs;
+            s[i].startMs = s[i].intendedMs + (int32_t) twsimRandom(TWSIM_WAKE_JITTER_MS);
+            s[i].durationMs = (int32_t) (exchangeMs * (s[i].units ? s[i].units : 1));
+            s[i].retries = TW_LBT_RETRIES;
+            s[i].pending = true;
+            s[i].collided = false;
+        }
+        for (uint8_t c=0; c<radioChannels(); c++) {
+            twsimContend(s, sensors, c, modulusSecs * 1000, &steady);
+        }
+    }
+
+    // Simulate the first windows after a power failure, when sensors have no time and
+    // spread themselves at random on the home channel
+    twsimResult startup = {0};
+    for (uint32_t i=0; i<sensors; i++) {
+        s[i].channel = 0;
+        s[i].intendedMs = (int32_t) (twsimRandom(TW_STARTUP_SPREAD_SECS) * 1000);
+        s[i].startMs = s[i].intendedMs + (int32_t) twsimRandom(TWSIM_WAKE_JITTER_MS);
+        s[i].durationMs = (int32_t) exchangeMs;
+        s[i].retries = TW_LBT_RETRIES;
+        s[i].pending = true;
+        s[i].collided = false;
+    }
+    twsimContend(s, sensors, 0, TW_STARTUP_SPREAD_SECS * 1000, &startup);
+    memset(s, '?', sensors * sizeof(twsimSensor));
+    poolFree(s);
+
+    // Report
+    uint32_t steadyTenths = twsimTenthsPercent(steady.collisions, steady.exchanges);
+    uint32_t startupTenths = twsimTenthsPercent(startup.collisions, startup.exchanges);
+    APP_PRINTF("twsim: %3d sensors, %4ds modulus: steady %d.%d%% collide, %dms latency; startup %d.%d%% collide, %dms latency\r\n",
+               sensors, modulusSecs,
+               steadyTenths / 10, steadyTenths % 10, steady.exchanges ? (uint32_t) (steady.latencyMs / steady.exchanges) : 0,
+               startupTenths / 10, startupTenths % 10, startup.exchanges ? (uint32_t) (startup.latencyMs / startup.exchanges) : 0);
+    return true;
+
+}
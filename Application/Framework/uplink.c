@@ -0,0 +1,152 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Wired uplink for gateways with a local computer on USART1.  The Notecard requests that the
+// gateway performs on behalf of sensors, which are the notes that they add along with anything
+// else they ask of the Notecard, are instead sent to the computer as framed records, and what
+// it sends back is taken as the Notecard's response.  The gateway's own housekeeping still
+// uses the Notecard.  Each record is the magic bytes, the payload length as 16 bits, the
+// payload, and a CRC-32 of the payload, all little-endian.  A request record's payload is the
+// exact text that the Notecard would have been sent, one newline-terminated line per request
+// or command, and the computer answers with a single record holding the response to its last
+// line.  A failed or missing response fails the request just as a Notecard I/O error would.
+
+#include "framework.h"
+#include "main.h"
+
+// Framing
+#define UPLINK_MAGIC0           0x53
+#define UPLINK_MAGIC1           0x57
+#define UPLINK_HEADER_BYTES     4
+#define UPLINK_CRC_BYTES        4
+
+// Whether the uplink is in use
+static bool uplinkActive = false;
+
+// Forwards
+bool uplinkSend(const char *payload, uint32_t len);
+char *uplinkReceive(void);
+
+// Open the uplink if it's configured
+bool uplinkInit()
+{
+    if (!GATEWAY_WIRED_UPLINK) {
+        return false;
+    }
+    MX_USART1_UART_Init();
+    uplinkActive = true;
+    APP_PRINTF("uplink: sensor requests go to USART1 at %d baud\r\n", USART1_BAUDRATE);
+    return true;
+}
+
+// See whether sensor requests are going to the uplink rather than the Notecard
+bool uplinkIsActive()
+{
+    return uplinkActive;
+}
+
+// Send a payload as a record
+bool uplinkSend(const char *payload, uint32_t len)
+{
+    if (len > 0xFFFF) {
+        return false;
+    }
+    uint8_t *record = (uint8_t *) poolAlloc(UPLINK_HEADER_BYTES + len + UPLINK_CRC_BYTES);
+    if (record == NULL) {
+        return false;
+    }
+    record[0] = UPLINK_MAGIC0;
+    record[1] = UPLINK_MAGIC1;
+    record[2] = (uint8_t) len;
+    record[3] = (uint8_t) (len >> 8);
+    memcpy(&record[UPLINK_HEADER_BYTES], payload, len);
+    uint32_t crc = utilCRC32(0, (uint8_t *) payload, len);
+    for (int i=0; i<UPLINK_CRC_BYTES; i++) {
+        record[UPLINK_HEADER_BYTES + len + i] = (uint8_t) (crc >> (i*8));
+    }
+    MX_USART1_UART_Transmit(record, UPLINK_HEADER_BYTES + len + UPLINK_CRC_BYTES, GATEWAY_WIRED_TIMEOUT_MS);
+    poolFree(record);
+    return true;
+}
+
+// Receive a record, returning its payload as a null-terminated string to be freed by the
+// caller, or NULL if none arrived intact
+char *uplinkReceive()
+{
+    uint8_t header[UPLINK_HEADER_BYTES];
+    if (!MX_USART1_UART_Receive(header, sizeof(header), GATEWAY_WIRED_TIMEOUT_MS)) {
+        APP_PRINTF("uplink: no response\r\n");
+        return NULL;
+    }
+    uint32_t len = header[2] | (header[3] << 8);
+    if (header[0] != UPLINK_MAGIC0 || header[1] != UPLINK_MAGIC1 || len > GATEWAY_WIRED_MAX_BYTES) {
+        APP_PRINTF("uplink: bad response header\r\n");
+        return NULL;
+    }
+    uint8_t *payload = (uint8_t *) poolAlloc(len + UPLINK_CRC_BYTES + 1);
+    if (payload == NULL) {
+        return NULL;
+    }
+    if (!MX_USART1_UART_Receive(payload, len + UPLINK_CRC_BYTES, GATEWAY_WIRED_TIMEOUT_MS)) {
+        APP_PRINTF("uplink: response truncated\r\n");
+        poolFree(payload);
+        return NULL;
+    }
+    uint32_t crc = 0;
+    for (int i=0; i<UPLINK_CRC_BYTES; i++) {
+        crc |= ((uint32_t) payload[len+i]) << (i*8);
+    }
+    if (crc != utilCRC32(0, payload, len)) {
+        APP_PRINTF("uplink: response has bad CRC\r\n");
+        poolFree(payload);
+        return NULL;
+    }
+    payload[len] = '\0';
+    return (char *) payload;
+}
+
+// Perform a request given as JSON text, one or more newline-terminated lines, returning the
+// response text to be freed by the caller, or NULL on failure, just as NoteRequestResponseJSON
+char *uplinkRequestResponseJSON(const char *reqJSON)
+{
+    if (!uplinkSend(reqJSON, strlen(reqJSON))) {
+        return NULL;
+    }
+    return uplinkReceive();
+}
+
+// Perform a request, which is freed, returning a response that reports an I/O error on
+// failure, just as NoteRequestResponse
+J *uplinkRequestResponse(J *req)
+{
+    if (req == NULL) {
+        return NULL;
+    }
+    char *reqJSON = JConvertToJSONString(req);
+    JDelete(req);
+    if (reqJSON == NULL) {
+        return NULL;
+    }
+    uint32_t len = strlen(reqJSON);
+    char *line = (char *) poolAlloc(len+2);
+    if (line == NULL) {
+        JFree(reqJSON);
+        return NULL;
+    }
+    memcpy(line, reqJSON, len);
+    line[len++] = '\n';
+    line[len] = '\0';
+    JFree(reqJSON);
+    char *rspJSON = uplinkRequestResponseJSON(line);
+    poolFree(line);
+    J *rsp = (rspJSON == NULL) ? NULL : JConvertFromJSONString(rspJSON);
+    if (rspJSON != NULL) {
+        poolFree(rspJSON);
+    }
+    if (rsp == NULL) {
+        rsp = JCreateObject();
+        JAddStringToObject(rsp, "err", "uplink: no valid response {io}");
+    }
+    return rsp;
+}
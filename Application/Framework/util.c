@@ -36,49 +36,64 @@ void utilAddressToText(const uint8_t *address, char *buf, uint32_t buflen)
     }
 }
 
-// Given an env var with a name and potentially a location in parens, extract them,
-// and the name buf must be SENSOR_NAME_MAX.
-void extractNameComponents(char *in, char *namebuf, char *olcbuf, uint32_t olcbuflen)
-{
+// Hex digit values plus one, indexed by character, so that non-hex characters are zero
+static const uint8_t hexDigitValuePlusOne[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
 
-    // Skip leading blanks
-    while (*in == ' ' && *in != '\0') {
-        in++;
+// Convert hex text in the format of utilAddressToText() back to an address, returning the
+// number of bytes decoded or -1 if the text isn't valid.  Text shorter than a full address
+// yields only its least significant bytes, at the start of the buffer, and any trailing odd
+// digit is ignored.
+int utilTextToAddress(const char *text, uint8_t *address)
+{
+    int len = strlen(text) / 2;
+    if (len > ADDRESS_LEN) {
+        return -1;
     }
-
-    // Copy name until a paren
-    uint32_t namelen = 0;
-    while (*in != '\0' && *in != '(') {
-        if (namebuf != NULL && namelen < (SENSOR_NAME_MAX-1)) {
-            namebuf[namelen++] = *in;
+    for (int i=len-1; i>=0; i--) {
+        uint8_t hi = hexDigitValuePlusOne[(uint8_t) *text++];
+        uint8_t lo = hexDigitValuePlusOne[(uint8_t) *text++];
+        if (hi == 0 || lo == 0) {
+            return -1;
         }
-        in++;
+        address[i] = ((hi-1) << 4) | (lo-1);
     }
+    return len;
+}
 
-    // Remove trailing whitespace and null-terminate
-    if (namebuf != NULL) {
-        while (namelen > 0 && namebuf[namelen-1] == ' ') {
-            namelen--;
-        }
-        namebuf[namelen] = '\0';
-    }
+// Get the value of a hex digit, or -1 if it isn't one
+int utilHexDigit(char ch)
+{
+    return (int) hexDigitValuePlusOne[(uint8_t) ch] - 1;
+}
 
-    // Extract OLC
-    if (olcbuf != NULL) {
-        *olcbuf = '\0';
-        if (*in == '[') {
-            size_t olclen = 0;
-            while (true) {
-                ++in;
-                if (*in == '\0' || *in == ']') {
-                    break;
-                }
-                if (olclen < (olcbuflen-1)) {
-                    olcbuf[olclen++] = *in;
-                }
-            }
-            olcbuf[olclen] = '\0';
-        }
+// Hash an address (FNV-1a) for use as a key in RAM-resident lookup tables
+uint32_t utilHashAddress(const uint8_t *address)
+{
+    uint32_t hash = 2166136261UL;
+    for (int i=0; i<ADDRESS_LEN; i++) {
+        hash = (hash ^ address[i]) * 16777619UL;
     }
+    return hash;
+}
 
+// Update a CRC-32 (IEEE 802.3) with more data, a nibble at a time to keep the table small
+uint32_t utilCRC32(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+    static const uint32_t nibbleTable[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+    crc = ~crc;
+    for (uint32_t i=0; i<len; i++) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ nibbleTable[crc & 0x0f];
+        crc = (crc >> 4) ^ nibbleTable[crc & 0x0f];
+    }
+    return ~crc;
 }
+
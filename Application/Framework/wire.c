@@ -0,0 +1,458 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Short-header frames.  Once a gateway has told a sensor its peer ID in an ACK, the two of
+// them may exchange encrypted frames whose carrier names the network by a hash of the
+// gateway's address and the sensor by that ID, rather than carrying both 12-byte addresses.
+// Within the encrypted header the request ID, offset and total length are sent as varints,
+// and the sender's telemetry only when it differs from what it last sent to the same peer.
+// The first chunk of a request always carries all of it, so that a receiver's view is never
+// stale for longer than an exchange.  Received frames are expanded into the full carrier and
+// message as soon as they arrive, so that everything downstream sees only one format, and
+// full-header frames are always still accepted.  A gateway only replies with short headers
+// to a sensor whose last frame used them.
+//
+// Short-header frames are encrypted and authenticated with AES CCM under the sensor's key,
+// and their truncated tag is checked before anything within them is parsed, so a forged or
+// corrupted frame costs the receiver a single pass through the AES peripheral.  The nonce is
+// the cleartext header and a frame counter that each sender starts at a random value on boot,
+// in which the direction bit keeps the gateway's and the sensor's nonces apart.
+
+#include "main.h"
+#include "framework.h"
+
+// Peer handles from which the gateway has most recently received a short-header frame
+#define WIRE_SHORT_PEERS            256
+static uint8_t shortPeers[WIRE_SHORT_PEERS/8];
+
+// The sensor's ID, as assigned by its gateway, or 0 if not yet known
+uint16_t wirePeerID = 0;
+
+// Which optional fields were present in the message last received
+uint8_t wireReceivedFields = MESSAGE_FIELDS_ALL;
+
+// The counter of frames that we've sent, which is part of each frame's nonce
+static uint32_t frameCounter = 0;
+static bool frameCounterSeeded = false;
+
+// The short-header frame last received, as it was heard
+static uint8_t receivedFrame[sizeof(wireMessageCarrier)];
+static uint16_t receivedFrameLen = 0;
+
+// Telemetry last sent, and the hash of the peer to which it was sent
+static uint32_t sentPeerHash = 0;
+static uint16_t sentMillivolts;
+static int8_t sentRSSI;
+static int8_t sentSNR;
+static int8_t sentTXP;
+static int8_t sentLTP;
+
+// Whether the message last received was expanded from a compact ACK, or was repeated by a relay
+bool wireReceivedCompact = false;
+bool wireReceivedRelayed = false;
+
+// Forwards
+static uint16_t wireShortNetwork(uint8_t *gatewayAddress);
+static void wireShortNonce(uint8_t *frame, uint8_t *nonce);
+static void wireCompactAckHeader(wireCompactAck *ack, uint8_t *header);
+static bool wireCompactAckExpand(uint8_t *key, wireCompactAck *ack, wireMessage *msg);
+static uint32_t wireShortCounterNext(void);
+
+// The network identifier of a gateway
+static uint16_t wireShortNetwork(uint8_t *gatewayAddress)
+{
+    return (uint16_t) utilHashAddress(gatewayAddress);
+}
+
+// Append an unsigned varint, seven bits per byte with the high bit set on all but the last
+uint32_t wirePutVarint(uint8_t *p, uint32_t value)
+{
+    uint32_t len = 0;
+    while (value >= 0x80) {
+        p[len++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    p[len++] = (uint8_t) value;
+    return len;
+}
+
+// Extract an unsigned varint, returning false if it's truncated or too long
+bool wireGetVarint(uint8_t **p, uint8_t *end, uint32_t *value)
+{
+    uint32_t v = 0;
+    for (int shift=0; shift<32; shift+=7) {
+        if (*p >= end) {
+            return false;
+        }
+        uint8_t b = *(*p)++;
+        v |= ((uint32_t) (b & 0x7F)) << shift;
+        if ((b & 0x80) == 0) {
+            *value = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Form the nonce of a frame from its cleartext header, which is followed by the frame counter
+static void wireShortNonce(uint8_t *frame, uint8_t *nonce)
+{
+    uint16_t headerLen = sizeof(wireShortCarrier) + MESSAGE_CCM_COUNTER_BYTES;
+    memset(nonce, 0, AES_CCM_NONCE_BYTES);
+    memcpy(nonce, &frame[offsetof(wireShortCarrier, Algorithm)], headerLen - offsetof(wireShortCarrier, Algorithm));
+}
+
+// See whether short-header frames may be sent to a peer, and if so return the sensor's ID
+bool wireShortPeer(uint8_t *address, uint16_t *retPeerID)
+{
+    if (!appIsGateway) {
+        if (wirePeerID == 0 || memcmp(address, gatewayAddress, ADDRESS_LEN) != 0) {
+            return false;
+        }
+        *retPeerID = wirePeerID;
+        return true;
+    }
+    int handle = flashConfigFindPeerHandle(address);
+    if (handle < 0 || handle >= WIRE_SHORT_PEERS || (shortPeers[handle/8] & (1 << (handle%8))) == 0) {
+        return false;
+    }
+    *retPeerID = (uint16_t) (handle + 1);
+    return true;
+}
+
+// On the gateway, note whether a sensor's last valid frame used a short header
+void wireShortPeerHeard(int handle, bool shortHeader)
+{
+    if (handle < 0 || handle >= WIRE_SHORT_PEERS) {
+        return;
+    }
+    if (shortHeader) {
+        shortPeers[handle/8] |= (1 << (handle%8));
+    } else {
+        shortPeers[handle/8] &= ~(1 << (handle%8));
+    }
+}
+
+// Format the carrier of a short-header frame, and its message in cleartext ready to be
+// sealed into the frame, returning the length of the message.  If delta, the frame is marked
+// with MESSAGE_FIELD_DELTA.
+uint16_t wireShortFormat(uint8_t *toAddress, uint16_t peerID, wireMessage *msg, bool delta, wireShortCarrier *frame, uint8_t *plain)
+{
+    frame->Version = MESSAGE_VERSION_SHORT;
+    frame->Algorithm = MESSAGE_ALG_CCM | (appIsGateway ? MESSAGE_SHORT_FROM_GATEWAY : 0);
+    frame->Network = wireShortNetwork(appIsGateway ? ourAddress : gatewayAddress);
+    frame->PeerID = peerID;
+
+    // Send telemetry when it changes, or in full to a different peer or in a request's first chunk
+    uint8_t fields = 0;
+    uint32_t peerHash = utilHashAddress(toAddress);
+    if (peerHash != sentPeerHash || (msg->Offset == 0 && (msg->Flags & MESSAGE_FLAG_ACK) == 0)) {
+        fields = MESSAGE_FIELDS_TELEMETRY;
+    } else {
+        fields |= (msg->Millivolts != sentMillivolts) ? MESSAGE_FIELD_MILLIVOLTS : 0;
+        fields |= (msg->RSSI != sentRSSI) ? MESSAGE_FIELD_RSSI : 0;
+        fields |= (msg->SNR != sentSNR) ? MESSAGE_FIELD_SNR : 0;
+        fields |= (msg->TXP != sentTXP) ? MESSAGE_FIELD_TXP : 0;
+        fields |= (msg->LTP != sentLTP) ? MESSAGE_FIELD_LTP : 0;
+    }
+    if (msg->Offset != 0) {
+        fields |= MESSAGE_FIELD_OFFSET;
+    }
+    if (msg->TotalLen != msg->Offset + msg->Len) {
+        fields |= MESSAGE_FIELD_TOTALLEN;
+    }
+    if (delta) {
+        fields |= MESSAGE_FIELD_DELTA;
+    }
+    sentPeerHash = peerHash;
+    sentMillivolts = msg->Millivolts;
+    sentRSSI = msg->RSSI;
+    sentSNR = msg->SNR;
+    sentTXP = msg->TXP;
+    sentLTP = msg->LTP;
+
+    // Format the header, followed by the body
+    uint16_t len = 0;
+    plain[len++] = msg->Flags;
+    plain[len++] = fields;
+    plain[len++] = msg->Len;
+    len += wirePutVarint(&plain[len], msg->RequestID);
+    if ((fields & MESSAGE_FIELD_OFFSET) != 0) {
+        len += wirePutVarint(&plain[len], msg->Offset);
+    }
+    if ((fields & MESSAGE_FIELD_TOTALLEN) != 0) {
+        len += wirePutVarint(&plain[len], msg->TotalLen);
+    }
+    if ((fields & MESSAGE_FIELD_MILLIVOLTS) != 0) {
+        plain[len++] = (uint8_t) msg->Millivolts;
+        plain[len++] = (uint8_t) (msg->Millivolts >> 8);
+    }
+    if ((fields & MESSAGE_FIELD_RSSI) != 0) {
+        plain[len++] = (uint8_t) msg->RSSI;
+    }
+    if ((fields & MESSAGE_FIELD_SNR) != 0) {
+        plain[len++] = (uint8_t) msg->SNR;
+    }
+    if ((fields & MESSAGE_FIELD_TXP) != 0) {
+        plain[len++] = (uint8_t) msg->TXP;
+    }
+    if ((fields & MESSAGE_FIELD_LTP) != 0) {
+        plain[len++] = (uint8_t) msg->LTP;
+    }
+    memcpy(&plain[len], msg->Body, msg->Len);
+    len += msg->Len;
+    return len;
+
+}
+
+// Seal a formatted short-header frame, numbering it, encrypting its message into it, and
+// appending the tag.  The frame is MESSAGE_CCM_COUNTER_BYTES+MESSAGE_CCM_TAG_BYTES longer
+// than the carrier and message alone.
+bool wireShortSeal(uint8_t *key, wireShortCarrier *frame, uint8_t *plain, uint16_t len)
+{
+    uint32_t counter = wireShortCounterNext();
+    for (int i=0; i<MESSAGE_CCM_COUNTER_BYTES; i++) {
+        frame->Message[i] = (uint8_t) (counter >> (i*8));
+    }
+    uint8_t nonce[AES_CCM_NONCE_BYTES];
+    wireShortNonce((uint8_t *) frame, nonce);
+    uint8_t *cipher = &frame->Message[MESSAGE_CCM_COUNTER_BYTES];
+    return MX_AES_CCM_Encrypt(key, nonce, (uint8_t *) frame, sizeof(wireShortCarrier) + MESSAGE_CCM_COUNTER_BYTES,
+                              plain, len, cipher, &cipher[len], MESSAGE_CCM_TAG_BYTES);
+}
+
+// Number the next frame that we seal, which is never the same as one before it since boot
+static uint32_t wireShortCounterNext()
+{
+    if (!frameCounterSeeded) {
+        frameCounter = MY_Random();
+        frameCounterSeeded = true;
+    }
+    return ++frameCounter;
+}
+
+// See whether the ACK of a chunk is to be compact, which the sensor decides when it sends the
+// chunk and the gateway when it receives it, so both must decide from the chunk alone
+bool wireCompactAckFor(bool shortHeader, uint8_t flags, uint32_t offset, uint32_t len, uint32_t totalLen)
+{
+    return RADIO_COMPACT_ACK && USE_MODEM_LORA && shortHeader && radioSpreadingFactor() != RADIO_SF_FSK
+           && (flags & (MESSAGE_FLAG_ACK|MESSAGE_FLAG_BEACON|MESSAGE_FLAG_WINDOW)) == 0
+           && offset != 0 && offset + len < totalLen;
+}
+
+// Form the cleartext header by which a compact ACK is authenticated, which is that of a
+// short-header frame from the gateway under a version of its own
+static void wireCompactAckHeader(wireCompactAck *ack, uint8_t *header)
+{
+    wireShortCarrier *carrier = (wireShortCarrier *) header;
+    carrier->Version = MESSAGE_VERSION_COMPACT_ACK;
+    carrier->Algorithm = MESSAGE_ALG_CCM | MESSAGE_SHORT_FROM_GATEWAY;
+    carrier->Network = ack->Network;
+    carrier->PeerID = ack->PeerID;
+    memcpy(carrier->Message, ack->Counter, MESSAGE_CCM_COUNTER_BYTES);
+}
+
+// On the gateway, seal a compact ACK to the sensor with the given ID into the frame
+bool wireCompactAckSeal(uint8_t *key, uint16_t peerID, wireCompactAckBody *body, uint8_t *frame)
+{
+    wireCompactAck *ack = (wireCompactAck *) frame;
+    ack->Network = wireShortNetwork(ourAddress);
+    ack->PeerID = peerID;
+    uint32_t counter = wireShortCounterNext();
+    for (int i=0; i<MESSAGE_CCM_COUNTER_BYTES; i++) {
+        ack->Counter[i] = (uint8_t) (counter >> (i*8));
+    }
+    uint8_t header[sizeof(wireShortCarrier) + MESSAGE_CCM_COUNTER_BYTES];
+    uint8_t nonce[AES_CCM_NONCE_BYTES];
+    wireCompactAckHeader(ack, header);
+    wireShortNonce(header, nonce);
+    return MX_AES_CCM_Encrypt(key, nonce, header, sizeof(header), (uint8_t *) body, sizeof(wireCompactAckBody),
+                              ack->Body, ack->Tag, MESSAGE_CCM_TAG_BYTES);
+}
+
+// On the sensor, authenticate and decrypt the compact ACK just received, and expand it into the
+// full carrier and an ACK message whose body is its wireCompactAckBody, returning false without
+// yielding any of it if it isn't from our gateway to us
+bool wireCompactAckOpen(uint8_t *key, wireMessage *msg)
+{
+    wireCompactAck ack;
+    if (wireReceivedLen != sizeof(ack) || wirePeerID == 0) {
+        return false;
+    }
+    memcpy(&ack, &wireReceivedCarrier, sizeof(ack));
+    return wireCompactAckExpand(key, &ack, msg);
+}
+
+// On the sensor, find the entry of the group ACK just received that's addressed to us, and
+// open it just as if it had been received as a compact ACK on its own
+bool wireGroupAckOpen(uint8_t *key, wireMessage *msg)
+{
+    wireGroupAck *group = (wireGroupAck *) &wireReceivedCarrier;
+    if (wireReceivedLen < sizeof(wireGroupAck) || wirePeerID == 0
+            || wireReceivedLen != sizeof(wireGroupAck) + (group->Count * sizeof(wireCompactAck))) {
+        return false;
+    }
+    for (int i=0; i<group->Count; i++) {
+        wireCompactAck ack;
+        memcpy(&ack, &group->Entry[i], sizeof(ack));
+        if (ack.PeerID == wirePeerID) {
+            return wireCompactAckExpand(key, &ack, msg);
+        }
+    }
+    return false;
+}
+
+// Authenticate and decrypt a compact ACK, expanding it into the received carrier and message
+static bool wireCompactAckExpand(uint8_t *key, wireCompactAck *ack, wireMessage *msg)
+{
+    if (ack->PeerID != wirePeerID || ack->Network != wireShortNetwork(gatewayAddress)) {
+        return false;
+    }
+    uint8_t header[sizeof(wireShortCarrier) + MESSAGE_CCM_COUNTER_BYTES];
+    uint8_t nonce[AES_CCM_NONCE_BYTES];
+    wireCompactAckBody body;
+    wireCompactAckHeader(ack, header);
+    wireShortNonce(header, nonce);
+    if (!MX_AES_CCM_Decrypt(key, nonce, header, sizeof(header), ack->Body, sizeof(ack->Body),
+                            (uint8_t *) &body, ack->Tag, MESSAGE_CCM_TAG_BYTES)) {
+        return false;
+    }
+    wireReceivedCarrier.Version = MESSAGE_VERSION_SHORT;
+    wireReceivedCarrier.Algorithm = MESSAGE_ALG_CCM;
+    wireReceivedCarrier.MessageLen = sizeof(ack->Body);
+    memcpy(wireReceivedCarrier.Sender, gatewayAddress, ADDRESS_LEN);
+    memcpy(wireReceivedCarrier.Receiver, ourAddress, ADDRESS_LEN);
+    memset(msg, 0, sizeof(wireMessage));
+    msg->Signature = MESSAGE_SIGNATURE;
+    msg->Flags = MESSAGE_FLAG_ACK;
+    msg->RequestID = body.RequestID;
+    msg->Len = sizeof(body);
+    msg->TotalLen = sizeof(body);
+    memcpy(msg->Body, &body, sizeof(body));
+    wireReceivedFields = 0;
+    wireReceivedCompact = true;
+    return true;
+}
+
+// Expand the short-header frame just received into the full carrier, in place, returning
+// false if it isn't a frame between us and our peer
+bool wireShortExpandCarrier()
+{
+    receivedFrameLen = 0;
+    if (wireReceivedLen <= sizeof(wireShortCarrier) + MESSAGE_CCM_COUNTER_BYTES + MESSAGE_CCM_TAG_BYTES
+            || wireReceivedLen > sizeof(receivedFrame)) {
+        return false;
+    }
+    memcpy(receivedFrame, &wireReceivedCarrier, wireReceivedLen);
+    wireShortCarrier *carrier = (wireShortCarrier *) receivedFrame;
+    uint16_t messageLen = wireReceivedLen - sizeof(wireShortCarrier);
+    if (messageLen > sizeof(wireReceivedCarrier.Message)) {
+        return false;
+    }
+
+    // A gateway hears its sensors by their IDs, and a sensor hears only its own gateway
+    bool fromGateway = (carrier->Algorithm & MESSAGE_SHORT_FROM_GATEWAY) != 0;
+    if (appIsGateway) {
+        if (fromGateway || carrier->Network != wireShortNetwork(ourAddress)) {
+            return false;
+        }
+        uint8_t sensorAddress[ADDRESS_LEN];
+        if (carrier->PeerID == 0 || !flashConfigPeerAddressByHandle(carrier->PeerID - 1, sensorAddress)) {
+            return false;
+        }
+        wireReceivedPeerHandle = carrier->PeerID - 1;
+        memcpy(wireReceivedCarrier.Sender, sensorAddress, ADDRESS_LEN);
+        memcpy(wireReceivedCarrier.Receiver, ourAddress, ADDRESS_LEN);
+    } else {
+        if (!fromGateway || wirePeerID == 0 || carrier->PeerID != wirePeerID
+                || carrier->Network != wireShortNetwork(gatewayAddress)) {
+            return false;
+        }
+        memcpy(wireReceivedCarrier.Sender, gatewayAddress, ADDRESS_LEN);
+        memcpy(wireReceivedCarrier.Receiver, ourAddress, ADDRESS_LEN);
+    }
+    wireReceivedCarrier.Algorithm = carrier->Algorithm & ~MESSAGE_SHORT_FROM_GATEWAY;
+    wireReceivedCarrier.MessageLen = messageLen;
+    memcpy(&wireReceivedCarrier.Message, carrier->Message, messageLen);
+    receivedFrameLen = wireReceivedLen;
+    return true;
+}
+
+// Authenticate and decrypt the message of the short-header frame just expanded, returning
+// false without yielding any of it if the frame's tag doesn't match
+bool wireShortOpen(uint8_t *key, uint8_t *plain, uint16_t *retLen)
+{
+    uint16_t headerLen = sizeof(wireShortCarrier) + MESSAGE_CCM_COUNTER_BYTES;
+    if (receivedFrameLen <= headerLen + MESSAGE_CCM_TAG_BYTES) {
+        return false;
+    }
+    uint16_t len = receivedFrameLen - headerLen - MESSAGE_CCM_TAG_BYTES;
+    uint8_t nonce[AES_CCM_NONCE_BYTES];
+    wireShortNonce(receivedFrame, nonce);
+    if (!MX_AES_CCM_Decrypt(key, nonce, receivedFrame, headerLen, &receivedFrame[headerLen], len,
+                            plain, &receivedFrame[headerLen+len], MESSAGE_CCM_TAG_BYTES)) {
+        return false;
+    }
+    *retLen = len;
+    return true;
+}
+
+// Expand an authenticated short header and its body into the full message, noting which of
+// the optional fields were present.  Telemetry that was omitted is left zero for the caller to
+// fill in from what it last knew of the peer.
+bool wireShortExpandMessage(uint8_t *plain, uint16_t len, wireMessage *msg)
+{
+    uint8_t *p = plain;
+    uint8_t *end = plain + len;
+    memset(msg, 0, sizeof(wireMessage));
+    if (len < 4) {
+        return false;
+    }
+    msg->Signature = MESSAGE_SIGNATURE;
+    msg->Flags = p[0];
+    uint8_t fields = p[1];
+    msg->Len = p[2];
+    p += 3;
+    uint32_t requestID, offset = 0, totalLen;
+    if (!wireGetVarint(&p, end, &requestID)) {
+        return false;
+    }
+    if ((fields & MESSAGE_FIELD_OFFSET) != 0 && !wireGetVarint(&p, end, &offset)) {
+        return false;
+    }
+    totalLen = offset + msg->Len;
+    if ((fields & MESSAGE_FIELD_TOTALLEN) != 0 && !wireGetVarint(&p, end, &totalLen)) {
+        return false;
+    }
+    msg->RequestID = requestID;
+    msg->Offset = offset;
+    msg->TotalLen = totalLen;
+    uint32_t telemetryLen = ((fields & MESSAGE_FIELD_MILLIVOLTS) != 0 ? 2 : 0)
+                            + ((fields & MESSAGE_FIELD_RSSI) != 0 ? 1 : 0)
+                            + ((fields & MESSAGE_FIELD_SNR) != 0 ? 1 : 0)
+                            + ((fields & MESSAGE_FIELD_TXP) != 0 ? 1 : 0)
+                            + ((fields & MESSAGE_FIELD_LTP) != 0 ? 1 : 0);
+    if ((uint32_t) (end - p) < telemetryLen + msg->Len || msg->Len > sizeof(msg->Body)) {
+        return false;
+    }
+    if ((fields & MESSAGE_FIELD_MILLIVOLTS) != 0) {
+        msg->Millivolts = (uint16_t) (p[0] | (p[1] << 8));
+        p += 2;
+    }
+    if ((fields & MESSAGE_FIELD_RSSI) != 0) {
+        msg->RSSI = (int8_t) *p++;
+    }
+    if ((fields & MESSAGE_FIELD_SNR) != 0) {
+        msg->SNR = (int8_t) *p++;
+    }
+    if ((fields & MESSAGE_FIELD_TXP) != 0) {
+        msg->TXP = (int8_t) *p++;
+    }
+    if ((fields & MESSAGE_FIELD_LTP) != 0) {
+        msg->LTP = (int8_t) *p++;
+    }
+    memcpy(msg->Body, p, msg->Len);
+    wireReceivedFields = fields;
+    return true;
+}
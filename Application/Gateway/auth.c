@@ -4,14 +4,277 @@
 
 #include "framework.h"
 
-// Allowed requests
-char *allowedRequests[] = {
-    "env.get",
-    "note.add",
-    "note.template",
-    "hub.log",
-    ""
+// Policies for the request types that sensors may issue.  A notefile must be an outbound
+// queue if AUTH_OUTBOUND_ONLY is set, and a note's body may have at most maxBodyFields
+// fields if nonzero.  Each sensor may issue at most perHour of each type in any hour
+// if nonzero, after which its requests of that type are refused until it slows down.
+#define AUTH_OUTBOUND_ONLY      0x01
+typedef struct {
+    const char *req;
+    uint8_t flags;
+    uint8_t maxBodyFields;
+    uint16_t perHour;
+} authPolicy;
+static const authPolicy policies[] = {
+    { "env.get",        0,                  0,  120 },
+    { "note.add",       AUTH_OUTBOUND_ONLY, 32, 720 },
+    { "note.template",  AUTH_OUTBOUND_ONLY, 32, 60 },
+    { "hub.log",        0,                  0,  120 },
+    { "survey.ping",    0,                  0,  1800 },
 };
+#define AUTH_POLICIES   (sizeof(policies) / sizeof(policies[0]))
+
+// Policies indexed by a hash of the request type, built on first use.  The table is more
+// than twice the size of the list so that a lookup almost never needs to probe.
+#define AUTH_POLICY_SLOTS   16
+static int8_t policySlot[AUTH_POLICY_SLOTS];
+static bool policySlotsBuilt = false;
+
+// Rate limiting state for the most recently active sensors, as a token bucket per
+// sensor and request type, in which each token is worth 1/perHour of an hour
+#define AUTH_RATE_SENSORS   16
+typedef struct {
+    uint32_t sensor;                // utilHashAddress() of the sensor
+    int64_t lastMs;
+    int64_t bucketMs[AUTH_POLICIES];
+} authRate;
+static authRate rates[AUTH_RATE_SENSORS];
+
+// Signal statistics aggregated over the pings of a site survey at one location, of which a
+// sensor in survey mode sends a rapid burst outside of its transmit window, as allowed by the
+// rate limit of its policy.  Only the summary is uploaded, as a single note, once the last
+// ping of the burst arrives.
+#define AUTH_SURVEY_SENSORS     4
+#define AUTH_SURVEY_NOTEFILE    "*#survey.qo"
+typedef struct {
+    int32_t min;
+    int32_t max;
+    int32_t sum;
+} authSurveyStat;
+#define AUTH_SURVEY_GTXDB       0
+#define AUTH_SURVEY_GRSSI       1
+#define AUTH_SURVEY_GRSNR       2
+#define AUTH_SURVEY_STXDB       3
+#define AUTH_SURVEY_SRSSI       4
+#define AUTH_SURVEY_SRSNR       5
+#define AUTH_SURVEY_STATS       6
+static const char * const surveyStatNames[AUTH_SURVEY_STATS] = {
+    "gtxdb", "grssi", "grsnr", "stxdb", "srssi", "srsnr",
+};
+typedef struct {
+    uint32_t sensor;                // utilHashAddress() of the sensor
+    uint32_t survey;                // The sensor's number for the location being surveyed
+    uint32_t received;
+    uint32_t lastSeq;
+    int64_t lastMs;
+    authSurveyStat stat[AUTH_SURVEY_STATS];
+} authSurvey;
+static authSurvey surveys[AUTH_SURVEY_SENSORS];
+
+// Forwards
+uint32_t authHash(const char *req);
+const authPolicy *authFindPolicy(const char *req);
+const char *authCheckPolicy(uint8_t *sensorAddress, const char *req, const char *file, uint32_t bodyFields);
+void authAppendStat(char *buf, uint32_t buflen, const char *label, int value);
+J *authSurveyPing(uint8_t *sensorAddress, J *req);
+
+// Hash a request type to a policy slot
+uint32_t authHash(const char *req)
+{
+    uint32_t hash = 2166136261UL;
+    for (; *req != '\0'; req++) {
+        hash = (hash ^ (uint8_t) *req) * 16777619UL;
+    }
+    return hash % AUTH_POLICY_SLOTS;
+}
+
+// Find the policy for a request type, or NULL if it isn't allowed
+const authPolicy *authFindPolicy(const char *req)
+{
+    if (!policySlotsBuilt) {
+        memset(policySlot, -1, sizeof(policySlot));
+        for (uint32_t i=0; i<AUTH_POLICIES; i++) {
+            uint32_t slot = authHash(policies[i].req);
+            while (policySlot[slot] >= 0) {
+                slot = (slot + 1) % AUTH_POLICY_SLOTS;
+            }
+            policySlot[slot] = (int8_t) i;
+        }
+        policySlotsBuilt = true;
+    }
+    uint32_t slot = authHash(req);
+    while (policySlot[slot] >= 0) {
+        if (strcmp(policies[policySlot[slot]].req, req) == 0) {
+            return &policies[policySlot[slot]];
+        }
+        slot = (slot + 1) % AUTH_POLICY_SLOTS;
+    }
+    return NULL;
+}
+
+// Check a request against its policy, returning NULL if it may proceed, or otherwise
+// the reason that it may not.  A request that may proceed counts toward its rate limit.
+const char *authCheckPolicy(uint8_t *sensorAddress, const char *req, const char *file, uint32_t bodyFields)
+{
+
+    // Look up the request type
+    const authPolicy *policy = authFindPolicy(req);
+    if (policy == NULL) {
+        return "request type not allowed";
+    }
+
+    // Only allow notes to be queued outbound, to either a plain or a secure queue
+    if ((policy->flags & AUTH_OUTBOUND_ONLY) != 0 && file != NULL) {
+        const char *type = strrchr(file, '.');
+        if (type != NULL && strcmp(type, ".qo") != 0 && strcmp(type, ".qos") != 0) {
+            return "notefile not allowed";
+        }
+    }
+    if (policy->maxBodyFields != 0 && bodyFields > policy->maxBodyFields) {
+        return "note body too large";
+    }
+    if (policy->perHour == 0) {
+        return NULL;
+    }
+
+    // Find the sensor's rate limiting state, replacing the least recently active one.  A
+    // bucket starts full, and is refilled by the time that has passed since.
+    uint32_t sensor = utilHashAddress(sensorAddress);
+    int64_t nowMs = TIMER_IF_GetTimeMs();
+    authRate *rate = &rates[0];
+    for (int i=0; i<AUTH_RATE_SENSORS; i++) {
+        if (rates[i].lastMs != 0 && rates[i].sensor == sensor) {
+            rate = &rates[i];
+            break;
+        }
+        if (rates[i].lastMs < rate->lastMs) {
+            rate = &rates[i];
+        }
+    }
+    if (rate->lastMs == 0 || rate->sensor != sensor) {
+        memset(rate, 0, sizeof(authRate));
+        rate->sensor = sensor;
+    }
+    rate->lastMs = nowMs;
+
+    // Allow the request if its bucket hasn't been drained, where the bucket holds the
+    // time by which the sensor is ahead of its allowance, up to an hour
+    int64_t tokenMs = (60*60*1000) / policy->perHour;
+    int64_t *bucketMs = &rate->bucketMs[policy - policies];
+    if (*bucketMs < nowMs) {
+        *bucketMs = nowMs;
+    }
+    if (*bucketMs + tokenMs > nowMs + (60*60*1000)) {
+        return "request rate limit exceeded";
+    }
+    *bucketMs += tokenMs;
+    return NULL;
+
+}
+
+// Append a labeled signal statistic to a message
+void authAppendStat(char *buf, uint32_t buflen, const char *label, int value)
+{
+    char number[24];
+    JItoA(value, number);
+    strlcat(buf, label, buflen);
+    strlcat(buf, number, buflen);
+}
+
+// Aggregate the signal of a survey ping.  For all but the last of the burst, return the
+// response to give the sensor instead of performing it.  For the last, rewrite it in place
+// as the note.add of the survey's summary and return NULL so that it's performed.
+J *authSurveyPing(uint8_t *sensorAddress, J *req)
+{
+
+    // Find the survey, beginning it anew if it's another location, replacing the sensor's
+    // survey that was least recently pinged
+    uint32_t sensor = utilHashAddress(sensorAddress);
+    uint32_t surveyID = (uint32_t) JGetInt(req, "survey");
+    uint32_t seq = (uint32_t) JGetInt(req, "seq");
+    uint32_t of = (uint32_t) JGetInt(req, "of");
+    authSurvey *s = &surveys[0];
+    for (int i=0; i<AUTH_SURVEY_SENSORS; i++) {
+        if (surveys[i].lastMs != 0 && surveys[i].sensor == sensor) {
+            s = &surveys[i];
+            break;
+        }
+        if (surveys[i].lastMs < s->lastMs) {
+            s = &surveys[i];
+        }
+    }
+    if (s->lastMs == 0 || s->sensor != sensor || s->survey != surveyID) {
+        memset(s, 0, sizeof(authSurvey));
+        s->sensor = sensor;
+        s->survey = surveyID;
+    }
+    s->lastMs = TIMER_IF_GetTimeMs();
+
+    // Aggregate the signal of the frame that carried the ping, unless it's a repeat
+    if (seq > s->lastSeq) {
+        int8_t v[AUTH_SURVEY_STATS];
+        appReceivedMessageStats(&v[AUTH_SURVEY_GTXDB], &v[AUTH_SURVEY_GRSSI], &v[AUTH_SURVEY_GRSNR],
+                                &v[AUTH_SURVEY_STXDB], &v[AUTH_SURVEY_SRSSI], &v[AUTH_SURVEY_SRSNR]);
+        for (int i=0; i<AUTH_SURVEY_STATS; i++) {
+            authSurveyStat *stat = &s->stat[i];
+            if (s->received == 0 || v[i] < stat->min) {
+                stat->min = v[i];
+            }
+            if (s->received == 0 || v[i] > stat->max) {
+                stat->max = v[i];
+            }
+            stat->sum += v[i];
+        }
+        s->received++;
+        s->lastSeq = seq;
+    }
+
+    // Until the last ping, just tell the sensor how many have arrived
+    if (seq < of) {
+        J *rsp = JCreateObject();
+        if (rsp != NULL) {
+            JAddNumberToObject(rsp, "pings", s->received);
+        }
+        return rsp;
+    }
+
+    // Rewrite the last as the summary, with the pings that never arrived counted as lost
+    J *body = JCreateObject();
+    if (body == NULL) {
+        return JCreateObject();
+    }
+    JAddNumberToObject(body, "survey", s->survey);
+    JAddNumberToObject(body, "pings", s->received);
+    JAddNumberToObject(body, "lost", (of > s->received) ? of - s->received : 0);
+    for (int i=0; i<AUTH_SURVEY_STATS; i++) {
+        char field[16];
+        authSurveyStat *stat = &s->stat[i];
+        strlcpy(field, surveyStatNames[i], sizeof(field));
+        strlcat(field, "_min", sizeof(field));
+        JAddNumberToObject(body, field, stat->min);
+        strlcpy(field, surveyStatNames[i], sizeof(field));
+        strlcat(field, "_max", sizeof(field));
+        JAddNumberToObject(body, field, stat->max);
+        strlcpy(field, surveyStatNames[i], sizeof(field));
+        strlcat(field, "_mean", sizeof(field));
+        JAddNumberToObject(body, field, s->received ? ((JNUMBER) stat->sum) / s->received : 0);
+    }
+    JDeleteItemFromObject(req, "req");
+    JAddStringToObject(req, "req", "note.add");
+    JDeleteItemFromObject(req, "file");
+    JAddStringToObject(req, "file", AUTH_SURVEY_NOTEFILE);
+    JDeleteItemFromObject(req, "survey");
+    JDeleteItemFromObject(req, "seq");
+    JDeleteItemFromObject(req, "of");
+    JDeleteItemFromObject(req, "body");
+    JAddItemToObject(req, "body", body);
+    JDeleteItemFromObject(req, "sync");
+    JAddBoolToObject(req, "sync", true);
+    APP_PRINTF("survey: location %d summarized from %d of %d pings\r\n", s->survey, s->received, of);
+    s->lastMs = 0;
+    return NULL;
+
+}
 
 // Check whether or not the sensor may issue this request to the notecard.  If
 // authorized, return NULL.  Otherwise, return the rsp that should be given
@@ -20,26 +283,17 @@ char *allowedRequests[] = {
 // kind of tests or transformations on the request that it likes (including
 // checking for certain notefiles), and is free to modify the incoming request
 // in order to bring it into compliance.
-J *authRequest(uint8_t *sensorAddress, char *sensorName, char *sensorLocationOLC, J *req)
+J *authRequest(uint8_t *sensorAddress, const char *sensorName, const char *sensorLocationOLC, J *req)
 {
     J *rsp = NULL;
 
-    // Look up the request in a list of allowed request types.
-    bool allowed = false;
+    // Check the request against the policy for its type
     char *reqType = JGetString(req, "req");
-    for (int i=0;; i++) {
-        if (allowedRequests[i][0] == '\0') {
-            break;
-        }
-        char *allowedreq = allowedRequests[i];
-        if (strcmp(reqType, allowedreq) == 0) {
-            allowed = true;
-            break;
-        }
-    }
-    if (!allowed) {
+    const char *reqFile = (JGetObjectItem(req, "file") != NULL) ? JGetString(req, "file") : NULL;
+    const char *err = authCheckPolicy(sensorAddress, reqType, reqFile, JGetArraySize(JGetObject(req, "body")));
+    if (err != NULL) {
         rsp = JCreateObject();
-        JAddStringToObject(rsp, "err", "request type not allowed");
+        JAddStringToObject(rsp, "err", err);
         return rsp;
     }
 
@@ -47,9 +301,7 @@ J *authRequest(uint8_t *sensorAddress, char *sensorName, char *sensorLocationOLC
     // is used during surveys.
     if (JGetBool(req, "radio")) {
         JDeleteItemFromObject(req, "radio");
-        char buf[24];
-        static char newMessage[256];
-        newMessage[0] = '\0';
+        char newMessage[256] = {0};
         char *text = JGetString(req, "text");
         if (text != NULL) {
             strlcat(newMessage, text, sizeof(newMessage));
@@ -57,24 +309,12 @@ J *authRequest(uint8_t *sensorAddress, char *sensorName, char *sensorLocationOLC
         }
         int8_t gtxdb, grssi, grsnr, stxdb, srssi, srsnr;
         appReceivedMessageStats(&gtxdb, &grssi, &grsnr, &stxdb, &srssi, &srsnr);
-        strlcat(newMessage, "gtxdb:", sizeof(newMessage));
-        JItoA(gtxdb, buf);
-        strlcat(newMessage, buf, sizeof(newMessage));
-        strlcat(newMessage, " grssi:", sizeof(newMessage));
-        JItoA(grssi, buf);
-        strlcat(newMessage, buf, sizeof(newMessage));
-        strlcat(newMessage, " grsnr:", sizeof(newMessage));
-        JItoA(grsnr, buf);
-        strlcat(newMessage, buf, sizeof(newMessage));
-        strlcat(newMessage, " stxdb:", sizeof(newMessage));
-        JItoA(stxdb, buf);
-        strlcat(newMessage, buf, sizeof(newMessage));
-        strlcat(newMessage, " srssi:", sizeof(newMessage));
-        JItoA(srssi, buf);
-        strlcat(newMessage, buf, sizeof(newMessage));
-        strlcat(newMessage, " srsnr:", sizeof(newMessage));
-        JItoA(srsnr, buf);
-        strlcat(newMessage, buf, sizeof(newMessage));
+        authAppendStat(newMessage, sizeof(newMessage), "gtxdb:", gtxdb);
+        authAppendStat(newMessage, sizeof(newMessage), " grssi:", grssi);
+        authAppendStat(newMessage, sizeof(newMessage), " grsnr:", grsnr);
+        authAppendStat(newMessage, sizeof(newMessage), " stxdb:", stxdb);
+        authAppendStat(newMessage, sizeof(newMessage), " srssi:", srssi);
+        authAppendStat(newMessage, sizeof(newMessage), " srsnr:", srsnr);
         if (text != NULL) {
             strlcat(newMessage, ")", sizeof(newMessage));
         }
@@ -82,6 +322,15 @@ J *authRequest(uint8_t *sensorAddress, char *sensorName, char *sensorLocationOLC
         JAddStringToObject(req, "text", newMessage);
     }
 
+    // Aggregate survey pings, performing only the summary of each location
+    if (strcmp(reqType, "survey.ping") == 0) {
+        rsp = authSurveyPing(sensorAddress, req);
+        if (rsp != NULL) {
+            return rsp;
+        }
+        reqType = JGetString(req, "req");
+    }
+
     // In order to save bandwidth over the air, look for a
     // "file" parameter that begins with the "*" character,
     // and if so subtitute the sensor's ID.  This is just an
@@ -106,3 +355,39 @@ J *authRequest(uint8_t *sensorAddress, char *sensorName, char *sensorLocationOLC
     return rsp;
 
 }
+
+// Check and transform a note that a sensor sent compactly, in the same way as authRequest()
+// does a J request, so that it can be written to the notecard without being expanded into
+// one.  The note's notefile is held in the file buffer, which may be rewritten in place.
+// If false is returned, the request is instead expanded and given to authRequest().
+bool authNote(uint8_t *sensorAddress, const char *sensorName, const char *sensorLocationOLC, compactNote *note, char *file, uint32_t filelen)
+{
+
+    // Check the note against the policy for its type, leaving any refusal to authRequest()
+    uint32_t bodyFields = 0;
+    for (int i=0; i<note->items; i++) {
+        bodyFields += note->item[i].inBody ? 1 : 0;
+    }
+    if (authCheckPolicy(sensorAddress, note->req, file, bodyFields) != NULL) {
+        return false;
+    }
+
+    // Substitute the sensor's ID for a leading "*" in the notefile, as above
+    if (file[0] == '*') {
+        char notefileID[64];
+        utilAddressToText(sensorAddress, notefileID, sizeof(notefileID));
+        strlcat(notefileID, &file[1], sizeof(notefileID));
+        if (strlcpy(file, notefileID, filelen) >= (size_t) filelen) {
+            return false;
+        }
+    }
+
+    // If this is a note.add, set the location as configured in env vars
+    if (strcmp(note->req, "note.add") == 0 && sensorLocationOLC[0] != '\0') {
+        compactNoteString(note, false, "olc", sensorLocationOLC);
+    }
+
+    // Done
+    return true;
+
+}
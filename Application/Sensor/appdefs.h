@@ -11,9 +11,11 @@
 #define USE_PIR                     true    // true for Reference sensor
 #define USE_BUTTON                  true    // button-press sends a message
 #define USE_PING_TEST               false   // for testing & locating sensors
+#define USE_VIB                     false   // vibration on A1, for monitoring motors
 
 // App init methods
 bool bmeInit(void);
 bool pirInit(void);
 bool pingInit(void);
 bool buttonInit(void);
+bool vibInit(void);
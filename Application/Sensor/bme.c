@@ -2,7 +2,7 @@
 // Use of this source code is governed by licenses granted by the
 // copyright holder including that found in the LICENSE file.
 
-#include <math.h>
+#include <stdlib.h>
 #include "main.h"
 #include "bme280/bme280.h"
 #include "appdefs.h"
@@ -10,22 +10,51 @@
 // Special request IDs
 #define REQUESTID_TEMPLATE          1
 
+// Time for the sensor to come out of power-on reset
+#define BME_POWER_UP_MS             2
+
 // The dynamic filename of the application specific queue.
 // NOTE: The Gateway will replace `*` with the originating node's ID.
 #define SENSORDATA_NOTEFILE         "*#air.qo"
 
+// The sensor is sampled every BME_SAMPLE_SECS, but a note is only sent when a value has
+// moved by more than its delta since the last note, or when BME_MAX_SILENCE_SECS have
+// passed without one.  Each note carries the min/max/mean of the samples since the last.
+// The sampling period adapts to the battery and link, up to BME_MAX_SILENCE_SECS.
+#define BME_SAMPLE_SECS             (10 * 60)
+#define BME_MAX_SILENCE_SECS        (60 * 60)
+#define BME_DELTA_TEMPERATURE       50              // 1/100 degrees C
+#define BME_DELTA_HUMIDITY          (2 * 1024)      // 1/1024 %RH
+#define BME_DELTA_PRESSURE          100             // Pa
+
 // TRUE if we've successfully registered the template
 static bool templateRegistered = false;
 
-// An instance of an env sample
+// The last measurement, as compensated by the driver's integer path
 typedef struct {
-    double temperature;
-    double pressure;
-    double humidity;
+    int32_t temperature;        // 1/100 degrees C
+    uint32_t pressure;          // Pa
+    uint32_t humidity;          // 1/1024 %RH
 } envSample;
-static envSample envSamples[5];
 static envSample lastBME = {0};
 
+// Samples taken since the last note was sent
+typedef struct {
+    envSample min;
+    envSample max;
+    int32_t temperatureSum;
+    uint32_t humiditySum;
+    uint32_t samples;
+} envWindow;
+static envWindow window = {0};
+static envSample lastReported = {0};
+static bool reportedOnce = false;
+
+// The device, whose calibration data is read once and retained across sleeps even
+// though the sensor itself is powered down between measurements
+static struct bme280_dev dev;
+static bool devCalibrated = false;
+
 // Which I2C device we are using
 extern I2C_HandleTypeDef hi2c2;
 
@@ -38,33 +67,59 @@ static bool syncNow = false;
 // Our scheduled app's ID
 static int appID = -1;
 
+// The fields of the gateway's responses that we use, which are extracted without a J tree
+typedef struct {
+    char err[80];
+    int32_t id;
+} bmeRsp;
+static bmeRsp rspFields;
+static const schedField rspFieldsDeclared[] = {
+    SCHED_FIELD("err", SCHED_FIELD_STRING, bmeRsp, err),
+    SCHED_FIELD("id", SCHED_FIELD_INT, bmeRsp, id),
+    SCHED_FIELDS_END
+};
+
 // Forwards
-static bool bme280_read(struct bme280_dev *dev, struct bme280_data *comp_data);
+static bool bme280_start(struct bme280_dev *dev, uint32_t *retDelayMs);
+static bool bme280_finish(struct bme280_dev *dev, struct bme280_data *comp_data);
+static bool bme280_wake(struct bme280_dev *dev);
 static void bme280_delay_us(uint32_t period, void *intf_ptr);
 static int8_t bme280_i2c_read(uint8_t reg_addr, uint8_t *reg_data, uint32_t len, void *intf_ptr);
 static int8_t bme280_i2c_write(uint8_t reg_addr, const uint8_t *reg_data, uint32_t len, void *intf_ptr);
 static bool addNote(void);
+static bool bmeMeasureBegin(uint32_t *retDelayMs);
+static bool bmeMeasureEnd(void);
 static bool registerNotefileTemplate(void);
 static bool bmeUpdate(void);
+static bool bmeUpdateBegin(uint32_t *retDelayMs);
+static bool bmeUpdateEnd(void);
+static void bmeAggregate(void);
+static bool bmeReportDue(void);
 static void bmePoll(int appID, int state, void *appContext);
-static void bmeResponse(int appID, J *rsp, void *appContext);
+static void bmeResponse(int appID, void *rsp, void *appContext);
 
 // Scheduled App One-Time Init
 bool bmeInit()
 {
 
-    // Power on the sensor to see if it's here
+    // Power on the sensor to see if it's here, unless the inventory already says
     GPIO_InitTypeDef init = {0};
     init.Speed = GPIO_SPEED_FREQ_HIGH;
     init.Pin = BME_POWER_Pin;
     init.Mode = GPIO_MODE_OUTPUT_PP;
     init.Pull = GPIO_NOPULL;
     HAL_GPIO_Init(BME_POWER_GPIO_Port, &init);
-    HAL_GPIO_WritePin(BME_POWER_GPIO_Port, BME_POWER_Pin, GPIO_PIN_SET);
-    MX_I2C2_Init();
-    bool success = bmeUpdate();
-    MX_I2C2_DeInit();
-    HAL_GPIO_WritePin(BME_POWER_GPIO_Port, BME_POWER_Pin, GPIO_PIN_RESET);
+    bool success;
+    if (!appHardwareProbed(HARDWARE_BME280, &success)) {
+        HAL_GPIO_WritePin(BME_POWER_GPIO_Port, BME_POWER_Pin, GPIO_PIN_SET);
+        MY_I2C2_Acquire();
+        success = bmeUpdate();
+        MY_I2C2_Release();
+        HAL_GPIO_WritePin(BME_POWER_GPIO_Port, BME_POWER_Pin, GPIO_PIN_RESET);
+        appHardwareFound(HARDWARE_BME280, success);
+    } else {
+        HAL_GPIO_WritePin(BME_POWER_GPIO_Port, BME_POWER_Pin, GPIO_PIN_RESET);
+    }
     if (success) {
         appSetSKU(SKU_REFERENCE);
     } else {
@@ -74,12 +129,17 @@ bool bmeInit()
     // Register the app
     schedAppConfig config = {
         .name = "bme",
-        .activationPeriodSecs = 60 * 60,
+        .activationPeriodSecs = BME_SAMPLE_SECS,
+        .activationPeriodMinSecs = BME_SAMPLE_SECS / 2,
+        .activationPeriodMaxSecs = BME_MAX_SILENCE_SECS,
         .pollPeriodSecs = 15,
+        .alignToWindow = true,
         .activateFn = NULL,
         .interruptFn = NULL,
         .pollFn = bmePoll,
-        .responseFn = bmeResponse,
+        .responseFields = rspFieldsDeclared,
+        .responseStruct = &rspFields,
+        .responseFieldsFn = bmeResponse,
     };
     appID = schedRegisterApp(&config);
     if (appID < 0) {
@@ -91,9 +151,11 @@ bool bmeInit()
 
 }
 
-// Poller
+// Poller, which sleeps through the sensor's power-up and its conversion
 void bmePoll(int appID, int state, void *appContext)
 {
+    static bool ok;
+    uint32_t delayMs;
 
     // Disable if this isn't a reference sensor
     if (appSKU() != SKU_REFERENCE) {
@@ -101,29 +163,45 @@ void bmePoll(int appID, int state, void *appContext)
         return;
     }
 
-    // Switch based upon state
-    switch (state) {
+    SCHED_BEGIN(state);
 
-    case STATE_ACTIVATED:
-        if (!templateRegistered) {
-            registerNotefileTemplate();
-            schedSetCompletionState(appID, STATE_ACTIVATED, STATE_DEACTIVATED);
-            APP_PRINTF("bme: template registration request\r\n");
-            break;
-        }
-        if (!addNote()) {
-            schedSetState(appID, STATE_DEACTIVATED, "bme: update failure");
-        } else {
-            schedSetCompletionState(appID, STATE_DEACTIVATED, STATE_DEACTIVATED);
-            APP_PRINTF("bme: note queued\r\n");
+    // Register the template the first time, unless the gateway already holds it
+    if (!templateRegistered && registerNotefileTemplate()) {
+        APP_PRINTF("bme: template registration request\r\n");
+        SCHED_AWAIT_RESPONSE(appID, &ok);
+        if (!ok) {
+            SCHED_EXIT(appID, "bme: template registration failure");
         }
-        break;
+    }
+
+    // Measure
+    HAL_GPIO_WritePin(BME_POWER_GPIO_Port, BME_POWER_Pin, GPIO_PIN_SET);
+    SCHED_AWAIT_MS(appID, BME_POWER_UP_MS);
+    if (!bmeMeasureBegin(&delayMs)) {
+        SCHED_EXIT(appID, "bme: update failure");
+    }
+    SCHED_AWAIT_MS(appID, delayMs);
+    if (!bmeMeasureEnd()) {
+        SCHED_EXIT(appID, "bme: update failure");
+    }
 
+    // Report it if it's due
+    bmeAggregate();
+    if (!bmeReportDue()) {
+        SCHED_EXIT(appID, "bme: unchanged");
+    }
+    if (!addNote()) {
+        SCHED_EXIT(appID, "bme: update failure");
     }
+    APP_PRINTF("bme: note queued\r\n");
+    SCHED_AWAIT_RESPONSE(appID, &ok);
+
+    SCHED_END(appID, ok ? "bme: completed" : "bme: note failure");
 
 }
 
-// Register the notefile template for our data
+// Register the notefile template for our data, returning true if the gateway's response is to
+// be awaited, which it isn't if the gateway already holds the template
 static bool registerNotefileTemplate()
 {
 
@@ -157,230 +235,278 @@ static bool registerNotefileTemplate()
     JAddNumberToObject(body, "temperature", TFLOAT16);
     JAddNumberToObject(body, "humidity", TFLOAT16);
     JAddNumberToObject(body, "pressure", TFLOAT32);
+    JAddNumberToObject(body, "temperature_min", TFLOAT16);
+    JAddNumberToObject(body, "temperature_max", TFLOAT16);
+    JAddNumberToObject(body, "temperature_mean", TFLOAT16);
+    JAddNumberToObject(body, "humidity_min", TFLOAT16);
+    JAddNumberToObject(body, "humidity_max", TFLOAT16);
+    JAddNumberToObject(body, "humidity_mean", TFLOAT16);
+    JAddNumberToObject(body, "samples", TINT16);
     JAddNumberToObject(body, "voltage", TFLOAT32);
 
-    // Attach the body to the request, and send it to the gateway
+    // Attach the body to the request, and send it to the gateway unless it already holds it
     JAddItemToObject(req, "body", body);
+    if (noteTemplateKnown(req)) {
+        templateRegistered = true;
+        return false;
+    }
     noteSendToGatewayAsync(req, true);
     return true;
 
 }
 
 // Gateway Response handler
-void bmeResponse(int appID, J *rsp, void *appContext)
+void bmeResponse(int appID, void *rsp, void *appContext)
 {
+    bmeRsp *r = (bmeRsp *) rsp;
 
     // See if there's an error
-    char *err = JGetString(rsp, "err");
-    if (err[0] != '\0') {
-        APP_PRINTF("bme: gateway returned error: %s\r\n", err);
+    if (r->err[0] != '\0') {
+        APP_PRINTF("bme: gateway returned error: %s\r\n", r->err);
         return;
     }
 
     // Flash the LED if this is a response to this specific ping request
-    switch (JGetInt(rsp, "id")) {
+    switch (r->id) {
 
     case REQUESTID_TEMPLATE:
         templateRegistered = true;
+        noteTemplateRegistered();
         APP_PRINTF("bme: SUCCESSFUL template registration\r\n");
         break;
     }
 
 }
 
-// Send the sensor data
-static bool addNote()
+// Start a conversion by the sensor once it has powered up, returning how long it will take.
+// It is powered down again if this fails.
+static bool bmeMeasureBegin(uint32_t *retDelayMs)
 {
+    MY_I2C2_Acquire();
+    bool success = bmeUpdateBegin(retDelayMs);
+    MY_I2C2_Release();
+    if (!success) {
+        HAL_GPIO_WritePin(BME_POWER_GPIO_Port, BME_POWER_Pin, GPIO_PIN_RESET);
+        APP_PRINTF("bme: update failed\r\n");
+    }
+    return success;
+}
 
-    // Measure the sensor values
-    HAL_GPIO_WritePin(BME_POWER_GPIO_Port, BME_POWER_Pin, GPIO_PIN_SET);
-    MX_I2C2_Init();
-    bool success = bmeUpdate();
-    MX_I2C2_DeInit();
+// Read the conversion, and power the sensor down
+static bool bmeMeasureEnd()
+{
+    MY_I2C2_Acquire();
+    bool success = bmeUpdateEnd();
+    MY_I2C2_Release();
     HAL_GPIO_WritePin(BME_POWER_GPIO_Port, BME_POWER_Pin, GPIO_PIN_RESET);
     if (!success) {
         APP_PRINTF("bme: update failed\r\n");
-        return false;
     }
+    return success;
+}
 
-    // Create the request
-    J *req = NoteNewRequest("note.add");
-    if (req == NULL) {
-        return false;
+// Fold the latest measurement into the window of samples since the last note
+static void bmeAggregate()
+{
+    if (window.samples == 0) {
+        window.min = window.max = lastBME;
+    }
+    if (lastBME.temperature < window.min.temperature) {
+        window.min.temperature = lastBME.temperature;
+    }
+    if (lastBME.temperature > window.max.temperature) {
+        window.max.temperature = lastBME.temperature;
+    }
+    if (lastBME.humidity < window.min.humidity) {
+        window.min.humidity = lastBME.humidity;
+    }
+    if (lastBME.humidity > window.max.humidity) {
+        window.max.humidity = lastBME.humidity;
     }
+    window.temperatureSum += lastBME.temperature;
+    window.humiditySum += lastBME.humidity;
+    window.samples++;
+}
 
-    // Create the body
-    J *body = JCreateObject();
-    if (body == NULL) {
-        JDelete(req);
-        return false;
+// Decide whether the window should be reported, which is when anything has moved beyond
+// its delta since the last report or when we've been silent for too long
+static bool bmeReportDue()
+{
+    if (!reportedOnce || window.samples * BME_SAMPLE_SECS >= BME_MAX_SILENCE_SECS) {
+        return true;
+    }
+    if (abs(lastBME.temperature - lastReported.temperature) > BME_DELTA_TEMPERATURE) {
+        return true;
     }
+    if (abs((int32_t) lastBME.humidity - (int32_t) lastReported.humidity) > BME_DELTA_HUMIDITY) {
+        return true;
+    }
+    if (abs((int32_t) lastBME.pressure - (int32_t) lastReported.pressure) > BME_DELTA_PRESSURE) {
+        return true;
+    }
+    return false;
+}
 
-    // Set the target notefile
-    JAddStringToObject(req, "file", SENSORDATA_NOTEFILE);
+// Send the sensor data, along with the window that led up to it
+static bool addNote()
+{
+
+    // Write the request for the target notefile
+    compactNote note;
+    compactNoteBegin(&note, "note.add", SENSORDATA_NOTEFILE);
 
     // If immediate, sync now
     if (syncNow) {
         syncNow = false;
-        JAddBoolToObject(req, "sync", true);
+        compactNoteBool(&note, false, "sync", true);
     }
 
     // Fill-in the body
-    JAddNumberToObject(body, "temperature", lastBME.temperature);
-    JAddNumberToObject(body, "humidity", lastBME.humidity);
-    JAddNumberToObject(body, "pressure", lastBME.pressure);
-    APP_PRINTF("bme temperature: %d.%dC humidity:%d.%d%%\r\n",
-               (int) lastBME.temperature, (int) (fabs(lastBME.temperature*100)) % 100,
-               (int) lastBME.humidity, (int) (fabs(lastBME.humidity*100)) % 100);
+    compactNoteNumber(&note, true, "temperature", ((JNUMBER) lastBME.temperature) / 100);
+    compactNoteNumber(&note, true, "humidity", ((JNUMBER) lastBME.humidity) / 1024);
+    compactNoteNumber(&note, true, "pressure", (JNUMBER) lastBME.pressure);
+    compactNoteNumber(&note, true, "temperature_min", ((JNUMBER) window.min.temperature) / 100);
+    compactNoteNumber(&note, true, "temperature_max", ((JNUMBER) window.max.temperature) / 100);
+    compactNoteNumber(&note, true, "temperature_mean", ((JNUMBER) (window.temperatureSum / (int32_t) window.samples)) / 100);
+    compactNoteNumber(&note, true, "humidity_min", ((JNUMBER) window.min.humidity) / 1024);
+    compactNoteNumber(&note, true, "humidity_max", ((JNUMBER) window.max.humidity) / 1024);
+    compactNoteNumber(&note, true, "humidity_mean", ((JNUMBER) (window.humiditySum / window.samples)) / 1024);
+    compactNoteNumber(&note, true, "samples", window.samples);
+    uint32_t humidityCentiPct = (lastBME.humidity * 100) / 1024;
+    APP_PRINTF("bme temperature: %d.%02dC humidity:%d.%02d%%\r\n",
+               lastBME.temperature / 100, abs(lastBME.temperature) % 100,
+               humidityCentiPct / 100, humidityCentiPct % 100);
 
     // Add the voltage, just for convenient reference
 #ifdef USE_SPARROW
-    JAddNumberToObject(body, "voltage", MX_ADC_A0_Voltage());
+    compactNoteNumber(&note, true, "voltage", MX_ADC_A0_Voltage());
 #endif
 
-    // Attach the body to the request, and send it to the gateway
-    JAddItemToObject(req, "body", body);
-    noteSendToGatewayAsync(req, false);
+    // Send it to the gateway, starting a new window
+    noteSendNoteToGatewayAsync(&note, false);
+    lastReported = lastBME;
+    reportedOnce = true;
+    memset(&window, 0, sizeof(window));
     return true;
 
 }
 
-// Update the static temp/humidity/pressure values with the most accurate
-// values that we can by averaging several samples.
+// Update the static temp/humidity/pressure values with a single forced-mode measurement, in
+// which the sensor's own oversampling does the averaging that used to be done in software,
+// waiting for the sensor to power up and then to convert
 bool bmeUpdate()
 {
-    bool success = false;
+    uint32_t delayMs;
+    bme280_delay_us(BME_POWER_UP_MS * 1000, NULL);
+    if (!bmeUpdateBegin(&delayMs)) {
+        return false;
+    }
+    bme280_delay_us(delayMs * 1000, NULL);
+    return bmeUpdateEnd();
+}
+
+// Start a forced-mode measurement of a sensor that has powered up, returning how long it
+// will take to convert
+bool bmeUpdateBegin(uint32_t *retDelayMs)
+{
 
-    // Determine whether it's on primary or secondary address
-    struct bme280_dev dev;
+    // Identify and calibrate the sensor the first time, and just verify that it is the same one after
     dev.intf = BME280_I2C_INTF;
     dev.read = bme280_i2c_read;
     dev.write = bme280_i2c_write;
     dev.delay_us = bme280_delay_us;
     dev.intf_ptr = &bme_dev_addr;
     bme_dev_addr = BME280_I2C_ADDR_PRIM;
-    if (bme280_init(&dev) != BME280_INTF_RET_SUCCESS) {
-        return success;
-    }
-
-    // Allocate a sample buffer
-    lastBME.temperature = lastBME.humidity = lastBME.pressure = 0.0;
-
-    // Ignore the first two readings for settling purposes
-    struct bme280_data comp_data;
-    bme280_read(&dev, &comp_data);
-    bme280_read(&dev, &comp_data);
-
-    // Take a set of measurements, discarding data that is very high or very low.  We
-    // do this to get the most accurate sample possible.
-    int validSamples = 0;
-    int totalRetries = 0;
-    int maxRetries = (sizeof(envSamples) / sizeof(envSamples[0]))*2;
-    struct bme280_data prev_data = {0};
-    int samples = sizeof(envSamples) / sizeof(envSamples[0]);
-    for (int i=0; i<samples; i++) {
-
-        // Read the sample, and retry if I2C read failure
-        if (!bme280_read(&dev, &comp_data)) {
-            if (totalRetries++ < maxRetries) {
-                --i;
-            }
-            continue;
+    if (!devCalibrated) {
+        if (bme280_init(&dev) != BME280_OK) {
+            return false;
         }
-
-        // If we haven't yet converged, retry
-        if (totalRetries < maxRetries && i > 0) {
-            double tempPct = fabs((comp_data.temperature-prev_data.temperature)/prev_data.temperature);
-            double pressPct = fabs((comp_data.pressure-prev_data.pressure)/prev_data.pressure);
-            double humidPct = fabs((comp_data.humidity-prev_data.humidity)/prev_data.humidity);
-            bool retry = false;
-            if (tempPct >= 0.001) {
-                retry = true;
-            }
-            if (pressPct >= 0.0001) {
-                retry = true;
-            }
-            if (humidPct >= 0.005) {
-                retry = true;
-            }
-            if (retry) {
-                totalRetries++;
-                i = -1;
-                validSamples = 0;
-                continue;
-            }
-        }
-        memcpy(&prev_data, &comp_data, sizeof(struct bme280_data));
-
-        // Store the sample
-        envSamples[validSamples].temperature = comp_data.temperature;
-        envSamples[validSamples].pressure = comp_data.pressure;
-        envSamples[validSamples].humidity = comp_data.humidity;
-        validSamples++;
-
+        devCalibrated = true;
+    } else if (!bme280_wake(&dev)) {
+        return false;
     }
 
-    // Average the samples (assuming lastBME is already zero'ed)
-    if (validSamples) {
-        for (int i=0; i<validSamples; i++) {
-            lastBME.temperature += envSamples[i].temperature;
-            lastBME.pressure += envSamples[i].pressure;
-            lastBME.humidity += envSamples[i].humidity;
-        }
-        lastBME.temperature /= validSamples;
-        lastBME.pressure /= validSamples;
-        lastBME.humidity /= validSamples;
-        success = true;
+    // Start the conversion
+    if (!bme280_start(&dev, retDelayMs)) {
+        devCalibrated = false;
+        return false;
     }
+    return true;
 
-    // Put the sensor to sleep, to save power if we're leaving it on
-    bme280_set_sensor_mode(BME280_SLEEP_MODE, &dev);
+}
 
-    // Done
-    return success;
+// Take the measurement once the sensor has converted it
+bool bmeUpdateEnd()
+{
+    struct bme280_data comp_data;
+    if (!bme280_finish(&dev, &comp_data)) {
+        devCalibrated = false;
+        return false;
+    }
+    lastBME.temperature = comp_data.temperature;
+    lastBME.pressure = comp_data.pressure;
+    lastBME.humidity = comp_data.humidity;
+    return true;
+}
 
+// Verify that a sensor whose calibration is known, and which has come out of power-on
+// reset, is the one we calibrated against
+bool bme280_wake(struct bme280_dev *dev)
+{
+    uint8_t chip_id = 0;
+    if (bme280_get_regs(BME280_CHIP_ID_ADDR, &chip_id, 1, dev) != BME280_OK || chip_id != dev->chip_id) {
+        devCalibrated = false;
+        return false;
+    }
+    return true;
 }
 
-// BME280 sensor read
-bool bme280_read(struct bme280_dev *dev, struct bme280_data *comp_data)
+// Start one forced-mode conversion by the BME280, after which the sensor returns to sleep,
+// returning the worst-case conversion time of these settings
+bool bme280_start(struct bme280_dev *dev, uint32_t *retDelayMs)
 {
     int8_t rslt;
     uint8_t settings_sel;
 
-    dev->settings.osr_h = BME280_OVERSAMPLING_1X;
+    // The IIR filter would only smooth across conversions, and each wake does just one
+    dev->settings.osr_h = BME280_OVERSAMPLING_4X;
     dev->settings.osr_p = BME280_OVERSAMPLING_16X;
-    dev->settings.osr_t = BME280_OVERSAMPLING_2X;
-    dev->settings.filter = BME280_FILTER_COEFF_16;
-    dev->settings.standby_time = BME280_STANDBY_TIME_62_5_MS;
+    dev->settings.osr_t = BME280_OVERSAMPLING_4X;
+    dev->settings.filter = BME280_FILTER_COEFF_OFF;
 
     settings_sel = BME280_OSR_PRESS_SEL;
     settings_sel |= BME280_OSR_TEMP_SEL;
     settings_sel |= BME280_OSR_HUM_SEL;
-    settings_sel |= BME280_STANDBY_SEL;
     settings_sel |= BME280_FILTER_SEL;
     rslt = bme280_set_sensor_settings(settings_sel, dev);
-    if (rslt != BME280_INTF_RET_SUCCESS) {
+    if (rslt != BME280_OK) {
         return false;
     }
-    rslt = bme280_set_sensor_mode(BME280_NORMAL_MODE, dev);
-    if (rslt != BME280_INTF_RET_SUCCESS) {
+    rslt = bme280_set_sensor_mode(BME280_FORCED_MODE, dev);
+    if (rslt != BME280_OK) {
         return false;
     }
 
-    // Delay while the sensor completes a measurement
-    dev->delay_us(70000, dev->intf_ptr);
+    *retDelayMs = bme280_cal_meas_delay(&dev->settings) + 1;
+    return true;
+}
+
+// BME280 sensor read of the conversion just completed
+bool bme280_finish(struct bme280_dev *dev, struct bme280_data *comp_data)
+{
+    int8_t rslt;
     memset(comp_data, 0, sizeof(struct bme280_data));
     rslt = bme280_get_sensor_data(BME280_ALL, comp_data, dev);
-    if (rslt != BME280_INTF_RET_SUCCESS) {
+    if (rslt != BME280_OK) {
         return false;
     }
 
     // If the data looks bad, don't accept it.  (Humidity does operate
     // at the extremes, but these do not and we've seen these failures
     // concurrently, where temp == -40 and press == 110000 && humid == 100%)
-    if (comp_data->temperature == -40           // temperature_min
-            || comp_data->pressure == 30000.0       // pressure_min
-            || comp_data->pressure == 110000.0) {   // pressure_max
+    if (comp_data->temperature == -4000         // temperature_min
+            || comp_data->pressure == 30000         // pressure_min
+            || comp_data->pressure == 110000) {     // pressure_max
         return false;
     }
 
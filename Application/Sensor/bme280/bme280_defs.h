@@ -85,6 +85,11 @@
 
 /********************************************************/
 
+/* The STM32WL's Cortex-M4 has no FPU, so use the 32-bit integer compensation */
+#ifndef BME280_32BIT_ENABLE
+#define BME280_32BIT_ENABLE
+#endif
+
 #ifndef BME280_64BIT_ENABLE /*< Check if 64-bit integer (using BME280_64BIT_ENABLE) is enabled */
 #ifndef BME280_32BIT_ENABLE /*< Check if 32-bit integer (using BME280_32BIT_ENABLE) is enabled */
 #ifndef BME280_FLOAT_ENABLE /*< If any of the integer data types not enabled then enable BME280_FLOAT_ENABLE */
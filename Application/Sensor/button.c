@@ -13,10 +13,22 @@
 // Our scheduled app ID
 static int appID = -1;
 
+// The fields of the gateway's responses that we use, which are extracted without a J tree
+typedef struct {
+    char err[80];
+    int32_t id;
+} buttonRsp;
+static buttonRsp rspFields;
+static const schedField rspFieldsDeclared[] = {
+    SCHED_FIELD("err", SCHED_FIELD_STRING, buttonRsp, err),
+    SCHED_FIELD("id", SCHED_FIELD_INT, buttonRsp, id),
+    SCHED_FIELDS_END
+};
+
 // Forwards
 static void buttonISR(int appID, uint16_t pins, void *appContext);
 static void buttonPoll(int appID, int state, void *appContext);
-static void buttonResponse(int appID, J *rsp, void *appContext);
+static void buttonResponse(int appID, void *rsp, void *appContext);
 static bool sendHealthLogMessage(bool immediate);
 
 // Scheduled App One-Time Init
@@ -28,10 +40,15 @@ bool buttonInit()
         .name = "button",
         .activationPeriodSecs = 60 * 24,
         .pollPeriodSecs = 15,
+        .alignToWindow = true,
         .activateFn = NULL,
         .interruptFn = buttonISR,
+        .interruptPins = BUTTON1_Pin,
+        .priority = SCHED_PRIORITY_URGENT,
         .pollFn = buttonPoll,
-        .responseFn = buttonResponse,
+        .responseFields = rspFieldsDeclared,
+        .responseStruct = &rspFields,
+        .responseFieldsFn = buttonResponse,
     };
     appID = schedRegisterApp(&config);
     if (appID < 0) {
@@ -85,7 +102,7 @@ void buttonISR(int appID, uint16_t pins, void *appContext)
 
 }
 
-// Send a note to the health log, and request a reply just
+// Send a health record to the gateway, and request a reply just
 // as a validation of bidirectional communications continuity.
 // Note that this method uses "sensorIgnoreTimeWindow()" which
 // is NOT AT ALL a good practice because it can step on other
@@ -95,70 +112,38 @@ void buttonISR(int appID, uint16_t pins, void *appContext)
 bool sendHealthLogMessage(bool immediate)
 {
 
-    // Create the new request
-    J *req = NoteNewRequest("hub.log");
-    if (req == NULL) {
-        return false;
-    }
-
-    // Create a body for the request
-    J *body = JCreateObject();
-    if (body == NULL) {
-        JDelete(req);
-        return false;
-    }
-
-    // Format the health message
-    char message[80] = {0};
-    utilAddressToText(ourAddress, message, sizeof(message));
-    if (sensorName[0] != '\0') {
-        strlcat(message, " (", sizeof(message));
-        strlcat(message, sensorName, sizeof(message));
-        strlcat(message, ")", sizeof(message));
-    }
-    strlcat(message, " says hello", sizeof(message));
-    JAddStringToObject(req, "text", message);
-
-    // Notify the gateway that we wish to add RSSI/SNR info to the text
-    JAddBoolToObject(req, "radio", true);
-
-    // Add an ID to the request, which will be echo'ed
-    // back in the response by the notecard itself.  This
-    // helps us to identify the asynchronous response
-    // without needing to have an additional state.
-    JAddNumberToObject(req, "id", REQUESTID_MANUAL_PING);
-
     // If immediate send is requested, ignore the
     // time window and just send it now.  Also, set
     // the sync flag so that when it arrives on the
     // gateway it is synced immediately to the notehub.
     if (immediate) {
         sensorIgnoreTimeWindow();
-        JAddBoolToObject(req, "sync", true);
     }
 
-    // Send the request with the "true" argument meaning
-    // that the notecard's response should be sent
-    // all the way back from the gateway to us, rather
-    // than discarding the response.
-    noteSendToGatewayAsync(req, true);
+    // Send the record, which the gateway expands into a note
+    // of its health notefile along with the battery and signal
+    // of the message carrying it.  The ID is echo'ed back in
+    // the response, which is sent all the way back from the
+    // gateway to us, and helps us to identify it without
+    // needing to have an additional state.
+    noteSendHealthToGatewayAsync(REQUESTID_MANUAL_PING, immediate);
     return true;
 
 }
 
 // Gateway Response handler
-void buttonResponse(int appID, J *rsp, void *appContext)
+void buttonResponse(int appID, void *rsp, void *appContext)
 {
+    buttonRsp *r = (buttonRsp *) rsp;
 
     // See if there's an error
-    char *err = JGetString(rsp, "err");
-    if (err[0] != '\0') {
-        APP_PRINTF("button: gateway returned error: %s\r\n", err);
+    if (r->err[0] != '\0') {
+        APP_PRINTF("button: gateway returned error: %s\r\n", r->err);
         return;
     }
 
     // Flash the LED if this is a response to this specific ping request
-    switch (JGetInt(rsp, "id")) {
+    switch (r->id) {
 
     case REQUESTID_MANUAL_PING:
         ledIndicateAck(2);
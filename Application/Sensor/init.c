@@ -28,4 +28,9 @@ __weak void schedAppInit()
     pingInit();
 #endif
 
+    // Reports the vibration spectrum of a motor sensed on A1
+#if USE_VIB
+    vibInit();
+#endif
+
 }
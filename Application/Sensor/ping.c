@@ -4,11 +4,30 @@
 
 #include "appdefs.h"
 
-// If TRUE, we're in survey mode in which the button is used to send
-// pings that include RSSI/SNR transmitted at full power, and all
-// scheduled activities are disabled.
+// If TRUE, we're in survey mode in which the button is used to survey
+// the location with pings transmitted at full power, whose RSSI/SNR
+// the gateway summarizes, and all scheduled activities are disabled.
 #define SURVEY_MODE                 false
 
+// In survey mode, a press of the button surveys the location with a rapid burst of this many
+// pings, sent this far apart regardless of the transmit window.  The gateway aggregates the
+// signal of the burst and uploads a single summary note for the location.
+#define SURVEY_PINGS                20
+#define SURVEY_PING_INTERVAL_MS     1000
+
+// If TRUE, we're instead a load generator for measuring the gateway's capacity, emulating
+// LOAD_TEST_SENSORS logical sensors that each send a frame of LOAD_TEST_PAYLOAD_BYTES once per
+// LOAD_TEST_INTERVAL_SECS, spread evenly across the interval and each as its own exchange.
+// Every frame is numbered within its logical sensor's stream so that the gateway, which
+// absorbs them rather than passing them to its Notecard, can summarize the throughput,
+// latency and loss achieved (see its "stats" command).  If LOAD_TEST_IGNORE_TW, frames are
+// sent without waiting for our slot, which steps on other devices' communications.
+#define LOAD_TEST_MODE              false
+#define LOAD_TEST_SENSORS           4
+#define LOAD_TEST_INTERVAL_SECS     60
+#define LOAD_TEST_PAYLOAD_BYTES     32
+#define LOAD_TEST_IGNORE_TW         false
+
 // States for the local state machine
 #define STATE_BUTTON                0
 
@@ -28,15 +47,49 @@ static bool templateRegistered = false;
 // Our scheduled app's ID
 static int appID = -1;
 
+// The number of the location being surveyed, the ping of its burst being sent, and whether
+// the button asked for the survey
+#if SURVEY_MODE
+static uint32_t surveyID = 0;
+static uint32_t surveySeq = 0;
+static bool surveyRequested = false;
+#endif
+
+// The load-test stream of the logical sensor now sending, and the sequence of each
+#if LOAD_TEST_MODE
+static uint8_t loadStream = 0;
+static uint32_t loadSequence[LOAD_TEST_SENSORS];
+#endif
+
+// The fields of the gateway's responses that we use, which are extracted without a J tree
+typedef struct {
+    char err[80];
+    int32_t id;
+} pingRsp;
+static pingRsp rspFields;
+static const schedField rspFieldsDeclared[] = {
+    SCHED_FIELD("err", SCHED_FIELD_STRING, pingRsp, err),
+    SCHED_FIELD("id", SCHED_FIELD_INT, pingRsp, id),
+    SCHED_FIELDS_END
+};
+
 // Forwards
 static void pingISR(int appID, uint16_t pins, void *appContext);
 static void pingPoll(int appID, int state, void *appContext);
-static void pingResponse(int appID, J *rsp, void *appContext);
+static void pingResponse(int appID, void *rsp, void *appContext);
 static bool sendHealthLogMessage(bool immediate);
 #if !SURVEY_MODE
 static void addNote(uint32_t count);
 static bool registerNotefileTemplate(void);
 #endif
+#if SURVEY_MODE
+static void surveyPoll(int appID, int state, void *appContext);
+static void surveyPing(void);
+#endif
+#if LOAD_TEST_MODE
+static void loadPoll(int appID, int state, void *appContext);
+static void loadSend(uint8_t stream);
+#endif
 
 // Scheduled App One-Time Init
 bool pingInit()
@@ -46,12 +99,30 @@ bool pingInit()
     schedAppConfig config = {
         .name = "ping",
         .activationPeriodSecs = 60 * 15,
+        .activationPeriodMinSecs = 60 * 5,
+        .activationPeriodMaxSecs = 60 * 60 * 4,
         .pollPeriodSecs = 15,
+        .alignToWindow = true,
         .activateFn = NULL,
         .interruptFn = pingISR,
+        .interruptPins = BUTTON1_Pin,
         .pollFn = pingPoll,
-        .responseFn = pingResponse,
+        .responseFields = rspFieldsDeclared,
+        .responseStruct = &rspFields,
+        .responseFieldsFn = pingResponse,
     };
+#if SURVEY_MODE
+    config.pollFn = surveyPoll;
+#endif
+#if LOAD_TEST_MODE
+    config.name = "load";
+    config.activationPeriodSecs = LOAD_TEST_INTERVAL_SECS;
+    config.activationPeriodMinSecs = 0;
+    config.activationPeriodMaxSecs = 0;
+    config.interruptFn = NULL;
+    config.interruptPins = 0;
+    config.pollFn = loadPoll;
+#endif
     appID = schedRegisterApp(&config);
     if (appID < 0) {
         return false;
@@ -82,8 +153,7 @@ void pingPoll(int appID, int state, void *appContext)
 #else
 
         // If the template isn't registered, do so
-        if (!templateRegistered) {
-            registerNotefileTemplate();
+        if (!templateRegistered && registerNotefileTemplate()) {
             schedSetCompletionState(appID, STATE_ACTIVATED, STATE_DEACTIVATED);
             APP_PRINTF("ping: template registration request\r\n");
             break;
@@ -122,13 +192,18 @@ void pingISR(int appID, uint16_t pins, void *appContext)
 
     // Set the state to button, and immediately schedule
     if ((pins & BUTTON1_Pin) != 0) {
+#if SURVEY_MODE
+        surveyRequested = true;
+        schedActivateNowFromISR(appID, false, STATE_ACTIVATED);
+#else
         schedActivateNowFromISR(appID, true, STATE_BUTTON);
+#endif
         return;
     }
 
 }
 
-// Send a note to the health log, and request a reply just
+// Send a health record to the gateway, and request a reply just
 // as a validation of bidirectional communications continuity.
 // Note that this method uses "sensorIgnoreTimeWindow()" which
 // is NOT AT ALL a good practice because it can step on other
@@ -138,58 +213,27 @@ void pingISR(int appID, uint16_t pins, void *appContext)
 bool sendHealthLogMessage(bool immediate)
 {
 
-    // Create the new request
-    J *req = NoteNewRequest("hub.log");
-    if (req == NULL) {
-        return false;
-    }
-
-    // Create a body for the request
-    J *body = JCreateObject();
-    if (body == NULL) {
-        JDelete(req);
-        return false;
-    }
-
-    // Format the health message
-    char message[80] = {0};
-    utilAddressToText(ourAddress, message, sizeof(message));
-    if (sensorName[0] != '\0') {
-        strlcat(message, " (", sizeof(message));
-        strlcat(message, sensorName, sizeof(message));
-        strlcat(message, ")", sizeof(message));
-    }
-    strlcat(message, " says hello", sizeof(message));
-    JAddStringToObject(req, "text", message);
-
-    // Notify the gateway that we wish to add RSSI/SNR info to the text
-    JAddBoolToObject(req, "radio", true);
-
-    // Add an ID to the request, which will be echo'ed
-    // back in the response by the notecard itself.  This
-    // helps us to identify the asynchronous response
-    // without needing to have an additional state.
-    JAddNumberToObject(req, "id", REQUESTID_MANUAL_PING);
-
     // If immediate send is requested, ignore the
     // time window and just send it now.  Also, set
     // the sync flag so that when it arrives on the
     // gateway it is synced immediately to the notehub.
     if (immediate) {
         sensorIgnoreTimeWindow();
-        JAddBoolToObject(req, "sync", true);
     }
 
-    // Send the request with the "true" argument meaning
-    // that the notecard's response should be sent
-    // all the way back from the gateway to us, rather
-    // than discarding the response.
-    noteSendToGatewayAsync(req, true);
+    // Send the record, which the gateway expands into a note
+    // of its health notefile along with the battery and signal
+    // of the message carrying it.  The ID is echo'ed back in
+    // the response, which is sent all the way back from the
+    // gateway to us, and helps us to identify it without
+    // needing to have an additional state.
+    noteSendHealthToGatewayAsync(REQUESTID_MANUAL_PING, immediate);
     return true;
 
 }
 
-// Register the notefile template for our data
+// Register the notefile template for our data, returning true if the gateway's response is to
+// be awaited, which it isn't if the gateway already holds the template
 #if !SURVEY_MODE
 static bool registerNotefileTemplate()
 {
@@ -224,8 +268,12 @@ static bool registerNotefileTemplate()
     JAddNumberToObject(body, "count", TINT32);
     JAddStringToObject(body, "sensor", TSTRING(40));
 
-    // Attach the body to the request, and send it to the gateway
+    // Attach the body to the request, and send it to the gateway unless it already holds it
     JAddItemToObject(req, "body", body);
+    if (noteTemplateKnown(req)) {
+        templateRegistered = true;
+        return false;
+    }
     noteSendToGatewayAsync(req, true);
     return true;
 
@@ -237,48 +285,122 @@ static bool registerNotefileTemplate()
 static void addNote(uint32_t count)
 {
 
-    // Create the request
-    J *req = NoteNewRequest("note.add");
-    if (req == NULL) {
-        return;
-    }
+    // Write the request for the target notefile
+    compactNote note;
+    compactNoteBegin(&note, "note.add", SENSORDATA_NOTEFILE);
 
-    // Create the body
-    J *body = JCreateObject();
-    if (body == NULL) {
-        JDelete(req);
-        return;
+    // Fill-in the body
+    compactNoteNumber(&note, true, "count", count);
+    if (sensorName[0] != '\0') {
+        compactNoteString(&note, true, "sensor", sensorName);
     }
 
-    // Set the target notefile
-    JAddStringToObject(req, "file", SENSORDATA_NOTEFILE);
+    // Send it to the gateway
+    noteSendNoteToGatewayAsync(&note, false);
 
-    // Fill-in the body
-    JAddNumberToObject(body, "count", count);
-    if (sensorName[0] != '\0') {
-        JAddStringToObject(body, "sensor", sensorName);
+}
+#endif
+
+// Survey a location when the button asks for it, written as a coroutine that sends each ping
+// of the burst at full power once the last has completed, spacing them out
+#if SURVEY_MODE
+static void surveyPoll(int appID, int state, void *appContext)
+{
+    bool ok;
+    SCHED_BEGIN(state);
+    if (!surveyRequested) {
+        SCHED_EXIT(appID, "ping: nothing to do");
+    }
+    surveyRequested = false;
+    surveyID++;
+    ledIndicateAck(1);
+    for (surveySeq = 1; surveySeq <= SURVEY_PINGS; surveySeq++) {
+        surveyPing();
+        SCHED_AWAIT_RESPONSE(appID, &ok);
+        if (!ok) {
+            APP_PRINTF("ping: survey %d ping %d failed\r\n", surveyID, surveySeq);
+        }
+        if (surveySeq < SURVEY_PINGS) {
+            SCHED_AWAIT_MS(appID, SURVEY_PING_INTERVAL_MS);
+        }
     }
+    ledIndicateAck(2);
+    SCHED_END(appID, "ping: survey sent");
+}
+#endif
 
-    // Attach the body to the request, and send it to the gateway
-    JAddItemToObject(req, "body", body);
-    noteSendToGatewayAsync(req, false);
+// Send the next ping of the survey of a location
+#if SURVEY_MODE
+static void surveyPing()
+{
+    compactNote note;
+    compactNoteBegin(&note, "survey.ping", NULL);
+    compactNoteNumber(&note, false, "survey", surveyID);
+    compactNoteNumber(&note, false, "seq", surveySeq);
+    compactNoteNumber(&note, false, "of", SURVEY_PINGS);
+    atpMaximizePowerLevel();
+    sensorIgnoreTimeWindow();
+    noteSendNoteToGatewayAsync(&note, true);
+}
+#endif
+
+// Load generator, written as a coroutine that sends a frame for each of the logical sensors
+// in turn, awaiting the completion of each before spacing out the next
+#if LOAD_TEST_MODE
+static void loadPoll(int appID, int state, void *appContext)
+{
+    bool ok;
+    SCHED_BEGIN(state);
+    for (loadStream = 0; loadStream < LOAD_TEST_SENSORS; loadStream++) {
+        loadSend(loadStream);
+        SCHED_AWAIT_RESPONSE(appID, &ok);
+        if (!ok) {
+            APP_PRINTF("load: stream %d frame %d failed\r\n", loadStream, loadSequence[loadStream]);
+        }
+        if (loadStream+1 < LOAD_TEST_SENSORS) {
+            SCHED_AWAIT_MS(appID, (LOAD_TEST_INTERVAL_SECS * 1000) / LOAD_TEST_SENSORS);
+        }
+    }
+    SCHED_END(appID, "load: round sent");
+}
+#endif
 
+// Send the next load-test frame of a logical sensor, padded to the payload size
+#if LOAD_TEST_MODE
+static void loadSend(uint8_t stream)
+{
+    uint32_t len = (LOAD_TEST_PAYLOAD_BYTES > sizeof(compactLoadTest)) ? LOAD_TEST_PAYLOAD_BYTES : sizeof(compactLoadTest);
+    uint8_t *data = (uint8_t *) poolAlloc(len);
+    if (data != NULL) {
+        compactLoadTest frame;
+        frame.Marker = COMPACT_LOAD_TEST;
+        frame.Stream = stream;
+        frame.Sequence = ++loadSequence[stream];
+        memcpy(data, &frame, sizeof(frame));
+        for (uint32_t i=sizeof(frame); i<len; i++) {
+            data[i] = (uint8_t) i;
+        }
+    }
+    if (LOAD_TEST_IGNORE_TW) {
+        sensorIgnoreTimeWindow();
+    }
+    sensorSendDataToGateway(data, len, false);
 }
 #endif
 
 // Gateway Response handler
-void pingResponse(int appID, J *rsp, void *appContext)
+void pingResponse(int appID, void *rsp, void *appContext)
 {
+    pingRsp *r = (pingRsp *) rsp;
 
     // See if there's an error
-    char *err = JGetString(rsp, "err");
-    if (err[0] != '\0') {
-        APP_PRINTF("ping: gateway returned error: %s\r\n", err);
+    if (r->err[0] != '\0') {
+        APP_PRINTF("ping: gateway returned error: %s\r\n", r->err);
         return;
     }
 
     // Flash the LED if this is a response to this specific ping request
-    switch (JGetInt(rsp, "id")) {
+    switch (r->id) {
 
     case REQUESTID_MANUAL_PING:
         ledIndicateAck(2);
@@ -288,6 +410,7 @@ void pingResponse(int appID, J *rsp, void *appContext)
 #if !SURVEY_MODE
     case REQUESTID_TEMPLATE:
         templateRegistered = true;
+        noteTemplateRegistered();
         APP_PRINTF("ping: SUCCESSFUL template registration\r\n");
         break;
 #endif
@@ -4,6 +4,7 @@
 
 #include "appdefs.h"
 #include "main.h"
+#include "stm32_timer.h"
 
 // Addresses of the BME sensor used to identify
 // the Sparrow Reference Sensor Board
@@ -12,10 +13,55 @@
 #define BME280_I2C_TIMEOUT_MS       100
 #define BME280_I2C_RETRY_COUNT      3
 
-// Suppression timer for PIR activity, so that in a high-activity area
-// it isn't continuously sending messages
-#define PIR_SUPPRESSION_MINS        15
-static int64_t lastInterruptMs = 0;
+// Motion is histogrammed into per-minute buckets of saturating 4-bit counts,
+// and the histogram is sent as the payload of a single note each time the
+// app is activated, so that the timing of activity within the reporting
+// interval is retained without a note per burst of motion.
+#define PIR_REPORT_MINS             60
+#define PIR_BUCKET_BITS             4
+#define PIR_BUCKET_MAX              ((1 << PIR_BUCKET_BITS) - 1)
+#define PIR_HISTOGRAM_BYTES         ((PIR_REPORT_MINS * PIR_BUCKET_BITS + 7) / 8)
+static uint8_t histogram[PIR_HISTOGRAM_BYTES];
+static int64_t histogramBeganMs = 0;
+
+// Each trigger can first be classified by the shape of the band-pass filtered signal that
+// follows it, read out from the sensor in PIR_CLASSIFY_SAMPLES samples taken PIR_CLASSIFY_SAMPLE_MS
+// apart while the MCU sleeps in between.  Motion swings the signal back and forth through zero,
+// whereas the heating and cooling of the scene that cause most false triggers drift it slowly
+// one way, so the trigger is counted only if a single quantized neuron over a handful of
+// features of the signal, each scaled to 0..127, fires.  Its weights are hand-set for those two
+// patterns, and may be replaced by ones trained on a particular installation.
+#define PIR_CLASSIFIER              false
+#define PIR_CLASSIFY_SAMPLES        32
+#define PIR_CLASSIFY_SAMPLE_MS      31
+#define PIR_CLASSIFY_NOISE          96          // BPF counts within which a swing isn't counted
+#define PIR_CLASSIFY_FEATURES       4
+static const int8_t classifierWeights[PIR_CLASSIFY_FEATURES] = {
+    2,          // Peak magnitude of the signal
+    8,          // Swings through zero beyond the noise
+    2,          // Mean change between samples
+    -6,         // Drift between the first and last quarters
+};
+static const int32_t classifierBias = -160;
+static int16_t classifySamples[PIR_CLASSIFY_SAMPLES];
+static uint32_t classifySampleCount = 0;
+static int64_t classifyTriggerMs = 0;
+static bool classifying = false;
+static UTIL_TIMER_Object_t classifyTimer;
+static bool classifyTimerCreated = false;
+
+// The serial readout of the sensor in forced readout mode, which is an out-of-range flag,
+// then the 14-bit signal, then an echo of the 25-bit configuration register
+#define PIR_READOUT_BITS            40
+#define PIR_READOUT_CONFIG_BITS     25
+#define PIR_READOUT_SIGNAL_BITS     14
+
+// The configuration register in wake up mode, as set at init, and the state of the mode field
+#define PIR_MODE_SHIFT              7
+#define PIR_MODE_MASK               (0x03 << PIR_MODE_SHIFT)
+#define PIR_MODE_FORCED_READOUT     0
+#define PIR_MODE_WAKE_UP            2
+static uint32_t wakeUpRegister = 0;
 
 // States for the local state machine
 #define STATE_MOTION_CHECK          0
@@ -33,18 +79,39 @@ static bool templateRegistered = false;
 // Number of motion events
 static uint32_t motionEvents = 0;
 static uint32_t motionEventsTotal = 0;
+static uint32_t motionEventsRejected = 0;
 
 // Our scheduled app's ID
 static int appID = -1;
 
+// The fields of the gateway's responses that we use, which are extracted without a J tree
+typedef struct {
+    char err[80];
+    int32_t id;
+} pirRsp;
+static pirRsp rspFields;
+static const schedField rspFieldsDeclared[] = {
+    SCHED_FIELD("err", SCHED_FIELD_STRING, pirRsp, err),
+    SCHED_FIELD("id", SCHED_FIELD_INT, pirRsp, id),
+    SCHED_FIELDS_END
+};
+
 // Forwards
 static void pirISR(int appID, uint16_t pins, void *appContext);
 static void pirPoll(int appID, int state, void *appContext);
-static void pirResponse(int appID, J *rsp, void *appContext);
+static void pirResponse(int appID, void *rsp, void *appContext);
 static void addNote(bool immediate);
+static void histogramRecord(int64_t nowMs);
+static void motionRecord(int64_t nowMs);
 static inline bool isSparrowReferenceSensorBoard(void);
 static bool registerNotefileTemplate(void);
 static void resetInterrupt(void);
+static void sendConfiguration(uint32_t configurationRegister);
+static void directLinkMode(uint32_t mode, uint32_t pull);
+static bool readoutSample(int16_t *sample);
+static bool classifyBegin(int64_t nowMs);
+static void classifyEvent(void *context);
+static bool classifyIsMotion(void);
 
 // Scheduled App One-Time Init
 bool pirInit()
@@ -58,12 +125,17 @@ bool pirInit()
     // Register the app
     schedAppConfig config = {
         .name = "pir",
-        .activationPeriodSecs = 60 * 60,
+        .activationPeriodSecs = PIR_REPORT_MINS * 60,
         .pollPeriodSecs = 15,
+        .alignToWindow = true,
         .activateFn = NULL,
         .interruptFn = pirISR,
+        .interruptPins = PIR_DIRECT_LINK_Pin,
+        .priority = SCHED_PRIORITY_URGENT,
         .pollFn = pirPoll,
-        .responseFn = pirResponse,
+        .responseFields = rspFieldsDeclared,
+        .responseStruct = &rspFields,
+        .responseFieldsFn = pirResponse,
     };
     appID = schedRegisterApp(&config);
     if (appID < 0) {
@@ -130,8 +202,8 @@ bool pirInit()
     // section 2.7 for communication details. In wake up operation mode, the internal alarm event unit is
     // used to generate a low to high transition on the "DIRECT LINK" line once the criteria for motion was
     // met. The host system must pull this line from high to low in order to reset the alarm unit.
-    uint32_t operationModes = 2;        // Wake Up mode
-    configurationRegister |= ((operationModes & 0x03) << 7);
+    uint32_t operationModes = PIR_MODE_WAKE_UP;
+    configurationRegister |= ((operationModes & 0x03) << PIR_MODE_SHIFT);
 
     // Signal Source [6:5] 2 bits (0: PIR (BPF) 1: PIR (LPF) 2: Reserved 3: Temperature Sensor)
     // The signal of the pyroelectric sensor can be observed after low-pass filtering (LPF). The data on the
@@ -170,7 +242,22 @@ bool pirInit()
     uint32_t pulseDetectionMode = 0;
     configurationRegister |= ((pulseDetectionMode & 0x01) << 0);
 
-    // Send the register according to 2.6 timing
+    // Send the register
+    wakeUpRegister = configurationRegister;
+    sendConfiguration(configurationRegister);
+
+    // Reset the interrupt, and begin the first histogram
+    histogramBeganMs = TIMER_IF_GetTimeMs();
+    resetInterrupt();
+
+    // Success
+    return true;
+
+}
+
+// Send the configuration register according to datasheet 2.6 timing
+static void sendConfiguration(uint32_t configurationRegister)
+{
     HAL_DelayUs(750);       // tSLT must be at least 580uS to prepare for accepting config
     for (int i=24; i>=0; --i) {
         HAL_GPIO_WritePin(PIR_SERIAL_IN_Port, PIR_SERIAL_IN_Pin, GPIO_PIN_RESET);
@@ -183,13 +270,6 @@ bool pirInit()
     }
     HAL_GPIO_WritePin(PIR_SERIAL_IN_Port, PIR_SERIAL_IN_Pin, GPIO_PIN_RESET);
     HAL_DelayUs(750);       // tSLT must be at least 580uS for latching
-
-    // Reset the interrupt
-    resetInterrupt();
-
-    // Success
-    return true;
-
 }
 
 // Reset the interrupt according to datasheet 2.7 "Wake Up Mode"
@@ -224,8 +304,7 @@ void pirPoll(int appID, int state, void *appContext)
     switch (state) {
 
     case STATE_ACTIVATED:
-        if (!templateRegistered) {
-            registerNotefileTemplate();
+        if (!templateRegistered && registerNotefileTemplate()) {
             schedSetCompletionState(appID, STATE_ACTIVATED, STATE_MOTION_CHECK);
             APP_PRINTF("pir: template registration request\r\n");
             break;
@@ -238,7 +317,12 @@ void pirPoll(int appID, int state, void *appContext)
             schedSetState(appID, STATE_DEACTIVATED, "pir: completed");
             break;
         }
-        APP_PRINTF("pir: %d motion events sensed\r\n", motionEvents);
+        if (PIR_CLASSIFIER) {
+            APP_PRINTF("pir: %d motion events sensed, %d triggers rejected\r\n", motionEvents, motionEventsRejected);
+            motionEventsRejected = 0;
+        } else {
+            APP_PRINTF("pir: %d motion events sensed\r\n", motionEvents);
+        }
         addNote(true);
         schedSetCompletionState(appID, STATE_MOTION_CHECK, STATE_MOTION_CHECK);
         APP_PRINTF("pir: note queued\r\n");
@@ -248,7 +332,8 @@ void pirPoll(int appID, int state, void *appContext)
 
 }
 
-// Register the notefile template for our data
+// Register the notefile template for our data, returning true if the gateway's response is to
+// be awaited, which it isn't if the gateway already holds the template
 static bool registerNotefileTemplate()
 {
 
@@ -278,33 +363,40 @@ static bool registerNotefileTemplate()
     // substituted with the textified sensor address.
     JAddStringToObject(req, "file", SENSORDATA_NOTEFILE);
 
-    // Fill-in the body template
+    // Fill-in the body template.  The histogram travels as the payload, one
+    // PIR_BUCKET_BITS-wide count per minute, low nibble first.
     JAddNumberToObject(body, "count", TINT32);
     JAddNumberToObject(body, "total", TINT32);
+    JAddNumberToObject(body, "minutes", TINT16);
 
-    // Attach the body to the request, and send it to the gateway
+    // Attach the body to the request, and send it to the gateway unless it already holds it
     JAddItemToObject(req, "body", body);
+    if (noteTemplateKnown(req)) {
+        templateRegistered = true;
+        return false;
+    }
     noteSendToGatewayAsync(req, true);
     return true;
 
 }
 
 // Gateway Response handler
-void pirResponse(int appID, J *rsp, void *appContext)
+void pirResponse(int appID, void *rsp, void *appContext)
 {
+    pirRsp *r = (pirRsp *) rsp;
 
     // See if there's an error
-    char *err = JGetString(rsp, "err");
-    if (err[0] != '\0') {
-        APP_PRINTF("pir: gateway returned error: %s\r\n", err);
+    if (r->err[0] != '\0') {
+        APP_PRINTF("pir: gateway returned error: %s\r\n", r->err);
         return;
     }
 
     // Flash the LED if this is a response to this specific ping request
-    switch (JGetInt(rsp, "id")) {
+    switch (r->id) {
 
     case REQUESTID_TEMPLATE:
         templateRegistered = true;
+        noteTemplateRegistered();
         APP_PRINTF("pir: SUCCESSFUL template registration\r\n");
         break;
     }
@@ -315,35 +407,43 @@ void pirResponse(int appID, J *rsp, void *appContext)
 static void addNote(bool immediate)
 {
 
-    // Create the request
-    J *req = NoteNewRequest("note.add");
-    if (req == NULL) {
-        return;
-    }
-
-    // Create the body
-    J *body = JCreateObject();
-    if (body == NULL) {
-        JDelete(req);
-        return;
-    }
-
-    // Set the target notefile
-    JAddStringToObject(req, "file", SENSORDATA_NOTEFILE);
+    // Write the request for the target notefile
+    compactNote note;
+    compactNoteBegin(&note, "note.add", SENSORDATA_NOTEFILE);
 
     // If immediate, sync now
     if (immediate) {
-        JAddBoolToObject(req, "sync", true);
+        compactNoteBool(&note, false, "sync", true);
     }
 
-    // Fill-in the body
-    JAddNumberToObject(body, "total", motionEventsTotal);
-    JAddNumberToObject(body, "count", motionEvents);
+    // Take the histogram and begin the next one, masking the ISR so that no
+    // event is lost between the copy and the reset
+    uint8_t buckets[PIR_HISTOGRAM_BYTES];
+    int64_t nowMs = TIMER_IF_GetTimeMs();
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint32_t count = motionEvents;
+    uint32_t minutes = (uint32_t) ((nowMs - histogramBeganMs) / 60000) + 1;
+    memcpy(buckets, histogram, sizeof(buckets));
+    memset(histogram, 0, sizeof(histogram));
     motionEvents = 0;
+    histogramBeganMs = nowMs;
+    __set_PRIMASK(primask);
+    if (minutes > PIR_REPORT_MINS) {
+        minutes = PIR_REPORT_MINS;
+    }
 
-    // Attach the body to the request, and send it to the gateway
-    JAddItemToObject(req, "body", body);
-    noteSendToGatewayAsync(req, false);
+    // Fill-in the body
+    compactNoteNumber(&note, true, "total", motionEventsTotal);
+    compactNoteNumber(&note, true, "count", count);
+    compactNoteNumber(&note, true, "minutes", minutes);
+    int len = (minutes * PIR_BUCKET_BITS + 7) / 8;
+    char payload[((PIR_HISTOGRAM_BYTES + 2) / 3) * 4 + 1];
+    JB64Encode(payload, (const char *) buckets, len);
+    compactNoteString(&note, false, "payload", payload);
+
+    // Send it to the gateway
+    noteSendNoteToGatewayAsync(&note, false);
 
 }
 
@@ -351,34 +451,178 @@ static void addNote(bool immediate)
 void pirISR(int appID, uint16_t pins, void *appContext)
 {
 
-    // Set the state to 'motion' and immediately schedule
+    // Record the motion event, unless it is first to be classified.  It is reported when the
+    // app is next activated.
     if ((pins & PIR_DIRECT_LINK_Pin) != 0) {
-
-        // Record the motion event
-        motionEvents++;
-        motionEventsTotal++;
-        resetInterrupt();
-
-        // See if we're past the suppression interval
         int64_t nowMs = TIMER_IF_GetTimeMs();
-        if (lastInterruptMs == 0) {
-            lastInterruptMs = nowMs;
-        } else {
-            uint32_t elapsedSecs = (uint32_t) (nowMs - lastInterruptMs) / 1000;
-            lastInterruptMs = nowMs;
-            if (elapsedSecs < (PIR_SUPPRESSION_MINS*60)) {
-                return;
-            }
+        if (PIR_CLASSIFIER && classifyBegin(nowMs)) {
+            return;
         }
+        motionRecord(nowMs);
+        resetInterrupt();
+        return;
+    }
+
+}
 
-        // Activate the scheduler
-        if (!schedIsActive(appID)) {
-            schedActivateNowFromISR(appID, true, STATE_MOTION_CHECK);
+// Count a motion event
+static void motionRecord(int64_t nowMs)
+{
+    motionEvents++;
+    motionEventsTotal++;
+    histogramRecord(nowMs);
+}
+
+// Set the mode of the DIRECT LINK line, which we drive and the sensor drives in turn
+static void directLinkMode(uint32_t mode, uint32_t pull)
+{
+    GPIO_InitTypeDef init = {0};
+    init.Mode = mode;
+    init.Pull = pull;
+    init.Speed = GPIO_SPEED_FREQ_HIGH;
+    init.Pin = PIR_DIRECT_LINK_Pin;
+    HAL_GPIO_Init(PIR_DIRECT_LINK_Port, &init);
+}
+
+// Read a sample of the signal in forced readout mode according to datasheet 2.7, by clocking out
+// each bit with a low-to-high transition and then releasing the line for the sensor to drive
+// it.  The configuration register that follows the signal is checked against the one we sent,
+// so that a readout that isn't in step is never mistaken for a signal.
+static bool readoutSample(int16_t *sample)
+{
+    uint64_t frame = 0;
+    for (int i=0; i<PIR_READOUT_BITS; i++) {
+        directLinkMode(GPIO_MODE_OUTPUT_PP, GPIO_NOPULL);
+        HAL_GPIO_WritePin(PIR_DIRECT_LINK_Port, PIR_DIRECT_LINK_Pin, GPIO_PIN_RESET);
+        HAL_DelayUs(1);     // tL can be very short
+        HAL_GPIO_WritePin(PIR_DIRECT_LINK_Port, PIR_DIRECT_LINK_Pin, GPIO_PIN_SET);
+        HAL_DelayUs(1);     // tH can be very short
+        directLinkMode(GPIO_MODE_INPUT, GPIO_NOPULL);
+        HAL_DelayUs(5);     // tBit settling must be at least 2uS
+        frame = (frame << 1) | (HAL_GPIO_ReadPin(PIR_DIRECT_LINK_Port, PIR_DIRECT_LINK_Pin) == GPIO_PIN_SET ? 1 : 0);
+    }
+    directLinkMode(GPIO_MODE_OUTPUT_PP, GPIO_NOPULL);
+    HAL_GPIO_WritePin(PIR_DIRECT_LINK_Port, PIR_DIRECT_LINK_Pin, GPIO_PIN_RESET);
+    uint32_t forcedRegister = (wakeUpRegister & ~PIR_MODE_MASK) | (PIR_MODE_FORCED_READOUT << PIR_MODE_SHIFT);
+    if ((uint32_t) (frame & ((1UL << PIR_READOUT_CONFIG_BITS) - 1)) != forcedRegister) {
+        return false;
+    }
+
+    // The signal is two's complement after band-pass filtering
+    int32_t signal = (int32_t) ((frame >> PIR_READOUT_CONFIG_BITS) & ((1UL << PIR_READOUT_SIGNAL_BITS) - 1));
+    if ((signal & (1 << (PIR_READOUT_SIGNAL_BITS-1))) != 0) {
+        signal -= (1 << PIR_READOUT_SIGNAL_BITS);
+    }
+    *sample = (int16_t) signal;
+    return true;
+}
+
+// Begin sampling the signal that follows a trigger, returning false if the trigger is instead
+// to be counted as it is
+static bool classifyBegin(int64_t nowMs)
+{
+    if (classifying) {
+        return false;
+    }
+    if (!classifyTimerCreated) {
+        UTIL_TIMER_Create(&classifyTimer, 0xFFFFFFFFU, UTIL_TIMER_ONESHOT, classifyEvent, NULL);
+        classifyTimerCreated = true;
+    }
+    classifying = true;
+    classifyTriggerMs = nowMs;
+    classifySampleCount = 0;
+    HAL_NVIC_DisableIRQ(PIR_DIRECT_LINK_EXTI_IRQn);
+    directLinkMode(GPIO_MODE_OUTPUT_PP, GPIO_NOPULL);
+    HAL_GPIO_WritePin(PIR_DIRECT_LINK_Port, PIR_DIRECT_LINK_Pin, GPIO_PIN_RESET);
+    sendConfiguration((wakeUpRegister & ~PIR_MODE_MASK) | (PIR_MODE_FORCED_READOUT << PIR_MODE_SHIFT));
+    UTIL_TIMER_SetPeriod(&classifyTimer, PIR_CLASSIFY_SAMPLE_MS);
+    UTIL_TIMER_Start(&classifyTimer);
+    return true;
+}
+
+// Take the next sample, and once all have been taken count the trigger if it was motion and
+// return the sensor to wake up mode.  A readout that fails counts the trigger, so that the
+// classifier can't lose motion to a fault of its own.
+static void classifyEvent(void *context)
+{
+    int16_t sample;
+    bool ok = readoutSample(&sample);
+    if (ok) {
+        classifySamples[classifySampleCount++] = sample;
+        if (classifySampleCount < PIR_CLASSIFY_SAMPLES) {
+            UTIL_TIMER_Start(&classifyTimer);
+            return;
         }
+    }
+    if (!ok || classifyIsMotion()) {
+        motionRecord(classifyTriggerMs);
+    } else {
+        motionEventsRejected++;
+    }
+    sendConfiguration(wakeUpRegister);
+    resetInterrupt();
+    classifying = false;
+}
 
-        return;
+// Classify the samples, by scaling each feature to 0..127 and firing the neuron if the
+// weighted sum of the features exceeds its bias
+static bool classifyIsMotion()
+{
+    int32_t peak = 0, swings = 0, change = 0, firstSum = 0, lastSum = 0;
+    int32_t quarter = PIR_CLASSIFY_SAMPLES / 4;
+    int32_t lastSign = 0;
+    for (int i=0; i<PIR_CLASSIFY_SAMPLES; i++) {
+        int32_t s = classifySamples[i];
+        int32_t magnitude = (s < 0 ? -s : s);
+        if (magnitude > peak) {
+            peak = magnitude;
+        }
+        if (magnitude > PIR_CLASSIFY_NOISE) {
+            int32_t sign = (s < 0 ? -1 : 1);
+            if (lastSign != 0 && sign != lastSign) {
+                swings++;
+            }
+            lastSign = sign;
+        }
+        if (i > 0) {
+            int32_t d = s - classifySamples[i-1];
+            change += (d < 0 ? -d : d);
+        }
+        if (i < quarter) {
+            firstSum += s;
+        } else if (i >= PIR_CLASSIFY_SAMPLES - quarter) {
+            lastSum += s;
+        }
+    }
+    int32_t drift = (lastSum - firstSum) / quarter;
+    int32_t features[PIR_CLASSIFY_FEATURES] = {
+        peak / 64,
+        swings * 16,
+        change / (PIR_CLASSIFY_SAMPLES - 1) / 16,
+        (drift < 0 ? -drift : drift) / 64,
+    };
+    int32_t sum = classifierBias;
+    for (int i=0; i<PIR_CLASSIFY_FEATURES; i++) {
+        sum += (int32_t) classifierWeights[i] * (features[i] > 127 ? 127 : features[i]);
     }
+    return sum > 0;
+}
 
+// Count a motion event in its minute's bucket, saturating both the count and, should
+// the activation be late, the minute
+static void histogramRecord(int64_t nowMs)
+{
+    uint32_t minute = (uint32_t) ((nowMs - histogramBeganMs) / 60000);
+    if (minute >= PIR_REPORT_MINS) {
+        minute = PIR_REPORT_MINS - 1;
+    }
+    uint32_t bit = minute * PIR_BUCKET_BITS;
+    uint8_t *b = &histogram[bit / 8];
+    uint32_t shift = bit % 8;
+    uint32_t count = (*b >> shift) & PIR_BUCKET_MAX;
+    if (count < PIR_BUCKET_MAX) {
+        *b = (*b & ~(PIR_BUCKET_MAX << shift)) | ((count + 1) << shift);
+    }
 }
 
 // We have no viable way of detecting whether or not the PIR sensor
@@ -386,6 +630,11 @@ void pirISR(int appID, uint16_t pins, void *appContext)
 bool isSparrowReferenceSensorBoard (void) {
     bool result;
 
+    // Use what the BME app or the hardware inventory determined, if anything
+    if (appHardwareProbed(HARDWARE_BME280, &result)) {
+        return result;
+    }
+
     // Power on the sensor to see if it's here
     GPIO_InitTypeDef init = {0};
     init.Speed = GPIO_SPEED_FREQ_LOW;
@@ -394,10 +643,11 @@ bool isSparrowReferenceSensorBoard (void) {
     init.Pull = GPIO_NOPULL;
     HAL_GPIO_Init(BME_POWER_GPIO_Port, &init);
     HAL_GPIO_WritePin(BME_POWER_GPIO_Port, BME_POWER_Pin, GPIO_PIN_SET);
-    MX_I2C2_Init();
+    MY_I2C2_Acquire();
     result = (MY_I2C2_Ping(BME280_I2C_ADDR_PRIM, BME280_I2C_TIMEOUT_MS, BME280_I2C_RETRY_COUNT)
            || MY_I2C2_Ping(BME280_I2C_ADDR_SEC, BME280_I2C_TIMEOUT_MS, BME280_I2C_RETRY_COUNT));
-    MX_I2C2_DeInit();
+    MY_I2C2_Release();
+    appHardwareFound(HARDWARE_BME280, result);
 
     return result;
 }
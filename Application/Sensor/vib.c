@@ -0,0 +1,400 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#include "appdefs.h"
+#include "main.h"
+
+// Vibration of a motor is measured through an analog accelerometer or similar on A1, which
+// is streamed by DMA for VIB_CAPTURE_BLOCKS blocks of VIB_FFT_SAMPLES samples each time the
+// app is activated.  Each block is reduced as it arrives, to its RMS and peak about its mean
+// and to the power in each bin of its spectrum, and only those reductions are reported: the
+// RMS, the peak, the frequency of the strongest bin, and the share of the power in each of
+// VIB_BANDS octave bands, one byte each, as the payload of a single note.
+#define VIB_REPORT_MINS             15
+#define VIB_ADC_CHANNEL             ADC_CHANNEL_4       // A1 (PB2)
+#define VIB_SAMPLE_HZ               2048
+#define VIB_FFT_BITS                8
+#define VIB_FFT_SAMPLES             (1 << VIB_FFT_BITS)
+#define VIB_CAPTURE_BLOCKS          8
+#define VIB_BIN_HZ                  (VIB_SAMPLE_HZ / VIB_FFT_SAMPLES)
+#define VIB_BANDS                   (VIB_FFT_BITS - 1)  // Bins [1,2), [2,4), ... [64,128)
+
+// The spectrum is computed in fixed point, because the MCU has no FPU, by a radix-2 FFT
+// that halves at each stage so that it can't overflow.  The twiddles come from a quarter
+// wave of sine in Q15, which also gives the Hann window that is applied to each block.
+static const int16_t vibSine[VIB_FFT_SAMPLES/4 + 1] = {
+    0, 804, 1608, 2410, 3212, 4011, 4808, 5602,
+    6393, 7179, 7962, 8739, 9512, 10278, 11039, 11793,
+    12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530,
+    18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594,
+    23170, 23731, 24279, 24811, 25329, 25832, 26319, 26790,
+    27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+    30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971,
+    32137, 32285, 32412, 32521, 32609, 32678, 32728, 32757,
+    32767,
+};
+
+// The DMA buffer, of which a block is reduced while the DMA fills the other, and the
+// reductions accumulated over the capture
+static uint16_t streamBuffer[2 * VIB_FFT_SAMPLES];
+static int16_t fftRe[VIB_FFT_SAMPLES];
+static int16_t fftIm[VIB_FFT_SAMPLES];
+static uint32_t binPower[VIB_FFT_SAMPLES/2];
+static uint64_t sumSquares = 0;
+static uint32_t peakCounts = 0;
+static uint32_t blocksReduced = 0;
+static volatile bool captureDone = false;
+static uint32_t captureOverruns = 0;
+
+// States for the local state machine
+#define STATE_CAPTURE               0
+#define STATE_CAPTURING             1
+
+// Special request IDs
+#define REQUESTID_TEMPLATE          1
+
+// The dynamic filename of the application specific queue.
+// NOTE: The Gateway will replace `*` with the originating node's ID.
+#define SENSORDATA_NOTEFILE         "*#vibration.qo"
+
+// TRUE if we've successfully registered the template
+static bool templateRegistered = false;
+
+// Our scheduled app's ID
+static int appID = -1;
+
+// The fields of the gateway's responses that we use, which are extracted without a J tree
+typedef struct {
+    char err[80];
+    int32_t id;
+} vibRsp;
+static vibRsp rspFields;
+static const schedField rspFieldsDeclared[] = {
+    SCHED_FIELD("err", SCHED_FIELD_STRING, vibRsp, err),
+    SCHED_FIELD("id", SCHED_FIELD_INT, vibRsp, id),
+    SCHED_FIELDS_END
+};
+
+// Forwards
+static void vibPoll(int appID, int state, void *appContext);
+static void vibResponse(int appID, void *rsp, void *appContext);
+static bool captureBegin(void);
+static void captureBlock(uint16_t *samples, uint32_t count);
+static void fft(int16_t *re, int16_t *im);
+static int32_t sine(uint32_t k);
+static int32_t cosine(uint32_t k);
+static uint32_t isqrt(uint64_t v);
+static void addNote(void);
+static bool registerNotefileTemplate(void);
+
+// Scheduled App One-Time Init
+bool vibInit()
+{
+
+    // Register the app
+    schedAppConfig config = {
+        .name = "vib",
+        .activationPeriodSecs = VIB_REPORT_MINS * 60,
+        .pollPeriodSecs = 1,
+        .activateFn = NULL,
+        .interruptFn = NULL,
+        .pollFn = vibPoll,
+        .responseFields = rspFieldsDeclared,
+        .responseStruct = &rspFields,
+        .responseFieldsFn = vibResponse,
+    };
+    appID = schedRegisterApp(&config);
+    if (appID < 0) {
+        return false;
+    }
+
+    // Success
+    return true;
+
+}
+
+// Poller
+void vibPoll(int appID, int state, void *appContext)
+{
+
+    // Switch based upon state
+    switch (state) {
+
+    case STATE_ACTIVATED:
+        if (!templateRegistered && registerNotefileTemplate()) {
+            schedSetCompletionState(appID, STATE_ACTIVATED, STATE_CAPTURE);
+            APP_PRINTF("vib: template registration request\r\n");
+            break;
+        }
+
+        // fallthrough to capture
+
+    case STATE_CAPTURE:
+        if (!captureBegin()) {
+            schedSetState(appID, STATE_DEACTIVATED, "vib: ADC busy");
+            break;
+        }
+        schedSetState(appID, STATE_CAPTURING, "vib: capturing");
+        break;
+
+    case STATE_CAPTURING:
+        if (!captureDone) {
+            break;
+        }
+        if (captureOverruns != 0) {
+            APP_PRINTF("vib: %d blocks overrun\r\n", captureOverruns);
+        }
+        addNote();
+        schedSetCompletionState(appID, STATE_DEACTIVATED, STATE_DEACTIVATED);
+        APP_PRINTF("vib: note queued\r\n");
+        break;
+
+    }
+
+}
+
+// Begin streaming the channel, with the reductions reset
+static bool captureBegin()
+{
+    GPIO_InitTypeDef init = {0};
+    init.Mode = GPIO_MODE_ANALOG;
+    init.Pull = GPIO_NOPULL;
+    init.Pin = A1_Pin;
+    HAL_GPIO_Init(A1_GPIO_Port, &init);
+    memset(binPower, 0, sizeof(binPower));
+    sumSquares = 0;
+    peakCounts = 0;
+    blocksReduced = 0;
+    captureOverruns = 0;
+    captureDone = false;
+    return MX_ADC_Stream_Start(VIB_ADC_CHANNEL, streamBuffer, VIB_FFT_SAMPLES, VIB_SAMPLE_HZ, captureBlock);
+}
+
+// Reduce a block as it arrives, stopping the stream once all have been
+static void captureBlock(uint16_t *samples, uint32_t count)
+{
+
+    // The mean, about which the block is measured
+    uint32_t sum = 0;
+    for (uint32_t i=0; i<count; i++) {
+        sum += samples[i];
+    }
+    int32_t mean = (int32_t) (sum / count);
+
+    // Its RMS and peak, and the windowed block scaled from 12 bits to Q15
+    for (uint32_t i=0; i<count; i++) {
+        int32_t x = (int32_t) samples[i] - mean;
+        uint32_t magnitude = (uint32_t) (x < 0 ? -x : x);
+        if (magnitude > peakCounts) {
+            peakCounts = magnitude;
+        }
+        sumSquares += (uint64_t) (x * x);
+        int32_t hann = (32768 - cosine(i)) / 2;
+        fftRe[i] = (int16_t) (((x * 8) * hann) >> 15);
+        fftIm[i] = 0;
+    }
+
+    // The power in each bin of its spectrum, scaled so that the capture can't overflow
+    fft(fftRe, fftIm);
+    for (uint32_t k=1; k<VIB_FFT_SAMPLES/2; k++) {
+        uint32_t power = (uint32_t) ((int32_t) fftRe[k] * fftRe[k]) + (uint32_t) ((int32_t) fftIm[k] * fftIm[k]);
+        binPower[k] += power / VIB_CAPTURE_BLOCKS;
+    }
+
+    // Done when all have been reduced
+    if (++blocksReduced >= VIB_CAPTURE_BLOCKS) {
+        captureOverruns = MX_ADC_Stream_Stop();
+        captureDone = true;
+    }
+
+}
+
+// The sine and cosine of 2*pi*k/VIB_FFT_SAMPLES in Q15, for k within half a cycle
+static int32_t sine(uint32_t k)
+{
+    return (k <= VIB_FFT_SAMPLES/4) ? vibSine[k] : vibSine[VIB_FFT_SAMPLES/2 - k];
+}
+static int32_t cosine(uint32_t k)
+{
+    k %= VIB_FFT_SAMPLES;
+    if (k >= VIB_FFT_SAMPLES/2) {
+        k = VIB_FFT_SAMPLES - k;
+    }
+    return (k <= VIB_FFT_SAMPLES/4) ? vibSine[VIB_FFT_SAMPLES/4 - k] : -vibSine[k - VIB_FFT_SAMPLES/4];
+}
+
+// In-place radix-2 decimation-in-time FFT, halving at each stage so that the result is the
+// transform divided by VIB_FFT_SAMPLES
+static void fft(int16_t *re, int16_t *im)
+{
+
+    // Bit-reversed order
+    for (uint32_t i=0, j=0; i<VIB_FFT_SAMPLES; i++) {
+        if (i < j) {
+            int16_t t = re[i];
+            re[i] = re[j];
+            re[j] = t;
+            t = im[i];
+            im[i] = im[j];
+            im[j] = t;
+        }
+        uint32_t bit = VIB_FFT_SAMPLES >> 1;
+        while ((j & bit) != 0) {
+            j &= ~bit;
+            bit >>= 1;
+        }
+        j |= bit;
+    }
+
+    // Butterflies
+    for (uint32_t span=1; span<VIB_FFT_SAMPLES; span <<= 1) {
+        uint32_t step = VIB_FFT_SAMPLES / (span * 2);
+        for (uint32_t m=0; m<span; m++) {
+            int32_t wr = cosine(m * step);
+            int32_t wi = -sine(m * step);
+            for (uint32_t i=m; i<VIB_FFT_SAMPLES; i += span * 2) {
+                uint32_t j = i + span;
+                int32_t tr = ((wr * re[j]) - (wi * im[j])) >> 15;
+                int32_t ti = ((wr * im[j]) + (wi * re[j])) >> 15;
+                int32_t ur = re[i];
+                int32_t ui = im[i];
+                re[i] = (int16_t) ((ur + tr) >> 1);
+                im[i] = (int16_t) ((ui + ti) >> 1);
+                re[j] = (int16_t) ((ur - tr) >> 1);
+                im[j] = (int16_t) ((ui - ti) >> 1);
+            }
+        }
+    }
+
+}
+
+// Integer square root
+static uint32_t isqrt(uint64_t v)
+{
+    uint64_t root = 0;
+    uint64_t bit = (uint64_t) 1 << 62;
+    while (bit > v) {
+        bit >>= 2;
+    }
+    while (bit != 0) {
+        if (v >= root + bit) {
+            v -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (uint32_t) root;
+}
+
+// Register the notefile template for our data, returning true if the gateway's response is to
+// be awaited, which it isn't if the gateway already holds the template
+static bool registerNotefileTemplate()
+{
+
+    // Create the request
+    J *req = NoteNewRequest("note.template");
+    if (req == NULL) {
+        return false;
+    }
+
+    // Create the body
+    J *body = JCreateObject();
+    if (body == NULL) {
+        JDelete(req);
+        return false;
+    }
+
+    // Add an ID to the request, which will be echo'ed
+    // back in the response by the notecard itself.
+    JAddNumberToObject(req, "id", REQUESTID_TEMPLATE);
+
+    // Fill-in request parameters, with the gateway substituting
+    // the textified sensor address for the * in the "file"
+    JAddStringToObject(req, "file", SENSORDATA_NOTEFILE);
+
+    // Fill-in the body template.  The band shares travel as the payload, one
+    // byte per octave band, lowest first.
+    JAddNumberToObject(body, "rms", TINT16);
+    JAddNumberToObject(body, "peak", TINT16);
+    JAddNumberToObject(body, "hz", TINT16);
+
+    // Attach the body to the request, and send it to the gateway unless it already holds it
+    JAddItemToObject(req, "body", body);
+    if (noteTemplateKnown(req)) {
+        templateRegistered = true;
+        return false;
+    }
+    noteSendToGatewayAsync(req, true);
+    return true;
+
+}
+
+// Gateway Response handler
+void vibResponse(int appID, void *rsp, void *appContext)
+{
+    vibRsp *r = (vibRsp *) rsp;
+
+    // See if there's an error
+    if (r->err[0] != '\0') {
+        APP_PRINTF("vib: gateway returned error: %s\r\n", r->err);
+        return;
+    }
+
+    // Note that the template has been registered
+    switch (r->id) {
+
+    case REQUESTID_TEMPLATE:
+        templateRegistered = true;
+        noteTemplateRegistered();
+        APP_PRINTF("vib: SUCCESSFUL template registration\r\n");
+        break;
+    }
+
+}
+
+// Send the features of the capture
+static void addNote()
+{
+
+    // The RMS and peak in millivolts
+    uint32_t samples = VIB_CAPTURE_BLOCKS * VIB_FFT_SAMPLES;
+    uint32_t rmsMv = (isqrt(sumSquares / samples) * VDDA_APPLI) / 4095;
+    uint32_t peakMv = (peakCounts * VDDA_APPLI) / 4095;
+
+    // The strongest bin, and the share of the power in each octave band
+    uint64_t bandPower[VIB_BANDS] = {0};
+    uint64_t totalPower = 0;
+    uint32_t strongest = 1;
+    for (uint32_t k=1; k<VIB_FFT_SAMPLES/2; k++) {
+        if (binPower[k] > binPower[strongest]) {
+            strongest = k;
+        }
+        uint32_t band = 31 - __CLZ(k);
+        bandPower[band] += binPower[k];
+        totalPower += binPower[k];
+    }
+    uint8_t bands[VIB_BANDS];
+    for (int i=0; i<VIB_BANDS; i++) {
+        bands[i] = (totalPower == 0) ? 0 : (uint8_t) ((bandPower[i] * 255) / totalPower);
+    }
+    APP_PRINTF("vib: rms %dmV peak %dmV strongest %dHz\r\n", rmsMv, peakMv, strongest * VIB_BIN_HZ);
+
+    // Write the request for the target notefile
+    compactNote note;
+    compactNoteBegin(&note, "note.add", SENSORDATA_NOTEFILE);
+
+    // Fill-in the body
+    compactNoteNumber(&note, true, "rms", rmsMv);
+    compactNoteNumber(&note, true, "peak", peakMv);
+    compactNoteNumber(&note, true, "hz", strongest * VIB_BIN_HZ);
+    char payload[((VIB_BANDS + 2) / 3) * 4 + 1];
+    JB64Encode(payload, (const char *) bands, VIB_BANDS);
+    compactNoteString(&note, false, "payload", payload);
+
+    // Send it to the gateway
+    noteSendNoteToGatewayAsync(&note, false);
+
+}
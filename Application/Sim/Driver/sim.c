@@ -0,0 +1,800 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Capacity simulation of a gateway and many sensors, each running the unmodified firmware.
+// The firmware and the stubs that stand in for its hardware are built once as a shared
+// object.  Every node gets its own copy of that object's writable segment, which is swapped
+// into place whenever the node runs, and its own flash, which is mapped at the device's
+// address.  Each node runs as a coroutine on its own stack until it idles or delays, and is
+// interrupted on the driver's stack when an alarm, a frame or a button press is due, so a
+// whole network runs on one host thread in virtual time.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <sys/mman.h>
+#include "simdriver.h"
+
+// When the gateway and the sensors are first pressed into pairing
+#define SIM_BOOT_SPREAD_US      (5*1000000ULL)
+#define SIM_PAIR_GATEWAY_US     (30*1000000ULL)
+#define SIM_PAIR_SENSORS_US     (35*1000000ULL)
+#define SIM_PRESS_US            (200*1000ULL)
+#define SIM_BUTTON_RETRY_US     (1000*1000ULL)
+
+// How long after the last sensor is pressed that the gateway stops pairing, which is longer
+// than a sensor keeps trying
+#define SIM_PAIR_WINDOW_US      (6*60*1000000ULL)
+
+// Time from a reset to the firmware running
+#define SIM_RESET_US            (10*1000ULL)
+
+// The wall-clock time at which every simulation begins, so that runs are repeatable
+#define SIM_EPOCH_SECS          1767225600
+
+// Options, with their defaults
+simOptions simOpt = {
+    .sensors = 10,
+    .durationUs = 3600*1000000ULL,
+    .benchPeriodSecs = 300,
+    .notecardLatencyMs = 50,
+    .radiusMetres = 1000,
+    .pairSpacingMs = 20000,
+    .seed = 1,
+    .trace = -1,
+};
+
+// Nodes, the first of which is the gateway
+simNode *simNodes = NULL;
+int simNodeCount = 0;
+
+// The node that is running, or NULL when the driver is
+simNode *simCurrent = NULL;
+
+// The virtual clock
+uint64_t simNow = 0;
+
+// When the statistics begin to be gathered
+uint64_t simMeasureFromUs = 0;
+
+// The firmware
+simFirmware simFw;
+
+// An event
+typedef struct {
+    uint64_t us;
+    uint64_t seq;
+    int node;
+    int kind;
+    uint32_t gen;
+    int64_t arg;
+} simEvent;
+
+// The event queue, as a binary heap ordered by time and then by when events were scheduled
+static simEvent *events = NULL;
+static size_t eventCount = 0;
+static size_t eventMax = 0;
+static uint64_t eventSeq = 0;
+
+// The firmware's writable segment, and each node's initial copy of it
+static uint8_t *segBase = NULL;
+static size_t segLen = 0;
+static uint8_t *segInitial = NULL;
+
+// The node whose RAM and flash are in place
+static simNode *loaded = NULL;
+
+// The flash of every node, one after another
+static int flashFd = -1;
+
+// The driver's own context, and the way back to it when a handler resets its node
+static ucontext_t driverContext;
+static jmp_buf handlerReset;
+static bool inHandler = false;
+static bool handlerOnDriverStack = false;
+
+// CPU time at which the running node was entered
+static struct timespec cpuEntered;
+
+// The node whose trace output is mid-line
+static simNode *traceMidLine = NULL;
+
+// Random number state
+static uint64_t randomState = 0;
+
+// Forwards
+static void usage(const char *program);
+static bool loadFirmware(const char *path);
+static int findSegment(struct dl_phdr_info *info, size_t size, void *data);
+static bool createNodes(void);
+static void startNode(simNode *node);
+static void nodeEntry(void);
+static void nodeLoad(simNode *node);
+static void nodeResume(simNode *node);
+static void nodeYield(simNode *node);
+static void nodeRestart(simNode *node);
+static void nodeHandle(simNode *node, const simInterrupt *interrupt);
+static void nodeHandleOnDriverStack(simNode *node, const simInterrupt *interrupt);
+static bool nodeHandlePending(simNode *node);
+static void cpuEnter(void);
+static void cpuLeave(simNode *node);
+static void pressButton(int node, uint64_t at);
+static bool eventPop(simEvent *event);
+static const char *nodeName(const simNode *node, char *buf, size_t buflen);
+
+// Run the simulation
+int main(int argc, char *argv[])
+{
+    const char *firmware = NULL;
+
+    // Parse the options
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:p:l:r:g:s:v:f:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            simOpt.sensors = atoi(optarg);
+            break;
+        case 't':
+            simOpt.durationUs = strtoull(optarg, NULL, 10) * 1000000ULL;
+            break;
+        case 'p':
+            simOpt.benchPeriodSecs = (uint32_t) strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            simOpt.notecardLatencyMs = (uint32_t) strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            simOpt.radiusMetres = (uint32_t) strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            simOpt.pairSpacingMs = (uint32_t) strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            simOpt.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'v':
+            simOpt.trace = (strcmp(optarg, "all") == 0) ? -2 : atoi(optarg);
+            break;
+        case 'f':
+            firmware = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (simOpt.sensors < 1 || simOpt.benchPeriodSecs == 0 || simOpt.durationUs == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    randomState = (simOpt.seed * 0x9E3779B97F4A7C15ULL) | 1;
+
+    // The firmware is found beside the driver unless it's named
+    char path[4096];
+    if (firmware == NULL) {
+        ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - sizeof("sparrowsim.so"));
+        if (len < 0) {
+            perror("readlink");
+            return 1;
+        }
+        path[len] = '\0';
+        char *slash = strrchr(path, '/');
+        strcpy((slash == NULL) ? path : slash+1, "sparrowsim.so");
+        firmware = path;
+    }
+
+    // Load the firmware and create the nodes
+    if (!loadFirmware(firmware) || !createNodes()) {
+        return 1;
+    }
+
+    // Pair every sensor with the gateway as a person would, pressing the gateway's button and
+    // then each sensor's in turn, and finally the gateway's again once they've all had time
+    pressButton(0, SIM_PAIR_GATEWAY_US);
+    uint64_t pressUs = SIM_PAIR_SENSORS_US;
+    for (int i=1; i<simNodeCount; i++) {
+        pressButton(i, pressUs);
+        pressUs += (uint64_t) simOpt.pairSpacingMs * 1000;
+    }
+    pressButton(0, pressUs + SIM_PAIR_WINDOW_US);
+    simSchedule(pressUs + SIM_PAIR_WINDOW_US, 0, SIM_EVENT_PAIR_END, 0, 0);
+    printf("simulating a gateway and %d sensors for %llus, pairing until %.0fs\n",
+           simOpt.sensors, (unsigned long long) (simOpt.durationUs / 1000000),
+           (double) (pressUs + SIM_PAIR_WINDOW_US) / 1000000);
+
+    // Run until the time is up
+    struct timespec wallBegan, wallEnded;
+    clock_gettime(CLOCK_MONOTONIC, &wallBegan);
+    simEvent event;
+    while (eventPop(&event) && event.us <= simOpt.durationUs) {
+        simNow = event.us;
+        simNode *node = (event.node >= 0) ? &simNodes[event.node] : NULL;
+        switch (event.kind) {
+
+        case SIM_EVENT_WAKE:
+            if (event.gen == node->wakeGen && (node->state == SIM_NODE_DELAY || node->state == SIM_NODE_RUNNABLE)) {
+                nodeResume(node);
+            }
+            break;
+
+        case SIM_EVENT_ALARM:
+            if (event.gen == node->alarmGen && node->alarmArmed) {
+                node->alarmArmed = false;
+                simInterrupt interrupt = { .kind = SIM_EVENT_ALARM };
+                simInterruptNode(node, &interrupt);
+            }
+            break;
+
+        case SIM_EVENT_BUTTON: {
+            simInterrupt interrupt = { .kind = SIM_EVENT_BUTTON, .irq = (int) event.arg };
+            simInterruptNode(node, &interrupt);
+            break;
+        }
+
+        case SIM_EVENT_PAIR_END:
+            simMeasureFromUs = simNow;
+            break;
+
+        default:
+            simAirEvent(event.kind, node, event.gen, event.arg);
+            break;
+
+        }
+    }
+    if (simNow < simOpt.durationUs) {
+        simNow = simOpt.durationUs;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &wallEnded);
+
+    // Report
+    double seconds = (double) (simNow - simMeasureFromUs) / 1000000;
+    double wall = (double) (wallEnded.tv_sec - wallBegan.tv_sec) + (double) (wallEnded.tv_nsec - wallBegan.tv_nsec) / 1e9;
+    printf("\nsimulated %.0fs in %.1fs; measured over the last %.0fs\n", (double) simNow / 1000000, wall, seconds);
+    if (seconds <= 0) {
+        printf("the run ended before pairing did, so nothing was measured\n");
+        return 0;
+    }
+    uint32_t resets = 0;
+    for (int i=0; i<simNodeCount; i++) {
+        resets += simNodes[i].resets;
+    }
+    printf("gateway cpu:   %.1fms (%.4f%% of the time simulated)\n",
+           (double) simNodes[0].cpuNs / 1e6, 100.0 * (double) simNodes[0].cpuNs / ((double) simNow * 1000));
+    printf("resets:        %u\n", resets);
+    simAirReport(seconds);
+    simBenchReport(seconds);
+    return 0;
+
+}
+
+// Describe the options
+static void usage(const char *program)
+{
+    fprintf(stderr, "usage: %s [options]\n", program);
+    fprintf(stderr, "  -n sensors     number of sensors (%d)\n", simOpt.sensors);
+    fprintf(stderr, "  -t secs        time to simulate (%llu)\n", (unsigned long long) (simOpt.durationUs / 1000000));
+    fprintf(stderr, "  -p secs        period at which each sensor sends a note (%u)\n", simOpt.benchPeriodSecs);
+    fprintf(stderr, "  -l ms          time that each Notecard transaction takes (%u)\n", simOpt.notecardLatencyMs);
+    fprintf(stderr, "  -r metres      radius of the disc over which sensors are placed (%u)\n", simOpt.radiusMetres);
+    fprintf(stderr, "  -g ms          time between pairing one sensor and the next (%u)\n", simOpt.pairSpacingMs);
+    fprintf(stderr, "  -s seed        seed of the placement and of the nodes' IDs (%llu)\n", (unsigned long long) simOpt.seed);
+    fprintf(stderr, "  -v node|all    trace a node's output, the gateway being node 0\n");
+    fprintf(stderr, "  -f path        firmware to run (sparrowsim.so beside the driver)\n");
+}
+
+// Load the firmware, and find and keep a copy of its writable segment as it was loaded
+static bool loadFirmware(const char *path)
+{
+
+    // Reserve the flash's address range before anything else can be mapped there
+    void *flash = mmap((void *) SIM_FLASH_BASE, SIM_FLASH_SIZE, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (flash != (void *) SIM_FLASH_BASE) {
+        fprintf(stderr, "can't reserve the flash at 0x%08lx\n", SIM_FLASH_BASE);
+        return false;
+    }
+
+    // Load the firmware
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        return false;
+    }
+    simFw.main = (void (*)(void)) dlsym(handle, "simNodeMain");
+    simFw.alarm = (void (*)(void)) dlsym(handle, "simNodeAlarm");
+    simFw.radio = (void (*)(int, const uint8_t *, uint16_t, int16_t, int8_t)) dlsym(handle, "simNodeRadio");
+    simFw.button = (bool (*)(bool)) dlsym(handle, "simNodeButton");
+    simFw.primask = (uint32_t (*)(void)) dlsym(handle, "simNodePrimask");
+    simFw.setIRQ = (void (*)(bool)) dlsym(handle, "simNodeSetIRQ");
+    if (simFw.main == NULL || simFw.alarm == NULL || simFw.radio == NULL
+            || simFw.button == NULL || simFw.primask == NULL || simFw.setIRQ == NULL) {
+        fprintf(stderr, "%s: not a sparrow simulation build\n", path);
+        return false;
+    }
+
+    // Find its writable segment, which holds all of the firmware's RAM
+    Dl_info info;
+    if (dladdr((void *) simFw.main, &info) == 0) {
+        fprintf(stderr, "%s: can't be located\n", path);
+        return false;
+    }
+    dl_iterate_phdr(findSegment, info.dli_fbase);
+    if (segBase == NULL) {
+        fprintf(stderr, "%s: has no writable segment\n", path);
+        return false;
+    }
+    segInitial = malloc(segLen);
+    if (segInitial == NULL) {
+        return false;
+    }
+    memcpy(segInitial, segBase, segLen);
+    return true;
+
+}
+
+// Find the writable segment of the object loaded at the given base
+static int findSegment(struct dl_phdr_info *info, size_t size, void *data)
+{
+    (void) size;
+    if ((void *) info->dlpi_addr != data) {
+        return 0;
+    }
+    for (int i=0; i<info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        if (ph->p_type == PT_LOAD && (ph->p_flags & PF_W) != 0) {
+            segBase = (uint8_t *) (info->dlpi_addr + ph->p_vaddr);
+            segLen = ph->p_memsz;
+            return 1;
+        }
+    }
+    return 1;
+}
+
+// Create and place the nodes, with flash that is erased and RAM as the firmware was loaded
+static bool createNodes(void)
+{
+
+    // Create each node's flash
+    simNodeCount = simOpt.sensors + 1;
+    size_t flashTotal = SIM_FLASH_SIZE * (size_t) simNodeCount;
+    flashFd = memfd_create("sparrowsim-flash", 0);
+    if (flashFd < 0 || ftruncate(flashFd, (off_t) flashTotal) != 0) {
+        perror("memfd");
+        return false;
+    }
+    void *all = mmap(NULL, flashTotal, PROT_READ | PROT_WRITE, MAP_SHARED, flashFd, 0);
+    if (all == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    memset(all, 0xFF, flashTotal);
+    munmap(all, flashTotal);
+
+    // Create the nodes, placing the gateway at the centre and the sensors evenly over the disc
+    simNodes = calloc((size_t) simNodeCount, sizeof(simNode));
+    if (simNodes == NULL) {
+        return false;
+    }
+    for (int i=0; i<simNodeCount; i++) {
+        simNode *node = &simNodes[i];
+        node->index = i;
+        node->params.gateway = (i == 0);
+        node->params.uid[0] = (uint32_t) (simRandom() * 4294967296.0);
+        node->params.uid[1] = (uint32_t) (simRandom() * 4294967296.0);
+        node->params.uid[2] = (uint32_t) i;
+        node->params.benchPeriodSecs = simOpt.benchPeriodSecs;
+        node->params.notecardLatencyMs = simOpt.notecardLatencyMs;
+        node->params.epochSecs = SIM_EPOCH_SECS;
+        node->params.trace = (simOpt.trace == -2 || simOpt.trace == i);
+        if (i > 0) {
+            double r = simOpt.radiusMetres * sqrt(simRandom());
+            double a = 2 * M_PI * simRandom();
+            node->x = r * cos(a);
+            node->y = r * sin(a);
+        }
+        node->ram = malloc(segLen);
+        node->stack = malloc(SIM_STACK_SIZE);
+        if (node->ram == NULL || node->stack == NULL) {
+            fprintf(stderr, "out of memory creating node %d\n", i);
+            return false;
+        }
+        memcpy(node->ram, segInitial, segLen);
+        simAirInit(node);
+        startNode(node);
+        uint64_t bootUs = (i == 0) ? 0 : (uint64_t) (simRandom() * SIM_BOOT_SPREAD_US);
+        node->bootUs = bootUs;
+        simSchedule(bootUs, i, SIM_EVENT_WAKE, node->wakeGen, 0);
+    }
+    return true;
+
+}
+
+// Make a node ready to run its firmware from the beginning
+static void startNode(simNode *node)
+{
+    getcontext(&node->context);
+    node->context.uc_stack.ss_sp = node->stack;
+    node->context.uc_stack.ss_size = SIM_STACK_SIZE;
+    node->context.uc_link = &driverContext;
+    makecontext(&node->context, nodeEntry, 0);
+    node->state = SIM_NODE_RUNNABLE;
+    node->wakeGen++;
+}
+
+// The coroutine of a node, which only returns if the firmware does
+static void nodeEntry(void)
+{
+    simFw.main();
+    simCurrent->state = SIM_NODE_DEAD;
+}
+
+// Put a node's RAM and flash in place
+static void nodeLoad(simNode *node)
+{
+    if (loaded == node) {
+        return;
+    }
+    if (loaded != NULL) {
+        memcpy(loaded->ram, segBase, segLen);
+    }
+    memcpy(segBase, node->ram, segLen);
+    void *flash = mmap((void *) SIM_FLASH_BASE, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                       flashFd, (off_t) (SIM_FLASH_SIZE * (size_t) node->index));
+    if (flash != (void *) SIM_FLASH_BASE) {
+        perror("mmap flash");
+        exit(1);
+    }
+    loaded = node;
+}
+
+// Run a node until it idles or delays
+static void nodeResume(simNode *node)
+{
+    nodeLoad(node);
+    simCurrent = node;
+    node->state = SIM_NODE_RUNNABLE;
+    node->polls = 0;
+    cpuEnter();
+    swapcontext(&driverContext, &node->context);
+    cpuLeave(node);
+    simCurrent = NULL;
+    if (node->resetting) {
+        nodeRestart(node);
+    }
+}
+
+// Return to the driver from a node's coroutine
+static void nodeYield(simNode *node)
+{
+    node->primask = simFw.primask();
+    swapcontext(&node->context, &driverContext);
+}
+
+// Restart a node that has reset itself, with its RAM as it was first loaded and its flash
+// as it was left.  Its backup registers are lost with its RAM.
+static void nodeRestart(simNode *node)
+{
+    nodeLoad(node);
+    memcpy(segBase, segInitial, segLen);
+    node->resetting = false;
+    node->resets++;
+    node->pendingCount = 0;
+    node->alarmArmed = false;
+    node->alarmGen++;
+    inHandler = false;
+    simAirInit(node);
+    startNode(node);
+    node->bench.base = node->bench.queuedMax;
+    node->bootUs = simNow + SIM_RESET_US;
+    simSchedule(node->bootUs, node->index, SIM_EVENT_WAKE, node->wakeGen, 0);
+}
+
+// Run an interrupt handler of the node that is loaded
+static void nodeHandle(simNode *node, const simInterrupt *interrupt)
+{
+    inHandler = true;
+    simFw.setIRQ(true);
+    switch (interrupt->kind) {
+    case SIM_EVENT_ALARM:
+        simFw.alarm();
+        break;
+    case SIM_EVENT_BUTTON:
+        // Until the button's interrupt is enabled, try again later
+        if (!simFw.button(interrupt->irq != 0)) {
+            simSchedule(simNow + SIM_BUTTON_RETRY_US, node->index, SIM_EVENT_BUTTON, 0, interrupt->irq);
+        }
+        break;
+    default:
+        simFw.radio(interrupt->irq, interrupt->payload, interrupt->size, interrupt->rssi, interrupt->snr);
+        break;
+    }
+    simFw.setIRQ(false);
+    inHandler = false;
+}
+
+// Run an interrupt handler of an idle or delaying node on the driver's stack, and wake the
+// node if it was idle, as an interrupt ends WFI
+static void nodeHandleOnDriverStack(simNode *node, const simInterrupt *interrupt)
+{
+    nodeLoad(node);
+    simCurrent = node;
+    handlerOnDriverStack = true;
+    cpuEnter();
+    if (setjmp(handlerReset) == 0) {
+        nodeHandle(node, interrupt);
+    }
+    cpuLeave(node);
+    handlerOnDriverStack = false;
+    simCurrent = NULL;
+    if (node->resetting) {
+        nodeRestart(node);
+        return;
+    }
+    if (node->state == SIM_NODE_IDLE) {
+        node->state = SIM_NODE_RUNNABLE;
+        node->wakeGen++;
+        simSchedule(simNow, node->index, SIM_EVENT_WAKE, node->wakeGen, 0);
+    }
+}
+
+// Run the handlers of interrupts that arrived while the running node had them masked,
+// returning true if there were any
+static bool nodeHandlePending(simNode *node)
+{
+    bool handled = false;
+    while (node->pendingCount > 0) {
+        simInterrupt interrupt = node->pending[0];
+        node->pendingCount--;
+        memmove(&node->pending[0], &node->pending[1], sizeof(simInterrupt) * (size_t) node->pendingCount);
+        nodeHandle(node, &interrupt);
+        handled = true;
+    }
+    return handled;
+}
+
+// Interrupt a node, which is done at once if it is idle or is delaying with interrupts
+// enabled, and otherwise once it next yields with them enabled or idles
+void simInterruptNode(simNode *node, const simInterrupt *interrupt)
+{
+    if (node->state == SIM_NODE_DEAD) {
+        return;
+    }
+    if (node->state == SIM_NODE_IDLE || (node->state == SIM_NODE_DELAY && node->primask == 0)) {
+        nodeHandleOnDriverStack(node, interrupt);
+        return;
+    }
+    if (node->pendingCount >= SIM_PENDING_MAX) {
+        node->pendingDropped++;
+        return;
+    }
+    node->pending[node->pendingCount++] = *interrupt;
+}
+
+// Note the CPU time at which a node was entered
+static void cpuEnter(void)
+{
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuEntered);
+}
+
+// Charge a node for the CPU time since it was entered
+static void cpuLeave(simNode *node)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    int64_t ns = (int64_t) (now.tv_sec - cpuEntered.tv_sec) * 1000000000LL + (now.tv_nsec - cpuEntered.tv_nsec);
+    if (ns > 0) {
+        node->cpuNs += (uint64_t) ns;
+    }
+}
+
+// Press a node's button briefly at the given time
+static void pressButton(int node, uint64_t at)
+{
+    simSchedule(at, node, SIM_EVENT_BUTTON, 0, 1);
+    simSchedule(at + SIM_PRESS_US, node, SIM_EVENT_BUTTON, 0, 0);
+}
+
+// Schedule an event
+void simSchedule(uint64_t us, int node, int kind, uint32_t gen, int64_t arg)
+{
+    if (eventCount == eventMax) {
+        eventMax = (eventMax == 0) ? 1024 : eventMax * 2;
+        events = realloc(events, eventMax * sizeof(simEvent));
+        if (events == NULL) {
+            fprintf(stderr, "out of memory scheduling events\n");
+            exit(1);
+        }
+    }
+    simEvent e = { .us = us, .seq = eventSeq++, .node = node, .kind = kind, .gen = gen, .arg = arg };
+    size_t i = eventCount++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (events[parent].us < e.us || (events[parent].us == e.us && events[parent].seq < e.seq)) {
+            break;
+        }
+        events[i] = events[parent];
+        i = parent;
+    }
+    events[i] = e;
+}
+
+// Take the earliest event
+static bool eventPop(simEvent *event)
+{
+    if (eventCount == 0) {
+        return false;
+    }
+    *event = events[0];
+    simEvent last = events[--eventCount];
+    size_t i = 0;
+    for (;;) {
+        size_t child = (2 * i) + 1;
+        if (child >= eventCount) {
+            break;
+        }
+        if (child + 1 < eventCount && (events[child+1].us < events[child].us
+                                       || (events[child+1].us == events[child].us && events[child+1].seq < events[child].seq))) {
+            child++;
+        }
+        if (last.us < events[child].us || (last.us == events[child].us && last.seq < events[child].seq)) {
+            break;
+        }
+        events[i] = events[child];
+        i = child;
+    }
+    events[i] = last;
+    return true;
+}
+
+// A uniformly distributed number in [0,1)
+double simRandom(void)
+{
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return (double) ((randomState * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+// A node's name for the trace
+static const char *nodeName(const simNode *node, char *buf, size_t buflen)
+{
+    if (node->index == 0) {
+        return "gw";
+    }
+    snprintf(buf, buflen, "s%d", node->index);
+    return buf;
+}
+
+// Get the parameters of the running node
+const simParams *simNodeParams(void)
+{
+    return &simCurrent->params;
+}
+
+// Get the time, treating a node that reads it over and over as waiting for it to change
+uint64_t simNowUs(void)
+{
+    if (simCurrent != NULL && !inHandler && ++simCurrent->polls > SIM_POLL_LIMIT) {
+        simCurrent->polls = 0;
+        simDelayUs(SIM_POLL_DELAY_US);
+    }
+    return simNow;
+}
+
+// Get the time in RTC ticks
+uint64_t simTicks(void)
+{
+    return (simNowUs() * 1024) / 1000000;
+}
+
+// Get the time since the running node last started
+uint64_t simUptimeUs(void)
+{
+    return simNowUs() - simCurrent->bootUs;
+}
+
+// Set the running node's alarm, to the first microsecond at or after the given tick
+void simAlarmSet(uint64_t ticks)
+{
+    simNode *node = simCurrent;
+    uint64_t us = ((ticks * 1000000) + 1023) / 1024;
+    if (us < simNow) {
+        us = simNow;
+    }
+    node->alarmArmed = true;
+    node->alarmGen++;
+    simSchedule(us, node->index, SIM_EVENT_ALARM, node->alarmGen, 0);
+}
+
+// Cancel the running node's alarm
+void simAlarmCancel(void)
+{
+    simCurrent->alarmArmed = false;
+    simCurrent->alarmGen++;
+}
+
+// Wait for an interrupt, as WFI does.  Interrupts wake the node even when masked.
+void simIdle(void)
+{
+    simNode *node = simCurrent;
+    if (inHandler || nodeHandlePending(node)) {
+        return;
+    }
+    node->state = SIM_NODE_IDLE;
+    nodeYield(node);
+}
+
+// Delay, letting interrupts run during the delay unless they are masked
+void simDelayUs(uint64_t us)
+{
+    simNode *node = simCurrent;
+    if (inHandler || us == 0) {
+        return;
+    }
+    if (simFw.primask() == 0) {
+        nodeHandlePending(node);
+    }
+    node->state = SIM_NODE_DELAY;
+    node->wakeGen++;
+    simSchedule(simNow + us, node->index, SIM_EVENT_WAKE, node->wakeGen, 0);
+    nodeYield(node);
+}
+
+// Write a node's trace output, prefixed at the start of each line with the time and node
+void simTrace(const char *text, size_t len)
+{
+    char name[16];
+    simNode *node = simCurrent;
+    if (traceMidLine != NULL && traceMidLine != node) {
+        putchar('\n');
+        traceMidLine = NULL;
+    }
+    for (size_t i=0; i<len; i++) {
+        if (text[i] == '\r') {
+            continue;
+        }
+        if (traceMidLine == NULL) {
+            printf("%10.3f %-5s ", (double) simNow / 1000000, nodeName(node, name, sizeof(name)));
+            traceMidLine = node;
+        }
+        putchar(text[i]);
+        if (text[i] == '\n') {
+            traceMidLine = NULL;
+        }
+    }
+}
+
+// Reset the running node, which restarts once the driver has regained control
+void simReset(void)
+{
+    simNode *node = simCurrent;
+    node->resetting = true;
+    if (handlerOnDriverStack) {
+        longjmp(handlerReset, 1);
+    }
+    swapcontext(&node->context, &driverContext);
+    abort();
+}
+
+// Stop the simulation because the firmware did something that the device couldn't
+void simFatal(const char *format, ...)
+{
+    char name[16];
+    if (simCurrent != NULL) {
+        fprintf(stderr, "%.3f %s: ", (double) simNow / 1000000, nodeName(simCurrent, name, sizeof(name)));
+    }
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
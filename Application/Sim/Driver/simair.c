@@ -0,0 +1,598 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// The airwaves.  Signals fall off with distance by a log-distance path loss, and a frame is
+// received only by a radio that is listening on its channel with its modulation and sync
+// word from before the end of its preamble, that hears it above the demodulation floor of
+// its spreading factor, and that isn't drowned out by an overlapping frame of the same
+// spreading factor within the capture margin.  Radios are half-duplex, and a radio that
+// stops listening or transmitting abandons the frame that it was receiving or sending.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "simdriver.h"
+
+// Modems, as in radio.h
+#define SIM_MODEM_FSK           0
+#define SIM_MODEM_LORA          1
+
+// Path loss at a metre, and its exponent
+#define SIM_PATH_LOSS_1M_DB     31.7
+#define SIM_PATH_LOSS_EXPONENT  3.0
+
+// Receiver noise figure
+#define SIM_NOISE_FIGURE_DB     6.0
+
+// Margin by which a frame must exceed those overlapping it to be captured
+#define SIM_CAPTURE_DB          6.0
+
+// SNR needed to demodulate FSK
+#define SIM_FSK_SNR_DB          13.0
+
+// Symbols of a LoRa preamble that a receiver must hear to detect it, and bytes of FSK
+#define SIM_LORA_DETECT_SYMBOLS 5
+#define SIM_FSK_DETECT_BYTES    4
+
+// Frames that are remembered, and for how long after they end, so that the frames that
+// overlapped one may be found when it ends
+#define SIM_FRAMES              65536
+#define SIM_FRAME_KEEP_US       (30*1000000ULL)
+
+// A frame
+typedef struct {
+    int64_t id;
+    int sender;
+    uint32_t frequency;
+    uint16_t syncWord;
+    simModemConfig config;
+    uint8_t payload[256];
+    uint8_t size;
+    uint64_t startUs;
+    uint64_t lockUs;
+    uint64_t endUs;
+    bool aborted;
+} simFrame;
+
+// The outcome of a frame at one of the radios receiving it
+typedef struct {
+    simNode *node;
+    simInterrupt interrupt;
+} simDelivery;
+
+// Frames, and those that are on the air or recently were
+static simFrame frames[SIM_FRAMES];
+static int64_t frameNext = 0;
+static int64_t *active = NULL;
+static size_t activeCount = 0;
+static size_t activeMax = 0;
+
+// Statistics, gathered once measurement has begun
+static uint64_t statSensorAirtimeUs = 0;
+static uint64_t statGatewayAirtimeUs = 0;
+static uint32_t statSensorFrames = 0;
+static uint32_t statGatewayFrames = 0;
+static uint32_t statGatewayReceived = 0;
+static uint32_t statGatewayCollided = 0;
+static uint32_t statGatewayWeak = 0;
+static uint32_t statGatewayErrors = 0;
+static uint32_t statSensorReceived = 0;
+static uint32_t statCollided = 0;
+static uint32_t statCadDetected = 0;
+static uint32_t statCadClear = 0;
+
+// Demodulation floor in dB of SNR, by LoRa spreading factor from SF7
+static const double loraSnrDb[] = { -7.5, -10.0, -12.5, -15.0, -17.5, -20.0 };
+
+// Forwards
+static simFrame *frameGet(int64_t id);
+static double bandwidthHz(const simModemConfig *config);
+static double symbolUs(const simModemConfig *config);
+static double noiseDbm(const simModemConfig *config);
+static double requiredSnrDb(const simModemConfig *config);
+static double receivedDbm(const simFrame *frame, const simNode *receiver);
+static bool sameModulation(const simModemConfig *a, const simModemConfig *b);
+static bool interferes(const simFrame *other, const simFrame *frame);
+static void abandon(simNode *node);
+static void pruneActive(void);
+static bool measuring(void);
+static void lockEvent(simFrame *frame);
+static void txEndEvent(simFrame *frame);
+static void cadEndEvent(simNode *node);
+
+// Find a frame that is still remembered
+static simFrame *frameGet(int64_t id)
+{
+    simFrame *frame = &frames[id % SIM_FRAMES];
+    return (frame->id == id) ? frame : NULL;
+}
+
+// The bandwidth of a modulation, in Hz
+static double bandwidthHz(const simModemConfig *config)
+{
+    static const double lora[] = { 125000, 250000, 500000 };
+    if (config->modem == SIM_MODEM_LORA) {
+        return lora[config->bandwidth % 3];
+    }
+    return (double) config->datarate;
+}
+
+// The time of a LoRa symbol, or of an FSK byte, in microseconds
+static double symbolUs(const simModemConfig *config)
+{
+    if (config->modem == SIM_MODEM_LORA) {
+        return (double) (1U << config->datarate) * 1e6 / bandwidthHz(config);
+    }
+    return 8e6 / (double) config->datarate;
+}
+
+// The noise floor of a receiver
+static double noiseDbm(const simModemConfig *config)
+{
+    return -174.0 + (10.0 * log10(bandwidthHz(config))) + SIM_NOISE_FIGURE_DB;
+}
+
+// The SNR that a modulation needs to be demodulated
+static double requiredSnrDb(const simModemConfig *config)
+{
+    if (config->modem != SIM_MODEM_LORA) {
+        return SIM_FSK_SNR_DB;
+    }
+    uint32_t sf = config->datarate;
+    if (sf < 7) {
+        sf = 7;
+    }
+    if (sf > 12) {
+        sf = 12;
+    }
+    return loraSnrDb[sf - 7];
+}
+
+// The power at which a receiver hears a frame
+static double receivedDbm(const simFrame *frame, const simNode *receiver)
+{
+    const simNode *sender = &simNodes[frame->sender];
+    double dx = sender->x - receiver->x;
+    double dy = sender->y - receiver->y;
+    double metres = sqrt((dx * dx) + (dy * dy));
+    if (metres < 1.0) {
+        metres = 1.0;
+    }
+    return (double) frame->config.power - (SIM_PATH_LOSS_1M_DB + (10.0 * SIM_PATH_LOSS_EXPONENT * log10(metres)));
+}
+
+// See whether a receiver configured one way can demodulate a frame sent another
+static bool sameModulation(const simModemConfig *a, const simModemConfig *b)
+{
+    if (a->modem != b->modem || a->datarate != b->datarate) {
+        return false;
+    }
+    if (a->modem == SIM_MODEM_LORA) {
+        return (a->bandwidth == b->bandwidth && a->iqInverted == b->iqInverted);
+    }
+    return true;
+}
+
+// See whether one frame interferes with another, which LoRa frames of other spreading
+// factors are taken not to do because they are nearly orthogonal
+static bool interferes(const simFrame *other, const simFrame *frame)
+{
+    if (other->id == frame->id || other->frequency != frame->frequency
+            || other->startUs >= frame->endUs || other->endUs <= frame->startUs) {
+        return false;
+    }
+    if (other->config.modem == SIM_MODEM_LORA && frame->config.modem == SIM_MODEM_LORA) {
+        return (other->config.datarate == frame->config.datarate);
+    }
+    return true;
+}
+
+// Abandon whatever the radio was sending or receiving
+static void abandon(simNode *node)
+{
+    simRadio *radio = &node->radio;
+    if (radio->mode == SIM_RADIO_TX && radio->frame >= 0) {
+        simFrame *frame = frameGet(radio->frame);
+        if (frame != NULL) {
+            frame->aborted = true;
+            frame->endUs = simNow;
+        }
+    }
+    radio->frame = -1;
+    radio->gen++;
+}
+
+// Forget the frames that can no longer have overlapped one that is on the air
+static void pruneActive(void)
+{
+    size_t kept = 0;
+    for (size_t i=0; i<activeCount; i++) {
+        simFrame *frame = frameGet(active[i]);
+        if (frame != NULL && frame->endUs + SIM_FRAME_KEEP_US >= simNow) {
+            active[kept++] = active[i];
+        }
+    }
+    activeCount = kept;
+}
+
+// See whether the statistics are being gathered
+static bool measuring(void)
+{
+    return simMeasureFromUs != 0 && simNow >= simMeasureFromUs;
+}
+
+// Reset a node's radio, which is asleep when the node starts
+void simAirInit(simNode *node)
+{
+    simRadio *radio = &node->radio;
+    abandon(node);
+    radio->mode = SIM_RADIO_SLEEP;
+    radio->continuous = false;
+    radio->frequency = 0;
+    radio->syncWord = 0x1424;
+}
+
+// Tune the running node's radio, which loses any frame it was receiving
+void simAirSetChannel(uint32_t frequency)
+{
+    simRadio *radio = &simCurrent->radio;
+    if (radio->mode == SIM_RADIO_RX) {
+        abandon(simCurrent);
+        radio->rxSinceUs = simNow;
+    }
+    radio->frequency = frequency;
+}
+
+// Set the running node's LoRa sync word
+void simAirSetSyncWord(uint16_t syncWord)
+{
+    simCurrent->radio.syncWord = syncWord;
+}
+
+// Set the running node's transmit configuration
+void simAirSetTxConfig(const simModemConfig *config)
+{
+    simCurrent->radio.tx = *config;
+}
+
+// Set the running node's receive configuration
+void simAirSetRxConfig(const simModemConfig *config)
+{
+    simRadio *radio = &simCurrent->radio;
+    radio->rx = *config;
+    if (radio->mode == SIM_RADIO_RX) {
+        abandon(simCurrent);
+        radio->rxSinceUs = simNow;
+    }
+}
+
+// The time on air of a frame, as radio.c computes it but in microseconds
+uint32_t simAirTimeOnAirUs(const simModemConfig *config, uint8_t payloadLen)
+{
+    if (config->modem != SIM_MODEM_LORA) {
+        uint64_t bits = ((uint64_t) config->preambleLen << 3) + (config->fixLen ? 0 : 8) + 24
+                        + ((uint64_t) (payloadLen + (config->crcOn ? 2 : 0)) << 3);
+        return (config->datarate == 0) ? 0 : (uint32_t) ((bits * 1000000) / config->datarate);
+    }
+    static const uint32_t bandwidths[] = { 125000, 250000, 500000 };
+    uint32_t bw = config->bandwidth % 3;
+    int32_t sf = (int32_t) config->datarate;
+    int32_t crDenom = config->coderate + 4;
+    bool lowDatarateOptimize = ((bw == 0 && (sf == 11 || sf == 12)) || (bw == 1 && sf == 12));
+    int32_t ceilNumerator = (payloadLen << 3) + (config->crcOn ? 16 : 0) - (4 * sf) + (config->fixLen ? 0 : 20);
+    int32_t ceilDenominator;
+    if (sf <= 6) {
+        ceilDenominator = 4 * sf;
+    } else {
+        ceilNumerator += 8;
+        ceilDenominator = lowDatarateOptimize ? 4 * (sf - 2) : 4 * sf;
+    }
+    if (ceilNumerator < 0) {
+        ceilNumerator = 0;
+    }
+    int32_t intermediate = (((ceilNumerator + ceilDenominator - 1) / ceilDenominator) * crDenom) + config->preambleLen + 12;
+    if (sf <= 6) {
+        intermediate += 2;
+    }
+    uint64_t numerator = (uint64_t) ((4 * intermediate) + 1) * (1U << (sf - 2));
+    return (uint32_t) ((numerator * 1000000) / (4ULL * bandwidths[bw]));
+}
+
+// Transmit a frame from the running node
+void simAirSend(const uint8_t *buffer, uint8_t size)
+{
+    simNode *node = simCurrent;
+    simRadio *radio = &node->radio;
+    abandon(node);
+    pruneActive();
+
+    // Put the frame on the air
+    simFrame *frame = &frames[frameNext % SIM_FRAMES];
+    memset(frame, 0, sizeof(*frame));
+    frame->id = frameNext++;
+    frame->sender = node->index;
+    frame->frequency = radio->frequency;
+    frame->syncWord = radio->syncWord;
+    frame->config = radio->tx;
+    memcpy(frame->payload, buffer, size);
+    frame->size = size;
+    frame->startUs = simNow;
+    frame->endUs = simNow + simAirTimeOnAirUs(&radio->tx, size);
+    double preambleUs = symbolUs(&radio->tx) * (double) radio->tx.preambleLen;
+    if (radio->tx.modem == SIM_MODEM_LORA) {
+        frame->lockUs = simNow + (uint64_t) (preambleUs + (4.25 * symbolUs(&radio->tx)));
+    } else {
+        frame->lockUs = simNow + (uint64_t) (preambleUs + (3 * symbolUs(&radio->tx)));
+    }
+    if (frame->lockUs > frame->endUs) {
+        frame->lockUs = frame->endUs;
+    }
+    if (activeCount == activeMax) {
+        activeMax = (activeMax == 0) ? 256 : activeMax * 2;
+        active = realloc(active, activeMax * sizeof(int64_t));
+        if (active == NULL) {
+            simFatal("out of memory tracking frames");
+        }
+    }
+    active[activeCount++] = frame->id;
+
+    // Transmit it
+    radio->mode = SIM_RADIO_TX;
+    radio->frame = frame->id;
+    radio->airtimeUs += frame->endUs - frame->startUs;
+    radio->framesSent++;
+    if (measuring()) {
+        if (node->index == 0) {
+            statGatewayAirtimeUs += frame->endUs - frame->startUs;
+            statGatewayFrames++;
+        } else {
+            statSensorAirtimeUs += frame->endUs - frame->startUs;
+            statSensorFrames++;
+        }
+    }
+    simSchedule(frame->lockUs, -1, SIM_EVENT_LOCK, 0, frame->id);
+    simSchedule(frame->endUs, node->index, SIM_EVENT_TX_END, 0, frame->id);
+}
+
+// Listen, until a frame is received unless continuously
+void simAirRx(bool continuous)
+{
+    simRadio *radio = &simCurrent->radio;
+    abandon(simCurrent);
+    radio->mode = SIM_RADIO_RX;
+    radio->continuous = continuous;
+    radio->rxSinceUs = simNow;
+}
+
+// Listen in duty-cycled mode, which is taken to be a single receive that hears any preamble
+// long enough to span the sleep, as the firmware's sniffing preambles are
+void simAirRxDutyCycle(uint32_t rxUs, uint32_t sleepUs)
+{
+    (void) rxUs;
+    (void) sleepUs;
+    simAirRx(false);
+}
+
+// Detect whether a preamble is on the air over the given number of symbols
+void simAirCad(uint8_t symbols)
+{
+    simNode *node = simCurrent;
+    simRadio *radio = &node->radio;
+    abandon(node);
+    radio->mode = SIM_RADIO_CAD;
+    radio->rxSinceUs = simNow;
+    uint64_t us = (uint64_t) ((symbols + 0.5) * symbolUs(&radio->rx));
+    simSchedule(simNow + us, node->index, SIM_EVENT_CAD_END, radio->gen, 0);
+}
+
+// Put the running node's radio into standby
+void simAirStandby(void)
+{
+    abandon(simCurrent);
+    simCurrent->radio.mode = SIM_RADIO_STANDBY;
+}
+
+// Put the running node's radio to sleep
+void simAirSleep(void)
+{
+    abandon(simCurrent);
+    simCurrent->radio.mode = SIM_RADIO_SLEEP;
+}
+
+// The power on the running node's channel, of the noise and whatever is on the air
+int16_t simAirRssi(void)
+{
+    simNode *node = simCurrent;
+    simRadio *radio = &node->radio;
+    double mw = pow(10.0, noiseDbm(&radio->rx) / 10.0);
+    for (size_t i=0; i<activeCount; i++) {
+        simFrame *frame = frameGet(active[i]);
+        if (frame != NULL && frame->sender != node->index && frame->frequency == radio->frequency
+                && frame->startUs <= simNow && frame->endUs > simNow) {
+            mw += pow(10.0, receivedDbm(frame, node) / 10.0);
+        }
+    }
+    return (int16_t) lround(10.0 * log10(mw));
+}
+
+// An event of the airwaves
+void simAirEvent(int kind, simNode *node, uint32_t gen, int64_t id)
+{
+    switch (kind) {
+
+    case SIM_EVENT_LOCK: {
+        simFrame *frame = frameGet(id);
+        if (frame != NULL && !frame->aborted) {
+            lockEvent(frame);
+        }
+        break;
+    }
+
+    case SIM_EVENT_TX_END: {
+        simFrame *frame = frameGet(id);
+        if (frame != NULL) {
+            txEndEvent(frame);
+        }
+        break;
+    }
+
+    case SIM_EVENT_CAD_END:
+        if (gen == node->radio.gen && node->radio.mode == SIM_RADIO_CAD) {
+            cadEndEvent(node);
+        }
+        break;
+
+    }
+}
+
+// Lock the receivers that have heard enough of a frame's preamble onto it
+static void lockEvent(simFrame *frame)
+{
+    double detectUs = symbolUs(&frame->config) * ((frame->config.modem == SIM_MODEM_LORA) ? SIM_LORA_DETECT_SYMBOLS : SIM_FSK_DETECT_BYTES);
+    for (int i=0; i<simNodeCount; i++) {
+        simNode *node = &simNodes[i];
+        simRadio *radio = &node->radio;
+        if (i == frame->sender || radio->mode != SIM_RADIO_RX || radio->frame >= 0
+                || radio->frequency != frame->frequency || !sameModulation(&radio->rx, &frame->config)
+                || (frame->config.modem == SIM_MODEM_LORA && radio->syncWord != frame->syncWord)
+                || (double) radio->rxSinceUs + detectUs > (double) frame->lockUs) {
+            continue;
+        }
+        if (receivedDbm(frame, node) - noiseDbm(&radio->rx) < requiredSnrDb(&radio->rx)) {
+            if (i == 0 && measuring()) {
+                statGatewayWeak++;
+            }
+            continue;
+        }
+        radio->frame = frame->id;
+    }
+}
+
+// Complete a frame at its sender and at the receivers that locked onto it
+static void txEndEvent(simFrame *frame)
+{
+    simDelivery *deliveries = malloc(sizeof(simDelivery) * ((size_t) simNodeCount + 1));
+    if (deliveries == NULL) {
+        simFatal("out of memory delivering a frame");
+    }
+    int count = 0;
+
+    // The sender is done, unless it abandoned the frame
+    simNode *sender = &simNodes[frame->sender];
+    if (!frame->aborted && sender->radio.mode == SIM_RADIO_TX && sender->radio.frame == frame->id) {
+        sender->radio.frame = -1;
+        sender->radio.mode = SIM_RADIO_STANDBY;
+        sender->radio.gen++;
+        deliveries[count].node = sender;
+        memset(&deliveries[count].interrupt, 0, sizeof(simInterrupt));
+        deliveries[count].interrupt.irq = SIM_IRQ_TX_DONE;
+        count++;
+    }
+
+    // Decide the outcome at every receiver before any of them can act on it
+    for (int i=0; i<simNodeCount; i++) {
+        simNode *node = &simNodes[i];
+        simRadio *radio = &node->radio;
+        if (radio->mode != SIM_RADIO_RX || radio->frame != frame->id) {
+            continue;
+        }
+        double signal = receivedDbm(frame, node);
+        double interferenceMw = 0;
+        for (size_t j=0; j<activeCount; j++) {
+            simFrame *other = frameGet(active[j]);
+            if (other != NULL && other->sender != i && interferes(other, frame)) {
+                interferenceMw += pow(10.0, receivedDbm(other, node) / 10.0);
+            }
+        }
+        bool collided = (interferenceMw > 0 && signal - (10.0 * log10(interferenceMw)) < SIM_CAPTURE_DB);
+        bool garbled = frame->aborted || radio->rx.fixLen != frame->config.fixLen
+                       || (radio->rx.fixLen && radio->rx.payloadLen != frame->size);
+        simInterrupt *interrupt = &deliveries[count].interrupt;
+        memset(interrupt, 0, sizeof(*interrupt));
+        deliveries[count].node = node;
+        if (collided || garbled) {
+            interrupt->irq = SIM_IRQ_RX_ERROR;
+        } else {
+            double snr = signal - noiseDbm(&radio->rx);
+            interrupt->irq = SIM_IRQ_RX_DONE;
+            memcpy(interrupt->payload, frame->payload, frame->size);
+            interrupt->size = frame->size;
+            interrupt->rssi = (int16_t) lround(signal);
+            interrupt->snr = (int8_t) lround((snr > 127) ? 127 : (snr < -128) ? -128 : snr);
+        }
+        count++;
+        if (measuring()) {
+            if (collided) {
+                statCollided++;
+            }
+            if (i == 0) {
+                if (collided) {
+                    statGatewayCollided++;
+                } else if (garbled) {
+                    statGatewayErrors++;
+                } else {
+                    statGatewayReceived++;
+                }
+            } else if (!collided && !garbled) {
+                statSensorReceived++;
+            }
+        }
+
+        // A single receive ends with the frame, while a continuous one listens for the next
+        radio->frame = -1;
+        if (radio->continuous) {
+            radio->rxSinceUs = simNow;
+        } else {
+            radio->mode = SIM_RADIO_STANDBY;
+            radio->gen++;
+        }
+    }
+
+    // Interrupt the sender and the receivers
+    for (int i=0; i<count; i++) {
+        simInterruptNode(deliveries[i].node, &deliveries[i].interrupt);
+    }
+    free(deliveries);
+}
+
+// Complete a CAD, which detects any frame of its modulation that was on the air during it
+static void cadEndEvent(simNode *node)
+{
+    simRadio *radio = &node->radio;
+    bool detected = false;
+    for (size_t i=0; i<activeCount && !detected; i++) {
+        simFrame *frame = frameGet(active[i]);
+        if (frame != NULL && frame->sender != node->index && frame->frequency == radio->frequency
+                && sameModulation(&radio->rx, &frame->config)
+                && frame->startUs < simNow && frame->endUs > radio->rxSinceUs
+                && receivedDbm(frame, node) - noiseDbm(&radio->rx) >= requiredSnrDb(&radio->rx)) {
+            detected = true;
+        }
+    }
+    radio->mode = SIM_RADIO_STANDBY;
+    radio->gen++;
+    if (measuring()) {
+        if (detected) {
+            statCadDetected++;
+        } else {
+            statCadClear++;
+        }
+    }
+    simInterrupt interrupt = { .irq = detected ? SIM_IRQ_CAD_DETECTED : SIM_IRQ_CAD_CLEAR };
+    simInterruptNode(node, &interrupt);
+}
+
+// Report the use of the airwaves
+void simAirReport(double seconds)
+{
+    printf("airtime:       sensors %.1fs in %u frames (%.2f%% of the channel), gateway %.1fs in %u frames\n",
+           (double) statSensorAirtimeUs / 1e6, statSensorFrames, 100.0 * (double) statSensorAirtimeUs / (seconds * 1e6),
+           (double) statGatewayAirtimeUs / 1e6, statGatewayFrames);
+    printf("at gateway:    %u frames received, %u lost to collisions, %u too weak, %u garbled\n",
+           statGatewayReceived, statGatewayCollided, statGatewayWeak, statGatewayErrors);
+    printf("at sensors:    %u frames received\n", statSensorReceived);
+    printf("collisions:    %u frames lost at any receiver\n", statCollided);
+    printf("cad:           %u detected, %u clear\n", statCadDetected, statCadClear);
+}
@@ -0,0 +1,207 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// The benchmark's statistics.  Each sensor's bench app reports the notes that it queues,
+// and the gateway's Notecard reports the notes that are added to it, by the sensor's
+// address in the notefile's name and the note's sequence number, so the latency of each
+// note is the time between the two.  Notes queued before pairing is over aren't measured.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "simdriver.h"
+
+// Latency histogram buckets, in seconds, the last of which is unbounded
+#define SIM_BUCKETS             14
+#define SIM_BUCKET_FIRST_SECS   0.25
+
+// Width of the histogram's largest bar
+#define SIM_BAR_WIDTH           50
+
+// A note that hasn't been delivered this long after being queued is taken to be lost
+#define SIM_LOST_PERIODS        3
+
+// Latencies of the notes that were measured, in microseconds
+static uint64_t *latencies = NULL;
+static size_t latencyCount = 0;
+static size_t latencyMax = 0;
+
+// Notes reported delivered that weren't awaited
+static uint32_t duplicates = 0;
+static uint32_t unknown = 0;
+
+// Forwards
+static int compareLatency(const void *a, const void *b);
+static double percentile(double p);
+
+// Note a sensor's address, as the gateway will name its notefile
+void simBenchAddress(const char *addressText)
+{
+    snprintf(simCurrent->bench.address, sizeof(simCurrent->bench.address), "%s", addressText);
+}
+
+// Note the queueing of a sensor's note
+void simBenchQueued(uint32_t sequence)
+{
+    simBench *bench = &simCurrent->bench;
+    uint32_t index = bench->base + sequence;
+    if (index >= bench->queuedMax) {
+        uint32_t max = (index + 1 > bench->queuedMax * 2) ? index + 1 : bench->queuedMax * 2;
+        uint64_t *queuedUs = realloc(bench->queuedUs, sizeof(uint64_t) * max);
+        if (queuedUs == NULL) {
+            simFatal("out of memory recording notes");
+        }
+        memset(&queuedUs[bench->queuedMax], 0, sizeof(uint64_t) * (max - bench->queuedMax));
+        bench->queuedUs = queuedUs;
+        bench->queuedMax = max;
+    }
+    bench->queuedUs[index] = simNow;
+    if (simMeasureFromUs != 0 && simNow >= simMeasureFromUs) {
+        bench->queued++;
+    }
+}
+
+// Note that a sensor's note has been added to the gateway's Notecard
+void simBenchDelivered(const char *file, uint32_t sequence)
+{
+
+    // Find the sensor from its address, which begins the name of the notefile
+    const char *hash = strchr(file, '#');
+    size_t len = (hash == NULL) ? strlen(file) : (size_t) (hash - file);
+    simBench *bench = NULL;
+    for (int i=1; i<simNodeCount; i++) {
+        simBench *b = &simNodes[i].bench;
+        if (strlen(b->address) == len && strncasecmp(b->address, file, len) == 0) {
+            bench = b;
+            break;
+        }
+    }
+    if (bench == NULL) {
+        unknown++;
+        return;
+    }
+
+    // Measure its latency
+    uint32_t index = bench->base + sequence;
+    if (index >= bench->queuedMax || bench->queuedUs[index] == 0) {
+        duplicates++;
+        return;
+    }
+    uint64_t queuedUs = bench->queuedUs[index];
+    bench->queuedUs[index] = 0;
+    if (simMeasureFromUs == 0 || queuedUs < simMeasureFromUs) {
+        return;
+    }
+    bench->delivered++;
+    if (latencyCount == latencyMax) {
+        latencyMax = (latencyMax == 0) ? 1024 : latencyMax * 2;
+        latencies = realloc(latencies, sizeof(uint64_t) * latencyMax);
+        if (latencies == NULL) {
+            simFatal("out of memory recording latencies");
+        }
+    }
+    latencies[latencyCount++] = simNow - queuedUs;
+
+}
+
+// Note a Notecard transaction
+void simBenchNotecard(const char *req, uint32_t ms)
+{
+    (void) req;
+    if (simMeasureFromUs != 0 && simNow >= simMeasureFromUs) {
+        simCurrent->bench.notecardTransactions++;
+        simCurrent->bench.notecardMs += ms;
+    }
+}
+
+// Order latencies
+static int compareLatency(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// A percentile of the sorted latencies, in seconds
+static double percentile(double p)
+{
+    size_t i = (size_t) (p * (double) (latencyCount - 1) + 0.5);
+    return (double) latencies[i] / 1e6;
+}
+
+// Report the delivery and latency of the notes
+void simBenchReport(double seconds)
+{
+
+    // Count the notes, those not yet delivered being in flight if they were queued recently
+    uint64_t lostUs = (uint64_t) simOpt.benchPeriodSecs * SIM_LOST_PERIODS * 1000000;
+    uint32_t queued = 0, delivered = 0, inFlight = 0, lost = 0;
+    int sending = 0;
+    for (int i=1; i<simNodeCount; i++) {
+        simBench *bench = &simNodes[i].bench;
+        queued += bench->queued;
+        delivered += bench->delivered;
+        if (bench->queued > 0) {
+            sending++;
+        }
+        for (uint32_t j=0; j<bench->queuedMax; j++) {
+            uint64_t queuedUs = bench->queuedUs[j];
+            if (queuedUs == 0 || queuedUs < simMeasureFromUs) {
+                continue;
+            }
+            if (queuedUs + lostUs > simNow) {
+                inFlight++;
+            } else {
+                lost++;
+            }
+        }
+    }
+    printf("sensors:       %d of %d sent notes\n", sending, simNodeCount - 1);
+    printf("notes:         %u queued, %u delivered, %u in flight, %u lost, %u duplicates, %u unknown\n",
+           queued, delivered, inFlight, lost, duplicates, unknown);
+    printf("throughput:    %.2f notes/min\n", (double) delivered * 60 / seconds);
+    printf("notecard:      %u transactions taking %.1fs\n",
+           simNodes[0].bench.notecardTransactions, (double) simNodes[0].bench.notecardMs / 1000);
+    if (latencyCount == 0) {
+        return;
+    }
+
+    // Report the percentiles
+    qsort(latencies, latencyCount, sizeof(uint64_t), compareLatency);
+    printf("latency:       p50 %.2fs, p90 %.2fs, p99 %.2fs, max %.2fs\n",
+           percentile(0.50), percentile(0.90), percentile(0.99), (double) latencies[latencyCount-1] / 1e6);
+
+    // And the histogram, whose buckets double in width
+    uint32_t buckets[SIM_BUCKETS] = {0};
+    uint32_t largest = 0;
+    for (size_t i=0; i<latencyCount; i++) {
+        double secs = (double) latencies[i] / 1e6;
+        double bound = SIM_BUCKET_FIRST_SECS;
+        int b = 0;
+        while (b < SIM_BUCKETS-1 && secs > bound) {
+            bound *= 2;
+            b++;
+        }
+        if (++buckets[b] > largest) {
+            largest = buckets[b];
+        }
+    }
+    double bound = SIM_BUCKET_FIRST_SECS;
+    for (int b=0; b<SIM_BUCKETS; b++, bound *= 2) {
+        if (buckets[b] == 0) {
+            continue;
+        }
+        char bar[SIM_BAR_WIDTH+1];
+        int width = (int) (((uint64_t) buckets[b] * SIM_BAR_WIDTH + largest - 1) / largest);
+        memset(bar, '#', (size_t) width);
+        bar[width] = '\0';
+        if (b < SIM_BUCKETS-1) {
+            printf("  <= %7.2fs %6u %s\n", bound, buckets[b], bar);
+        } else {
+            printf("   > %7.2fs %6u %s\n", bound / 2, buckets[b], bar);
+        }
+    }
+
+}
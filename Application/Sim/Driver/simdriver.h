@@ -0,0 +1,166 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// State shared by the parts of the simulation driver: the nodes, the virtual clock and its
+// event queue, the airwaves and the benchmark's statistics.  None of this is visible to the
+// firmware, which reaches the driver only through sim.h.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <ucontext.h>
+#include <setjmp.h>
+#include "../Inc/sim.h"
+
+// The node's flash, which is mapped at the device's address for whichever node is running
+#define SIM_FLASH_BASE          0x08000000UL
+#define SIM_FLASH_SIZE          0x00040000UL
+
+// Size of each node's stack
+#define SIM_STACK_SIZE          (256*1024)
+
+// Reads of the clock in one activation beyond which the node is taken to be polling it
+#define SIM_POLL_LIMIT          1000
+#define SIM_POLL_DELAY_US       1000
+
+// Interrupts that may wait for a node to unmask them
+#define SIM_PENDING_MAX         16
+
+// Kinds of event
+#define SIM_EVENT_WAKE          1           // Node's delay has ended, or an interrupt woke it
+#define SIM_EVENT_ALARM         2           // Node's RTC alarm
+#define SIM_EVENT_BUTTON        3           // Node's button is pressed (arg 1) or released
+#define SIM_EVENT_LOCK          4           // Receivers may lock onto frame arg
+#define SIM_EVENT_TX_END        5           // Frame arg has been sent
+#define SIM_EVENT_CAD_END       6           // Node's CAD has completed
+#define SIM_EVENT_PAIR_END      7           // Measurement begins once pairing is over
+
+// Execution states of a node
+#define SIM_NODE_RUNNABLE       0
+#define SIM_NODE_IDLE           1
+#define SIM_NODE_DELAY          2
+#define SIM_NODE_DEAD           3
+
+// Radio modes
+#define SIM_RADIO_SLEEP         0
+#define SIM_RADIO_STANDBY       1
+#define SIM_RADIO_TX            2
+#define SIM_RADIO_RX            3
+#define SIM_RADIO_CAD           4
+
+// An interrupt awaiting delivery
+typedef struct {
+    int kind;                       // SIM_EVENT_ALARM, SIM_EVENT_BUTTON, or 0 for the radio
+    int irq;                        // Radio interrupt, or the button's state
+    uint8_t payload[256];
+    uint16_t size;
+    int16_t rssi;
+    int8_t snr;
+} simInterrupt;
+
+// A node's radio, as the airwaves see it
+typedef struct {
+    int mode;
+    bool continuous;
+    uint32_t frequency;
+    uint16_t syncWord;
+    simModemConfig tx;
+    simModemConfig rx;
+    uint64_t rxSinceUs;             // When the receiver began listening
+    int64_t frame;                  // Frame being sent or received, or -1
+    uint32_t gen;                   // Invalidates the radio's outstanding events
+    uint64_t airtimeUs;             // Statistics
+    uint32_t framesSent;
+} simRadio;
+
+// A node's benchmark statistics
+typedef struct {
+    char address[40];               // Its address, as it appears in its notefile's name
+    uint64_t *queuedUs;             // When each note was queued, by sequence number
+    uint32_t queuedMax;
+    uint32_t base;                  // Added to its sequence numbers, which restart with it
+    uint32_t queued;
+    uint32_t delivered;
+    uint32_t duplicates;
+    uint32_t notecardTransactions;
+    uint64_t notecardMs;
+} simBench;
+
+// A node
+typedef struct {
+    int index;
+    simParams params;
+    double x, y;                    // Position in metres
+
+    // Execution
+    uint8_t *ram;                   // Its copy of the firmware's RAM while another node runs
+    ucontext_t context;
+    uint8_t *stack;
+    int state;
+    uint64_t bootUs;                // When it last started
+    uint32_t wakeGen;
+    uint32_t primask;               // As it was when the node last yielded
+    bool resetting;
+    uint32_t resets;
+    uint32_t polls;
+
+    // Its RTC alarm
+    bool alarmArmed;
+    uint32_t alarmGen;
+
+    // Interrupts held while masked
+    simInterrupt pending[SIM_PENDING_MAX];
+    int pendingCount;
+    uint32_t pendingDropped;
+
+    // Peripherals and statistics
+    simRadio radio;
+    simBench bench;
+    uint64_t cpuNs;
+} simNode;
+
+// Parameters of the run
+typedef struct {
+    int sensors;
+    uint64_t durationUs;
+    uint32_t benchPeriodSecs;
+    uint32_t notecardLatencyMs;
+    uint32_t radiusMetres;
+    uint32_t pairSpacingMs;
+    uint64_t seed;
+    int trace;                      // Node to trace, -1 for none, or -2 for all
+} simOptions;
+
+// Driver state
+extern simOptions simOpt;
+extern simNode *simNodes;
+extern int simNodeCount;
+extern simNode *simCurrent;
+extern uint64_t simNow;
+extern uint64_t simMeasureFromUs;
+
+// Firmware entry points
+typedef struct {
+    void (*main)(void);
+    void (*alarm)(void);
+    void (*radio)(int irq, const uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr);
+    bool (*button)(bool pressed);
+    uint32_t (*primask)(void);
+    void (*setIRQ)(bool inHandler);
+} simFirmware;
+extern simFirmware simFw;
+
+// sim.c
+void simSchedule(uint64_t us, int node, int kind, uint32_t gen, int64_t arg);
+void simInterruptNode(simNode *node, const simInterrupt *interrupt);
+double simRandom(void);
+
+// simair.c
+void simAirInit(simNode *node);
+void simAirEvent(int kind, simNode *node, uint32_t gen, int64_t frame);
+void simAirReport(double seconds);
+
+// simbench.c
+void simBenchReport(double seconds);
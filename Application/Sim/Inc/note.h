@@ -0,0 +1,175 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// The subset of note-c's API that the firmware uses, with note-c's names, types and
+// constants, implemented for the simulation by simnote.c against a simulated Notecard.
+// The J tree is cJSON's, as it is in note-c, and it is allocated through the hooks that
+// the firmware registers with NoteSetFn().
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Types
+#define JNUMBER                     double
+#define JINTEGER                    int64_t
+#define JTIME                       long
+typedef struct J {
+    struct J *next;
+    struct J *prev;
+    struct J *child;
+    int type;
+    char *valuestring;
+    JINTEGER valueint;
+    JNUMBER valuenumber;
+    char *string;
+} J;
+
+// cJSON item types
+#define JInvalid                    (0)
+#define JFalse                      (1 << 0)
+#define JTrue                       (1 << 1)
+#define JNULL                       (1 << 2)
+#define JNumber                     (1 << 3)
+#define JString                     (1 << 4)
+#define JArray                      (1 << 5)
+#define JObject                     (1 << 6)
+#define JRaw                        (1 << 7)
+#define JIsReference                256
+#define JStringIsConst              512
+
+// Types of items as classified by JGetItemType()
+#define JTYPE_NOT_PRESENT           0
+#define JTYPE_BOOL_TRUE             1
+#define JTYPE_BOOL_FALSE            2
+#define JTYPE_NULL                  3
+#define JTYPE_NUMBER_ZERO           4
+#define JTYPE_NUMBER                5
+#define JTYPE_STRING_BLANK          6
+#define JTYPE_STRING_ZERO           7
+#define JTYPE_STRING_NUMBER         8
+#define JTYPE_STRING_BOOL_TRUE      9
+#define JTYPE_STRING_BOOL_FALSE     10
+#define JTYPE_STRING                11
+#define JTYPE_OBJECT                12
+#define JTYPE_ARRAY                 13
+
+// Template field types
+#define TBOOL                       true
+#define TINT8                       11
+#define TINT16                      12
+#define TINT24                      13
+#define TINT32                      14
+#define TINT64                      18
+#define TUINT8                      21
+#define TUINT16                     22
+#define TUINT24                     23
+#define TUINT32                     24
+#define TFLOAT16                    12.1
+#define TFLOAT32                    14.1
+#define TFLOAT64                    18.1
+#define _TSTRING(N)                 #N
+#define TSTRING(N)                  _TSTRING(N)
+
+// Constants
+#define NOTE_I2C_ADDR_DEFAULT       0x17
+#define NOTE_I2C_MAX_DEFAULT        30
+#define NOTE_MD5_HASH_SIZE          16
+#define NOTE_MD5_HASH_STRING_SIZE   (((NOTE_MD5_HASH_SIZE)*2)+1)
+#define JNTOA_PRECISION             (16)
+#define JNTOA_MAX                   (44)
+
+// Iterate over the fields of an object or the items of an array
+#define JObjectForEach(element, array) for (element = ((array) != NULL) ? (array)->child : NULL; element != NULL; element = element->next)
+
+// Hooks
+typedef void * (*mallocFn) (size_t size);
+typedef void (*freeFn) (void *);
+typedef void (*delayMsFn) (uint32_t ms);
+typedef uint32_t (*getMsFn) (void);
+typedef size_t (*debugOutputFn) (const char *text);
+typedef void (*mutexFn) (void);
+typedef bool (*i2cResetFn) (uint16_t DevAddress);
+typedef const char * (*i2cTransmitFn) (uint16_t DevAddress, uint8_t* pBuffer, uint16_t Size);
+typedef const char * (*i2cReceiveFn) (uint16_t DevAddress, uint8_t* pBuffer, uint16_t Size, uint32_t *available);
+void NoteSetFn(mallocFn mallocHook, freeFn freeHook, delayMsFn delayMsHook, getMsFn getMsHook);
+void NoteSetFnDebugOutput(debugOutputFn fn);
+void NoteSetFnMutex(mutexFn lockI2Cfn, mutexFn unlockI2Cfn, mutexFn lockNotefn, mutexFn unlockNotefn);
+void NoteSetFnI2C(uint32_t i2caddr, uint32_t i2cmax, i2cResetFn resetfn, i2cTransmitFn transmitfn, i2cReceiveFn receivefn);
+void NoteSetFnDisabled(void);
+
+// Requests
+J *NoteNewRequest(const char *request);
+J *NoteNewCommand(const char *request);
+bool NoteRequest(J *req);
+J *NoteRequestResponse(J *req);
+char *NoteRequestResponseJSON(const char *reqJSON);
+void NoteDeleteResponse(J *response);
+bool NoteResponseError(J *rsp);
+bool NoteResponseErrorContains(J *rsp, const char *errstr);
+bool NoteReset(void);
+void NoteSuspendTransactionDebug(void);
+void NoteResumeTransactionDebug(void);
+uint32_t NoteMemAvailable(void);
+bool NoteSetEnvDefault(const char *variable, char *buf);
+bool NoteSetEnvDefaultInt(const char *variable, JINTEGER defaultVal);
+
+// Time and region
+JTIME NoteTimeST(void);
+bool NoteTimeValidST(void);
+void NoteTimeSet(JTIME secondsUTC, int offset, char *zone, char *country, char *area);
+bool NoteRegion(char **retCountry, char **retArea, char **retZone, int *retZoneOffset);
+
+// MD5
+typedef struct {
+    unsigned long buf[4];
+    unsigned long bits[2];
+    unsigned char in[64];
+} NoteMD5Context;
+void NoteMD5Init(NoteMD5Context *ctx);
+void NoteMD5Update(NoteMD5Context *ctx, unsigned char const *buf, unsigned long len);
+void NoteMD5Final(unsigned char *digest, NoteMD5Context *ctx);
+void NoteMD5HashString(unsigned char *data, unsigned long len, char *strbuf, unsigned long buflen);
+void NoteMD5HashToString(unsigned char *hash, char *strbuf, unsigned long buflen);
+
+// J trees
+void *JMalloc(size_t size);
+void JFree(void *p);
+void JDelete(J *item);
+J *JCreateObject(void);
+J *JCreateString(const char *string);
+J *JCreateNumber(JNUMBER num);
+J *JAddBoolToObject(J * const object, const char * const name, const bool boolean);
+J *JAddNumberToObject(J * const object, const char * const name, const JNUMBER number);
+J *JAddStringToObject(J * const object, const char * const name, const char * const string);
+J *JAddArrayToObject(J * const object, const char * const name);
+void JAddItemToObject(J *object, const char *name, J *item);
+void JAddItemToArray(J *array, J *item);
+J *JDetachItemFromObject(J *object, const char *name);
+void JDeleteItemFromObject(J *object, const char *name);
+J *JGetObjectItem(const J * const object, const char * const name);
+char *JConvertToJSONString(const J *item);
+J *JConvertFromJSONString(const char *json);
+bool JIsPresent(J *rsp, const char *field);
+char *JGetString(J *rsp, const char *field);
+JNUMBER JGetNumber(J *rsp, const char *field);
+JINTEGER JGetInt(J *rsp, const char *field);
+bool JGetBool(J *rsp, const char *field);
+J *JGetObject(J *rsp, const char *field);
+int JGetArraySize(const J *array);
+J *JGetArrayItem(const J *array, int item);
+int JGetItemType(J *item);
+char *JGetItemName(const J * item);
+char *JStringValue(J *item);
+JNUMBER JNumberValue(J *item);
+bool JBoolValue(J *item);
+char *JNtoA(JNUMBER f, char *buf, int precision);
+void JItoA(JINTEGER n, char *s);
+JINTEGER JAtoI(const char *s);
+int JB64EncodeLen(int len);
+int JB64Encode(char *coded_dst, const char *plain_src, int len_plain_src);
+int JB64DecodeLen(const char *coded_src);
+int JB64Decode(char *plain_dst, const char *coded_src);
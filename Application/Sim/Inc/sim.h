@@ -0,0 +1,89 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Interface between the simulation driver and the firmware of the nodes that it runs.  The
+// firmware, together with the stubs that stand in for the hardware, is built once as a
+// shared object whose RAM is swapped for that of whichever node is running, so each node
+// has its own copy of every global.  The driver owns the virtual clock, the airwaves and
+// the statistics, and the nodes reach them only through the functions declared here.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Radio interrupts delivered to a node
+#define SIM_IRQ_TX_DONE         1
+#define SIM_IRQ_TX_TIMEOUT      2
+#define SIM_IRQ_RX_DONE         3
+#define SIM_IRQ_RX_TIMEOUT      4
+#define SIM_IRQ_RX_ERROR        5
+#define SIM_IRQ_CAD_CLEAR       6
+#define SIM_IRQ_CAD_DETECTED    7
+
+// The modem configuration that a node has given its radio, in the radio driver's terms
+typedef struct {
+    uint8_t modem;                  // MODEM_FSK or MODEM_LORA
+    uint8_t bandwidth;              // LoRa: 0=125kHz, 1=250kHz, 2=500kHz; FSK: Hz in datarate
+    uint32_t datarate;              // LoRa: spreading factor; FSK: bits per second
+    uint8_t coderate;               // LoRa: 1..4 for 4/5..4/8
+    uint16_t preambleLen;           // LoRa: symbols; FSK: bytes
+    bool fixLen;                    // Implicit header
+    uint8_t payloadLen;             // Receive only: length expected with an implicit header
+    bool crcOn;
+    bool iqInverted;
+    int8_t power;                   // Transmit only: dBm
+} simModemConfig;
+
+// Parameters of the run that the nodes need
+typedef struct {
+    bool gateway;                   // This node has a Notecard
+    uint32_t uid[3];                // Its unique device ID
+    uint32_t benchPeriodSecs;       // How often each sensor's bench app sends a note
+    uint32_t notecardLatencyMs;     // Time that each Notecard transaction takes
+    uint32_t epochSecs;             // Wall-clock time at which the simulation began
+    bool trace;                     // Format and keep the node's trace output
+} simParams;
+
+// Services of the driver, which operate on the node that is running
+const simParams *simNodeParams(void);
+uint64_t simNowUs(void);
+uint64_t simTicks(void);
+uint64_t simUptimeUs(void);
+void simAlarmSet(uint64_t ticks);
+void simAlarmCancel(void);
+void simIdle(void);
+void simDelayUs(uint64_t us);
+void simTrace(const char *text, size_t len);
+void simReset(void) __attribute__((noreturn));
+void simFatal(const char *format, ...);
+
+// Services of the driver's model of the airwaves
+void simAirSetChannel(uint32_t frequency);
+void simAirSetSyncWord(uint16_t syncWord);
+void simAirSetTxConfig(const simModemConfig *config);
+void simAirSetRxConfig(const simModemConfig *config);
+uint32_t simAirTimeOnAirUs(const simModemConfig *config, uint8_t payloadLen);
+void simAirSend(const uint8_t *buffer, uint8_t size);
+void simAirRx(bool continuous);
+void simAirRxDutyCycle(uint32_t rxUs, uint32_t sleepUs);
+void simAirCad(uint8_t symbols);
+void simAirStandby(void);
+void simAirSleep(void);
+int16_t simAirRssi(void);
+
+// Reports to the driver's benchmark statistics
+void simBenchAddress(const char *addressText);
+void simBenchQueued(uint32_t sequence);
+void simBenchDelivered(const char *file, uint32_t sequence);
+void simBenchNotecard(const char *req, uint32_t ms);
+
+// Entry points of the node firmware, called by the driver with the node's RAM in place
+void simNodeMain(void);
+void simNodeAlarm(void);
+void simNodeRadio(int irq, const uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr);
+bool simNodeButton(bool pressed);
+uint32_t simNodePrimask(void);
+void simNodeSetIRQ(bool inHandler);
@@ -0,0 +1,110 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Host replacement for the CMSIS compiler header, included ahead of every source so that
+// the real one is skipped and the HAL and CMSIS headers build natively.  The core intrinsics
+// that touch Cortex-M registers become operations on the simulated node's interrupt mask,
+// and the rest compile to nothing.
+#ifndef __CMSIS_COMPILER_H
+#define __CMSIS_COMPILER_H
+
+#include <stdint.h>
+
+#define __ASM                                  __asm
+#define __INLINE                               inline
+#define __STATIC_INLINE                        static inline
+#define __STATIC_FORCEINLINE                   __attribute__((always_inline)) static inline
+#define __NO_RETURN                            __attribute__((__noreturn__))
+#define __USED                                 __attribute__((used))
+#define __WEAK                                 __attribute__((weak))
+#define __PACKED                               __attribute__((packed, aligned(1)))
+#define __PACKED_STRUCT                        struct __attribute__((packed, aligned(1)))
+#define __PACKED_UNION                         union __attribute__((packed, aligned(1)))
+#define __ALIGNED(x)                           __attribute__((aligned(x)))
+#define __RESTRICT                             __restrict
+#define __COMPILER_BARRIER()                   __ASM volatile("":::"memory")
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpacked"
+#pragma GCC diagnostic ignored "-Wattributes"
+struct __attribute__((packed)) T_UINT16_WRITE { uint16_t v; };
+struct __attribute__((packed)) T_UINT16_READ { uint16_t v; };
+struct __attribute__((packed)) T_UINT32_WRITE { uint32_t v; };
+struct __attribute__((packed)) T_UINT32_READ { uint32_t v; };
+struct __attribute__((packed)) T_UINT32 { uint32_t v; };
+#pragma GCC diagnostic pop
+#define __UNALIGNED_UINT32(x)                  (((struct T_UINT32 *)(x))->v)
+#define __UNALIGNED_UINT16_WRITE(addr, val)    (void)((((struct T_UINT16_WRITE *)(void *)(addr))->v) = (val))
+#define __UNALIGNED_UINT16_READ(addr)          (((const struct T_UINT16_READ *)(const void *)(addr))->v)
+#define __UNALIGNED_UINT32_WRITE(addr, val)    (void)((((struct T_UINT32_WRITE *)(void *)(addr))->v) = (val))
+#define __UNALIGNED_UINT32_READ(addr)          (((const struct T_UINT32_READ *)(const void *)(addr))->v)
+
+// The simulated PRIMASK, owned by each node, and the exception number that is nonzero while
+// the driver is running one of the node's interrupt handlers
+extern uint32_t simPrimask;
+extern uint32_t simIpsr;
+
+__STATIC_FORCEINLINE uint32_t __get_PRIMASK(void)
+{
+    return simPrimask;
+}
+
+__STATIC_FORCEINLINE void __set_PRIMASK(uint32_t priMask)
+{
+    simPrimask = priMask;
+}
+
+__STATIC_FORCEINLINE void __disable_irq(void)
+{
+    simPrimask = 1;
+}
+
+__STATIC_FORCEINLINE void __enable_irq(void)
+{
+    simPrimask = 0;
+}
+
+#define __NOP()                                __COMPILER_BARRIER()
+#define __WFI()                                __COMPILER_BARRIER()
+#define __WFE()                                __COMPILER_BARRIER()
+#define __SEV()                                __COMPILER_BARRIER()
+#define __ISB()                                __COMPILER_BARRIER()
+#define __DSB()                                __COMPILER_BARRIER()
+#define __DMB()                                __COMPILER_BARRIER()
+#define __BKPT(value)                          __builtin_trap()
+#define __REV(value)                           __builtin_bswap32(value)
+#define __REV16(value)                         ((uint32_t) (((value) & 0xff00ff00U) >> 8) | (((value) & 0x00ff00ffU) << 8))
+#define __CLZ(value)                           ((uint8_t) ((value) == 0 ? 32 : __builtin_clz(value)))
+
+__STATIC_FORCEINLINE uint32_t __RBIT(uint32_t value)
+{
+    uint32_t result = 0;
+    for (int i=0; i<32; i++) {
+        result = (result << 1) | (value & 1);
+        value >>= 1;
+    }
+    return result;
+}
+
+__STATIC_FORCEINLINE uint32_t __get_IPSR(void)
+{
+    return simIpsr;
+}
+
+__STATIC_FORCEINLINE uint32_t __get_CONTROL(void)
+{
+    return 0;
+}
+
+__STATIC_FORCEINLINE uint32_t __get_MSP(void)
+{
+    return 0;
+}
+
+__STATIC_FORCEINLINE void __set_MSP(uint32_t topOfMainStack)
+{
+    (void) topOfMainStack;
+}
+
+#endif
@@ -0,0 +1,73 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Host wrapper for the device header, found ahead of the real one so that every HAL, LL and
+// CMSIS header sees it first.  The peripherals that the firmware touches directly become
+// ordinary structures in the node's RAM, and the flash size is fixed at that of the
+// STM32WLE5JC rather than being read from its engineering bytes.
+
+#pragma once
+
+#include_next "stm32wlxx.h"
+
+extern FLASH_TypeDef simFLASH;
+extern RCC_TypeDef simRCC;
+extern PWR_TypeDef simPWR;
+extern EXTI_TypeDef simEXTI;
+extern RTC_TypeDef simRTC;
+extern TAMP_TypeDef simTAMP;
+extern SYSCFG_TypeDef simSYSCFG;
+extern DBGMCU_TypeDef simDBGMCU;
+extern GPIO_TypeDef simGPIOA;
+extern GPIO_TypeDef simGPIOB;
+extern GPIO_TypeDef simGPIOC;
+extern GPIO_TypeDef simGPIOH;
+extern SCB_Type simSCB;
+extern DWT_Type simDWT;
+extern CoreDebug_Type simCoreDebug;
+extern NVIC_Type simNVIC;
+extern SysTick_Type simSysTick;
+
+#undef FLASH
+#define FLASH                   (&simFLASH)
+#undef RCC
+#define RCC                     (&simRCC)
+#undef PWR
+#define PWR                     (&simPWR)
+#undef EXTI
+#define EXTI                    (&simEXTI)
+#undef RTC
+#define RTC                     (&simRTC)
+#undef TAMP
+#define TAMP                    (&simTAMP)
+#undef SYSCFG
+#define SYSCFG                  (&simSYSCFG)
+#undef DBGMCU
+#define DBGMCU                  (&simDBGMCU)
+#undef GPIOA
+#define GPIOA                   (&simGPIOA)
+#undef GPIOB
+#define GPIOB                   (&simGPIOB)
+#undef GPIOC
+#define GPIOC                   (&simGPIOC)
+#undef GPIOH
+#define GPIOH                   (&simGPIOH)
+#undef SCB
+#define SCB                     (&simSCB)
+#undef DWT
+#define DWT                     (&simDWT)
+#undef CoreDebug
+#define CoreDebug               (&simCoreDebug)
+#undef NVIC
+#define NVIC                    (&simNVIC)
+#undef SysTick
+#define SysTick                 (&simSysTick)
+
+#undef FLASH_SIZE
+#define FLASH_SIZE              0x00040000UL
+
+// A reset restarts the node's firmware with its flash intact
+void simReset(void) __attribute__((noreturn));
+#undef NVIC_SystemReset
+#define NVIC_SystemReset        simReset
@@ -0,0 +1,14 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Host wrapper for the C library's string header, adding the BSD functions that newlib has
+// and that older versions of glibc lack.  They are implemented in simhal.c.
+
+#pragma once
+
+#include_next <string.h>
+#include <stddef.h>
+
+size_t strlcpy(char *dst, const char *src, size_t siz);
+size_t strlcat(char *dst, const char *src, size_t siz);
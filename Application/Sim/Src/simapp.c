@@ -0,0 +1,194 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// The node's startup, as main() and MX_UTIL_Init() perform it on the device, and the
+// benchmark app that takes the place of the sensor's configured apps.  Each sensor sends a
+// numbered note once per benchmark period, aligned to its transmit window as the reference
+// apps are, and the driver measures the latency of each from being queued on the sensor to
+// being added to the gateway's Notecard.
+
+#include "appdefs.h"
+#include "stm32_seq.h"
+#include "sim.h"
+
+// The dynamic filename of the benchmark's queue.
+// NOTE: The Gateway will replace `*` with the originating node's ID.
+#define BENCH_NOTEFILE              "*#bench.qo"
+
+// Special request IDs
+#define REQUESTID_TEMPLATE          1
+
+// TRUE if we've successfully registered the template
+static bool templateRegistered = false;
+
+// The number of the last note queued
+static uint32_t benchSequence = 0;
+
+// Our scheduled app's ID
+static int appID = -1;
+
+// The fields of the gateway's responses that we use, which are extracted without a J tree
+typedef struct {
+    char err[80];
+    int32_t id;
+} benchRsp;
+static benchRsp rspFields;
+static const schedField rspFieldsDeclared[] = {
+    SCHED_FIELD("err", SCHED_FIELD_STRING, benchRsp, err),
+    SCHED_FIELD("id", SCHED_FIELD_INT, benchRsp, id),
+    SCHED_FIELDS_END
+};
+
+// Forwards
+void radioReceivedTask(void);
+static void benchPoll(int appID, int state, void *appContext);
+static void benchResponse(int appID, void *rsp, void *appContext);
+static bool registerNotefileTemplate(void);
+static void addNote(uint32_t sequence);
+
+// Start the node, as main() does once the clocks and peripherals are up
+void simNodeMain()
+{
+
+    // Initialize ST utilities, as MX_UTIL_Init() does for the tasks that can be signalled here
+    UTIL_TIMER_Init();
+    UTIL_SEQ_RegTask((1 << CFG_SEQ_Task_Radio_Received), UTIL_SEQ_RFU, radioReceivedTask);
+#if DEBUGGER_ON
+    UTIL_SEQ_RegTask((1 << CFG_SEQ_Task_Console), UTIL_SEQ_RFU, traceInput);
+#endif
+
+    // Run the app, which will init its own peripherals
+    MX_AppMain();
+
+}
+
+// Get the interrupt mask, for the driver to decide whether interrupts may be delivered
+uint32_t simNodePrimask()
+{
+    return simPrimask;
+}
+
+// Note whether the node is running an interrupt handler, as the IPSR would show it
+void simNodeSetIRQ(bool inHandler)
+{
+    simIpsr = inHandler ? 1 : 0;
+}
+
+// Initialize the benchmark app in place of the configured ones
+void schedAppInit()
+{
+
+    // Register the app
+    schedAppConfig config = {
+        .name = "bench",
+        .activationPeriodSecs = simNodeParams()->benchPeriodSecs,
+        .activationPeriodMinSecs = 0,
+        .activationPeriodMaxSecs = 0,
+        .pollPeriodSecs = 15,
+        .alignToWindow = true,
+        .activateFn = NULL,
+        .interruptFn = NULL,
+        .interruptPins = 0,
+        .pollFn = benchPoll,
+        .responseFields = rspFieldsDeclared,
+        .responseStruct = &rspFields,
+        .responseFieldsFn = benchResponse,
+    };
+    appID = schedRegisterApp(&config);
+
+    // Tell the driver which notefile is ours once the gateway has substituted our address
+    simBenchAddress(ourAddressText);
+
+}
+
+// Poller
+static void benchPoll(int appID, int state, void *appContext)
+{
+
+    // Switch based upon state
+    switch (state) {
+
+    // App was just activated, so add the next note
+    case STATE_ACTIVATED:
+
+        // If the template isn't registered, do so
+        if (!templateRegistered && registerNotefileTemplate()) {
+            schedSetCompletionState(appID, STATE_ACTIVATED, STATE_DEACTIVATED);
+            APP_PRINTF("bench: template registration request\r\n");
+            break;
+        }
+
+        // Add a note to the file
+        addNote(++benchSequence);
+        schedSetCompletionState(appID, STATE_DEACTIVATED, STATE_DEACTIVATED);
+        APP_PRINTF("bench: note %d queued\r\n", benchSequence);
+        break;
+
+    }
+
+}
+
+// Register the notefile template for our data, returning true if the gateway's response is to
+// be awaited, which it isn't if the gateway already holds the template
+static bool registerNotefileTemplate()
+{
+
+    // Create the request
+    J *req = NoteNewRequest("note.template");
+    if (req == NULL) {
+        return false;
+    }
+
+    // Create the body
+    J *body = JCreateObject();
+    if (body == NULL) {
+        JDelete(req);
+        return false;
+    }
+
+    // Fill-in request parameters
+    JAddNumberToObject(req, "id", REQUESTID_TEMPLATE);
+    JAddStringToObject(req, "file", BENCH_NOTEFILE);
+    JAddNumberToObject(body, "seq", TUINT32);
+
+    // Attach the body to the request, and send it to the gateway unless it already holds it
+    JAddItemToObject(req, "body", body);
+    if (noteTemplateKnown(req)) {
+        templateRegistered = true;
+        return false;
+    }
+    noteSendToGatewayAsync(req, true);
+    return true;
+
+}
+
+// Queue the next note, and tell the driver when it was queued
+static void addNote(uint32_t sequence)
+{
+    compactNote note;
+    compactNoteBegin(&note, "note.add", BENCH_NOTEFILE);
+    compactNoteNumber(&note, true, "seq", sequence);
+    simBenchQueued(sequence);
+    noteSendNoteToGatewayAsync(&note, false);
+}
+
+// Gateway Response handler
+static void benchResponse(int appID, void *rsp, void *appContext)
+{
+    benchRsp *r = (benchRsp *) rsp;
+
+    // See if there's an error
+    if (r->err[0] != '\0') {
+        APP_PRINTF("bench: gateway returned error: %s\r\n", r->err);
+        return;
+    }
+
+    // Note the template's registration
+    if (r->id == REQUESTID_TEMPLATE) {
+        templateRegistered = true;
+        noteTemplateRegistered();
+        APP_PRINTF("bench: template registered\r\n");
+    }
+
+}
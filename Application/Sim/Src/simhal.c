@@ -0,0 +1,737 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// The node's hardware as the firmware sees it: the registers and HAL calls that it uses
+// directly, the MX_ and MY_ services of main.c, and the trace output.  Everything declared
+// here lives in the node's RAM, so each node has its own peripherals.  Peripherals that the
+// benchmark has no use for, such as the ADC, I2C and the UARTs, behave as if nothing were
+// connected to them.
+
+#include <stdio.h>
+#include <stdarg.h>
+#include "main.h"
+#include "stm32_seq.h"
+#include "stm32_adv_trace.h"
+#include "framework.h"
+#include "sim.h"
+
+// Registers of the peripherals that the firmware touches directly
+FLASH_TypeDef simFLASH;
+RCC_TypeDef simRCC;
+PWR_TypeDef simPWR;
+EXTI_TypeDef simEXTI;
+RTC_TypeDef simRTC;
+TAMP_TypeDef simTAMP;
+SYSCFG_TypeDef simSYSCFG;
+DBGMCU_TypeDef simDBGMCU;
+GPIO_TypeDef simGPIOA;
+GPIO_TypeDef simGPIOB;
+GPIO_TypeDef simGPIOC;
+GPIO_TypeDef simGPIOH;
+SCB_Type simSCB;
+DWT_Type simDWT;
+CoreDebug_Type simCoreDebug;
+NVIC_Type simNVIC;
+SysTick_Type simSysTick;
+
+// Interrupt state
+uint32_t simPrimask = 0;
+uint32_t simIpsr = 0;
+
+// HAL handles referenced by the framework
+RTC_HandleTypeDef hrtc;
+SUBGHZ_HandleTypeDef hsubghz;
+
+// Backup registers, which on the device survive a reset but here are lost with the RAM
+static uint32_t backupRegisters[32];
+
+// Pins driven from outside, as a button is, by port
+#define GPIO_PORTS 4
+static uint16_t gpioDriven[GPIO_PORTS];
+static uint16_t gpioDrivenHigh[GPIO_PORTS];
+
+// Console and random number state
+static bool dbgEnabled = true;
+static uint64_t randomState = 0;
+
+// Whether an AES operation awaits MX_AES_CTR_Wait()
+static bool aesPending = false;
+
+// Trace output staged by the zero-copy interface
+static uint8_t traceStaged[UTIL_ADV_TRACE_FIFO_SIZE];
+static uint16_t traceStagedLen = 0;
+
+// Size of the image, as it would be for a typical build
+#define SIM_IMAGE_SIZE      (96*1024)
+
+// Size of the heap and stack, as set by the linker script
+#define SIM_HEAP_SIZE       0x3000
+#define SIM_STACK_SIZE      0x1000
+
+// Length of the AES-256 keys that the firmware uses
+#define SIM_AES_KEY_BYTES   32
+
+// Battery voltage reported by the ADC
+#define SIM_BATTERY_MV      3600
+
+// Forwards
+static int gpioPort(GPIO_TypeDef *GPIOx);
+
+// Find the index of a port
+static int gpioPort(GPIO_TypeDef *GPIOx)
+{
+    if (GPIOx == GPIOA) {
+        return 0;
+    }
+    if (GPIOx == GPIOB) {
+        return 1;
+    }
+    if (GPIOx == GPIOC) {
+        return 2;
+    }
+    return 3;
+}
+
+// Configure pins, recording their mode and pull as the device's registers would
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init)
+{
+    for (uint32_t pin=0; pin<16; pin++) {
+        if ((GPIO_Init->Pin & (1U << pin)) == 0) {
+            continue;
+        }
+        GPIOx->MODER = (GPIOx->MODER & ~(3U << (pin*2))) | ((GPIO_Init->Mode & 3U) << (pin*2));
+        GPIOx->PUPDR = (GPIOx->PUPDR & ~(3U << (pin*2))) | ((GPIO_Init->Pull & 3U) << (pin*2));
+    }
+}
+
+// Deconfigure pins
+void HAL_GPIO_DeInit(GPIO_TypeDef *GPIOx, uint32_t GPIO_Pin)
+{
+    for (uint32_t pin=0; pin<16; pin++) {
+        if ((GPIO_Pin & (1U << pin)) != 0) {
+            GPIOx->MODER |= (3U << (pin*2));
+            GPIOx->PUPDR &= ~(3U << (pin*2));
+        }
+    }
+}
+
+// Read a pin, which reads what drives it from outside, else what we drive it with when it is
+// an output, else its pull, so that a pin with nothing connected reads as floating
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+    int port = gpioPort(GPIOx);
+    if ((gpioDriven[port] & GPIO_Pin) != 0) {
+        return ((gpioDrivenHigh[port] & GPIO_Pin) != 0) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+    }
+    uint32_t pin = (uint32_t) __builtin_ctz(GPIO_Pin);
+    uint32_t mode = (GPIOx->MODER >> (pin*2)) & 3U;
+    if (mode == 1U) {
+        return ((GPIOx->ODR & GPIO_Pin) != 0) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+    }
+    uint32_t pull = (GPIOx->PUPDR >> (pin*2)) & 3U;
+    return (pull == GPIO_PULLUP) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+// Write a pin
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+    if (PinState != GPIO_PIN_RESET) {
+        GPIOx->ODR |= GPIO_Pin;
+    } else {
+        GPIOx->ODR &= ~((uint32_t) GPIO_Pin);
+    }
+}
+
+// Toggle a pin
+void HAL_GPIO_TogglePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+    GPIOx->ODR ^= GPIO_Pin;
+}
+
+// Press or release the button, which drives its pin to its active level and interrupts just as
+// the EXTI line would.  Returns false if the node isn't yet listening to the button.
+bool simNodeButton(bool pressed)
+{
+    int port = gpioPort(BUTTON1_GPIO_Port);
+    bool high = (pressed == (BUTTON1_ACTIVE_HIGH != 0));
+    gpioDriven[port] |= BUTTON1_Pin;
+    if (high) {
+        gpioDrivenHigh[port] |= BUTTON1_Pin;
+    } else {
+        gpioDrivenHigh[port] &= ~BUTTON1_Pin;
+    }
+    if ((simNVIC.ISER[BUTTON1_EXTI_IRQn >> 5] & (1U << (BUTTON1_EXTI_IRQn & 31))) == 0) {
+        return false;
+    }
+    MX_AppISR(BUTTON1_Pin);
+    return true;
+}
+
+// Enable an interrupt, which only the button's is modelled
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+    if (IRQn >= 0) {
+        simNVIC.ISER[IRQn >> 5] |= (1U << (IRQn & 31));
+    }
+}
+
+// Disable an interrupt
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+    if (IRQn >= 0) {
+        simNVIC.ISER[IRQn >> 5] &= ~(1U << (IRQn & 31));
+    }
+}
+
+// Set an interrupt's priority, which the simulation doesn't use
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority)
+{
+    (void) IRQn;
+    (void) PreemptPriority;
+    (void) SubPriority;
+}
+
+// Unique device ID
+uint32_t HAL_GetUIDw0(void)
+{
+    return simNodeParams()->uid[0];
+}
+
+// Unique device ID
+uint32_t HAL_GetUIDw1(void)
+{
+    return simNodeParams()->uid[1];
+}
+
+// Unique device ID
+uint32_t HAL_GetUIDw2(void)
+{
+    return simNodeParams()->uid[2];
+}
+
+// Unlock the flash, which is always writable here
+HAL_StatusTypeDef HAL_FLASH_Unlock(void)
+{
+    return HAL_OK;
+}
+
+// Lock the flash
+HAL_StatusTypeDef HAL_FLASH_Lock(void)
+{
+    return HAL_OK;
+}
+
+// Program a double word of the node's flash, which like the device's can only clear bits
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data)
+{
+    if (TypeProgram != FLASH_TYPEPROGRAM_DOUBLEWORD || (Address & 7U) != 0
+            || Address < FLASH_BASE || Address + sizeof(uint64_t) > FLASH_BASE + FLASH_SIZE) {
+        return HAL_ERROR;
+    }
+    uint64_t *dest = (uint64_t *) (uintptr_t) Address;
+    if (*dest != UINT64_MAX && Data != 0) {
+        return HAL_ERROR;
+    }
+    *dest = Data;
+    return HAL_OK;
+}
+
+// Erase pages of the node's flash
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError)
+{
+    *PageError = UINT32_MAX;
+    if (pEraseInit->TypeErase == FLASH_TYPEERASE_MASSERASE) {
+        memset((void *) (uintptr_t) FLASH_BASE, 0xFF, FLASH_SIZE);
+        return HAL_OK;
+    }
+    if (pEraseInit->Page + pEraseInit->NbPages > FLASH_SIZE / FLASH_PAGE_SIZE) {
+        *PageError = pEraseInit->Page;
+        return HAL_ERROR;
+    }
+    memset((void *) (uintptr_t) (FLASH_BASE + (pEraseInit->Page * FLASH_PAGE_SIZE)), 0xFF, pEraseInit->NbPages * FLASH_PAGE_SIZE);
+    return HAL_OK;
+}
+
+// Write a backup register
+void HAL_RTCEx_BKUPWrite(RTC_HandleTypeDef *hrtc, uint32_t BackupRegister, uint32_t Data)
+{
+    (void) hrtc;
+    backupRegisters[BackupRegister % 32] = Data;
+}
+
+// Read a backup register
+uint32_t HAL_RTCEx_BKUPRead(RTC_HandleTypeDef *hrtc, uint32_t BackupRegister)
+{
+    (void) hrtc;
+    return backupRegisters[BackupRegister % 32];
+}
+
+// Radio commands sent other than through the radio driver, which only set the PA
+HAL_StatusTypeDef HAL_SUBGHZ_ExecSetCmd(SUBGHZ_HandleTypeDef *hsubghz, SUBGHZ_RadioSetCmd_t Command, uint8_t *pBuffer, uint16_t Size)
+{
+    (void) hsubghz;
+    (void) Command;
+    (void) pBuffer;
+    (void) Size;
+    return HAL_OK;
+}
+
+// Delay for microseconds
+void MX_TIM17_DelayUs(uint32_t us)
+{
+    simDelayUs(us);
+}
+
+// The clock speed has no effect on the simulation
+void MX_ClockBoost(void)
+{
+}
+
+// The clock speed has no effect on the simulation
+void MX_ClockRelax(void)
+{
+}
+
+// A pseudo-random number from a generator seeded by the node's unique ID
+uint32_t MY_Random(void)
+{
+    if (randomState == 0) {
+        const simParams *params = simNodeParams();
+        randomState = (((uint64_t) params->uid[0] << 32) | params->uid[1]) ^ ((uint64_t) params->uid[2] * 0x9E3779B97F4A7C15ULL);
+        randomState |= 1;
+    }
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return (uint32_t) ((randomState * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+// The entropy pool never needs refilling
+bool MY_RandomRefillDue(void)
+{
+    return false;
+}
+
+// The entropy pool never needs refilling
+void MY_RandomRefill(void)
+{
+}
+
+// Hash a key and nonce into the seed of a keystream, standing in for AES, which the benchmark
+// needs only to the extent that peers with the same key agree and peers without it don't
+static uint64_t aesSeed(const uint8_t *key, const uint8_t *nonce, uint16_t nonceLen)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (uint32_t i=0; i<SIM_AES_KEY_BYTES; i++) {
+        h = (h ^ key[i]) * 1099511628211ULL;
+    }
+    for (uint16_t i=0; i<nonceLen; i++) {
+        h = (h ^ nonce[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Mix a value, as the finalizer of splitmix64 does
+static uint64_t aesMix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Apply the keystream of a seed, where the output may be the input
+static void aesApply(uint64_t seed, const uint8_t *input, uint16_t len, uint8_t *output)
+{
+    uint64_t block = 0;
+    for (uint16_t i=0; i<len; i++) {
+        if ((i & 7) == 0) {
+            block = aesMix(seed + (0x9E3779B97F4A7C15ULL * ((i >> 3) + 1)));
+        }
+        output[i] = input[i] ^ (uint8_t) (block >> ((i & 7) * 8));
+    }
+}
+
+// Compute a tag over associated data and plaintext with the keystream's seed
+static void aesTag(uint64_t seed, const uint8_t *aad, uint16_t aadLen, const uint8_t *plaintext, uint16_t len, uint8_t *tag, uint16_t tagLen)
+{
+    uint64_t h = aesMix(seed ^ 0xA5A5A5A5A5A5A5A5ULL);
+    for (uint16_t i=0; i<aadLen; i++) {
+        h = aesMix(h ^ aad[i]);
+    }
+    h = aesMix(h ^ aadLen);
+    for (uint16_t i=0; i<len; i++) {
+        h = aesMix(h ^ plaintext[i]);
+    }
+    for (uint16_t i=0; i<tagLen; i++) {
+        if ((i & 7) == 0) {
+            h = aesMix(h + len);
+        }
+        tag[i] = (uint8_t) (h >> ((i & 7) * 8));
+    }
+}
+
+// Begin CTR encryption or decryption, which completes at once
+bool MX_AES_CTR_Start(uint8_t *key, uint8_t *input, uint16_t len, uint8_t *output)
+{
+    aesApply(aesSeed(key, NULL, 0), input, len, output);
+    aesPending = true;
+    return true;
+}
+
+// Begin CTR encryption or decryption in place, which completes at once
+bool MX_AES_CTR_StartInPlace(uint8_t *key, uint8_t *buf, uint16_t len, uint16_t bufSize)
+{
+    return MX_AES_CTR_Start(key, buf, len, buf);
+}
+
+// Wait for the operation begun by MX_AES_CTR_Start to complete
+bool MX_AES_CTR_Wait(void)
+{
+    bool pending = aesPending;
+    aesPending = false;
+    return pending;
+}
+
+// End the AES session
+void MX_AES_CTR_SessionEnd(void)
+{
+    aesPending = false;
+}
+
+// Encrypt in CTR mode
+bool MX_AES_CTR_Encrypt(uint8_t *key, uint8_t *plaintext, uint16_t len, uint8_t *ciphertext)
+{
+    return MX_AES_CTR_Start(key, plaintext, len, ciphertext) && MX_AES_CTR_Wait();
+}
+
+// Decrypt in CTR mode
+bool MX_AES_CTR_Decrypt(uint8_t *key, uint8_t *ciphertext, uint16_t len, uint8_t *plaintext)
+{
+    return MX_AES_CTR_Start(key, ciphertext, len, plaintext) && MX_AES_CTR_Wait();
+}
+
+// Encrypt and authenticate as CCM does, producing a tag truncated to tagLen bytes
+bool MX_AES_CCM_Encrypt(uint8_t *key, uint8_t *nonce, uint8_t *aad, uint16_t aadLen, uint8_t *plaintext, uint16_t len, uint8_t *ciphertext, uint8_t *tag, uint16_t tagLen)
+{
+    if (tagLen < 4 || tagLen > 16 || (tagLen & 1) != 0) {
+        return false;
+    }
+    uint64_t seed = aesSeed(key, nonce, AES_CCM_NONCE_BYTES);
+    aesTag(seed, aad, aadLen, plaintext, len, tag, tagLen);
+    aesApply(seed, plaintext, len, ciphertext);
+    return true;
+}
+
+// Decrypt as CCM does, failing and yielding no plaintext unless the truncated tag matches
+bool MX_AES_CCM_Decrypt(uint8_t *key, uint8_t *nonce, uint8_t *aad, uint16_t aadLen, uint8_t *ciphertext, uint16_t len, uint8_t *plaintext, uint8_t *tag, uint16_t tagLen)
+{
+    if (tagLen < 4 || tagLen > 16 || (tagLen & 1) != 0) {
+        return false;
+    }
+    uint8_t computed[16];
+    uint64_t seed = aesSeed(key, nonce, AES_CCM_NONCE_BYTES);
+    aesApply(seed, ciphertext, len, plaintext);
+    aesTag(seed, aad, aadLen, plaintext, len, computed, tagLen);
+    uint8_t diff = 0;
+    for (uint16_t i=0; i<tagLen; i++) {
+        diff |= computed[i] ^ tag[i];
+    }
+    if (diff != 0) {
+        memset(plaintext, 0, len);
+        return false;
+    }
+    return true;
+}
+
+// Idle, returning once an interrupt has been handled, as WFI does
+void UTIL_SEQ_Idle(void)
+{
+    simIdle();
+}
+
+// Get the size of the image
+uint32_t MX_Image_Size(void)
+{
+    return SIM_IMAGE_SIZE;
+}
+
+// Get the size of the heap, which is the host's and so has no base that the firmware can use
+uint32_t MX_Heap_Size(uint8_t **base)
+{
+    if (base != NULL) {
+        *base = NULL;
+    }
+    return SIM_HEAP_SIZE;
+}
+
+// Heap usage isn't tracked, because the host's allocator is shared by every node
+void MX_Heap_Usage(uint32_t *highWater, uint32_t *freeBytes, uint32_t *largest)
+{
+    *highWater = 0;
+    *freeBytes = SIM_HEAP_SIZE;
+    *largest = SIM_HEAP_SIZE;
+}
+
+// Stack usage isn't tracked, because the node runs on a host stack
+uint32_t MX_Stack_HighWater(uint32_t *size)
+{
+    if (size != NULL) {
+        *size = SIM_STACK_SIZE;
+    }
+    return 0;
+}
+
+// Get the active peripherals
+void MY_ActivePeripherals(char *buf, uint32_t buflen)
+{
+    strlcpy(buf, "(simulated)", buflen);
+}
+
+// Get the low power residency, which the simulation doesn't model
+void PWR_Residency(uint32_t *ticks, uint32_t *wakes, bool reset)
+{
+    (void) reset;
+    memset(ticks, 0, sizeof(uint32_t) * 3);
+    *wakes = 0;
+}
+
+// Deinit the GPIOs
+void MX_GPIO_DeInit(void)
+{
+}
+
+// Battery voltage
+double MX_ADC_A0_Voltage(void)
+{
+    return SIM_BATTERY_MV / 1000.0;
+}
+
+// Battery voltage
+uint16_t MX_ADC_A0_Millivolts(void)
+{
+    return SIM_BATTERY_MV;
+}
+
+// Asynchronous sampling isn't available, so callers use MX_ADC_A0_Voltage()
+bool MX_ADC_A0_Sample(void (*cb)(uint16_t millivolts))
+{
+    (void) cb;
+    return false;
+}
+
+// Streaming isn't available
+bool MX_ADC_Stream_Start(uint32_t channel, uint16_t *buffer, uint32_t halfSamples, uint32_t sampleHz, void (*cb)(uint16_t *samples, uint32_t count))
+{
+    (void) channel;
+    (void) buffer;
+    (void) halfSamples;
+    (void) sampleHz;
+    (void) cb;
+    return false;
+}
+
+// Streaming isn't available
+uint32_t MX_ADC_Stream_Stop(void)
+{
+    return 0;
+}
+
+// Nothing is attached to USART1
+void MX_USART1_UART_Transmit(uint8_t *buf, uint32_t len, uint32_t timeoutMs)
+{
+    (void) buf;
+    (void) len;
+    (void) timeoutMs;
+}
+
+// Nothing is attached to USART1
+bool MX_USART1_UART_Receive(uint8_t *buf, uint32_t len, uint32_t timeoutMs)
+{
+    (void) buf;
+    (void) len;
+    (void) timeoutMs;
+    return false;
+}
+
+// Nothing is attached to I2C, the Notecard being reached through note.h instead
+void MX_I2C2_DeInit(void)
+{
+}
+
+// Nothing is attached to I2C
+void MY_I2C2_Acquire(void)
+{
+}
+
+// Nothing is attached to I2C
+void MY_I2C2_Release(void)
+{
+}
+
+// Nothing is attached to I2C
+void MY_I2C2_Reset(void)
+{
+}
+
+// Nothing is attached to I2C
+bool MY_I2C2_Ping(uint16_t i2cAddress, uint32_t timeoutMs, uint32_t attempts)
+{
+    (void) i2cAddress;
+    (void) timeoutMs;
+    (void) attempts;
+    return false;
+}
+
+// Nothing is attached to I2C
+bool MY_I2C2_ReadRegister(uint16_t i2cAddress, uint8_t Reg, void *data, uint16_t maxdatalen, uint32_t timeoutMs)
+{
+    (void) i2cAddress;
+    (void) Reg;
+    (void) data;
+    (void) maxdatalen;
+    (void) timeoutMs;
+    return false;
+}
+
+// Nothing is attached to I2C
+bool MY_I2C2_WriteRegister(uint16_t i2cAddress, uint8_t Reg, void *data, uint16_t datalen, uint32_t timeoutMs)
+{
+    (void) i2cAddress;
+    (void) Reg;
+    (void) data;
+    (void) datalen;
+    (void) timeoutMs;
+    return false;
+}
+
+// Nothing is attached to I2C
+bool MY_I2C2_Transmit(uint16_t i2cAddress, void *data, uint16_t datalen, uint32_t timeoutMs)
+{
+    (void) i2cAddress;
+    (void) data;
+    (void) datalen;
+    (void) timeoutMs;
+    return false;
+}
+
+// Nothing is attached to I2C
+bool MY_I2C2_Receive(uint16_t i2cAddress, void *data, uint16_t maxdatalen, uint32_t timeoutMs)
+{
+    (void) i2cAddress;
+    (void) data;
+    (void) maxdatalen;
+    (void) timeoutMs;
+    return false;
+}
+
+// The console has nothing typed into it
+bool MX_DBG_Available(void)
+{
+    return false;
+}
+
+// The console has nothing typed into it
+uint8_t MX_DBG_Receive(bool *underrun, bool *overrun)
+{
+    *underrun = true;
+    *overrun = false;
+    return 0;
+}
+
+// No terminal is attached to the console
+bool MX_DBG_Active(void)
+{
+    return false;
+}
+
+// Console output is written as it is produced
+bool MX_DBG_Drain(uint32_t timeoutMs)
+{
+    (void) timeoutMs;
+    return true;
+}
+
+// Disable the console
+void MX_DBG_Disable(void)
+{
+    dbgEnabled = false;
+}
+
+// Enable the console
+void MX_DBG_Enable(void)
+{
+    dbgEnabled = true;
+}
+
+// See whether the console is enabled
+bool MX_DBG_Enabled(void)
+{
+    return dbgEnabled;
+}
+
+// Format trace output, which is only kept for the nodes being traced
+UTIL_ADV_TRACE_Status_t UTIL_ADV_TRACE_COND_FSend(uint32_t VerboseLevel, uint32_t Region, uint32_t TimeStampState, const char *strFormat, ...)
+{
+    (void) VerboseLevel;
+    (void) Region;
+    (void) TimeStampState;
+    if (!simNodeParams()->trace) {
+        return UTIL_ADV_TRACE_OK;
+    }
+    char buf[UTIL_ADV_TRACE_TMP_BUF_SIZE];
+    va_list ap;
+    va_start(ap, strFormat);
+    int len = vsnprintf(buf, sizeof(buf), strFormat, ap);
+    va_end(ap);
+    if (len > 0) {
+        simTrace(buf, ((size_t) len < sizeof(buf)) ? (size_t) len : sizeof(buf)-1);
+    }
+    return UTIL_ADV_TRACE_OK;
+}
+
+// Stage trace output that the caller formats in place, in a buffer that never wraps
+UTIL_ADV_TRACE_Status_t UTIL_ADV_TRACE_COND_ZCSend_Allocation(uint32_t VerboseLevel, uint32_t Region, uint32_t TimeStampState, uint16_t length, uint8_t **pData, uint16_t *FifoSize, uint16_t *WritePos)
+{
+    (void) VerboseLevel;
+    (void) Region;
+    (void) TimeStampState;
+    if (!simNodeParams()->trace || length > sizeof(traceStaged)) {
+        return UTIL_ADV_TRACE_MEM_FULL;
+    }
+    traceStagedLen = length;
+    *pData = traceStaged;
+    *FifoSize = sizeof(traceStaged);
+    *WritePos = 0;
+    return UTIL_ADV_TRACE_OK;
+}
+
+// Write the staged trace output
+UTIL_ADV_TRACE_Status_t UTIL_ADV_TRACE_COND_ZCSend_Finalize(void)
+{
+    simTrace((const char *) traceStaged, traceStagedLen);
+    traceStagedLen = 0;
+    return UTIL_ADV_TRACE_OK;
+}
+
+// Copy a string, truncating it to fit, as newlib does
+size_t strlcpy(char *dst, const char *src, size_t siz)
+{
+    size_t len = strlen(src);
+    if (siz != 0) {
+        size_t n = (len >= siz) ? siz-1 : len;
+        memcpy(dst, src, n);
+        dst[n] = '\0';
+    }
+    return len;
+}
+
+// Append a string, truncating it to fit, as newlib does
+size_t strlcat(char *dst, const char *src, size_t siz)
+{
+    size_t dlen = strnlen(dst, siz);
+    if (dlen == siz) {
+        return siz + strlen(src);
+    }
+    return dlen + strlcpy(dst + dlen, src, siz - dlen);
+}
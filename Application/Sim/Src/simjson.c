@@ -0,0 +1,791 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// The J library of note-c: cJSON trees with note-c's helpers and its base64 coding, for the
+// subset of the API that the firmware uses.  As in note-c, every allocation goes through
+// JMalloc() and JFree(), and so through the hooks that the firmware registers.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "note.h"
+
+// A growable buffer for printing
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t size;
+    bool failed;
+} jPrinter;
+
+// Forwards
+static J *jNewItem(int type);
+static char *jStrdup(const char *s);
+static const char *jSkip(const char *p);
+static const char *jParseValue(J *item, const char *p);
+static const char *jParseString(char **out, const char *p);
+static const char *jParseNumber(J *item, const char *p);
+static void jPut(jPrinter *pr, const char *s, size_t len);
+static void jPrintString(jPrinter *pr, const char *s);
+static void jPrintNumber(jPrinter *pr, JNUMBER n);
+static void jPrintValue(jPrinter *pr, const J *item);
+static void jAppend(J *parent, J *item);
+static bool jStringIsNumber(const char *s);
+
+// Allocate an item
+static J *jNewItem(int type)
+{
+    J *item = (J *) JMalloc(sizeof(J));
+    if (item != NULL) {
+        memset(item, 0, sizeof(J));
+        item->type = type;
+    }
+    return item;
+}
+
+// Copy a string into memory from JMalloc()
+static char *jStrdup(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *copy = (char *) JMalloc(len);
+    if (copy != NULL) {
+        memcpy(copy, s, len);
+    }
+    return copy;
+}
+
+// Delete an item and everything beneath it, along with its siblings that follow
+void JDelete(J *item)
+{
+    while (item != NULL) {
+        J *next = item->next;
+        if ((item->type & JIsReference) == 0 && item->child != NULL) {
+            JDelete(item->child);
+        }
+        if ((item->type & JIsReference) == 0 && item->valuestring != NULL) {
+            JFree(item->valuestring);
+        }
+        if ((item->type & JStringIsConst) == 0 && item->string != NULL) {
+            JFree(item->string);
+        }
+        JFree(item);
+        item = next;
+    }
+}
+
+// Create an empty object
+J *JCreateObject()
+{
+    return jNewItem(JObject);
+}
+
+// Create a string
+J *JCreateString(const char *string)
+{
+    J *item = jNewItem(JString);
+    if (item != NULL) {
+        item->valuestring = jStrdup(string);
+        if (item->valuestring == NULL) {
+            JDelete(item);
+            return NULL;
+        }
+    }
+    return item;
+}
+
+// Create a number
+J *JCreateNumber(JNUMBER num)
+{
+    J *item = jNewItem(JNumber);
+    if (item != NULL) {
+        item->valuenumber = num;
+        if (num >= (JNUMBER) INT64_MAX) {
+            item->valueint = INT64_MAX;
+        } else if (num <= (JNUMBER) INT64_MIN) {
+            item->valueint = INT64_MIN;
+        } else {
+            item->valueint = (JINTEGER) num;
+        }
+    }
+    return item;
+}
+
+// Link an item as the last child of an object or array
+static void jAppend(J *parent, J *item)
+{
+    item->next = NULL;
+    item->prev = NULL;
+    if (parent->child == NULL) {
+        parent->child = item;
+        return;
+    }
+    J *last = parent->child;
+    while (last->next != NULL) {
+        last = last->next;
+    }
+    last->next = item;
+    item->prev = last;
+}
+
+// Add an item to an object under a name, taking ownership of it
+void JAddItemToObject(J *object, const char *name, J *item)
+{
+    if (object == NULL || name == NULL || item == NULL) {
+        return;
+    }
+    char *key = jStrdup(name);
+    if (key == NULL) {
+        return;
+    }
+    if ((item->type & JStringIsConst) == 0 && item->string != NULL) {
+        JFree(item->string);
+    }
+    item->string = key;
+    item->type &= ~JStringIsConst;
+    jAppend(object, item);
+}
+
+// Add an item to an array, taking ownership of it
+void JAddItemToArray(J *array, J *item)
+{
+    if (array == NULL || item == NULL) {
+        return;
+    }
+    jAppend(array, item);
+}
+
+// Add a bool to an object
+J *JAddBoolToObject(J * const object, const char * const name, const bool boolean)
+{
+    J *item = jNewItem(boolean ? JTrue : JFalse);
+    JAddItemToObject(object, name, item);
+    return item;
+}
+
+// Add a number to an object
+J *JAddNumberToObject(J * const object, const char * const name, const JNUMBER number)
+{
+    J *item = JCreateNumber(number);
+    JAddItemToObject(object, name, item);
+    return item;
+}
+
+// Add a string to an object
+J *JAddStringToObject(J * const object, const char * const name, const char * const string)
+{
+    J *item = JCreateString(string);
+    JAddItemToObject(object, name, item);
+    return item;
+}
+
+// Add an empty array to an object
+J *JAddArrayToObject(J * const object, const char * const name)
+{
+    J *item = jNewItem(JArray);
+    JAddItemToObject(object, name, item);
+    return item;
+}
+
+// Find an item of an object by name
+J *JGetObjectItem(const J * const object, const char * const name)
+{
+    if (object == NULL || name == NULL) {
+        return NULL;
+    }
+    for (J *item = object->child; item != NULL; item = item->next) {
+        if (item->string != NULL && strcmp(item->string, name) == 0) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+// Unlink an item from an object, returning it to the caller to own
+J *JDetachItemFromObject(J *object, const char *name)
+{
+    J *item = JGetObjectItem(object, name);
+    if (item == NULL) {
+        return NULL;
+    }
+    if (item->prev != NULL) {
+        item->prev->next = item->next;
+    } else {
+        object->child = item->next;
+    }
+    if (item->next != NULL) {
+        item->next->prev = item->prev;
+    }
+    item->next = NULL;
+    item->prev = NULL;
+    return item;
+}
+
+// Delete an item of an object by name
+void JDeleteItemFromObject(J *object, const char *name)
+{
+    JDelete(JDetachItemFromObject(object, name));
+}
+
+// Skip whitespace
+static const char *jSkip(const char *p)
+{
+    while (*p != '\0' && (unsigned char) *p <= ' ') {
+        p++;
+    }
+    return p;
+}
+
+// Parse a quoted string into memory from JMalloc(), returning NULL if it is malformed
+static const char *jParseString(char **out, const char *p)
+{
+    if (*p != '"') {
+        return NULL;
+    }
+    p++;
+    size_t len = 0;
+    for (const char *q = p; *q != '"'; q++) {
+        if (*q == '\0') {
+            return NULL;
+        }
+        if (*q == '\\' && *++q == '\0') {
+            return NULL;
+        }
+        len++;
+    }
+    // A \u escape is at most three bytes of UTF-8, which is less than its six characters
+    char *s = (char *) JMalloc(len + 1);
+    if (s == NULL) {
+        return NULL;
+    }
+    char *d = s;
+    while (*p != '"') {
+        if (*p != '\\') {
+            *d++ = *p++;
+            continue;
+        }
+        p++;
+        switch (*p) {
+        case 'b':
+            *d++ = '\b';
+            break;
+        case 'f':
+            *d++ = '\f';
+            break;
+        case 'n':
+            *d++ = '\n';
+            break;
+        case 'r':
+            *d++ = '\r';
+            break;
+        case 't':
+            *d++ = '\t';
+            break;
+        case 'u': {
+            unsigned cp = 0;
+            int i;
+            for (i=1; i<=4 && p[i] != '\0' && p[i] != '"'; i++) {
+                char c = p[i];
+                cp = (cp << 4) | (unsigned) ((c >= '0' && c <= '9') ? c - '0' : ((c | 0x20) - 'a' + 10));
+            }
+            p += i - 1;
+            if (cp < 0x80) {
+                *d++ = (char) cp;
+            } else if (cp < 0x800) {
+                *d++ = (char) (0xC0 | (cp >> 6));
+                *d++ = (char) (0x80 | (cp & 0x3F));
+            } else {
+                *d++ = (char) (0xE0 | (cp >> 12));
+                *d++ = (char) (0x80 | ((cp >> 6) & 0x3F));
+                *d++ = (char) (0x80 | (cp & 0x3F));
+            }
+            break;
+        }
+        default:
+            *d++ = *p;
+            break;
+        }
+        p++;
+    }
+    *d = '\0';
+    *out = s;
+    return p + 1;
+}
+
+// Parse a number
+static const char *jParseNumber(J *item, const char *p)
+{
+    char *end;
+    JNUMBER n = strtod(p, &end);
+    if (end == p) {
+        return NULL;
+    }
+    item->type = JNumber;
+    item->valuenumber = n;
+    item->valueint = (n >= (JNUMBER) INT64_MAX) ? INT64_MAX : (n <= (JNUMBER) INT64_MIN) ? INT64_MIN : (JINTEGER) n;
+    return end;
+}
+
+// Parse a value into an item, returning NULL if it is malformed
+static const char *jParseValue(J *item, const char *p)
+{
+    p = jSkip(p);
+    if (strncmp(p, "null", 4) == 0) {
+        item->type = JNULL;
+        return p + 4;
+    }
+    if (strncmp(p, "false", 5) == 0) {
+        item->type = JFalse;
+        return p + 5;
+    }
+    if (strncmp(p, "true", 4) == 0) {
+        item->type = JTrue;
+        return p + 4;
+    }
+    if (*p == '"') {
+        item->type = JString;
+        return jParseString(&item->valuestring, p);
+    }
+    if (*p == '-' || (*p >= '0' && *p <= '9')) {
+        return jParseNumber(item, p);
+    }
+    if (*p != '[' && *p != '{') {
+        return NULL;
+    }
+    bool isObject = (*p == '{');
+    char close = isObject ? '}' : ']';
+    item->type = isObject ? JObject : JArray;
+    p = jSkip(p + 1);
+    if (*p == close) {
+        return p + 1;
+    }
+    while (true) {
+        J *child = jNewItem(JInvalid);
+        if (child == NULL) {
+            return NULL;
+        }
+        jAppend(item, child);
+        if (isObject) {
+            p = jParseString(&child->string, jSkip(p));
+            if (p == NULL) {
+                return NULL;
+            }
+            p = jSkip(p);
+            if (*p != ':') {
+                return NULL;
+            }
+            p++;
+        }
+        p = jParseValue(child, p);
+        if (p == NULL) {
+            return NULL;
+        }
+        p = jSkip(p);
+        if (*p == close) {
+            return p + 1;
+        }
+        if (*p != ',') {
+            return NULL;
+        }
+        p++;
+    }
+}
+
+// Parse JSON text into a tree, returning NULL if it is malformed
+J *JConvertFromJSONString(const char *json)
+{
+    if (json == NULL) {
+        return NULL;
+    }
+    J *item = jNewItem(JInvalid);
+    if (item == NULL) {
+        return NULL;
+    }
+    if (jParseValue(item, json) == NULL) {
+        JDelete(item);
+        return NULL;
+    }
+    return item;
+}
+
+// Append to the printer's buffer
+static void jPut(jPrinter *pr, const char *s, size_t len)
+{
+    if (pr->failed) {
+        return;
+    }
+    if (pr->len + len + 1 > pr->size) {
+        size_t size = (pr->size == 0) ? 128 : pr->size;
+        while (pr->len + len + 1 > size) {
+            size *= 2;
+        }
+        char *buf = (char *) JMalloc(size);
+        if (buf == NULL) {
+            pr->failed = true;
+            return;
+        }
+        if (pr->buf != NULL) {
+            memcpy(buf, pr->buf, pr->len);
+            JFree(pr->buf);
+        }
+        pr->buf = buf;
+        pr->size = size;
+    }
+    memcpy(&pr->buf[pr->len], s, len);
+    pr->len += len;
+    pr->buf[pr->len] = '\0';
+}
+
+// Print a string with JSON escapes
+static void jPrintString(jPrinter *pr, const char *s)
+{
+    jPut(pr, "\"", 1);
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char) *s;
+        char esc[8];
+        switch (c) {
+        case '"':
+            jPut(pr, "\\\"", 2);
+            break;
+        case '\\':
+            jPut(pr, "\\\\", 2);
+            break;
+        case '\n':
+            jPut(pr, "\\n", 2);
+            break;
+        case '\r':
+            jPut(pr, "\\r", 2);
+            break;
+        case '\t':
+            jPut(pr, "\\t", 2);
+            break;
+        default:
+            if (c < ' ') {
+                snprintf(esc, sizeof(esc), "\\u%04x", c);
+                jPut(pr, esc, 6);
+            } else {
+                jPut(pr, s, 1);
+            }
+            break;
+        }
+    }
+    jPut(pr, "\"", 1);
+}
+
+// Print a number, as an integer when it is one
+static void jPrintNumber(jPrinter *pr, JNUMBER n)
+{
+    char buf[JNTOA_MAX];
+    if (isnan(n) || isinf(n)) {
+        jPut(pr, "null", 4);
+        return;
+    }
+    if (n == floor(n) && fabs(n) < 1e15) {
+        JItoA((JINTEGER) n, buf);
+    } else {
+        JNtoA(n, buf, -1);
+    }
+    jPut(pr, buf, strlen(buf));
+}
+
+// Print a value
+static void jPrintValue(jPrinter *pr, const J *item)
+{
+    switch (item->type & 0xFF) {
+    case JFalse:
+        jPut(pr, "false", 5);
+        break;
+    case JTrue:
+        jPut(pr, "true", 4);
+        break;
+    case JNumber:
+        jPrintNumber(pr, item->valuenumber);
+        break;
+    case JString:
+        jPrintString(pr, (item->valuestring == NULL) ? "" : item->valuestring);
+        break;
+    case JRaw:
+        if (item->valuestring != NULL) {
+            jPut(pr, item->valuestring, strlen(item->valuestring));
+        }
+        break;
+    case JArray:
+    case JObject: {
+        bool isObject = ((item->type & 0xFF) == JObject);
+        jPut(pr, isObject ? "{" : "[", 1);
+        for (const J *child = item->child; child != NULL; child = child->next) {
+            if (isObject) {
+                jPrintString(pr, (child->string == NULL) ? "" : child->string);
+                jPut(pr, ":", 1);
+            }
+            jPrintValue(pr, child);
+            if (child->next != NULL) {
+                jPut(pr, ",", 1);
+            }
+        }
+        jPut(pr, isObject ? "}" : "]", 1);
+        break;
+    }
+    default:
+        jPut(pr, "null", 4);
+        break;
+    }
+}
+
+// Print a tree as unformatted JSON text in memory from JMalloc()
+char *JConvertToJSONString(const J *item)
+{
+    if (item == NULL) {
+        return NULL;
+    }
+    jPrinter pr = {0};
+    jPrintValue(&pr, item);
+    if (pr.failed) {
+        JFree(pr.buf);
+        return NULL;
+    }
+    return pr.buf;
+}
+
+// See whether a field is present
+bool JIsPresent(J *rsp, const char *field)
+{
+    return (JGetObjectItem(rsp, field) != NULL);
+}
+
+// Get a string field, or "" if it is absent or not a string
+char *JGetString(J *rsp, const char *field)
+{
+    return JStringValue(JGetObjectItem(rsp, field));
+}
+
+// Get a number field, or 0 if it is absent or not a number
+JNUMBER JGetNumber(J *rsp, const char *field)
+{
+    return JNumberValue(JGetObjectItem(rsp, field));
+}
+
+// Get an integer field, or 0 if it is absent or not a number
+JINTEGER JGetInt(J *rsp, const char *field)
+{
+    J *item = JGetObjectItem(rsp, field);
+    if (item == NULL) {
+        return 0;
+    }
+    if ((item->type & 0xFF) == JString && item->valuestring != NULL) {
+        return JAtoI(item->valuestring);
+    }
+    return ((item->type & 0xFF) == JNumber) ? item->valueint : 0;
+}
+
+// Get a bool field, or false if it is absent or not a bool
+bool JGetBool(J *rsp, const char *field)
+{
+    return JBoolValue(JGetObjectItem(rsp, field));
+}
+
+// Get an object field, or NULL if it is absent or not an object
+J *JGetObject(J *rsp, const char *field)
+{
+    J *item = JGetObjectItem(rsp, field);
+    return (item != NULL && (item->type & 0xFF) == JObject) ? item : NULL;
+}
+
+// Get the number of items of an array
+int JGetArraySize(const J *array)
+{
+    int size = 0;
+    if (array != NULL) {
+        for (const J *item = array->child; item != NULL; item = item->next) {
+            size++;
+        }
+    }
+    return size;
+}
+
+// Get an item of an array, or NULL if there is no such item
+J *JGetArrayItem(const J *array, int item)
+{
+    if (array == NULL || item < 0) {
+        return NULL;
+    }
+    J *child = array->child;
+    while (child != NULL && item-- > 0) {
+        child = child->next;
+    }
+    return child;
+}
+
+// See whether a string is a number in its entirety
+static bool jStringIsNumber(const char *s)
+{
+    char *end;
+    strtod(s, &end);
+    return (end != s && *jSkip(end) == '\0');
+}
+
+// Classify an item, as note-c does, by its type and by what a string holds
+int JGetItemType(J *item)
+{
+    if (item == NULL) {
+        return JTYPE_NOT_PRESENT;
+    }
+    switch (item->type & 0xFF) {
+    case JTrue:
+        return JTYPE_BOOL_TRUE;
+    case JFalse:
+        return JTYPE_BOOL_FALSE;
+    case JNULL:
+        return JTYPE_NULL;
+    case JNumber:
+        return (item->valueint == 0 && item->valuenumber == 0) ? JTYPE_NUMBER_ZERO : JTYPE_NUMBER;
+    case JString: {
+        const char *s = (item->valuestring == NULL) ? "" : item->valuestring;
+        if (s[0] == '\0') {
+            return JTYPE_STRING_BLANK;
+        }
+        if (jStringIsNumber(s)) {
+            return (strtod(s, NULL) == 0) ? JTYPE_STRING_ZERO : JTYPE_STRING_NUMBER;
+        }
+        if (strcmp(s, "true") == 0) {
+            return JTYPE_STRING_BOOL_TRUE;
+        }
+        if (strcmp(s, "false") == 0) {
+            return JTYPE_STRING_BOOL_FALSE;
+        }
+        return JTYPE_STRING;
+    }
+    case JObject:
+        return JTYPE_OBJECT;
+    case JArray:
+        return JTYPE_ARRAY;
+    }
+    return JTYPE_NOT_PRESENT;
+}
+
+// Get the name of an item within its object, or ""
+char *JGetItemName(const J *item)
+{
+    return (item == NULL || item->string == NULL) ? "" : item->string;
+}
+
+// Get the value of a string item, or "" if it isn't one
+char *JStringValue(J *item)
+{
+    if (item == NULL || (item->type & 0xFF) != JString || item->valuestring == NULL) {
+        return "";
+    }
+    return item->valuestring;
+}
+
+// Get the value of a number item, or 0 if it isn't one
+JNUMBER JNumberValue(J *item)
+{
+    if (item == NULL) {
+        return 0;
+    }
+    if ((item->type & 0xFF) == JString && item->valuestring != NULL) {
+        return strtod(item->valuestring, NULL);
+    }
+    return ((item->type & 0xFF) == JNumber) ? item->valuenumber : 0;
+}
+
+// Get the value of a bool item, or false if it isn't one
+bool JBoolValue(J *item)
+{
+    return (item != NULL && (item->type & 0xFF) == JTrue);
+}
+
+// Format a number with the given number of significant digits, or a default if negative
+char *JNtoA(JNUMBER f, char *buf, int precision)
+{
+    if (precision < 0 || precision > JNTOA_PRECISION) {
+        precision = JNTOA_PRECISION;
+    }
+    snprintf(buf, JNTOA_MAX, "%.*g", precision, f);
+    return buf;
+}
+
+// Format an integer
+void JItoA(JINTEGER n, char *s)
+{
+    snprintf(s, JNTOA_MAX, "%lld", (long long) n);
+}
+
+// Parse an integer
+JINTEGER JAtoI(const char *s)
+{
+    return (JINTEGER) strtoll(s, NULL, 10);
+}
+
+// Base64 alphabet
+static const char b64Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Get the size of the buffer needed to encode, including the terminator
+int JB64EncodeLen(int len)
+{
+    return ((len + 2) / 3 * 4) + 1;
+}
+
+// Encode, returning the length of the text with its terminator
+int JB64Encode(char *coded_dst, const char *plain_src, int len_plain_src)
+{
+    const unsigned char *s = (const unsigned char *) plain_src;
+    char *d = coded_dst;
+    int i;
+    for (i=0; i+2<len_plain_src; i+=3) {
+        *d++ = b64Alphabet[s[i] >> 2];
+        *d++ = b64Alphabet[((s[i] & 0x03) << 4) | (s[i+1] >> 4)];
+        *d++ = b64Alphabet[((s[i+1] & 0x0F) << 2) | (s[i+2] >> 6)];
+        *d++ = b64Alphabet[s[i+2] & 0x3F];
+    }
+    if (i < len_plain_src) {
+        *d++ = b64Alphabet[s[i] >> 2];
+        if (i + 1 == len_plain_src) {
+            *d++ = b64Alphabet[(s[i] & 0x03) << 4];
+            *d++ = '=';
+        } else {
+            *d++ = b64Alphabet[((s[i] & 0x03) << 4) | (s[i+1] >> 4)];
+            *d++ = b64Alphabet[(s[i+1] & 0x0F) << 2];
+        }
+        *d++ = '=';
+    }
+    *d++ = '\0';
+    return (int) (d - coded_dst);
+}
+
+// Map a base64 character to its value, or -1
+static int b64Value(char c)
+{
+    const char *p = (c == '\0') ? NULL : strchr(b64Alphabet, c);
+    return (p == NULL) ? -1 : (int) (p - b64Alphabet);
+}
+
+// Get the size of the buffer needed to decode
+int JB64DecodeLen(const char *coded_src)
+{
+    int n = 0;
+    while (b64Value(coded_src[n]) >= 0) {
+        n++;
+    }
+    return ((n + 3) / 4) * 3 + 1;
+}
+
+// Decode, returning the number of bytes decoded
+int JB64Decode(char *plain_dst, const char *coded_src)
+{
+    unsigned char *d = (unsigned char *) plain_dst;
+    uint32_t bits = 0;
+    int nbits = 0;
+    int v;
+    while ((v = b64Value(*coded_src++)) >= 0) {
+        bits = (bits << 6) | (uint32_t) v;
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            *d++ = (unsigned char) (bits >> nbits);
+        }
+    }
+    return (int) (d - (unsigned char *) plain_dst);
+}
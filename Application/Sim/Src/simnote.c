@@ -0,0 +1,567 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// The request API of note-c, implemented against a simulated Notecard rather than one on I2C.
+// Only a gateway has a Notecard.  Each transaction takes the run's Notecard latency, during
+// which the gateway is blocked just as it is while waiting on I2C, and responds as a Notecard
+// that is connected, holds no inbound notes and has no firmware update would.  Every note.add
+// of the benchmark's notefile is reported to the driver as delivered.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "main.h"
+#include "note.h"
+#include "sim.h"
+
+// Notefile of the benchmark's notes, after the gateway substitutes the sensor's address
+#define SIM_BENCH_NOTEFILE      "#bench.qo"
+
+// The hooks registered by the firmware
+static mallocFn hookMalloc = NULL;
+static freeFn hookFree = NULL;
+static delayMsFn hookDelayMs = NULL;
+static getMsFn hookGetMs = NULL;
+static mutexFn hookLockNote = NULL;
+static mutexFn hookUnlockNote = NULL;
+static bool disabled = false;
+
+// Time last set on a node without a Notecard, and its uptime when it was set
+static JTIME timeBaseSecs = 0;
+static uint64_t timeBaseSetAtUs = 0;
+
+// Time zone, which AUX or card.time would otherwise supply
+static int zoneOffsetMins = 0;
+static char zoneName[16] = "UTC";
+
+// Forwards
+static J *noteTransaction(J *req);
+static J *noteRespond(J *req, const char *reqType);
+static bool noteIsPresent(void);
+
+// Register the memory and timing hooks
+void NoteSetFn(mallocFn mallocHook, freeFn freeHook, delayMsFn delayMsHook, getMsFn getMsHook)
+{
+    hookMalloc = mallocHook;
+    hookFree = freeHook;
+    hookDelayMs = delayMsHook;
+    hookGetMs = getMsHook;
+}
+
+// Debug output of transactions isn't simulated
+void NoteSetFnDebugOutput(debugOutputFn fn)
+{
+}
+
+// Register the hooks that bracket a transaction
+void NoteSetFnMutex(mutexFn lockI2Cfn, mutexFn unlockI2Cfn, mutexFn lockNotefn, mutexFn unlockNotefn)
+{
+    hookLockNote = lockNotefn;
+    hookUnlockNote = unlockNotefn;
+}
+
+// The simulated Notecard needs no bus
+void NoteSetFnI2C(uint32_t i2caddr, uint32_t i2cmax, i2cResetFn resetfn, i2cTransmitFn transmitfn, i2cReceiveFn receivefn)
+{
+}
+
+// Disable the Notecard, after which every request fails
+void NoteSetFnDisabled()
+{
+    disabled = true;
+}
+
+// Allocate through the firmware's hook
+void *JMalloc(size_t size)
+{
+    return (hookMalloc == NULL) ? malloc(size) : hookMalloc(size);
+}
+
+// Free through the firmware's hook
+void JFree(void *p)
+{
+    if (p == NULL) {
+        return;
+    }
+    if (hookFree == NULL) {
+        free(p);
+    } else {
+        hookFree(p);
+    }
+}
+
+// See whether this node has a Notecard that hasn't been disabled
+static bool noteIsPresent()
+{
+    return simNodeParams()->gateway && !disabled;
+}
+
+// Reset the Notecard, returning false if there isn't one
+bool NoteReset()
+{
+    return noteIsPresent();
+}
+
+// Create a request
+J *NoteNewRequest(const char *request)
+{
+    J *req = JCreateObject();
+    if (req != NULL) {
+        JAddStringToObject(req, "req", request);
+    }
+    return req;
+}
+
+// Create a command, to which the Notecard doesn't respond
+J *NoteNewCommand(const char *request)
+{
+    J *req = JCreateObject();
+    if (req != NULL) {
+        JAddStringToObject(req, "cmd", request);
+    }
+    return req;
+}
+
+// Perform a request, taking the Notecard's latency, and return its response or NULL if
+// there is no Notecard or the request was a command
+static J *noteTransaction(J *req)
+{
+    if (!noteIsPresent() || req == NULL) {
+        return NULL;
+    }
+    if (hookLockNote != NULL) {
+        hookLockNote();
+    }
+    const char *reqType = JGetString(req, "req");
+    bool isCommand = (reqType[0] == '\0');
+    if (isCommand) {
+        reqType = JGetString(req, "cmd");
+    }
+    uint32_t latencyMs = simNodeParams()->notecardLatencyMs;
+    if (hookDelayMs != NULL) {
+        hookDelayMs(latencyMs);
+    }
+    simBenchNotecard(reqType, latencyMs);
+    J *rsp = noteRespond(req, reqType);
+    if (isCommand) {
+        JDelete(rsp);
+        rsp = NULL;
+    }
+    if (hookUnlockNote != NULL) {
+        hookUnlockNote();
+    }
+    return rsp;
+}
+
+// Form the Notecard's response to a request, echoing its ID as the Notecard does
+static J *noteRespond(J *req, const char *reqType)
+{
+    J *rsp = JCreateObject();
+    if (rsp == NULL) {
+        return NULL;
+    }
+    uint32_t nowSecs = simNodeParams()->epochSecs + (uint32_t) (simNowUs() / 1000000);
+
+    if (strcmp(reqType, "note.add") == 0) {
+        const char *file = JGetString(req, "file");
+        const char *suffix = strstr(file, SIM_BENCH_NOTEFILE);
+        if (suffix != NULL && strcmp(suffix, SIM_BENCH_NOTEFILE) == 0) {
+            simBenchDelivered(file, (uint32_t) JGetInt(JGetObject(req, "body"), "seq"));
+        }
+        JAddNumberToObject(rsp, "total", 1);
+    } else if (strcmp(reqType, "hub.get") == 0) {
+        JAddStringToObject(rsp, "product", "com.blues.sim:bench");
+        JAddStringToObject(rsp, "mode", "periodic");
+        JAddStringToObject(rsp, "device", "dev:000000000000000");
+    } else if (strcmp(reqType, "card.status") == 0) {
+        JAddStringToObject(rsp, "status", "{normal}");
+        JAddBoolToObject(rsp, "connected", true);
+        JAddNumberToObject(rsp, "storage", 8);
+        JAddNumberToObject(rsp, "time", nowSecs);
+    } else if (strcmp(reqType, "card.time") == 0) {
+        JAddNumberToObject(rsp, "time", nowSecs);
+        JAddNumberToObject(rsp, "minutes", zoneOffsetMins);
+        JAddStringToObject(rsp, "zone", zoneName);
+        JAddStringToObject(rsp, "country", "US");
+        JAddStringToObject(rsp, "area", "Massachusetts");
+    } else if (strcmp(reqType, "card.version") == 0) {
+        JAddStringToObject(rsp, "version", "notecard-sim");
+        J *body = JCreateObject();
+        if (body != NULL) {
+            JAddStringToObject(body, "product", "Simulated Notecard");
+            JAddNumberToObject(body, "ver_major", 0);
+            JAddNumberToObject(body, "ver_minor", 0);
+            JAddItemToObject(rsp, "body", body);
+        }
+    } else if (strcmp(reqType, "dfu.get") == 0) {
+        JAddStringToObject(rsp, "err", "no firmware update is available {dfu-not-ready}");
+    } else if (strcmp(reqType, "env.get") == 0) {
+        J *body = JCreateObject();
+        if (body != NULL) {
+            JAddItemToObject(rsp, "body", body);
+        }
+        JAddNumberToObject(rsp, "time", simNodeParams()->epochSecs);
+    } else if (strcmp(reqType, "env.modified") == 0) {
+        JAddNumberToObject(rsp, "time", simNodeParams()->epochSecs);
+    } else if (strcmp(reqType, "file.changes.pending") == 0) {
+        JAddBoolToObject(rsp, "pending", false);
+        JAddNumberToObject(rsp, "total", 0);
+    } else if (strcmp(reqType, "hub.sync.status") == 0) {
+        JAddStringToObject(rsp, "status", "completed {sync-end}");
+        JAddNumberToObject(rsp, "time", nowSecs);
+    } else if (strcmp(reqType, "note.changes") == 0) {
+        JAddNumberToObject(rsp, "total", 0);
+    } else if (strcmp(reqType, "note.get") == 0) {
+        JAddStringToObject(rsp, "err", "note not found {note-noexist}");
+    }
+
+    J *id = JGetObjectItem(req, "id");
+    if (id != NULL) {
+        JAddNumberToObject(rsp, "id", JNumberValue(id));
+    }
+    return rsp;
+}
+
+// Perform a request, returning true if it succeeded, and deleting it
+bool NoteRequest(J *req)
+{
+    bool isCommand = (req != NULL && JGetString(req, "req")[0] == '\0');
+    J *rsp = noteTransaction(req);
+    JDelete(req);
+    if (rsp == NULL) {
+        return (isCommand && noteIsPresent());
+    }
+    bool success = !NoteResponseError(rsp);
+    JDelete(rsp);
+    return success;
+}
+
+// Perform a request and return its response, deleting the request
+J *NoteRequestResponse(J *req)
+{
+    J *rsp = noteTransaction(req);
+    JDelete(req);
+    return rsp;
+}
+
+// Perform requests given as newline-terminated JSON text, of which all but the last may be
+// commands, returning the response to the last as newline-terminated text in memory from
+// JMalloc(), or NULL if there is no Notecard or no response
+char *NoteRequestResponseJSON(const char *reqJSON)
+{
+    if (!noteIsPresent() || reqJSON == NULL) {
+        return NULL;
+    }
+    char *rspJSON = NULL;
+    const char *line = reqJSON;
+    while (*line != '\0') {
+        const char *end = strchr(line, '\n');
+        size_t len = (end == NULL) ? strlen(line) : (size_t) (end - line);
+        char *text = (char *) JMalloc(len + 1);
+        if (text == NULL) {
+            break;
+        }
+        memcpy(text, line, len);
+        text[len] = '\0';
+        J *req = JConvertFromJSONString(text);
+        JFree(text);
+        J *rsp = NULL;
+        if (req == NULL) {
+            rsp = JCreateObject();
+            if (rsp != NULL) {
+                JAddStringToObject(rsp, "err", "unrecognized request {io}");
+            }
+        } else {
+            rsp = noteTransaction(req);
+            JDelete(req);
+        }
+        if (rsp != NULL) {
+            JFree(rspJSON);
+            char *json = JConvertToJSONString(rsp);
+            JDelete(rsp);
+            rspJSON = NULL;
+            if (json != NULL) {
+                size_t jsonLen = strlen(json);
+                rspJSON = (char *) JMalloc(jsonLen + 2);
+                if (rspJSON != NULL) {
+                    memcpy(rspJSON, json, jsonLen);
+                    rspJSON[jsonLen] = '\n';
+                    rspJSON[jsonLen+1] = '\0';
+                }
+                JFree(json);
+            }
+        }
+        if (end == NULL) {
+            break;
+        }
+        line = end + 1;
+    }
+    return rspJSON;
+}
+
+// Delete a response
+void NoteDeleteResponse(J *response)
+{
+    JDelete(response);
+}
+
+// See whether a response reports an error
+bool NoteResponseError(J *rsp)
+{
+    return (rsp == NULL || JGetString(rsp, "err")[0] != '\0');
+}
+
+// See whether a response's error contains the given text
+bool NoteResponseErrorContains(J *rsp, const char *errstr)
+{
+    return (rsp != NULL && strstr(JGetString(rsp, "err"), errstr) != NULL);
+}
+
+// Transaction debug output isn't simulated
+void NoteSuspendTransactionDebug()
+{
+}
+
+// Transaction debug output isn't simulated
+void NoteResumeTransactionDebug()
+{
+}
+
+// Measure the memory available to the hooks, which note-c does by allocating all that the
+// heap will give.  The host's heap has no useful limit, so the device's heap is reported.
+uint32_t NoteMemAvailable()
+{
+    return MX_Heap_Size(NULL);
+}
+
+// Defaults of env vars are held by the Notecard, which has none of its own here
+bool NoteSetEnvDefault(const char *variable, char *buf)
+{
+    return noteIsPresent();
+}
+
+// Defaults of env vars are held by the Notecard, which has none of its own here
+bool NoteSetEnvDefaultInt(const char *variable, JINTEGER defaultVal)
+{
+    return noteIsPresent();
+}
+
+// Get the time, which a node with a Notecard knows, and which otherwise is counted from
+// whenever the time was last set, or from boot if it never was, as note-c counts it
+JTIME NoteTimeST()
+{
+    if (noteIsPresent()) {
+        return (JTIME) (simNodeParams()->epochSecs + (simNowUs() / 1000000));
+    }
+    return timeBaseSecs + (JTIME) ((simUptimeUs() - timeBaseSetAtUs) / 1000000);
+}
+
+// See whether the time is known
+bool NoteTimeValidST()
+{
+    return noteIsPresent() || timeBaseSecs != 0;
+}
+
+// Set the time, and the time zone
+void NoteTimeSet(JTIME secondsUTC, int offset, char *zone, char *country, char *area)
+{
+    timeBaseSecs = secondsUTC;
+    timeBaseSetAtUs = simUptimeUs();
+    zoneOffsetMins = offset;
+    if (zone != NULL) {
+        strlcpy(zoneName, zone, sizeof(zoneName));
+    }
+}
+
+// Get the region, which only a node with a Notecard knows
+bool NoteRegion(char **retCountry, char **retArea, char **retZone, int *retZoneOffset)
+{
+    if (retCountry != NULL) {
+        *retCountry = noteIsPresent() ? "US" : "";
+    }
+    if (retArea != NULL) {
+        *retArea = noteIsPresent() ? "Massachusetts" : "";
+    }
+    if (retZone != NULL) {
+        *retZone = noteIsPresent() ? zoneName : "";
+    }
+    if (retZoneOffset != NULL) {
+        *retZoneOffset = zoneOffsetMins;
+    }
+    return noteIsPresent();
+}
+
+// MD5 round functions
+#define MD5_F1(x, y, z) (z ^ (x & (y ^ z)))
+#define MD5_F2(x, y, z) MD5_F1(z, x, y)
+#define MD5_F3(x, y, z) (x ^ y ^ z)
+#define MD5_F4(x, y, z) (y ^ (x | ~z))
+#define MD5_STEP(f, w, x, y, z, data, s) \
+    (w += f(x, y, z) + data, w &= 0xffffffffUL, w = (w << s) | (w >> (32 - s)), w &= 0xffffffffUL, w += x, w &= 0xffffffffUL)
+
+// Transform the state by one 64-byte block
+static void noteMD5Transform(unsigned long buf[4], const unsigned char inraw[64])
+{
+    unsigned long in[16];
+    for (int i=0; i<16; i++) {
+        in[i] = (unsigned long) inraw[i*4] | ((unsigned long) inraw[i*4+1] << 8)
+                | ((unsigned long) inraw[i*4+2] << 16) | ((unsigned long) inraw[i*4+3] << 24);
+    }
+    unsigned long a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    MD5_STEP(MD5_F1, a, b, c, d, in[0] + 0xd76aa478, 7);
+    MD5_STEP(MD5_F1, d, a, b, c, in[1] + 0xe8c7b756, 12);
+    MD5_STEP(MD5_F1, c, d, a, b, in[2] + 0x242070db, 17);
+    MD5_STEP(MD5_F1, b, c, d, a, in[3] + 0xc1bdceee, 22);
+    MD5_STEP(MD5_F1, a, b, c, d, in[4] + 0xf57c0faf, 7);
+    MD5_STEP(MD5_F1, d, a, b, c, in[5] + 0x4787c62a, 12);
+    MD5_STEP(MD5_F1, c, d, a, b, in[6] + 0xa8304613, 17);
+    MD5_STEP(MD5_F1, b, c, d, a, in[7] + 0xfd469501, 22);
+    MD5_STEP(MD5_F1, a, b, c, d, in[8] + 0x698098d8, 7);
+    MD5_STEP(MD5_F1, d, a, b, c, in[9] + 0x8b44f7af, 12);
+    MD5_STEP(MD5_F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
+    MD5_STEP(MD5_F1, b, c, d, a, in[11] + 0x895cd7be, 22);
+    MD5_STEP(MD5_F1, a, b, c, d, in[12] + 0x6b901122, 7);
+    MD5_STEP(MD5_F1, d, a, b, c, in[13] + 0xfd987193, 12);
+    MD5_STEP(MD5_F1, c, d, a, b, in[14] + 0xa679438e, 17);
+    MD5_STEP(MD5_F1, b, c, d, a, in[15] + 0x49b40821, 22);
+
+    MD5_STEP(MD5_F2, a, b, c, d, in[1] + 0xf61e2562, 5);
+    MD5_STEP(MD5_F2, d, a, b, c, in[6] + 0xc040b340, 9);
+    MD5_STEP(MD5_F2, c, d, a, b, in[11] + 0x265e5a51, 14);
+    MD5_STEP(MD5_F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
+    MD5_STEP(MD5_F2, a, b, c, d, in[5] + 0xd62f105d, 5);
+    MD5_STEP(MD5_F2, d, a, b, c, in[10] + 0x02441453, 9);
+    MD5_STEP(MD5_F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
+    MD5_STEP(MD5_F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
+    MD5_STEP(MD5_F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
+    MD5_STEP(MD5_F2, d, a, b, c, in[14] + 0xc33707d6, 9);
+    MD5_STEP(MD5_F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
+    MD5_STEP(MD5_F2, b, c, d, a, in[8] + 0x455a14ed, 20);
+    MD5_STEP(MD5_F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
+    MD5_STEP(MD5_F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
+    MD5_STEP(MD5_F2, c, d, a, b, in[7] + 0x676f02d9, 14);
+    MD5_STEP(MD5_F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
+
+    MD5_STEP(MD5_F3, a, b, c, d, in[5] + 0xfffa3942, 4);
+    MD5_STEP(MD5_F3, d, a, b, c, in[8] + 0x8771f681, 11);
+    MD5_STEP(MD5_F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
+    MD5_STEP(MD5_F3, b, c, d, a, in[14] + 0xfde5380c, 23);
+    MD5_STEP(MD5_F3, a, b, c, d, in[1] + 0xa4beea44, 4);
+    MD5_STEP(MD5_F3, d, a, b, c, in[4] + 0x4bdecfa9, 11);
+    MD5_STEP(MD5_F3, c, d, a, b, in[7] + 0xf6bb4b60, 16);
+    MD5_STEP(MD5_F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
+    MD5_STEP(MD5_F3, a, b, c, d, in[13] + 0x289b7ec6, 4);
+    MD5_STEP(MD5_F3, d, a, b, c, in[0] + 0xeaa127fa, 11);
+    MD5_STEP(MD5_F3, c, d, a, b, in[3] + 0xd4ef3085, 16);
+    MD5_STEP(MD5_F3, b, c, d, a, in[6] + 0x04881d05, 23);
+    MD5_STEP(MD5_F3, a, b, c, d, in[9] + 0xd9d4d039, 4);
+    MD5_STEP(MD5_F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
+    MD5_STEP(MD5_F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
+    MD5_STEP(MD5_F3, b, c, d, a, in[2] + 0xc4ac5665, 23);
+
+    MD5_STEP(MD5_F4, a, b, c, d, in[0] + 0xf4292244, 6);
+    MD5_STEP(MD5_F4, d, a, b, c, in[7] + 0x432aff97, 10);
+    MD5_STEP(MD5_F4, c, d, a, b, in[14] + 0xab9423a7, 15);
+    MD5_STEP(MD5_F4, b, c, d, a, in[5] + 0xfc93a039, 21);
+    MD5_STEP(MD5_F4, a, b, c, d, in[12] + 0x655b59c3, 6);
+    MD5_STEP(MD5_F4, d, a, b, c, in[3] + 0x8f0ccc92, 10);
+    MD5_STEP(MD5_F4, c, d, a, b, in[10] + 0xffeff47d, 15);
+    MD5_STEP(MD5_F4, b, c, d, a, in[1] + 0x85845dd1, 21);
+    MD5_STEP(MD5_F4, a, b, c, d, in[8] + 0x6fa87e4f, 6);
+    MD5_STEP(MD5_F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
+    MD5_STEP(MD5_F4, c, d, a, b, in[6] + 0xa3014314, 15);
+    MD5_STEP(MD5_F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
+    MD5_STEP(MD5_F4, a, b, c, d, in[4] + 0xf7537e82, 6);
+    MD5_STEP(MD5_F4, d, a, b, c, in[11] + 0xbd3af235, 10);
+    MD5_STEP(MD5_F4, c, d, a, b, in[2] + 0x2ad7d2bb, 15);
+    MD5_STEP(MD5_F4, b, c, d, a, in[9] + 0xeb86d391, 21);
+
+    buf[0] = (buf[0] + a) & 0xffffffffUL;
+    buf[1] = (buf[1] + b) & 0xffffffffUL;
+    buf[2] = (buf[2] + c) & 0xffffffffUL;
+    buf[3] = (buf[3] + d) & 0xffffffffUL;
+}
+
+// Begin an MD5 hash
+void NoteMD5Init(NoteMD5Context *ctx)
+{
+    ctx->buf[0] = 0x67452301;
+    ctx->buf[1] = 0xefcdab89;
+    ctx->buf[2] = 0x98badcfe;
+    ctx->buf[3] = 0x10325476;
+    ctx->bits[0] = 0;
+    ctx->bits[1] = 0;
+}
+
+// Hash more data
+void NoteMD5Update(NoteMD5Context *ctx, unsigned char const *buf, unsigned long len)
+{
+    unsigned long used = (ctx->bits[0] >> 3) & 0x3f;
+    unsigned long bits = (ctx->bits[0] + (len << 3)) & 0xffffffffUL;
+    if (bits < ctx->bits[0]) {
+        ctx->bits[1]++;
+    }
+    ctx->bits[0] = bits;
+    ctx->bits[1] += len >> 29;
+    while (len > 0) {
+        unsigned long n = 64 - used;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(&ctx->in[used], buf, n);
+        used += n;
+        buf += n;
+        len -= n;
+        if (used == 64) {
+            noteMD5Transform(ctx->buf, ctx->in);
+            used = 0;
+        }
+    }
+}
+
+// Finish a hash, padding the data with its length in bits
+void NoteMD5Final(unsigned char *digest, NoteMD5Context *ctx)
+{
+    unsigned char lengthBytes[8];
+    for (int i=0; i<4; i++) {
+        lengthBytes[i] = (unsigned char) (ctx->bits[0] >> (i*8));
+        lengthBytes[i+4] = (unsigned char) (ctx->bits[1] >> (i*8));
+    }
+    static const unsigned char pad[64] = { 0x80 };
+    unsigned long used = (ctx->bits[0] >> 3) & 0x3f;
+    NoteMD5Update(ctx, pad, (used < 56) ? (56 - used) : (120 - used));
+    NoteMD5Update(ctx, lengthBytes, 8);
+    for (int i=0; i<4; i++) {
+        for (int j=0; j<4; j++) {
+            digest[i*4+j] = (unsigned char) (ctx->buf[i] >> (j*8));
+        }
+    }
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+// Format a hash as hex
+void NoteMD5HashToString(unsigned char *hash, char *strbuf, unsigned long buflen)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned long i;
+    for (i=0; i<NOTE_MD5_HASH_SIZE && (i*2)+2 < buflen; i++) {
+        strbuf[i*2] = hex[hash[i] >> 4];
+        strbuf[i*2+1] = hex[hash[i] & 0x0f];
+    }
+    if (buflen > 0) {
+        strbuf[i*2] = '\0';
+    }
+}
+
+// Hash data and format the hash as hex
+void NoteMD5HashString(unsigned char *data, unsigned long len, char *strbuf, unsigned long buflen)
+{
+    NoteMD5Context ctx;
+    unsigned char hash[NOTE_MD5_HASH_SIZE];
+    NoteMD5Init(&ctx);
+    NoteMD5Update(&ctx, data, len);
+    NoteMD5Final(hash, &ctx);
+    NoteMD5HashToString(hash, strbuf, buflen);
+}
@@ -0,0 +1,510 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// The radio driver of radio.c, implemented on the driver's model of the airwaves rather than
+// the SUBGHZ peripheral.  As in radio.c, the timeouts of a transmit and of a single receive
+// are software timers in the node, so that a timeout that fires as a frame arrives is handled
+// just as it is on the device, and the radio's interrupts arrive through simNodeRadio().
+
+#include "main.h"
+#include "radio.h"
+#include "radio_driver.h"
+#include "stm32_timer.h"
+#include "sim.h"
+
+// Radio state
+static RadioEvents_t *radioEvents = NULL;
+static RadioState_t radioState = RF_IDLE;
+static simModemConfig txConfig;
+static simModemConfig rxConfig;
+static bool rxContinuous = false;
+static uint32_t txTimeoutMs = 0;
+static uint8_t cadSymbols = 1;
+static uint8_t maxPayloadLength[2] = { 255, 255 };
+static uint8_t syncWordRegisters[2] = { 0x14, 0x24 };
+static UTIL_TIMER_Object_t txTimeoutTimer;
+static UTIL_TIMER_Object_t rxTimeoutTimer;
+
+// Forwards
+static void RadioInit(RadioEvents_t *events);
+static RadioState_t RadioGetStatus(void);
+static void RadioSetModem(RadioModems_t modem);
+static void RadioSetChannel(uint32_t freq);
+static bool RadioIsChannelFree(uint32_t freq, uint32_t rxBandwidth, int16_t rssiThresh, uint32_t maxCarrierSenseTime);
+static uint32_t RadioRandom(void);
+static void RadioSetRxConfig(RadioModems_t modem, uint32_t bandwidth, uint32_t datarate, uint8_t coderate,
+                             uint32_t bandwidthAfc, uint16_t preambleLen, uint16_t symbTimeout, bool fixLen,
+                             uint8_t payloadLen, bool crcOn, bool freqHopOn, uint8_t hopPeriod, bool iqInverted,
+                             bool rxContinuous);
+static void RadioSetTxConfig(RadioModems_t modem, int8_t power, uint32_t fdev, uint32_t bandwidth,
+                             uint32_t datarate, uint8_t coderate, uint16_t preambleLen, bool fixLen, bool crcOn,
+                             bool freqHopOn, uint8_t hopPeriod, bool iqInverted, uint32_t timeout);
+static bool RadioCheckRfFrequency(uint32_t frequency);
+static uint32_t RadioTimeOnAir(RadioModems_t modem, uint32_t bandwidth, uint32_t datarate, uint8_t coderate,
+                               uint16_t preambleLen, bool fixLen, uint8_t payloadLen, bool crcOn);
+static void RadioSend(uint8_t *buffer, uint8_t size);
+static void RadioSleep(void);
+static void RadioDeepSleep(void);
+static void RadioStandby(void);
+static void RadioRx(uint32_t timeout);
+static void RadioStartCad(void);
+static void RadioSetTxContinuousWave(uint32_t freq, int8_t power, uint16_t time);
+static int16_t RadioRssi(RadioModems_t modem);
+static void RadioWrite(uint16_t addr, uint8_t data);
+static uint8_t RadioRead(uint16_t addr);
+static void RadioWriteRegisters(uint16_t addr, uint8_t *buffer, uint8_t size);
+static void RadioReadRegisters(uint16_t addr, uint8_t *buffer, uint8_t size);
+static void RadioSetMaxPayloadLength(RadioModems_t modem, uint8_t max);
+static void RadioSetPublicNetwork(bool enable);
+static uint32_t RadioGetWakeupTime(void);
+static void RadioIrqProcess(void);
+static void RadioRxBoosted(uint32_t timeout);
+static void RadioSetRxDutyCycle(uint32_t rxTime, uint32_t sleepTime);
+static void RadioTxPrbs(void);
+static void RadioTxCw(int8_t power);
+static int32_t RadioSetRxGenericConfig(GenericModems_t modem, RxConfigGeneric_t *config, uint32_t rxContinuous, uint32_t symbTimeout);
+static int32_t RadioSetTxGenericConfig(GenericModems_t modem, TxConfigGeneric_t *config, int8_t power, uint32_t timeout);
+static void RadioDeInit(void);
+static void RadioOnTxTimeoutIrq(void *context);
+static void RadioOnRxTimeoutIrq(void *context);
+static void RadioStopTimers(void);
+
+// Radio driver structure initialization, in the order of struct Radio_s
+const struct Radio_s Radio = {
+    RadioInit,
+    RadioGetStatus,
+    RadioSetModem,
+    RadioSetChannel,
+    RadioIsChannelFree,
+    RadioRandom,
+    RadioSetRxConfig,
+    RadioSetTxConfig,
+    RadioCheckRfFrequency,
+    RadioTimeOnAir,
+    RadioSend,
+    RadioSleep,
+    RadioStandby,
+    RadioRx,
+    RadioStartCad,
+    RadioSetTxContinuousWave,
+    RadioRssi,
+    RadioWrite,
+    RadioRead,
+    RadioWriteRegisters,
+    RadioReadRegisters,
+    RadioSetMaxPayloadLength,
+    RadioSetPublicNetwork,
+    RadioGetWakeupTime,
+    RadioIrqProcess,
+    RadioRxBoosted,
+    RadioSetRxDutyCycle,
+    RadioTxPrbs,
+    RadioTxCw,
+    RadioSetRxGenericConfig,
+    RadioSetTxGenericConfig,
+    RadioDeInit,
+    RadioDeepSleep,
+};
+
+// Initialize the radio, leaving it in standby
+static void RadioInit(RadioEvents_t *events)
+{
+    radioEvents = events;
+    UTIL_TIMER_Create(&txTimeoutTimer, 0xFFFFFFFFU, UTIL_TIMER_ONESHOT, RadioOnTxTimeoutIrq, NULL);
+    UTIL_TIMER_Create(&rxTimeoutTimer, 0xFFFFFFFFU, UTIL_TIMER_ONESHOT, RadioOnRxTimeoutIrq, NULL);
+    RadioStandby();
+}
+
+// Get the radio's state
+static RadioState_t RadioGetStatus(void)
+{
+    return radioState;
+}
+
+// Select the modem for both transmit and receive
+static void RadioSetModem(RadioModems_t modem)
+{
+    txConfig.modem = (uint8_t) modem;
+    rxConfig.modem = (uint8_t) modem;
+    simAirSetTxConfig(&txConfig);
+    simAirSetRxConfig(&rxConfig);
+}
+
+// Tune the radio
+static void RadioSetChannel(uint32_t freq)
+{
+    simAirSetChannel(freq);
+}
+
+// Carrier sense isn't used by the firmware, so the channel is always reported free
+static bool RadioIsChannelFree(uint32_t freq, uint32_t rxBandwidth, int16_t rssiThresh, uint32_t maxCarrierSenseTime)
+{
+    return true;
+}
+
+// Get a random number, which on the device is taken from wideband noise
+static uint32_t RadioRandom(void)
+{
+    return MY_Random();
+}
+
+// Set the receive configuration
+static void RadioSetRxConfig(RadioModems_t modem, uint32_t bandwidth, uint32_t datarate, uint8_t coderate,
+                             uint32_t bandwidthAfc, uint16_t preambleLen, uint16_t symbTimeout, bool fixLen,
+                             uint8_t payloadLen, bool crcOn, bool freqHopOn, uint8_t hopPeriod, bool iqInverted,
+                             bool continuous)
+{
+    rxConfig.modem = (uint8_t) modem;
+    rxConfig.bandwidth = (modem == MODEM_LORA) ? (uint8_t) bandwidth : 0;
+    rxConfig.datarate = datarate;
+    rxConfig.coderate = coderate;
+    rxConfig.preambleLen = preambleLen;
+    rxConfig.fixLen = fixLen;
+    rxConfig.payloadLen = payloadLen;
+    rxConfig.crcOn = crcOn;
+    rxConfig.iqInverted = iqInverted;
+    rxContinuous = continuous;
+    simAirSetRxConfig(&rxConfig);
+}
+
+// Set the transmit configuration
+static void RadioSetTxConfig(RadioModems_t modem, int8_t power, uint32_t fdev, uint32_t bandwidth,
+                             uint32_t datarate, uint8_t coderate, uint16_t preambleLen, bool fixLen, bool crcOn,
+                             bool freqHopOn, uint8_t hopPeriod, bool iqInverted, uint32_t timeout)
+{
+    txConfig.modem = (uint8_t) modem;
+    txConfig.bandwidth = (modem == MODEM_LORA) ? (uint8_t) bandwidth : 0;
+    txConfig.datarate = datarate;
+    txConfig.coderate = coderate;
+    txConfig.preambleLen = preambleLen;
+    txConfig.fixLen = fixLen;
+    txConfig.crcOn = crcOn;
+    txConfig.iqInverted = iqInverted;
+    txConfig.power = power;
+    txTimeoutMs = timeout;
+    simAirSetTxConfig(&txConfig);
+}
+
+// Every frequency is supported
+static bool RadioCheckRfFrequency(uint32_t frequency)
+{
+    return true;
+}
+
+// Compute the time on air of a packet, rounded up to the millisecond as radio.c does
+static uint32_t RadioTimeOnAir(RadioModems_t modem, uint32_t bandwidth, uint32_t datarate, uint8_t coderate,
+                               uint16_t preambleLen, bool fixLen, uint8_t payloadLen, bool crcOn)
+{
+    simModemConfig config = {0};
+    config.modem = (uint8_t) modem;
+    config.bandwidth = (modem == MODEM_LORA) ? (uint8_t) bandwidth : 0;
+    config.datarate = datarate;
+    config.coderate = coderate;
+    config.preambleLen = preambleLen;
+    config.fixLen = fixLen;
+    config.crcOn = crcOn;
+    return (simAirTimeOnAirUs(&config, payloadLen) + 999) / 1000;
+}
+
+// Transmit, timing out in software if the transmit doesn't complete
+static void RadioSend(uint8_t *buffer, uint8_t size)
+{
+    RadioStopTimers();
+    RBI_ConfigRFSwitch((txConfig.power > 15) ? RBI_SWITCH_RFO_HP : RBI_SWITCH_RFO_LP);
+    radioState = RF_TX_RUNNING;
+    if (txTimeoutMs != 0) {
+        UTIL_TIMER_SetPeriod(&txTimeoutTimer, txTimeoutMs);
+        UTIL_TIMER_Start(&txTimeoutTimer);
+    }
+    simAirSend(buffer, size);
+}
+
+// Put the radio to sleep, which abandons whatever it is doing
+static void RadioSleep(void)
+{
+    RadioStopTimers();
+    radioState = RF_IDLE;
+    simAirSleep();
+}
+
+// Put the radio into its deepest sleep, which here is no different from sleep
+static void RadioDeepSleep(void)
+{
+    RadioSleep();
+}
+
+// Put the radio into standby, which abandons whatever it is doing
+static void RadioStandby(void)
+{
+    RadioStopTimers();
+    radioState = RF_IDLE;
+    simAirStandby();
+}
+
+// Receive, continuously if so configured, and timing out in software after the given
+// number of milliseconds unless that is 0
+static void RadioRx(uint32_t timeout)
+{
+    RadioStopTimers();
+    RBI_ConfigRFSwitch(RBI_SWITCH_RX);
+    radioState = RF_RX_RUNNING;
+    if (timeout != 0) {
+        UTIL_TIMER_SetPeriod(&rxTimeoutTimer, timeout);
+        UTIL_TIMER_Start(&rxTimeoutTimer);
+    }
+    simAirRx(rxContinuous);
+}
+
+// Sample the channel for a preamble, for the number of symbols last given to SUBGRF_SetCadParams()
+static void RadioStartCad(void)
+{
+    RadioStopTimers();
+    radioState = RF_CAD;
+    simAirCad(cadSymbols);
+}
+
+// Test modes aren't simulated
+static void RadioSetTxContinuousWave(uint32_t freq, int8_t power, uint16_t time)
+{
+}
+
+// Get the instantaneous RSSI
+static int16_t RadioRssi(RadioModems_t modem)
+{
+    return simAirRssi();
+}
+
+// Write a register, of which only the LoRa sync word matters to the airwaves
+static void RadioWrite(uint16_t addr, uint8_t data)
+{
+    SUBGRF_WriteRegister(addr, data);
+}
+
+// Read a register
+static uint8_t RadioRead(uint16_t addr)
+{
+    if (addr == REG_LR_SYNCWORD || addr == REG_LR_SYNCWORD + 1) {
+        return syncWordRegisters[addr - REG_LR_SYNCWORD];
+    }
+    return 0;
+}
+
+// Write consecutive registers
+static void RadioWriteRegisters(uint16_t addr, uint8_t *buffer, uint8_t size)
+{
+    for (uint8_t i=0; i<size; i++) {
+        SUBGRF_WriteRegister(addr + i, buffer[i]);
+    }
+}
+
+// Read consecutive registers
+static void RadioReadRegisters(uint16_t addr, uint8_t *buffer, uint8_t size)
+{
+    for (uint8_t i=0; i<size; i++) {
+        buffer[i] = RadioRead(addr + i);
+    }
+}
+
+// Set the largest payload that the receiver accepts
+static void RadioSetMaxPayloadLength(RadioModems_t modem, uint8_t max)
+{
+    maxPayloadLength[(modem == MODEM_LORA) ? 1 : 0] = max;
+}
+
+// The public network sync word isn't used by the firmware
+static void RadioSetPublicNetwork(bool enable)
+{
+}
+
+// Get the time that the radio takes to wake, as radio.c computes it
+static uint32_t RadioGetWakeupTime(void)
+{
+    return SUBGRF_GetRadioWakeUpTime() + RADIO_WAKEUP_TIME;
+}
+
+// Interrupts are delivered by simNodeRadio() rather than processed here
+static void RadioIrqProcess(void)
+{
+}
+
+// Receive with boosted gain, which the simulation doesn't distinguish
+static void RadioRxBoosted(uint32_t timeout)
+{
+    RadioRx(timeout);
+}
+
+// Receive in duty-cycled mode, with times in units of 15.625us
+static void RadioSetRxDutyCycle(uint32_t rxTime, uint32_t sleepTime)
+{
+    RadioStopTimers();
+    RBI_ConfigRFSwitch(RBI_SWITCH_RX);
+    radioState = RF_RX_RUNNING;
+    simAirRxDutyCycle((rxTime * 1000) / 64, (sleepTime * 1000) / 64);
+}
+
+// Test modes aren't simulated
+static void RadioTxPrbs(void)
+{
+}
+
+// Test modes aren't simulated
+static void RadioTxCw(int8_t power)
+{
+}
+
+// The generic configuration interface isn't used by the firmware
+static int32_t RadioSetRxGenericConfig(GenericModems_t modem, RxConfigGeneric_t *config, uint32_t continuous, uint32_t symbTimeout)
+{
+    return -1;
+}
+
+// The generic configuration interface isn't used by the firmware
+static int32_t RadioSetTxGenericConfig(GenericModems_t modem, TxConfigGeneric_t *config, int8_t power, uint32_t timeout)
+{
+    return -1;
+}
+
+// De-initialize the radio, which loses its configuration
+static void RadioDeInit(void)
+{
+    RadioSleep();
+}
+
+// Software timeout of a transmit
+static void RadioOnTxTimeoutIrq(void *context)
+{
+    radioState = RF_IDLE;
+    simAirStandby();
+    if (radioEvents != NULL && radioEvents->TxTimeout != NULL) {
+        radioEvents->TxTimeout();
+    }
+}
+
+// Software timeout of a receive
+static void RadioOnRxTimeoutIrq(void *context)
+{
+    radioState = RF_IDLE;
+    simAirStandby();
+    if (radioEvents != NULL && radioEvents->RxTimeout != NULL) {
+        radioEvents->RxTimeout();
+    }
+}
+
+// Stop the software timeouts
+static void RadioStopTimers(void)
+{
+    UTIL_TIMER_Stop(&txTimeoutTimer);
+    UTIL_TIMER_Stop(&rxTimeoutTimer);
+}
+
+// Radio interrupt, called by the driver.  As on the device, a single receive or a CAD puts
+// the radio into standby when it completes, while a continuous receive carries on.
+void simNodeRadio(int irq, const uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr)
+{
+    if (radioEvents == NULL) {
+        return;
+    }
+    switch (irq) {
+
+    case SIM_IRQ_TX_DONE:
+        UTIL_TIMER_Stop(&txTimeoutTimer);
+        radioState = RF_IDLE;
+        if (radioEvents->TxDone != NULL) {
+            radioEvents->TxDone();
+        }
+        break;
+
+    case SIM_IRQ_TX_TIMEOUT:
+        UTIL_TIMER_Stop(&txTimeoutTimer);
+        radioState = RF_IDLE;
+        if (radioEvents->TxTimeout != NULL) {
+            radioEvents->TxTimeout();
+        }
+        break;
+
+    case SIM_IRQ_RX_DONE:
+        UTIL_TIMER_Stop(&rxTimeoutTimer);
+        if (!rxContinuous) {
+            radioState = RF_IDLE;
+        }
+        if (size > maxPayloadLength[(rxConfig.modem == MODEM_LORA) ? 1 : 0]) {
+            if (radioEvents->RxError != NULL) {
+                radioEvents->RxError();
+            }
+            break;
+        }
+        if (radioEvents->RxDone != NULL) {
+            radioEvents->RxDone((uint8_t *) payload, size, rssi, snr);
+        }
+        break;
+
+    case SIM_IRQ_RX_TIMEOUT:
+        UTIL_TIMER_Stop(&rxTimeoutTimer);
+        if (!rxContinuous) {
+            radioState = RF_IDLE;
+        }
+        if (radioEvents->RxTimeout != NULL) {
+            radioEvents->RxTimeout();
+        }
+        break;
+
+    case SIM_IRQ_RX_ERROR:
+        UTIL_TIMER_Stop(&rxTimeoutTimer);
+        if (!rxContinuous) {
+            radioState = RF_IDLE;
+        }
+        if (radioEvents->RxError != NULL) {
+            radioEvents->RxError();
+        }
+        break;
+
+    case SIM_IRQ_CAD_CLEAR:
+    case SIM_IRQ_CAD_DETECTED:
+        radioState = RF_IDLE;
+        if (radioEvents->CadDone != NULL) {
+            radioEvents->CadDone(irq == SIM_IRQ_CAD_DETECTED);
+        }
+        break;
+
+    }
+}
+
+// Set the number of symbols that a CAD samples
+void SUBGRF_SetCadParams(RadioLoRaCadSymbols_t cadSymbolNum, uint8_t cadDetPeak, uint8_t cadDetMin, RadioCadExitModes_t cadExitMode, uint32_t cadTimeout)
+{
+    cadSymbols = (uint8_t) (1 << cadSymbolNum);
+}
+
+// Select the PA, whose settings don't affect the airwaves beyond the power that's configured
+void SUBGRF_SetPaConfig(uint8_t paDutyCycle, uint8_t hpMax, uint8_t deviceSel, uint8_t paLut)
+{
+}
+
+// Set the transmit power without the rest of the transmit configuration
+uint8_t SUBGRF_SetRfTxPower(int8_t power)
+{
+    txConfig.power = power;
+    simAirSetTxConfig(&txConfig);
+    return (power > 15) ? RFO_HP : RFO_LP;
+}
+
+// Write a register, of which only the LoRa sync word matters to the airwaves
+void SUBGRF_WriteRegister(uint16_t address, uint8_t data)
+{
+    if (address == REG_LR_SYNCWORD || address == REG_LR_SYNCWORD + 1) {
+        syncWordRegisters[address - REG_LR_SYNCWORD] = data;
+        simAirSetSyncWord((uint16_t) ((syncWordRegisters[0] << 8) | syncWordRegisters[1]));
+    }
+}
+
+// Interrupt routing, which the simulation doesn't need
+void SUBGRF_SetDioIrqParams(uint16_t irqMask, uint16_t dio1Mask, uint16_t dio2Mask, uint16_t dio3Mask)
+{
+}
+
+// Get the time that the TCXO takes to start
+uint32_t SUBGRF_GetRadioWakeUpTime(void)
+{
+    return (uint32_t) RBI_GetWakeUpTime();
+}
@@ -0,0 +1,183 @@
+// Copyright 2022 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// The timer interface of timer_if.c, implemented on the driver's virtual clock rather than
+// the RTC.  The clock ticks at the RTC's 1024 Hz, and its single alarm is what the timer
+// server in stm32_timer.c runs on, so the firmware's timers behave as they do on the device.
+// Delays yield to the driver, which lets the interrupts that are due in the meantime run.
+
+#include "main.h"
+#include "timer_if.h"
+#include "sim.h"
+
+// Timer driver callbacks handler
+const UTIL_TIMER_Driver_s UTIL_TimerDriver = {
+    TIMER_IF_Init,
+    NULL,
+
+    TIMER_IF_StartTimer,
+    TIMER_IF_StopTimer,
+
+    TIMER_IF_SetTimerContext,
+    TIMER_IF_GetTimerContext,
+
+    TIMER_IF_GetTimerElapsedTime,
+    TIMER_IF_GetTimerValue,
+    TIMER_IF_GetMinimumTimeout,
+
+    TIMER_IF_Convert_ms2Tick,
+    TIMER_IF_Convert_Tick2ms,
+};
+
+//  SysTime driver callbacks handler
+const UTIL_SYSTIM_Driver_s UTIL_SYSTIMDriver = {
+    TIMER_IF_BkUp_Write_Seconds,
+    TIMER_IF_BkUp_Read_Seconds,
+    TIMER_IF_BkUp_Write_SubSeconds,
+    TIMER_IF_BkUp_Read_SubSeconds,
+    TIMER_IF_GetTime,
+};
+
+// Minimum timeout delay of Alarm in ticks
+#define MIN_ALARM_DELAY    3
+
+// Backup registers
+#define RTC_BKP_SECONDS    RTC_BKP_DR0
+#define RTC_BKP_SUBSECONDS RTC_BKP_DR1
+
+// Timer context
+static uint32_t RtcTimerContext = 0;
+
+// Init timer interface
+UTIL_TIMER_Status_t TIMER_IF_Init(void)
+{
+    TIMER_IF_StopTimer();
+    TIMER_IF_SetTimerContext();
+    return UTIL_TIMER_OK;
+}
+
+// Start the timer, whose alarm fires at once if its time has already passed
+UTIL_TIMER_Status_t TIMER_IF_StartTimer(uint32_t timeout)
+{
+    uint64_t now = simTicks();
+    uint32_t elapsed = (uint32_t) now - RtcTimerContext;
+    uint64_t due = (timeout > elapsed) ? now + (timeout - elapsed) : now;
+    simAlarmSet(due);
+    return UTIL_TIMER_OK;
+}
+
+// Stop the timer
+UTIL_TIMER_Status_t TIMER_IF_StopTimer(void)
+{
+    simAlarmCancel();
+    return UTIL_TIMER_OK;
+}
+
+// Set the timer context
+uint32_t TIMER_IF_SetTimerContext(void)
+{
+    RtcTimerContext = (uint32_t) simTicks();
+    return RtcTimerContext;
+}
+
+// Get the timer context
+uint32_t TIMER_IF_GetTimerContext(void)
+{
+    return RtcTimerContext;
+}
+
+// Get elapsed time
+uint32_t TIMER_IF_GetTimerElapsedTime(void)
+{
+    return ((uint32_t) simTicks() - RtcTimerContext);
+}
+
+// Get the current timer value
+uint32_t TIMER_IF_GetTimerValue(void)
+{
+    return (uint32_t) simTicks();
+}
+
+// Get minimum timeout
+uint32_t TIMER_IF_GetMinimumTimeout(void)
+{
+    return (MIN_ALARM_DELAY);
+}
+
+// Convert milliseconds to ticks
+uint32_t TIMER_IF_Convert_ms2Tick(uint32_t timeMilliSec)
+{
+    return ((uint32_t)((((uint64_t) timeMilliSec) << RTC_N_PREDIV_S) / 1000));
+}
+
+// Convert ticks to milliseconds
+uint32_t TIMER_IF_Convert_Tick2ms(uint32_t tick)
+{
+    return ((uint32_t)((((uint64_t)(tick)) * 1000) >> RTC_N_PREDIV_S));
+}
+
+// Delay, letting interrupts run unless they are masked
+void TIMER_IF_DelayMs(uint32_t delay)
+{
+    simDelayUs((uint64_t) delay * 1000);
+}
+
+// Alarm interrupt, called by the driver
+void simNodeAlarm(void)
+{
+    UTIL_TIMER_IRQ_Handler();
+}
+
+// Get the time in seconds
+uint32_t TIMER_IF_GetTime(uint16_t *mSeconds)
+{
+    uint64_t ticks = simTicks();
+    *mSeconds = TIMER_IF_Convert_Tick2ms((uint32_t) (ticks & RTC_PREDIV_S));
+    return (uint32_t) (ticks >> RTC_N_PREDIV_S);
+}
+
+// Get the time in milliseconds
+int64_t TIMER_IF_GetTimeMs()
+{
+    uint16_t msec;
+    int64_t result = TIMER_IF_GetTime(&msec);
+    result = (result * 1000LL) + (msec % 1000);
+    return result;
+}
+
+// Write the backup register with seconds
+void TIMER_IF_BkUp_Write_Seconds(uint32_t Seconds)
+{
+    HAL_RTCEx_BKUPWrite(&hrtc, RTC_BKP_SECONDS, Seconds);
+}
+
+// Write the backup register with subseconds
+void TIMER_IF_BkUp_Write_SubSeconds(uint32_t SubSeconds)
+{
+    HAL_RTCEx_BKUPWrite(&hrtc, RTC_BKP_SUBSECONDS, SubSeconds);
+}
+
+// Read seconds from backup
+uint32_t TIMER_IF_BkUp_Read_Seconds(void)
+{
+    return HAL_RTCEx_BKUPRead(&hrtc, RTC_BKP_SECONDS);
+}
+
+// Read subseconds from backup
+uint32_t TIMER_IF_BkUp_Read_SubSeconds(void)
+{
+    return HAL_RTCEx_BKUPRead(&hrtc, RTC_BKP_SUBSECONDS);
+}
+
+// Provide a tick value, which like the device's is the RTC's
+uint32_t HAL_GetTick(void)
+{
+    return TIMER_IF_GetTimerValue();
+}
+
+// This function provides delay (in ms)
+void HAL_Delay(__IO uint32_t Delay)
+{
+    TIMER_IF_DelayMs(Delay);
+}
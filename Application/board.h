@@ -107,6 +107,18 @@
 #define SPI1_TX_DMA_IRQn                DMA2_Channel2_IRQn
 #define SPI1_TX_DMA_IRQHandler          DMA2_Channel2_IRQHandler
 
+// AES
+#define AES_IN_DMA_Channel              DMA2_Channel3
+#define AES_IN_DMA_IRQn                 DMA2_Channel3_IRQn
+#define AES_IN_DMA_IRQHandler           DMA2_Channel3_IRQHandler
+#define AES_OUT_DMA_Channel             DMA2_Channel4
+#define AES_OUT_DMA_IRQn                DMA2_Channel4_IRQn
+#define AES_OUT_DMA_IRQHandler          DMA2_Channel4_IRQHandler
+
+// SUBGHZ radio buffer, whose DMA is polled rather than interrupting
+#define SUBGHZSPI_RX_DMA_Channel        DMA2_Channel5
+#define SUBGHZSPI_TX_DMA_Channel        DMA2_Channel6
+
 // I2C2 --  Note that on the UFQFPN48 package, SCL is only available on PA12.
 // This prevents any possible use of RF_BUSY, which is ONLY available on PA12.
 #define I2C2_SDA_Pin                    GPIO_PIN_11         // PA11
@@ -127,6 +139,10 @@
 #define ADC_DMA_IRQn                    DMA1_Channel7_IRQn
 #define ADC_DMA_IRQHandler              DMA1_Channel7_IRQHandler
 
+// The timer whose update event paces the conversions of a streaming ADC channel
+#define ADC_STREAM_TIM                  TIM2
+#define ADC_STREAM_TRIGGER              ADC_EXTERNALTRIG_T2_TRGO
+
 #define VREFINT_ADC_Channel             ADC_CHANNEL_VREFINT
 #define VREFINT_ADC_RankIndex           0                   // VREFINT will always be first
 #define VREFINT_ADC_Rank                ADC_REGULAR_RANK_1
@@ -173,8 +189,8 @@
 #define ADC_TOTAL                       (2 + count_A1 + count_A2 + count_A3)
 #define ADC_COUNT                       (ADC_TOTAL-1)       // # of usable ADCs without VREFINT
 
-// USART1
-#define USART1_BAUDRATE                 115200
+// USART1, which carries the gateway's wired uplink, if it's used
+#define USART1_BAUDRATE                 460800
 #define USART1_TX_Pin                   GPIO_PIN_6          // PB6
 #define USART1_TX_GPIO_Port             GPIOB
 #define USART1_RX_Pin                   GPIO_PIN_7          // PB7
@@ -226,6 +242,16 @@
 #define PIR_DIRECT_LINK_EXTI_IRQn       EXTI9_5_IRQn
 #define PIR_DIRECT_LINK_IT_PRIORITY     15
 
+// Notecard ATTN, where a gateway has it wired to an input.  The reference boards leave it
+// unconnected, so it's only used if NOTECARD_ATTN_ENABLED is defined, and otherwise the
+// gateway polls the Notecard for changes to the environment and to the config DB.
+#ifdef NOTECARD_ATTN_ENABLED
+#define NOTECARD_ATTN_Pin               GPIO_PIN_15         // PA15 (A3)
+#define NOTECARD_ATTN_GPIO_Port         GPIOA
+#define NOTECARD_ATTN_EXTI_IRQn         EXTI15_10_IRQn
+#define NOTECARD_ATTN_IT_PRIORITY       15
+#endif
+
 // BME Power Pin - powering peripherals on a switched i2c bus
 #define BME_POWER_Pin                   GPIO_PIN_5          // PA5
 #define BME_POWER_GPIO_Port             GPIOA
@@ -377,3 +403,5 @@
 #ifdef USE_SPARROW
 #define BATMON_ADJUSTMENT   3           // Multiplier for RP605Z333B used by Sparrow
 #endif
+#define BATMON_SETTLE_MS    10          // BAT MON settling after it is powered by the LED
+#define ADC_TIMEOUT_MS      10          // The whole sequence converts in well under this
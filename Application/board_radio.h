@@ -35,6 +35,21 @@
 // Number of transmit power levels
 #define RBO_LEVELS                          (((RBO_MAX)-(RBO_MIN))+1)
 
+// PA settings characterized for this board, which replace the driver's generic ones.  Each
+// entry is the output in dBm, whether it's the HP PA, paDutyCycle, hpMax, the power register,
+// and the typical supply current in mA, per the STM32WL's optimal PA settings.  A level is sent
+// with the lowest-current entry of its PA that delivers at least that level, its power register
+// lowered by the difference.  Remove the table to use the driver's settings.
+#define RBI_PA_TABLE { \
+    { 10, false, 0x01, 0x00, 13,  15 }, \
+    { 14, false, 0x04, 0x00, 14,  21 }, \
+    { 15, false, 0x07, 0x00, 14,  25 }, \
+    { 14, true,  0x02, 0x02, 22,  85 }, \
+    { 17, true,  0x02, 0x03, 22,  95 }, \
+    { 20, true,  0x03, 0x05, 22, 102 }, \
+    { 22, true,  0x04, 0x07, 22, 118 }, \
+}
+
 // Radio maximum wakeup time (in ms)
 #define RF_WAKEUP_TIME                     10U
 
@@ -24,8 +24,26 @@
 #define NOTECARD_INBOUND_PERIOD_MINS        (60*24)
 #endif
 
-// Configuration database
+// When hub_adaptive is set, as it would be on a battery or solar gateway, the mode above is
+// adapted to the load every NOTECARD_ADAPTIVE_CHECK_MINS.  The Notecard is continuous for
+// NOTECARD_ADAPTIVE_URGENT_MINS after a sensor's note asks to be synced, or while at least
+// NOTECARD_ADAPTIVE_CONTINUOUS_NOTES are queued, and otherwise periodic, its outbound period
+// halved from the maximum for each NOTECARD_ADAPTIVE_NOTES_PER_HALVING queued and its inbound
+// period that many times longer.  While periodic, env and config DB changes arrive later.
+#define NOTECARD_ADAPTIVE_CHECK_MINS        5
+#define NOTECARD_ADAPTIVE_URGENT_MINS       10
+#define NOTECARD_ADAPTIVE_CONTINUOUS_NOTES  50
+#define NOTECARD_ADAPTIVE_NOTES_PER_HALVING 10
+#define NOTECARD_ADAPTIVE_OUTBOUND_MAX_MINS 60
+#define NOTECARD_ADAPTIVE_OUTBOUND_MIN_MINS 5
+#define NOTECARD_ADAPTIVE_INBOUND_FACTOR    4
+
+// Configuration database.  The gateway reads only the notes that changed since its last pass,
+// through a change tracker of this name kept by the Notecard, and at most this many per
+// transaction so that each is short enough to fit between the windows of the sensors.
 #define CONFIGDB                            "config.db"
+#define CONFIGDB_TRACKER                    "sparrow-gateway"
+#define CONFIGDB_CHANGES_MAX                8
 
 // Sensor database
 #define SENSORDB                            "sensors.db"
@@ -40,14 +58,21 @@
 #define SENSORDB_FIELD_SENSOR_SNR           "sensor_snr"
 #define SENSORDB_FIELD_SENSOR_TXP           "sensor_txp"
 #define SENSORDB_FIELD_SENSOR_LTP           "sensor_ltp"
+#define SENSORDB_FIELD_LATENCY_P50          "latency_p50_ms"
+#define SENSORDB_FIELD_LATENCY_P90          "latency_p90_ms"
+#define SENSORDB_FIELD_LATENCY_MAX          "latency_max_ms"
 
-// Amount of time that we should assume that it takes to transmit a request, process it,
-// and receive the response, given the type of application running on the sensors.  If,
-// for example, many requests or responses are desirable within a given time window,
-// then this can be made large.  The downside of making this smaller is that a given
-// node will "step on top of" the next sensor's window.  However, sensors do a
-// listen-before-talk, which mitigates this to a certain extent.
-#define RADIO_TIME_WINDOW_SECS                          (17)
+// Number of exchanges that should fit within a sensor's time window, given the type of
+// application running on the sensors.  An exchange is a full-size request chunk and its ACK
+// at the default spreading factor, with the turnaround allowance before each and a margin
+// for processing and for the error in the sensors' clocks, which are synchronized to the
+// gateway's to the millisecond, so the window length follows from the radio parameters.  If, for example,
+// many requests or responses are desirable within a given time window, then this can be
+// made large.  The downside of making this smaller is that a given node will "step on top
+// of" the next sensor's window.  However, sensors do a listen-before-talk, which mitigates
+// this to a certain extent.
+#define RADIO_TIME_WINDOW_EXCHANGES                     2
+#define RADIO_TIME_WINDOW_MARGIN_MS                     250
 
 // The very nature of our protocol is that every message sent from the sensor to the
 // gateway, and from the gateway to the sensor, is ACK'ed.  Unfortunately, some
@@ -61,17 +86,223 @@
 // The number of times we'll retry a request upon some kind of failure
 #define GATEWAY_REQUEST_FAILURE_RETRIES                 5
 
-// Environment variables
+// Requests that don't require a response are held in a bounded queue on the sensor and
+// sent to the gateway together as a single JSON array, so that several notes generated
+// while waiting for a transmit window share that one window.
+#define SENSOR_QUEUE_MAX_REQUESTS                       8
+#define SENSOR_QUEUE_MAX_BATCH_BYTES                    1024
+
+// Low-priority requests that don't require a response are held back for up to this long so
+// that they are batched with whatever is sent next, unless the queue fills first
+#define SENSOR_LOW_PRIORITY_DEFER_SECS                  (15*60)
+
+// Once an exchange within our transmit window has completed, requests queued behind it are
+// sent in the same window for as long as what remains of it would fit another exchange,
+// judging by how long exchanges have been taking, rather than each waiting for the next.
+#define SENSOR_SLOT_CHAINING                            true
+
+// Requests that don't require a response, which the gateway couldn't be reached to deliver,
+// are kept in flash rather than dropped, and drained in batches once it can be reached again.
+// Meanwhile, any further such request is tried once before joining them, without retries.
+#define SENSOR_STORE_AND_FORWARD                        true
+
+// Each request is prefixed with how long ago the sensor created it, in ms and as of the moment
+// its first chunk is sent, so that the gateway can tell how long it took from its creation to
+// being accepted by the Notecard: queueing, the wait for the slot, airtime, retries and the
+// Notecard itself.  The percentiles of this for each sensor are kept in sensors.db.
+#define SENSOR_REQUEST_AGE                              true
+
+// Each request also carries the shortest of the activation periods of the sensor's periodic apps
+// and how long until the first of them is next due, from which the gateway keeps a calendar of
+// when each sensor is next expected.  Slots of sensors that aren't due in them are then free
+// for housekeeping, entries of sensors about to arrive are kept in the request cache, and a
+// sensor that misses the slot after it was due is flagged as late.
+#define SENSOR_ADVERTISE_SCHEDULE                       true
+
+// A mains-powered sensor built with this enabled also relays for sensors beyond the reach of
+// the gateway, as designated by the "relay" field of their notes in the gateway's config DB.
+// Between its own exchanges it listens continuously on the home channel (see relay.c).
+#define SENSOR_RELAY                                    false
+
+// The number of sensor apps that may be registered, including the framework's own
+#define SCHED_MAX_APPS                                  12
+
+// The number of sensor apps that may be active at once.  Each may have a request of its
+// own outstanding, with the sensor's request queue taking them to the gateway in turn, so
+// that a period's work is done in one awake interval.  Set to 1 to run apps one at a time.
+#define SCHED_MAX_ACTIVE_APPS                           4
+
+// Apps that declare bounds on their activation period have it stretched, by doubling for each
+// of these conditions, when the battery is low, when ATP is at its maximum power or is losing
+// packets, or when the gateway asks us to hold off.  When none of those hold and the battery is
+// good, the period is instead halved.  The period is re-evaluated as the conditions change.
+#define SCHED_ADAPT_BATTERY_GOOD_MV                     3600
+#define SCHED_ADAPT_BATTERY_LOW_MV                      3300
+#define SCHED_ADAPT_BATTERY_CRITICAL_MV                 3000
+#define SCHED_ADAPT_LOSS_PCT                            25
+#define SCHED_ADAPT_MAX_SCALE                           16
+
+// Apps that ask for it have their periodic activations moved later, by less than their period,
+// to this long before the sensor's next slot begins, so that their requests share that slot's
+// transmit window rather than each waking the radio for a slot of their own.  The lead is the
+// time that they need to take their readings.
+#define SCHED_ALIGN_WINDOW                              true
+#define SCHED_ALIGN_WINDOW_LEAD_SECS                    30
+
+// Sensor requests that don't require a response are performed against the Notecard by a
+// background task after the gateway has gone back to receiving, up to this many at once.
+// Beyond that they overflow to flash, and when a response is required, they're performed
+// as they're received.  While the Notecard is busy or unreachable, the task retries the
+// request at the head of the queue with a backoff that doubles between these bounds.
+#define GATEWAY_NOTECARD_QUEUE_MAX                      8
+#define GATEWAY_STORE_AND_FORWARD                       true
+#define GATEWAY_NOTECARD_RETRY_MIN_MS                   1000
+#define GATEWAY_NOTECARD_RETRY_MAX_MS                   60000
+
+// A Notecard transaction holds up everything else for as long as it takes, so the task
+// doesn't begin one while a sensor is in the middle of an exchange or received frames are
+// waiting, checking again this often, unless it has already held off for the longest time.
+#define GATEWAY_NOTECARD_DEFER_MS                       50
+#define GATEWAY_NOTECARD_DEFER_MAX_MS                   5000
+
+// Compact note.adds waiting in that queue, from any of the sensors, are performed together
+// in a single Notecard transaction, up to this many at once.  So that others may join it,
+// the task holds the oldest back for up to this long, unless the queue fills first.
+#define GATEWAY_NOTECARD_COALESCE_MAX                   8
+#define GATEWAY_NOTECARD_COALESCE_MS                    2000
+
+// The most recently completed requests of each sensor are remembered, so that a retry of
+// one, sent because the sensor missed our ACK or response, isn't performed again.  The
+// responses to the last few, up to a size limit, are kept so that a retry for one can be
+// answered without a Notecard round trip.
+#define GATEWAY_RECENT_REQUESTS                         3
+#define GATEWAY_RESPONSE_CACHE                          4
+#define GATEWAY_RESPONSE_CACHE_MAX_BYTES                512
+
+// The largest request that the gateway will hold for a sensor, and the largest response that
+// a sensor will hold from the gateway.  A larger one is still received and acknowledged so
+// that the exchange completes, but its data is dropped as it arrives and the requester is
+// given an error instead, so a single transfer can never take more memory than this.
+#define GATEWAY_REQUEST_MAX_BYTES                       POOL_ARENA_BYTES
+#define SENSOR_RESPONSE_MAX_BYTES                       2048
+
+// A request is admitted only while those being received or awaiting the Notecard hold no more
+// than this in all, the one arriving included, although one is always admitted when nothing
+// else is held.  A sensor whose request isn't admitted, or for which memory can't be had, is
+// told in its ACK that the gateway is busy, and begins the request again once it has held off
+// for at least this long rather than sending chunks that would only be dropped.
+#define GATEWAY_REQUEST_BUDGET_BYTES                    (POOL_ARENA_BYTES*2)
+#define GATEWAY_BUSY_RETRY_SECS                         15
+
+// The gateway snapshots its request cache and slot plan to flash this often while sensors are
+// being heard, as well as before a DFU or a restart, and takes them up again when it starts,
+// so that sensors find their slots where they were.  Each snapshot erases its flash pages,
+// which endure some 10,000 erasures, so it's taken no more than a few times a day.
+#define GATEWAY_SNAPSHOT_MINS                           240
+
+// When a sensor awaits a response, the gateway performs its request before sending the final
+// ACK, so that a response which fits within what remains of that frame can be carried in it.
+// The sensor doesn't ACK such a response, because its next request implicitly acknowledges it.
+#define GATEWAY_RESPONSE_IN_ACK                         true
+
+// Responses to sensors are squeezed with a static dictionary of Notecard JSON fragments when
+// that makes them smaller.  Sensors that speak short headers also expand squeezed responses,
+// so only those are sent them.
+#define GATEWAY_SQUEEZE_RESPONSES                       true
+
+// How long after the Notecard knows the time that the gateway waits for it to learn the time
+// zone, before giving sensors the time without it
+#define GATEWAY_BOOT_ZONE_WAIT_SECS                     30
+
+// Each sensor may begin this many requests per hour on average, in bursts of up to the
+// given number, beyond which the gateway's ACKs ask it to hold back its next request.
+// This keeps a sensor that is reporting far too often from taking airtime and Notecard
+// capacity from the rest.
+#define GATEWAY_SENSOR_REQUESTS_PER_HOUR                240
+#define GATEWAY_SENSOR_REQUEST_BURST                    8
+
+// A compact note.add whose template the gateway knows is written to the Notecard as JSON
+// text directly from its packed fields, rather than by way of a J tree.
+#define GATEWAY_FORWARD_COMPACT_NOTES                   true
+
+// A gateway with a local computer on USART1 can send the Notecard requests that it performs
+// for sensors to that computer instead, as framed records, so that throughput is limited by
+// LoRa rather than by the Notecard and its sync.  Each exchange, whose response is limited in
+// size, must complete within the timeout.  See uplink.c for the framing.
+#define GATEWAY_WIRED_UPLINK                            false
+#define GATEWAY_WIRED_TIMEOUT_MS                        1000
+#define GATEWAY_WIRED_MAX_BYTES                         1024
+
+// Environment variables.  Apps may register up to this many in total, including the
+// gateway's own, with gatewayEnvVarRegisterInt() or gatewayEnvVarRegisterString().
+#define GATEWAY_ENV_VARS_MAX                            16
+
+// Responses to sensors' env.get requests are cached, up to this many of up to this size,
+// until the Notecard reports that the environment has been modified
+#define GATEWAY_ENV_CACHE                               8
+#define GATEWAY_ENV_CACHE_MAX_BYTES                     256
+
+// Responses to sensors' note.template requests are cached, up to this many of up to this size,
+// keyed on the template and its notefile, so that a template that the Notecard already holds for
+// a notefile isn't registered with it again
+#define GATEWAY_TEMPLATE_CACHE                          16
+#define GATEWAY_TEMPLATE_CACHE_MAX_BYTES                32
 extern uint32_t var_gateway_env_update_mins;
 #define VAR_GATEWAY_ENV_UPDATE_MINS                     "env_update_mins"
 #define DEFAULT_GATEWAY_ENV_UPDATE_MINS                 (5)
 extern uint32_t var_gateway_pairing_timeout_mins;
 #define VAR_PAIRING_BEACON_GATEWAY_TIMEOUT_MINS         "pairing_timeout_mins"
 #define DEFAULT_PAIRING_BEACON_GATEWAY_TIMEOUT_MINS     (60)
+
+// Mass provisioning, in which a gateway in pairing mode answers beacons without deferring
+// to its neighbors, stays in pairing mode for as long as sensors keep pairing with it, and
+// holds the new peers in RAM until pairings pause for a while before writing them to flash
+extern uint32_t var_gateway_pairing_provision;
+#define VAR_PAIRING_PROVISION                           "pairing_provision"
+#define DEFAULT_PAIRING_PROVISION                       (0)
+#define GATEWAY_PROVISION_COMMIT_QUIET_SECS             30
+
+// Housekeeping is done a step at a time when at least this long remains before a sensor
+// is next expected to transmit, but a step is taken regardless after this long without one
+#define GATEWAY_HOUSEKEEPING_GAP_SECS                   2
+#define GATEWAY_HOUSEKEEPING_STARVE_SECS                60
+
+// A sensor that advertised its schedule is kept in the request cache from this long before it
+// is due, and is flagged as late once this long has passed since the end of the slot that
+// followed when it was due
+#define GATEWAY_CALENDAR_PREWARM_SECS                   60
+#define GATEWAY_CALENDAR_LATE_SECS                      60
+
+// Where the Notecard's ATTN is wired, the gateway arms it for changes to the environment
+// and to the config DB instead of polling for them, re-arming it this often in case the
+// Notecard has restarted since
+#define GATEWAY_ATTN_REARM_MINS                         60
 extern uint32_t var_gateway_sensordb_update_mins;
 #define VAR_GATEWAY_SENSORDB_UPDATE_MINS                "sensordb_update_mins"
 #define DEFAULT_GATEWAY_SENSORDB_UPDATE_MINS            (60)
 extern uint32_t var_gateway_sensordb_reset_counts;
 #define VAR_GATEWAY_SENSORDB_RESET_COUNTS               "sensordb_reset_counts"
 #define DEFAULT_GATEWAY_SENSORDB_RESET_COUNTS           0
+extern uint32_t var_gateway_sensor_dfu;
+#define VAR_GATEWAY_SENSOR_DFU                          "sensor_dfu"
+#define DEFAULT_GATEWAY_SENSOR_DFU                      0
+extern uint32_t var_gateway_hub_adaptive;
+#define VAR_GATEWAY_HUB_ADAPTIVE                        "hub_adaptive"
+#define DEFAULT_GATEWAY_HUB_ADAPTIVE                    0
+extern uint32_t var_gateway_pktlog_mins;
+#define VAR_GATEWAY_PKTLOG_MINS                         "pktlog_mins"
+#define DEFAULT_GATEWAY_PKTLOG_MINS                     (60)
+
+// The gateway's packet event log, which is uploaded as a single note to this notefile
+// every pktlog_mins or when the ring is three-quarters full
+#define PKTLOG_EVENTS                                   64
+#define PKTLOG_NOTEFILE                                 "pktlog.qo"
+
+// Gateway-wide statistics, which are emitted as a single templated note to this notefile
+// every sensordb_update_mins
+#define STATS_NOTEFILE                                  "_gwstats.qo"
+
+// Sensors' health records, which the gateway expands into templated notes of this notefile
+// along with what it saw of the signal of the message that carried each one
+#define HEALTH_NOTEFILE                                 "_health.qo"
 
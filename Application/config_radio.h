@@ -24,6 +24,45 @@
 // http://dev.blues.io/hardware/sparrow-datasheet#setting-a-frequency-plan
 #define RF_FREQ 0
 
+// CHANNEL PLAN
+// Offsets in Hz from the frequency selected above.  Channel 0 is the home channel, on which
+// sensors pair and on which they transmit whenever they aren't within their own slot.  The
+// gateway assigns channels to slots round-robin so that adjacent slots are on different
+// channels, tells each sensor its channel in the ACK, and while idle listens on the channel
+// of the sensor whose slot it is.  Only list channels that are legal in every region in
+// which the product is used; for example, { 0, 200000, 400000 } in US915.
+#define RADIO_CHANNEL_PLAN_HZ   { 0 }
+
+// NOISE FLOOR
+// When the plan has more than one channel, the gateway samples the noise on each of them
+// during an idle gap in its listening, at most once per survey period, and keeps a noise
+// floor for each.  Slots are assigned round-robin only among the channels whose floor is
+// within the margin of the quietest, so that sensors move off a channel that has become
+// noisy when the gateway next assigns slots and tells them in its ACKs and broadcasts.  The
+// home channel itself never moves, because a sensor that missed the news could no longer
+// pair or reach the gateway outside its slot.
+#define RADIO_NOISE_SURVEY_SECS     60
+#define RADIO_NOISE_MARGIN_DB       6
+#define RADIO_NOISE_SETTLE_MS       1
+
+// DUTY CYCLE
+// Sub-bands within which each transmitter may only be on the air for a fraction of the time,
+// as { lowest Hz, highest Hz, hundredths of a percent } of each transmission's center
+// frequency.  These are EU868's, per ERC Recommendation 70-03, and frequencies outside
+// every band aren't limited.  Our own airtime is charged to its band over a sliding window
+// that moves in steps of a bucket.  A transmission that would exceed the allowance isn't
+// sent, the gateway asks a sensor to hold off while it couldn't afford to answer another
+// exchange, and the gateway stretches its modulus for the next period when it has used
+// more than the target percentage of its allowance, shrinking it again as use falls.
+#define RADIO_DUTY_CYCLE            true
+#define RADIO_DUTY_BANDS            { { 863000000, 865000000, 10 }, { 865000000, 868000000, 100 }, \
+                                      { 868000000, 868600000, 100 }, { 868700000, 869200000, 10 }, \
+                                      { 869400000, 869650000, 1000 }, { 869700000, 870000000, 100 } }
+#define RADIO_DUTY_WINDOW_SECS      (60*60)
+#define RADIO_DUTY_BUCKETS          12
+#define RADIO_DUTY_TARGET_PERCENT   80
+#define RADIO_DUTY_STRETCH_MAX      800             // Longest modulus, as a percentage of the usual
+
 // RSSI
 // The Received Signal Strength Indication is the received signal power in milliwatts
 // and is measured in dBm. This value can be used as a measurement of how well
@@ -49,8 +88,16 @@
 #define ATP_ENABLED     true
 #define RBO_INITIAL     (RBO_MIN+(((RBO_MAX)-(RBO_MIN))/3))
 
-// (DETERMINATIVE OF MESSAGE_MAX_BODY)
-// This defines how long we wait for a radio.Send() to succeed.
+// Record the gateway's view of the last ATP_SIM_PACKETS packets that ATP sent, or lost, so
+// that the 'atpsim' console command can replay them through alternative ATP parameters and
+// score each on the energy radiated and the packets lost.  Traces recorded elsewhere may
+// be loaded with 'atp+'.  When false, nothing is recorded.
+#define ATP_SIM_ON      false
+#define ATP_SIM_PACKETS 256
+
+// This defines how long we wait for a radio.Send() to succeed.  With LoRa it is the time on air
+// of a full-size message at the spreading factor in use plus this margin, and with FSK it is fixed.
+#define TX_TIMEOUT_MARGIN_MS                        500
 #define TX_TIMEOUT_VALUE                            4000
 
 // (DETERMINATIVE OF MESSAGE_MAX_BODY)
@@ -69,9 +116,47 @@
 #define LORA_SYMBOL_TIMEOUT                         5         // Symbols
 #define LORA_FIX_LENGTH_PAYLOAD_ON                  false
 #define LORA_IQ_INVERSION_ON                        false
+#define LORA_CAD_DET_MIN                            10        // Minimum symbol recognition for CAD
+
+// When the signal is strong in both directions, the gateway may tell the sensor to finish
+// a solicited exchange at a lower spreading factor so that it occupies less airtime.  The
+// first message of every exchange is always sent at LORA_SPREADING_FACTOR.
+#define LORA_ADAPTIVE_SF                            true
+#define LORA_ADAPTIVE_SF_MINIMUM                    7         // Lowest SF that may be chosen
+#define LORA_ADAPTIVE_SF_MARGIN_DB                  8         // Required SNR above demodulation floor
+
+// When the signal is stronger still and the exchange is a bulk transfer, the gateway may
+// instead tell the sensor to finish it using FSK, which carries a full-size message in a
+// small fraction of its time on air at SF7.  FSK has none of LoRa's processing gain, so
+// this requires a strong signal in both directions.  An exchange that fails in FSK is
+// retried as a new exchange, which always begins at LORA_SPREADING_FACTOR.
+#define LORA_ADAPTIVE_FSK                           true
+#define LORA_ADAPTIVE_FSK_MIN_RSSI                  -90       // dBm, in both directions
+#define LORA_ADAPTIVE_FSK_MIN_SNR                   5         // dB, in both directions
+
+// The gateway also chooses the coding rate for the remainder of an exchange, from how often
+// frames from the sensor arrive garbled.  A link with bursty interference is worth the extra
+// symbols of 4/7 or 4/8, while a clean one stays at LORA_CODINGRATE.  A rate is only chosen
+// if a full-size message still fits within MESSAGE_MAX_AIRTIME_MS at the spreading factor in
+// use.  The radio derives low-data-rate optimization from the SF and bandwidth on both ends,
+// so it needs no signalling of its own.
+#define LORA_ADAPTIVE_CR                            true
+#define LORA_ADAPTIVE_CR_PERCENT_46                 5         // Garbled frames that warrant 4/6
+#define LORA_ADAPTIVE_CR_PERCENT_47                 12        // ... 4/7
+#define LORA_ADAPTIVE_CR_PERCENT_48                 25        // ... 4/8
 
 #elif (( USE_MODEM_LORA == 0 ) && ( USE_MODEM_FSK == 1 ))
 
+#define LORA_ADAPTIVE_FSK                           false
+#define LORA_ADAPTIVE_CR                            false
+
+#else
+
+#error "Please define a modem in the compiler subghz_phy_app.h."
+
+#endif /* USE_MODEM_LORA | USE_MODEM_FSK */
+
+// FSK parameters, used either as the only modem or for the remainder of a bulk exchange
 #define FSK_FDEV                                    25000     // Hz
 #define FSK_DATARATE                                50000     // bps
 #define FSK_BANDWIDTH                               50000     // Hz
@@ -79,18 +164,60 @@
 #define FSK_PREAMBLE_LENGTH                         5         // Same for Tx and Rx
 #define FSK_FIX_LENGTH_PAYLOAD_ON                   false
 
-#else
+// An exchange is a bulk transfer if a response has been requested, because responses include
+// firmware blocks and env, or if at least this many bytes of the request remain to be sent
+#define LORA_ADAPTIVE_FSK_MIN_BYTES                 (MESSAGE_MAX_BODY*2)
+#define RADIO_SF_FSK                                1         // In the ACK's SpreadingFactor, switch to FSK
 
-#error "Please define a modem in the compiler subghz_phy_app.h."
+// Receive timeouts for solicited messages are the time on air of a full-size message at the
+// spreading factor in use, plus the time to wake the radio and the turnaround allowance, plus
+// a margin for whatever the peer must do before it can reply.
+#define SOLICITED_COMMS_RX_MARGIN_MS                2000    // Peer replies as soon as it has decrypted and looked up state
+#define WINDOW_CHUNK_RX_MARGIN_MS                   500     // Sensor sends the next chunk of a window back-to-back
+#define SOLICITED_PROCESSING_RX_MARGIN_MS           5000    // Gateway performs the request against the Notecard
+#define UNSOLICITED_RX_TIMEOUT_VALUE                300000
 
-#endif /* USE_MODEM_LORA | USE_MODEM_FSK */
+// The sensor's wait for an ACK adapts to the round trip measured on its link as TCP's does, being
+// the time on air of a full-size frame plus the smoothed excess of past waits over their ACKs'
+// time on air plus four times its variation.  It never exceeds the fixed timeout above, and it
+// doubles after each ACK that fails to arrive, up to a limit, until a wait is measured again.
+#define SENSOR_RTT_MIN_MARGIN_MS                    250
+#define SENSOR_RTT_BACKOFF_MAX                      3
 
-#define SOLICITED_COMMS_RX_TIMEOUT_VALUE            8000
-#define SOLICITED_PROCESSING_RX_TIMEOUT_VALUE       8000
-#define UNSOLICITED_RX_TIMEOUT_VALUE                300000
+// A retried request goes out at a random moment within its slot, drawn from a range that
+// doubles with each retry, so that sensors whose requests collided don't collide again
+#define SENSOR_RETRY_BACKOFF_MS                     1000
+
+// The gateway's receiver runs continuously, and frames that arrive while it is busy with the
+// previous one are queued to be processed in turn.  A frame queued for longer than its sender
+// waits for a reply is discarded, because answering it would only waste airtime.
+#define RADIO_RX_QUEUE_FRAMES                       4
+#define RADIO_RX_QUEUE_MAX_AGE_MS                   SOLICITED_COMMS_RX_MARGIN_MS
+
+// The gateway's 'capture' console command traces each received frame as the 'rx+' and 'rx'
+// console commands that replay it, so a captured log fed back to a bench gateway's console
+// re-injects the same frames at their original spacing.  Replayed frames are held in a
+// small queue so that the pace of the console doesn't disturb their timing.
+#define RADIO_REPLAY_FRAMES                         4
+#define RADIO_REPLAY_LINE_BYTES                     32
+
+// When the gateway's final ACK says how long it expects to take to respond, the sensor sleeps
+// through that time and then listens only within a guard of when the response is due.  The
+// guard is twice the jitter measured between expected and actual arrival, but at least the
+// minimum, and the sensor doesn't bother to sleep for less than the minimum sleep.
+#define SENSOR_RESPONSE_GUARD_MIN_MS                250
+#define SENSOR_RESPONSE_SLEEP_MIN_MS                500
 #define TCXO_WORKAROUND_TIME_MARGIN                 50      // 50ms margin
 
-// Pairing beacon automatic repeat period
+// Between exchanges a sensor's radio sleeps with its configuration retained, which costs a
+// fraction of a microamp more than a cold sleep but lets it transmit as soon as it wakes,
+// rather than after the radio has been initialized, configured, and calibrated again
+#define RADIO_WARM_SLEEP                            true
+
+// Pairing beacons are repeated after the minimum period, which doubles with each beacon
+// up to the maximum, plus up to a quarter of the period of random jitter so that sensors
+// powered up together don't keep colliding
+#define PAIRING_BEACON_MIN_SECS                     5
 #define PAIRING_BEACON_SECS                         60
 
 // Amount of time that the sensor will allow itself to stay in pairing mode before
@@ -105,25 +232,40 @@
 
 // Message structure definitions
 #define MESSAGE_VERSION             1
+#define MESSAGE_VERSION_SHORT       2           // Short-header frame between a sensor and its gateway
+#define MESSAGE_VERSION_COMPACT_ACK 3           // Compact ACK, authenticated under this version, which isn't sent
+#define MESSAGE_VERSION_GROUP_ACK   4           // Compact ACKs to several sensors at once
 #define MESSAGE_ALG_CLEAR           0           // Cleartext
 #define MESSAGE_ALG_CTR             1           // AES CTR mode, 4 byte padding
+#define MESSAGE_ALG_CCM             2           // AES CCM mode, short-header frames only
+#define MESSAGE_ALG_RELAYED         0x40        // In Algorithm, set on a frame repeated by a relay
+#define MESSAGE_CCM_COUNTER_BYTES   4           // Sender's frame counter, part of the nonce
+#define MESSAGE_CCM_TAG_BYTES       4           // Truncated authentication tag
 #define AES_KEY_LENGTH              256         // bits
 #define AES_KEY_BYTES               (AES_KEY_LENGTH/8)
 #define AES_PAD_BYTES               4
 
-// Note that calculating this number is a process of trial and error.  You must
-// use TRANSMIT_SIZE_TEST below until you calculate the value correctly.  The max
-// LoRa message size depends upon the radio parameters (timeout, bandwidth, etc)
-// the size of our message header overhead.  The #defines here will enable you
-// to repeatedly press the button on the test sensor to send messages of decreasing
-// length.  If you start too high, the radio.Send() will fail with the error
-// "can't transmit to gateway: request aborted".
-// Once you see a transmit succeed, you've discovered the right number below.
-// (Note that this does not affect the ability to send long requests and response.
-// Rather, this just says that you will be able to be guaranteed that a
-// MESSAGE_MAX_BODY request or response will fit into a single packet rather
-// than using multiple packets.
-#define MESSAGE_MAX_BODY        170      // TIMEOUT:4000 BW:250 SPREAD:12 CODING:4/5 w/LDRO
+// The largest chunk of a request or response that a packet can carry, which is what fills
+// the 254-byte LoRa packet along with its header.  (Note that this does not affect the
+// ability to send long requests and responses, which are sent in multiple packets.)
+#define MESSAGE_MAX_BODY        200
+
+// The chunk size actually used is the largest, up to MESSAGE_MAX_BODY, whose message is
+// on air for no longer than this at the spreading factor in use, so that fast links fill
+// the packet while slow links stay within the TX timeout and any regional dwell limit.
+// Because the transmit timeout, receive timeouts and slot lengths are all derived from
+// the time on air of a message of that size, the chunk sizes and times on air at each
+// spreading factor are displayed at startup.  Sensors and gateways must agree on it,
+// because chunk offsets within a window are multiples of the chunk size.
+#define MESSAGE_MAX_AIRTIME_MS  4050     // 171 bytes at BW:250 SPREAD:12 CODING:4/5 w/LDRO
+#define MESSAGE_MIN_CHUNK       16       // Used even if it exceeds the airtime limit
+
+// The number of request chunks that a sensor may transmit back-to-back before it
+// waits for the gateway's ACK.  The gateway only ACKs the final chunk of each window,
+// and that ACK contains a selective-ACK bitmap so that only lost chunks are resent.
+// Setting this to 1 reverts to stop-and-wait behavior.  Because the bitmap is 32 bits,
+// values above 33 have no additional effect.
+#define MESSAGE_WINDOW_CHUNKS   4
 
 // For transmit size testing - see below.  Note that high-level packet length
 // guidance is found here:
@@ -140,6 +282,12 @@
 #define MESSAGE_FLAG_ACK        0x01    // This is an ACK message
 #define MESSAGE_FLAG_BEACON     0x02    // This is a BEACON message
 #define MESSAGE_FLAG_RESPONSE   0x04    // We require a response to this request
+#define MESSAGE_FLAG_WINDOW     0x08    // More chunks of this window follow, so don't ACK this one
+#define MESSAGE_FLAG_GATEWAY    0x10    // Cleartext announcement from a gateway to its neighbors
+#define MESSAGE_FLAG_WAKEUP     0x20    // Gateway asking a sniffing sensor to check in
+#define MESSAGE_FLAG_BROADCAST  0x40    // Gateway's broadcast to all of its sensors
+#define MESSAGE_FLAG_KEY        0x80    // Sensor asking for the gateway's broadcast key
+#define MESSAGE_FLAG_EXTENDED   0x20    // In a sensor's frame only, taking the extended ACK
 #define MESSAGE_SIGNATURE       0xADAD
 typedef struct __attribute__((__packed__))
 {
@@ -171,7 +319,90 @@ typedef struct __attribute__((__packed__))
 }
 wireMessageCarrier;
 
-// Body of a gateway ACK message (LITTLE-ENDIAN on the wire)
+// The carrier of a short-header frame (MESSAGE_VERSION_SHORT), whose length is that of the
+// packet.  The carrier is followed by the sender's frame counter, then by the message
+// encrypted with AES CCM, and finally by the truncated tag authenticating both the message
+// and everything in cleartext before it.  Because the tag is checked before the message is
+// used, there's no Signature; the message begins with the Flags, a bitmap of the optional
+// fields present, and Len.  These are followed by the RequestID, the Offset if nonzero and
+// the TotalLen if it isn't Offset+Len, all as varints, then by whichever of Millivolts, RSSI,
+// SNR, TXP and LTP are present in that order, and finally by the Body.  MESSAGE_FIELD_DELTA
+// marks an ACK whose body is a gatewayAckDeltaBody, and in a sensor's frame says that it holds
+// a full ACK's fields against which the gateway may send one.
+#define MESSAGE_SHORT_FROM_GATEWAY  0x80    // In Algorithm, set on frames sent by the gateway
+#define MESSAGE_FIELD_MILLIVOLTS    0x01
+#define MESSAGE_FIELD_RSSI          0x02
+#define MESSAGE_FIELD_SNR           0x04
+#define MESSAGE_FIELD_TXP           0x08
+#define MESSAGE_FIELD_LTP           0x10
+#define MESSAGE_FIELD_OFFSET        0x20
+#define MESSAGE_FIELD_TOTALLEN      0x40
+#define MESSAGE_FIELD_DELTA         0x80
+#define MESSAGE_FIELDS_TELEMETRY    0x1F
+#define MESSAGE_FIELDS_ALL          0x7F
+typedef struct __attribute__((__packed__))
+{
+    uint8_t Version;                // MESSAGE_VERSION_SHORT
+    uint8_t Algorithm;              // Always MESSAGE_ALG_CCM, plus MESSAGE_SHORT_FROM_GATEWAY
+    uint16_t Network;               // Low 16 bits of utilHashAddress() of the gateway's address
+    uint16_t PeerID;                // Sensor's ID, as assigned by the gateway in its ACK
+    uint8_t Message[];
+}
+wireShortCarrier;
+
+// A compact ACK, which the gateway sends in place of a full ACK to a short-header chunk that is
+// neither the first nor the last of its request, because all that the sensor needs to hear then
+// is which chunks arrived.  Both ends know this from the chunk itself, so the compact ACK is
+// sent in LoRa implicit-header mode with a length fixed in advance, saving the PHY header as
+// well as the full ACK's body.  It is sealed with AES CCM just as a short-header frame from the
+// gateway is, its cleartext being authenticated as if preceded by MESSAGE_VERSION_COMPACT_ACK.
+#define RADIO_COMPACT_ACK           true
+typedef struct __attribute__((__packed__))
+{
+    uint32_t RequestID;
+    uint32_t AckedLen;              // As in gatewayAckBody
+    uint32_t SackBitmap;
+}
+wireCompactAckBody;
+typedef struct __attribute__((__packed__))
+{
+    uint16_t Network;               // As in wireShortCarrier
+    uint16_t PeerID;
+    uint8_t Counter[MESSAGE_CCM_COUNTER_BYTES];
+    uint8_t Body[sizeof(wireCompactAckBody)];   // Encrypted
+    uint8_t Tag[MESSAGE_CCM_TAG_BYTES];
+}
+wireCompactAck;
+
+// A group ACK, which the gateway sends in place of the selective ACKs owed to several sensors
+// whose windows it was hearing at once, so that the turnaround and airtime of an ACK is paid
+// once for all of them.  Each sensor finds among the entries the compact ACK sealed to it, and
+// because the number of entries varies, the frame is sent with an explicit header.
+#define RADIO_GROUP_ACK             true
+#define GROUP_ACK_MAX_ENTRIES       4
+typedef struct __attribute__((__packed__))
+{
+    uint8_t Version;                // MESSAGE_VERSION_GROUP_ACK
+    uint8_t Count;                  // Number of entries
+    wireCompactAck Entry[];
+}
+wireGroupAck;
+
+// Body of a gateway ACK message (LITTLE-ENDIAN on the wire) to a sensor that marks its frames
+// with MESSAGE_FLAG_EXTENDED.  That flag's bit is MESSAGE_FLAG_WAKEUP's, which only a gateway
+// sends, so a gateway on older firmware ignores it and sends the legacy ACK as it always has,
+// and a sensor never sees it as anything but a wakeup.  The ACK's fields begin as those of
+// gatewayAckLegacyBody do, and the Format that follows them in place of the legacy Name is
+// what tells the sensor which ACK it has, since no name begins with a byte that can't appear
+// in UTF-8.  When the sensor asks for it in an encrypted frame, the gateway's broadcast key
+// follows the null-terminated Name.  A beacon ACK, which is sent in cleartext, never carries it.
+// An AckedLen telling the sensor that the gateway had no room for its request, which it
+// begins again after the RetryAfterSecs of the ACK
+#define GATEWAY_ACK_BUSY            0xFFFFFFFF
+
+// The Format of the extended ACK
+#define GATEWAY_ACK_EXTENDED        0xFF
+
 typedef struct __attribute__((__packed__))
 {
     uint32_t TWModulusSecs;         // Transmit Window modulus of Time that defines slots
@@ -184,18 +415,247 @@ typedef struct __attribute__((__packed__))
     uint32_t Time;                  // Unix epoch secs
     int16_t ZoneOffsetMins;
     uint8_t ZoneName[3];
+    uint8_t Format;                 // GATEWAY_ACK_EXTENDED
+    uint32_t AckedLen;              // Contiguous bytes of the request received by gateway, or GATEWAY_ACK_BUSY
+    uint32_t SackBitmap;            // Bit N set if chunk N+1 beyond AckedLen was also received
+    uint8_t SpreadingFactor;        // SF for the rest of this exchange, or 0 for the default
+    uint8_t CodingRate;             // Coding rate for the rest of this exchange, or 0 for the default
+    uint32_t ImageCRC;              // CRC-32 of the image offered to sensors, or 0 if none
+    uint32_t ImageLen;              // Length of the image offered to sensors
+    uint8_t Channel;                // Channel in the plan on which to transmit within the slot
+    uint16_t ResponseDelayMs;       // Expected time from this final ACK to the response, or 0 if unknown
+    uint16_t PeerID;                // Sensor's ID for short-header frames, or 0 if it has none
+    uint16_t RetryAfterSecs;        // Time the sensor should hold back its next request, or 0
+    uint8_t TWUrgentPeriodSecs;     // Period at whose start each urgent window opens, or 0 if none
+    uint8_t TWUrgentSecs;           // Length of each urgent window
+    uint16_t TimeMs;                // Milliseconds past Time at which this frame began transmitting
+    uint16_t ResponseLen;           // Length of the response following the name and any key, or 0
+    uint16_t ConfigVersion;         // Hash of the fields that a delta ACK omits, never 0
+    uint16_t SettingsVersion;       // Version of the sensor's settings in the config DB, or 0 if none
+    uint8_t RelayAddress[ADDRESS_LEN];  // Sensor through which to reach the gateway, or all zeros
     char Name[SENSOR_NAME_MAX];     // Must be at end, and always null-terminated
 }
 gatewayAckBody;
 
+// Body of the ACK of older firmware, which acknowledges just the chunk that it follows.  The
+// gateway sends it to a sensor whose frames aren't marked with MESSAGE_FLAG_EXTENDED, and
+// never sets MESSAGE_FLAG_EXTENDED on its own frames.
+typedef struct __attribute__((__packed__))
+{
+    uint32_t TWModulusSecs;
+    uint16_t TWModulusOffsetSecs;
+    uint16_t TWSlotBeginsSecs;
+    uint16_t TWSlotEndsSecs;
+    uint16_t TWListenBeforeTalkMs;
+    uint32_t LastProcessedRequestID;
+    uint32_t BootTime;
+    uint32_t Time;
+    int16_t ZoneOffsetMins;
+    uint8_t ZoneName[3];
+    char Name[SENSOR_NAME_MAX];     // Must be at end, and always null-terminated
+}
+gatewayAckLegacyBody;
+
+// Body of a delta ACK, which the gateway sends in place of a full ACK in a short-header frame
+// once the sensor holds the full ACK of the same ConfigVersion, because the schedule, zone,
+// boot time, image, name and ID rarely change.  The sensor keeps those from the full ACK, and
+// takes the rest from this, which is followed by the broadcast key and response as the name
+// is in a full ACK.  A sensor that finds that its version differs stops marking its frames
+// with MESSAGE_FIELD_DELTA, so that its next ACK is full.
+#define RADIO_DELTA_ACK             true
+typedef struct __attribute__((__packed__))
+{
+    uint16_t ConfigVersion;         // As in gatewayAckBody
+    uint32_t AckedLen;
+    uint32_t SackBitmap;
+    uint32_t Time;
+    uint16_t TimeMs;
+    uint8_t SpreadingFactor;
+    uint8_t CodingRate;
+    uint16_t ResponseDelayMs;
+    uint16_t RetryAfterSecs;
+    uint16_t ResponseLen;
+}
+gatewayAckDeltaBody;
+
+// Body of a gateway's announcement to other gateways on the same channel, sent in cleartext
+// and addressed to the gateway itself so that no peer mistakes it for a message to process.
+typedef struct __attribute__((__packed__))
+{
+    uint32_t TWModulusSecs;         // Transmit Window modulus in use by this gateway
+    uint16_t TWModulusOffsetSecs;   // Offset of this gateway's slots within the modulus
+    uint16_t SlotUnits;             // Minimum-length slots that this gateway has assigned
+}
+gatewayAnnounceBody;
+
+// Body of a gateway's broadcast to all of its sensors, encrypted with the gateway's broadcast
+// key and sent with the wakeup preamble so that sniffing sensors hear it.  It carries the
+// fleet-wide fields of the ACK, followed by the slots of as many sensors as fit.  A sensor not
+// listed keeps its slot within the new modulus until its next ACK.
+typedef struct __attribute__((__packed__))
+{
+    uint32_t AddressHash;           // utilHashAddress() of the sensor's address
+    uint16_t TWSlotBeginsSecs;      // Start of the sensor's transmit window
+    uint16_t TWSlotEndsSecs;        // End of the sensor's transmit window
+    uint8_t Channel;                // Channel on which to transmit within the slot
+}
+gatewayBroadcastSlot;
+#define GATEWAY_BROADCAST_SLOTS         15
+typedef struct __attribute__((__packed__))
+{
+    uint32_t TWModulusSecs;         // Transmit Window modulus of Time that defines slots
+    uint16_t TWModulusOffsetSecs;   // Offset to skew this gateway from others
+    uint16_t TWListenBeforeTalkMs;  // Granularity of LBT timer
+    uint32_t BootTime;              // Unix epoch secs
+    uint32_t Time;                  // Unix epoch secs, which must advance from one broadcast to the next
+    uint16_t TimeMs;                // Milliseconds past Time at which this frame's payload began
+    int16_t ZoneOffsetMins;
+    uint8_t ZoneName[3];
+    uint32_t ImageCRC;              // CRC-32 of the image offered to sensors, or 0 if none
+    uint32_t ImageLen;              // Length of the image offered to sensors
+    gatewayBroadcastSlot Slots[GATEWAY_BROADCAST_SLOTS];    // Must be at end, truncated to those in use
+}
+gatewayBroadcastBody;
+
+// A gateway broadcasts when it boots and whenever it re-assigns slots, but no more often than
+// this.  Broadcasts are only sent when sensors are sniffing (RADIO_SNIFF_PERIOD_MS).
+#define GATEWAY_BROADCAST_MIN_SECS      (60*5)
+
+// Gateways sharing a channel announce themselves this often (plus jitter), and a neighbor
+// not heard for a while is forgotten.  When neighbors are known, all of them share one
+// modulus and each takes a contiguous run of slots, ordered by gateway address.  When
+// pairing, a gateway defers its beacon ACK for each neighbor using fewer slots than it.
+#define GATEWAY_NEIGHBORS_MAX           8
+#define GATEWAY_ANNOUNCE_SECS           (60*10)
+#define GATEWAY_ANNOUNCE_JITTER_SECS    60
+#define GATEWAY_NEIGHBOR_SECS           (60*35)
+#define GATEWAY_PAIR_DEFER_MS           1000
+#define GATEWAY_PAIR_DEFER_MAX_MS       4000
+
+// When enabled, a gateway and its paired sensors exchange encrypted traffic using a LoRa sync
+// word derived from the gateway's address, so that the radio discards the frames of co-located
+// networks before they wake the MCU to fail decryption.  Cleartext frames, such as beacons and
+// gateway announcements, keep the common sync word, which both sides also listen on while
+// pairing.  Because a gateway then hears its neighbors' announcements only while pairing, this
+// is disabled by default for installations that rely on neighbors sharing the time windows.
+#define RADIO_NETWORK_SYNC_WORD         false
+#define RADIO_COMMON_SYNC_WORD          0x12
+
+// Between exchanges, a sensor may leave its radio in duty-cycled receive ("sniff") mode, waking
+// for a few symbols each period to look for a preamble.  A gateway that has something new for
+// its sensors, such as a changed env var, sends each of them a wakeup with a preamble spanning
+// a full period, and a woken sensor checks in within its next transmit window so that the ACK
+// brings it up to date.  This costs the sensor roughly RX_SYMBOLS symbols of receive current
+// per period, so it is disabled (0) by default; 2000ms is a reasonable value when enabled.
+// A sensor checks in at most once per SENSOR_WAKEUP_MIN_SECS however often it is woken.
+#define RADIO_SNIFF_PERIOD_MS           0
+#define RADIO_SNIFF_RX_SYMBOLS          4
+#define SENSOR_WAKEUP_MIN_SECS          60
+
+// A sensor that the gateway names a relay for (SENSOR_RELAY) addresses its full-header frames
+// to the relay, which repeats each to the gateway as soon as it's heard, with MESSAGE_ALG_RELAYED
+// set and followed by this trailer if it fits.  What the gateway sends to that sensor within
+// RELAY_PEER_SECS of the sensor's last frame is repeated back to it in the same way.  A gateway
+// holds up to GATEWAY_RELAYS_MAX designations, and accepts relayed frames only for those.
+typedef struct __attribute__((__packed__))
+{
+    int8_t RSSI;                    // Relay's view of the sensor's signal
+    int8_t SNR;
+}
+wireRelayTrailer;
+#define RELAY_PEERS_MAX                 4
+#define RELAY_PEER_SECS                 60
+#define GATEWAY_RELAYS_MAX              16
+
+// Sensor firmware update over LoRa (see dfulora.c).  A sensor requests the gateway's image
+// this many bytes at a time, one block per request, and checks for an offered image this often.
+// With each request it sends the CRCs of up to DFU_LORA_DELTA_BLOCKS of the blocks of its own
+// image that follow, so that the gateway sends only the first of those that differs.
+#define DFU_LORA_BLOCK_BYTES        1024
+#define DFU_LORA_CHECK_SECS         (60*15)
+#define DFU_LORA_DELTA_BLOCKS       8
+
+// Per-sensor settings (see settings.c).  A gateway holds the versions of the settings of up to
+// GATEWAY_SETTINGS_MAX sensors, and a sensor holds up to SENSOR_SETTINGS_MAX_BYTES of the JSON
+// text of its own, checking this often for a version that it failed to fetch.
+#define GATEWAY_SETTINGS_MAX        16
+#define SENSOR_SETTINGS_MAX_BYTES   256
+#define SENSOR_SETTINGS_CHECK_SECS  (60*15)
+
+// Pages of flash holding the peer table and its index, which with the default of 7 hold 143
+// peers, 15 hold 309, and 21 hold 426.  RAM use barely depends upon it, but each page is
+// taken from the two firmware images, and changing it moves the config area and so forgets
+// the peers that were paired.
+#define FLASH_PEER_PAGES    7
+
+// Bound on the peers that FLASH_PEER_PAGES can hold, each taking no less than a type, address,
+// name and key, which sizes the gateway's tables indexed by peer handle
+#define MAX_PEER_HANDLES    ((FLASH_PEER_PAGES*FLASH_PAGE_SIZE)/(sizeof(uint16_t)+ADDRESS_LEN+SENSOR_NAME_MAX+AES_KEY_BYTES))
+
 // Maximum number of cached sensors supported by a gateway, which determines
-// how many "transactions in flight" can be supported.
-#define MAX_CACHED_SENSORS  25
+// how many "transactions in flight" can be supported.  Each entry takes about 190
+// bytes of RAM1, so this is bounded by RAM rather than by the peers paired in flash;
+// beyond it, those heard least recently are evicted, preferring those whose stats
+// have already been written to sensors.db.  The linker script checks that the
+// result, together with the heap and stack, fits in RAM1.
+#define MAX_CACHED_SENSORS  48
+
+// Number of slots in the open-addressed hash index of the request cache, which
+// must be a power of two and should be at least twice MAX_CACHED_SENSORS.
+#define REQUEST_CACHE_HASH_SLOTS    128
 
 // Amount of time beyond which we no longer consider a sensor to be "active",
 // and thus we no longer reserve a time window slot for it.
 #define TW_ACTIVE_SECS              (60*60*24)      // one day
 #define TW_LBT_PERIOD_MS            1000            // Granularity of LBT period
+#define TW_LBT_USE_CAD              true            // Check for activity with CAD before a full LBT listen
+#define TW_LBT_RETRIES              10              // LBT listens before transmitting regardless
+#define TW_STARTUP_SPREAD_SECS      180             // Random spread of sensors' first windows after power failure
+#define TW_STARTUP_WINDOW_SECS      120             // Length of those windows
+#define TW_SLOT_LATE_SECS           1               // Lateness within which a slot is taken to begin now
+
+// The gateway stamps each ACK and broadcast with the millisecond at which it expects the frame
+// to begin transmitting, and the sensor takes that instant to be its receive-done timestamp
+// less the frame's time on air, so that sensors keep the gateway's time to within a few ms
+// rather than to the second.  The gateway's own clock is kept by the RTC, and is set from the
+// Notecard's time by housekeeping on a slow schedule, but only if the two have drifted apart
+// by more than the tolerance, so that its milliseconds don't jump with every check.
+#define TIME_SYNC_TX_LATENCY_MS     2               // Processing between the stamp and the radio
+#define TIME_SYNC_TOLERANCE_MS      1500
+#define TIME_SYNC_NOTECARD_SECS     (60*60)
+
+// A sensor learns the rate at which its clock drifts from the gateway's by comparing successive
+// synchronizations at least this far apart, and corrects both its time and its wakeups by it.
+// A rate beyond what any crystal would exhibit is taken to be an error and ignored.
+#define TIME_SYNC_DRIFT_MIN_SECS    (60*30)
+#define TIME_SYNC_DRIFT_MAX_PPM     200
+
+// At the start of every urgent period, relative to the modulus offset, the gateway listens on
+// the home channel whatever slot it's in, and sensors contend with LBT to send urgent requests
+// there rather than waiting for their own slots.  A period of 0 disables urgent windows.
+#define TW_URGENT_PERIOD_SECS       30
+#define TW_URGENT_SECS              3
+
+// Slots are sized by the airtime that each sensor's exchanges actually use, as measured over
+// successive periods.  Sensors whose use is light share a slot, relying upon LBT for the rare
+// occasion when they collide, while heavy users get a longer slot so that more of their queue
+// goes out within the window.  A sensor gets a slot of its own until it has been measured.
+#define TW_AIRTIME_PERIOD_SECS      (60*60)
+#define TW_AIRTIME_LIGHT_MS         2000            // Airtime per period below which a sensor shares a slot
+#define TW_AIRTIME_HEAVY_MS         20000           // Airtime per period that earns each additional slot
+#define TW_SLOT_SHARED_SENSORS      4               // Light sensors sharing a single slot
+#define TW_SLOT_MAX_UNITS           4               // Longest slot, in minimum-length slots
+
+// The gateway counts the receive errors, undecodable frames, resyncs and busy channels that
+// it runs into by where they fall within the modulus, averaged over successive periods.  When
+// a slot's trouble becomes chronic, that slot is left empty by the next slot assignment and
+// its sensors move to the slots that follow, unless the modulus is shared with neighbors.
+#define TW_HEAT_CHRONIC_EVENTS      8               // Average troubles per period that make a slot chronic
+#define TW_HEAT_AVOID_MAX           2               // Most slots left empty at a time
 
-// Whether or not to auto-reboot sensors when the gateway reboots
+// Whether or not to auto-reboot sensors when the gateway reboots.  When the sensor is set to
+// resynchronize instead, it keeps its ATP model, templates, apps and queued requests, and only
+// forgets the parts of its transmit window and request state that the gateway lost, so that a
+// gateway restart doesn't have every sensor boot, re-learn and spread itself out at once.
 #define REBOOT_SENSORS_WHEN_GATEWAY_REBOOTS true
+#define SENSOR_RESYNC_WHEN_GATEWAY_REBOOTS  true
@@ -8,6 +8,19 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// The role that the image plays.  By default one image serves both, deciding at boot by
+// whether a Notecard is present, but an image built for a single role leaves out the code
+// and the state of the other, and tests for the role compile to constants.  The Gateway
+// and Sensor build configurations select one with -DSPARROW_ROLE=...  A gateway built for
+// its role alone doesn't pass its image to sensors over LoRa (see dfulora.c), because
+// sensors that took it couldn't run as sensors.
+#define SPARROW_ROLE_ANY                                0
+#define SPARROW_ROLE_GATEWAY                            1
+#define SPARROW_ROLE_SENSOR                             2
+#ifndef SPARROW_ROLE
+#define SPARROW_ROLE                                    SPARROW_ROLE_ANY
+#endif
+
 // Enables trace output and input on an attached serial terminal.  Note that
 // if using LPUART1 this costs xxx nA, and using USART2 it's crazy expensive.
 // Do NOT ship battery powered products with this enabled.
@@ -17,36 +30,194 @@
 #define DEBUGGER_ON_USART2                              false
 #define DEBUGGER_ON_LPUART1                             true
 
+// LPUART1 is clocked from LSE, so its trace output can keep draining while the processor is
+// in STOP2.  Its FIFO is refilled by an interrupt that wakes the processor just long enough
+// to do so, and the trace is sent without waiting for it to complete.  When false, STOP2 is
+// held off for as long as trace output is being sent.
+#define DEBUGGER_LPUART1_STOP2                          true
+
 // Special GPIO trace methods when working on radio code
 #define DEBUGGER_RADIO_DBG_GPIO                         false
 
 // Disable entering STOP2 low-power mode (should never be necessary, even when debugging)
 #define LOW_POWER_DISABLE                               false
 
+// When idle, sleep rather than entering STOP2 if the next timer is due within this
+// many milliseconds, because restoring the clocks on exit would take longer than the wait
+#define LOW_POWER_STOP_MIN_MS                           3
+
+// Sleep through HAL_Delay() calls of at least this many milliseconds on an RTC alarm, in
+// STOP2 if it is otherwise allowed, rather than spinning on the clock
+#define LOW_POWER_DELAY_MIN_MS                          2
+
+// Longest that a sensor sleeps when no app, transmit window, or pending exchange needs it
+// sooner.  Every deadline sets its own wakeup, so this only bounds the sleep of a sensor
+// with nothing to do, and nothing in the firmware needs it to wake periodically.
+#define SENSOR_SLEEP_MAX_SECS                           (60*60*24)
+
+// Run the core from a 16Mhz MSI range at voltage scale 2 while waiting on the radio, I2C,
+// or timers, raising it to 48Mhz at scale 1 only around the gateway's processing of sensor
+// requests and around AES operations.  The UARTs and I2C are clocked from HSI16 so that
+// their timing doesn't depend upon the speed of the core.
+#define CLOCK_GOVERNOR                                  true
+
+// Move radio payloads of at least this many bytes to and from the SUBGHZ radio's buffer
+// by DMA, which keeps the SPI's FIFO full rather than waiting on each byte in turn.  The
+// core is boosted for the transfer so that the SPI runs at 12Mhz rather than 4Mhz.
+#define SUBGHZ_DMA                                      true
+#define SUBGHZ_DMA_MIN_BYTES                            16
+
+// Speed of the gateway's I2C bus to the Notecard in kHz: 100 (Standard-mode), 400
+// (Fast-mode), or 1000 (Fast-mode Plus, which also enables the pins' FM+ drive and which
+// should only be selected where the board's pull-ups and the Notecard support it)
+#define NOTECARD_I2C_KHZ                                400
+
+// The most that note-c moves to or from the Notecard in one I2C segment.  Each segment
+// carries a few bytes of header and an inter-segment turnaround, so larger segments spend
+// more of the bus on payload; it may not exceed the 255 that its length byte can express.
+#define NOTECARD_I2C_SEGMENT_BYTES                      127
+
+// Reference-counted peripherals (RNG, AES, I2C2) are left powered for this long after
+// their last user releases them, so that back-to-back users share a single init
+#define PERIPHERAL_IDLE_MS                              250
+
+// Random words drawn from the RNG in a single burst, and topped up in idle time whenever
+// fewer than half remain, so that drawing one is normally just a load
+#define RNG_POOL_WORDS                                  8
+
 // Normally, on sensors, the LEDs will shut off after some period of time after
 // boot in order to save energy.  Sometimes disabling this feature is useful
 // when debugging.  Obviously if in an enclosure where LEDs are not visible
 // this should be set to false.
 #define LEDS_ALWAYS                                     false
 
+// Enable the DWT cycle-counter profiler of named hot-path spans, which are displayed
+// with the 'prof' console command.  When false, the spans compile to nothing.
+#define PROFILER_ON                                     false
+
+// Enable the timeline of core, app, Notecard and low-power state changes, which is written
+// out in Chrome trace format with the 'timeline' console command.  When false, nothing is
+// recorded.
+#define TIMELINE_ON                                     false
+#define TIMELINE_EVENTS                                 128
+
+// Enable the timing of each hop from an external interrupt to its app's poll function, which
+// is displayed per app with the 'latency' console command.  When false, nothing is recorded.
+#define LATENCY_ON                                      false
+
+// Fixed-block pools for message, request, and Notecard I/O buffers.  Small blocks hold
+// note-c's JSON nodes and strings, medium blocks hold a message body or a Notecard I2C
+// segment, and large blocks hold a batch of sensor requests.  Larger requests, or those
+// made when a class is exhausted, come from the heap, of which as many as POOL_HEAP_TRACKED
+// at once are counted as in use.  See the 'pool' console command.  The blocks are static RAM
+// taken from what would otherwise be heap, and are held to POOL_STATIC_BYTES of it.
+#define POOL_SMALL_BYTES                                64
+#define POOL_SMALL_BLOCKS                               16
+#define POOL_MEDIUM_BYTES                               256
+#define POOL_MEDIUM_BLOCKS                              4
+#define POOL_LARGE_BYTES                                SENSOR_QUEUE_MAX_BATCH_BYTES
+#define POOL_LARGE_BLOCKS                               1
+#define POOL_HEAP_TRACKED                               16
+#define POOL_STATIC_BYTES                               3072
+
+// Arena from which the gateway serves every allocation made while it performs one sensor
+// request, releasing them together when it's done.  A request needing more overflows into
+// the pools above, which the 'pool' command counts, so this should cover the high water.
+#define POOL_ARENA_BYTES                                4096
+
 // Verbose level for all trace logs
 #define VERBOSE_LEVEL               VLEVEL_M
 
 // Enable trace logs
 #define APP_LOG_ENABLED             1
 
+// Defer the formatting of APP_PRINTF output to a low-priority task, queueing the format
+// and its raw arguments (with %s arguments copied) so that logging on the radio and
+// scheduler paths doesn't run printf inline.  Lines are dropped, and counted, when the
+// ring is full.
+#define LOG_DEFERRED                0
+#define LOG_DEFERRED_RECORDS        24
+#define LOG_DEFERRED_ARGS           8
+#define LOG_DEFERRED_STRING_BYTES   48
+
 // Trace methods (which are designed this way so they don't require the large printf library)
 size_t trace(const char *message);
 char *tracePeer(void);
 #define DEBUG_VARIABLE(X) ((void)(X))
+
+// Console commands, registered as tables that are searched in the order registered.  A
+// command is matched by name or alias, or with TRACE_CMD_ARGS by "<name> <args>".  Handlers
+// run in the console's own low-priority task, and one that has more to do returns true to
+// be called again, with the same arguments, the next time that task runs.
+#define TRACE_CMD_ARGS              0x01
+#define TRACE_CMD_GATEWAY           0x02
+#define TRACE_CMD_TABLES            4
+typedef bool (*traceCmdFn)(char *args);
+typedef struct {
+    const char *name;
+    const char *alias;
+    uint8_t flags;
+    traceCmdFn fn;
+} traceCmd;
+
 #if DEBUGGER_ON
 void traceClearID(void);
 void traceSetID(const char *state, const uint8_t *address, uint32_t requestID);
 void traceInput(void);
 bool traceInputAvailable(void);
+bool traceCmdRegister(const traceCmd *cmds, uint32_t count);
 #else
 #define traceClearID(void)
 #define traceSetID(state, address, requestID)
 #define traceInput(void)
 #define traceInputAvailable(void) false
+#define traceCmdRegister(cmds, count) ((void)(cmds), false)
 #endif
+
+// Fixed-field trace events, which are written straight into the trace FIFO without printf,
+// as "<peer> <event> name:value ...".  Each subsystem has its own verbosity, which along
+// with the global VERBOSE_LEVEL is tested before any arguments are evaluated.
+typedef enum {
+    TRACE_APP,
+    TRACE_RADIO,
+    TRACE_ATP,
+    TRACE_SCHED,
+    TRACE_TW,
+    TRACE_GATEWAY,
+    TRACE_FLASH,
+    TRACE_SUBSYSTEMS
+} traceSubsystem;
+#define TRACE_SUBSYSTEM_LEVEL       VLEVEL_H
+
+// The most verbose level of each subsystem's traces that is built at all.  Traces above
+// it compile to nothing, format strings included, whatever the runtime level.  VLEVEL_H
+// builds in the state machine's transitions and the sensor's time-window arithmetic, and
+// VLEVEL_OFF leaves a subsystem silent but for its errors.
+#define TRACE_BUILD_LEVEL_APP       VLEVEL_M
+#define TRACE_BUILD_LEVEL_RADIO     VLEVEL_M
+#define TRACE_BUILD_LEVEL_ATP       VLEVEL_M
+#define TRACE_BUILD_LEVEL_SCHED     VLEVEL_M
+#define TRACE_BUILD_LEVEL_TW        VLEVEL_M
+#define TRACE_BUILD_LEVEL_GATEWAY   VLEVEL_M
+#define TRACE_BUILD_LEVEL_FLASH     VLEVEL_M
+#define TRACE_BUILD_LEVEL(sys) (                                \
+    (sys) == TRACE_APP ? TRACE_BUILD_LEVEL_APP :                \
+    (sys) == TRACE_RADIO ? TRACE_BUILD_LEVEL_RADIO :            \
+    (sys) == TRACE_ATP ? TRACE_BUILD_LEVEL_ATP :                \
+    (sys) == TRACE_SCHED ? TRACE_BUILD_LEVEL_SCHED :            \
+    (sys) == TRACE_TW ? TRACE_BUILD_LEVEL_TW :                  \
+    (sys) == TRACE_GATEWAY ? TRACE_BUILD_LEVEL_GATEWAY :        \
+    TRACE_BUILD_LEVEL_FLASH)
+typedef struct {
+    const char *name;
+    int32_t value;
+} traceField;
+extern uint8_t traceLevel[TRACE_SUBSYSTEMS];
+#define TRACE_ON(sys, level) ((level) <= TRACE_BUILD_LEVEL(sys) && (level) <= traceLevel[sys])
+#define TRACE_EVENT(sys, level, event, ...) do { if (TRACE_ON(sys, level)) { \
+    const traceField _fields[] = { __VA_ARGS__ }; \
+    traceEvent(level, event, _fields, sizeof(_fields)/sizeof(_fields[0])); } } while (0)
+void traceEvent(uint32_t level, const char *event, const traceField *fields, uint32_t fieldCount);
+
+// Formatted traces belonging to a subsystem, tested just as trace events are
+#define TRACE_PRINTF(sys, level, ...) do { if (TRACE_ON(sys, level)) { APP_PRINTF(__VA_ARGS__); } } while (0)
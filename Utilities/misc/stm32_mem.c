@@ -22,6 +22,14 @@
 #include "stm32_mem.h"
    
 /* Private typedef -----------------------------------------------------------*/
+/* Words and halfwords through which byte buffers may be accessed */
+#if defined(__GNUC__)
+typedef uint32_t __attribute__((__may_alias__)) UTIL_MEM_word_t;
+typedef uint16_t __attribute__((__may_alias__)) UTIL_MEM_half_t;
+#else
+typedef uint32_t UTIL_MEM_word_t;
+typedef uint16_t UTIL_MEM_half_t;
+#endif
 /* Private defines -----------------------------------------------------------*/
 /* Private macros ------------------------------------------------------------*/
 /* Private variables ---------------------------------------------------------*/
@@ -34,6 +42,52 @@ void UTIL_MEM_cpy_8( void *dst, const void *src, uint16_t size )
   uint8_t* dst8= (uint8_t *) dst;
   uint8_t* src8= (uint8_t *) src;
 
+  /* When the buffers are equally aligned, move whole words or halfwords once aligned */
+  if( ( ( ( (uintptr_t) dst8 ^ (uintptr_t) src8 ) & 3U ) == 0U ) && ( size >= 8U ) )
+  {
+    while( ( (uintptr_t) dst8 & 3U ) != 0U )
+    {
+      *dst8++ = *src8++;
+      size--;
+    }
+    UTIL_MEM_word_t* dst32= (UTIL_MEM_word_t *) dst8;
+    const UTIL_MEM_word_t* src32= (const UTIL_MEM_word_t *) src8;
+    while( size >= 16U )
+    {
+      dst32[0] = src32[0];
+      dst32[1] = src32[1];
+      dst32[2] = src32[2];
+      dst32[3] = src32[3];
+      dst32 += 4;
+      src32 += 4;
+      size -= 16U;
+    }
+    while( size >= 4U )
+    {
+      *dst32++ = *src32++;
+      size -= 4U;
+    }
+    dst8 = (uint8_t *) dst32;
+    src8 = (uint8_t *) src32;
+  }
+  else if( ( ( ( (uintptr_t) dst8 ^ (uintptr_t) src8 ) & 1U ) == 0U ) && ( size >= 4U ) )
+  {
+    if( ( (uintptr_t) dst8 & 1U ) != 0U )
+    {
+      *dst8++ = *src8++;
+      size--;
+    }
+    UTIL_MEM_half_t* dst16= (UTIL_MEM_half_t *) dst8;
+    const UTIL_MEM_half_t* src16= (const UTIL_MEM_half_t *) src8;
+    while( size >= 2U )
+    {
+      *dst16++ = *src16++;
+      size -= 2U;
+    }
+    dst8 = (uint8_t *) dst16;
+    src8 = (uint8_t *) src16;
+  }
+
   while( size-- )
     {
         *dst8++ = *src8++;
@@ -55,11 +109,38 @@ void UTIL_MEM_cpyr_8( void *dst, const void *src, uint16_t size )
 void UTIL_MEM_set_8( void *dst, uint8_t value, uint16_t size )
 {
   uint8_t* dst8= (uint8_t *) dst;
+
+  /* Once aligned, store whole words of the value */
+  if( size >= 8U )
+  {
+    while( ( (uintptr_t) dst8 & 3U ) != 0U )
+    {
+      *dst8++ = value;
+      size--;
+    }
+    UTIL_MEM_word_t word = (UTIL_MEM_word_t) value * 0x01010101U;
+    UTIL_MEM_word_t* dst32= (UTIL_MEM_word_t *) dst8;
+    while( size >= 16U )
+    {
+      dst32[0] = word;
+      dst32[1] = word;
+      dst32[2] = word;
+      dst32[3] = word;
+      dst32 += 4;
+      size -= 16U;
+    }
+    while( size >= 4U )
+    {
+      *dst32++ = word;
+      size -= 4U;
+    }
+    dst8 = (uint8_t *) dst32;
+  }
+
   while( size-- )
   {
     *dst8++ = value;
   }
 }
 
-
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
@@ -75,6 +75,12 @@
 static char *lower_digits = "0123456789abcdefghijklmnopqrstuvwxyz";
 static char *upper_digits = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 
+/* Decimal digit pairs, so that a number costs one division for every two digits */
+static const char digit_pairs[200] =
+  "00010203040506070809" "10111213141516171819" "20212223242526272829" "30313233343536373839"
+  "40414243444546474849" "50515253545556575859" "60616263646566676869" "70717273747576777879"
+  "80818283848586878889" "90919293949596979899";
+
 /* Functions Definition ------------------------------------------------------*/
 #ifdef TINY_PRINTF
 #else
@@ -149,15 +155,42 @@ static char *ee_number(char *str, int max_size, long num, int base, int size, in
   
   i = 0;
 
-  if (num == 0)
-    tmp[i++] = '0';
-  else
+  unsigned long n = (unsigned long) num;
+  if (base == 10)
   {
-    while (num != 0)
+    /* Two digits per division, from the table of pairs */
+    while (n >= 100)
+    {
+      unsigned long q = n / 100;
+      unsigned int r = (unsigned int) (n - (q * 100)) * 2;
+      tmp[i++] = digit_pairs[r + 1];
+      tmp[i++] = digit_pairs[r];
+      n = q;
+    }
+    if (n >= 10)
     {
-      tmp[i++] = dig[((unsigned long) num) % (unsigned) base];
-      num = ((unsigned long) num) / (unsigned) base;
+      tmp[i++] = digit_pairs[(n * 2) + 1];
+      tmp[i++] = digit_pairs[n * 2];
     }
+    else
+      tmp[i++] = dig[n];
+  }
+  else if (base == 16)
+  {
+    /* A digit per nibble, without dividing */
+    do
+    {
+      tmp[i++] = dig[n & 0x0F];
+      n >>= 4;
+    } while (n != 0);
+  }
+  else
+  {
+    do
+    {
+      tmp[i++] = dig[n % (unsigned) base];
+      n = n / (unsigned) base;
+    } while (n != 0);
   }
 
   if (i > precision) precision = i;
@@ -488,7 +521,10 @@ int tiny_vsnprintf_like(char *buf, const int size, const char *fmt, va_list args
   int base;
   char *str;
   int len;
+#ifdef TINY_PRINTF
+#else
   int i;
+#endif
   char *s;
   
   int flags;            // Flags to number()
@@ -508,7 +544,17 @@ int tiny_vsnprintf_like(char *buf, const int size, const char *fmt, va_list args
     
     if (*fmt != '%')
     {
+#ifdef TINY_PRINTF
+      /* Copy the run of literal chars up to the next conversion in one pass */
+      char *end = buf + (size - 1);
+      do
+      {
+        *str++ = *fmt++;
+      } while (*fmt && *fmt != '%' && str < end);
+      fmt--;
+#else
       *str++ = *fmt;
+#endif
       continue;
     }
                   
@@ -606,15 +652,20 @@ repeat:
         s = va_arg(args, char *);
         if (!s) s = "<NULL>";
 #ifdef TINY_PRINTF
-        len = strlen(s);
+        /* Pad and copy up to the end of the buffer, rather than checking it for each char */
+        {
+          char *end = buf + (size - 1);
+          char *copy_end;
+          len = strlen(s);
+          while (len < field_width-- && str < end) *str++ = ' ';
+          if (len > (end - str)) len = end - str;
+          for (copy_end = str + len; str < copy_end; ) *str++ = *s++;
+        }
 #else
         len = strnlen(s, precision);
         if (!(flags & LEFT))
-#endif
           while (len < field_width--) *str++ = ' ';
         for (i = 0; i < len; ++i) *str++ = *s++;
-#ifdef TINY_PRINTF
-#else        
         while (len < field_width--) *str++ = ' ';
 #endif
         continue;
@@ -671,12 +722,12 @@ repeat:
 
       default:
         if (*fmt != '%') *str++ = '%';
-        CHECK_STR_SIZE(buf, str, size);
-        if (*fmt)
-          *str++ = *fmt;
-        else
+        /* A full buffer is caught at the top of the loop: breaking here would fall through
+           to the number conversion */
+        if (!*fmt)
           --fmt;
-        CHECK_STR_SIZE(buf, str, size);
+        else if ((str - buf) < (size - 1))
+          *str++ = *fmt;
         continue;
     }
 
@@ -136,6 +136,7 @@ UTIL_TIMER_Status_t UTIL_TIMER_Create( UTIL_TIMER_Object_t *TimerObject, uint32_
     TimerObject->IsPending = 0U;
     TimerObject->IsRunning = 0U;
     TimerObject->IsReloadStopped = 0U;
+    TimerObject->IsQueued = 0U;
     TimerObject->Callback = Callback;
     TimerObject->argument = Argument;
     TimerObject->Mode = Mode;
@@ -228,11 +229,12 @@ UTIL_TIMER_Status_t UTIL_TIMER_Stop( UTIL_TIMER_Object_t *TimerObject )
     UTIL_TIMER_Object_t* prev = TimerListHead;
     UTIL_TIMER_Object_t* cur = TimerListHead;
     TimerObject->IsReloadStopped = 1U;
+    TimerObject->IsRunning = 0U;
     
     /* List is empty or the Obj to stop does not exist  */
-    if(NULL != TimerListHead)
+    if((NULL != TimerListHead) && (TimerObject->IsQueued != 0U))
     {
-      TimerObject->IsRunning = 0U;
+      TimerObject->IsQueued = 0U;
       
       if( TimerListHead == TimerObject ) /* Stop the Head */
       {
@@ -401,6 +403,7 @@ void UTIL_TIMER_IRQ_Handler( void )
       TimerListHead = TimerListHead->Next;
       cur->IsPending = 0;
       cur->IsRunning = 0;
+      cur->IsQueued = 0;
       cur->Callback(cur->argument);
       if(( cur->Mode == UTIL_TIMER_PERIODIC) && (cur->IsReloadStopped == 0U))
       {
@@ -444,22 +447,15 @@ UTIL_TIMER_Time_t UTIL_TIMER_GetElapsedTime(UTIL_TIMER_Time_t past )
 /**
  * @brief Check if the Object to be added is not already in the list
  *
+ * @remark The list membership is tracked in the object itself, so that starting,
+ *         stopping, and re-arming a timer doesn't require walking the list.
+ *
  * @param TimerObject Structure containing the timer object parameters
  * @retval 1 (the object is already in the list) or 0
  */
 bool TimerExists( UTIL_TIMER_Object_t *TimerObject )
 {
-  UTIL_TIMER_Object_t* cur = TimerListHead;
-
-  while( cur != NULL )
-  {
-    if( cur == TimerObject )
-    {
-      return true;
-    }
-    cur = cur->Next;
-  }
-  return false;
+  return (TimerObject != NULL) && (TimerObject->IsQueued != 0U);
 }
 
 /**
@@ -504,12 +500,14 @@ void TimerInsertTimer( UTIL_TIMER_Object_t *TimerObject)
     {
         cur->Next = TimerObject;
         TimerObject->Next = next;
+        TimerObject->IsQueued = 1U;
         return;
 
     }
   }
   cur->Next = TimerObject;
   TimerObject->Next = NULL;
+  TimerObject->IsQueued = 1U;
 }
 
 /**
@@ -530,6 +528,7 @@ void TimerInsertNewHeadTimer( UTIL_TIMER_Object_t *TimerObject )
   }
 
   TimerObject->Next = cur;
+  TimerObject->IsQueued = 1U;
   TimerListHead = TimerObject;
   TimerSetTimeout( TimerListHead );
 }
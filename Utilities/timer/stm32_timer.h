@@ -93,6 +93,7 @@ typedef struct TimerEvent_s
     uint8_t IsPending;            /*!<Is the timer waiting for an event               */
     uint8_t IsRunning;            /*!<Is the timer running                            */
     uint8_t IsReloadStopped;      /*!<Is the reload stopped                           */
+    uint8_t IsQueued;             /*!<Is the timer linked into the timer list         */
     UTIL_TIMER_Mode_t Mode;       /*!<Timer type : one-shot/continuous                */
     void ( *Callback )( void *);  /*!<callback function                               */
     void *argument;               /*!<callback argument                               */